@@ -0,0 +1,229 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2008 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Inline builder for command APDUs, writes straight in to the transmit buffer
+ * of an xfr. Errors are sticky and only reported by apdu_finish(), which is
+ * also the only place the xfr is touched after apdu_init().
+*/
+#ifndef _APDU_H
+#define _APDU_H
+
+#include <string.h>
+
+#define APDU_MAX_NEST	4
+
+struct apdu {
+	xfr_t		a_xfr;
+	uint8_t		*a_buf;
+	uint8_t		*a_ptr;
+	uint8_t		*a_end;
+	uint8_t		*a_lc;
+	uint8_t		*a_tlv[APDU_MAX_NEST];
+	unsigned int	a_depth;
+	uint8_t		a_ext; /* extended length Lc and Le */
+	uint8_t		a_err;
+};
+
+static inline void apdu_byte(struct apdu *a, uint8_t b)
+{
+	if ( a->a_ptr >= a->a_end ) {
+		a->a_err = 1;
+		return;
+	}
+	*a->a_ptr++ = b;
+}
+
+static inline void apdu_buf(struct apdu *a, const uint8_t *ptr, size_t len)
+{
+	if ( !len )
+		return;
+	if ( len > (size_t)(a->a_end - a->a_ptr) ) {
+		a->a_err = 1;
+		return;
+	}
+	memcpy(a->a_ptr, ptr, len);
+	a->a_ptr += len;
+}
+
+/* Reset the xfr and start a command with its 4 byte header */
+static inline void apdu_init(struct apdu *a, xfr_t xfr, uint8_t cla,
+				uint8_t ins, uint8_t p1, uint8_t p2)
+{
+	size_t room;
+
+	xfr_reset(xfr);
+	a->a_xfr = xfr;
+	a->a_buf = a->a_ptr = xfr_tx_space(xfr, &room);
+	a->a_end = a->a_buf + room;
+	a->a_lc = NULL;
+	a->a_depth = 0;
+	a->a_ext = 0;
+	a->a_err = 0;
+
+	apdu_byte(a, cla);
+	apdu_byte(a, ins);
+	apdu_byte(a, p1);
+	apdu_byte(a, p2);
+}
+
+/* Use the extended length forms of Lc and Le, before apdu_data_begin() */
+static inline void apdu_extended(struct apdu *a)
+{
+	a->a_ext = 1;
+}
+
+/* Command data follows, Lc is filled in by apdu_data_end() or left out if
+ * there turns out to be no data.
+ */
+static inline void apdu_data_begin(struct apdu *a)
+{
+	a->a_lc = a->a_ptr;
+	apdu_byte(a, 0);
+	if ( a->a_ext ) {
+		apdu_byte(a, 0);
+		apdu_byte(a, 0);
+	}
+}
+
+static inline void apdu_data_end(struct apdu *a)
+{
+	size_t len;
+
+	if ( a->a_err || NULL == a->a_lc || a->a_depth ) {
+		a->a_err = 1;
+		return;
+	}
+
+	len = a->a_ptr - (a->a_lc + (a->a_ext ? 3 : 1));
+	if ( !len ) {
+		a->a_ptr = a->a_lc;
+		a->a_lc = NULL;
+		return;
+	}
+
+	if ( a->a_ext ) {
+		if ( len > 0xffff ) {
+			a->a_err = 1;
+			return;
+		}
+		a->a_lc[1] = len >> 8;
+		a->a_lc[2] = len & 0xff;
+	}else{
+		if ( len > 0xff ) {
+			a->a_err = 1;
+			return;
+		}
+		a->a_lc[0] = len;
+	}
+}
+
+/* Shorthand for a command whose data is a single buffer */
+static inline void apdu_data(struct apdu *a, const uint8_t *ptr, size_t len)
+{
+	apdu_data_begin(a);
+	apdu_buf(a, ptr, len);
+	apdu_data_end(a);
+}
+
+/* Expected response length, 256 (or 65536 if extended) is encoded as zero */
+static inline void apdu_le(struct apdu *a, size_t le)
+{
+	if ( a->a_ext ) {
+		if ( le > 0x10000 ) {
+			a->a_err = 1;
+			return;
+		}
+		if ( NULL == a->a_lc )
+			apdu_byte(a, 0);
+		apdu_byte(a, (le >> 8) & 0xff);
+		apdu_byte(a, le & 0xff);
+	}else{
+		if ( le > 0x100 ) {
+			a->a_err = 1;
+			return;
+		}
+		apdu_byte(a, le & 0xff);
+	}
+}
+
+/* Start a TLV in the command data, tags are packed as for struct ber_tag.
+ * Three bytes are set aside for the length, apdu_tlv_end() shrinks them to
+ * the shortest encoding.
+ */
+static inline void apdu_tlv_begin(struct apdu *a, uint32_t tag)
+{
+	if ( a->a_depth >= APDU_MAX_NEST ) {
+		a->a_err = 1;
+		return;
+	}
+
+	if ( tag > 0xffffff )
+		apdu_byte(a, tag >> 24);
+	if ( tag > 0xffff )
+		apdu_byte(a, (tag >> 16) & 0xff);
+	if ( tag > 0xff )
+		apdu_byte(a, (tag >> 8) & 0xff);
+	apdu_byte(a, tag & 0xff);
+
+	a->a_tlv[a->a_depth++] = a->a_ptr;
+	apdu_byte(a, 0);
+	apdu_byte(a, 0);
+	apdu_byte(a, 0);
+}
+
+static inline void apdu_tlv_end(struct apdu *a)
+{
+	uint8_t *lp, *val;
+	size_t len, hlen;
+
+	if ( a->a_err || !a->a_depth ) {
+		a->a_err = 1;
+		return;
+	}
+
+	lp = a->a_tlv[--a->a_depth];
+	val = lp + 3;
+	len = a->a_ptr - val;
+
+	if ( len < 0x80 ) {
+		lp[0] = len;
+		hlen = 1;
+	}else if ( len < 0x100 ) {
+		lp[0] = 0x81;
+		lp[1] = len;
+		hlen = 2;
+	}else if ( len < 0x10000 ) {
+		lp[0] = 0x82;
+		lp[1] = len >> 8;
+		lp[2] = len & 0xff;
+		hlen = 3;
+	}else{
+		a->a_err = 1;
+		return;
+	}
+
+	if ( hlen < 3 ) {
+		memmove(lp + hlen, val, len);
+		a->a_ptr -= 3 - hlen;
+	}
+}
+
+static inline void apdu_tlv(struct apdu *a, uint32_t tag,
+				const uint8_t *ptr, size_t len)
+{
+	apdu_tlv_begin(a, tag);
+	apdu_buf(a, ptr, len);
+	apdu_tlv_end(a);
+}
+
+/* Commit the command to the xfr, returns zero on error */
+static inline int apdu_finish(struct apdu *a)
+{
+	if ( a->a_err || a->a_depth )
+		return 0;
+	return xfr_tx_commit(a->a_xfr, a->a_ptr - a->a_buf);
+}
+
+#endif /* _APDU_H */
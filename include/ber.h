@@ -6,19 +6,65 @@
 #ifndef _BER_H
 #define _BER_H
 
+/* Tags are packed big-endian in to an integer, eg. 0x9f38 for the PDOL, and
+ * tables must be sorted in ascending order of tag.
+ */
 struct ber_tag {
-	const char *tag;
-	size_t tag_len;
+	uint32_t tag;
 	int(*op)(const uint8_t *ptr, size_t len, void *priv);
 };
 
 #define BER_NUM_TAGS(x) (sizeof(x)/sizeof(struct ber_tag))
 
+/* Called for tags which aren't in the table, return zero to stop decoding */
+typedef int (*ber_unknown_cb_t)(const uint8_t *tag, size_t tag_len,
+				const uint8_t *ptr, size_t len, void *priv);
+
 int ber_decode(const struct ber_tag *tags, unsigned int num_tags,
 		const uint8_t *ptr, size_t len, void *priv);
+int ber_decode_ex(const struct ber_tag *tags, unsigned int num_tags,
+		const uint8_t *ptr, size_t len,
+		ber_unknown_cb_t unknown, void *priv);
 size_t ber_tag_len(const uint8_t *ptr, const uint8_t *end);
 const uint8_t *ber_decode_tag(const uint8_t **ptr, const uint8_t *end,
 					size_t *tag_len);
 size_t ber_decode_len(const uint8_t **ptr, const uint8_t *end);
 
+/* Push parser for TLV data which arrives in pieces. Primitive values are
+ * passed to the value callback as they come in, possibly split across many
+ * calls. Any callback may be NULL, returning zero from one stops the parse.
+ */
+#define BER_STREAM_MAX_TAG	4
+#define BER_STREAM_MAX_DEPTH	8
+
+struct ber_stream_ops {
+	int (*tag_start)(void *priv, const uint8_t *tag, size_t tag_len,
+				size_t len, int constructed);
+	int (*value)(void *priv, const uint8_t *ptr, size_t len);
+	int (*tag_end)(void *priv, const uint8_t *tag, size_t tag_len);
+};
+
+struct ber_stream_frame {
+	uint8_t f_tag[BER_STREAM_MAX_TAG];
+	uint8_t f_tag_len;
+	size_t f_left;
+};
+
+struct ber_stream {
+	const struct ber_stream_ops *s_ops;
+	void *s_priv;
+	unsigned int s_state;
+	unsigned int s_depth;
+	uint8_t s_tag[BER_STREAM_MAX_TAG];
+	uint8_t s_tag_len;
+	uint8_t s_len_bytes;
+	size_t s_len;
+	struct ber_stream_frame s_stack[BER_STREAM_MAX_DEPTH];
+};
+
+void ber_stream_init(struct ber_stream *s, const struct ber_stream_ops *ops,
+			void *priv);
+int ber_stream_feed(struct ber_stream *s, const uint8_t *ptr, size_t len);
+int ber_stream_finish(struct ber_stream *s);
+
 #endif /* _BER_H */
@@ -9,6 +9,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <sys/uio.h>
 
 #include "compiler.h"
 
@@ -42,6 +43,10 @@
  * \defgroup g_cci Chip Card Interface
  * Represents a slot or RF field in a chip card device and chip card (if one is
  * present).
+ *
+ * \defgroup g_loop Event Loop
+ * Drives asynchronous transactions on many CCIDs from one thread, either
+ * from an external poll/epoll loop or with a built in poll(2) loop.
  */
 
 /** \ingroup g_ccid
@@ -59,6 +64,18 @@ typedef struct _cci *cci_t;
 */
 typedef struct _xfr *xfr_t;
 
+/** \ingroup g_cci
+ * Completion callback for asynchronous transactions.
+ *
+ * Called with ok set to zero if the transaction failed.
+*/
+typedef void (*cci_xfr_cb_t)(cci_t cci, xfr_t xfr, int ok, void *priv);
+
+/** \ingroup g_ccid
+ * Slot change callback, status is one of CHIPCARD_(PRESENT|NOT_PRESENT).
+*/
+typedef void (*ccid_slot_cb_t)(cci_t cci, unsigned int status, void *priv);
+
 /** \ingroup g_ccid
  * Physical Chip Card Interface Device.
  *
@@ -66,12 +83,32 @@ typedef struct _xfr *xfr_t;
 */
 typedef struct libusb_device *ccidev_t;
 
+/** \ingroup g_loop
+ * Event loop
+*/
+typedef struct _ccid_loop *ccid_loop_t;
+typedef void (*ccid_pollfd_added_t)(int fd, short events, void *priv);
+typedef void (*ccid_pollfd_removed_t)(int fd, void *priv);
+
 _public ccidev_t *libccid_get_device_list(size_t *nmemb);
 _public void libccid_free_device_list(ccidev_t *list);
 _public ccidev_t libccid_device_by_address(uint8_t bus, uint8_t addr);
 _public uint8_t libccid_device_bus(ccidev_t dev);
 _public uint8_t libccid_device_addr(ccidev_t dev);
 
+/** \ingroup g_libccid
+ * Hotplug notification registration.
+*/
+typedef struct _ccid_hotplug *ccid_hotplug_t;
+/** \ingroup g_libccid
+ * Hotplug callback, arrived is zero when the device has been removed.
+*/
+typedef void (*ccid_hotplug_cb_t)(ccidev_t dev, int arrived, void *priv);
+_public ccid_hotplug_t libccid_hotplug_register(ccid_hotplug_cb_t cb,
+						void *priv, int enumerate);
+_public void libccid_hotplug_deregister(ccid_hotplug_t hp);
+_public int libccid_cap_cache(const char *fn);
+
 #define CCID_ERROR_IN_VALUE		1
 #define CCID_ERROR_NO_MEM		2
 #define CCID_ERROR_DEVICE_REMOVED	3
@@ -82,8 +119,12 @@ _public uint8_t libccid_device_addr(ccidev_t dev);
 #define CCID_ERROR_CARD_TIMEOUT		8
 #define CCID_ERROR_AUTH			9
 #define CCID_ERROR_PIN_TIMEOUT		10 /* not implemented */
+#define CCID_ERROR_CANCELLED		11 /* by ccid_cancel() */
 
 _public ccid_t ccid_probe(ccidev_t dev, const char *tracefile);
+_public ccid_t ccid_probe_replay(const char *fn, const char *tracefile);
+_public size_t libccid_probe_all(ccidev_t *dev, size_t num,
+				const char * const *tracefile, ccid_t *ccid);
 _public unsigned int ccid_num_slots(ccid_t ccid);
 _public cci_t ccid_get_slot(ccid_t ccid, unsigned int i);
 _public unsigned int ccid_num_fields(ccid_t ccid);
@@ -93,14 +134,133 @@ _public void ccid_log(ccid_t ccid, const char *fmt, ...) _printf(2, 3);
 _public uint8_t ccid_bus(ccid_t ccid);
 _public uint8_t ccid_addr(ccid_t ccid);
 _public const char *ccid_name(ccid_t ccid);
+_public int ccid_flush(ccid_t ccid);
+_public int ccid_expire_idle(ccid_t ccid);
+_public int ccid_cancel(ccid_t ccid, unsigned int slot);
+_public int ccid_slot_notify(ccid_t ccid, ccid_slot_cb_t cb, void *priv);
+_public const uint8_t *ccid_escape(ccid_t ccid, unsigned int slot, xfr_t xfr,
+					size_t *rlen);
 
 _public unsigned int ccid_error(ccid_t ccid);
 
+/** \ingroup g_ccid
+ * Number of latency histogram buckets. Bucket n counts commands that took
+ * less than 2^n microseconds but no less than 2^(n-1), the last bucket also
+ * counts everything slower.
+*/
+#define CCID_STATS_BUCKETS	24
+/** \ingroup g_ccid
+ * Number of command types, indexed by bMessageType - CCID_STATS_CMD_BASE.
+*/
+#define CCID_STATS_CMDS		0x13
+#define CCID_STATS_CMD_BASE	0x61
+/** \ingroup g_ccid Number of error counters, indexed by CCID_ERROR_* code. */
+#define CCID_STATS_ERRORS	(CCID_ERROR_CANCELLED + 1)
+
+/** \ingroup g_ccid Latency counters for one CCID command type. */
+struct ccid_cmd_stats {
+	uint64_t	c_count;
+	uint64_t	c_total_usec;
+	uint64_t	c_max_usec;
+	uint64_t	c_hist[CCID_STATS_BUCKETS];
+};
+
+/** \ingroup g_ccid Counters returned by \ref ccid_stats. */
+struct ccid_stats {
+	struct ccid_cmd_stats	s_cmd[CCID_STATS_CMDS];
+	uint64_t		s_time_ext;
+	uint64_t		s_errors[CCID_STATS_ERRORS];
+	uint64_t		s_tx_bytes;
+	uint64_t		s_rx_bytes;
+};
+
+_public void ccid_stats(ccid_t ccid, struct ccid_stats *st);
+_public void ccid_stats_reset(ccid_t ccid);
+_public const char *ccid_stats_cmd_name(unsigned int idx);
+
+/** \ingroup g_ccid
+ * Card side of a simulated ISO 7816 command. Write the response, including
+ * the status word, to rsp and return its length, or zero to stay mute.
+*/
+typedef size_t (*ccid_sim_apdu_cb_t)(void *priv, const uint8_t *cmd,
+					size_t len, uint8_t *rsp, size_t max);
+
+/** \ingroup g_ccid
+ * An ISO 14443-A card for \ref ccid_probe_sim. Zero ATQA means pick one to
+ * suit the UID length. Cards with SAK bit 0x20 set speak T=CL, with the
+ * given ATS or a default one, and answer commands with t_apdu, or with as
+ * many bytes as Le asks for if that's NULL. t_wtx is the number of waiting
+ * time extensions asked for before each response. Cards with a t_mfc image
+ * of t_mfc_sectors sectors answer Mifare Classic commands, the image is
+ * used in place and must outlive the simulator.
+*/
+struct ccid_sim_tag {
+	uint8_t			t_uid[10];
+	size_t			t_uid_len;
+	uint8_t			t_atqa[2];
+	uint8_t			t_sak;
+	const uint8_t		*t_ats;
+	size_t			t_ats_len;
+	unsigned int		t_wtx;
+	uint8_t			*t_mfc;
+	unsigned int		t_mfc_sectors;
+	ccid_sim_apdu_cb_t	t_apdu;
+	void			*t_priv;
+};
+
+/** \ingroup g_ccid Counters returned by \ref ccid_sim_stats. */
+struct ccid_sim_stats {
+	uint64_t	s_escapes; /* round trips to the reader */
+	uint64_t	s_reg_read;
+	uint64_t	s_reg_write;
+	uint64_t	s_batch;
+	uint64_t	s_fifo_read;
+	uint64_t	s_fifo_write;
+	uint64_t	s_regs_read; /* including batched */
+	uint64_t	s_regs_written;
+	uint64_t	s_fifo_bytes;
+	uint64_t	s_frames; /* transmitted over the air */
+	uint64_t	s_collisions;
+	uint64_t	s_wtx;
+	uint64_t	s_chained; /* T=CL blocks with the chaining bit */
+	uint64_t	s_overflows; /* FIFO */
+	uint64_t	s_proto_err; /* driver broke the rules */
+};
+
+_public ccid_t ccid_probe_sim(const struct ccid_sim_tag *tags,
+				unsigned int num, const char *tracefile);
+_public int ccid_sim_present(ccid_t ccid, unsigned int tag, int present);
+_public int ccid_sim_stats(ccid_t ccid, struct ccid_sim_stats *st);
+_public int ccid_sim_stats_reset(ccid_t ccid);
+
+/* Event loop */
+_public ccid_loop_t libccid_loop_new(void);
+_public int libccid_loop_pollfds(ccid_loop_t loop, ccid_pollfd_added_t added,
+				ccid_pollfd_removed_t removed, void *priv);
+_public int libccid_loop_add(ccid_loop_t loop, ccid_t ccid);
+_public void libccid_loop_remove(ccid_loop_t loop, ccid_t ccid);
+_public int libccid_loop_timeout(ccid_loop_t loop);
+_public int libccid_loop_dispatch(ccid_loop_t loop);
+_public int libccid_loop_run(ccid_loop_t loop, int timeout);
+_public void libccid_loop_free(ccid_loop_t loop);
+
 /* Transact xfr buffers */
 _public xfr_t xfr_alloc(size_t txbuf, size_t rxbuf);
 _public void xfr_reset(xfr_t xfr);
 _public int xfr_tx_byte(xfr_t xfr, uint8_t byte);
 _public int xfr_tx_buf(xfr_t xfr, const uint8_t *ptr, size_t len);
+_public int xfr_tx_iov(xfr_t xfr, const struct iovec *iov, unsigned int iovcnt);
+_public uint8_t *xfr_tx_reserve(xfr_t xfr, size_t len);
+_public uint8_t *xfr_tx_space(xfr_t xfr, size_t *len);
+_public int xfr_tx_commit(xfr_t xfr, size_t len);
+
+/** \ingroup g_xfr
+ * Bytes which must precede caller provided buffers, see \ref xfr_tx_attach.
+*/
+#define XFR_HEADROOM	10
+_public int xfr_tx_attach(xfr_t xfr, uint8_t *buf, size_t len);
+_public int xfr_rx_attach(xfr_t xfr, uint8_t *buf, size_t len);
+_public void xfr_auto_response(xfr_t xfr, int enable);
 
 _public uint8_t xfr_rx_sw1(xfr_t xfr);
 _public uint8_t xfr_rx_sw2(xfr_t xfr);
@@ -113,7 +273,153 @@ _public ccid_t cci_ccid(cci_t cci);
 
 _public int cci_power_off(cci_t cci);
 _public int cci_transact(cci_t cci, xfr_t xfr);
+_public int cci_submit(cci_t cci, xfr_t xfr, cci_xfr_cb_t cb, void *priv);
+
+/** \ingroup g_cci
+ * One command of a \ref cci_transact_batch.
+ *
+ * The command is built in a_xfr beforehand and the response is left there.
+ * The status word is as expected if (SW1SW2 & a_sw_mask) == a_sw, so a zero
+ * mask accepts anything. a_ok is filled in by \ref cci_transact_batch.
+*/
+struct cci_apdu {
+	xfr_t		a_xfr;
+	uint16_t	a_sw;
+	uint16_t	a_sw_mask;
+	int		a_ok;
+};
+/** \ingroup g_cci
+ * Stop a \ref cci_transact_batch at the first unexpected status word.
+*/
+#define CCI_BATCH_STOP		(1U << 0)
+_public unsigned int cci_transact_batch(cci_t cci, struct cci_apdu *apdu,
+					unsigned int num, unsigned int flags);
+
+/** \ingroup g_cci
+ * Which part of the command \ref cci_scan steps through.
+*/
+#define CCI_SCAN_CLA		0
+#define CCI_SCAN_INS		1
+#define CCI_SCAN_P1P2		2
+/** \ingroup g_cci
+ * Two byte file ID as the command data, for SELECT.
+*/
+#define CCI_SCAN_FID		3
+
+/** \ingroup g_cci
+ * Command space scan parameters, for \ref cci_scan.
+ *
+ * Commands are s_hdr with the field s_field set to each value from s_first
+ * to s_last in turn, apart from those listed in s_skip. Le is left out if
+ * s_le is negative. s_path is a list of file IDs to SELECT before starting,
+ * and again after every command which selects something. Status words
+ * whose SW1 is set in the s_ignore bitmap aren't recorded.
+*/
+struct cci_scan {
+	uint8_t		s_hdr[4];
+	unsigned int	s_field;
+	unsigned int	s_first;
+	unsigned int	s_last;
+	int		s_le;
+	const uint16_t	*s_path;
+	unsigned int	s_npath;
+	const uint16_t	*s_skip;
+	unsigned int	s_nskip;
+	uint8_t		s_ignore[32];
+};
+
+/** \ingroup g_cci
+ * Most distinct status words recorded by \ref cci_scan.
+*/
+#define CCI_SCAN_BUCKETS	32
+/** \ingroup g_cci
+ * Most values recorded per status word by \ref cci_scan.
+*/
+#define CCI_SCAN_VALUES		100
+/** \ingroup g_cci
+ * Values which got one particular status word.
+*/
+struct cci_scan_bucket {
+	uint16_t	b_sw;
+	uint16_t	b_nval;
+	unsigned int	b_count;
+	uint16_t	b_val[CCI_SCAN_VALUES];
+};
+/** \ingroup g_cci
+ * Scan results. r_overflow counts responses which didn't fit in a bucket.
+*/
+struct cci_scan_result {
+	unsigned int		r_sent;
+	unsigned int		r_errors;
+	unsigned int		r_overflow;
+	unsigned int		r_nbuckets;
+	struct cci_scan_bucket	r_bucket[CCI_SCAN_BUCKETS];
+};
+_public int cci_scan(cci_t cci, const struct cci_scan *scan,
+			struct cci_scan_result *res);
+
+/** \ingroup g_cci
+ * Length of a GlobalPlatform secure channel C-MAC.
+*/
+#define CCI_GP_MAC_LEN		8
+/** \ingroup g_cci
+ * Let \ref cci_gp_load use extended length LOAD commands, if the card
+ * supports them and the interface can carry them.
+*/
+#define CCI_GP_EXTENDED		(1U << 0)
+/** \ingroup g_cci
+ * Compute the C-MAC of a command for \ref cci_gp_load.
+ *
+ * cmd is the command up to the end of its data, with the secure messaging
+ * bit set in CLA and Lc already counting the MAC. icv is the chaining value,
+ * which is the previous C-MAC. Returns zero on failure.
+*/
+typedef int (*cci_gp_mac_t)(void *priv, const uint8_t *icv,
+				const uint8_t *cmd, size_t len, uint8_t *mac);
+/** \ingroup g_cci
+ * Load parameters, for \ref cci_gp_load.
+ *
+ * l_file is an IJC file, or a CAP file with its components stored rather
+ * than compressed. l_pkg is the package AID and l_sd the security domain to
+ * load it in to, which may be empty. If l_applet is set then an instance of
+ * that applet is installed as l_inst, or as l_applet if l_inst is NULL, with
+ * privileges l_privs. l_block limits the LOAD block size, zero is as big as
+ * the interface allows. If l_mac is set every command carries a C-MAC, with
+ * l_icv as the chaining value for the first one.
+*/
+struct cci_gp_load {
+	const char	*l_file;
+	const uint8_t	*l_pkg;
+	size_t		l_pkg_len;
+	const uint8_t	*l_sd;
+	size_t		l_sd_len;
+	const uint8_t	*l_applet;
+	size_t		l_applet_len;
+	const uint8_t	*l_inst;
+	size_t		l_inst_len;
+	uint8_t		l_privs;
+	size_t		l_block;
+	unsigned int	l_flags;
+	cci_gp_mac_t	l_mac;
+	void		*l_priv;
+	uint8_t		l_icv[CCI_GP_MAC_LEN];
+};
+/** \ingroup g_cci
+ * Load results. r_block is the LOAD block size used and r_size the length
+ * of the load file data block. r_icv is the chaining value for the command
+ * after the load.
+*/
+struct cci_gp_result {
+	unsigned int	r_blocks;
+	size_t		r_block;
+	size_t		r_size;
+	uint16_t	r_sw;
+	uint8_t		r_icv[CCI_GP_MAC_LEN];
+};
+_public int cci_gp_load(cci_t cci, const struct cci_gp_load *load,
+			struct cci_gp_result *res);
 _public unsigned int cci_error(cci_t cci);
+_public const uint8_t *cci_atr(cci_t cci, size_t *atr_len);
 
 /* contact interfaces only */
 _public int cci_wait_for_card(cci_t cci);
@@ -173,10 +479,68 @@ _public unsigned int cci_clock_status(cci_t cci);
 #define CHIPCARD_1_8V		0x3
 _public const uint8_t *cci_power_on(cci_t cci, unsigned int voltage,
 				size_t *atr_len);
+_public void cci_set_pps(cci_t cci, int enable);
+_public const uint8_t *cci_warm_reset(cci_t cci, size_t *atr_len);
+_public void cci_set_idle_timeout(cci_t cci, unsigned int idle_ms);
+_public void cci_set_timeout(cci_t cci, unsigned int budget_ms);
+
+/* contactless interfaces only */
+_public int cci_rf_set_limits(cci_t cci, unsigned int max_kbps,
+				size_t max_fsd);
+_public int cci_rf_params(cci_t cci, unsigned int *kbps, size_t *fsd,
+				size_t *fsc);
+_public unsigned int cci_rf_poll(cci_t cci);
+_public const uint8_t *cci_rf_wait(cci_t cci, unsigned int interval_ms,
+				int timeout_ms, size_t *ats_len);
+/** \ingroup g_cci
+ * Receives each frame of a response from \ref cci_rf_transact_stream, return
+ * zero to abort the exchange.
+*/
+typedef int (*cci_rf_rx_cb_t)(void *priv, const uint8_t *buf, size_t len);
+_public int cci_rf_transact_stream(cci_t cci, const uint8_t *tx, size_t tx_len,
+				cci_rf_rx_cb_t cb, void *priv);
+struct ber_stream;
+_public int cci_rf_transact_ber(cci_t cci, const uint8_t *tx, size_t tx_len,
+				struct ber_stream *s, uint16_t *sw);
+
+/** \ingroup g_cci A contactless card found by \ref cci_rf_inventory. */
+struct cci_rf_tag {
+	uint8_t		t_uid[10];
+	uint8_t		t_uid_len;
+	uint8_t		t_atqa[2];
+	uint8_t		t_sak;
+};
+_public int cci_rf_inventory(cci_t cci, struct cci_rf_tag *tags,
+				unsigned int max, unsigned int *num);
+_public const uint8_t *cci_rf_activate(cci_t cci, const struct cci_rf_tag *tag,
+				size_t *ats_len);
+
+/** \ingroup g_cci Authenticate with Mifare Classic key A. */
+#define CCI_MFC_KEY_A		0x60
+/** \ingroup g_cci Authenticate with Mifare Classic key B. */
+#define CCI_MFC_KEY_B		0x61
+/** \ingroup g_cci Size of a Mifare Classic block. */
+#define CCI_MFC_BLOCK_SIZE	16
+/** \ingroup g_cci Number of sectors on the largest Mifare Classic card. */
+#define CCI_MFC_MAX_SECTORS	40
+/** \ingroup g_cci Key for one sector of a Mifare Classic card. */
+struct cci_mfc_key {
+	uint8_t		k_key[6];
+	uint8_t		k_type;
+};
+_public size_t cci_mfc_sectors_size(unsigned int sector, unsigned int num);
+_public int cci_mfc_read(cci_t cci, unsigned int sector, unsigned int num,
+				const struct cci_mfc_key *keys,
+				uint8_t *buf, size_t len, uint64_t *done);
+_public int cci_mfc_write(cci_t cci, unsigned int sector, unsigned int num,
+				const struct cci_mfc_key *keys,
+				const uint8_t *buf, size_t len, uint64_t *done);
 
 /* -- Utility functions */
 _public void hex_dump(const uint8_t *ptr, size_t len, size_t llen);
 _public void hex_dumpf(FILE *f, const uint8_t *ptr, size_t len, size_t llen);
+_public void hex_dumpf_indent(FILE *f, const uint8_t *ptr, size_t len,
+				size_t llen, unsigned int depth);
 _public void ber_dump(const uint8_t *ptr, size_t len, unsigned int depth);
 
 #endif /* _CCID_H */
@@ -32,6 +32,7 @@
 #define  EMV_ERR_BAD_PIN		0x09
 #define  EMV_ERR_BER_DECODE		0x0a
 #define  EMV_ERR_APP_NOT_SELECTED	0x0b
+#define  EMV_ERR_CERT_REVOKED		0x0c
 typedef uint32_t emv_err_t;
 
 typedef struct _emv *emv_t;
@@ -44,11 +45,28 @@ typedef const uint8_t *(*emv_mod_cb_t)(void *priv, unsigned int index,
 typedef const uint8_t *(*emv_exp_cb_t)(void *priv, unsigned int index,
 					size_t *len);
 typedef int (*emv_dol_cb_t)(uint16_t tag, uint8_t *ptr, size_t len, void *priv);
+typedef void (*emv_auth_cb_t)(emv_t e, int ok, void *priv);
 
 /* Setup/teardown */
 _public emv_t emv_init(cci_t cc);
+_public int emv_reset(emv_t e);
 _public void emv_fini(emv_t e);
 
+/* Memory held by an emv_t, for sizing long running processes */
+struct emv_alloc_stats {
+	uint64_t	a_slabs;	/* chunks obtained from malloc */
+	uint64_t	a_committed;	/* bytes in those chunks */
+	uint64_t	a_live;		/* allocations in use */
+	uint64_t	a_requested;	/* bytes in use */
+	uint64_t	a_peak;		/* high-water mark of a_requested */
+};
+struct emv_mem_stats {
+	struct emv_alloc_stats	m_data;  /* application nodes, process-wide */
+	struct emv_alloc_stats	m_files; /* decoded records and index */
+	struct emv_alloc_stats	m_auth;  /* idle authentication jobs */
+};
+_public void emv_mem_stats(emv_t e, struct emv_mem_stats *st);
+
 /* error handling */
 _public emv_err_t emv_error(emv_t e);
 _public unsigned int emv_error_type(emv_err_t e);
@@ -73,15 +91,24 @@ _public const char *emv_app_pname(emv_app_t a);
 _public uint8_t emv_app_prio(emv_app_t a);
 _public int emv_app_confirm(emv_app_t a);
 
+/* Application selection results by ATR and PSE, disabled by default */
+_public void emv_appsel_cache_size(unsigned int max);
+_public void emv_appsel_cache_flush(void);
+
 /* Application initiation */
 _public int emv_app_init(emv_t e);
 _public int emv_app_aip(emv_t e, emv_aip_t aip);
 
 /* Application data */
 _public int emv_read_app_data(emv_t e);
+_public int emv_read_app_data_lazy(emv_t e);
 _public emv_data_t emv_retrieve_data(emv_t e, uint16_t id);
 _public emv_data_t *emv_retrieve_records(emv_t e, unsigned int *nmemb);
 
+/* Snapshots of decoded application data, loaded ones have no card */
+_public int emv_db_save(emv_t e, const char *fn);
+_public emv_t emv_db_load(const char *fn);
+
 _public emv_data_t *emv_data_children(emv_data_t d, unsigned int *nmemb);
 _public const uint8_t *emv_data(emv_data_t d, size_t *len);
 _public int emv_data_int(emv_data_t d);
@@ -100,6 +127,57 @@ _public int emv_authenticate_dynamic(emv_t e, emv_mod_cb_t mod,
 					emv_exp_cb_t exp, void *priv);
 _public int emv_dda_ok(emv_t e);
 
+/* Asynchronous offline data authentication, card access is done before
+ * returning and the cryptography on a pool of worker threads. Callbacks are
+ * run from emv_auth_complete() on the calling thread.
+ */
+_public int emv_authenticate_static_data_async(emv_t e, emv_mod_cb_t mod,
+					emv_exp_cb_t exp, void *priv,
+					emv_auth_cb_t cb, void *cb_priv);
+_public int emv_authenticate_dynamic_async(emv_t e, emv_mod_cb_t mod,
+					emv_exp_cb_t exp, void *priv,
+					emv_auth_cb_t cb, void *cb_priv);
+_public unsigned int emv_auth_complete(emv_t e, int wait);
+
+/* Select, initiate, read and authenticate in one go */
+#define EMV_QUICK_SELECT	0
+#define EMV_QUICK_INIT		1
+#define EMV_QUICK_READ		2
+#define EMV_QUICK_AUTH		3
+#define EMV_QUICK_NR_STAGES	4
+struct emv_quick_aid {
+	const uint8_t	*a_aid;
+	size_t		a_len;
+};
+struct emv_quick {
+	const struct emv_quick_aid *q_aids; /* preferred, skips the PSE */
+	unsigned int	q_num_aids;
+	const uint16_t	*q_tags; /* wanted from the records */
+	unsigned int	q_num_tags;
+	emv_mod_cb_t	q_mod; /* NULL to skip SDA */
+	emv_exp_cb_t	q_exp;
+	void		*q_priv;
+};
+struct emv_quick_result {
+	uint64_t	r_usec[EMV_QUICK_NR_STAGES];
+	uint64_t	r_total;
+	unsigned int	r_stage; /* which failed, or EMV_QUICK_NR_STAGES */
+	unsigned int	r_records; /* read so far */
+	unsigned int	r_num_records; /* listed in the AFL */
+	unsigned int	r_missing; /* requested tags not on the card */
+	int		r_sda; /* -1 if not attempted */
+};
+_public int emv_quick_read(emv_t e, const struct emv_quick *q,
+				struct emv_quick_result *r);
+
+/* Drop all cached certification authority public keys */
+_public void emv_ca_flush(void);
+
+/* Verified issuer public keys, the cache is disabled by default */
+_public void emv_pk_cache_size(unsigned int max);
+_public int emv_pk_revoke(const emv_rid_t rid, unsigned int ca_idx,
+				const uint8_t *serial);
+
 /* Cardholder verification, only offline plaintext pin supported for now */
 _public int emv_cvm(emv_t e);
 _public int emv_cvm_pin(emv_t e, const char *pin);
@@ -113,6 +191,10 @@ _public int emv_trm_atc(emv_t e);
 _public uint8_t *emv_construct_dol(emv_dol_cb_t cbfn,
 					const uint8_t *ptr, size_t len,
 					size_t *ret_len, void *priv);
+_public int emv_construct_dol_buf(emv_dol_cb_t cbfn,
+					const uint8_t *ptr, size_t len,
+					uint8_t *buf, size_t *buf_len,
+					void *priv);
 
 _public const uint8_t *emv_generate_ac(emv_t e, uint8_t ref,
 					const uint8_t *tx, uint8_t len,
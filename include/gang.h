@@ -10,14 +10,39 @@
 #define GANG_DEFAULT_ALLOC	0x1000U
 #define GANG_POISON 		1
 #define GANG_POISON_PATTERN 	0xa5
+#define GANG_STATS		1
 
 typedef struct _gang *gang_t;
 
+/* Position in a gang, from gang_mark(), to be handed to gang_rewind() */
+struct gang_mark {
+	void *m_slab;
+	void *m_ptr;
+#if GANG_STATS
+	uint64_t m_live;
+	uint64_t m_requested;
+#endif
+};
+
+/* Counters from gang_stats(), all zero unless built with GANG_STATS */
+struct gang_stats {
+	uint64_t	s_slabs;
+	uint64_t	s_committed;
+	uint64_t	s_live;
+	uint64_t	s_requested;
+	uint64_t	s_peak;
+};
+
 _private gang_t gang_new(size_t alloc, size_t align);
 _private void *gang_alloc(gang_t g, size_t sz) _malloc;
 _private void *gang_alloc_a(gang_t g, size_t sz, size_t align) _malloc;
 _private void *gang_alloc0(gang_t g, size_t sz) _malloc;
 _private void *gang_alloc0_a(gang_t g, size_t sz, size_t align) _malloc;
+_private void gang_size_hint(gang_t g, size_t sz);
+_private void gang_mark(gang_t g, struct gang_mark *m);
+_private void gang_rewind(gang_t g, const struct gang_mark *m);
+_private void gang_reset(gang_t g);
 _private void gang_free(gang_t g);
+_private void gang_stats(gang_t g, struct gang_stats *st);
 
 #endif /* _GANG_HEADER_INCLUDED */
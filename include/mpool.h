@@ -10,11 +10,24 @@ typedef struct _mpool *mpool_t;
 
 #define MPOOL_POISON 		1
 #define MPOOL_POISON_PATTERN 	0x5a
+#define MPOOL_STATS		1
+
+/* Counters from mpool_stats(), all zero unless built with MPOOL_STATS */
+struct mpool_stats {
+	size_t		s_obj_size;
+	uint64_t	s_slabs;
+	uint64_t	s_committed;
+	uint64_t	s_live;
+	uint64_t	s_peak;
+};
 
 _private mpool_t mpool_new(size_t obj_size, unsigned slab_size);
+_private mpool_t mpool_new_shared(size_t obj_size, unsigned slab_size);
 _private void mpool_free(mpool_t m);
+_private void mpool_reset(mpool_t m);
 _private void * mpool_alloc(mpool_t m) _malloc;
 _private void *mpool_alloc0(mpool_t m) _malloc;
 _private void mpool_return(mpool_t m, void *obj);
+_private void mpool_stats(mpool_t m, struct mpool_stats *st);
 
 #endif /* _MPOOL_HEADER_INCLUDED_ */
@@ -8,10 +8,67 @@
 
 typedef struct _sim *sim_t;
 
+/* Called once per record by sim_read_records(), in record order, with ok
+ * set to zero if the record could not be read.
+ */
+typedef void (*sim_rec_cb_t)(sim_t sim, unsigned int rec, unsigned int nrec,
+				int ok, void *priv);
+
+/* SMS record status codes */
+#define SIM_SMS_STATUS_FREE	0
+#define SIM_SMS_STATUS_READ	1
+#define SIM_SMS_STATUS_UNREAD	3
+#define SIM_SMS_STATUS_SENT	5
+#define SIM_SMS_STATUS_UNSENT	7
+
+/* Longest address is 20 digits, alphanumeric ones can be 11 characters of
+ * up to 3 bytes each in UTF-8.
+ */
+#define SIM_SMS_ADDR_MAX	36
+/* 160 septets, each of which can be up to 3 bytes of UTF-8 */
+#define SIM_SMS_TEXT_MAX	484
+
+/* Decoded EF_SMS record. For SMS-DELIVER s_addr is the originator and
+ * s_time the service centre time stamp, for SMS-SUBMIT s_addr is the
+ * destination and s_time is unset. s_tz is in quarter hours east of GMT.
+ * s_ud is the user data, after any header, and s_text is only filled in
+ * for the default alphabet and UCS2. Messages which aren't part of a
+ * concatenated message have s_concat_total set to zero.
+ */
+struct sim_sms {
+	uint8_t		s_status;
+	uint8_t		s_mti;
+	uint8_t		s_smsc_type;
+	uint8_t		s_addr_type;
+	uint8_t		s_pid;
+	uint8_t		s_dcs;
+	uint8_t		s_udhi;
+	uint8_t		s_concat_total;
+	uint8_t		s_concat_seq;
+	uint16_t	s_concat_ref;
+	uint16_t	s_year;
+	uint8_t		s_mon, s_day, s_hour, s_min, s_sec;
+	int8_t		s_tz;
+	char		s_smsc[SIM_SMS_ADDR_MAX];
+	char		s_addr[SIM_SMS_ADDR_MAX];
+	const uint8_t	*s_ud;
+	size_t		s_ud_len;
+	size_t		s_text_len;
+	char		s_text[SIM_SMS_TEXT_MAX];
+};
+
 /* SIM session */
 _public sim_t sim_new(cci_t cc);
+_public unsigned int sim_read_records(sim_t sim, uint16_t df, uint16_t ef,
+				uint8_t *buf, size_t len,
+				size_t *reclen, unsigned int *nrec,
+				sim_rec_cb_t cb, void *priv);
 _public int sim_sms_save(sim_t sim, const char *fn);
 _public int sim_sms_restore(sim_t sim, const char *fn);
 _public void sim_free(sim_t sim);
 
+/* SMS PDUs */
+_public int sim_sms_decode(const uint8_t *rec, size_t len,
+				struct sim_sms *sms);
+
 #endif /* _GSM_H */
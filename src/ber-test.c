@@ -0,0 +1,441 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2008 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Regression test for the BER push parser, run by "make check". A known FCI
+ * is fed whole, a byte at a time and in random pieces, and each time must
+ * give the same events. It is then returned by a simulated T=CL card, in a
+ * chained response, through cci_rf_transact_ber(). Truncated and malformed
+ * encodings must be refused, by ber_decode() as well, and tags missing from
+ * the table must go to the unknown callback.
+*/
+
+#include <ccid.h>
+#include <ber.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FILLER_LEN	400
+#define LOG_MAX		512
+
+/* 6f { 84 a5 { 50 9f38 df01 } 87 }, lengths up to two bytes long */
+static uint8_t fci[448];
+static size_t fci_len;
+static uint8_t values[448];
+static size_t values_len;
+
+static const char * const fci_events =
+	"6f:432{ 84:7( )84 a5:417{ 50:4( )50 9f38:3( )9f38 "
+	"df01:400( )df01 }a5 87:0( )87 }6f ";
+
+static uint8_t *put_hdr(uint8_t *p, uint16_t tag, size_t len)
+{
+	if ( tag > 0xff )
+		*p++ = tag >> 8;
+	*p++ = tag & 0xff;
+
+	if ( len < 0x80 ) {
+		*p++ = len;
+	}else if ( len < 0x100 ) {
+		*p++ = 0x81;
+		*p++ = len;
+	}else{
+		*p++ = 0x82;
+		*p++ = len >> 8;
+		*p++ = len & 0xff;
+	}
+
+	return p;
+}
+
+static uint8_t *put_val(uint8_t *p, uint16_t tag, const uint8_t *val,
+			size_t len)
+{
+	p = put_hdr(p, tag, len);
+	memcpy(p, val, len);
+	memcpy(values + values_len, val, len);
+	values_len += len;
+	return p + len;
+}
+
+static void build_fci(void)
+{
+	static const uint8_t aid[] = {0xa0, 0x00, 0x00, 0x00, 0x03, 0x10, 0x10};
+	static const uint8_t pdol[] = {0x9f, 0x1a, 0x02};
+	uint8_t filler[FILLER_LEN], *p = fci;
+	unsigned int i;
+
+	for(i = 0; i < sizeof(filler); i++)
+		filler[i] = i * 7;
+
+	p = put_hdr(p, 0x6f, 9 + 4 + 417 + 2);
+	p = put_val(p, 0x84, aid, sizeof(aid));
+	p = put_hdr(p, 0xa5, 6 + 6 + 405);
+	p = put_val(p, 0x50, (const uint8_t *)"VISA", 4);
+	p = put_val(p, 0x9f38, pdol, sizeof(pdol));
+	p = put_val(p, 0xdf01, filler, sizeof(filler));
+	p = put_val(p, 0x87, filler, 0);
+	fci_len = p - fci;
+}
+
+struct events {
+	char		e_log[LOG_MAX];
+	size_t		e_len;
+	size_t		e_values;
+	int		e_bad;
+};
+
+static void log_tag(struct events *ev, const uint8_t *tag, size_t tag_len)
+{
+	size_t i;
+
+	for(i = 0; i < tag_len && ev->e_len + 3 < LOG_MAX; i++)
+		ev->e_len += sprintf(ev->e_log + ev->e_len, "%.2x", tag[i]);
+}
+
+static void log_str(struct events *ev, const char *str)
+{
+	size_t len = strlen(str);
+
+	if ( ev->e_len + len < LOG_MAX ) {
+		memcpy(ev->e_log + ev->e_len, str, len + 1);
+		ev->e_len += len;
+	}
+}
+
+static int ev_start(void *priv, const uint8_t *tag, size_t tag_len,
+			size_t len, int constructed)
+{
+	struct events *ev = priv;
+	char buf[32];
+
+	log_tag(ev, tag, tag_len);
+	snprintf(buf, sizeof(buf), ":%zu%c ", len, constructed ? '{' : '(');
+	log_str(ev, buf);
+	return 1;
+}
+
+/* Values must arrive in order, with nothing missing or repeated */
+static int ev_value(void *priv, const uint8_t *ptr, size_t len)
+{
+	struct events *ev = priv;
+
+	if ( ev->e_values + len > values_len ||
+			memcmp(values + ev->e_values, ptr, len) )
+		ev->e_bad = 1;
+	ev->e_values += len;
+	return 1;
+}
+
+static int ev_end(void *priv, const uint8_t *tag, size_t tag_len)
+{
+	struct events *ev = priv;
+
+	log_str(ev, (tag[0] & 0x20) ? "}" : ")");
+	log_tag(ev, tag, tag_len);
+	log_str(ev, " ");
+	return 1;
+}
+
+static const struct ber_stream_ops ev_ops = {
+	.tag_start = ev_start,
+	.value = ev_value,
+	.tag_end = ev_end,
+};
+
+static int check_events(const char *name, const struct events *ev)
+{
+	if ( !ev->e_bad && ev->e_values == values_len &&
+			!strcmp(ev->e_log, fci_events) )
+		return 1;
+
+	fprintf(stderr, "%s: got %s\n", name, ev->e_log);
+	return 0;
+}
+
+/* Feed the FCI in pieces of the sizes given by next() */
+static int feed_split(const char *name, size_t (*next)(size_t left))
+{
+	struct ber_stream s;
+	struct events ev;
+	size_t ofs, n;
+
+	memset(&ev, 0, sizeof(ev));
+	ber_stream_init(&s, &ev_ops, &ev);
+
+	for(ofs = 0; ofs < fci_len; ofs += n) {
+		n = (*next)(fci_len - ofs);
+		if ( !ber_stream_feed(&s, fci + ofs, n) ) {
+			fprintf(stderr, "%s: refused at %zu\n", name, ofs);
+			return 0;
+		}
+		if ( ofs + n < fci_len && ber_stream_finish(&s) ) {
+			fprintf(stderr, "%s: finished early\n", name);
+			return 0;
+		}
+	}
+
+	if ( !ber_stream_finish(&s) ) {
+		fprintf(stderr, "%s: not finished\n", name);
+		return 0;
+	}
+
+	return check_events(name, &ev);
+}
+
+static size_t next_all(size_t left)
+{
+	return left;
+}
+
+static size_t next_byte(size_t left)
+{
+	return 1;
+}
+
+static size_t next_random(size_t left)
+{
+	size_t n = 1 + rand() % 37;
+	return (n < left) ? n : left;
+}
+
+static int test_splits(void)
+{
+	unsigned int i;
+
+	if ( !feed_split("whole", next_all) )
+		return 0;
+	if ( !feed_split("bytes", next_byte) )
+		return 0;
+
+	srand(1);
+	for(i = 0; i < 100; i++) {
+		if ( !feed_split("random", next_random) )
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Every prefix of the FCI is accepted, but isn't a complete TLV */
+static int test_truncated(void)
+{
+	struct ber_stream s;
+	struct events ev;
+	size_t len;
+
+	for(len = 0; len < fci_len; len++) {
+		memset(&ev, 0, sizeof(ev));
+		ber_stream_init(&s, &ev_ops, &ev);
+		if ( !ber_stream_feed(&s, fci, len) ) {
+			fprintf(stderr, "truncated: refused %zu bytes\n", len);
+			return 0;
+		}
+		if ( len && ber_stream_finish(&s) ) {
+			fprintf(stderr, "truncated: finished at %zu\n", len);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static const struct {
+	const char	*name;
+	uint8_t		enc[20];
+	size_t		len;
+} bad[] = {
+	{"child longer than parent", {0x6f, 0x03, 0x84, 0x05, 0x00}, 5},
+	{"child header past parent", {0x6f, 0x01, 0x9f, 0x38}, 4},
+	{"indefinite length", {0x6f, 0x80, 0x00, 0x00}, 4},
+	{"5 byte length", {0x84, 0x85, 0x00, 0x00, 0x00, 0x00, 0x01}, 7},
+	{"5 byte tag", {0xdf, 0x81, 0x82, 0x83, 0x04, 0x00}, 6},
+	{"too deep", {0x61, 0x10, 0x61, 0x0e, 0x61, 0x0c, 0x61, 0x0a,
+			0x61, 0x08, 0x61, 0x06, 0x61, 0x04, 0x61, 0x02,
+			0x61, 0x00}, 18},
+};
+
+static int test_bad(void)
+{
+	struct ber_stream s;
+	struct events ev;
+	unsigned int i;
+	int ret = 1;
+
+	for(i = 0; i < sizeof(bad)/sizeof(*bad); i++) {
+		memset(&ev, 0, sizeof(ev));
+		ber_stream_init(&s, &ev_ops, &ev);
+		if ( ber_stream_feed(&s, bad[i].enc, bad[i].len) ) {
+			fprintf(stderr, "%s: accepted\n", bad[i].name);
+			ret = 0;
+		}
+	}
+
+	return ret;
+}
+
+static int count_known(const uint8_t *ptr, size_t len, void *priv)
+{
+	return 1;
+}
+
+/* The FCI's contents, but only 84 in the table, the rest are unknown */
+static const struct ber_tag known[] = {
+	{ .tag = 0x84, .op = count_known },
+};
+
+static int log_unknown(const uint8_t *tag, size_t tag_len,
+			const uint8_t *ptr, size_t len, void *priv)
+{
+	struct events *ev = priv;
+	char buf[32];
+
+	log_tag(ev, tag, tag_len);
+	snprintf(buf, sizeof(buf), ":%zu ", len);
+	log_str(ev, buf);
+	return 1;
+}
+
+static int stop_unknown(const uint8_t *tag, size_t tag_len,
+			const uint8_t *ptr, size_t len, void *priv)
+{
+	return 0;
+}
+
+static const struct {
+	const char	*name;
+	uint8_t		enc[8];
+	size_t		len;
+} bad_len[] = {
+	{"huge length", {0x84, 0x84, 0xff, 0xff, 0xff, 0xff, 0x00}, 7},
+	{"length past end", {0x84, 0x82, 0x00}, 3},
+	{"value past end", {0x84, 0x02, 0x00}, 3},
+};
+
+static int test_decode(void)
+{
+	const uint8_t *fcp = fci + 4;
+	size_t fcp_len = fci_len - 4;
+	struct events ev;
+	unsigned int i;
+	int ret = 1;
+
+	memset(&ev, 0, sizeof(ev));
+	if ( ber_decode_ex(known, BER_NUM_TAGS(known), fcp, fcp_len,
+				log_unknown, &ev) != 1 ||
+			strcmp(ev.e_log, "a5:417 87:0 ") ) {
+		fprintf(stderr, "unknown: got %s\n", ev.e_log);
+		ret = 0;
+	}
+
+	if ( ber_decode_ex(known, BER_NUM_TAGS(known), fcp, fcp_len,
+				stop_unknown, NULL) ) {
+		fprintf(stderr, "unknown: didn't stop\n");
+		ret = 0;
+	}
+
+	/* copied to exactly sized buffers so that over reads show up */
+	for(i = 0; i < sizeof(bad_len)/sizeof(*bad_len); i++) {
+		uint8_t *buf;
+
+		buf = malloc(bad_len[i].len);
+		if ( NULL == buf )
+			return 0;
+		memcpy(buf, bad_len[i].enc, bad_len[i].len);
+		if ( ber_decode(known, BER_NUM_TAGS(known),
+				buf, bad_len[i].len, NULL) ) {
+			fprintf(stderr, "%s: accepted\n", bad_len[i].name);
+			ret = 0;
+		}
+		free(buf);
+	}
+
+	return ret;
+}
+
+/* Card side, answers anything with the FCI */
+static size_t fci_apdu(void *priv, const uint8_t *cmd, size_t len,
+			uint8_t *rsp, size_t max)
+{
+	if ( fci_len + 2 > max )
+		return 0;
+	memcpy(rsp, fci, fci_len);
+	rsp[fci_len] = 0x90;
+	rsp[fci_len + 1] = 0x00;
+	return fci_len + 2;
+}
+
+/* The same events from a chained response, small frames to make many */
+static int test_tcl(void)
+{
+	static const uint8_t select[] = {0x00, 0xa4, 0x04, 0x00, 0x07,
+				0xa0, 0x00, 0x00, 0x00, 0x03, 0x10, 0x10, 0x00};
+	struct ccid_sim_stats st;
+	struct ccid_sim_tag tag;
+	struct ber_stream s;
+	struct events ev;
+	uint16_t sw = 0;
+	ccid_t ccid;
+	cci_t cci;
+	int ret = 0;
+
+	memset(&tag, 0, sizeof(tag));
+	memcpy(tag.t_uid, "\x08\x12\x34\x56", 4);
+	tag.t_uid_len = 4;
+	tag.t_sak = 0x20;
+	tag.t_apdu = fci_apdu;
+
+	ccid = ccid_probe_sim(&tag, 1, NULL);
+	if ( NULL == ccid )
+		return 0;
+
+	cci = ccid_get_field(ccid, 0);
+	if ( NULL == cci || !cci_rf_set_limits(cci, 0, 32) ||
+			NULL == cci_power_on(cci, 0, NULL) ) {
+		fprintf(stderr, "tcl: power on failed\n");
+		goto out;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ber_stream_init(&s, &ev_ops, &ev);
+	ccid_sim_stats_reset(ccid);
+	if ( !cci_rf_transact_ber(cci, select, sizeof(select), &s, &sw) ||
+			sw != 0x9000 ) {
+		fprintf(stderr, "tcl: transact failed, sw %.4x\n", sw);
+		goto out;
+	}
+
+	if ( !ccid_sim_stats(ccid, &st) || st.s_chained < 10 ) {
+		fprintf(stderr, "tcl: response wasn't chained\n");
+		goto out;
+	}
+
+	ret = check_events("tcl", &ev);
+	cci_power_off(cci);
+out:
+	ccid_close(ccid);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int ret = EXIT_SUCCESS;
+
+	build_fci();
+
+	if ( !test_splits() )
+		ret = EXIT_FAILURE;
+	if ( !test_truncated() )
+		ret = EXIT_FAILURE;
+	if ( !test_bad() )
+		ret = EXIT_FAILURE;
+	if ( !test_decode() )
+		ret = EXIT_FAILURE;
+	if ( !test_tcl() )
+		ret = EXIT_FAILURE;
+
+	return ret;
+}
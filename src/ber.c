@@ -2,44 +2,10 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <ctype.h>
 
+#include <ccid.h>
 #include <ber.h>
 
-static void hex_dump(const uint8_t *tmp, size_t len,
-			size_t llen, unsigned int depth)
-{
-	size_t i, j;
-	size_t line;
-
-	for(j = 0; j < len; j += line, tmp += line) {
-		if ( j + llen > len ) {
-			line = len - j;
-		}else{
-			line = llen;
-		}
-
-		printf("%*c%05zx : ", depth, ' ', j);
-
-		for(i = 0; i < line; i++) {
-			if ( isprint(tmp[i]) ) {
-				printf("%c", tmp[i]);
-			}else{
-				printf(".");
-			}
-		}
-
-		for(; i < llen; i++)
-			printf(" ");
-
-		for(i=0; i < line; i++)
-			printf(" %02x", tmp[i]);
-
-		printf("\n");
-	}
-	printf("\n");
-}
-
 #if 0
 static unsigned int ber_id_octet_class(const uint8_t cls)
 {
@@ -70,7 +36,8 @@ static unsigned int ber_len_short(const uint8_t cls)
 void ber_dump(const uint8_t *buf, size_t len, unsigned int depth)
 {
 	const uint8_t *end = buf + len;
-	uint32_t clen, num, i;
+	uint32_t num, i;
+	size_t clen;
 	uint8_t idb;
 #if 0
 	const char * const clsname[]={
@@ -90,11 +57,10 @@ again:
 
 	/* FIXME: if ( tag == 0x1f ) get rest of type... */
 	if ( num >= 0x1f ) {
-		for(num = 0, i = 0; buf < end; i++) {
+		for(num = 0; buf < end; ) {
 			num <<= 7;
 			num |= *buf & 0x7f;
-			buf++;
-			if ( !(*buf & 0x80) )
+			if ( !(*buf++ & 0x80) )
 				break;
 		}
 	}
@@ -111,7 +77,7 @@ again:
 		uint32_t l;
 
 		l = ber_len_short(*buf);
-		if ( l > 4 || buf + l > end )
+		if ( l > 4 || l >= (size_t)(end - buf) )
 			return;
 		buf++;
 		for(clen = i = 0; i < l; i++, buf++) {
@@ -121,11 +87,11 @@ again:
 
 	}
 
-	if ( buf + clen > end )
+	if ( clen > (size_t)(end - buf) )
 		return;
 
 	printf("%*c.len = %zu (0x%zx)",
-		depth, ' ', len, len);
+		depth, ' ', clen, clen);
 
 	if ( ber_id_octet_constructed(idb) ) {
 		printf(" {\n");
@@ -133,36 +99,24 @@ again:
 		printf("%*c}\n", depth, ' ');
 	}else{
 		printf("\n");
-		hex_dump(buf, clen, 16, depth);
+		hex_dumpf_indent(stdout, buf, clen, 16, depth);
 	}
 
 	buf += clen;
 	goto again;
 }
 
-static int tag_cmp(const struct ber_tag *tag, const uint8_t *idb, size_t len)
-{
-	if ( tag->tag_len < len )
-		return 1;
-	if ( tag->tag_len > len )
-		return -1;
-	return memcmp(idb, tag->tag, len);
-}
-
 static const struct ber_tag *find_tag(const struct ber_tag *tags,
 					unsigned int num_tags,
-					const uint8_t *idb,
-					size_t tag_len)
+					uint32_t tag)
 {
 	while ( num_tags ) {
 		unsigned int i;
-		int cmp;
 
 		i = num_tags / 2U;
-		cmp = tag_cmp(tags + i, idb, tag_len);
-		if ( cmp < 0 ) {
+		if ( tag < tags[i].tag ) {
 			num_tags = i;
-		}else if ( cmp > 0 ) {
+		}else if ( tag > tags[i].tag ) {
 			tags = tags + (i + 1U);
 			num_tags = num_tags - (i + 1U);
 		}else
@@ -172,6 +126,21 @@ static const struct ber_tag *find_tag(const struct ber_tag *tags,
 	return NULL;
 }
 
+/* Returns zero for tags which don't fit, they can't be in any table */
+static uint32_t pack_tag(const uint8_t *idb, size_t tag_len)
+{
+	uint32_t ret;
+	size_t i;
+
+	if ( tag_len > sizeof(ret) )
+		return 0;
+
+	for(ret = i = 0; i < tag_len; i++)
+		ret = (ret << 8) | idb[i];
+
+	return ret;
+}
+
 static const uint8_t *decode_tag(const uint8_t **ptr,
 					const uint8_t *end,
 					size_t *tag_len)
@@ -226,8 +195,9 @@ static size_t decode_len(const uint8_t **ptr, const uint8_t *end)
 	}else{
 		size_t i, l;
 
+		/* the length octets follow this one */
 		l = ber_len_short(*tmp);
-		if ( l > 4 || tmp + l > end ) {
+		if ( l > 4 || l >= (size_t)(end - tmp) ) {
 			*ptr = end;
 			return 1;
 		}
@@ -249,15 +219,13 @@ size_t ber_decode_len(const uint8_t **ptr, const uint8_t *end)
 	return decode_len(ptr, end);
 }
 
-int ber_decode(const struct ber_tag *tags, unsigned int num_tags,
-		const uint8_t *ptr, size_t len, void *priv)
+int ber_decode_ex(const struct ber_tag *tags, unsigned int num_tags,
+		const uint8_t *ptr, size_t len,
+		ber_unknown_cb_t unknown, void *priv)
 {
 	const uint8_t *end = ptr + len;
 	unsigned int i;
-	uint32_t clen;
-
-//	printf("BER DECODE:\n");
-//	hex_dump(ptr, len, 16, 0);
+	size_t clen;
 
 	for(i = 0; ptr < end; ptr += clen) {
 		const uint8_t *idb;
@@ -269,23 +237,215 @@ int ber_decode(const struct ber_tag *tags, unsigned int num_tags,
 			return 0;
 
 		clen = decode_len(&ptr, end);
-		if ( ptr + clen > end )
+		if ( clen > (size_t)(end - ptr) )
 			return 0;
 
-		tag = find_tag(tags, num_tags, idb, tag_len);
+		tag = find_tag(tags, num_tags, pack_tag(idb, tag_len));
 		if ( tag ) {
 			if ( tag->op && !(*tag->op)(ptr, clen, priv) )
 				return 0;
 			i++;
-		}else{
-			size_t i;
-			printf("unknown tag: ");
-			for(i = 0; i < tag_len; i++)
-				printf("%.2x ", idb[i]);
-			printf("\n");
-			hex_dump(ptr, clen, 16, 0);
+		}else if ( unknown ) {
+			if ( !(*unknown)(idb, tag_len, ptr, clen, priv) )
+				return 0;
 		}
 	}
 
 	return i;
 }
+
+/* Unknown tags are skipped */
+int ber_decode(const struct ber_tag *tags, unsigned int num_tags,
+		const uint8_t *ptr, size_t len, void *priv)
+{
+	return ber_decode_ex(tags, num_tags, ptr, len, NULL, priv);
+}
+
+enum {
+	STREAM_TAG = 0,
+	STREAM_TAG_MORE,
+	STREAM_LEN,
+	STREAM_LEN_MORE,
+	STREAM_VALUE,
+	STREAM_ERROR,
+};
+
+void ber_stream_init(struct ber_stream *s, const struct ber_stream_ops *ops,
+			void *priv)
+{
+	memset(s, 0, sizeof(*s));
+	s->s_ops = ops;
+	s->s_priv = priv;
+	s->s_state = STREAM_TAG;
+}
+
+static int stream_error(struct ber_stream *s)
+{
+	s->s_state = STREAM_ERROR;
+	return 0;
+}
+
+/* Account for n bytes of the enclosing constructed values */
+static int stream_consume(struct ber_stream *s, size_t n)
+{
+	unsigned int i;
+
+	for(i = 0; i < s->s_depth; i++) {
+		if ( s->s_stack[i].f_left < n )
+			return 0;
+		s->s_stack[i].f_left -= n;
+	}
+
+	return 1;
+}
+
+/* Close every constructed value which has been used up */
+static int stream_pop(struct ber_stream *s)
+{
+	const struct ber_stream_ops *ops = s->s_ops;
+	struct ber_stream_frame *f;
+
+	while ( s->s_depth ) {
+		f = &s->s_stack[s->s_depth - 1];
+		if ( f->f_left )
+			break;
+		s->s_depth--;
+		if ( ops->tag_end &&
+			!(*ops->tag_end)(s->s_priv, f->f_tag, f->f_tag_len) )
+			return 0;
+	}
+
+	return 1;
+}
+
+static int stream_end_primitive(struct ber_stream *s)
+{
+	const struct ber_stream_ops *ops = s->s_ops;
+
+	s->s_state = STREAM_TAG;
+	if ( ops->tag_end &&
+		!(*ops->tag_end)(s->s_priv, s->s_tag, s->s_tag_len) )
+		return 0;
+	return stream_pop(s);
+}
+
+/* The header is complete, s_len is the length of the contents */
+static int stream_header(struct ber_stream *s)
+{
+	const struct ber_stream_ops *ops = s->s_ops;
+	struct ber_stream_frame *f;
+	int constructed;
+
+	if ( s->s_depth && s->s_stack[s->s_depth - 1].f_left < s->s_len )
+		return 0;
+
+	constructed = ber_id_octet_constructed(s->s_tag[0]);
+	if ( ops->tag_start && !(*ops->tag_start)(s->s_priv,
+					s->s_tag, s->s_tag_len,
+					s->s_len, constructed) )
+		return 0;
+
+	if ( !constructed ) {
+		if ( !s->s_len )
+			return stream_end_primitive(s);
+		s->s_state = STREAM_VALUE;
+		return 1;
+	}
+
+	if ( s->s_depth >= BER_STREAM_MAX_DEPTH )
+		return 0;
+
+	f = &s->s_stack[s->s_depth++];
+	memcpy(f->f_tag, s->s_tag, s->s_tag_len);
+	f->f_tag_len = s->s_tag_len;
+	f->f_left = s->s_len;
+	s->s_state = STREAM_TAG;
+	return stream_pop(s);
+}
+
+static int stream_byte(struct ber_stream *s, uint8_t c)
+{
+	if ( !stream_consume(s, 1) )
+		return 0;
+
+	switch(s->s_state) {
+	case STREAM_TAG:
+		s->s_tag[0] = c;
+		s->s_tag_len = 1;
+		if ( ber_id_octet_tag(c) == 0x1f )
+			s->s_state = STREAM_TAG_MORE;
+		else
+			s->s_state = STREAM_LEN;
+		return 1;
+	case STREAM_TAG_MORE:
+		if ( s->s_tag_len >= BER_STREAM_MAX_TAG )
+			return 0;
+		s->s_tag[s->s_tag_len++] = c;
+		if ( !(c & 0x80) )
+			s->s_state = STREAM_LEN;
+		return 1;
+	case STREAM_LEN:
+		if ( ber_len_form_short(c) ) {
+			s->s_len = ber_len_short(c);
+			return stream_header(s);
+		}
+		/* no indefinite lengths, and it has to fit in 32 bits */
+		s->s_len_bytes = ber_len_short(c);
+		if ( !s->s_len_bytes || s->s_len_bytes > 4 )
+			return 0;
+		s->s_len = 0;
+		s->s_state = STREAM_LEN_MORE;
+		return 1;
+	case STREAM_LEN_MORE:
+		s->s_len = (s->s_len << 8) | c;
+		if ( --s->s_len_bytes )
+			return 1;
+		return stream_header(s);
+	default:
+		return 0;
+	}
+}
+
+/* Feed the next piece of the encoding, returns zero if it is malformed or a
+ * callback failed, after which the stream must be initialised again.
+ */
+int ber_stream_feed(struct ber_stream *s, const uint8_t *ptr, size_t len)
+{
+	const struct ber_stream_ops *ops = s->s_ops;
+	const uint8_t *end = ptr + len;
+	size_t n;
+
+	while ( ptr < end ) {
+		if ( s->s_state == STREAM_ERROR )
+			return 0;
+
+		if ( s->s_state != STREAM_VALUE ) {
+			if ( !stream_byte(s, *ptr) )
+				return stream_error(s);
+			ptr++;
+			continue;
+		}
+
+		n = end - ptr;
+		if ( n > s->s_len )
+			n = s->s_len;
+
+		if ( !stream_consume(s, n) )
+			return stream_error(s);
+		if ( ops->value && !(*ops->value)(s->s_priv, ptr, n) )
+			return stream_error(s);
+
+		ptr += n;
+		s->s_len -= n;
+		if ( !s->s_len && !stream_end_primitive(s) )
+			return stream_error(s);
+	}
+
+	return s->s_state != STREAM_ERROR;
+}
+
+/* Returns true if the data so far ends on a complete top level TLV */
+int ber_stream_finish(struct ber_stream *s)
+{
+	return s->s_state == STREAM_TAG && !s->s_depth;
+}
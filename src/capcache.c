@@ -0,0 +1,273 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2008 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Reader capability cache. The data rate and clock frequency tables are
+ * fetched with control transfers on every probe, but they are a property of
+ * the reader model. A small table of them is kept in a shared mapping of a
+ * file, keyed on VID, PID and bcdDevice. Entries also hold the parsed CCID
+ * class descriptor, and are only used if that matches the live one exactly.
+ * The format is native to the machine which wrote it, files with the wrong
+ * header are reinitialised. Other processes may be using the same file, so
+ * as well as cap_lock, which serialises the threads of this one, lookups take
+ * a shared fcntl() lock on the file and stores or reinitialising take an
+ * exclusive one.
+*/
+
+#include <ccid.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ccid-internal.h"
+
+#define CAP_MAGIC	0x50414343 /* "CCAP" in little endian */
+#define CAP_VERSION	1
+#define CAP_SLOTS	64
+#define CAP_MAX_TABLE	64
+
+struct cap_ent {
+	uint16_t	c_vid;
+	uint16_t	c_pid;
+	uint16_t	c_bcd;
+	uint8_t		c_used;
+	uint8_t		_pad0;
+	uint32_t	c_num_rate;
+	uint32_t	c_num_clock;
+	struct ccid_desc c_desc;
+	uint32_t	c_rate[CAP_MAX_TABLE];
+	uint32_t	c_clock[CAP_MAX_TABLE];
+};
+
+struct cap_hdr {
+	uint32_t	h_magic;
+	uint16_t	h_version;
+	uint16_t	h_ent_size;
+	uint32_t	h_slots;
+	uint32_t	_pad0;
+	struct cap_ent	h_ent[CAP_SLOTS];
+};
+
+static pthread_mutex_t cap_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cap_hdr *cap;
+static int cap_fd = -1;
+
+/* Lock or unlock the whole file against other processes */
+static int cap_flock(int fd, short type)
+{
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	while ( fcntl(fd, F_SETLKW, &fl) ) {
+		if ( errno != EINTR ) {
+			fprintf(stderr, "*** error: fcntl: %s\n",
+				strerror(errno));
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static unsigned int cap_hash(const struct _cap_key *k)
+{
+	return ((k->k_vid * 31 + k->k_pid) * 31 + k->k_bcd) % CAP_SLOTS;
+}
+
+static int cap_match(const struct cap_ent *c, const struct _cap_key *k)
+{
+	return c->c_used && c->c_vid == k->k_vid &&
+		c->c_pid == k->k_pid && c->c_bcd == k->k_bcd;
+}
+
+/* Called with cap_lock held, returns the entry for k or a free slot */
+static struct cap_ent *cap_find(const struct _cap_key *k)
+{
+	struct cap_ent *c;
+	unsigned int i, h;
+
+	for(h = cap_hash(k), i = 0; i < CAP_SLOTS; i++) {
+		c = &cap->h_ent[(h + i) % CAP_SLOTS];
+		if ( !c->c_used || cap_match(c, k) )
+			return c;
+	}
+
+	/* full, just evict the home slot */
+	return &cap->h_ent[h];
+}
+
+static uint32_t *table_dup(const uint32_t *tbl, size_t num)
+{
+	uint32_t *ret;
+
+	ret = calloc(num ? num : 1, sizeof(*ret));
+	if ( NULL == ret )
+		return NULL;
+	memcpy(ret, tbl, num * sizeof(*ret));
+	return ret;
+}
+
+/* Fill in the rate and clock tables from the cache, returns zero on a miss */
+int _cap_lookup(struct _ccid *ccid, const struct _cap_key *k)
+{
+	struct cap_ent *c;
+	int ret = 0;
+
+	pthread_mutex_lock(&cap_lock);
+
+	if ( NULL == cap || !cap_flock(cap_fd, F_RDLCK) )
+		goto out;
+
+	c = cap_find(k);
+	if ( !cap_match(c, k) )
+		goto unlock;
+	if ( memcmp(&c->c_desc, &ccid->d_desc, sizeof(c->c_desc)) )
+		goto unlock;
+	if ( c->c_num_rate > CAP_MAX_TABLE || c->c_num_clock > CAP_MAX_TABLE )
+		goto unlock;
+
+	ccid->d_data_rate = table_dup(c->c_rate, c->c_num_rate);
+	ccid->d_clock_freq = table_dup(c->c_clock, c->c_num_clock);
+	if ( NULL == ccid->d_data_rate || NULL == ccid->d_clock_freq ) {
+		free(ccid->d_data_rate);
+		free(ccid->d_clock_freq);
+		ccid->d_data_rate = NULL;
+		ccid->d_clock_freq = NULL;
+		goto unlock;
+	}
+
+	ccid->d_num_rate = c->c_num_rate;
+	ccid->d_num_clock = c->c_num_clock;
+	ret = 1;
+unlock:
+	cap_flock(cap_fd, F_UNLCK);
+out:
+	pthread_mutex_unlock(&cap_lock);
+	return ret;
+}
+
+/* Remember the tables which were just fetched from the reader */
+void _cap_store(struct _ccid *ccid, const struct _cap_key *k)
+{
+	struct cap_ent *c;
+
+	if ( ccid->d_num_rate > CAP_MAX_TABLE ||
+			ccid->d_num_clock > CAP_MAX_TABLE )
+		return;
+
+	pthread_mutex_lock(&cap_lock);
+
+	if ( NULL == cap || !cap_flock(cap_fd, F_WRLCK) )
+		goto out;
+
+	c = cap_find(k);
+	memset(c, 0, sizeof(*c));
+	c->c_vid = k->k_vid;
+	c->c_pid = k->k_pid;
+	c->c_bcd = k->k_bcd;
+	memcpy(&c->c_desc, &ccid->d_desc, sizeof(c->c_desc));
+	c->c_num_rate = ccid->d_num_rate;
+	c->c_num_clock = ccid->d_num_clock;
+	if ( ccid->d_num_rate )
+		memcpy(c->c_rate, ccid->d_data_rate,
+			ccid->d_num_rate * sizeof(*c->c_rate));
+	if ( ccid->d_num_clock )
+		memcpy(c->c_clock, ccid->d_clock_freq,
+			ccid->d_num_clock * sizeof(*c->c_clock));
+	c->c_used = 1;
+	cap_flock(cap_fd, F_UNLCK);
+out:
+	pthread_mutex_unlock(&cap_lock);
+}
+
+static int cap_valid(const struct cap_hdr *h)
+{
+	return h->h_magic == CAP_MAGIC &&
+		h->h_version == CAP_VERSION &&
+		h->h_ent_size == sizeof(struct cap_ent) &&
+		h->h_slots == CAP_SLOTS;
+}
+
+/** Use a file to cache reader capabilities across probes.
+ * \ingroup g_libccid
+ * @param fn name of the cache file, created if it doesn't exist, or NULL to
+ * stop using the cache.
+ *
+ * Once set, \ref ccid_probe takes the data rate and clock frequency tables
+ * of a reader from the cache instead of asking the reader for them, if a
+ * reader of the same model with an identical CCID descriptor has been seen
+ * before. The file may be shared between processes, access to it is
+ * serialised with fcntl() record locks so it must be on a filesystem which
+ * supports them.
+ *
+ * @return zero on failure, in which case no cache is used.
+ */
+int libccid_cap_cache(const char *fn)
+{
+	struct cap_hdr *h = NULL;
+	struct stat st;
+	void *map;
+	int fd = -1;
+
+	if ( NULL == fn )
+		goto swap;
+
+	fd = open(fn, O_RDWR | O_CREAT, 0644);
+	if ( fd < 0 ) {
+		fprintf(stderr, "*** error: %s: %s\n", fn, strerror(errno));
+		goto swap;
+	}
+
+	/* another process may be creating or reinitialising it */
+	if ( !cap_flock(fd, F_WRLCK) )
+		goto err_close;
+
+	if ( fstat(fd, &st) ) {
+		fprintf(stderr, "*** error: %s: %s\n", fn, strerror(errno));
+		goto err_close;
+	}
+
+	if ( st.st_size != sizeof(*h) && ftruncate(fd, sizeof(*h)) ) {
+		fprintf(stderr, "*** error: %s: %s\n", fn, strerror(errno));
+		goto err_close;
+	}
+
+	map = mmap(NULL, sizeof(*h), PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	if ( MAP_FAILED == map ) {
+		fprintf(stderr, "*** error: mmap: %s\n", strerror(errno));
+		goto err_close;
+	}
+
+	h = map;
+	if ( !cap_valid(h) ) {
+		memset(h, 0, sizeof(*h));
+		h->h_magic = CAP_MAGIC;
+		h->h_version = CAP_VERSION;
+		h->h_ent_size = sizeof(struct cap_ent);
+		h->h_slots = CAP_SLOTS;
+	}
+
+	cap_flock(fd, F_UNLCK);
+	goto swap;
+
+err_close:
+	close(fd);
+	fd = -1;
+swap:
+	pthread_mutex_lock(&cap_lock);
+	if ( cap ) {
+		munmap(cap, sizeof(*cap));
+		close(cap_fd);
+	}
+	cap = h;
+	cap_fd = fd;
+	pthread_mutex_unlock(&cap_lock);
+
+	return (NULL == fn || NULL != h);
+}
@@ -7,6 +7,8 @@
 */
 
 #include <ccid.h>
+#include <limits.h>
+#include <time.h>
 
 #include "ccid-internal.h"
 
@@ -42,6 +44,46 @@ ccid_t cci_ccid(cci_t cci)
 	return cci->i_parent;
 }
 
+uint64_t _cci_now_msec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Everything sent during one call shares the one deadline */
+static void call_begin(struct _cci *cci)
+{
+	if ( cci->i_timeout_ms )
+		cci->i_deadline = _cci_now_msec() + cci->i_timeout_ms;
+}
+
+static void call_end(struct _cci *cci)
+{
+	cci->i_deadline = 0;
+}
+
+/** Set a time budget for calls on a slot.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t to configure.
+ * @param budget_ms Time limit in milliseconds, zero for none.
+ *
+ * Each \ref cci_transact, \ref cci_power_on or \ref cci_warm_reset must
+ * finish within budget_ms, including any GET RESPONSE rounds and time
+ * extensions. Asynchronous transactions each get the whole budget. On
+ * readers which exchange TPDUs or characters, every response must also
+ * start within the card's block waiting time, or work waiting time for
+ * T=0, which is restarted by each time extension. A command which runs
+ * over is aborted as for \ref ccid_cancel and fails with
+ * CCID_ERROR_CARD_TIMEOUT. Contact slots only, the default is no limit.
+ */
+void cci_set_timeout(cci_t cci, unsigned int budget_ms)
+{
+	cci->i_timeout_ms = budget_ms;
+}
+
 /** Power on a chip card slot.
  * \ingroup g_cci
  *
@@ -49,12 +91,233 @@ ccid_t cci_ccid(cci_t cci)
  * @param voltage Voltage selector.
  * @param atr_len Pointer to size_t to retrieve length of ATR message.
  *
+ * If the card was left powered by \ref cci_power_off in keep powered mode,
+ * and the idle timeout has not yet run out, then it gets a warm reset as
+ * for \ref cci_warm_reset instead of a full activation.
+ *
  * @return NULL for failure, pointer to ATR message otherwise.
  */
 const uint8_t *cci_power_on(cci_t cci, unsigned int voltage,
 				size_t *atr_len)
 {
-	return (*cci->i_ops->power_on)(cci, voltage, atr_len);
+	const uint8_t *atr = NULL;
+	size_t len;
+
+	call_begin(cci);
+	if ( cci->i_idle ) {
+		cci->i_idle = 0;
+		if ( cci->i_ops->warm_reset && voltage == cci->i_voltage &&
+				_cci_now_msec() < cci->i_idle_deadline )
+			atr = (*cci->i_ops->warm_reset)(cci, &len);
+		if ( NULL == atr )
+			(*cci->i_ops->power_off)(cci);
+	}
+
+	if ( NULL == atr )
+		atr = (*cci->i_ops->power_on)(cci, voltage, &len);
+	call_end(cci);
+	if ( NULL == atr )
+		return NULL;
+
+	cci->i_voltage = voltage;
+	if ( atr_len )
+		*atr_len = len;
+	return _cci_save_atr(cci, atr, len);
+}
+
+/** Warm reset the active card.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t of an active card.
+ * @param atr_len Pointer to size_t to retrieve length of ATR message.
+ *
+ * Contact cards are reset without removing power, and if the ATR is the
+ * same as before then the Fi/Di and protocol parameters negotiated at power
+ * on are put back without being worked out again. Contactless cards have
+ * the field cycled and are selected again by UID, without anticollision.
+ * Card state such as the selected file or application is lost either way.
+ *
+ * @return NULL for failure, pointer to ATR (or ATS) message otherwise.
+ */
+const uint8_t *cci_warm_reset(cci_t cci, size_t *atr_len)
+{
+	const uint8_t *atr;
+	size_t len;
+
+	if ( NULL == cci->i_ops->warm_reset ) {
+		cci->i_parent->d_error = CCID_ERROR_IN_VALUE;
+		return NULL;
+	}
+
+	cci->i_idle = 0;
+	call_begin(cci);
+	atr = (*cci->i_ops->warm_reset)(cci, &len);
+	call_end(cci);
+	if ( NULL == atr )
+		return NULL;
+
+	if ( atr_len )
+		*atr_len = len;
+	return _cci_save_atr(cci, atr, len);
+}
+
+/** Leave cards powered for a while after they are powered off.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t to configure.
+ * @param idle_ms Idle timeout in milliseconds, zero disables.
+ *
+ * In keep powered mode \ref cci_power_off leaves an active card powered.
+ * If \ref cci_power_on is called within idle_ms then the card only gets a
+ * warm reset. Otherwise it is really powered off by the next power on, by
+ * \ref ccid_expire_idle or when the CCID is closed. Disabled by default.
+ */
+void cci_set_idle_timeout(cci_t cci, unsigned int idle_ms)
+{
+	cci->i_idle_ms = idle_ms;
+	if ( !idle_ms )
+		_cci_idle_expire(cci, UINT64_MAX);
+}
+
+/* Really power off a card left powered by cci_power_off() if its timeout has
+ * passed, returns the milliseconds left or -1 if there is nothing to do.
+ */
+int _cci_idle_expire(struct _cci *cci, uint64_t now)
+{
+	if ( !cci->i_idle )
+		return -1;
+
+	if ( now < cci->i_idle_deadline ) {
+		if ( cci->i_idle_deadline - now > INT_MAX )
+			return INT_MAX;
+		return cci->i_idle_deadline - now;
+	}
+
+	cci->i_idle = 0;
+	cci->i_atr_len = 0;
+	(*cci->i_ops->power_off)(cci);
+	return -1;
+}
+
+const uint8_t *_cci_save_atr(struct _cci *cci, const uint8_t *atr, size_t len)
+{
+	if ( len > sizeof(cci->i_atr) )
+		len = sizeof(cci->i_atr);
+	memcpy(cci->i_atr, atr, len);
+	cci->i_atr_len = len;
+	return atr;
+}
+
+/** Retrieve the ATR of the active card.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t to query.
+ * @param atr_len Pointer to size_t to retrieve length of ATR message.
+ *
+ * Returns a copy of the ATR from the last \ref cci_power_on, or of the ATS
+ * from the last contactless activation, which stays valid until the card is
+ * powered off or activated again. Generates no traffic to the CCID.
+ *
+ * @return NULL if there is no active card, pointer to ATR message otherwise.
+ */
+const uint8_t *cci_atr(cci_t cci, size_t *atr_len)
+{
+	if ( cci->i_status != CHIPCARD_ACTIVE )
+		return NULL;
+	if ( atr_len )
+		*atr_len = cci->i_atr_len;
+	return cci->i_atr;
+}
+
+/** Enable or disable baud rate negotiation.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t to configure.
+ * @param enable Zero to leave cards at the default rate.
+ *
+ * By default \ref cci_power_on negotiates the fastest Fi/Di supported by both
+ * the card (from TA1 of the ATR) and the reader, using PPS where the reader
+ * does not do so itself. Takes effect at the next power on. Contact
+ * interfaces only.
+ */
+void cci_set_pps(cci_t cci, int enable)
+{
+	cci->i_no_pps = !enable;
+}
+
+/* ISO 7816-4 procedure bytes resolved by xfr_auto_response() */
+#define SW1_MORE_DATA		0x61
+#define SW1_GSM_MORE_DATA	0x9f
+#define SW1_WRONG_LE		0x6c
+#define INS_GET_RESPONSE	0xc0
+#define CLA_GSM			0xa0
+#define AUTO_MAX_ROUNDS		32
+
+/* Response data accumulates in the receive buffer, each GET RESPONSE is
+ * received directly after the data so far. Its CCID header lands over the
+ * tail of that data, which is saved beforehand and put back afterwards.
+ */
+static int auto_response(struct _cci *cci, struct _xfr *xfr)
+{
+	const struct ccid_msg *rxhdr = xfr->x_rxhdr;
+	uint8_t *rxbuf = xfr->x_rxbuf;
+	size_t rxmax = xfr->x_rxmax;
+	uint8_t save[XFR_HEADROOM], cla, sw1, sw2;
+	size_t got = 0, keep = 0;
+	unsigned int i;
+	int ret = 1;
+
+	if ( xfr->x_txlen < 5 )
+		return 1;
+	/* GET RESPONSE is interindustry, keeping only the logical channel,
+	 * except on GSM SIMs which use their own class
+	 */
+	cla = xfr->x_txbuf[0];
+	if ( cla != CLA_GSM )
+		cla &= 0x03;
+
+	for(i = 0; i < AUTO_MAX_ROUNDS && xfr->x_rxlen >= 2; i++) {
+		sw1 = xfr->x_rxbuf[xfr->x_rxlen - 2];
+		sw2 = xfr->x_rxbuf[xfr->x_rxlen - 1];
+
+		if ( sw1 == SW1_WRONG_LE && 0 == got ) {
+			xfr->x_txbuf[xfr->x_txlen - 1] = sw2;
+		}else if ( sw1 == SW1_MORE_DATA || sw1 == SW1_GSM_MORE_DATA ) {
+			if ( keep )
+				memcpy(rxbuf + got - keep, save, keep);
+			got += xfr->x_rxlen - 2;
+			keep = (got < XFR_HEADROOM) ? got : XFR_HEADROOM;
+			memcpy(save, rxbuf + got - keep, keep);
+
+			xfr->x_rxbuf = rxbuf + got;
+			xfr->x_rxhdr = (const struct ccid_msg *)
+					(xfr->x_rxbuf - XFR_HEADROOM);
+			xfr->x_rxmax = rxmax - got;
+
+			xfr->x_txlen = 0;
+			xfr->x_txbuf[xfr->x_txlen++] = cla;
+			xfr->x_txbuf[xfr->x_txlen++] = INS_GET_RESPONSE;
+			xfr->x_txbuf[xfr->x_txlen++] = 0; /* P1 */
+			xfr->x_txbuf[xfr->x_txlen++] = 0; /* P2 */
+			xfr->x_txbuf[xfr->x_txlen++] = sw2; /* Le */
+		}else{
+			break;
+		}
+
+		if ( !(*cci->i_ops->transact)(cci, xfr) ) {
+			ret = 0;
+			break;
+		}
+	}
+
+	if ( keep )
+		memcpy(rxbuf + got - keep, save, keep);
+	if ( ret )
+		xfr->x_rxlen += got;
+	xfr->x_rxhdr = rxhdr;
+	xfr->x_rxbuf = rxbuf;
+	xfr->x_rxmax = rxmax;
+	return ret;
 }
 
 /** Perform a chip card transaction.
@@ -63,13 +326,134 @@ const uint8_t *cci_power_on(cci_t cci, unsigned int voltage,
  * @param cci \ref cci_t for this transaction.
  * @param xfr \ref xfr_t representing the transfer buffer.
  *
- * Transactions consist of a transmit followed by a recieve.
+ * Transactions consist of a transmit followed by a recieve. See
+ * \ref xfr_auto_response for automatic handling of procedure bytes. On
+ * readers which only exchange TPDUs, T=1 cards are driven by the host, with
+ * commands and responses of any length chained through blocks of up to the
+ * IFSC and IFSD agreed at power on.
  *
  * @return zero on failure.
  */
 int cci_transact(cci_t cci, xfr_t xfr)
 {
-	return (*cci->i_ops->transact)(cci, xfr);
+	int ret;
+
+	call_begin(cci);
+	ret = (*cci->i_ops->transact)(cci, xfr);
+	if ( ret && xfr->x_auto )
+		ret = auto_response(cci, xfr);
+	call_end(cci);
+	return ret;
+}
+
+/** Submit an asynchronous chip card transaction.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t for this transaction.
+ * @param xfr \ref xfr_t representing the transfer buffer.
+ * @param cb Callback to run when the transaction completes.
+ * @param priv Private data pointer passed to the callback.
+ *
+ * Queue a transaction and return immediately. Transactions queued on the
+ * same CCID are sent in order, each one being put on the wire as soon as the
+ * previous one completes. The xfr must not be touched until the callback has
+ * run. Interfaces which do not support asynchronous operation perform the
+ * transaction synchronously and call cb before returning.
+ *
+ * @return zero if the transaction could not be queued, in which case the
+ * callback is not called.
+ */
+int cci_submit(cci_t cci, xfr_t xfr, cci_xfr_cb_t cb, void *priv)
+{
+	int ret;
+
+	if ( cci->i_ops->submit )
+		return (*cci->i_ops->submit)(cci, xfr, cb, priv);
+
+	ret = (*cci->i_ops->transact)(cci, xfr);
+	if ( cb )
+		(*cb)(cci, xfr, ret, priv);
+	return 1;
+}
+
+static void batch_done(cci_t cci, xfr_t xfr, int ok, void *priv)
+{
+	struct cci_apdu *a = priv;
+	a->a_ok = ok;
+}
+
+/* Transport went fine, now see if the card said the right thing */
+static int batch_check(struct cci_apdu *a)
+{
+	struct _xfr *xfr = a->a_xfr;
+	uint16_t sw;
+
+	if ( !a->a_ok || xfr->x_rxlen < 2 )
+		return a->a_ok = 0;
+
+	sw = (xfr->x_rxbuf[xfr->x_rxlen - 2] << 8) |
+		xfr->x_rxbuf[xfr->x_rxlen - 1];
+	return a->a_ok = ((sw & a->a_sw_mask) == a->a_sw);
+}
+
+/** Perform a list of chip card transactions.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t for these transactions.
+ * @param apdu Array of commands, see \ref cci_apdu.
+ * @param num Number of entries in apdu.
+ * @param flags Zero or \ref CCI_BATCH_STOP.
+ *
+ * Runs the commands in order, back to back. Where the interface supports
+ * \ref cci_submit they are all queued at once, except that commands whose
+ * xfr has \ref xfr_auto_response enabled are done synchronously, since their
+ * GET RESPONSE must directly follow them. With \ref CCI_BATCH_STOP nothing
+ * is queued ahead, each command is only sent if the previous one was as
+ * expected. Commands which aren't sent have a_ok cleared.
+ *
+ * @return the index of the first command which failed or had an unexpected
+ * status word, or num if they all went as expected.
+ */
+unsigned int cci_transact_batch(cci_t cci, struct cci_apdu *apdu,
+				unsigned int num, unsigned int flags)
+{
+	unsigned int i, ret = num;
+	int pipe, pending = 0;
+
+	pipe = !(flags & CCI_BATCH_STOP) && cci->i_ops->submit;
+
+	for(i = 0; i < num; i++)
+		apdu[i].a_ok = 0;
+
+	for(i = 0; i < num; i++) {
+		struct cci_apdu *a = &apdu[i];
+
+		if ( pipe && !a->a_xfr->x_auto ) {
+			if ( (*cci->i_ops->submit)(cci, a->a_xfr,
+						batch_done, a) )
+				pending = 1;
+			continue;
+		}
+
+		if ( pending ) {
+			ccid_flush(cci->i_parent);
+			pending = 0;
+		}
+
+		a->a_ok = cci_transact(cci, a->a_xfr);
+		if ( (flags & CCI_BATCH_STOP) && !batch_check(a) )
+			return i;
+	}
+
+	if ( pending )
+		ccid_flush(cci->i_parent);
+
+	for(i = 0; i < num; i++) {
+		if ( !batch_check(&apdu[i]) && ret == num )
+			ret = i;
+	}
+
+	return ret;
 }
 
 /** Power off a chip card slot.
@@ -77,9 +461,20 @@ int cci_transact(cci_t cci, xfr_t xfr)
  *
  * @param cci \ref cci_t to power off.
  *
+ * See \ref cci_set_idle_timeout for keep powered mode, in which an active
+ * card is only marked as idle.
+ *
  * @return zero on failure.
  */
 int cci_power_off(cci_t cci)
 {
+	if ( cci->i_idle_ms && cci->i_status == CHIPCARD_ACTIVE ) {
+		cci->i_idle = 1;
+		cci->i_idle_deadline = _cci_now_msec() + cci->i_idle_ms;
+		return 1;
+	}
+
+	cci->i_idle = 0;
+	cci->i_atr_len = 0;
 	return (*cci->i_ops->power_off)(cci);
 }
@@ -7,20 +7,222 @@
 */
 
 #include <ccid.h>
+#include <unistd.h>
 
 #include "ccid-internal.h"
 
-static int select_params(struct _cci *cci, const uint8_t *atr, size_t len)
+#define PPSS		0xff
+#define PPS0_PPS1	0x10
+
+struct atr_info {
+	unsigned int proto; /* first offered */
+	unsigned int protos; /* bitmask of all those offered */
+	uint8_t ta1;
+	int specific; /* TA2 puts the card in specific mode, no PPS */
+	unsigned int specific_proto; /* the only protocol, from TA2 */
+
+	/* T=1 parameters, at the ISO 7816-3 defaults if not given */
+	uint8_t tc1;
+	uint8_t ifsc;
+	uint8_t bwi_cwi;
+	uint8_t crc;
+};
+
+/* Interface bytes come in groups, each one introduced by a TD byte naming the
+ * protocol it is for. The first TA, TB and TC for T=1 from the third group on
+ * give the IFSC, waiting times and EDC type.
+ */
+static void parse_atr(const uint8_t *atr, size_t len, struct atr_info *ai)
+{
+	unsigned int n, t = CCID_PROTOCOL_T0;
+	uint8_t y, td, seen = 0;
+	size_t i;
+
+	memset(ai, 0, sizeof(*ai));
+	ai->proto = CCID_PROTOCOL_T0;
+	ai->ta1 = 0x11;
+	ai->ifsc = T1_DEFAULT_IFS;
+	ai->bwi_cwi = 0x4d;
+
+	if ( len < 2 )
+		goto out;
+
+	y = atr[1] >> 4;
+	for(i = 2, n = 1; ; n++) {
+		if ( (y & 0x1) && i < len ) {
+			if ( n == 1 )
+				ai->ta1 = atr[i];
+			if ( n == 2 ) {
+				ai->specific = 1;
+				ai->specific_proto = atr[i] & 0xf;
+				if ( atr[i] & 0x10 )
+					ai->ta1 = 0x11; /* implicit, leave be */
+			}
+			if ( n > 2 && t == CCID_PROTOCOL_T1 && !(seen & 0x1) ) {
+				ai->ifsc = atr[i];
+				seen |= 0x1;
+			}
+			i++;
+		}
+		if ( (y & 0x2) && i < len ) {
+			if ( n > 2 && t == CCID_PROTOCOL_T1 && !(seen & 0x2) ) {
+				ai->bwi_cwi = atr[i];
+				seen |= 0x2;
+			}
+			i++;
+		}
+		if ( (y & 0x4) && i < len ) {
+			if ( n == 1 )
+				ai->tc1 = atr[i];
+			if ( n > 2 && t == CCID_PROTOCOL_T1 && !(seen & 0x4) ) {
+				ai->crc = atr[i] & 0x1;
+				seen |= 0x4;
+			}
+			i++;
+		}
+		if ( 0 == (y & 0x8) || i >= len )
+			break;
+
+		td = atr[i++];
+		t = td & 0xf;
+		if ( n == 1 )
+			ai->proto = t;
+		ai->protos |= 1U << t;
+		y = td >> 4;
+	}
+
+out:
+	if ( !ai->protos )
+		ai->protos = 1U << ai->proto;
+}
+
+/* T=1 protocol data structure for SetParameters, from the ATR */
+static void t1_params(uint8_t *params, const struct atr_info *ai, uint8_t fidi)
+{
+	struct ccid_t1 *t1 = (struct ccid_t1 *)params;
+
+	memset(t1, 0, sizeof(*t1));
+	t1->bmFindexDindex = fidi;
+	t1->bmTCCSKST1 = 0x10 | ai->crc;
+	t1->bGuardTimeT1 = ai->tc1;
+	t1->bWaitingIntegerT1 = ai->bwi_cwi;
+	t1->bIFSC = ai->ifsc;
+}
+
+/* Only this kind of reader needs the host to run T=1, and can be switched
+ * from T=0 to it.
+ */
+static int tpdu_level(struct _ccid *ccid)
+{
+	uint32_t features = ccid->d_desc.dwFeatures;
+
+	return (features & CCID_T1_TPDU) &&
+		!(features & (CCID_T1_APDU|CCID_T1_APDU_EXT)) &&
+		(ccid->d_desc.dwProtocols & CCID_T1);
+}
+
+static int do_pps(struct _cci *cci, struct _xfr *xfr,
+			unsigned int proto, uint8_t fidi)
 {
+	struct _ccid *ccid = cci->i_parent;
+	uint8_t pps[4];
+
+	pps[0] = PPSS;
+	pps[1] = PPS0_PPS1 | proto;
+	pps[2] = fidi;
+	pps[3] = pps[0] ^ pps[1] ^ pps[2];
+
+	xfr_reset(xfr);
+	xfr_tx_buf(xfr, pps, sizeof(pps));
+	if ( !_PC_to_RDR_XfrBlock(ccid, cci->i_idx, xfr) )
+		return 0;
+	if ( !_RDR_to_PC(ccid, cci->i_idx, xfr) )
+		return 0;
+	_RDR_to_PC_DataBlock(ccid, xfr);
+
+	/* card accepts by echoing the request */
+	if ( xfr->x_rxlen != sizeof(pps) || memcmp(xfr->x_rxbuf, pps, sizeof(pps)) ) {
+		trace(ccid, "     : PPS refused by card\n");
+		return 0;
+	}
+
 	return 1;
-#if 0
+}
+
+static int set_params(struct _cci *cci, struct _xfr *xfr, unsigned int proto,
+			const uint8_t *params, size_t plen)
+{
+	struct _ccid *ccid = cci->i_parent;
+
+	xfr_reset(xfr);
+	xfr_tx_buf(xfr, params, plen);
+	if ( !_PC_to_RDR_SetParameters(ccid, cci->i_idx, xfr, proto) )
+		return 0;
+	if ( !_RDR_to_PC(ccid, cci->i_idx, xfr) )
+		return 0;
+	return _RDR_to_PC_Parameters(ccid, xfr);
+}
+
+/* Negotiate the fastest Fi/Di supported by both the card and the reader,
+ * failure leaves the card at the default rate. Cards which offer T=1 after
+ * T=0 are switched to it on TPDU level readers, for the bigger blocks.
+ * Cards in specific mode can't negotiate, the reader is set to their TA1 and
+ * the protocol from TA2, and if it can't do those the card can't be used.
+ * Returns zero if the card can't be used.
+ */
+static int select_params(struct _cci *cci, const uint8_t *atr, size_t len)
+{
 	struct _ccid *ccid = cci->i_parent;
+	uint32_t features = ccid->d_desc.dwFeatures;
+	struct atr_info ai;
+	unsigned int proto;
+	uint8_t fidi, params[sizeof(struct ccid_t1)];
+	size_t plen;
+	int pps = 0;
 	xfr_t xfr;
 
-	xfr = xfr_alloc(256, 256);
+	cci->i_params_len = 0;
+	cci->i_pps = 0;
+
+	if ( cci->i_no_pps )
+		return 1;
+
+	/* reader has already done it all */
+	if ( features & (CCID_ATR_CONFIG|CCID_PPS_AUTO) )
+		return 1;
+
+	parse_atr(atr, len, &ai);
+	if ( ai.specific ) {
+		/* the card runs at TA1 with the TA2 protocol, or not at all */
+		proto = ai.specific_proto;
+		fidi = ai.ta1;
+		if ( proto != CCID_PROTOCOL_T0 && proto != CCID_PROTOCOL_T1 ) {
+			trace(ccid, "     : Specific mode T=%u unsupported\n",
+				proto);
+			return 0;
+		}
+		if ( !_ccid_fidi_ok(ccid, fidi) ) {
+			trace(ccid, "     : Specific mode TA1=0x%.2x "
+				"unsupported\n", fidi);
+			return 0;
+		}
+	}else{
+		proto = ai.proto;
+		if ( proto != CCID_PROTOCOL_T1 && tpdu_level(ccid) &&
+				(ai.protos & (1U << CCID_PROTOCOL_T1)) )
+			proto = CCID_PROTOCOL_T1;
+		fidi = _ccid_best_fidi(ccid, ai.ta1);
+	}
+
+	if ( fidi == 0x11 && proto == ai.proto )
+		return 1;
+
+	/* the ATR is in cci->i_xfr and is returned to the caller */
+	xfr = xfr_alloc(64, 64);
 	if ( NULL == xfr )
 		return 0;
 
+	xfr_reset(xfr);
 	if ( !_PC_to_RDR_GetParameters(ccid, cci->i_idx, xfr) )
 		goto err;
 	if ( !_RDR_to_PC(ccid, cci->i_idx, xfr) )
@@ -28,12 +230,126 @@ static int select_params(struct _cci *cci, const uint8_t *atr, size_t len)
 	if ( !_RDR_to_PC_Parameters(ccid, xfr) )
 		goto err;
 
+	if ( xfr->x_rxhdr->in.bApp != proto && proto == ai.proto &&
+			!ai.specific ) {
+		trace(ccid, "     : Reader chose T=%u, card offers T=%u\n",
+			xfr->x_rxhdr->in.bApp, proto);
+		proto = xfr->x_rxhdr->in.bApp;
+	}
+
+	/* the reader doesn't know the T=1 parameters unless it read the ATR */
+	if ( proto == CCID_PROTOCOL_T1 ) {
+		plen = sizeof(struct ccid_t1);
+		t1_params(params, &ai, fidi);
+	}else{
+		plen = sizeof(struct ccid_t0);
+		if ( xfr->x_rxlen < plen )
+			goto err;
+		memcpy(params, xfr->x_rxbuf, plen);
+	}
+
+	/* CCID_PPS_CUR readers do the PPS for us on SetParameters, otherwise
+	 * it must be exchanged with the card first, which is impossible on
+	 * APDU level readers.
+	 */
+	if ( !ai.specific && 0 == (features & CCID_PPS_CUR) ) {
+		if ( features & (CCID_T1_APDU|CCID_T1_APDU_EXT) )
+			goto out;
+		if ( !do_pps(cci, xfr, proto, fidi) )
+			goto out;
+		pps = 1;
+	}
+
+	params[0] = fidi;
+	if ( !set_params(cci, xfr, proto, params, plen) )
+		goto err;
+
+	cci->i_proto = proto;
+	cci->i_pps = pps;
+	memcpy(cci->i_params, params, plen);
+	cci->i_params_len = plen;
+out:
 	xfr_free(xfr);
 	return 1;
 err:
 	xfr_free(xfr);
 	return 0;
-#endif
+}
+
+/* Put back what select_params() negotiated, after a warm reset which gave
+ * the same ATR. The card is at the default rate again, the reader may or
+ * may not be, so both are told.
+ */
+static int restore_params(struct _cci *cci)
+{
+	xfr_t xfr;
+
+	if ( !cci->i_params_len )
+		return 1;
+
+	xfr = xfr_alloc(64, 64);
+	if ( NULL == xfr )
+		return 0;
+
+	if ( cci->i_pps &&
+			!do_pps(cci, xfr, cci->i_proto, cci->i_params[0]) )
+		goto err;
+
+	if ( !set_params(cci, xfr, cci->i_proto,
+				cci->i_params, cci->i_params_len) )
+		goto err;
+
+	xfr_free(xfr);
+	return 1;
+err:
+	xfr_free(xfr);
+	return 0;
+}
+
+/* Hand T=1 cards on TPDU level readers to the host block protocol. Unless
+ * select_params() already did, the reader is told the T=1 parameters from
+ * the ATR first, they are put back along with the rest after a warm reset.
+ */
+static void t1_start(struct _cci *cci, const uint8_t *atr, size_t len)
+{
+	struct _ccid *ccid = cci->i_parent;
+	uint8_t params[sizeof(struct ccid_t1)];
+	struct atr_info ai;
+	xfr_t xfr;
+	int ok;
+
+	cci->i_t1.t_on = 0;
+	if ( !tpdu_level(ccid) )
+		return;
+
+	parse_atr(atr, len, &ai);
+	if ( cci->i_params_len ) {
+		if ( cci->i_proto != CCID_PROTOCOL_T1 )
+			return;
+	}else{
+		if ( ai.proto != CCID_PROTOCOL_T1 )
+			return;
+	}
+
+	if ( !cci->i_params_len &&
+			!(ccid->d_desc.dwFeatures & CCID_ATR_CONFIG) ) {
+		t1_params(params, &ai, (ai.specific) ? ai.ta1 : 0x11);
+
+		xfr = xfr_alloc(64, 64);
+		if ( NULL == xfr )
+			return;
+		ok = set_params(cci, xfr, CCID_PROTOCOL_T1,
+				params, sizeof(params));
+		xfr_free(xfr);
+		if ( !ok )
+			return;
+
+		cci->i_proto = CCID_PROTOCOL_T1;
+		memcpy(cci->i_params, params, sizeof(params));
+		cci->i_params_len = sizeof(params);
+	}
+
+	_t1_init(cci, ai.ifsc, ai.crc);
 }
 
 static const uint8_t *contact_power_on(struct _cci *cci, unsigned int voltage,
@@ -44,38 +360,79 @@ static const uint8_t *contact_power_on(struct _cci *cci, unsigned int voltage,
 	if ( cci->i_ops != &_contact_ops )
 		return NULL;
 
-	if ( !_PC_to_RDR_IccPowerOn(ccid, cci->i_idx, ccid->d_xfr, voltage) )
+	if ( !_PC_to_RDR_IccPowerOn(ccid, cci->i_idx, cci->i_xfr, voltage) )
 		return NULL;
 
-	if ( !_RDR_to_PC(ccid, cci->i_idx, ccid->d_xfr) )
+	if ( !_RDR_to_PC(ccid, cci->i_idx, cci->i_xfr) )
 		return NULL;
 	
-	_RDR_to_PC_DataBlock(ccid, ccid->d_xfr);
+	_RDR_to_PC_DataBlock(ccid, cci->i_xfr);
 
-	select_params(cci, ccid->d_xfr->x_rxbuf, ccid->d_xfr->x_rxlen);
+	if ( !select_params(cci, cci->i_xfr->x_rxbuf, cci->i_xfr->x_rxlen) )
+		return NULL;
+	t1_start(cci, cci->i_xfr->x_rxbuf, cci->i_xfr->x_rxlen);
 
 	if ( atr_len )
-		*atr_len = ccid->d_xfr->x_rxlen;
-	return ccid->d_xfr->x_rxbuf;
+		*atr_len = cci->i_xfr->x_rxlen;
+	return cci->i_xfr->x_rxbuf;
+}
+
+/* An IccPowerOn while the card is powered gives a warm reset. If the ATR is
+ * the same as last time then the negotiated parameters are reused.
+ */
+static const uint8_t *contact_warm_reset(struct _cci *cci, size_t *atr_len)
+{
+	struct _ccid *ccid = cci->i_parent;
+	struct _xfr *xfr = cci->i_xfr;
+
+	if ( cci->i_status != CHIPCARD_ACTIVE )
+		return NULL;
+
+	if ( !_PC_to_RDR_IccPowerOn(ccid, cci->i_idx, xfr, cci->i_voltage) )
+		return NULL;
+	if ( !_RDR_to_PC(ccid, cci->i_idx, xfr) )
+		return NULL;
+	_RDR_to_PC_DataBlock(ccid, xfr);
+
+	if ( cci->i_status != CHIPCARD_ACTIVE )
+		return NULL;
+
+	if ( xfr->x_rxlen == cci->i_atr_len &&
+			!memcmp(xfr->x_rxbuf, cci->i_atr, cci->i_atr_len) ) {
+		trace(ccid, "     : Same ATR, reusing parameters\n");
+		if ( !restore_params(cci) )
+			return NULL;
+	}else if ( !select_params(cci, xfr->x_rxbuf, xfr->x_rxlen) ) {
+		return NULL;
+	}
+	t1_start(cci, xfr->x_rxbuf, xfr->x_rxlen);
+
+	if ( atr_len )
+		*atr_len = xfr->x_rxlen;
+	return xfr->x_rxbuf;
 }
 
 static int contact_power_off(struct _cci *cci)
 {
 	struct _ccid *ccid = cci->i_parent;
 
-	if ( !_PC_to_RDR_IccPowerOff(ccid, cci->i_idx, ccid->d_xfr) )
+	cci->i_t1.t_on = 0;
+	if ( !_PC_to_RDR_IccPowerOff(ccid, cci->i_idx, cci->i_xfr) )
 		return 0;
 
-	if ( !_RDR_to_PC(ccid, cci->i_idx, ccid->d_xfr) )
+	if ( !_RDR_to_PC(ccid, cci->i_idx, cci->i_xfr) )
 		return 0;
 	
-	return _RDR_to_PC_SlotStatus(ccid, ccid->d_xfr);
+	return _RDR_to_PC_SlotStatus(ccid, cci->i_xfr);
 }
 
 static int contact_transact(struct _cci *cci, struct _xfr *xfr)
 {
 	struct _ccid *ccid = cci->i_parent;
 
+	if ( cci->i_t1.t_on )
+		return _t1_transact(cci, xfr);
+
 	if ( !_PC_to_RDR_XfrBlock(ccid, cci->i_idx, xfr) )
 		return 0;
 
@@ -86,6 +443,31 @@ static int contact_transact(struct _cci *cci, struct _xfr *xfr)
 	return 1;
 }
 
+static int contact_submit(struct _cci *cci, struct _xfr *xfr,
+				cci_xfr_cb_t cb, void *priv)
+{
+	struct _ccid *ccid = cci->i_parent;
+
+	if ( xfr->x_state != XFR_STATE_IDLE ) {
+		ccid->d_error = CCID_ERROR_IN_VALUE;
+		return 0;
+	}
+
+	/* a command is many blocks, each depending on the last */
+	if ( cci->i_t1.t_on ) {
+		int ret = _t1_transact(cci, xfr);
+		if ( cb )
+			(*cb)(cci, xfr, ret, priv);
+		return 1;
+	}
+
+	/* set before submitting, a failed submit completes immediately */
+	xfr->x_cb = cb;
+	xfr->x_priv = priv;
+
+	return _PC_to_RDR_XfrBlock(ccid, cci->i_idx, xfr);
+}
+
 /** Retrieve chip card status.
  * \ingroup g_cci
  *
@@ -102,13 +484,13 @@ unsigned int cci_clock_status(cci_t cci)
 	if ( cci->i_ops != &_contact_ops )
 		return CHIPCARD_NOT_PRESENT;
 
-	if ( !_PC_to_RDR_GetSlotStatus(ccid, cci->i_idx, ccid->d_xfr) )
+	if ( !_PC_to_RDR_GetSlotStatus(ccid, cci->i_idx, cci->i_xfr) )
 		return CHIPCARD_CLOCK_ERR;
 
-	if ( !_RDR_to_PC(ccid, cci->i_idx, ccid->d_xfr) )
+	if ( !_RDR_to_PC(ccid, cci->i_idx, cci->i_xfr) )
 		return CHIPCARD_CLOCK_ERR;
 
-	return _RDR_to_PC_SlotStatus(ccid, ccid->d_xfr);
+	return _RDR_to_PC_SlotStatus(ccid, cci->i_xfr);
 }
 
 /** Wait for insertion of a chip card in to the slot.
@@ -116,24 +498,51 @@ unsigned int cci_clock_status(cci_t cci)
  *
  * @param cci \ref cci_t to wait on.
  *
- * @return Always succeeds and returns 1.
+ * Sleeps on the interrupt endpoint until the CCID notifies us of a change in
+ * slot status. Devices without an interrupt endpoint are polled.
+ *
+ * @return zero on failure.
  */
 int cci_wait_for_card(cci_t cci)
 {
 	struct _ccid *ccid = cci->i_parent;
+	int rc, intr;
+
+	/* start listening before checking so no insertion is missed */
+	intr = _ccid_intr_start(ccid);
+
+	if ( !_PC_to_RDR_GetSlotStatus(ccid, cci->i_idx, cci->i_xfr) )
+		return 0;
+	if ( !_RDR_to_PC(ccid, cci->i_idx, cci->i_xfr) )
+		return 0;
+
+	while( cci->i_status == CHIPCARD_NOT_PRESENT ) {
+		if ( !intr ) {
+			usleep(250000);
+			if ( !_PC_to_RDR_GetSlotStatus(ccid, cci->i_idx,
+							cci->i_xfr) )
+				return 0;
+			if ( !_RDR_to_PC(ccid, cci->i_idx, cci->i_xfr) )
+				return 0;
+			continue;
+		}
+
+		rc = libusb_handle_events(_libccid_ctx());
+		if ( rc && rc != LIBUSB_ERROR_INTERRUPTED )
+			return 0;
+
+		/* listener stops if the device goes away */
+		if ( !_ccid_intr_start(ccid) )
+			return 0;
+	}
 
-	do {
-		_PC_to_RDR_GetSlotStatus(ccid, cci->i_idx, ccid->d_xfr);
-		_RDR_to_PC(ccid, cci->i_idx, ccid->d_xfr);
-		if ( cci->i_status != CHIPCARD_NOT_PRESENT )
-			break;
-		_cci_wait_for_interrupt(ccid);
-	} while( cci->i_status == CHIPCARD_NOT_PRESENT );
 	return 1;
 }
 
 _private const struct _cci_ops _contact_ops = {
 	.power_on = contact_power_on,
 	.power_off = contact_power_off,
+	.warm_reset = contact_warm_reset,
 	.transact = contact_transact,
+	.submit = contact_submit,
 };
@@ -7,6 +7,8 @@
 */
 
 #include <ccid.h>
+#include <ber.h>
+#include <unistd.h>
 
 #include "ccid-internal.h"
 #include "rfid-internal.h"
@@ -21,20 +23,12 @@
 #define dhex_dump(a, b, c) do {} while(0)
 #endif
 
-static int do_select(struct _cci *cci)
+/* Bring up layer 3 on the tag which was just selected in to rf_tag */
+static int do_activate(struct _cci *cci)
 {
 	struct _rfid *rf = cci->i_priv;
 	int ret;
 
-	memset(&rf->rf_tag, 0, sizeof(rf->rf_tag));
-	memset(&rf->rf_l3p, 0, sizeof(rf->rf_l3p));
-	rf->rf_l3 = NULL;
-
-	if ( !_iso14443a_anticol(cci, 0, &rf->rf_tag) ) {
-		cci->i_status = CHIPCARD_NOT_PRESENT;
-		return 0;
-	}
-
 	cci->i_status = CHIPCARD_ACTIVE;
 
 	dprintf("Found ISO-14443-A tag: cascade level %d\n",
@@ -42,6 +36,8 @@ static int do_select(struct _cci *cci)
 	dhex_dump(rf->rf_tag.uid, rf->rf_tag.uid_len, 16);
 
 	if ( rf->rf_tag.tcl_capable ) {
+		rf->rf_l3p.tcl.max_kbps = rf->rf_max_kbps;
+		rf->rf_l3p.tcl.max_fsd = rf->rf_max_fsd;
 		ret = _tcl_get_ats(cci, &rf->rf_tag, &rf->rf_l3p.tcl);
 		if ( ret )
 			rf->rf_l3 = (rfid_l3_t)_tcl_transact;
@@ -64,13 +60,52 @@ static int do_select(struct _cci *cci)
 	return 0;
 }
 
+static void reset_l3(struct _rfid *rf)
+{
+	memset(&rf->rf_l3p, 0, sizeof(rf->rf_l3p));
+	rf->rf_l3 = NULL;
+}
+
+static int do_select(struct _cci *cci)
+{
+	struct _rfid *rf = cci->i_priv;
+
+	reset_l3(rf);
+
+	if ( !_iso14443a_anticol(cci, 0, &rf->rf_tag) ) {
+		cci->i_status = CHIPCARD_NOT_PRESENT;
+		return 0;
+	}
+
+	return do_activate(cci);
+}
+
+/* Switch on the field and set up for ISO 14443-A, unless it's still that way
+ * from last time. An active card may have left the ASIC at a higher bit
+ * rate so start afresh after one.
+ */
+static int field_up(struct _cci *cci)
+{
+	struct _rfid *rf = cci->i_priv;
+
+	if ( rf->rf_ready && cci->i_status != CHIPCARD_ACTIVE )
+		return 1;
+
+	rf->rf_ready = 0;
+	if ( !_rfid_layer1_rf_power(cci, 1) )
+		return 0;
+	if ( !_rfid_layer1_14443a_init(cci) )
+		return 0;
+
+	rf->rf_ready = 1;
+	return 1;
+}
+
 static const uint8_t *rfid_power_on(struct _cci *cci, unsigned int voltage,
 				size_t *atr_len)
 {
 	struct _ccid *ccid = cci->i_parent;
-	if ( !_rfid_layer1_rf_power(cci, 1) )
-		return NULL;
-	if ( !_rfid_layer1_14443a_init(cci) )
+	if ( !field_up(cci) )
 		return NULL;
 	if ( !do_select(cci) )
 		return NULL;
@@ -81,10 +116,50 @@ static const uint8_t *rfid_power_on(struct _cci *cci, unsigned int voltage,
 
 static int rfid_power_off(struct _cci *cci)
 {
+	struct _rfid *rf = cci->i_priv;
+
 	cci->i_status = CHIPCARD_NOT_PRESENT;
+	rf->rf_ready = 0;
 	return _rfid_layer1_rf_power(cci, 0);
 }
 
+/* Cycle the field and wake the same card again by its UID, which skips the
+ * anticollision. ISO 14443-4 cards still need a fresh RATS.
+ */
+static const uint8_t *rfid_warm_reset(struct _cci *cci, size_t *atr_len)
+{
+	struct _ccid *ccid = cci->i_parent;
+	struct _rfid *rf = cci->i_priv;
+
+	if ( NULL == rf || cci->i_status != CHIPCARD_ACTIVE ||
+			!rf->rf_tag.uid_len )
+		return NULL;
+
+	if ( !_rfid_layer1_rf_power(cci, 0) )
+		return NULL;
+	rf->rf_ready = 0;
+	if ( !field_up(cci) )
+		return NULL;
+
+	reset_l3(rf);
+	if ( !_iso14443a_select(cci, &rf->rf_tag) ) {
+		cci->i_status = CHIPCARD_NOT_PRESENT;
+		return NULL;
+	}
+
+	if ( !rf->rf_tag.tcl_capable ) {
+		if ( atr_len )
+			*atr_len = 0;
+		return ccid->d_xfr->x_rxbuf;
+	}
+
+	if ( !do_activate(cci) )
+		return NULL;
+	if ( atr_len )
+		*atr_len = ccid->d_xfr->x_rxlen;
+	return ccid->d_xfr->x_rxbuf;
+}
+
 static int rfid_transact(struct _cci *cci, struct _xfr *xfr)
 {
 	struct _rfid *rf = cci->i_priv;
@@ -114,9 +189,490 @@ static void rfid_dtor(struct _cci *cci)
 	cci->i_priv = NULL;
 }
 
+/** Limit the bit rate and frame size negotiated with contactless cards.
+ * \ingroup g_cci
+ * @param cci \ref cci_t of an RF field.
+ * @param max_kbps Highest bit rate to use (106, 212, 424 or 848), or zero
+ * for no limit.
+ * @param max_fsd Largest frame the card may send, or zero for no limit.
+ *
+ * By default the fastest rate and biggest frames which both the reader and
+ * card support are chosen. Limits take effect at the next power on.
+ *
+ * @return zero if cci is not an RF field.
+ */
+int cci_rf_set_limits(cci_t cci, unsigned int max_kbps, size_t max_fsd)
+{
+	struct _rfid *rf;
+
+	if ( cci->i_ops != &_rfid_ops || NULL == cci->i_priv ) {
+		cci->i_parent->d_error = CCID_ERROR_IN_VALUE;
+		return 0;
+	}
+
+	rf = cci->i_priv;
+	rf->rf_max_kbps = max_kbps;
+	rf->rf_max_fsd = max_fsd;
+	return 1;
+}
+
+/** Retrieve the parameters negotiated with a contactless card.
+ * \ingroup g_cci
+ * @param cci \ref cci_t of an RF field.
+ * @param kbps Returns the bit rate in use, the same in both directions.
+ * @param fsd Returns the largest frame the card may send.
+ * @param fsc Returns the largest frame which will be sent to the card.
+ *
+ * @return zero if there is no ISO 14443-4 card active in the field.
+ */
+int cci_rf_params(cci_t cci, unsigned int *kbps, size_t *fsd, size_t *fsc)
+{
+	struct _rfid *rf;
+
+	if ( cci->i_ops != &_rfid_ops || NULL == cci->i_priv ) {
+		cci->i_parent->d_error = CCID_ERROR_IN_VALUE;
+		return 0;
+	}
+
+	rf = cci->i_priv;
+	if ( rf->rf_l3 != (rfid_l3_t)_tcl_transact )
+		return 0;
+
+	if ( kbps )
+		*kbps = rf->rf_l3p.tcl.kbps;
+	if ( fsd )
+		*fsd = rf->rf_l3p.tcl.fsd;
+	if ( fsc )
+		*fsc = rf->rf_l3p.tcl.fsc;
+	return 1;
+}
+
+/** Exchange a command with an ISO 14443-4 card, streaming the response.
+ * \ingroup g_cci
+ * @param cci \ref cci_t of an RF field.
+ * @param tx Command to send.
+ * @param tx_len Length of command.
+ * @param cb Function to receive the response.
+ * @param priv Private data pointer passed to the callback.
+ *
+ * The response is passed to cb in pieces, one per frame of a chained
+ * response, so there is no limit on its size and it needn't be buffered.
+ *
+ * @return zero on failure or if cb aborted the exchange.
+ */
+int cci_rf_transact_stream(cci_t cci, const uint8_t *tx, size_t tx_len,
+				cci_rf_rx_cb_t cb, void *priv)
+{
+	struct _rfid *rf;
+
+	if ( cci->i_ops != &_rfid_ops || NULL == cci->i_priv ) {
+		cci->i_parent->d_error = CCID_ERROR_IN_VALUE;
+		return 0;
+	}
+
+	rf = cci->i_priv;
+	if ( rf->rf_l3 != (rfid_l3_t)_tcl_transact ) {
+		cci->i_parent->d_error = CCID_ERROR_IN_VALUE;
+		return 0;
+	}
+
+	return _tcl_transact_cb(cci, &rf->rf_tag, &rf->rf_l3p.tcl,
+				tx, tx_len, cb, priv);
+}
+
+/* Everything but the status word goes to the parser as it arrives, the last
+ * two bytes seen are held back in case they are the end of the response.
+ */
+struct ber_rx {
+	struct ber_stream	*r_s;
+	uint8_t			r_sw[2];
+	unsigned int		r_held;
+};
+
+static int ber_rx(void *priv, const uint8_t *buf, size_t len)
+{
+	struct ber_rx *r = priv;
+
+	if ( len >= 2 ) {
+		if ( !ber_stream_feed(r->r_s, r->r_sw, r->r_held) ||
+				!ber_stream_feed(r->r_s, buf, len - 2) )
+			return 0;
+		memcpy(r->r_sw, buf + len - 2, 2);
+		r->r_held = 2;
+		return 1;
+	}
+
+	if ( !len )
+		return 1;
+
+	if ( r->r_held == 2 ) {
+		if ( !ber_stream_feed(r->r_s, r->r_sw, 1) )
+			return 0;
+		r->r_sw[0] = r->r_sw[1];
+		r->r_held = 1;
+	}
+	r->r_sw[r->r_held++] = buf[0];
+	return 1;
+}
+
+/** Exchange a command with an ISO 14443-4 card, parsing the response.
+ * \ingroup g_cci
+ * @param cci \ref cci_t of an RF field.
+ * @param tx Command to send.
+ * @param tx_len Length of command.
+ * @param s BER stream, initialised by the caller with ber_stream_init().
+ * @param sw Returns the status word.
+ *
+ * As for \ref cci_rf_transact_stream, but the response data is fed to s
+ * one frame at a time as the card sends them, so the TLV callbacks run as
+ * it arrives and no reassembly buffer is needed. The status word is not fed.
+ *
+ * @return zero on failure, if the stream refused the data, or if it didn't
+ * end on a complete TLV.
+ */
+int cci_rf_transact_ber(cci_t cci, const uint8_t *tx, size_t tx_len,
+				struct ber_stream *s, uint16_t *sw)
+{
+	struct ber_rx r = {
+		.r_s = s,
+	};
+
+	if ( !cci_rf_transact_stream(cci, tx, tx_len, ber_rx, &r) )
+		return 0;
+	if ( r.r_held != 2 || !ber_stream_finish(s) )
+		return 0;
+
+	if ( sw )
+		*sw = (r.r_sw[0] << 8) | r.r_sw[1];
+	return 1;
+}
+
+static void rf_status(struct _cci *cci, unsigned int status)
+{
+	struct _ccid *ccid = cci->i_parent;
+
+	if ( cci->i_status == status )
+		return;
+
+	cci->i_status = status;
+	if ( ccid->d_slot_cb )
+		(*ccid->d_slot_cb)(cci, status, ccid->d_slot_priv);
+}
+
+static int rf_probe(struct _cci *cci)
+{
+	if ( cci->i_status == CHIPCARD_ACTIVE )
+		return 1;
+
+	if ( !field_up(cci) )
+		return 0;
+
+	rf_status(cci, _iso14443a_present(cci, 0) ?
+			CHIPCARD_PRESENT : CHIPCARD_NOT_PRESENT);
+	return 1;
+}
+
+/** Check for a contactless card with minimal overhead.
+ * \ingroup g_cci
+ * @param cci \ref cci_t of an RF field.
+ *
+ * The field is left on and set up between calls so that each check is just
+ * a REQA, and a HLTA if something answered. Changes are reported through the
+ * callback set with \ref ccid_slot_notify, just like contact card insertion
+ * and removal. An active card is not disturbed.
+ *
+ * @return the new status, CHIPCARD_NOT_PRESENT on error.
+ */
+unsigned int cci_rf_poll(cci_t cci)
+{
+	if ( cci->i_ops != &_rfid_ops || NULL == cci->i_priv ) {
+		cci->i_parent->d_error = CCID_ERROR_IN_VALUE;
+		return CHIPCARD_NOT_PRESENT;
+	}
+
+	if ( !rf_probe(cci) )
+		return CHIPCARD_NOT_PRESENT;
+
+	return cci->i_status;
+}
+
+/** Wait for a contactless card and activate it.
+ * \ingroup g_cci
+ * @param cci \ref cci_t of an RF field.
+ * @param interval_ms Time between checks in milliseconds.
+ * @param timeout_ms Maximum time to wait in milliseconds, or -1 for forever.
+ * @param ats_len Returns the length of the ATS.
+ *
+ * Polls as for \ref cci_rf_poll and only runs the full anticollision and
+ * activation, as for \ref cci_power_on, once a card answers.
+ *
+ * @return NULL on failure or timeout, or the ATS which is empty for cards
+ * which do not support ISO 14443-4.
+ */
+const uint8_t *cci_rf_wait(cci_t cci, unsigned int interval_ms,
+				int timeout_ms, size_t *ats_len)
+{
+	struct _ccid *ccid = cci->i_parent;
+	struct _rfid *rf;
+	uint64_t deadline;
+
+	if ( cci->i_ops != &_rfid_ops || NULL == cci->i_priv ||
+			cci->i_status == CHIPCARD_ACTIVE ) {
+		ccid->d_error = CCID_ERROR_IN_VALUE;
+		return NULL;
+	}
+
+	rf = cci->i_priv;
+	deadline = _cci_now_msec() + ((timeout_ms < 0) ? 0 : timeout_ms);
+
+	for(;;) {
+		if ( !rf_probe(cci) )
+			return NULL;
+		if ( cci->i_status == CHIPCARD_PRESENT )
+			break;
+		if ( timeout_ms >= 0 && _cci_now_msec() >= deadline )
+			return NULL;
+		usleep(interval_ms * 1000);
+	}
+
+	if ( !do_select(cci) ) {
+		if ( cci->i_status != CHIPCARD_ACTIVE ||
+				rf->rf_tag.tcl_capable )
+			return NULL;
+		if ( ats_len )
+			*ats_len = 0;
+		return _cci_save_atr(cci, ccid->d_xfr->x_rxbuf, 0);
+	}
+
+	if ( ats_len )
+		*ats_len = ccid->d_xfr->x_rxlen;
+	return _cci_save_atr(cci, ccid->d_xfr->x_rxbuf, ccid->d_xfr->x_rxlen);
+}
+
+/** Find all the contactless cards in the field.
+ * \ingroup g_cci
+ * @param cci \ref cci_t of an RF field.
+ * @param tags Array to fill in with the cards found.
+ * @param max Number of entries in the tags array.
+ * @param num Returns the number of cards found.
+ *
+ * Switches on the field and walks the whole ISO 14443-3 A anticollision tree
+ * without ever cycling the field. Each card is halted as soon as its UID is
+ * known, so \ref cci_rf_activate can then pick out any of them. The ATQA is
+ * as received, it is the OR of all cards which answered at the same time.
+ *
+ * @return zero on failure.
+ */
+int cci_rf_inventory(cci_t cci, struct cci_rf_tag *tags, unsigned int max,
+			unsigned int *num)
+{
+	struct _rfid *rf;
+	struct rfid_tag *found;
+	unsigned int i, n;
+	int ret = 0;
+
+	if ( cci->i_ops != &_rfid_ops || NULL == cci->i_priv ) {
+		cci->i_parent->d_error = CCID_ERROR_IN_VALUE;
+		return 0;
+	}
+
+	rf = cci->i_priv;
+	*num = 0;
+	if ( !max )
+		return 1;
+
+	found = calloc(max, sizeof(*found));
+	if ( NULL == found ) {
+		cci->i_parent->d_error = CCID_ERROR_NO_MEM;
+		return 0;
+	}
+
+	if ( !field_up(cci) )
+		goto out;
+
+	/* anything that was active is about to be halted */
+	reset_l3(rf);
+	memset(&rf->rf_tag, 0, sizeof(rf->rf_tag));
+	cci->i_status = CHIPCARD_NOT_PRESENT;
+
+	if ( !_iso14443a_inventory(cci, found, max, &n) )
+		goto out;
+
+	for(i = 0; i < n; i++) {
+		memset(&tags[i], 0, sizeof(tags[i]));
+		memcpy(tags[i].t_uid, found[i].uid, found[i].uid_len);
+		tags[i].t_uid_len = found[i].uid_len;
+		memcpy(tags[i].t_atqa, found[i].atqa, sizeof(tags[i].t_atqa));
+		tags[i].t_sak = found[i].sak;
+	}
+
+	*num = n;
+	ret = 1;
+out:
+	free(found);
+	return ret;
+}
+
+/** Activate one of the cards found by \ref cci_rf_inventory.
+ * \ingroup g_cci
+ * @param cci \ref cci_t of an RF field.
+ * @param tag The card to activate.
+ * @param ats_len Returns the length of the ATS.
+ *
+ * The card is woken up and selected by its UID, any other card in the field
+ * stays put. ISO 14443-4 cards then have their ATS read and are ready for
+ * \ref cci_transact as if they had been found by \ref cci_power_on.
+ *
+ * @return NULL on failure, or the ATS which is empty for cards which do not
+ * support ISO 14443-4.
+ */
+const uint8_t *cci_rf_activate(cci_t cci, const struct cci_rf_tag *tag,
+				size_t *ats_len)
+{
+	struct _ccid *ccid = cci->i_parent;
+	struct _rfid *rf;
+
+	if ( cci->i_ops != &_rfid_ops || NULL == cci->i_priv ||
+			tag->t_uid_len > sizeof(rf->rf_tag.uid) ) {
+		ccid->d_error = CCID_ERROR_IN_VALUE;
+		return NULL;
+	}
+
+	rf = cci->i_priv;
+	reset_l3(rf);
+
+	memset(&rf->rf_tag, 0, sizeof(rf->rf_tag));
+	memcpy(rf->rf_tag.uid, tag->t_uid, tag->t_uid_len);
+	rf->rf_tag.uid_len = tag->t_uid_len;
+	memcpy(rf->rf_tag.atqa, tag->t_atqa, sizeof(rf->rf_tag.atqa));
+
+	if ( !_iso14443a_select(cci, &rf->rf_tag) ) {
+		cci->i_status = CHIPCARD_NOT_PRESENT;
+		return NULL;
+	}
+
+	if ( !rf->rf_tag.tcl_capable ) {
+		cci->i_status = CHIPCARD_ACTIVE;
+		if ( ats_len )
+			*ats_len = 0;
+		return _cci_save_atr(cci, ccid->d_xfr->x_rxbuf, 0);
+	}
+
+	if ( !do_activate(cci) )
+		return NULL;
+	if ( ats_len )
+		*ats_len = ccid->d_xfr->x_rxlen;
+	return _cci_save_atr(cci, ccid->d_xfr->x_rxbuf, ccid->d_xfr->x_rxlen);
+}
+
+/* The selected tag, if it's one for the Mifare Classic calls */
+static struct _rfid *mfc_tag(struct _cci *cci, unsigned int sector,
+				unsigned int num, size_t len)
+{
+	struct _rfid *rf;
+
+	if ( cci->i_ops != &_rfid_ops || NULL == cci->i_priv )
+		goto err;
+
+	rf = cci->i_priv;
+	if ( cci->i_status != CHIPCARD_ACTIVE ||
+			rf->rf_tag.layer2 != RFID_LAYER2_ISO14443A ||
+			rf->rf_tag.tcl_capable )
+		goto err;
+
+	if ( !num || num > CCI_MFC_MAX_SECTORS ||
+			sector > CCI_MFC_MAX_SECTORS - num ||
+			len < _mfc_sectors_size(sector, num) )
+		goto err;
+
+	return rf;
+err:
+	cci->i_parent->d_error = CCID_ERROR_IN_VALUE;
+	return NULL;
+}
+
+/** Size of the buffer needed for a range of Mifare Classic sectors.
+ * \ingroup g_cci
+ * @param sector First sector.
+ * @param num Number of sectors.
+ *
+ * The first 32 sectors have 4 blocks each, any after that have 16.
+ *
+ * @return size in bytes.
+ */
+size_t cci_mfc_sectors_size(unsigned int sector, unsigned int num)
+{
+	return _mfc_sectors_size(sector, num);
+}
+
+/** Read whole sectors from a Mifare Classic card.
+ * \ingroup g_cci
+ * @param cci \ref cci_t of an RF field with an active Mifare Classic card.
+ * @param sector First sector to read.
+ * @param num Number of sectors to read.
+ * @param keys One key for each sector.
+ * @param buf Buffer for the blocks of every sector, back to back.
+ * @param len Size of buf, see \ref cci_mfc_sectors_size.
+ * @param done Returns a bitmap of the sectors which were read.
+ *
+ * Each sector is authenticated once and then all of its blocks read. The
+ * keys are converted for the reader in advance and authentication is skipped
+ * when the sector is already authenticated with the same key, for example by
+ * the previous call. Sectors which fail are filled with zeros and the card is
+ * selected again so that the rest can still be read.
+ *
+ * @return zero on failure, including if the card was lost.
+ */
+int cci_mfc_read(cci_t cci, unsigned int sector, unsigned int num,
+			const struct cci_mfc_key *keys,
+			uint8_t *buf, size_t len, uint64_t *done)
+{
+	struct _rfid *rf;
+
+	*done = 0;
+	rf = mfc_tag(cci, sector, num, len);
+	if ( NULL == rf )
+		return 0;
+
+	return _mfc_read_sectors(cci, &rf->rf_tag, &rf->rf_l3p.mfc,
+				sector, num, keys, buf, done);
+}
+
+/** Write whole sectors to a Mifare Classic card.
+ * \ingroup g_cci
+ * @param cci \ref cci_t of an RF field with an active Mifare Classic card.
+ * @param sector First sector to write.
+ * @param num Number of sectors to write.
+ * @param keys One key for each sector.
+ * @param buf The blocks of every sector, back to back, laid out as for
+ * \ref cci_mfc_read.
+ * @param len Size of buf.
+ * @param done Returns a bitmap of the sectors which were written.
+ *
+ * As for \ref cci_mfc_read except that the manufacturer block and the sector
+ * trailers, which hold the keys and access bits, are skipped.
+ *
+ * @return zero on failure, including if the card was lost.
+ */
+int cci_mfc_write(cci_t cci, unsigned int sector, unsigned int num,
+			const struct cci_mfc_key *keys,
+			const uint8_t *buf, size_t len, uint64_t *done)
+{
+	struct _rfid *rf;
+
+	*done = 0;
+	rf = mfc_tag(cci, sector, num, len);
+	if ( NULL == rf )
+		return 0;
+
+	return _mfc_write_sectors(cci, &rf->rf_tag, &rf->rf_l3p.mfc,
+				sector, num, keys, buf, done);
+}
+
 _private const struct _cci_ops _rfid_ops = {
 	.power_on = rfid_power_on,
 	.power_off = rfid_power_off,
+	.warm_reset = rfid_warm_reset,
 	.transact = rfid_transact,
 	.dtor = rfid_dtor,
 };
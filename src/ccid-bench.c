@@ -0,0 +1,525 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2008 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Measure APDU throughput and latency of readers. Used to qualify new
+ * reader models and catch performance regressions in the library.
+*/
+
+#include <ccid.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#define BENCH_MAX_TARGETS	32
+#define BENCH_DEFAULT_COUNT	1000
+#define BENCH_MAX_CMD		261
+#define BENCH_MAX_TAGS		8
+#define BENCH_DEFAULT_SAK	0x20
+
+#define WL_SELECT	0
+#define WL_READ		1
+#define WL_ESCAPE	2
+
+struct workload {
+	unsigned int w_type;
+	uint8_t w_data[BENCH_MAX_CMD];
+	size_t w_len;
+	unsigned int w_size;
+};
+
+struct target {
+	unsigned int t_field;
+	unsigned int t_idx;
+};
+
+struct result {
+	unsigned int r_count;
+	unsigned int r_fail;
+	unsigned int r_sw_err;
+	uint64_t r_bytes;
+	uint64_t r_usec;
+	uint32_t *r_lat;
+	struct ccid_sim_stats r_sim;
+	int r_sim_ok;
+};
+
+static const char *wl_name[] = {
+	[WL_SELECT] = "select",
+	[WL_READ] = "read",
+	[WL_ESCAPE] = "escape",
+};
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int parse_hex(const char *str, uint8_t *buf, size_t max, size_t *len)
+{
+	unsigned int hi, lo;
+	size_t i;
+
+	for(i = 0; str[0] && str[1]; i++, str += 2) {
+		if ( i >= max )
+			return 0;
+		if ( sscanf(str, "%1x%1x", &hi, &lo) != 2 )
+			return 0;
+		buf[i] = (hi << 4) | lo;
+	}
+
+	*len = i;
+	return (str[0] == '\0');
+}
+
+static int parse_workload(struct workload *w, const char *str)
+{
+	const char *arg;
+
+	arg = strchr(str, ':');
+	if ( arg )
+		arg++;
+
+	if ( !strncmp(str, "select", 6) ) {
+		w->w_type = WL_SELECT;
+		if ( NULL == arg ) {
+			/* EMV payment system environment */
+			memcpy(w->w_data, "1PAY.SYS.DDF01", 14);
+			w->w_len = 14;
+			return 1;
+		}
+		return parse_hex(arg, w->w_data, 0xff, &w->w_len) && w->w_len;
+	}
+
+	if ( !strncmp(str, "read", 4) ) {
+		w->w_type = WL_READ;
+		w->w_size = (arg) ? strtoul(arg, NULL, 0) : 0x100;
+		return (w->w_size > 0 && w->w_size <= 0x100);
+	}
+
+	if ( !strncmp(str, "escape", 6) ) {
+		w->w_type = WL_ESCAPE;
+		if ( NULL == arg )
+			return 0;
+		return parse_hex(arg, w->w_data, sizeof(w->w_data), &w->w_len);
+	}
+
+	return 0;
+}
+
+/* <uid>[:sak], for the simulator */
+static int parse_tag(struct ccid_sim_tag *tag, const char *str)
+{
+	char hex[2 * sizeof(tag->t_uid) + 1];
+	const char *arg;
+	size_t len;
+
+	memset(tag, 0, sizeof(*tag));
+	tag->t_sak = BENCH_DEFAULT_SAK;
+
+	arg = strchr(str, ':');
+	len = (arg) ? (size_t)(arg - str) : strlen(str);
+	if ( len >= sizeof(hex) )
+		return 0;
+	memcpy(hex, str, len);
+	hex[len] = '\0';
+
+	if ( arg )
+		tag->t_sak = strtoul(arg + 1, NULL, 16);
+
+	return parse_hex(hex, tag->t_uid, sizeof(tag->t_uid),
+				&tag->t_uid_len) &&
+		(tag->t_uid_len == 4 || tag->t_uid_len == 7 ||
+		 tag->t_uid_len == 10);
+}
+
+/* Build the next command, returns number of bytes sent */
+static size_t build_cmd(const struct workload *w, xfr_t xfr, size_t *ofs)
+{
+	xfr_reset(xfr);
+
+	switch(w->w_type) {
+	case WL_SELECT:
+		xfr_tx_byte(xfr, 0x00);
+		xfr_tx_byte(xfr, 0xa4);
+		xfr_tx_byte(xfr, 0x04);
+		xfr_tx_byte(xfr, 0x00);
+		xfr_tx_byte(xfr, w->w_len);
+		xfr_tx_buf(xfr, w->w_data, w->w_len);
+		xfr_tx_byte(xfr, 0x00);
+		return 6 + w->w_len;
+	case WL_READ:
+		if ( *ofs > 0x7fff )
+			*ofs = 0;
+		xfr_tx_byte(xfr, 0x00);
+		xfr_tx_byte(xfr, 0xb0);
+		xfr_tx_byte(xfr, *ofs >> 8);
+		xfr_tx_byte(xfr, *ofs & 0xff);
+		xfr_tx_byte(xfr, w->w_size & 0xff);
+		return 5;
+	case WL_ESCAPE:
+		xfr_tx_buf(xfr, w->w_data, w->w_len);
+		return w->w_len;
+	default:
+		abort();
+	}
+}
+
+static int do_one(const struct workload *w, ccid_t ccid, cci_t cci,
+			const struct target *t, xfr_t xfr, size_t *ofs,
+			struct result *r)
+{
+	const uint8_t *rbuf;
+	uint64_t start, lat;
+	size_t tlen, rlen;
+	uint8_t sw1;
+
+	tlen = build_cmd(w, xfr, ofs);
+
+	start = now_usec();
+	if ( w->w_type == WL_ESCAPE ) {
+		rbuf = ccid_escape(ccid, (t->t_field) ? 0 : t->t_idx,
+					xfr, &rlen);
+		lat = now_usec() - start;
+		if ( NULL == rbuf )
+			return 0;
+	}else{
+		if ( !cci_transact(cci, xfr) )
+			return 0;
+		lat = now_usec() - start;
+		rbuf = xfr_rx_data(xfr, &rlen);
+		if ( NULL == rbuf )
+			return 0;
+		rlen += 2;
+	}
+
+	r->r_lat[r->r_count++] = (lat > UINT32_MAX) ? UINT32_MAX : lat;
+	r->r_usec += lat;
+	r->r_bytes += tlen + rlen;
+
+	if ( w->w_type == WL_ESCAPE )
+		return 1;
+
+	sw1 = xfr_rx_sw1(xfr);
+	if ( sw1 != 0x90 && sw1 != 0x61 ) {
+		r->r_sw_err++;
+		/* ran off the end of the file, start the sweep again */
+		if ( w->w_type == WL_READ && *ofs ) {
+			*ofs = 0;
+			return 1;
+		}
+	}
+
+	if ( w->w_type == WL_READ )
+		*ofs += w->w_size;
+
+	return 1;
+}
+
+static int lat_cmp(const void *A, const void *B)
+{
+	const uint32_t *a = A, *b = B;
+	return (*a > *b) - (*a < *b);
+}
+
+static uint32_t percentile(const struct result *r, unsigned int permille)
+{
+	unsigned int i;
+
+	if ( 0 == r->r_count )
+		return 0;
+
+	i = ((uint64_t)r->r_count * permille + 999) / 1000;
+	if ( i )
+		i--;
+	return r->r_lat[i];
+}
+
+static void report(const struct workload *w, ccid_t ccid,
+			const struct target *t, struct result *r, int machine)
+{
+	double secs, tps, bps;
+
+	qsort(r->r_lat, r->r_count, sizeof(*r->r_lat), lat_cmp);
+
+	secs = r->r_usec / 1000000.0;
+	tps = (secs > 0) ? r->r_count / secs : 0;
+	bps = (secs > 0) ? r->r_bytes / secs : 0;
+
+	if ( machine ) {
+		printf("%u\t%u\t%s\t%s\t%u\t%s\t%u\t%u\t%u\t%llu\t%.6f"
+			"\t%.1f\t%.1f\t%u\t%u\t%u\t%u",
+			ccid_bus(ccid), ccid_addr(ccid), ccid_name(ccid),
+			(t->t_field) ? "field" : "slot", t->t_idx,
+			wl_name[w->w_type], r->r_count, r->r_fail,
+			r->r_sw_err, (unsigned long long)r->r_bytes,
+			secs, tps, bps,
+			percentile(r, 500), percentile(r, 990),
+			percentile(r, 999),
+			(r->r_count) ? r->r_lat[r->r_count - 1] : 0);
+		if ( r->r_sim_ok )
+			printf("\t%llu\t%llu\t%llu\t%llu",
+				(unsigned long long)r->r_sim.s_escapes,
+				(unsigned long long)r->r_sim.s_regs_read,
+				(unsigned long long)r->r_sim.s_regs_written,
+				(unsigned long long)r->r_sim.s_fifo_bytes);
+		printf("\n");
+		return;
+	}
+
+	printf("%s %u.%u %s %u: %s\n", ccid_name(ccid),
+		ccid_bus(ccid), ccid_addr(ccid),
+		(t->t_field) ? "field" : "slot", t->t_idx,
+		wl_name[w->w_type]);
+	printf("  %u transactions in %.3fs, %u failed, %u bad status\n",
+		r->r_count, secs, r->r_fail, r->r_sw_err);
+	printf("  %.1f xfr/s, %.1f bytes/s\n", tps, bps);
+	printf("  latency p50 %uus, p99 %uus, p99.9 %uus, max %uus\n",
+		percentile(r, 500), percentile(r, 990), percentile(r, 999),
+		(r->r_count) ? r->r_lat[r->r_count - 1] : 0);
+	if ( r->r_sim_ok )
+		printf("  RC632 %llu escapes (%.1f per xfr), %llu reads, "
+			"%llu writes, %llu FIFO bytes\n",
+			(unsigned long long)r->r_sim.s_escapes,
+			(r->r_count) ?
+				(double)r->r_sim.s_escapes / r->r_count : 0,
+			(unsigned long long)r->r_sim.s_regs_read,
+			(unsigned long long)r->r_sim.s_regs_written,
+			(unsigned long long)r->r_sim.s_fifo_bytes);
+}
+
+static int bench_target(const struct workload *w, ccid_t ccid,
+			const struct target *t, unsigned int count,
+			int machine)
+{
+	struct result r;
+	const uint8_t *atr;
+	size_t atr_len, ofs = 0;
+	unsigned int i;
+	xfr_t xfr;
+	cci_t cci;
+	int ret = 0;
+
+	cci = (t->t_field) ? ccid_get_field(ccid, t->t_idx) :
+				ccid_get_slot(ccid, t->t_idx);
+	if ( NULL == cci ) {
+		fprintf(stderr, "%s: no %s %u\n", ccid_name(ccid),
+			(t->t_field) ? "field" : "slot", t->t_idx);
+		return 0;
+	}
+
+	memset(&r, 0, sizeof(r));
+	r.r_lat = calloc(count, sizeof(*r.r_lat));
+	if ( NULL == r.r_lat )
+		return 0;
+
+	xfr = xfr_alloc(BENCH_MAX_CMD, 0x102);
+	if ( NULL == xfr )
+		goto out_free;
+	xfr_auto_response(xfr, 1);
+
+	if ( w->w_type != WL_ESCAPE ) {
+		atr = cci_power_on(cci, CHIPCARD_AUTO_VOLTAGE, &atr_len);
+		if ( NULL == atr ) {
+			fprintf(stderr, "%s: %s %u: power on failed\n",
+				ccid_name(ccid),
+				(t->t_field) ? "field" : "slot", t->t_idx);
+			goto out_xfr;
+		}
+	}
+
+	/* only count the workload, not finding the card */
+	r.r_sim_ok = ccid_sim_stats_reset(ccid);
+
+	for(i = 0; i < count; i++) {
+		if ( !do_one(w, ccid, cci, t, xfr, &ofs, &r) ) {
+			r.r_fail++;
+			if ( cci_error(cci) == CCID_ERROR_DEVICE_REMOVED ||
+					cci_error(cci) == CCID_ERROR_NO_CARD )
+				break;
+		}
+	}
+
+	if ( r.r_sim_ok )
+		ccid_sim_stats(ccid, &r.r_sim);
+
+	report(w, ccid, t, &r, machine);
+	ret = 1;
+
+	if ( w->w_type != WL_ESCAPE )
+		cci_power_off(cci);
+out_xfr:
+	xfr_free(xfr);
+out_free:
+	free(r.r_lat);
+	return ret;
+}
+
+static int bench_ccid(const struct workload *w, ccid_t ccid,
+			const struct target *t, unsigned int num_t,
+			unsigned int count, int machine)
+{
+	struct target def;
+	unsigned int i;
+	int ret = 1;
+
+	if ( num_t ) {
+		for(i = 0; i < num_t; i++) {
+			if ( !bench_target(w, ccid, t + i, count, machine) )
+				ret = 0;
+		}
+		return ret;
+	}
+
+	/* default to every slot with a card in, and every field */
+	for(i = 0; i < ccid_num_slots(ccid); i++) {
+		if ( cci_slot_status(ccid_get_slot(ccid, i)) ==
+				CHIPCARD_NOT_PRESENT )
+			continue;
+		def.t_field = 0;
+		def.t_idx = i;
+		if ( !bench_target(w, ccid, &def, count, machine) )
+			ret = 0;
+	}
+
+	for(i = 0; i < ccid_num_fields(ccid); i++) {
+		def.t_field = 1;
+		def.t_idx = i;
+		if ( !bench_target(w, ccid, &def, count, machine) )
+			ret = 0;
+	}
+
+	return ret;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: ccid-bench [options]\n"
+		"  -w <workload>  select[:aid], read[:size] or escape:hex\n"
+		"  -n <count>     number of transactions (default %u)\n"
+		"  -s <slot>      benchmark a contact slot\n"
+		"  -f <field>     benchmark an RF field\n"
+		"  -r <file>      replay a binary trace instead of using USB\n"
+		"  -x <uid>[:sak] simulate an RC632 with this card in the "
+			"field, SAK\n"
+		"                 defaults to %#x (T=CL), may be repeated\n"
+		"  -t <file>      trace log file\n"
+		"  -m             machine readable output\n",
+		BENCH_DEFAULT_COUNT, BENCH_DEFAULT_SAK);
+}
+
+int main(int argc, char **argv)
+{
+	struct target t[BENCH_MAX_TARGETS];
+	struct ccid_sim_tag tag[BENCH_MAX_TAGS];
+	const char *replay = NULL, *tf = NULL;
+	unsigned int num_t = 0, num_tags = 0, count = BENCH_DEFAULT_COUNT;
+	struct workload w;
+	int c, machine = 0, ret = EXIT_SUCCESS;
+	ccidev_t *dev;
+	size_t num_dev, i;
+	ccid_t ccid;
+
+	parse_workload(&w, "select");
+
+	while ( (c = getopt(argc, argv, "w:n:s:f:r:x:t:mh")) != -1 ) {
+		switch(c) {
+		case 'w':
+			if ( !parse_workload(&w, optarg) ) {
+				fprintf(stderr, "bad workload: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			if ( 0 == count ) {
+				usage();
+				return EXIT_FAILURE;
+			}
+			break;
+		case 's':
+		case 'f':
+			if ( num_t >= BENCH_MAX_TARGETS ) {
+				fprintf(stderr, "too many targets\n");
+				return EXIT_FAILURE;
+			}
+			t[num_t].t_field = (c == 'f');
+			t[num_t].t_idx = strtoul(optarg, NULL, 0);
+			num_t++;
+			break;
+		case 'r':
+			replay = optarg;
+			break;
+		case 'x':
+			if ( num_tags >= BENCH_MAX_TAGS ) {
+				fprintf(stderr, "too many cards\n");
+				return EXIT_FAILURE;
+			}
+			if ( !parse_tag(&tag[num_tags], optarg) ) {
+				fprintf(stderr, "bad card: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			num_tags++;
+			break;
+		case 't':
+			tf = optarg;
+			break;
+		case 'm':
+			machine = 1;
+			break;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if ( machine )
+		printf("#bus\taddr\tname\ttype\tidx\tworkload\tcount\tfail"
+			"\tsw_err\tbytes\tsecs\txfr_per_sec\tbytes_per_sec"
+			"\tp50_us\tp99_us\tp999_us\tmax_us%s\n",
+			(num_tags) ?
+				"\tescapes\treg_rd\treg_wr\tfifo_bytes" : "");
+
+	if ( num_tags ) {
+		ccid = ccid_probe_sim(tag, num_tags, tf);
+		if ( NULL == ccid )
+			return EXIT_FAILURE;
+		if ( !bench_ccid(&w, ccid, t, num_t, count, machine) )
+			ret = EXIT_FAILURE;
+		ccid_close(ccid);
+		return ret;
+	}
+
+	if ( replay ) {
+		ccid = ccid_probe_replay(replay, tf);
+		if ( NULL == ccid )
+			return EXIT_FAILURE;
+		if ( !bench_ccid(&w, ccid, t, num_t, count, machine) )
+			ret = EXIT_FAILURE;
+		ccid_close(ccid);
+		return ret;
+	}
+
+	dev = libccid_get_device_list(&num_dev);
+	if ( NULL == dev )
+		return EXIT_FAILURE;
+
+	for(i = 0; i < num_dev; i++) {
+		ccid = ccid_probe(dev[i], tf);
+		if ( NULL == ccid ) {
+			ret = EXIT_FAILURE;
+			continue;
+		}
+		if ( !bench_ccid(&w, ccid, t, num_t, count, machine) )
+			ret = EXIT_FAILURE;
+		ccid_close(ccid);
+	}
+
+	libccid_free_device_list(dev);
+	return ret;
+}
@@ -11,13 +11,16 @@
 #endif
 
 #include <string.h>
+#include <stdarg.h>
 #include <assert.h>
+#include <pthread.h>
 #if HAVE_ENDIAN_H
 #include <endian.h>
 #endif
 
 #include <libusb.h>
 #include <ccid-spec.h>
+#include <list.h>
 
 #define trace(ccid, fmt, x...) \
 		do { \
@@ -33,28 +36,90 @@ struct _cci_ops {
 					unsigned int v,
 					size_t *atr_len);
 	int (*power_off)(struct _cci *cci);
+	const uint8_t *(*warm_reset)(struct _cci *cci, size_t *atr_len);
 	int (*transact)(struct _cci *cc, struct _xfr *xfr);
+	int (*submit)(struct _cci *cc, struct _xfr *xfr,
+			cci_xfr_cb_t cb, void *priv);
 	void (*dtor)(struct _cci *cc);
 };
 extern const struct _cci_ops _contact_ops;
 extern const struct _cci_ops _rfid_ops;
 
+/* big enough for an ATS at the maximum FSD */
+#define CCI_ATR_MAX 256
+
+#define T1_DEFAULT_IFS	32
+#define T1_MAX_IFS	254
+
+/* host side T=1 for readers which only exchange TPDUs, see proto_t1.c */
+struct _t1 {
+	struct _xfr	*t_xfr; /* one block each way */
+	uint8_t		t_on;
+	uint8_t		t_crc; /* EDC is a CRC rather than an LRC */
+	uint8_t		t_ns; /* sequence number of our next I-block */
+	uint8_t		t_nr; /* expected from the card's next I-block */
+	unsigned int	t_atr_ifsc;
+	unsigned int	t_ifsc;
+	unsigned int	t_ifsd;
+	unsigned int	t_max_inf; /* biggest block the reader can carry */
+};
+
 struct _cci {
 	struct _ccid *i_parent;
 	uint8_t i_idx;
 	uint8_t i_status;
 	const struct _cci_ops *i_ops;
+	struct _xfr *i_xfr; /* for power and status commands */
+	uint8_t i_no_pps; /* don't negotiate Fi/Di at power on */
 	void *i_priv;
+
+	/* copy of the ATR, or ATS for contactless, as of the last activation */
+	size_t i_atr_len;
+	uint8_t i_atr[CCI_ATR_MAX];
+
+	/* parameters negotiated at the last activation, replayed after a
+	 * warm reset which gives the same ATR. i_params_len is zero if the
+	 * card was left at the defaults.
+	 */
+	uint8_t i_voltage;
+	uint8_t i_proto;
+	uint8_t i_pps; /* PPS was exchanged with the card */
+	uint8_t i_params_len;
+	uint8_t i_params[sizeof(struct ccid_t1)];
+
+	/* block protocol state, unused unless i_t1.t_on */
+	struct _t1 i_t1;
+
+	/* per call time budget, see cci_set_timeout() */
+	unsigned int i_timeout_ms;
+	uint64_t i_deadline; /* of the call in progress */
+
+	/* keep powered mode, see cci_set_idle_timeout() */
+	unsigned int i_idle_ms;
+	uint8_t i_idle; /* powered, but released by cci_power_off() */
+	uint64_t i_idle_deadline;
 };
 
 #define RFID_MAX_FIELDS 1
 
+/* receive buffer for readers with more than one busy slot */
+struct _ccid_rx {
+	struct _ccid		*r_ccid;
+	struct libusb_transfer	*r_xfer;
+	uint8_t			*r_buf;
+	size_t			r_len;
+	int			r_busy;
+};
+
 struct _ccid {
 	libusb_device_handle *d_dev;
 
 	struct _xfr	*d_xfr;
 
 	FILE		*d_tf;
+	struct _trace	*d_bt;
+	struct _replay	*d_replay; /* virtual device, no USB */
+	struct _rfid_sim *d_sim; /* simulated RF field, no USB */
 
 	/* USB interface */
 	int 		d_inp;
@@ -83,11 +148,39 @@ struct _ccid {
 
 	unsigned int	d_error;
 
+	/* instrumentation, protected by d_lock */
+	struct ccid_stats	d_stats;
+
 	char		*d_name;
 	uint32_t	*d_clock_freq;
 	uint32_t	*d_data_rate;
 	size_t		d_num_clock;
 	size_t		d_num_rate;
+
+	/* bulk pipe command queue */
+	pthread_mutex_t	d_lock;
+	struct list_head d_queue;
+	struct list_head d_inflight;
+	struct list_head d_done;
+	unsigned int	d_num_inflight;
+
+	/* response routing for concurrent slots */
+	struct _ccid_rx	*d_rx;
+	unsigned int	d_num_rx;
+	unsigned int	d_rx_posted;
+	unsigned int	d_unanswered;
+
+	/* interrupt endpoint listener */
+	struct libusb_transfer *d_intr_xfer;
+	uint8_t		*d_intr_buf;
+	size_t		d_intr_len;
+	int		d_intr_state;
+	ccid_slot_cb_t	d_slot_cb;
+	void		*d_slot_priv;
+
+	/* event loop membership */
+	struct _ccid_loop *d_loop;
+	struct list_head d_loop_list;
 };
 
 struct _xfr {
@@ -97,8 +190,41 @@ struct _xfr {
 	uint8_t 	*x_txbuf;
 	const struct ccid_msg	*x_rxhdr;
 	uint8_t 	*x_rxbuf;
+	int		x_auto; /* handle 61xx/6Cxx in cci_transact() */
+
+	/* internal buffers, for when caller buffers are detached */
+	size_t			x_own_txmax, x_own_rxmax;
+	struct ccid_msg		*x_own_txhdr;
+	struct ccid_msg		*x_own_rxhdr;
+
+	/* asynchronous submission state */
+	struct list_head	x_list;
+	struct _ccid		*x_ccid;
+	struct libusb_transfer	*x_out;
+	struct libusb_transfer	*x_in;
+	cci_xfr_cb_t		x_cb;
+	void			*x_priv;
+	unsigned int		x_slot;
+	unsigned int		x_state;
+	unsigned int		x_busy;
+	unsigned int		x_retry;
+	unsigned int		x_waiting;
+	int			x_result;
+	int			x_done;
+	uint64_t		x_start; /* usec, monotonic */
+
+	/* msec, monotonic, zero for none, see cci_set_timeout() */
+	uint64_t		x_deadline;
+	uint64_t		x_resp_deadline;
+	unsigned int		x_resp_ms;
+	unsigned int		x_abort; /* waiting out a PC_to_RDR_Abort */
 };
 
+#define XFR_STATE_IDLE		0
+#define XFR_STATE_QUEUED	1
+#define XFR_STATE_INFLIGHT	2
+#define XFR_STATE_DONE		3
+
 #define INTF_RFID_OMNI	(1<<0)
 struct _cci_interface {
 	int c, i, a;
@@ -124,7 +250,9 @@ _private int _PC_to_RDR_GetSlotStatus(struct _ccid *ccid, unsigned int slot,
 _private int _PC_to_RDR_GetParameters(struct _ccid *ccid, unsigned int slot,
 					struct _xfr *xfr);
 _private int _PC_to_RDR_SetParameters(struct _ccid *ccid, unsigned int slot,
-					struct _xfr *xfr);
+					struct _xfr *xfr, unsigned int proto);
+_private int _ccid_fidi_ok(struct _ccid *ccid, uint8_t fidi);
+_private uint8_t _ccid_best_fidi(struct _ccid *ccid, uint8_t ta1);
 _private int _PC_to_RDR_ResetParameters(struct _ccid *ccid, unsigned int slot,
 					struct _xfr *xfr);
 _private int _PC_to_RDR_IccPowerOn(struct _ccid *ccid, unsigned int slot,
@@ -134,14 +262,57 @@ _private int _PC_to_RDR_IccPowerOff(struct _ccid *ccid, unsigned int slot,
 					struct _xfr *xfr);
 _private int _PC_to_RDR_XfrBlock(struct _ccid *ccid, unsigned int slot,
 					struct _xfr *xfr);
+_private int _PC_to_RDR_XfrBlock_bwi(struct _ccid *ccid, unsigned int slot,
+					struct _xfr *xfr, unsigned int bwi);
 _private int _PC_to_RDR_Escape(struct _ccid *ccid, unsigned int slot,
 					struct _xfr *xfr);
 
-_private int _cci_wait_for_interrupt(struct _ccid *ccid);
+_private int _ccid_intr_start(struct _ccid *ccid);
+_private int _ccid_expire_xfrs(struct _ccid *ccid);
+
+_private libusb_context *_libccid_ctx(void);
 
 _private struct _xfr *_xfr_do_alloc(size_t txbuf, size_t rxbuf);
 _private void _xfr_do_free(struct _xfr *xfr);
 
+/* replay.c */
+_private struct _replay *_replay_open(const char *fn);
+_private void _replay_close(struct _replay *rp);
+_private const uint8_t *_replay_desc(struct _replay *rp, size_t *len);
+_private size_t _replay_answer(struct _replay *rp, struct _xfr *xfr,
+				size_t txlen);
+
+/* rfid_sim.c */
+_private int _rfid_sim_attach(struct _ccid *ccid,
+				const struct ccid_sim_tag *tags,
+				unsigned int num);
+_private void _rfid_sim_free(struct _rfid_sim *s);
+
+/* proto_t1.c */
+_private int _t1_init(struct _cci *cci, unsigned int ifsc, int crc);
+_private void _t1_free(struct _t1 *t1);
+_private int _t1_transact(struct _cci *cci, struct _xfr *xfr);
+
+/* capcache.c */
+struct _cap_key {
+	uint16_t	k_vid;
+	uint16_t	k_pid;
+	uint16_t	k_bcd;
+};
+_private int _cap_lookup(struct _ccid *ccid, const struct _cap_key *k);
+_private void _cap_store(struct _ccid *ccid, const struct _cap_key *k);
+
+/* trace.c */
+_private struct _trace *_trace_open(const char *fn);
+_private void _trace_close(struct _trace *bt);
+_private void _trace_msg(struct _ccid *ccid, unsigned int dir,
+				const void *buf, size_t len);
+_private void _trace_log(struct _ccid *ccid, const char *fmt, va_list va);
+
+_private uint64_t _cci_now_msec(void);
+_private int _cci_idle_expire(struct _cci *cci, uint64_t now);
+_private const uint8_t *_cci_save_atr(struct _cci *cci, const uint8_t *atr,
+					size_t len);
 _private void _hex_dumpf(FILE *f, const uint8_t *tmp, size_t len, size_t llen);
 
 #endif /* _CCID_INTERNAL_H */
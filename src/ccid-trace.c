@@ -0,0 +1,201 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2008 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Decode binary trace files produced by ccid_probe() with a "bin:" tracefile
+ * in to the same text format as the normal trace log.
+*/
+
+#include <ccid.h>
+#include <ccid-spec.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+
+static const char *xmit_name(uint8_t type)
+{
+	switch(type) {
+	case PC_to_RDR_SetParameters:
+		return "PC_to_RDR_SetParameters";
+	case PC_to_RDR_IccPowerOn:
+		return "PC_to_RDR_IccPowerOn";
+	case PC_to_RDR_IccPowerOff:
+		return "PC_to_RDR_IccPowerOff";
+	case PC_to_RDR_GetSlotStatus:
+		return "PC_to_RDR_GetSlotStatus";
+	case PC_to_RDR_Secure:
+		return "PC_to_RDR_Secure";
+	case PC_to_RDR_T0APDU:
+		return "PC_to_RDR_T0APDU";
+	case PC_to_RDR_Escape:
+		return "PC_to_RDR_Escape";
+	case PC_to_RDR_GetParameters:
+		return "PC_to_RDR_GetParameters";
+	case PC_to_RDR_ResetParameters:
+		return "PC_to_RDR_ResetParameters";
+	case PC_to_RDR_IccClock:
+		return "PC_to_RDR_IccClock";
+	case PC_to_RDR_XfrBlock:
+		return "PC_to_RDR_XfrBlock";
+	case PC_to_RDR_Mechanical:
+		return "PC_to_RDR_Mechanical";
+	case PC_to_RDR_Abort:
+		return "PC_to_RDR_Abort";
+	case PC_to_RDR_SetBaudAndFreq:
+		return "PC_to_RDR_SetBaudAndFreq";
+	default:
+		return "PC_to_RDR_Unknown";
+	}
+}
+
+static const char *recv_name(uint8_t type)
+{
+	switch(type) {
+	case RDR_to_PC_DataBlock:
+		return "RDR_to_PC_DataBlock";
+	case RDR_to_PC_SlotStatus:
+		return "RDR_to_PC_SlotStatus";
+	case RDR_to_PC_Parameters:
+		return "RDR_to_PC_Parameters";
+	case RDR_to_PC_Escape:
+		return "RDR_to_PC_Escape";
+	case RDR_to_PC_BaudAndFreq:
+		return "RDR_to_PC_BaudAndFreq";
+	default:
+		return "RDR_to_PC_Unknown";
+	}
+}
+
+static void print_rec(const struct _trace_rec *rec, const uint8_t *buf,
+			int stamps)
+{
+	const struct ccid_msg *msg = (const struct ccid_msg *)buf;
+	size_t len = rec->r_len;
+
+	if ( stamps ) {
+		printf("[%llu.%06llu] ",
+			(unsigned long long)(rec->r_ts / 1000000000ULL),
+			(unsigned long long)(rec->r_ts % 1000000000ULL) / 1000);
+	}
+
+	switch(rec->r_dir) {
+	case TRACE_XMIT:
+		if ( len < sizeof(*msg) )
+			break;
+		printf(" Xmit: %s(%u)\n", xmit_name(rec->r_type), rec->r_slot);
+		hex_dumpf(stdout, buf + sizeof(*msg), len - sizeof(*msg), 16);
+		break;
+	case TRACE_RECV:
+		if ( len < sizeof(*msg) )
+			break;
+		printf(" Recv: %zu bytes for slot %u (seq = 0x%.2x)\n",
+			len - sizeof(*msg), rec->r_slot, rec->r_seq);
+		printf("     : %s: %zu bytes\n", recv_name(rec->r_type),
+			len - sizeof(*msg));
+		if ( msg->in.bStatus & 0x40 )
+			printf("     : Command: ERR: 0x%.2x\n", msg->in.bError);
+		hex_dumpf(stdout, buf + sizeof(*msg), len - sizeof(*msg), 16);
+		break;
+	case TRACE_INTR:
+		printf(" Intr: %zu byte interrupt packet\n", len);
+		hex_dumpf(stdout, buf, len, 16);
+		break;
+	case TRACE_LOG:
+		fwrite(buf, len, 1, stdout);
+		break;
+	case TRACE_DESC:
+		printf(" o Fetching config descriptor\n");
+		hex_dumpf(stdout, buf, len, 16);
+		break;
+	default:
+		printf("*** unknown trace record type %u\n", rec->r_dir);
+		break;
+	}
+}
+
+static int decode(const uint8_t *map, size_t maplen, int stamps)
+{
+	static uint8_t buf[TRACE_RING_SIZE / 2];
+	struct _trace_rec rec;
+	struct _trace_ring r;
+	int64_t off;
+
+	off = _trace_ring_open(&r, map, maplen);
+	if ( off < 0 ) {
+		fprintf(stderr, "*** error: not a valid ccid trace file\n");
+		return 0;
+	}
+
+	while ( (uint64_t)off + sizeof(rec) <= r.head ) {
+		_trace_ring_read(&r, off, &rec, sizeof(rec));
+		if ( rec.r_magic == TRACE_REC_MAGIC ) {
+			_trace_ring_read(&r, off + sizeof(rec), buf, rec.r_len);
+			print_rec(&rec, buf, stamps);
+		}
+		off += TRACE_ALIGN(sizeof(rec) + rec.r_len);
+	}
+
+	return 1;
+}
+
+static int decode_file(const char *fn, int stamps)
+{
+	struct stat st;
+	void *map;
+	int fd, ret;
+
+	fd = open(fn, O_RDONLY);
+	if ( fd < 0 ) {
+		fprintf(stderr, "%s: open: %s\n", fn, strerror(errno));
+		return 0;
+	}
+
+	if ( fstat(fd, &st) ) {
+		fprintf(stderr, "%s: fstat: %s\n", fn, strerror(errno));
+		close(fd);
+		return 0;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if ( map == MAP_FAILED ) {
+		fprintf(stderr, "%s: mmap: %s\n", fn, strerror(errno));
+		return 0;
+	}
+
+	ret = decode(map, st.st_size, stamps);
+	munmap(map, st.st_size);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int i, stamps = 0, ret = EXIT_SUCCESS;
+
+	if ( argc > 1 && !strcmp(argv[1], "-t") ) {
+		stamps = 1;
+		argc--;
+		argv++;
+	}
+
+	if ( argc < 2 ) {
+		fprintf(stderr, "Usage: ccid-trace [-t] <file> [file...]\n");
+		return EXIT_FAILURE;
+	}
+
+	for(i = 1; i < argc; i++) {
+		if ( !decode_file(argv[i], stamps) )
+			ret = EXIT_FAILURE;
+	}
+
+	return ret;
+}
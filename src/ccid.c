@@ -9,9 +9,12 @@
 #include <ccid.h>
 
 #include <stdarg.h>
+#include <errno.h>
 #include <inttypes.h>
+#include <time.h>
 
 #include "ccid-internal.h"
+#include "trace.h"
 
 static void usb_xfr_error(struct _ccid *ccid, int rc)
 {
@@ -37,56 +40,179 @@ static size_t x_tbuflen(struct _xfr *xfr)
 	return xfr->x_txlen + sizeof(struct ccid_msg);
 }
 
-int _cci_wait_for_interrupt(struct _ccid *ccid)
+/* ---[ Interrupt endpoint listener
+ *
+ * A single interrupt transfer is kept posted for the life of the CCID, slot
+ * change notifications update the cached status of every slot in the bitmap
+ * and are passed to any registered callback.
+ */
+#define INTR_IDLE	0
+#define INTR_RUNNING	1
+#define INTR_STOPPING	2
+
+static void intr_slot_change(struct _ccid *ccid, const uint8_t *buf,
+				size_t len)
+{
+	ccid_slot_cb_t cb = ccid->d_slot_cb;
+	unsigned int i, bits;
+
+	for(i = 0; i < ccid->d_num_slots && 1 + i / 4 < len; i++) {
+		bits = (buf[1 + i / 4] >> ((i % 4) * 2)) & 0x3;
+		if ( 0 == (bits & 0x2) )
+			continue;
+
+		trace(ccid, "     : Slot %u status changed to %s\n", i,
+			(bits & 0x1) ? "present" : "NOT present");
+
+		if ( bits & 0x1 ) {
+			if ( ccid->d_slot[i].i_status == CHIPCARD_NOT_PRESENT )
+				ccid->d_slot[i].i_status = CHIPCARD_PRESENT;
+		}else{
+			ccid->d_slot[i].i_status = CHIPCARD_NOT_PRESENT;
+		}
+
+		if ( cb )
+			(*cb)(ccid->d_slot + i, ccid->d_slot[i].i_status,
+				ccid->d_slot_priv);
+	}
+}
+
+static void intr_done(struct libusb_transfer *t)
+{
+	struct _ccid *ccid = t->user_data;
+	const uint8_t *buf = t->buffer;
+	size_t len = t->actual_length;
+
+	switch(t->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		goto stop;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		ccid->d_error = CCID_ERROR_DEVICE_REMOVED;
+		goto stop;
+	default:
+		fprintf(stderr, "*** error: interrupt transfer failed\n");
+		len = 0;
+		break;
+	}
+
+	if ( len ) {
+		_trace_msg(ccid, TRACE_INTR, buf, len);
+		trace(ccid, " Intr: %zu byte interrupt packet\n", len);
+		switch( buf[0] ) {
+		case RDR_to_PC_NotifySlotChange:
+			intr_slot_change(ccid, buf, len);
+			break;
+		case RDR_to_PC_HardwareError:
+			trace(ccid, "     : HALT AND CATCH FIRE!!\n");
+			break;
+		default:
+			fprintf(stderr, "*** error: unknown interrupt packet\n");
+			break;
+		}
+	}
+
+	pthread_mutex_lock(&ccid->d_lock);
+	if ( ccid->d_intr_state != INTR_RUNNING ||
+			libusb_submit_transfer(ccid->d_intr_xfer) )
+		ccid->d_intr_state = INTR_IDLE;
+	pthread_mutex_unlock(&ccid->d_lock);
+	return;
+stop:
+	pthread_mutex_lock(&ccid->d_lock);
+	ccid->d_intr_state = INTR_IDLE;
+	pthread_mutex_unlock(&ccid->d_lock);
+}
+
+int _ccid_intr_start(struct _ccid *ccid)
 {
-	const uint8_t *buf;
-	int ret, rc;
 	size_t len;
+	int rc;
 
-again:
-	rc = libusb_interrupt_transfer(ccid->d_dev, ccid->d_intrp,
-				(void *)ccid->d_xfr->x_rxhdr,
-				x_rbuflen(ccid->d_xfr), &ret, 250);
-	if ( rc == LIBUSB_ERROR_INTERRUPTED )
-		goto again;
+	if ( 0 == ccid->d_intrp )
+		return 0;
+
+	pthread_mutex_lock(&ccid->d_lock);
+
+	if ( ccid->d_intr_state != INTR_IDLE ) {
+		pthread_mutex_unlock(&ccid->d_lock);
+		return 1;
+	}
+
+	if ( NULL == ccid->d_intr_xfer ) {
+		len = 1 + (CCID_MAX_SLOTS + 3) / 4;
+		if ( len < ccid->d_max_intr )
+			len = ccid->d_max_intr;
+		ccid->d_intr_buf = malloc(len);
+		ccid->d_intr_len = len;
+		ccid->d_intr_xfer = libusb_alloc_transfer(0);
+		if ( NULL == ccid->d_intr_buf || NULL == ccid->d_intr_xfer )
+			goto err;
+	}
+
+	libusb_fill_interrupt_transfer(ccid->d_intr_xfer, ccid->d_dev,
+					ccid->d_intrp, ccid->d_intr_buf,
+					ccid->d_intr_len, intr_done, ccid, 0);
+	rc = libusb_submit_transfer(ccid->d_intr_xfer);
 	if ( rc ) {
-		fprintf(stderr, "*** error: libusb_interrupt_transfer()\n");
+		fprintf(stderr, "*** error: libusb_submit_transfer()\n");
 		usb_xfr_error(ccid, rc);
+		pthread_mutex_unlock(&ccid->d_lock);
 		return 0;
 	}
 
-	if ( ret == 0 )
-		return 1;
+	ccid->d_intr_state = INTR_RUNNING;
+	pthread_mutex_unlock(&ccid->d_lock);
+	return 1;
 
-	buf = (void *)ccid->d_xfr->x_rxhdr;
-	len = (size_t)ret;
+err:
+	ccid->d_error = CCID_ERROR_NO_MEM;
+	pthread_mutex_unlock(&ccid->d_lock);
+	return 0;
+}
 
-	trace(ccid, " Intr: %zu byte interrupt packet\n", len);
-	if ( len < 1 )
-		return 1;
+static void intr_stop(struct _ccid *ccid)
+{
+	int rc;
 
-	switch( buf[0] ) {
-	case RDR_to_PC_NotifySlotChange:
-		assert(2 == len);
-		if ( buf[1] & 0x2 ) {
-			trace(ccid, "     : Slot status changed to %s\n",
-				((buf[1] & 0x1) == 0) ? 
-					"NOT present" : "present");
-			ccid->d_slot[0].i_status =
-				((buf[1] & 0x1) == 0) ?
-					CHIPCARD_NOT_PRESENT :
-					CHIPCARD_PRESENT;
-		}
-		break;
-	case RDR_to_PC_HardwareError:
-		trace(ccid, "     : HALT AND CATCH FIRE!!\n");
-		break;
-	default:
-		fprintf(stderr, "*** error: unknown interrupt packet\n");
-		break;
+	pthread_mutex_lock(&ccid->d_lock);
+	if ( ccid->d_intr_state == INTR_RUNNING ) {
+		ccid->d_intr_state = INTR_STOPPING;
+		libusb_cancel_transfer(ccid->d_intr_xfer);
 	}
+	pthread_mutex_unlock(&ccid->d_lock);
 
-	return 1;
+	while ( ccid->d_intr_state != INTR_IDLE ) {
+		rc = libusb_handle_events(_libccid_ctx());
+		if ( rc && rc != LIBUSB_ERROR_INTERRUPTED )
+			break;
+	}
+
+	libusb_free_transfer(ccid->d_intr_xfer);
+	free(ccid->d_intr_buf);
+	ccid->d_intr_xfer = NULL;
+	ccid->d_intr_buf = NULL;
+}
+
+/** Register for card insertion and removal events.
+ * \ingroup g_ccid
+ * @param ccid The \ref ccid_t to monitor.
+ * @param cb Function to call when the status of a slot changes, or NULL.
+ * @param priv Private data pointer passed to the callback.
+ *
+ * Starts listening on the interrupt endpoint for slot change notifications.
+ * The callback is run with the new status for each slot named in the
+ * notification, from whichever thread is handling USB events.
+ *
+ * @return zero if the device has no interrupt endpoint or the listener could
+ * not be started.
+ */
+int ccid_slot_notify(ccid_t ccid, ccid_slot_cb_t cb, void *priv)
+{
+	ccid->d_slot_cb = cb;
+	ccid->d_slot_priv = priv;
+	return _ccid_intr_start(ccid);
 }
 
 unsigned int _RDR_to_PC_DataBlock(struct _ccid *ccid, struct _xfr *xfr)
@@ -149,6 +275,75 @@ static const uint8_t di_table[16] = {
 	12, 20, 0, 0, 0, 0, 0, 0
 };
 
+static int rate_supported(struct _ccid *ccid, uint32_t baud)
+{
+	uint32_t slack = baud / 100;
+	size_t i;
+
+	if ( 0 == ccid->d_num_rate )
+		return (baud <= ccid->d_desc.dwMaxDataRate);
+
+	for(i = 0; i < ccid->d_num_rate; i++) {
+		if ( ccid->d_data_rate[i] + slack >= baud &&
+				ccid->d_data_rate[i] <= baud + slack )
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Whether the reader can run at exactly the Fi and Di in fidi, for cards in
+ * specific mode which can't negotiate anything else.
+ */
+int _ccid_fidi_ok(struct _ccid *ccid, uint8_t fidi)
+{
+	unsigned int f = fidi >> 4, d = fidi & 0xf;
+
+	if ( fidi == 0x11 )
+		return 1;
+	if ( 0 == fi_table[f].fi || 0 == di_table[d] )
+		return 0;
+	if ( ccid->d_desc.dwDefaultClock > fi_table[f].fmax )
+		return 0;
+
+	return rate_supported(ccid, (uint64_t)ccid->d_desc.dwDefaultClock *
+				1000 * di_table[d] / fi_table[f].fi);
+}
+
+/* Pick the fastest Di, no faster than that offered in TA1, which gives a baud
+ * rate the reader supports at its default clock. Returns the default 0x11 if
+ * nothing better can be used.
+ */
+uint8_t _ccid_best_fidi(struct _ccid *ccid, uint8_t ta1)
+{
+	unsigned int f = ta1 >> 4, d, best = 0;
+	uint64_t baud;
+
+	if ( 0 == fi_table[f].fi || 0 == di_table[ta1 & 0xf] )
+		return 0x11;
+	if ( ccid->d_desc.dwDefaultClock > fi_table[f].fmax )
+		return 0x11;
+
+	for(d = 1; d < 16; d++) {
+		if ( 0 == di_table[d] || di_table[d] > di_table[ta1 & 0xf] )
+			continue;
+		if ( best && di_table[d] <= di_table[best] )
+			continue;
+
+		baud = (uint64_t)ccid->d_desc.dwDefaultClock * 1000 *
+			di_table[d] / fi_table[f].fi;
+		if ( rate_supported(ccid, baud) )
+			best = d;
+	}
+
+	if ( best <= 1 )
+		return 0x11;
+
+	trace(ccid, "     : Selected Fi=%d Di=%d\n",
+		fi_table[f].fi, di_table[best]);
+	return (f << 4) | best;
+}
+
 static unsigned int guard_time(uint8_t t)
 {
 	if ( t == 0xff )
@@ -285,155 +480,1142 @@ static int _cmd_result(struct _ccid *ccid, const struct ccid_msg *msg)
 	}
 }
 
-static int do_recv(struct _ccid *ccid, struct _xfr *xfr)
+static void _chipcard_set_status(struct _cci *cc, unsigned int status)
 {
-	int ret, rc;
-	size_t len;
+	switch( status & CCID_SLOT_STATUS_MASK ) {
+	case CCID_STATUS_ICC_ACTIVE:
+		trace(cc->i_parent, "     : ICC present and active\n");
+		cc->i_status = CHIPCARD_ACTIVE;
+		break;
+	case CCID_STATUS_ICC_PRESENT:
+		trace(cc->i_parent, "     : ICC present and inactive\n");
+		cc->i_status = CHIPCARD_PRESENT;
+		break;
+	case CCID_STATUS_ICC_NOT_PRESENT:
+		trace(cc->i_parent, "     : ICC not presnt\n");
+		cc->i_status = CHIPCARD_NOT_PRESENT;
+		break;
+	default:
+		fprintf(stderr, "*** error: unknown chipcard status update\n");
+		break;
+	}
+}
 
-again:
-	rc = libusb_bulk_transfer(ccid->d_dev, ccid->d_inp,
-				(void *)xfr->x_rxhdr,
-				x_rbuflen(xfr), &ret, 0);
-	if ( rc == LIBUSB_ERROR_INTERRUPTED )
-		goto again;
+/* ---[ Instrumentation
+ *
+ * Every command is timed from the moment it is put on the wire until its
+ * final response arrives, so the latency covers the USB transfers, reader
+ * firmware and card but not time spent queued behind other commands.
+ */
+static uint64_t stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Called with d_lock held */
+static void stats_latency(struct _ccid *ccid, struct _xfr *xfr)
+{
+	struct ccid_cmd_stats *cs;
+	uint64_t usec, v;
+	unsigned int idx, b;
+
+	idx = xfr->x_txhdr->bMessageType - CCID_STATS_CMD_BASE;
+	if ( idx >= CCID_STATS_CMDS )
+		return;
+
+	usec = stats_now() - xfr->x_start;
+	for(v = usec, b = 0; v && b < CCID_STATS_BUCKETS - 1; v >>= 1, b++)
+		/* nothing */;
+
+	cs = &ccid->d_stats.s_cmd[idx];
+	cs->c_count++;
+	cs->c_total_usec += usec;
+	if ( usec > cs->c_max_usec )
+		cs->c_max_usec = usec;
+	cs->c_hist[b]++;
+}
+
+/** Retrieve performance counters for a CCID.
+ * \ingroup g_ccid
+ * @param ccid The \ref ccid_t to retrieve counters for.
+ * @param st Structure to fill in.
+ *
+ * Counters accumulate from \ref ccid_probe or the last call to
+ * \ref ccid_stats_reset. Errors are counted by the value of \ref ccid_error
+ * when a command fails.
+ */
+void ccid_stats(ccid_t ccid, struct ccid_stats *st)
+{
+	pthread_mutex_lock(&ccid->d_lock);
+	memcpy(st, &ccid->d_stats, sizeof(*st));
+	pthread_mutex_unlock(&ccid->d_lock);
+}
+
+/** Zero the performance counters for a CCID.
+ * \ingroup g_ccid
+ * @param ccid The \ref ccid_t to reset counters for.
+ */
+void ccid_stats_reset(ccid_t ccid)
+{
+	pthread_mutex_lock(&ccid->d_lock);
+	memset(&ccid->d_stats, 0, sizeof(ccid->d_stats));
+	pthread_mutex_unlock(&ccid->d_lock);
+}
+
+/** Name of a command type in struct ccid_stats.
+ * \ingroup g_ccid
+ * @param idx Index in to s_cmd.
+ * @return The name of the CCID message, or NULL if it is not a valid command.
+ */
+const char *ccid_stats_cmd_name(unsigned int idx)
+{
+	static const char * const names[CCID_STATS_CMDS] = {
+		[PC_to_RDR_SetParameters - CCID_STATS_CMD_BASE] =
+			"SetParameters",
+		[PC_to_RDR_IccPowerOn - CCID_STATS_CMD_BASE] = "IccPowerOn",
+		[PC_to_RDR_IccPowerOff - CCID_STATS_CMD_BASE] = "IccPowerOff",
+		[PC_to_RDR_GetSlotStatus - CCID_STATS_CMD_BASE] =
+			"GetSlotStatus",
+		[PC_to_RDR_Secure - CCID_STATS_CMD_BASE] = "Secure",
+		[PC_to_RDR_T0APDU - CCID_STATS_CMD_BASE] = "T0APDU",
+		[PC_to_RDR_Escape - CCID_STATS_CMD_BASE] = "Escape",
+		[PC_to_RDR_GetParameters - CCID_STATS_CMD_BASE] =
+			"GetParameters",
+		[PC_to_RDR_ResetParameters - CCID_STATS_CMD_BASE] =
+			"ResetParameters",
+		[PC_to_RDR_IccClock - CCID_STATS_CMD_BASE] = "IccClock",
+		[PC_to_RDR_XfrBlock - CCID_STATS_CMD_BASE] = "XfrBlock",
+		[PC_to_RDR_Mechanical - CCID_STATS_CMD_BASE] = "Mechanical",
+		[PC_to_RDR_Abort - CCID_STATS_CMD_BASE] = "Abort",
+		[PC_to_RDR_SetBaudAndFreq - CCID_STATS_CMD_BASE] =
+			"SetBaudAndFreq",
+	};
+
+	if ( idx >= CCID_STATS_CMDS )
+		return NULL;
+	return names[idx];
+}
+
+/* ---[ Bulk pipe transfer engine
+ *
+ * Commands are queued on the CCID and sent with libusb_submit_transfer(). The
+ * IN transfer for a command is posted alongside its OUT transfer so that it is
+ * already waiting when the reader responds, and the next queued command is put
+ * on the wire from within the completion callback of the previous one. The
+ * synchronous _PC_to_RDR()/_RDR_to_PC() pair is just a submit followed by a
+ * wait for completion.
+ *
+ * Readers which advertise bMaxCCIDBusySlots > 1 may have one command in
+ * flight per slot, up to that limit. Responses can then come back in any
+ * order so they are received in to a pool of buffers owned by the CCID and
+ * routed to the waiting xfr by bSlot/bSeq. Otherwise the response is received
+ * directly in to the xfr.
+ */
+#define XFR_MAX_RETRY		10
+#define XFR_RESP_SLACK_MS	200 /* reader and USB overhead on top of BWT */
+#define XFR_ABORT_MS		500 /* for an aborted command to be wound up */
+
+static void usb_status_error(struct _ccid *ccid,
+				enum libusb_transfer_status status)
+{
+	switch(status) {
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		ccid->d_error = CCID_ERROR_DEVICE_REMOVED;
+		return;
+	default:
+		ccid->d_error = CCID_ERROR_BUS;
+		return;
+	}
+}
+
+static unsigned int max_busy(struct _ccid *ccid)
+{
+	return (ccid->d_num_rx) ? ccid->d_num_rx : 1;
+}
+
+static int slot_busy(struct _ccid *ccid, unsigned int slot)
+{
+	struct _xfr *xfr;
+
+	list_for_each_entry(xfr, &ccid->d_inflight, x_list) {
+		if ( xfr->x_slot == slot )
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Called with d_lock held */
+static void xfr_finish(struct _ccid *ccid, struct _xfr *xfr)
+{
+	if ( xfr->x_state == XFR_STATE_INFLIGHT ) {
+		list_del(&xfr->x_list);
+		ccid->d_num_inflight--;
+		stats_latency(ccid, xfr);
+	}
+	if ( !xfr->x_result && ccid->d_error < CCID_STATS_ERRORS )
+		ccid->d_stats.s_errors[ccid->d_error]++;
+	xfr->x_state = XFR_STATE_DONE;
+	list_add_tail(&xfr->x_list, &ccid->d_done);
+}
+
+static void in_done(struct libusb_transfer *t);
+static void out_done(struct libusb_transfer *t);
+static void rx_done(struct libusb_transfer *t);
+
+/* Post a receive from the pool, called with d_lock held */
+static int rx_post(struct _ccid *ccid)
+{
+	struct _ccid_rx *rx;
+	unsigned int i;
+	int rc;
+
+	for(i = 0; i < ccid->d_num_rx; i++) {
+		if ( !ccid->d_rx[i].r_busy )
+			break;
+	}
+
+	assert(i < ccid->d_num_rx);
+	rx = ccid->d_rx + i;
+
+	libusb_fill_bulk_transfer(rx->r_xfer, ccid->d_dev, ccid->d_inp,
+				rx->r_buf, rx->r_len, rx_done, rx, 0);
+	rc = libusb_submit_transfer(rx->r_xfer);
+	if ( rc ) {
+		fprintf(stderr, "*** error: libusb_submit_transfer()\n");
+		usb_xfr_error(ccid, rc);
+		return 0;
+	}
+
+	rx->r_busy = 1;
+	ccid->d_rx_posted++;
+	return 1;
+}
+
+/* Drop a reference to the libusb transfers, called with d_lock held */
+static void xfr_kick(struct _ccid *ccid);
+static void xfr_put(struct _ccid *ccid, struct _xfr *xfr)
+{
+	assert(xfr->x_busy);
+	if ( --xfr->x_busy )
+		return;
+	xfr_finish(ccid, xfr);
+	xfr_kick(ccid);
+}
+
+/* Response arrived, or will never arrive, called with d_lock held */
+static void xfr_answered(struct _ccid *ccid, struct _xfr *xfr)
+{
+	assert(xfr->x_waiting);
+	xfr->x_waiting = 0;
+	ccid->d_unanswered--;
+	xfr_put(ccid, xfr);
+}
+
+static void fail_waiting(struct _ccid *ccid)
+{
+	struct _xfr *xfr, *tmp;
+
+	list_for_each_entry_safe(xfr, tmp, &ccid->d_inflight, x_list) {
+		if ( xfr->x_waiting )
+			xfr_answered(ccid, xfr);
+	}
+}
+
+static int start_direct(struct _ccid *ccid, struct _xfr *xfr)
+{
+	int rc;
+
+	libusb_fill_bulk_transfer(xfr->x_in, ccid->d_dev, ccid->d_inp,
+				(void *)xfr->x_rxhdr, x_rbuflen(xfr),
+				in_done, xfr, 0);
+
+	rc = libusb_submit_transfer(xfr->x_in);
 	if ( rc ) {
-		fprintf(stderr, "*** error: libusb_bulk_read()\n");
+		fprintf(stderr, "*** error: libusb_submit_transfer()\n");
 		usb_xfr_error(ccid, rc);
 		return 0;
 	}
 
-	len = (size_t)ret;
+	xfr->x_busy = 1;
+	return 1;
+}
+
+static int start_routed(struct _ccid *ccid, struct _xfr *xfr)
+{
+	ccid->d_unanswered++;
+	if ( ccid->d_rx_posted < ccid->d_unanswered && !rx_post(ccid) ) {
+		ccid->d_unanswered--;
+		return 0;
+	}
+
+	xfr->x_waiting = 1;
+	xfr->x_busy = 1;
+	return 1;
+}
+
+/* Called with d_lock held */
+static void xfr_kick(struct _ccid *ccid)
+{
+	struct _xfr *xfr, *tmp;
+	int rc;
+
+again:
+	list_for_each_entry_safe(xfr, tmp, &ccid->d_queue, x_list) {
+		if ( ccid->d_num_inflight >= max_busy(ccid) )
+			break;
+		if ( slot_busy(ccid, xfr->x_slot) )
+			continue;
+
+		list_del(&xfr->x_list);
+		list_add_tail(&xfr->x_list, &ccid->d_inflight);
+		ccid->d_num_inflight++;
+		xfr->x_state = XFR_STATE_INFLIGHT;
+		xfr->x_start = stats_now();
+		ccid->d_stats.s_tx_bytes += x_tbuflen(xfr);
+		if ( xfr->x_resp_ms )
+			xfr->x_resp_deadline = xfr->x_start / 1000 +
+						xfr->x_resp_ms;
+
+		libusb_fill_bulk_transfer(xfr->x_out, ccid->d_dev,
+					ccid->d_outp,
+					(void *)xfr->x_txhdr, x_tbuflen(xfr),
+					out_done, xfr, 0);
+
+		if ( ccid->d_num_rx )
+			rc = start_routed(ccid, xfr);
+		else
+			rc = start_direct(ccid, xfr);
+		if ( !rc ) {
+			xfr_finish(ccid, xfr);
+			goto again;
+		}
 
-	if ( len < sizeof(*xfr->x_rxhdr) ) {
+		rc = libusb_submit_transfer(xfr->x_out);
+		if ( rc ) {
+			fprintf(stderr, "*** error: libusb_submit_transfer()\n");
+			usb_xfr_error(ccid, rc);
+			if ( ccid->d_num_rx ) {
+				/* the posted receive is re-used later */
+				xfr_answered(ccid, xfr);
+				goto again;
+			}
+			libusb_cancel_transfer(xfr->x_in);
+			continue;
+		}
+		xfr->x_busy++;
+	}
+}
+
+/* Run completion callbacks, must be called without d_lock held */
+static void xfr_run_done(struct _ccid *ccid)
+{
+	struct _xfr *xfr;
+	cci_xfr_cb_t cb;
+	struct _cci *cci;
+
+	for(;;) {
+		pthread_mutex_lock(&ccid->d_lock);
+		if ( list_empty(&ccid->d_done) ) {
+			pthread_mutex_unlock(&ccid->d_lock);
+			break;
+		}
+		xfr = list_entry(ccid->d_done.next, struct _xfr, x_list);
+		list_del(&xfr->x_list);
+		xfr->x_state = XFR_STATE_IDLE;
+		cb = xfr->x_cb;
+		xfr->x_cb = NULL;
+		xfr->x_done = 1;
+		pthread_mutex_unlock(&ccid->d_lock);
+
+		if ( cb ) {
+			cci = (xfr->x_slot < ccid->d_num_slots) ?
+				ccid->d_slot + xfr->x_slot : NULL;
+			if ( xfr->x_result && xfr->x_rxhdr->bMessageType ==
+						RDR_to_PC_DataBlock )
+				_RDR_to_PC_DataBlock(ccid, xfr);
+			(*cb)(cci, xfr, xfr->x_result, xfr->x_priv);
+		}
+	}
+}
+
+static void out_done(struct libusb_transfer *t)
+{
+	struct _xfr *xfr = t->user_data;
+	struct _ccid *ccid = xfr->x_ccid;
+	int ok = 0;
+
+	pthread_mutex_lock(&ccid->d_lock);
+
+	if ( t->status != LIBUSB_TRANSFER_COMPLETED ) {
+		fprintf(stderr, "*** error: bulk write failed\n");
+		usb_status_error(ccid, t->status);
+	}else if ( (size_t)t->actual_length < x_tbuflen(xfr) ) {
+		fprintf(stderr, "*** error: truncated TX: %d/%zu\n",
+			t->actual_length, x_tbuflen(xfr));
+		ccid->d_error = CCID_ERROR_BUS;
+	}else{
+		ok = 1;
+	}
+
+	if ( !ok ) {
+		if ( !ccid->d_num_rx )
+			libusb_cancel_transfer(xfr->x_in);
+		else if ( xfr->x_waiting )
+			xfr_answered(ccid, xfr);
+	}
+
+	xfr_put(ccid, xfr);
+	pthread_mutex_unlock(&ccid->d_lock);
+	xfr_run_done(ccid);
+}
+
+static int do_recv(struct _ccid *ccid, struct _xfr *xfr, size_t len)
+{
+	const struct ccid_msg *msg = xfr->x_rxhdr;
+
+	if ( len < sizeof(*msg) ) {
 		fprintf(stderr, "*** error: truncated CCI msg\n");
 		ccid->d_error = CCID_ERROR_BUS;
 		return 0;
 	}
 
-	if ( sizeof(*xfr->x_rxhdr) + le32toh(xfr->x_rxhdr->dwLength) > len ) {
+	if ( sizeof(*msg) + le32toh(msg->dwLength) > len ) {
 		fprintf(stderr, "*** error: bad dwLength in CCI msg\n");
 		ccid->d_error = CCID_ERROR_BUS;
 		return 0;
 	}
 
-	xfr->x_rxlen = le32toh(xfr->x_rxhdr->dwLength);
+	xfr->x_rxlen = le32toh(msg->dwLength);
+
+	_trace_msg(ccid, TRACE_RECV, msg, sizeof(*msg) + xfr->x_rxlen);
+	ccid->d_stats.s_rx_bytes += len;
+	trace(ccid, " Recv: %zu bytes for slot %u (seq = 0x%.2x)\n",
+		xfr->x_rxlen, msg->bSlot, msg->bSeq);
+
+	if ( msg->bSlot != xfr->x_slot ) {
+		fprintf(stderr, "*** error: bad slot %u (expected %u)\n",
+			msg->bSlot, xfr->x_slot);
+		ccid->d_error = CCID_ERROR_BUS;
+		return 0;
+	}
+
+	if ( msg->bSeq != xfr->x_txhdr->bSeq ) {
+		fprintf(stderr, "*** error: expected seq 0x%.2x got 0x%.2x\n",
+			xfr->x_txhdr->bSeq, msg->bSeq);
+		ccid->d_error = CCID_ERROR_BUS;
+		return 0;
+	}
 
+	if ( msg->bSlot < CCID_MAX_SLOTS )
+		_chipcard_set_status(&ccid->d_slot[msg->bSlot],
+					msg->in.bStatus);
 	return 1;
 }
 
-static void _chipcard_set_status(struct _cci *cc, unsigned int status)
+/* Returns 1 if a further response is expected */
+static int rx_process(struct _ccid *ccid, struct _xfr *xfr, size_t len)
 {
-	switch( status & CCID_SLOT_STATUS_MASK ) {
-	case CCID_STATUS_ICC_ACTIVE:
-		trace(cc->i_parent, "     : ICC present and active\n");
-		cc->i_status = CHIPCARD_ACTIVE;
+	const struct ccid_msg *msg = xfr->x_rxhdr;
+
+	if ( !do_recv(ccid, xfr, len) )
+		return 0;
+
+	/* the aborted command may answer first, then the abort itself */
+	if ( xfr->x_abort ) {
+		if ( msg->bMessageType != RDR_to_PC_SlotStatus )
+			return 1;
+		xfr->x_result = 0;
+		return 0;
+	}
+
+	if ( msg->in.bStatus == CCID_RESULT_TIMEOUT && --xfr->x_retry ) {
+		ccid->d_stats.s_time_ext++;
+		/* bError is the multiple of BWT the card asked for */
+		if ( xfr->x_resp_ms )
+			xfr->x_resp_deadline = stats_now() / 1000 +
+				xfr->x_resp_ms * (msg->in.bError ?
+							msg->in.bError : 1);
+		return 1;
+	}
+
+	xfr->x_result = _cmd_result(ccid, xfr->x_rxhdr);
+	return 0;
+}
+
+static void in_done(struct libusb_transfer *t)
+{
+	struct _xfr *xfr = t->user_data;
+	struct _ccid *ccid = xfr->x_ccid;
+
+	pthread_mutex_lock(&ccid->d_lock);
+
+	switch(t->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		if ( !rx_process(ccid, xfr, t->actual_length) )
+			break;
+		if ( !libusb_submit_transfer(xfr->x_in) )
+			goto out;
+		fprintf(stderr, "*** error: libusb_submit_transfer()\n");
+		ccid->d_error = CCID_ERROR_BUS;
 		break;
-	case CCID_STATUS_ICC_PRESENT:
-		trace(cc->i_parent, "     : ICC present and inactive\n");
-		cc->i_status = CHIPCARD_PRESENT;
+	case LIBUSB_TRANSFER_CANCELLED:
 		break;
-	case CCID_STATUS_ICC_NOT_PRESENT:
-		trace(cc->i_parent, "     : ICC not presnt\n");
-		cc->i_status = CHIPCARD_NOT_PRESENT;
+	default:
+		fprintf(stderr, "*** error: bulk read failed\n");
+		usb_status_error(ccid, t->status);
+		break;
+	}
+
+	xfr_put(ccid, xfr);
+out:
+	pthread_mutex_unlock(&ccid->d_lock);
+	xfr_run_done(ccid);
+}
+
+static void rx_route(struct _ccid *ccid, const uint8_t *buf, size_t len)
+{
+	const struct ccid_msg *msg = (const struct ccid_msg *)buf;
+	struct _xfr *xfr;
+
+	if ( len < sizeof(*msg) ) {
+		fprintf(stderr, "*** error: truncated CCI msg\n");
+		ccid->d_error = CCID_ERROR_BUS;
+		return;
+	}
+
+	list_for_each_entry(xfr, &ccid->d_inflight, x_list) {
+		if ( !xfr->x_waiting )
+			continue;
+		if ( xfr->x_slot == msg->bSlot &&
+				xfr->x_txhdr->bSeq == msg->bSeq )
+			goto found;
+	}
+
+	fprintf(stderr, "*** error: unexpected msg for slot %u seq 0x%.2x\n",
+		msg->bSlot, msg->bSeq);
+	ccid->d_error = CCID_ERROR_BUS;
+	return;
+
+found:
+	if ( len > x_rbuflen(xfr) ) {
+		fprintf(stderr, "*** error: RX overflow %zu/%zu\n",
+			len, x_rbuflen(xfr));
+		ccid->d_error = CCID_ERROR_BUS;
+		xfr_answered(ccid, xfr);
+		return;
+	}
+
+	memcpy((void *)xfr->x_rxhdr, buf, len);
+	if ( !rx_process(ccid, xfr, len) )
+		xfr_answered(ccid, xfr);
+}
+
+static void rx_done(struct libusb_transfer *t)
+{
+	struct _ccid_rx *rx = t->user_data;
+	struct _ccid *ccid = rx->r_ccid;
+
+	pthread_mutex_lock(&ccid->d_lock);
+
+	rx->r_busy = 0;
+	ccid->d_rx_posted--;
+
+	switch(t->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		rx_route(ccid, rx->r_buf, t->actual_length);
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
 		break;
 	default:
-		fprintf(stderr, "*** error: unknown chipcard status update\n");
+		fprintf(stderr, "*** error: bulk read failed\n");
+		usb_status_error(ccid, t->status);
+		fail_waiting(ccid);
+		break;
+	}
+
+	/* keep one receive posted for every command awaiting a response */
+	while ( ccid->d_rx_posted < ccid->d_unanswered ) {
+		if ( !rx_post(ccid) ) {
+			fail_waiting(ccid);
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&ccid->d_lock);
+	xfr_run_done(ccid);
+}
+
+/* CCID 5.3.1, the control request goes first and then the bulk message,
+ * both naming the slot and sequence number of the command to abort.
+ */
+static void send_abort(struct _ccid *ccid, uint8_t slot, uint8_t seq)
+{
+	struct ccid_msg msg;
+	uint8_t rt;
+	int len;
+
+	rt = (LIBUSB_ENDPOINT_OUT|
+		LIBUSB_REQUEST_TYPE_CLASS|LIBUSB_RECIPIENT_INTERFACE);
+	if ( libusb_control_transfer(ccid->d_dev, rt, CCID_CTL_ABORT,
+					(seq << 8) | slot, ccid->d_intf,
+					NULL, 0, XFR_ABORT_MS) < 0 )
+		trace(ccid, "     : ABORT control request failed\n");
+
+	memset(&msg, 0, sizeof(msg));
+	msg.bMessageType = PC_to_RDR_Abort;
+	msg.bSlot = slot;
+	msg.bSeq = seq;
+	_trace_msg(ccid, TRACE_XMIT, &msg, sizeof(msg));
+	trace(ccid, " Xmit: PC_to_RDR_Abort(%u) seq 0x%.2x\n", slot, seq);
+
+	if ( libusb_bulk_transfer(ccid->d_dev, ccid->d_outp, (void *)&msg,
+					sizeof(msg), &len, XFR_ABORT_MS) )
+		trace(ccid, "     : PC_to_RDR_Abort failed\n");
+}
+
+#define CANCEL_NONE	0
+#define CANCEL_ABORT	1 /* send_abort() must be called */
+#define CANCEL_DONE	2 /* xfr_run_done() must be called */
+
+/* Cancel a transfer, called with d_lock held. Queued ones fail at once. The
+ * first time round one in flight is marked as aborting, and then completes
+ * when the reader confirms the abort. If that doesn't happen within
+ * XFR_ABORT_MS then the next call cancels the USB transfers.
+ */
+static int xfr_cancel(struct _ccid *ccid, struct _xfr *xfr,
+			uint8_t *slot, uint8_t *seq)
+{
+	switch(xfr->x_state) {
+	case XFR_STATE_QUEUED:
+		list_del(&xfr->x_list);
+		xfr->x_result = 0;
+		xfr_finish(ccid, xfr);
+		return CANCEL_DONE;
+	case XFR_STATE_INFLIGHT:
 		break;
+	default:
+		return CANCEL_NONE;
 	}
+
+	if ( !xfr->x_abort ) {
+		xfr->x_abort = 1;
+		xfr->x_resp_deadline = 0;
+		xfr->x_deadline = stats_now() / 1000 + XFR_ABORT_MS;
+		*slot = xfr->x_txhdr->bSlot;
+		*seq = xfr->x_txhdr->bSeq;
+		return CANCEL_ABORT;
+	}
+
+	trace(ccid, "     : Abort not confirmed, giving up on seq 0x%.2x\n",
+		xfr->x_txhdr->bSeq);
+	xfr->x_deadline = 0;
+	libusb_cancel_transfer(xfr->x_out);
+	if ( !ccid->d_num_rx ) {
+		libusb_cancel_transfer(xfr->x_in);
+		return CANCEL_NONE;
+	}
+	if ( xfr->x_waiting )
+		xfr_answered(ccid, xfr);
+	return CANCEL_DONE;
+}
+
+static void cancel_finish(struct _ccid *ccid, int rc, uint8_t slot,
+				uint8_t seq)
+{
+	if ( rc == CANCEL_ABORT )
+		send_abort(ccid, slot, seq);
+	if ( rc == CANCEL_DONE )
+		xfr_run_done(ccid);
+	/* whoever is waiting should notice */
+	libusb_interrupt_event_handler(_libccid_ctx());
+}
+
+/* Earliest deadline of a transfer, zero for none, called with d_lock held */
+static uint64_t deadline_of(const struct _xfr *xfr)
+{
+	uint64_t ret;
+
+	ret = xfr->x_deadline;
+	if ( xfr->x_resp_deadline && (!ret || xfr->x_resp_deadline < ret) )
+		ret = xfr->x_resp_deadline;
+	return ret;
+}
+
+static uint64_t xfr_until(struct _ccid *ccid, struct _xfr *xfr)
+{
+	uint64_t ret;
+
+	pthread_mutex_lock(&ccid->d_lock);
+	ret = deadline_of(xfr);
+	pthread_mutex_unlock(&ccid->d_lock);
+
+	return ret;
+}
+
+/* Called with d_lock held */
+static int xfr_timeout(struct _ccid *ccid, struct _xfr *xfr,
+			uint8_t *slot, uint8_t *seq)
+{
+	if ( !xfr->x_abort ) {
+		trace(ccid, " Timeout: slot %u seq 0x%.2x\n",
+			xfr->x_slot, xfr->x_txhdr->bSeq);
+		ccid->d_error = CCID_ERROR_CARD_TIMEOUT;
+	}
+	return xfr_cancel(ccid, xfr, slot, seq);
+}
+
+static void xfr_expire(struct _ccid *ccid, struct _xfr *xfr)
+{
+	uint8_t slot = 0, seq = 0;
+	int rc;
+
+	pthread_mutex_lock(&ccid->d_lock);
+	rc = xfr_timeout(ccid, xfr, &slot, &seq);
+	pthread_mutex_unlock(&ccid->d_lock);
+
+	cancel_finish(ccid, rc, slot, seq);
+}
+
+/* Called with d_lock held, the first transfer past its deadline, or the
+ * milliseconds until the next one is due in *ms, -1 if none are.
+ */
+static struct _xfr *next_expired(struct _ccid *ccid, uint64_t now, int *ms)
+{
+	struct list_head *lists[] = {&ccid->d_inflight, &ccid->d_queue};
+	struct _xfr *xfr;
+	uint64_t until;
+	unsigned int i;
+
+	*ms = -1;
+	for(i = 0; i < sizeof(lists)/sizeof(*lists); i++) {
+		list_for_each_entry(xfr, lists[i], x_list) {
+			until = deadline_of(xfr);
+			if ( !until )
+				continue;
+			if ( now >= until )
+				return xfr;
+			if ( *ms < 0 || until - now < (uint64_t)*ms )
+				*ms = until - now;
+		}
+	}
+
+	return NULL;
+}
+
+/* Deadlines of asynchronous transfers, for ccid_flush() and the event loop
+ * since nobody sits in xfr_wait() for those. Returns the milliseconds until
+ * the next one is due, or -1 if none are.
+ */
+int _ccid_expire_xfrs(struct _ccid *ccid)
+{
+	struct _xfr *xfr;
+	uint8_t slot, seq;
+	int ms, rc;
+
+	for(;;) {
+		/* the completion may free it, so cancel under the lock */
+		slot = seq = 0;
+		pthread_mutex_lock(&ccid->d_lock);
+		xfr = next_expired(ccid, stats_now() / 1000, &ms);
+		if ( xfr )
+			rc = xfr_timeout(ccid, xfr, &slot, &seq);
+		pthread_mutex_unlock(&ccid->d_lock);
+		if ( NULL == xfr )
+			return ms;
+		cancel_finish(ccid, rc, slot, seq);
+	}
+}
+
+static int xfr_wait(struct _ccid *ccid, struct _xfr *xfr)
+{
+	struct timeval tv;
+	uint64_t until, now;
+	int rc;
+
+	while ( !xfr->x_done ) {
+		until = xfr_until(ccid, xfr);
+		if ( until ) {
+			now = stats_now() / 1000;
+			if ( now >= until ) {
+				xfr_expire(ccid, xfr);
+				continue;
+			}
+			tv.tv_sec = (until - now) / 1000;
+			tv.tv_usec = ((until - now) % 1000) * 1000;
+			rc = libusb_handle_events_timeout_completed(
+					_libccid_ctx(), &tv, &xfr->x_done);
+		}else{
+			rc = libusb_handle_events_completed(_libccid_ctx(),
+							&xfr->x_done);
+		}
+		if ( rc == LIBUSB_ERROR_INTERRUPTED )
+			continue;
+		if ( rc ) {
+			fprintf(stderr, "*** error: libusb_handle_events()\n");
+			usb_xfr_error(ccid, rc);
+			return 0;
+		}
+	}
+
+	return xfr->x_result;
 }
 
 int _RDR_to_PC(struct _ccid *ccid, unsigned int slot, struct _xfr *xfr)
 {
-	const struct ccid_msg *msg;
-	unsigned int try = 10;
+	assert(xfr->x_ccid == ccid && xfr->x_slot == slot);
+	return xfr_wait(ccid, xfr);
+}
 
-again:
-	if ( !do_recv(ccid, xfr) )
+/* Answer from a recorded session instead of the wire, called with d_lock
+ * held. The command completes immediately.
+ */
+static void replay_xfr(struct _ccid *ccid, struct _xfr *xfr)
+{
+	size_t len;
+
+	list_add_tail(&xfr->x_list, &ccid->d_inflight);
+	ccid->d_num_inflight++;
+	xfr->x_state = XFR_STATE_INFLIGHT;
+	xfr->x_start = stats_now();
+	ccid->d_stats.s_tx_bytes += x_tbuflen(xfr);
+
+	len = _replay_answer(ccid->d_replay, xfr, x_tbuflen(xfr));
+	if ( len )
+		rx_process(ccid, xfr, len);
+	else
+		ccid->d_error = CCID_ERROR_BUS;
+
+	xfr_finish(ccid, xfr);
+}
+
+/* Longest a card may take to start answering a block, from the waiting
+ * time negotiated at power on or the ISO 7816-3 defaults, plus slack. Zero
+ * if unknown, or if the reader exchanges whole APDUs and so hides it.
+ */
+static unsigned int block_wait_ms(struct _ccid *ccid, struct _cci *cci)
+{
+	uint32_t khz = ccid->d_desc.dwDefaultClock;
+	unsigned int fidi = 0x11, wi = 10, bwi = 4;
+	uint64_t clocks;
+
+	if ( ccid->d_desc.dwFeatures & (CCID_T1_APDU|CCID_T1_APDU_EXT) )
+		return 0;
+	if ( !khz )
+		return 0;
+
+	if ( cci->i_params_len ) {
+		fidi = cci->i_params[0];
+		wi = cci->i_params[3];
+		bwi = cci->i_params[3] >> 4;
+	}
+	if ( !fi_table[fidi >> 4].fi || !di_table[fidi & 0xf] )
+		fidi = 0x11;
+	if ( bwi > 9 )
+		bwi = 9;
+
+	if ( cci->i_params_len && cci->i_proto == CCID_PROTOCOL_T0 ) {
+		/* WT = WI * 960 * Fi / f */
+		clocks = (uint64_t)wi * 960 * fi_table[fidi >> 4].fi;
+	}else{
+		/* BWT = 11 etu + 2^BWI * 960 * 372 / f, the longer default */
+		clocks = 11ULL * fi_table[fidi >> 4].fi /
+				di_table[fidi & 0xf] +
+			(960ULL * 372 << bwi);
+	}
+
+	return clocks / khz + 1 + XFR_RESP_SLACK_MS;
+}
+
+/* Called with d_lock held */
+static void xfr_deadlines(struct _ccid *ccid, unsigned int slot,
+				struct _xfr *xfr)
+{
+	struct _cci *cci;
+
+	xfr->x_deadline = 0;
+	xfr->x_resp_deadline = 0;
+	xfr->x_resp_ms = 0;
+	xfr->x_abort = 0;
+
+	if ( slot >= ccid->d_num_slots || ccid->d_replay )
+		return;
+
+	cci = &ccid->d_slot[slot];
+	if ( !cci->i_timeout_ms )
+		return;
+
+	xfr->x_deadline = (cci->i_deadline) ? cci->i_deadline :
+				stats_now() / 1000 + cci->i_timeout_ms;
+	if ( xfr->x_txhdr->bMessageType == PC_to_RDR_XfrBlock ) {
+		xfr->x_resp_ms = block_wait_ms(ccid, cci);
+		if ( xfr->x_txhdr->out.bApp[0] > 1 )
+			xfr->x_resp_ms *= xfr->x_txhdr->out.bApp[0];
+	}
+}
+
+static int _PC_to_RDR(struct _ccid *ccid, unsigned int slot, struct _xfr *xfr)
+{
+	/* Escape functions may use bad slots as part of their
+	 * interface. For example this is useful in detecting the
+	 * presence or absense of specific vendor extensions
+	 */
+	if ( xfr->x_txhdr->bMessageType != PC_to_RDR_Escape ) {
+		assert(slot < ccid->d_num_slots);
+	}
+
+	pthread_mutex_lock(&ccid->d_lock);
+
+	if ( xfr->x_state != XFR_STATE_IDLE ) {
+		pthread_mutex_unlock(&ccid->d_lock);
+		fprintf(stderr, "*** error: xfr already submitted\n");
+		ccid->d_error = CCID_ERROR_IN_VALUE;
+		return 0;
+	}
+
+	xfr->x_txhdr->dwLength = le32toh(xfr->x_txlen);
+	xfr->x_txhdr->bSlot = slot;
+	xfr->x_txhdr->bSeq = ccid->d_seq++;
+	_trace_msg(ccid, TRACE_XMIT, xfr->x_txhdr, x_tbuflen(xfr));
+
+	xfr->x_ccid = ccid;
+	xfr->x_slot = slot;
+	xfr->x_busy = 0;
+	xfr->x_waiting = 0;
+	xfr->x_retry = XFR_MAX_RETRY;
+	xfr->x_result = 0;
+	xfr->x_done = 0;
+	xfr_deadlines(ccid, slot, xfr);
+	if ( ccid->d_replay ) {
+		replay_xfr(ccid, xfr);
+	}else{
+		xfr->x_state = XFR_STATE_QUEUED;
+		list_add_tail(&xfr->x_list, &ccid->d_queue);
+		xfr_kick(ccid);
+	}
+
+	pthread_mutex_unlock(&ccid->d_lock);
+	xfr_run_done(ccid);
+	return 1;
+}
+
+static int rx_pool_alloc(struct _ccid *ccid)
+{
+	unsigned int i, num;
+	size_t len;
+
+	num = ccid->d_max_slots;
+	if ( num > ccid->d_num_slots )
+		num = ccid->d_num_slots;
+	if ( num <= 1 )
+		return 1;
+
+	len = ccid->d_desc.dwMaxCCIDMessageLength;
+	if ( len < sizeof(struct ccid_msg) + ccid->d_max_in )
+		len = sizeof(struct ccid_msg) + ccid->d_max_in;
+
+	ccid->d_rx = calloc(num, sizeof(*ccid->d_rx));
+	if ( NULL == ccid->d_rx )
 		return 0;
 
-	msg = xfr->x_rxhdr;
+	for(i = 0; i < num; i++) {
+		ccid->d_rx[i].r_ccid = ccid;
+		ccid->d_rx[i].r_len = len;
+		ccid->d_rx[i].r_buf = malloc(len);
+		ccid->d_rx[i].r_xfer = libusb_alloc_transfer(0);
+		ccid->d_num_rx++;
+		if ( NULL == ccid->d_rx[i].r_buf ||
+				NULL == ccid->d_rx[i].r_xfer )
+			return 0;
+	}
+
+	trace(ccid, " o %u slots may be busy concurrently\n", num);
+	return 1;
+}
+
+static void rx_pool_free(struct _ccid *ccid)
+{
+	unsigned int i;
+	int rc;
+
+	/* cancel surplus receives left posted after a failed command */
+	pthread_mutex_lock(&ccid->d_lock);
+	for(i = 0; i < ccid->d_num_rx; i++) {
+		if ( ccid->d_rx[i].r_busy )
+			libusb_cancel_transfer(ccid->d_rx[i].r_xfer);
+	}
+	pthread_mutex_unlock(&ccid->d_lock);
+
+	while ( ccid->d_rx_posted ) {
+		rc = libusb_handle_events(_libccid_ctx());
+		if ( rc && rc != LIBUSB_ERROR_INTERRUPTED )
+			break;
+	}
+
+	for(i = 0; i < ccid->d_num_rx; i++) {
+		libusb_free_transfer(ccid->d_rx[i].r_xfer);
+		free(ccid->d_rx[i].r_buf);
+	}
+	free(ccid->d_rx);
+	ccid->d_rx = NULL;
+	ccid->d_num_rx = 0;
+}
+
+static int expire_idle(struct _ccid *ccid, uint64_t now)
+{
+	unsigned int i;
+	int ret = -1, ms;
+
+	for(i = 0; i < ccid->d_num_slots; i++) {
+		ms = _cci_idle_expire(&ccid->d_slot[i], now);
+		if ( ms >= 0 && (ret < 0 || ms < ret) )
+			ret = ms;
+	}
+
+	for(i = 0; i < ccid->d_num_rf; i++) {
+		ms = _cci_idle_expire(&ccid->d_rf[i], now);
+		if ( ms >= 0 && (ret < 0 || ms < ret) )
+			ret = ms;
+	}
+
+	return ret;
+}
+
+/** Power off cards whose keep powered idle timeout has passed.
+ * \ingroup g_ccid
+ * @param ccid The \ref ccid_t to check.
+ *
+ * Only needed by applications which leave readers alone for a long time
+ * without an event loop, see \ref cci_set_idle_timeout.
+ *
+ * @return milliseconds until the next card is due to be powered off, or -1
+ * if no cards are being kept powered.
+ */
+int ccid_expire_idle(ccid_t ccid)
+{
+	return expire_idle(ccid, _cci_now_msec());
+}
+
+/** Abort the commands on a slot.
+ * \ingroup g_ccid
+ * @param ccid The \ref ccid_t.
+ * @param slot Slot number.
+ *
+ * May be called from any thread. Commands still queued fail at once. The
+ * one in flight, if any, is aborted with an ABORT request and a
+ * PC_to_RDR_Abort, and fails once the reader confirms, or after half a
+ * second by cancelling its USB transfers if the thread waiting on it gives
+ * up. \ref ccid_error then returns CCID_ERROR_CANCELLED.
+ *
+ * @return zero if there was nothing to cancel.
+ */
+int ccid_cancel(ccid_t ccid, unsigned int slot)
+{
+	struct _xfr *xfr, *tmp;
+	uint8_t bslot = 0, seq = 0;
+	int rc, abort = CANCEL_NONE, done = 0;
 
-	trace(ccid, " Recv: %zu bytes for slot %u (seq = 0x%.2x)\n",
-		xfr->x_rxlen, msg->bSlot, msg->bSeq);
+	pthread_mutex_lock(&ccid->d_lock);
 
-	if ( msg->bSlot != slot ) {
-		fprintf(stderr, "*** error: bad slot %u (expected %u)\n",
-			msg->bSlot, slot);
-		ccid->d_error = CCID_ERROR_BUS;
-		return 0;
+	list_for_each_entry_safe(xfr, tmp, &ccid->d_queue, x_list) {
+		if ( xfr->x_slot != slot )
+			continue;
+		xfr_cancel(ccid, xfr, &bslot, &seq);
+		done = 1;
 	}
 
-	if ( (uint8_t)(msg->bSeq + 1) != ccid->d_seq ) {
-		fprintf(stderr, "*** error: expected seq 0x%.2x got 0x%.2x\n",
-			ccid->d_seq, (uint8_t)(msg->bSeq + 1));
-		ccid->d_error = CCID_ERROR_BUS;
-		return 0;
+	list_for_each_entry(xfr, &ccid->d_inflight, x_list) {
+		if ( xfr->x_slot != slot || xfr->x_abort )
+			continue;
+		abort = xfr_cancel(ccid, xfr, &bslot, &seq);
+		break;
 	}
 
-	_chipcard_set_status(&ccid->d_slot[msg->bSlot], msg->in.bStatus);
+	if ( done || abort )
+		ccid->d_error = CCID_ERROR_CANCELLED;
 
-	if ( xfr->x_rxhdr->in.bStatus == CCID_RESULT_TIMEOUT && --try )
-		goto again;
+	pthread_mutex_unlock(&ccid->d_lock);
 
-	return _cmd_result(ccid, xfr->x_rxhdr);
+	rc = (done || abort);
+	if ( done )
+		xfr_run_done(ccid);
+	if ( rc )
+		cancel_finish(ccid, abort, bslot, seq);
+	return rc;
 }
 
-static int _PC_to_RDR(struct _ccid *ccid, unsigned int slot, struct _xfr *xfr)
+/** Wait for all outstanding transactions to complete.
+ * \ingroup g_ccid
+ * @param ccid The \ref ccid_t to wait on.
+ *
+ * Runs the USB event loop until every transaction submitted with
+ * \ref cci_submit has completed and had its callback run.
+ *
+ * @return zero on failure.
+ */
+int ccid_flush(ccid_t ccid)
 {
-	int ret, rc;
-	size_t len;
-
-	/* Escape functions may use bad slots as part of their
-	 * interface. For example this is useful in detecting the
-	 * presence or absense of specific vendor extensions
-	 */
-	if ( xfr->x_txhdr->bMessageType != PC_to_RDR_Escape ) {
-		assert(slot < ccid->d_num_slots);
-	}
-
-	xfr->x_txhdr->dwLength = le32toh(xfr->x_txlen);
-	xfr->x_txhdr->bSlot = slot;
-	xfr->x_txhdr->bSeq = ccid->d_seq++;
+	struct timeval tv;
+	int rc, busy, ms;
 
-again:
-	rc = libusb_bulk_transfer(ccid->d_dev, ccid->d_outp,
-				(void *)xfr->x_txhdr,
-				x_tbuflen(xfr), &ret, 0);
-	if ( rc == LIBUSB_ERROR_INTERRUPTED )
-		goto again;
-	if ( rc ) {
-		fprintf(stderr, "*** error: libusb_bulk_write()\n");
-		usb_xfr_error(ccid, rc);
-		return 0;
-	}
+	for(;;) {
+		ms = _ccid_expire_xfrs(ccid);
 
-	len = (size_t)ret;
+		pthread_mutex_lock(&ccid->d_lock);
+		busy = (!list_empty(&ccid->d_inflight) ||
+			!list_empty(&ccid->d_queue));
+		pthread_mutex_unlock(&ccid->d_lock);
+		if ( !busy )
+			break;
 
-	if ( ret < x_tbuflen(xfr) ) {
-		fprintf(stderr, "*** error: truncated TX: %zu/%zu\n",
-			len, x_tbuflen(xfr));
-		ccid->d_error = CCID_ERROR_BUS;
-		return 0;
+		if ( ms >= 0 ) {
+			tv.tv_sec = ms / 1000;
+			tv.tv_usec = (ms % 1000) * 1000;
+			rc = libusb_handle_events_timeout(_libccid_ctx(), &tv);
+		}else{
+			rc = libusb_handle_events(_libccid_ctx());
+		}
+		if ( rc == LIBUSB_ERROR_INTERRUPTED )
+			continue;
+		if ( rc ) {
+			fprintf(stderr, "*** error: libusb_handle_events()\n");
+			usb_xfr_error(ccid, rc);
+			return 0;
+		}
 	}
 
 	return 1;
 }
 
-int _PC_to_RDR_XfrBlock(struct _ccid *ccid, unsigned int slot, struct _xfr *xfr)
+/* bwi multiplies the block waiting time, for T=1 waiting time extensions on
+ * TPDU level readers, zero for none.
+ */
+int _PC_to_RDR_XfrBlock_bwi(struct _ccid *ccid, unsigned int slot,
+				struct _xfr *xfr, unsigned int bwi)
 {
 	int ret;
 
 	memset(xfr->x_txhdr, 0, sizeof(*xfr->x_txhdr));
 	xfr->x_txhdr->bMessageType = PC_to_RDR_XfrBlock;
-	//xfr->x_txhdr->out.bApp[0] = 0xff; /* wait integer */
+	xfr->x_txhdr->out.bApp[0] = bwi;
 	ret = _PC_to_RDR(ccid, slot, xfr);
 	if ( ret ) {
 		trace(ccid, " Xmit: PC_to_RDR_XfrBlock(%u)\n", slot);
+		if ( bwi )
+			trace(ccid, "     : BWT x %u\n", bwi);
 		_hex_dumpf(ccid->d_tf, xfr->x_txbuf, xfr->x_txlen, 16);
 	}
 	return ret;
 }
 
+int _PC_to_RDR_XfrBlock(struct _ccid *ccid, unsigned int slot, struct _xfr *xfr)
+{
+	return _PC_to_RDR_XfrBlock_bwi(ccid, slot, xfr, 0);
+}
+
 int _PC_to_RDR_Escape(struct _ccid *ccid, unsigned int slot, struct _xfr *xfr)
 {
 	int ret;
@@ -477,12 +1659,13 @@ int _PC_to_RDR_GetParameters(struct _ccid *ccid, unsigned int slot,
 }
 
 int _PC_to_RDR_SetParameters(struct _ccid *ccid, unsigned int slot,
-				struct _xfr *xfr)
+				struct _xfr *xfr, unsigned int proto)
 {
 	int ret;
 
 	memset(xfr->x_txhdr, 0, sizeof(*xfr->x_txhdr));
 	xfr->x_txhdr->bMessageType = PC_to_RDR_SetParameters;
+	xfr->x_txhdr->out.bApp[0] = proto;
 	ret = _PC_to_RDR(ccid, slot, xfr);
 	if ( ret )
 		trace(ccid, " Xmit: PC_to_RDR_SetParameters(%u)\n", slot);
@@ -759,18 +1942,11 @@ static int fill_ccid_desc(struct _ccid *ccid, const uint8_t *ptr, size_t len)
 	return 1;
 }
 
-static int probe_descriptors(struct _ccid *ccid)
+static int parse_descriptors(struct _ccid *ccid, const uint8_t *dbuf,
+				size_t sz)
 {
-	uint8_t dbuf[512];
-	uint8_t *ptr, *end;
-	int sz, valid_ccid = 0;
-
-	sz = libusb_get_descriptor(ccid->d_dev, LIBUSB_DT_CONFIG, 0,
-				dbuf, sizeof(dbuf));
-	if ( sz < 0 )
-		return 0;
-
-	trace(ccid, " o Fetching config descriptor\n");
+	const uint8_t *ptr, *end;
+	int valid_ccid = 0;
 
 	for(ptr = dbuf, end = ptr + sz; ptr + 2 < end; ) {
 		if ( ptr + ptr[0] > end )
@@ -809,6 +1985,22 @@ static int probe_descriptors(struct _ccid *ccid)
 	return 1;
 }
 
+static int probe_descriptors(struct _ccid *ccid)
+{
+	uint8_t dbuf[512];
+	int sz;
+
+	sz = libusb_get_descriptor(ccid->d_dev, LIBUSB_DT_CONFIG, 0,
+				dbuf, sizeof(dbuf));
+	if ( sz < 0 )
+		return 0;
+
+	trace(ccid, " o Fetching config descriptor\n");
+	_trace_msg(ccid, TRACE_DESC, dbuf, sz);
+
+	return parse_descriptors(ccid, dbuf, sz);
+}
+
 static int get_data_rates(struct _ccid *ccid)
 {
 	uint32_t buf[ccid->d_desc.bNumDataRatesSupported];
@@ -882,11 +2074,98 @@ static int get_clock_freqs(struct _ccid *ccid)
 	return 1;
 }
 
+static void free_slot_xfrs(struct _ccid *ccid)
+{
+	unsigned int x;
+
+	for(x = 0; x < CCID_MAX_SLOTS; x++) {
+		if ( ccid->d_slot[x].i_xfr != ccid->d_xfr )
+			_xfr_do_free(ccid->d_slot[x].i_xfr);
+		ccid->d_slot[x].i_xfr = NULL;
+		_t1_free(&ccid->d_slot[x].i_t1);
+	}
+}
+
+static struct _ccid *ccid_new(const char *tracefile)
+{
+	struct _ccid *ccid;
+	unsigned int x;
+
+	ccid = calloc(1, sizeof(*ccid));
+	if ( NULL == ccid )
+		return NULL;
+
+	pthread_mutex_init(&ccid->d_lock, NULL);
+	INIT_LIST_HEAD(&ccid->d_queue);
+	INIT_LIST_HEAD(&ccid->d_inflight);
+	INIT_LIST_HEAD(&ccid->d_done);
+
+	if ( tracefile && !strncmp("bin:", tracefile, 4) ) {
+		ccid->d_bt = _trace_open(tracefile + 4);
+		if ( ccid->d_bt == NULL )
+			goto err;
+	}else if ( tracefile ) {
+		if ( !strcmp("-", tracefile) )
+			ccid->d_tf = stdout;
+		else
+			ccid->d_tf = fopen(tracefile, "w");
+		if ( ccid->d_tf == NULL )
+			goto err;
+	}
+
+	for(x = 0; x < CCID_MAX_SLOTS; x++) {
+		ccid->d_slot[x].i_parent = ccid;
+		ccid->d_slot[x].i_idx = x;
+		ccid->d_slot[x].i_ops = &_contact_ops;
+	}
+
+	for(x = 0; x < RFID_MAX_FIELDS; x++) {
+		ccid->d_rf[x].i_parent = ccid;
+		ccid->d_rf[x].i_ops = &_rfid_ops;
+		/* idx and ops set by proprietary initialisation routines */
+	}
+
+	return ccid;
+err:
+	pthread_mutex_destroy(&ccid->d_lock);
+	free(ccid);
+	return NULL;
+}
+
+/* Undo ccid_new() */
+static void ccid_free(struct _ccid *ccid)
+{
+	_trace_close(ccid->d_bt);
+	pthread_mutex_destroy(&ccid->d_lock);
+	free(ccid);
+}
+
+static int setup_slots(struct _ccid *ccid)
+{
+	unsigned int x;
+
+	trace(ccid, "Setting up %u contact card slots\n", ccid->d_num_slots);
+	for(x = 0; x < ccid->d_num_slots; x++) {
+		if ( !_PC_to_RDR_GetSlotStatus(ccid, x, ccid->d_slot[x].i_xfr) )
+			return 0;
+		if ( !_RDR_to_PC(ccid, x, ccid->d_slot[x].i_xfr) )
+			return 0;
+		if ( !_RDR_to_PC_SlotStatus(ccid, ccid->d_slot[x].i_xfr) )
+			return 0;
+	}
+
+	return 1;
+}
+
 /** Connect to a physical chipcard device.
  * \ingroup g_ccid
  * @param dev \ref ccidev_t representing a physical device.
  * @param tracefile filename to open for trace logging (or NULL).
  *
+ * A tracefile of "-" logs to stdout. A name prefixed with "bin:" creates a
+ * compact binary trace of the raw messages instead of the text log, which is
+ * far cheaper to write and may be decoded later with ccid-trace.
+ *
  * This function:
  * #- Probes the USB device searching for a valid CCID interface.
  * #- Optionally opens a file for trace logging.
@@ -896,7 +2175,9 @@ static int get_clock_freqs(struct _ccid *ccid)
  */
 ccid_t ccid_probe(ccidev_t dev, const char *tracefile)
 {
+	struct libusb_device_descriptor dd;
 	struct _cci_interface intf;
+	struct _cap_key key;
 	struct _ccid *ccid = NULL;
 	unsigned int x;
 	int c;
@@ -905,38 +2186,23 @@ ccid_t ccid_probe(ccidev_t dev, const char *tracefile)
 		goto out;
 	}
 
+	if ( libusb_get_device_descriptor(dev, &dd) )
+		goto out;
+	key.k_vid = dd.idVendor;
+	key.k_pid = dd.idProduct;
+	key.k_bcd = dd.bcdDevice;
+
 	/* First initialize data structures */
-	ccid = calloc(1, sizeof(*ccid));
+	ccid = ccid_new(tracefile);
 	if ( NULL == ccid )
 		goto out;
 
-	if ( tracefile ) {
-		if ( !strcmp("-", tracefile) )
-			ccid->d_tf = stdout;
-		else
-			ccid->d_tf = fopen(tracefile, "w");
-		if ( ccid->d_tf == NULL )
-			goto out_free;
-	}
-
 	trace(ccid, "Probe CCI on dev %u:%u %d/%d/%d\n",
 		libusb_get_bus_number(dev),
 		libusb_get_device_address(dev), intf.c, intf.i, intf.a);
 	if ( intf.name )
 		trace(ccid, "Recognised as: %s\n", intf.name);
 
-	for(x = 0; x < CCID_MAX_SLOTS; x++) {
-		ccid->d_slot[x].i_parent = ccid;
-		ccid->d_slot[x].i_idx = x;
-		ccid->d_slot[x].i_ops = &_contact_ops;
-	}
-
-	for(x = 0; x < RFID_MAX_FIELDS; x++) {
-		ccid->d_rf[x].i_parent = ccid;
-		ccid->d_rf[x].i_ops = &_rfid_ops;
-		/* idx and ops set by proprietary initialisation routines */
-	}
-
 	/* Second, open USB device and get it ready */
 	if ( libusb_open(dev, &ccid->d_dev) ) {
 		goto out_free;
@@ -984,47 +2250,263 @@ ccid_t ccid_probe(ccidev_t dev, const char *tracefile)
 		goto out_close;
 	}
 
-	if ( !get_data_rates(ccid) )
-		goto out_close;
-	if( !get_clock_freqs(ccid) )
-		goto out_close;
+	if ( _cap_lookup(ccid, &key) ) {
+		trace(ccid, " o Rates and clocks from capability cache\n");
+	}else{
+		if ( !get_data_rates(ccid) )
+			goto out_close;
+		if( !get_clock_freqs(ccid) )
+			goto out_close;
+		_cap_store(ccid, &key);
+	}
 
 	ccid->d_xfr = _xfr_do_alloc(ccid->d_max_out, ccid->d_max_in);
 	if ( NULL == ccid->d_xfr )
 		goto out_close;
 
-	/* Fourth, setup each slot */
-	trace(ccid, "Setting up %u contact card slots\n", ccid->d_num_slots);
-	for(x = 0; x < ccid->d_num_slots; x++) {
-		if ( !_PC_to_RDR_GetSlotStatus(ccid, x, ccid->d_xfr) )
-			goto out_freebuf;
-		if ( !_RDR_to_PC(ccid, x, ccid->d_xfr) )
-			goto out_freebuf;
-		if ( !_RDR_to_PC_SlotStatus(ccid, ccid->d_xfr) )
+	for(x = 0; x < CCID_MAX_SLOTS; x++)
+		ccid->d_slot[x].i_xfr = ccid->d_xfr;
+
+	if ( !rx_pool_alloc(ccid) )
+		goto out_freebuf;
+
+	/* Slots which may be busy concurrently need their own buffers */
+	for(x = 1; ccid->d_num_rx && x < ccid->d_num_slots; x++) {
+		ccid->d_slot[x].i_xfr = _xfr_do_alloc(ccid->d_max_out,
+							ccid->d_max_in);
+		if ( NULL == ccid->d_slot[x].i_xfr )
 			goto out_freebuf;
 	}
 
+	/* Fourth, setup each slot */
+	if ( !setup_slots(ccid) )
+		goto out_freebuf;
+
 	/* Fifth, Initialise any proprietary interfaces */
 	if ( intf.flags & INTF_RFID_OMNI )
 		_omnikey_init_prox(ccid);
 
 	ccid->d_bus = libusb_get_bus_number(dev);
 	ccid->d_addr = libusb_get_device_address(dev);
-	ccid->d_name = strdup(intf.name);
+	ccid->d_name = strdup((intf.name) ? intf.name : "Generic CCID");
 	goto out;
 
 out_freebuf:
+	free_slot_xfrs(ccid);
+	rx_pool_free(ccid);
 	_xfr_do_free(ccid->d_xfr);
 out_close:
 	libusb_close(ccid->d_dev);
 out_free:
-	free(ccid);
+	ccid_free(ccid);
 	ccid = NULL;
 	fprintf(stderr, "ccid: error probing device\n");
 out:
 	return ccid;
 }
 
+/** Open a virtual CCID which replays a recorded session.
+ * \ingroup g_ccid
+ * @param fn binary trace file recorded by passing "bin:<file>" as the
+ * tracefile argument of \ref ccid_probe.
+ * @param tracefile filename to open for trace logging (or NULL).
+ *
+ * No USB device is used. Each command is answered at once with the recorded
+ * response to the next matching command in the trace, preferring identical
+ * ones, and wrapping around at the end. This allows host side code to be
+ * benchmarked and tested without readers or cards.
+ *
+ * @return NULL on failure, valid \ref ccid_t object otherwise.
+ */
+ccid_t ccid_probe_replay(const char *fn, const char *tracefile)
+{
+	struct _ccid *ccid;
+	const uint8_t *desc;
+	size_t desc_len;
+	unsigned int x;
+
+	ccid = ccid_new(tracefile);
+	if ( NULL == ccid )
+		return NULL;
+
+	trace(ccid, "Replay CCI from %s\n", fn);
+
+	ccid->d_replay = _replay_open(fn);
+	if ( NULL == ccid->d_replay )
+		goto out_free;
+
+	desc = _replay_desc(ccid->d_replay, &desc_len);
+	if ( NULL == desc ) {
+		fprintf(stderr, "*** error: %s: no descriptors recorded\n", fn);
+		goto out_free;
+	}
+
+	if ( !parse_descriptors(ccid, desc, desc_len) )
+		goto out_free;
+
+	/* slot changes are not replayed */
+	ccid->d_intrp = 0;
+
+	ccid->d_xfr = _xfr_do_alloc(ccid->d_max_out, ccid->d_max_in);
+	if ( NULL == ccid->d_xfr )
+		goto out_free;
+
+	for(x = 0; x < CCID_MAX_SLOTS; x++)
+		ccid->d_slot[x].i_xfr = ccid->d_xfr;
+
+	if ( !setup_slots(ccid) )
+		goto out_freebuf;
+
+	ccid->d_name = strdup("Replay");
+	return ccid;
+
+out_freebuf:
+	_xfr_do_free(ccid->d_xfr);
+out_free:
+	_replay_close(ccid->d_replay);
+	ccid_free(ccid);
+	fprintf(stderr, "ccid: error opening replay\n");
+	return NULL;
+}
+
+#define SIM_XFR_MAX	512
+
+/** Open a virtual reader with a simulated RC632 and cards in its field.
+ * \ingroup g_ccid
+ * @param tags the cards in the field, see \ref ccid_sim_tag.
+ * @param num number of cards.
+ * @param tracefile filename to open for trace logging (or NULL).
+ *
+ * No USB device is used. The reader has no contact slots and one RF field,
+ * driven by the same RC632 code as a real Omnikey, so the RF stack can be
+ * benchmarked without hardware. See \ref ccid_sim_stats for the cost of it.
+ *
+ * @return NULL on failure, valid \ref ccid_t object otherwise.
+ */
+ccid_t ccid_probe_sim(const struct ccid_sim_tag *tags, unsigned int num,
+			const char *tracefile)
+{
+	struct _ccid *ccid;
+	unsigned int x;
+
+	ccid = ccid_new(tracefile);
+	if ( NULL == ccid )
+		return NULL;
+
+	trace(ccid, "Simulated RC632 with %u cards\n", num);
+
+	ccid->d_xfr = _xfr_do_alloc(SIM_XFR_MAX, SIM_XFR_MAX);
+	if ( NULL == ccid->d_xfr )
+		goto out_free;
+
+	for(x = 0; x < CCID_MAX_SLOTS; x++)
+		ccid->d_slot[x].i_xfr = ccid->d_xfr;
+
+	if ( !_rfid_sim_attach(ccid, tags, num) )
+		goto out_freebuf;
+
+	ccid->d_name = strdup("RC632 simulator");
+	return ccid;
+
+out_freebuf:
+	_xfr_do_free(ccid->d_xfr);
+out_free:
+	ccid_free(ccid);
+	fprintf(stderr, "ccid: error opening simulator\n");
+	return NULL;
+}
+
+
+#define PROBE_MAX_THREADS	16
+
+struct probe_all {
+	pthread_mutex_t		p_lock;
+	ccidev_t		*p_dev;
+	const char * const	*p_trace;
+	ccid_t			*p_ccid;
+	size_t			p_num;
+	size_t			p_next;
+};
+
+static void *probe_worker(void *priv)
+{
+	struct probe_all *p = priv;
+	size_t i;
+
+	for(;;) {
+		pthread_mutex_lock(&p->p_lock);
+		i = p->p_next++;
+		pthread_mutex_unlock(&p->p_lock);
+		if ( i >= p->p_num )
+			break;
+		p->p_ccid[i] = ccid_probe(p->p_dev[i],
+					(p->p_trace) ? p->p_trace[i] : NULL);
+	}
+
+	return NULL;
+}
+
+/** Connect to many physical chipcard devices at once.
+ * \ingroup g_libccid
+ * @param dev array of \ref ccidev_t, eg. from \ref libccid_get_device_list.
+ * @param num number of elements in dev.
+ * @param tracefile array of num trace filenames as for \ref ccid_probe,
+ * entries may be NULL, as may the whole array.
+ * @param ccid array of num \ref ccid_t, filled in with the result of probing
+ * the corresponding device, NULL for those which failed.
+ *
+ * Probing a reader is mostly spent waiting on control transfers and slot
+ * status commands, so the devices are probed concurrently on a few worker
+ * threads rather than one after another. If no threads can be started then
+ * the devices are probed on the calling thread.
+ *
+ * @return the number of devices successfully probed.
+ */
+size_t libccid_probe_all(ccidev_t *dev, size_t num,
+			const char * const *tracefile, ccid_t *ccid)
+{
+	pthread_t tid[PROBE_MAX_THREADS];
+	struct probe_all p;
+	unsigned int i, nthreads;
+	size_t n, ret;
+
+	memset(ccid, 0, num * sizeof(*ccid));
+
+	p.p_dev = dev;
+	p.p_trace = tracefile;
+	p.p_ccid = ccid;
+	p.p_num = num;
+	p.p_next = 0;
+	pthread_mutex_init(&p.p_lock, NULL);
+
+	/* make sure libusb is initialised before the workers race for it */
+	_libccid_ctx();
+
+	nthreads = (num < PROBE_MAX_THREADS) ? num : PROBE_MAX_THREADS;
+	for(i = 0; num > 1 && i < nthreads; i++) {
+		if ( pthread_create(&tid[i], NULL, probe_worker, &p) ) {
+			fprintf(stderr, "*** error: pthread_create: %s\n",
+				strerror(errno));
+			break;
+		}
+	}
+	nthreads = (num > 1) ? i : 0;
+
+	/* pick up whatever the workers don't get to */
+	probe_worker(&p);
+
+	for(i = 0; i < nthreads; i++)
+		pthread_join(tid[i], NULL);
+
+	pthread_mutex_destroy(&p.p_lock);
+
+	for(ret = n = 0; n < num; n++) {
+		if ( ccid[n] )
+			ret++;
+	}
+
+	return ret;
+}
 uint8_t ccid_bus(ccid_t ccid)
 {
 	return ccid->d_bus;
@@ -1040,6 +2522,29 @@ const char *ccid_name(ccid_t ccid)
 	return ccid->d_name;
 }
 
+/** Send a vendor specific escape command to the reader.
+ * \ingroup g_ccid
+ * @param ccid The \ref ccid_t to send the command to.
+ * @param slot Slot number to put in the message header.
+ * @param xfr \ref xfr_t containing the command bytes.
+ * @param rlen Returns the length of the response.
+ *
+ * The meaning of the command and the response is entirely up to the reader
+ * vendor, there are no status words.
+ *
+ * @return NULL on failure, pointer to the response otherwise.
+ */
+const uint8_t *ccid_escape(ccid_t ccid, unsigned int slot, xfr_t xfr,
+				size_t *rlen)
+{
+	if ( !_PC_to_RDR_Escape(ccid, slot, xfr) )
+		return NULL;
+	if ( !_RDR_to_PC(ccid, slot, xfr) )
+		return NULL;
+	*rlen = xfr->x_rxlen;
+	return xfr->x_rxbuf;
+}
+
 /** Close connection to a chip card device.
  * \ingroup g_ccid
  * @param ccid The \ref ccid_t to close.
@@ -1052,10 +2557,19 @@ void ccid_close(ccid_t ccid)
 	unsigned int i;
 
 	if ( ccid ) {
+		if ( ccid->d_loop )
+			libccid_loop_remove(ccid->d_loop, ccid);
+		ccid_flush(ccid);
+		expire_idle(ccid, UINT64_MAX);
+		intr_stop(ccid);
+		free_slot_xfrs(ccid);
+		rx_pool_free(ccid);
 		if ( ccid->d_dev )
 			libusb_close(ccid->d_dev);
 		if ( ccid->d_tf )
 			fclose(ccid->d_tf);
+		_trace_close(ccid->d_bt);
+		_replay_close(ccid->d_replay);
 		_xfr_do_free(ccid->d_xfr);
 		free(ccid->d_name);
 
@@ -1064,6 +2578,8 @@ void ccid_close(ccid_t ccid)
 				continue;
 			(*ccid->d_rf[i].i_ops->dtor)(ccid->d_rf + i);
 		}
+		_rfid_sim_free(ccid->d_sim);
+		pthread_mutex_destroy(&ccid->d_lock);
 	}
 	free(ccid);
 }
@@ -1130,6 +2646,12 @@ void ccid_log(ccid_t ccid, const char *fmt, ...)
 {
 	va_list va;
 
+	if ( ccid->d_bt ) {
+		va_start(va, fmt);
+		_trace_log(ccid, fmt, va);
+		va_end(va);
+	}
+
 	if ( NULL == ccid->d_tf )
 		return;
 
@@ -10,6 +10,7 @@
 
 #include "ccid-internal.h"
 
+static pthread_once_t ctx_once = PTHREAD_ONCE_INIT;
 static libusb_context *ctx;
 
 struct devid {
@@ -24,6 +25,22 @@ struct devid {
 static struct devid *devid;
 static unsigned int num_devid;
 
+/* open addressed VID:PID index in to devid, built once on first use */
+static pthread_once_t devid_once = PTHREAD_ONCE_INIT;
+static struct devid **devid_hash;
+static unsigned int devid_hash_bits;
+
+struct _ccid_hotplug {
+	libusb_hotplug_callback_handle	h_handle;
+	ccid_hotplug_cb_t		h_cb;
+	void				*h_priv;
+	/* devices reported as arrived, so that departures can be matched
+	 * after the descriptors have gone away
+	 */
+	ccidev_t			*h_devs;
+	unsigned int			h_num_devs;
+};
+
 /* Easy string tokeniser */
 static int easy_explode(char *str, char split,
 			char **toks, int max_toks)
@@ -205,33 +222,57 @@ static struct devid *load_device_types(unsigned int *pcnt)
 	return ret;
 }
 
-static void zap_device_types(struct devid *d, unsigned int num)
+static unsigned int devid_hashfn(uint16_t idVendor, uint16_t idProduct)
 {
-	unsigned int i;
-	for(i = 0; i < num; i++)
-		free(d[i].name);
-	free(d);
+	uint32_t k = ((uint32_t)idVendor << 16) | idProduct;
+	return (k * 0x9e3779b1U) >> (32 - devid_hash_bits);
 }
 
-static void reload_device_types(void)
+static void build_index(void)
 {
-	struct devid *tmp;
-	unsigned int count;
+	unsigned int i, h, mask;
 
-	tmp = load_device_types(&count);
-	if ( NULL == tmp )
+	for(devid_hash_bits = 4; (1U << devid_hash_bits) < num_devid * 2;
+			devid_hash_bits++)
+		/* nothing */;
+
+	mask = (1U << devid_hash_bits) - 1;
+	devid_hash = calloc(mask + 1, sizeof(*devid_hash));
+	if ( NULL == devid_hash )
 		return;
 
-	zap_device_types(devid, num_devid);
-	devid = tmp;
-	num_devid = count;
+	/* duplicates stay behind the first entry, as with a linear scan */
+	for(i = 0; i < num_devid; i++) {
+		h = devid_hashfn(devid[i].idVendor, devid[i].idProduct);
+		while ( devid_hash[h] )
+			h = (h + 1) & mask;
+		devid_hash[h] = devid + i;
+	}
+}
+
+static void load_types_once(void)
+{
+	devid = load_device_types(&num_devid);
+	if ( devid )
+		build_index();
 }
 
 static void do_init(void)
 {
-	if ( NULL == ctx )
-		libusb_init(&ctx);
-	reload_device_types();
+	_libccid_ctx();
+	pthread_once(&devid_once, load_types_once);
+}
+
+static void ctx_init(void)
+{
+	libusb_init(&ctx);
+}
+
+/* May be called from several threads at once, by libccid_probe_all() */
+libusb_context *_libccid_ctx(void)
+{
+	pthread_once(&ctx_once, ctx_init);
+	return ctx;
 }
 
 static int check_interface(struct libusb_device *dev, int c, int i, int generic)
@@ -277,12 +318,18 @@ out:
 static struct devid *check_vendor_dev_list(uint16_t idVendor,
 						uint16_t idProduct)
 {
-	unsigned int i;
+	unsigned int h, mask;
 
-	for(i = 0; i < num_devid; i++) {
-		if ( devid[i].idVendor == idVendor &&
-			devid[i].idProduct == idProduct ) {
-			return devid + i;
+	pthread_once(&devid_once, load_types_once);
+	if ( NULL == devid_hash )
+		return NULL;
+
+	mask = (1U << devid_hash_bits) - 1;
+	for(h = devid_hashfn(idVendor, idProduct); devid_hash[h];
+			h = (h + 1) & mask) {
+		if ( devid_hash[h]->idVendor == idVendor &&
+			devid_hash[h]->idProduct == idProduct ) {
+			return devid_hash[h];
 		}
 	}
 
@@ -332,8 +379,8 @@ success:
 		intf->c = c;
 		intf->i = i;
 		intf->a = a;
-		intf->flags = id->flags;
-		intf->name = id->name;
+		intf->flags = (id) ? id->flags : 0;
+		intf->name = (id) ? id->name : NULL;
 	}
 	return 1;
 }
@@ -420,3 +467,117 @@ uint8_t libccid_device_addr(ccidev_t dev)
 {
 	return libusb_get_device_address(dev);
 }
+
+static int hp_find(struct _ccid_hotplug *hp, ccidev_t dev)
+{
+	unsigned int i;
+
+	for(i = 0; i < hp->h_num_devs; i++)
+		if ( hp->h_devs[i] == dev )
+			return i;
+	return -1;
+}
+
+static int hp_event(libusb_context *c, libusb_device *dev,
+			libusb_hotplug_event ev, void *priv)
+{
+	struct _ccid_hotplug *hp = priv;
+	ccidev_t *new;
+	int i;
+
+	switch(ev) {
+	case LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED:
+		if ( !_probe_descriptors(dev, NULL) || hp_find(hp, dev) >= 0 )
+			break;
+		new = realloc(hp->h_devs,
+				sizeof(*hp->h_devs) * (hp->h_num_devs + 1));
+		if ( NULL == new )
+			break;
+		hp->h_devs = new;
+		hp->h_devs[hp->h_num_devs++] = libusb_ref_device(dev);
+		(*hp->h_cb)(dev, 1, hp->h_priv);
+		break;
+	case LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT:
+		i = hp_find(hp, dev);
+		if ( i < 0 )
+			break;
+		hp->h_devs[i] = hp->h_devs[--hp->h_num_devs];
+		(*hp->h_cb)(dev, 0, hp->h_priv);
+		libusb_unref_device(dev);
+		break;
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+/** Register for notification of CCID arrival and removal.
+ * \ingroup g_libccid
+ * @param cb Function to call when a CCID is plugged in or removed.
+ * @param priv Private data pointer passed to the callback.
+ * @param enumerate If non-zero, cb is called for each CCID already present.
+ *
+ * Notifications are delivered from whichever thread is handling USB events,
+ * for example by way of \ref libccid_loop_dispatch. Only devices which were
+ * reported as arriving are reported when they leave. The \ref ccidev_t passed
+ * to the callback is only valid during the call, use \ref ccid_probe on it
+ * from there to open it.
+ *
+ * @return NULL if hotplug is not supported on this platform or on error.
+ */
+ccid_hotplug_t libccid_hotplug_register(ccid_hotplug_cb_t cb,
+					void *priv, int enumerate)
+{
+	struct _ccid_hotplug *hp;
+	int rc;
+
+	do_init();
+
+	if ( !libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) ) {
+		fprintf(stderr, "*** error: hotplug not supported\n");
+		return NULL;
+	}
+
+	hp = calloc(1, sizeof(*hp));
+	if ( NULL == hp )
+		return NULL;
+
+	hp->h_cb = cb;
+	hp->h_priv = priv;
+
+	rc = libusb_hotplug_register_callback(ctx,
+				LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+				LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+				(enumerate) ? LIBUSB_HOTPLUG_ENUMERATE :
+						LIBUSB_HOTPLUG_NO_FLAGS,
+				LIBUSB_HOTPLUG_MATCH_ANY,
+				LIBUSB_HOTPLUG_MATCH_ANY,
+				LIBUSB_HOTPLUG_MATCH_ANY,
+				hp_event, hp, &hp->h_handle);
+	if ( rc ) {
+		fprintf(stderr, "*** error: libusb_hotplug_register_callback()\n");
+		free(hp);
+		return NULL;
+	}
+
+	return hp;
+}
+
+/** Cancel hotplug notifications.
+ * \ingroup g_libccid
+ * @param hp \ref ccid_hotplug_t returned by \ref libccid_hotplug_register.
+ */
+void libccid_hotplug_deregister(ccid_hotplug_t hp)
+{
+	unsigned int i;
+
+	if ( NULL == hp )
+		return;
+
+	libusb_hotplug_deregister_callback(ctx, hp->h_handle);
+	for(i = 0; i < hp->h_num_devs; i++)
+		libusb_unref_device(hp->h_devs[i]);
+	free(hp->h_devs);
+	free(hp);
+}
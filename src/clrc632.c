@@ -12,6 +12,7 @@
 #include <ccid.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <time.h>
 
 #include "ccid-internal.h"
 #include "clrc632-regs.h"
@@ -25,34 +26,187 @@
 #endif
 
 #define TMO_AUTH1 140
+#define TIMER_RELAX_FACTOR 10
 
-struct reg_file {
-	uint8_t reg;
-	uint8_t val;
+#define RC632_NUM_REGS 0x40
+
+struct _clrc632 {
+	const struct _clrc632_ops	*ops;
+	unsigned int			no_batch;
+	uint64_t			timeout; /* last timer_set() in usec */
+
+	/* last known value of configuration registers */
+	uint64_t			sh_valid;
+	uint8_t				sh_val[RC632_NUM_REGS];
 };
 
-static int reg_read(struct _ccid *ccid, const struct _clrc632_ops *ops,
+/* Registers which only ever change when the host writes them. Status,
+ * command, FIFO, interrupt and page registers are always accessed directly.
+ */
+static int shadow_ok(uint8_t reg)
+{
+	if ( reg == RC632_REG_BIT_FRAMING )
+		return 1;
+	if ( reg < RC632_REG_PAGE2 || reg >= RC632_REG_PAGE6 )
+		return 0;
+	return (reg & 0x7) != 0;
+}
+
+static int shadow_get(struct _clrc632 *rc, uint8_t reg, uint8_t *val)
+{
+	if ( !shadow_ok(reg) || !(rc->sh_valid & (1ULL << reg)) )
+		return 0;
+	*val = rc->sh_val[reg];
+	return 1;
+}
+
+static void shadow_set(struct _clrc632 *rc, uint8_t reg, uint8_t val)
+{
+	if ( !shadow_ok(reg) )
+		return;
+	rc->sh_val[reg] = val;
+	rc->sh_valid |= (1ULL << reg);
+}
+
+static void shadow_clear(struct _clrc632 *rc, uint8_t reg)
+{
+	if ( reg < RC632_NUM_REGS )
+		rc->sh_valid &= ~(1ULL << reg);
+}
+
+static void shadow_flush(struct _clrc632 *rc)
+{
+	rc->sh_valid = 0;
+}
+
+static int reg_read(struct _ccid *ccid, struct _clrc632 *rc,
 			uint8_t reg, uint8_t *val)
 {
-	return (*ops->reg_read)(ccid, reg, val);
+	if ( shadow_get(rc, reg, val) )
+		return 1;
+	if ( !(*rc->ops->reg_read)(ccid, reg, val) )
+		return 0;
+	shadow_set(rc, reg, *val);
+	return 1;
 }
 
-static int reg_write(struct _ccid *ccid, const struct _clrc632_ops *ops,
+static int reg_write(struct _ccid *ccid, struct _clrc632 *rc,
 			uint8_t reg, uint8_t val)
 {
-	return (*ops->reg_write)(ccid, reg, val);
+	uint8_t cur;
+
+	if ( shadow_get(rc, reg, &cur) && cur == val )
+		return 1;
+	if ( !(*rc->ops->reg_write)(ccid, reg, val) ) {
+		shadow_clear(rc, reg);
+		return 0;
+	}
+	shadow_set(rc, reg, val);
+	return 1;
 }
 
-static int fifo_read(struct _ccid *ccid, const struct _clrc632_ops *ops,
+static int fifo_read(struct _ccid *ccid, struct _clrc632 *rc,
 			uint8_t *buf, size_t len)
 {
-	return (*ops->fifo_read)(ccid, buf, len);
+	return (*rc->ops->fifo_read)(ccid, buf, len);
 }
 
-static int fifo_write(struct _ccid *ccid, const struct _clrc632_ops *ops,
+static int fifo_write(struct _ccid *ccid, struct _clrc632 *rc,
 			const uint8_t *buf, size_t len)
 {
-	return (*ops->fifo_write)(ccid, buf, len);
+	return (*rc->ops->fifo_write)(ccid, buf, len);
+}
+
+/* One transport level batch of at most CLRC632_BATCH_MAX each way */
+static int do_batch(struct _ccid *ccid, struct _clrc632 *rc,
+			const struct _clrc632_reg *wr, unsigned int nwr,
+			struct _clrc632_reg *rd, unsigned int nrd)
+{
+	unsigned int i;
+
+	if ( 0 == nwr + nrd )
+		return 1;
+
+	if ( rc->ops->reg_batch && !rc->no_batch )
+		return (*rc->ops->reg_batch)(ccid, wr, nwr, rd, nrd);
+
+	for(i = 0; i < nwr; i++) {
+		if ( !(*rc->ops->reg_write)(ccid, wr[i].reg, wr[i].val) )
+			return 0;
+	}
+	for(i = 0; i < nrd; i++) {
+		if ( !(*rc->ops->reg_read)(ccid, rd[i].reg, &rd[i].val) )
+			return 0;
+	}
+	return 1;
+}
+
+/* Write registers in order then read some back, in as few round trips as
+ * the transport allows. Writes which wouldn't change anything and reads of
+ * known values are dropped.
+ */
+static int reg_batch(struct _ccid *ccid, struct _clrc632 *rc,
+			const struct _clrc632_reg *wr, unsigned int nwr,
+			struct _clrc632_reg *rd, unsigned int nrd)
+{
+	struct _clrc632_reg w[CLRC632_BATCH_MAX], r[CLRC632_BATCH_MAX];
+	struct _clrc632_reg *rp[CLRC632_BATCH_MAX];
+	unsigned int i, nw, nr;
+	uint8_t cur;
+
+	while ( nwr + nrd ) {
+		for(nw = 0; nwr && nw < CLRC632_BATCH_MAX; wr++, nwr--) {
+			if ( shadow_get(rc, wr->reg, &cur) && cur == wr->val )
+				continue;
+			w[nw++] = *wr;
+			shadow_set(rc, wr->reg, wr->val);
+		}
+
+		for(nr = 0; !nwr && nrd && nr < CLRC632_BATCH_MAX;
+				rd++, nrd--) {
+			if ( shadow_get(rc, rd->reg, &rd->val) )
+				continue;
+			r[nr].reg = rd->reg;
+			rp[nr++] = rd;
+		}
+
+		if ( !do_batch(ccid, rc, w, nw, r, nr) ) {
+			for(i = 0; i < nw; i++)
+				shadow_clear(rc, w[i].reg);
+			return 0;
+		}
+
+		for(i = 0; i < nr; i++) {
+			rp[i]->val = r[i].val;
+			shadow_set(rc, r[i].reg, r[i].val);
+		}
+	}
+
+	return 1;
+}
+
+/* Check that batched reads return the same as single ones, some firmware
+ * versions only handle single register accesses.
+ */
+static int probe_batch(struct _ccid *ccid, struct _clrc632 *rc)
+{
+	struct _clrc632_reg rd[2];
+	uint8_t a, b;
+
+	if ( NULL == rc->ops->reg_batch )
+		return 0;
+
+	if ( !(*rc->ops->reg_read)(ccid, RC632_REG_TX_CONTROL, &a) )
+		return 0;
+	if ( !(*rc->ops->reg_read)(ccid, RC632_REG_CW_CONDUCTANCE, &b) )
+		return 0;
+
+	rd[0].reg = RC632_REG_TX_CONTROL;
+	rd[1].reg = RC632_REG_CW_CONDUCTANCE;
+	if ( !(*rc->ops->reg_batch)(ccid, NULL, 0, rd, 2) )
+		return 0;
+
+	return (rd[0].val == a && rd[1].val == b);
 }
 
 static int asic_clear_bits(struct _ccid *ccid, void *priv,
@@ -98,19 +252,17 @@ static int asic_set_mask(struct _ccid *ccid, void *priv, uint8_t reg,
 }
 
 static int reg_write_batch(struct _ccid *ccid, void *priv,
-				const struct reg_file *r,
+				const struct _clrc632_reg *r,
 				unsigned int num)
 {
-	unsigned int i;
-	for(i = 0; i < num; i++) {
-		if ( !reg_write(ccid, priv, r[i].reg, r[i].val) )
-			return 0;
-	}
-	return 1;
+	return reg_batch(ccid, priv, r, num, NULL, 0);
 }
 
 static int asic_power(struct _ccid *ccid, void *priv, unsigned int on)
 {
+	/* registers are reset when the ASIC comes out of power down */
+	shadow_flush(priv);
+
 	if ( on ) {
 		return asic_clear_bits(ccid, priv, RC632_REG_CONTROL,
 						RC632_CONTROL_POWERDOWN);
@@ -136,6 +288,8 @@ static int rf_power(struct _ccid *ccid, void *priv, unsigned int on)
 	if ( ret )
 		usleep(10000);
 
+	shadow_flush(priv);
+
 	return ret;
 }
 
@@ -151,62 +305,166 @@ static int clear_irqs(struct _ccid *ccid, void *priv, uint8_t bits)
 			(~RC632_INT_SET) & bits);
 }
 
-/* Wait until RC632 is idle or TIMER IRQ has happened */
-static int wait_idle_timer(struct _ccid *ccid, void *priv)
+/* Poll intervals for wait_idle_rx(), in usec */
+#define POLL_MIN	50
+#define POLL_MAX	4000
+/* Give up if the ASIC timer hasn't fired this long after it should have */
+#define POLL_SLACK	100000
+
+/* FIFO alerts: LoAlert when no more than this many bytes are in the FIFO
+ * and HiAlert when no more than this many are free.
+ */
+#define FIFO_SIZE		64
+#define FIFO_WATER_LEVEL	32
+
+static uint64_t now_usec(void)
 {
-	uint8_t stat, irq, cmd;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
 
-	if ( !reg_read(ccid, priv, RC632_REG_INTERRUPT_EN, &irq) )
-		return 0;
+/* Move len bytes out of the FIFO in to the receive buffer, anything which
+ * doesn't fit is read and thrown away so that the FIFO can't overflow.
+ */
+static int fifo_drain(struct _ccid *ccid, void *priv, uint8_t *rx_buf,
+			uint8_t rx_max, unsigned int *got, uint8_t len)
+{
+	uint8_t junk[FIFO_SIZE];
+	unsigned int room;
+
+	room = (*got < rx_max) ? rx_max - *got : 0;
+	if ( room > len )
+		room = len;
+
+	if ( room ) {
+		if ( !fifo_read(ccid, priv, rx_buf + *got, room) )
+			return 0;
+		*got += room;
+		len -= room;
+	}
+
+	if ( len ) {
+		trace(ccid, "     : discarding %u bytes of RX data\n", len);
+		if ( !fifo_read(ccid, priv, junk, len) )
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Bit oriented anticollision frames are sent without CRC and are expected to
+ * collide, the caller finds out where from get_error() and COLL_POS.
+ */
+static int collision_ok(struct _clrc632 *rc)
+{
+	uint8_t red;
 
-	if ( !reg_write(ccid, priv, RC632_REG_INTERRUPT_EN, RC632_IRQ_SET
-				| RC632_IRQ_TIMER
-				| RC632_IRQ_IDLE
-				| RC632_IRQ_RX ) )
+	if ( !shadow_get(rc, RC632_REG_CHANNEL_REDUNDANCY, &red) )
 		return 0;
+	return !(red & RC632_CR_RX_CRC_ENABLE);
+}
+
+/* Wait until RC632 is idle or TIMER IRQ has happened.
+ *
+ * The first check is made after about half of the expected frame time, as
+ * programmed by timer_set(), then the interval doubles up to POLL_MAX. Each
+ * check reads all of the status registers in a single batch.
+ *
+ * If rx_buf is given then received data is streamed out of the FIFO each time
+ * it reaches the HiAlert level, so frames bigger than the FIFO work, and
+ * *rx_len is updated with the number of bytes received.
+ */
+static int wait_idle_rx(struct _ccid *ccid, void *priv,
+			uint8_t *rx_buf, uint8_t *rx_len)
+{
+	struct _clrc632 *rc = priv;
+	struct _clrc632_reg wr, rd[5];
+	uint64_t delay, deadline;
+	unsigned int nwr = 1, got = 0;
+	uint8_t fatal;
+	int done;
+
+	wr.reg = RC632_REG_INTERRUPT_EN;
+	wr.val = RC632_IRQ_SET | RC632_IRQ_TIMER |
+			RC632_IRQ_IDLE | RC632_IRQ_RX;
+
+	rd[0].reg = RC632_REG_PRIMARY_STATUS;
+	rd[1].reg = RC632_REG_ERROR_FLAG;
+	rd[2].reg = RC632_REG_INTERRUPT_RQ;
+	rd[3].reg = RC632_REG_COMMAND;
+	/* must come after COMMAND so that all data is counted once idle */
+	rd[4].reg = RC632_REG_FIFO_LENGTH;
+
+	delay = rc->timeout / (TIMER_RELAX_FACTOR * 2);
+	if ( delay < POLL_MIN )
+		delay = POLL_MIN;
+	deadline = now_usec() + rc->timeout + POLL_SLACK;
+
+	fatal = RC632_ERR_FLAG_PARITY_ERR | RC632_ERR_FLAG_FRAMING_ERR;
+	/* FIXME: why get we CRC errors in CL2 anticol
+	 * at iso14443a operation with mifare UL? */
+	if ( !collision_ok(rc) )
+		fatal |= RC632_ERR_FLAG_COL_ERR;
 
 	while (1) {
-		if ( !reg_read(ccid, priv, RC632_REG_PRIMARY_STATUS, &stat) )
+		if ( delay )
+			usleep(delay);
+
+		if ( !reg_batch(ccid, rc, &wr, nwr, rd, (rx_buf) ? 5 : 4) )
+			return 0;
+		nwr = 0;
+
+		if ( (rd[0].val & RC632_STAT_ERR) && (rd[1].val & fatal) )
+			return 0;
+
+		if ( (rd[0].val & RC632_STAT_IRQ) &&
+				(rd[2].val & RC632_IRQ_TIMER) &&
+				!(rd[2].val & RC632_IRQ_RX) ) {
+			/* timed out */
+			clear_irqs(ccid, priv, RC632_IRQ_TIMER);
 			return 0;
-		if (stat & RC632_STAT_ERR) {
-			uint8_t err;
-			if ( !reg_read(ccid, priv, RC632_REG_ERROR_FLAG, &err) )
-				return 0;
-			if (err & (RC632_ERR_FLAG_COL_ERR |
-				   RC632_ERR_FLAG_PARITY_ERR |
-				   RC632_ERR_FLAG_FRAMING_ERR |
-				/* FIXME: why get we CRC errors in CL2 anticol
-				 * at iso14443a operation with mifare UL? */
-				/*   RC632_ERR_FLAG_CRC_ERR | */
-				   0)) {
-				//printf("error during wait\n");
-				return 0;
-			}
 		}
-		if (stat & RC632_STAT_IRQ) {
-			if ( !reg_read(ccid, priv,
-				RC632_REG_INTERRUPT_RQ, &irq) )
-				return 0;
 
-			if (irq & RC632_IRQ_TIMER && !(irq & RC632_IRQ_RX)) {
-				/* timed out */
-				//printf("..timed out\n");
-				clear_irqs(ccid, priv, RC632_IRQ_TIMER);
+		done = (rd[3].val == 0);
+
+		if ( rx_buf && rd[4].val &&
+				(done || (rd[0].val & RC632_STAT_HIALERT)) ) {
+			if ( !fifo_drain(ccid, priv, rx_buf, *rx_len,
+					&got, rd[4].val) )
 				return 0;
-			}
 		}
 
-		if ( !reg_read(ccid, priv, RC632_REG_COMMAND, &cmd) )
+		if ( done ) {
+			clear_irqs(ccid, priv, RC632_IRQ_RX);
+			break;
+		}
+
+		if ( now_usec() > deadline ) {
+			trace(ccid, "     : RC632 timer never fired\n");
 			return 0;
+		}
 
-		if (cmd == 0) {
-			clear_irqs(ccid, priv, RC632_IRQ_RX);
-			return 1;
+		if ( rx_buf && rd[4].val ) {
+			/* reception under way, keep up with it */
+			delay = POLL_MIN;
+			continue;
 		}
 
-		/* poll every millisecond */
-		usleep(1000);
+		delay *= 2;
+		if ( delay > POLL_MAX )
+			delay = POLL_MAX;
 	}
+
+	if ( rx_buf )
+		*rx_len = (got < *rx_len) ? got : *rx_len;
+
+	return 1;
+}
+
+static int wait_idle_timer(struct _ccid *ccid, void *priv)
+{
+	return wait_idle_rx(ccid, priv, NULL, NULL);
 }
 
 /* calculate best 8bit prescaler and divisor for given usec timeout */
@@ -250,54 +508,62 @@ static void best_prescaler(uint64_t timeout, uint8_t *prescaler,
 //		__func__, timeout, best_prescaler, best_divisor);
 }
 
-#define TIMER_RELAX_FACTOR 10
-static int timer_set(struct _ccid *ccid, void *priv, uint64_t timeout)
+#define TIMER_NUM_REGS 5
+static void timer_regs(struct _clrc632 *rc, struct _clrc632_reg *wr,
+			uint64_t timeout)
 {
 	uint8_t prescaler, divisor;
 
 	timeout *= TIMER_RELAX_FACTOR;
-
 	best_prescaler(timeout, &prescaler, &divisor);
+	rc->timeout = timeout;
 
-	if ( !reg_write(ccid, priv, RC632_REG_TIMER_CLOCK,
-			      prescaler & 0x1f) )
-		return 0;
-
-	if ( !reg_write(ccid, priv, RC632_REG_TIMER_CONTROL,
-			      RC632_TMR_START_TX_END|RC632_TMR_STOP_RX_BEGIN) )
-		return 0;
-
+	wr[0].reg = RC632_REG_TIMER_CLOCK;
+	wr[0].val = prescaler & 0x1f;
+	wr[1].reg = RC632_REG_TIMER_CONTROL;
+	wr[1].val = RC632_TMR_START_TX_END|RC632_TMR_STOP_RX_BEGIN;
 	/* clear timer irq bit */
-	if ( !clear_irqs(ccid, priv, RC632_IRQ_TIMER) )
-		return 0;
-
+	wr[2].reg = RC632_REG_INTERRUPT_RQ;
+	wr[2].val = (~RC632_INT_SET) & RC632_IRQ_TIMER;
 	/* enable timer IRQ */
-	if ( !reg_write(ccid, priv, RC632_REG_INTERRUPT_EN,
-			RC632_IRQ_SET | RC632_IRQ_TIMER) )
-		return 0;
+	wr[3].reg = RC632_REG_INTERRUPT_EN;
+	wr[3].val = RC632_IRQ_SET | RC632_IRQ_TIMER;
+	wr[4].reg = RC632_REG_TIMER_RELOAD;
+	wr[4].val = divisor;
+}
 
-	if ( !reg_write(ccid, priv, RC632_REG_TIMER_RELOAD, divisor) )
-		return 0;
+static int timer_set(struct _ccid *ccid, void *priv, uint64_t timeout)
+{
+	struct _clrc632_reg wr[TIMER_NUM_REGS];
 
-	return 1;
+	timer_regs(priv, wr, timeout);
+	return reg_write_batch(ccid, priv, wr, TIMER_NUM_REGS);
 }
 
 static int set_rf_mode(struct _ccid *ccid, void *priv, const struct rf_mode *rf)
 {
+	struct _clrc632_reg wr[2], ctl;
+	unsigned int nwr = 0;
 	uint8_t red;
 
-	if ( !reg_write(ccid, priv, RC632_REG_BIT_FRAMING,
-				(rf->rx_align << 4) | (rf->tx_last_bits)) )
+	wr[0].reg = RC632_REG_BIT_FRAMING;
+	wr[0].val = (rf->rx_align << 4) | (rf->tx_last_bits);
+	ctl.reg = RC632_REG_CONTROL;
+	if ( !reg_batch(ccid, priv, wr, 1, &ctl, 1) )
 		return 0;
 
 	if ( rf->flags & RF_CRYPTO1 ) {
-		if ( !asic_clear_bits(ccid, priv, RC632_REG_CONTROL,
-					RC632_CONTROL_CRYPTO1_ON) )
-			return 0;
+		if ( ctl.val & RC632_CONTROL_CRYPTO1_ON ) {
+			wr[nwr].reg = RC632_REG_CONTROL;
+			wr[nwr].val = ctl.val & ~RC632_CONTROL_CRYPTO1_ON;
+			nwr++;
+		}
 	}else{
-		if ( !asic_set_bits(ccid, priv, RC632_REG_CONTROL,
-					RC632_CONTROL_CRYPTO1_ON) )
-			return 0;
+		if ( !(ctl.val & RC632_CONTROL_CRYPTO1_ON) ) {
+			wr[nwr].reg = RC632_REG_CONTROL;
+			wr[nwr].val = ctl.val | RC632_CONTROL_CRYPTO1_ON;
+			nwr++;
+		}
 	}
 
 	red = 0;
@@ -309,11 +575,12 @@ static int set_rf_mode(struct _ccid *ccid, void *priv, const struct rf_mode *rf)
 		red |= RC632_CR_PARITY_ENABLE;
 	if ( !(rf->flags & RF_PARITY_EVEN) )
 		red |= RC632_CR_PARITY_ODD;
-	
-	if ( !reg_write(ccid, priv, RC632_REG_CHANNEL_REDUNDANCY, red) )
-		return 0;
 
-	return 1;
+	wr[nwr].reg = RC632_REG_CHANNEL_REDUNDANCY;
+	wr[nwr].val = red;
+	nwr++;
+
+	return reg_write_batch(ccid, priv, wr, nwr);
 }
 
 static int get_rf_mode(struct _ccid *ccid, void *priv, const struct rf_mode *rf)
@@ -331,6 +598,48 @@ static int get_coll_pos(struct _ccid *ccid, void *priv, uint8_t *pos)
 	return reg_read(ccid, priv, RC632_REG_COLL_POS, pos);
 }
 
+/* Keep the FIFO topped up while a long frame is going out, refilling each
+ * time it drops to the LoAlert level.
+ */
+static int fifo_stream_tx(struct _ccid *ccid, void *priv,
+			const uint8_t *buf, unsigned int len)
+{
+	struct _clrc632 *rc = priv;
+	struct _clrc632_reg rd[2];
+	uint64_t deadline;
+	unsigned int n;
+
+	rd[0].reg = RC632_REG_PRIMARY_STATUS;
+	rd[1].reg = RC632_REG_FIFO_LENGTH;
+	deadline = now_usec() + rc->timeout + POLL_SLACK;
+
+	while ( len ) {
+		if ( !reg_batch(ccid, priv, NULL, 0, rd, 2) )
+			return 0;
+
+		if ( !(rd[0].val & RC632_STAT_LOALERT) ) {
+			if ( now_usec() > deadline ) {
+				trace(ccid, "     : RC632 TX stalled\n");
+				return 0;
+			}
+			usleep(POLL_MIN);
+			continue;
+		}
+
+		n = FIFO_SIZE - rd[1].val;
+		if ( n > len )
+			n = len;
+
+		if ( !fifo_write(ccid, priv, buf, n) )
+			return 0;
+
+		buf += n;
+		len -= n;
+	}
+
+	return 1;
+}
+
 static int transact(struct _ccid *ccid, void *priv,
 			 const uint8_t *tx_buf,
 			 uint8_t tx_len,
@@ -339,78 +648,50 @@ static int transact(struct _ccid *ccid, void *priv,
 			 uint64_t timer,
 			 unsigned int toggle)
 {
-	int cur_tx_len;
-	uint8_t rx_avail;
-	const uint8_t *cur_tx_buf = tx_buf;
-
-//	printf("%s: timeout=%"PRIu64", rx_len=%u, tx_len=%u\n",
-//		__func__, timer, *rx_len, tx_len);
+	struct _clrc632_reg wr[3 + TIMER_NUM_REGS];
+	unsigned int cur_tx_len;
 
-	if (tx_len > 64)
-		cur_tx_len = 64;
-	else
-		cur_tx_len = tx_len;
+	cur_tx_len = (tx_len > FIFO_SIZE) ? FIFO_SIZE : tx_len;
 
-	if ( !reg_write(ccid, priv, RC632_REG_COMMAND, RC632_CMD_IDLE) )
-		return 0;
+	wr[0].reg = RC632_REG_COMMAND;
+	wr[0].val = RC632_CMD_IDLE;
 	/* clear all interrupts */
-	if ( !reg_write(ccid, priv, RC632_REG_INTERRUPT_RQ, 0x7f) )
+	wr[1].reg = RC632_REG_INTERRUPT_RQ;
+	wr[1].val = 0x7f;
+	wr[2].reg = RC632_REG_FIFO_LEVEL;
+	wr[2].val = FIFO_WATER_LEVEL;
+	timer_regs(priv, wr + 3, timer);
+	if ( !reg_write_batch(ccid, priv, wr, 3 + TIMER_NUM_REGS) )
 		return 0;
 
-	if ( !timer_set(ccid, priv, timer) )
+	if ( !fifo_write(ccid, priv, tx_buf, cur_tx_len) )
 		return 0;
 
-	do {
-		if ( !fifo_write(ccid, priv, cur_tx_buf, cur_tx_len) )
-			return 0;
-
-		if (cur_tx_buf == tx_buf) {
-			if ( !reg_write(ccid, priv, RC632_REG_COMMAND,
-					RC632_CMD_TRANSCEIVE) )
-				return 0;
-		}
-
-		cur_tx_buf += cur_tx_len;
-		if (cur_tx_buf < tx_buf + tx_len) {
-			uint8_t fifo_fill;
-			if ( !reg_read(ccid, priv, RC632_REG_FIFO_LENGTH,
-					&fifo_fill) )
-				return 0;
+	if ( !reg_write(ccid, priv, RC632_REG_COMMAND, RC632_CMD_TRANSCEIVE) )
+		return 0;
 
-			cur_tx_len = 64 - fifo_fill;
-		} else
-			cur_tx_len = 0;
-	} while (cur_tx_len);
+	if ( !fifo_stream_tx(ccid, priv, tx_buf + cur_tx_len,
+				tx_len - cur_tx_len) )
+		return 0;
 
 	//if (toggle == 1)
 	//	tcl_toggle_pcb(ccid, priv);
 
-	if ( !wait_idle_timer(ccid, priv) ) {
+	if ( !wait_idle_rx(ccid, priv, rx_buf, rx_len) )
 		return 0;
-	}
 
-	if ( !reg_read(ccid, priv, RC632_REG_FIFO_LENGTH, &rx_avail) )
-		return 0;
-
-	if (rx_avail > *rx_len)
-		printf("rx_avail(%d) > rx_len(%d), JFYI\n", rx_avail, *rx_len);
-	else if (*rx_len > rx_avail)
-		*rx_len = rx_avail;
-
-	if (rx_avail == 0) {
-		printf("RX: FIFO empty\n");
+	if ( 0 == *rx_len ) {
+		trace(ccid, "     : RX: FIFO empty\n");
 		return 0;
 	}
 
-	/* FIXME: discard addidional bytes in FIFO */
-	return fifo_read(ccid, priv, rx_buf, *rx_len);
+	return 1;
 }
 
 #define RFID_MIFARE_KEY_LEN 6
-#define RFID_MIFARE_KEY_CODED_LEN 12
 
 /* Transform crypto1 key from generic 6byte into rc632 specific 12byte */
-static void mfc_transform_key(const uint8_t *key6, uint8_t *key12)
+static void mfc_code_key(const uint8_t *key6, uint8_t *key12)
 {
 	int i;
 	uint8_t ln;
@@ -424,18 +705,16 @@ static void mfc_transform_key(const uint8_t *key6, uint8_t *key12)
 	}
 }
 
-static int mfc_set_key(struct _ccid *ccid, void *priv, const uint8_t *key)
+static int mfc_load_key(struct _ccid *ccid, void *priv,
+				const uint8_t *coded_key)
 {
-	uint8_t coded_key[RFID_MIFARE_KEY_CODED_LEN];
 	uint8_t reg;
 
-	mfc_transform_key(key, coded_key);
-
 	/* Terminate probably running command */
 	if ( !reg_write(ccid, priv, RC632_REG_COMMAND, RC632_CMD_IDLE) )
 		return 0;
 
-	if ( !fifo_write(ccid, priv, coded_key, sizeof(coded_key)) )
+	if ( !fifo_write(ccid, priv, coded_key, RFID_MFC_CODED_KEY_LEN) )
 		return 0;
 
 	if ( !reg_write(ccid, priv, RC632_REG_COMMAND, RC632_CMD_LOAD_KEY) )
@@ -462,7 +741,7 @@ static int mfc_set_key_ee(struct _ccid *ccid, void *priv, unsigned int addr)
 	uint8_t cmd_addr[2];
 	uint8_t reg;
 
-	if (addr > 0xffff - RFID_MIFARE_KEY_CODED_LEN)
+	if (addr > 0xffff - RFID_MFC_CODED_KEY_LEN)
 		return 0;
 
 	cmd_addr[0] = addr & 0xff;		/* LSB */
@@ -618,7 +897,7 @@ mifare_transceive(struct rfid_asic_handle *handle,
 }
 #endif
 
-static const struct reg_file rf_14443a_init[] = {
+static const struct _clrc632_reg rf_14443a_init[] = {
 	{ .reg =	RC632_REG_TX_CONTROL,
 	  .val =	RC632_TXCTRL_MOD_SRC_INT |
 			RC632_TXCTRL_TX2_INV |
@@ -717,36 +996,52 @@ static struct {
 
 static int set_speed(struct _ccid *ccid, void *priv, unsigned int i)
 {
+	static const uint8_t mask[3] = {
+		RC632_RXCTRL1_SUBCP_MASK,
+		RC632_DECCTRL_BPSK,
+		RC632_CDRCTRL_RATE_MASK,
+	};
+	struct _clrc632_reg rd[3], wr[6];
+	unsigned int j, nwr = 0;
+	uint8_t bits[3];
+
 	if ( i >= ARRAY_SIZE(rate) )
 		return 0;
-	
-	if ( !asic_set_mask(ccid, priv, RC632_REG_RX_CONTROL1,
-			   RC632_RXCTRL1_SUBCP_MASK,
-			   rate[i].subc_pulses) )
-		return 0;
 
-	if ( !asic_set_mask(ccid, priv, RC632_REG_DECODER_CONTROL,
-			   RC632_DECCTRL_BPSK,
-			   rate[i].rx_coding) )
-		return 0;
+	rd[0].reg = RC632_REG_RX_CONTROL1;
+	rd[1].reg = RC632_REG_DECODER_CONTROL;
+	rd[2].reg = RC632_REG_CODER_CONTROL;
+	bits[0] = rate[i].subc_pulses;
+	bits[1] = rate[i].rx_coding;
+	bits[2] = rate[i].rate;
 
-	if ( !reg_write(ccid, priv, RC632_REG_RX_THRESHOLD, rate[i].rx_threshold) )
+	/* read-modify-write all three in one go */
+	if ( !reg_batch(ccid, priv, NULL, 0, rd, 3) )
 		return 0;
 
-	if ( rate[i].rx_coding == RC632_DECCTRL_BPSK &&
-		!reg_write(ccid, priv, RC632_REG_BPSK_DEM_CONTROL,
-				rate[i].bpsk_dem_ctrl) )
-		return 0;
+	for(j = 0; j < 3; j++) {
+		if ( (rd[j].val & mask[j]) == bits[j] )
+			continue;
+		wr[nwr].reg = rd[j].reg;
+		wr[nwr].val = (rd[j].val & ~mask[j]) | (bits[j] & mask[j]);
+		nwr++;
+	}
 
-	if ( !asic_set_mask(ccid, priv, RC632_REG_CODER_CONTROL,
-			RC632_CDRCTRL_RATE_MASK,
-			rate[i].rate) )
-		return 0;
+	wr[nwr].reg = RC632_REG_RX_THRESHOLD;
+	wr[nwr].val = rate[i].rx_threshold;
+	nwr++;
 
-	if ( !reg_write(ccid, priv, RC632_REG_MOD_WIDTH, rate[i].mod_width) )
-		return 0;
+	if ( rate[i].rx_coding == RC632_DECCTRL_BPSK ) {
+		wr[nwr].reg = RC632_REG_BPSK_DEM_CONTROL;
+		wr[nwr].val = rate[i].bpsk_dem_ctrl;
+		nwr++;
+	}
 
-	return 1;
+	wr[nwr].reg = RC632_REG_MOD_WIDTH;
+	wr[nwr].val = rate[i].mod_width;
+	nwr++;
+
+	return reg_write_batch(ccid, priv, wr, nwr);
 }
 
 static unsigned int get_speeds(struct _ccid *ccid, void *priv)
@@ -762,14 +1057,20 @@ static unsigned int carrier_freq(struct _ccid *ccid, void *priv)
 	return ISO14443_FREQ_CARRIER;
 }
 
+/* the FIFO is streamed so frames can be bigger than it */
 static unsigned int get_mtu(struct _ccid *ccid, void *priv)
 {
-	return 64;
+	return 256;
 }
 
 static unsigned int get_mru(struct _ccid *ccid, void *priv)
 {
-	return 64;
+	return 256;
+}
+
+static void asic_dtor(struct _ccid *ccid, void *priv)
+{
+	free(priv);
 }
 
 static const struct rfid_layer1_ops l1_ops = {
@@ -784,7 +1085,8 @@ static const struct rfid_layer1_ops l1_ops = {
 
 	.iso14443a_init = iso14443a_init,
 
-	.mfc_set_key = mfc_set_key,
+	.mfc_code_key = mfc_code_key,
+	.mfc_load_key = mfc_load_key,
 	.mfc_set_key_ee = mfc_set_key_ee,
 	.mfc_auth = mfc_auth,
 
@@ -792,28 +1094,44 @@ static const struct rfid_layer1_ops l1_ops = {
 	.get_speeds = get_speeds,
 	.mtu = get_mtu,
 	.mru = get_mru,
+
+	.dtor = asic_dtor,
 };
 
 int _clrc632_init(struct _cci *cci, const struct _clrc632_ops *asic_ops)
 {
 	struct _ccid *ccid = cci->i_parent;
-	void *priv = (void *)asic_ops;
+	struct _clrc632 *priv;
 
-	if ( !asic_power(ccid, priv, 0) )
+	priv = calloc(1, sizeof(*priv));
+	if ( NULL == priv )
 		return 0;
 
+	priv->ops = asic_ops;
+
+	if ( !asic_power(ccid, priv, 0) )
+		goto err;
+
 	usleep(10000);
 
 	if ( !asic_power(ccid, priv, 1) )
-		return 0;
+		goto err;
 
 	if ( !asic_set_bits(ccid, priv, RC632_REG_PAGE0, 0) )
-		return 0;
+		goto err;
 	if ( !asic_set_bits(ccid, priv, RC632_REG_TX_CONTROL, 0x5b) )
-		return 0;
+		goto err;
+
+	if ( !probe_batch(ccid, priv) ) {
+		trace(ccid, " o RC632 batched register access disabled\n");
+		priv->no_batch = 1;
+	}
 
 	if ( !_rfid_init(cci, &l1_ops, priv) )
-		return 0;
+		goto err;
 
 	return 1;
+err:
+	free(priv);
+	return 0;
 }
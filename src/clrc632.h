@@ -6,11 +6,28 @@
 #ifndef _CLRC632_H
 #define _CLRC632_H
 
+/* maximum number of writes, and of reads, in one reg_batch call */
+#define CLRC632_BATCH_MAX	32
+
+struct _clrc632_reg {
+	uint8_t reg;
+	uint8_t val;
+};
+
 struct _clrc632_ops {
 	int (*fifo_read)(struct _ccid *ccid, uint8_t *buf, size_t len);
 	int (*fifo_write)(struct _ccid *ccid, const uint8_t *buf, size_t len);
 	int (*reg_read)(struct _ccid *ccid, uint8_t reg, uint8_t *val);
 	int (*reg_write)(struct _ccid *ccid, uint8_t reg, uint8_t val);
+
+	/* Optional: perform all of the writes, in order, then all of the
+	 * reads in a single transaction. Register numbers to read are passed
+	 * in rd[].reg and the results returned in rd[].val. Returns zero if
+	 * the transport or firmware does not support it.
+	 */
+	int (*reg_batch)(struct _ccid *ccid,
+			const struct _clrc632_reg *wr, unsigned int nwr,
+			struct _clrc632_reg *rd, unsigned int nrd);
 };
 
 _private int _clrc632_init(struct _cci *cci, const struct _clrc632_ops *ops);
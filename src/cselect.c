@@ -62,25 +62,13 @@ static int do_stuff(cci_t cci)
 	return 1;
 }
 
-static int found_ccid(ccidev_t dev)
+static int found_ccid(ccid_t ccid)
 {
-	static unsigned int count;
 	unsigned int i, num_slots;
-	char fn[128];
-	ccid_t ccid;
 	cci_t cci;
-	int ret = 0;
 
 	printf("Found CCI device at %d.%d\n",
-		libccid_device_bus(dev),
-		libccid_device_addr(dev));
-
-	snprintf(fn, sizeof(fn), "cselect.%u.trace", count);
-	ccid = ccid_probe(dev, fn);
-	if ( NULL == ccid )
-		goto out;
-
-	count++;
+		ccid_bus(ccid), ccid_addr(ccid));
 	printf("%s\n", ccid_name(ccid));
 
 	num_slots = ccid_num_slots(ccid);
@@ -103,27 +91,50 @@ static int found_ccid(ccidev_t dev)
 			continue;
 	}
 
-	ret = 1;
 	ccid_close(ccid);
-out:
-	return ret;
+	return 1;
 }
 
 int main(int argc, char **argv)
 {
 	ccidev_t *dev;
+	ccid_t *ccid = NULL;
+	char **fn = NULL;
 	size_t num_dev, i;
+	int ret = EXIT_FAILURE;
 
 	dev = libccid_get_device_list(&num_dev);
 	if ( NULL == dev )
 		return EXIT_FAILURE;
 
+	ccid = calloc(num_dev + 1, sizeof(*ccid));
+	fn = calloc(num_dev + 1, sizeof(*fn));
+	if ( NULL == ccid || NULL == fn )
+		goto out;
+
 	for(i = 0; i < num_dev; i++) {
-		found_ccid(dev[i]);
+		fn[i] = malloc(128);
+		if ( NULL == fn[i] )
+			goto out;
+		snprintf(fn[i], 128, "cselect.%zu.trace", i);
+	}
+
+	/* readers are all brought up at once, then used one by one */
+	libccid_probe_all(dev, num_dev, (const char * const *)fn, ccid);
+
+	for(i = 0; i < num_dev; i++) {
+		if ( NULL == ccid[i] )
+			continue;
+		found_ccid(ccid[i]);
 		printf("\n");
 	}
 
+	ret = EXIT_SUCCESS;
+out:
+	for(i = 0; fn && i < num_dev; i++)
+		free(fn[i]);
+	free(fn);
+	free(ccid);
 	libccid_free_device_list(dev);
-
-	return EXIT_SUCCESS;
+	return ret;
 }
@@ -0,0 +1,635 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2008 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Measure the CPU cost of the host side of libemv and libsim, apart from
+ * the time spent on USB. Built in samples of FCI, GPO, record and SMS data
+ * are put through the decoders, and recorded card sessions are replayed
+ * through the virtual CCID to time reading application data and offline
+ * data authentication. Allocations are counted by wrapping malloc. The exit
+ * status is non-zero if any operation failed, "make check" runs it over
+ * emv-bench.trace and checks the allocation counts.
+*/
+
+#define _GNU_SOURCE
+#include <ccid.h>
+#include <ber.h>
+#include <emv.h>
+#include <sim.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <time.h>
+
+#include "ca_pubkeys.h"
+
+#define BENCH_DEFAULT_COUNT	10000
+#define BENCH_MAX_CORPUS	16
+#define BENCH_MAX_SAMPLE	256
+#define BENCH_BOOT_HEAP		4096
+
+struct stage {
+	const char	*s_name;
+	uint64_t	s_ops;
+	uint64_t	s_fail;
+	uint64_t	s_nsec;
+	uint64_t	s_allocs;
+};
+
+struct sample {
+	uint8_t		b_buf[BENCH_MAX_SAMPLE];
+	size_t		b_len;
+};
+
+/* Made up Visa card, the PAN is the well known test one */
+static const char * const emv_hex[] = {
+	/* FCI */
+	"6f2e8407a0000000031010a523500b56495341204352454449548701019f3803"
+	"9f1a025f2d02656ebf0c059f4d020b0a",
+	/* GPO, format 2 */
+	"770e82021c0094080801010010010300",
+	/* records */
+	"704157134761739001010010d25122011143804400000f5f201a564953412041"
+	"4351554952455220544553542f434152442030319f1f0c313134333830303030"
+	"303030",
+	"7081805a0847617390010100105f24032512315f25032001015f280208265f34"
+	"01018c159f02069f03069f1a0295055f2a029a039c019f37048d178a029f0206"
+	"9f03069f1a0295055f2a029a039c019f37048e0e000000000000000042031e03"
+	"1f009f0702ff009f0d05f0400088009f0e0500100000009f0f05f04000980"
+	"09f4a0182",
+};
+
+/* CDOL1 from the records above */
+static const char cdol_hex[] =
+	"9f02069f03069f1a0295055f2a029a039c019f3704";
+
+static const char * const sms_hex[] = {
+	/* SMS-DELIVER, default alphabet */
+	"0107911326040000f0040b911346610089f60000208062917314080cc8f71d14"
+	"969741f977fd07",
+	/* SMS-DELIVER, UCS2 */
+	"0107911326040000f0040b911346610089f60008208062917314080a00480065"
+	"006c006c006f",
+	/* SMS-SUBMIT, part of a concatenated message */
+	"0507911326040000f041000b911346610089f600000f050003cc0201a061391d"
+	"f4769701",
+};
+
+#define NUM_EMV		(sizeof(emv_hex)/sizeof(*emv_hex))
+#define NUM_SMS		(sizeof(sms_hex)/sizeof(*sms_hex))
+
+static struct sample emv_data_s[NUM_EMV];
+static struct sample sms_data_s[NUM_SMS];
+static struct sample cdol;
+
+static const struct {
+	const uint8_t *aid;
+	size_t aid_len;
+}aids[] = {
+	{(uint8_t *)"\xa0\x00\x00\x00\x03", 5},
+	{(uint8_t *)"\xa0\x00\x00\x00\x04", 5},
+	{(uint8_t *)"\xa0\x00\x00\x00\x25", 5},
+};
+
+static const struct {
+	const uint8_t *mod, *exp;
+	size_t mod_len, exp_len;
+}ca_keys[] = {
+	[7] = {.mod = visa1152_mod,
+		.mod_len = sizeof(visa1152_mod),
+		.exp = visa1152_exp,
+		.exp_len = sizeof(visa1152_exp)},
+};
+
+/* Allocation counting. dlsym() may want memory before the real allocator
+ * has been found, that comes from a small static heap which is never freed.
+ */
+static uint64_t allocs;
+static void *(*real_malloc)(size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static void (*real_free)(void *);
+static uint8_t boot_heap[BENCH_BOOT_HEAP];
+static size_t boot_used;
+
+static int boot_ptr(const void *ptr)
+{
+	return (const uint8_t *)ptr >= boot_heap &&
+		(const uint8_t *)ptr < boot_heap + sizeof(boot_heap);
+}
+
+static void *boot_alloc(size_t sz)
+{
+	void *ret;
+
+	sz = (sz + 15) & ~(size_t)15;
+	if ( sz > sizeof(boot_heap) - boot_used )
+		return NULL;
+	ret = boot_heap + boot_used;
+	boot_used += sz;
+	return ret;
+}
+
+static void alloc_init(void)
+{
+	static int busy;
+
+	if ( real_free || busy )
+		return;
+
+	busy = 1;
+	real_malloc = dlsym(RTLD_NEXT, "malloc");
+	real_calloc = dlsym(RTLD_NEXT, "calloc");
+	real_realloc = dlsym(RTLD_NEXT, "realloc");
+	real_free = dlsym(RTLD_NEXT, "free");
+	busy = 0;
+}
+
+void *malloc(size_t sz)
+{
+	alloc_init();
+	if ( NULL == real_malloc )
+		return boot_alloc(sz);
+	__sync_fetch_and_add(&allocs, 1);
+	return (*real_malloc)(sz);
+}
+
+void *calloc(size_t nmemb, size_t sz)
+{
+	alloc_init();
+	if ( NULL == real_calloc ) {
+		if ( sz && nmemb > sizeof(boot_heap) / sz )
+			return NULL;
+		return boot_alloc(nmemb * sz);
+	}
+	__sync_fetch_and_add(&allocs, 1);
+	return (*real_calloc)(nmemb, sz);
+}
+
+void *realloc(void *ptr, size_t sz)
+{
+	void *ret;
+
+	alloc_init();
+	if ( NULL == real_realloc )
+		return NULL;
+	__sync_fetch_and_add(&allocs, 1);
+	if ( !boot_ptr(ptr) )
+		return (*real_realloc)(ptr, sz);
+
+	/* the old size isn't known, but it's all in the boot heap */
+	ret = (*real_malloc)(sz);
+	if ( ret ) {
+		size_t max = boot_heap + sizeof(boot_heap) - (uint8_t *)ptr;
+		memcpy(ret, ptr, (sz < max) ? sz : max);
+	}
+	return ret;
+}
+
+void free(void *ptr)
+{
+	if ( NULL == ptr || boot_ptr(ptr) )
+		return;
+	alloc_init();
+	(*real_free)(ptr);
+}
+
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int parse_hex(const char *str, struct sample *s)
+{
+	unsigned int hi, lo;
+	size_t i;
+
+	for(i = 0; str[0] && str[1]; i++, str += 2) {
+		if ( i >= sizeof(s->b_buf) )
+			return 0;
+		if ( sscanf(str, "%1x%1x", &hi, &lo) != 2 )
+			return 0;
+		s->b_buf[i] = (hi << 4) | lo;
+	}
+
+	s->b_len = i;
+	return (str[0] == '\0');
+}
+
+static void stage_start(struct stage *st, uint64_t *nsec, uint64_t *nalloc)
+{
+	*nalloc = allocs;
+	*nsec = now_nsec();
+}
+
+static void stage_end(struct stage *st, uint64_t nsec, uint64_t nalloc,
+			unsigned int ops, int ok)
+{
+	st->s_nsec += now_nsec() - nsec;
+	st->s_allocs += allocs - nalloc;
+	st->s_ops += ops;
+	if ( !ok )
+		st->s_fail++;
+}
+
+/* Returns zero if any of the stage's operations failed */
+static int report(const char *corpus, const struct stage *st, int machine)
+{
+	double ns, al;
+
+	ns = (st->s_ops) ? (double)st->s_nsec / st->s_ops : 0;
+	al = (st->s_ops) ? (double)st->s_allocs / st->s_ops : 0;
+
+	if ( machine ) {
+		printf("%s\t%s\t%llu\t%llu\t%.1f\t%.2f\n",
+			corpus, st->s_name,
+			(unsigned long long)st->s_ops,
+			(unsigned long long)st->s_fail, ns, al);
+		return !st->s_fail;
+	}
+
+	printf("  %-8s %12.1f ns/op %8.2f allocs/op, %llu ops, %llu failed\n",
+		st->s_name, ns, al, (unsigned long long)st->s_ops,
+		(unsigned long long)st->s_fail);
+	return !st->s_fail;
+}
+
+struct ber_count {
+	unsigned int	c_known;
+	unsigned int	c_unknown;
+};
+
+static int count_tag(const uint8_t *ptr, size_t len, void *priv)
+{
+	struct ber_count *cnt = priv;
+	cnt->c_known++;
+	return 1;
+}
+
+static int count_unknown(const uint8_t *tag, size_t tag_len,
+			const uint8_t *ptr, size_t len, void *priv)
+{
+	struct ber_count *cnt = priv;
+	cnt->c_unknown++;
+	return 1;
+}
+
+static int tmpl(const uint8_t *ptr, size_t len, void *priv);
+
+/* Some of what libemv looks for, sorted by tag. Every tag in the samples
+ * must be here, any others are counted as unknown and fail the stage.
+ */
+static const struct ber_tag emv_tags[] = {
+	{ .tag = 0x50, .op = count_tag },
+	{ .tag = 0x57, .op = count_tag },
+	{ .tag = 0x5a, .op = count_tag },
+	{ .tag = 0x6f, .op = tmpl },
+	{ .tag = 0x70, .op = tmpl },
+	{ .tag = 0x77, .op = tmpl },
+	{ .tag = 0x82, .op = count_tag },
+	{ .tag = 0x84, .op = count_tag },
+	{ .tag = 0x87, .op = count_tag },
+	{ .tag = 0x8c, .op = count_tag },
+	{ .tag = 0x8d, .op = count_tag },
+	{ .tag = 0x8e, .op = count_tag },
+	{ .tag = 0x94, .op = count_tag },
+	{ .tag = 0xa5, .op = tmpl },
+	{ .tag = 0x5f20, .op = count_tag },
+	{ .tag = 0x5f24, .op = count_tag },
+	{ .tag = 0x5f25, .op = count_tag },
+	{ .tag = 0x5f28, .op = count_tag },
+	{ .tag = 0x5f2d, .op = count_tag },
+	{ .tag = 0x5f34, .op = count_tag },
+	{ .tag = 0x9f07, .op = count_tag },
+	{ .tag = 0x9f0d, .op = count_tag },
+	{ .tag = 0x9f0e, .op = count_tag },
+	{ .tag = 0x9f0f, .op = count_tag },
+	{ .tag = 0x9f1f, .op = count_tag },
+	{ .tag = 0x9f38, .op = count_tag },
+	{ .tag = 0x9f4a, .op = count_tag },
+	{ .tag = 0x9f4d, .op = count_tag },
+	{ .tag = 0xbf0c, .op = tmpl },
+};
+
+static int tmpl(const uint8_t *ptr, size_t len, void *priv)
+{
+	return ber_decode_ex(emv_tags, BER_NUM_TAGS(emv_tags), ptr, len,
+				count_unknown, priv);
+}
+
+static int bench_ber(unsigned int count, int machine)
+{
+	struct stage st = {.s_name = "ber"};
+	uint64_t nsec, nalloc;
+	struct ber_count cnt;
+	unsigned int i, j;
+	int ok = 1;
+
+	stage_start(&st, &nsec, &nalloc);
+	for(i = 0; i < count; i++) {
+		for(j = 0; j < NUM_EMV; j++) {
+			memset(&cnt, 0, sizeof(cnt));
+			if ( !ber_decode_ex(emv_tags, BER_NUM_TAGS(emv_tags),
+					emv_data_s[j].b_buf,
+					emv_data_s[j].b_len,
+					count_unknown, &cnt) ||
+					!cnt.c_known || cnt.c_unknown )
+				ok = 0;
+		}
+	}
+	stage_end(&st, nsec, nalloc, count * NUM_EMV, ok);
+	return report("builtin", &st, machine);
+}
+
+/* An unpredictable number and an amount, the rest zeros */
+static int dol_cb(uint16_t tag, uint8_t *ptr, size_t len, void *priv)
+{
+	unsigned int *seed = priv;
+	size_t i;
+
+	switch(tag) {
+	case 0x9f02:
+		memset(ptr, 0, len);
+		ptr[len - 1] = 0x99;
+		return 1;
+	case 0x9f37:
+		for(i = 0; i < len; i++)
+			ptr[i] = rand_r(seed);
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static int bench_dol(unsigned int count, int machine)
+{
+	struct stage st = {.s_name = "dol"};
+	uint8_t buf[BENCH_MAX_SAMPLE];
+	uint64_t nsec, nalloc;
+	unsigned int i, seed = 1;
+	size_t len;
+	int ok = 1;
+
+	stage_start(&st, &nsec, &nalloc);
+	for(i = 0; i < count; i++) {
+		len = sizeof(buf);
+		if ( !emv_construct_dol_buf(dol_cb, cdol.b_buf, cdol.b_len,
+						buf, &len, &seed) )
+			ok = 0;
+	}
+	stage_end(&st, nsec, nalloc, count, ok);
+	return report("builtin", &st, machine);
+}
+
+static int bench_sms(unsigned int count, int machine)
+{
+	struct stage st = {.s_name = "sms"};
+	uint64_t nsec, nalloc;
+	struct sim_sms sms;
+	unsigned int i, j;
+	int ok = 1;
+
+	stage_start(&st, &nsec, &nalloc);
+	for(i = 0; i < count; i++) {
+		for(j = 0; j < NUM_SMS; j++) {
+			if ( !sim_sms_decode(sms_data_s[j].b_buf,
+					sms_data_s[j].b_len, &sms) )
+				ok = 0;
+		}
+	}
+	stage_end(&st, nsec, nalloc, count * NUM_SMS, ok);
+	return report("builtin", &st, machine);
+}
+
+static const uint8_t *get_mod(void *priv, unsigned int idx, size_t *len)
+{
+	if ( idx >= sizeof(ca_keys)/sizeof(*ca_keys) )
+		return NULL;
+	*len = ca_keys[idx].mod_len;
+	return ca_keys[idx].mod;
+}
+
+static const uint8_t *get_exp(void *priv, unsigned int idx, size_t *len)
+{
+	if ( idx >= sizeof(ca_keys)/sizeof(*ca_keys) )
+		return NULL;
+	*len = ca_keys[idx].exp_len;
+	return ca_keys[idx].exp;
+}
+
+static int select_app(emv_t e)
+{
+	emv_app_t app;
+	unsigned int i;
+
+	if ( emv_appsel_pse(e) ) {
+		for(app = emv_appsel_pse_first(e); app;
+				app = emv_appsel_pse_next(e, app)) {
+			if ( emv_app_select_pse(e, app) )
+				return 1;
+		}
+	}
+
+	for(i = 0; i < sizeof(aids)/sizeof(*aids); i++) {
+		if ( emv_app_select_aid(e, aids[i].aid, aids[i].aid_len) )
+			return 1;
+	}
+
+	return 0;
+}
+
+#define RS_APPSEL	0
+#define RS_INIT		1
+#define RS_READ		2
+#define RS_SDA		3
+#define RS_DDA		4
+#define RS_MAX		5
+
+/* One pass through a recorded session, returns zero if it went wrong
+ * before authentication, which is only attempted if the card does it.
+ */
+static int replay_once(cci_t cci, struct stage *st)
+{
+	uint64_t nsec, nalloc;
+	emv_aip_t aip;
+	int ok, ret = 0;
+	emv_t e;
+
+	e = emv_init(cci);
+	if ( NULL == e )
+		return 0;
+
+	stage_start(st + RS_APPSEL, &nsec, &nalloc);
+	ok = select_app(e);
+	stage_end(st + RS_APPSEL, nsec, nalloc, 1, ok);
+	if ( !ok )
+		goto out;
+
+	stage_start(st + RS_INIT, &nsec, &nalloc);
+	ok = emv_app_init(e);
+	stage_end(st + RS_INIT, nsec, nalloc, 1, ok);
+	if ( !ok )
+		goto out;
+
+	stage_start(st + RS_READ, &nsec, &nalloc);
+	ok = emv_read_app_data(e);
+	stage_end(st + RS_READ, nsec, nalloc, 1, ok);
+	if ( !ok || !emv_app_aip(e, aip) )
+		goto out;
+
+	ret = 1;
+
+	if ( aip[0] & EMV_AIP_SDA ) {
+		stage_start(st + RS_SDA, &nsec, &nalloc);
+		ok = emv_authenticate_static_data(e, get_mod, get_exp, NULL);
+		stage_end(st + RS_SDA, nsec, nalloc, 1, ok);
+	}
+
+	if ( aip[0] & EMV_AIP_DDA ) {
+		stage_start(st + RS_DDA, &nsec, &nalloc);
+		ok = emv_authenticate_dynamic(e, get_mod, get_exp, NULL);
+		stage_end(st + RS_DDA, nsec, nalloc, 1, ok);
+	}
+
+out:
+	emv_fini(e);
+	return ret;
+}
+
+static int bench_replay(const char *fn, unsigned int count, int machine)
+{
+	struct stage st[RS_MAX] = {
+		[RS_APPSEL] = {.s_name = "appsel"},
+		[RS_INIT] = {.s_name = "init"},
+		[RS_READ] = {.s_name = "read"},
+		[RS_SDA] = {.s_name = "sda"},
+		[RS_DDA] = {.s_name = "dda"},
+	};
+	unsigned int i, pass;
+	ccid_t ccid;
+	cci_t cci;
+	int ret = 0;
+
+	ccid = ccid_probe_replay(fn, NULL);
+	if ( NULL == ccid )
+		return 0;
+
+	cci = (ccid_num_slots(ccid)) ? ccid_get_slot(ccid, 0) :
+					ccid_get_field(ccid, 0);
+	if ( NULL == cci || !cci_power_on(cci, CHIPCARD_AUTO_VOLTAGE, NULL) ) {
+		fprintf(stderr, "%s: power on failed\n", fn);
+		goto out;
+	}
+
+	for(pass = 0; pass < count; pass++) {
+		if ( !replay_once(cci, st) ) {
+			fprintf(stderr, "%s: session failed on pass %u\n",
+				fn, pass);
+			break;
+		}
+	}
+
+	ret = (pass == count);
+	if ( !machine )
+		printf("%s:\n", fn);
+	for(i = 0; i < RS_MAX; i++) {
+		if ( st[i].s_ops && !report(fn, st + i, machine) )
+			ret = 0;
+	}
+
+	cci_power_off(cci);
+out:
+	ccid_close(ccid);
+	return ret;
+}
+
+static int load_samples(void)
+{
+	unsigned int i;
+
+	for(i = 0; i < NUM_EMV; i++)
+		if ( !parse_hex(emv_hex[i], emv_data_s + i) )
+			return 0;
+	for(i = 0; i < NUM_SMS; i++)
+		if ( !parse_hex(sms_hex[i], sms_data_s + i) )
+			return 0;
+	return parse_hex(cdol_hex, &cdol);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: emv-bench [options]\n"
+		"  -n <count>     iterations of each stage (default %u)\n"
+		"  -r <file>      replay a binary trace of an EMV session, "
+			"may be repeated\n"
+		"  -R             only the replayed sessions, not the built "
+			"in samples\n"
+		"  -m             machine readable output\n",
+		BENCH_DEFAULT_COUNT);
+}
+
+int main(int argc, char **argv)
+{
+	const char *corpus[BENCH_MAX_CORPUS];
+	unsigned int num_corpus = 0, count = BENCH_DEFAULT_COUNT, i;
+	int c, machine = 0, builtin = 1, ret = EXIT_SUCCESS;
+
+	while ( (c = getopt(argc, argv, "n:r:Rmh")) != -1 ) {
+		switch(c) {
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			if ( 0 == count ) {
+				usage();
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'r':
+			if ( num_corpus >= BENCH_MAX_CORPUS ) {
+				fprintf(stderr, "too many traces\n");
+				return EXIT_FAILURE;
+			}
+			corpus[num_corpus++] = optarg;
+			break;
+		case 'R':
+			builtin = 0;
+			break;
+		case 'm':
+			machine = 1;
+			break;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if ( !load_samples() ) {
+		fprintf(stderr, "emv-bench: bad built in sample\n");
+		return EXIT_FAILURE;
+	}
+
+	if ( machine )
+		printf("#corpus\tstage\tops\tfail\tns_per_op\tallocs_per_op\n");
+
+	if ( builtin ) {
+		if ( !machine )
+			printf("built in samples:\n");
+		if ( !bench_ber(count, machine) )
+			ret = EXIT_FAILURE;
+		if ( !bench_dol(count, machine) )
+			ret = EXIT_FAILURE;
+		if ( !bench_sms(count, machine) )
+			ret = EXIT_FAILURE;
+	}
+
+	for(i = 0; i < num_corpus; i++) {
+		if ( !bench_replay(corpus[i], count, machine) )
+			ret = EXIT_FAILURE;
+	}
+
+	return ret;
+}
@@ -36,24 +36,59 @@ struct _emv_tag {
 	const char *t_label;
 };
 
+/* on a node, for elements whose tag is not EMV_DATA_ATOMIC */
+#define EMV_DATA_CONSTRUCTED	(1<<2)
+
+/* The elements of a record are decoded in to a single block: a flat array of
+ * nodes in which the children of each composite are contiguous and sorted by
+ * tag, then the pointer arrays handed out by emv_data_children() and lastly a
+ * copy of the record. Nodes refer to their data and children by byte offset
+ * from the node itself, so 16 of them fit in 256 bytes.
+ */
 struct _emv_data {
-	const struct _emv_tag *d_tag;
 	uint16_t d_id;
 	uint16_t d_flags;
-	const uint8_t *d_data;
-	size_t d_len;
-	struct _emv_data **d_elem;
-	unsigned int d_nmemb;
+	uint32_t d_off;
+	uint16_t d_len;
+	uint16_t d_nmemb;
+	uint32_t d_elem;
+};
+
+/* A child element being decoded, before it is placed in the node array */
+struct _emv_tlv {
+	uint16_t v_id;
+	const uint8_t *v_ptr;
+	size_t v_len;
 };
 
-static inline int emv_data_atomic(struct _emv_data *d)
+static inline const uint8_t *_emv_data_ptr(const struct _emv_data *d)
+{
+	return (const uint8_t *)d + d->d_off;
+}
+static inline struct _emv_data **_emv_data_elem(const struct _emv_data *d)
+{
+	return (struct _emv_data **)((uint8_t *)d + d->d_elem);
+}
+/* Children in tag order, d_nmemb of them back to back */
+static inline const struct _emv_data *_emv_data_kids(const struct _emv_data *d)
 {
-	return !!(d->d_tag->t_type & EMV_DATA_ATOMIC);
+	return (d->d_nmemb) ? *_emv_data_elem(d) : NULL;
 }
-static inline int emv_data_composite(struct _emv_data *d)
+static inline int emv_data_atomic(const struct _emv_data *d)
 {
-	return !(d->d_tag->t_type & EMV_DATA_ATOMIC);
+	return !(d->d_flags & EMV_DATA_CONSTRUCTED);
 }
+static inline int emv_data_composite(const struct _emv_data *d)
+{
+	return !!(d->d_flags & EMV_DATA_CONSTRUCTED);
+}
+
+/* A record listed in the AFL */
+struct _emv_recref {
+	uint8_t r_sfi;
+	uint8_t r_rec;
+	uint8_t r_sda;
+};
 
 struct _emv_db {
 	unsigned int db_nmemb;
@@ -62,6 +97,25 @@ struct _emv_db {
 	struct _emv_data **db_rec;
 	unsigned int db_numsda;
 	struct _emv_data **db_sda;
+
+	/* records are read in AFL order, db_rec[numread] onwards are NULL */
+	struct _emv_recref *db_afl;
+	unsigned int db_numread;
+	unsigned int db_sdaread;
+	unsigned int db_lastsda;
+
+	/* db_elem is grown as records are decoded */
+	unsigned int db_elem_max;
+	struct _emv_tlv *db_tmp;
+	unsigned int db_tmp_max;
+
+	/* SDA records back to back in AFL order, appended as they are read */
+	uint8_t *db_sdabuf;
+	size_t db_sdalen;
+	size_t db_sdamax;
+
+	/* first element with each known tag, indexed by position in tags[] */
+	struct _emv_data **db_slot;
 };
 
 struct _emv_app {
@@ -80,7 +134,6 @@ struct _emv {
 	cci_t e_dev;
 	xfr_t e_xfr;
 
-	mpool_t e_data;
 	gang_t e_files;
 	struct _emv_db e_db;
 
@@ -88,10 +141,13 @@ struct _emv {
 	unsigned int e_num_apps;
 	struct list_head e_apps;
 	struct _emv_app *e_app;
+	uint8_t e_sel_md[SHA_DIGEST_LENGTH];
+	uint8_t e_sel_key; /* e_sel_md identifies the card */
 
 	emv_aip_t e_aip;
 	uint8_t *e_afl;
 	size_t e_afl_len;
+	size_t e_afl_max;
 
 	/* crypto stuff */
 	uint8_t e_sda_ok;
@@ -103,7 +159,53 @@ struct _emv {
 	RSA *e_iss_pk;
 	RSA *e_icc_pk;
 
+	/* asynchronous authentication, protected by the pool lock */
+	struct list_head e_auth_done;
+	struct list_head e_auth_spare; /* owner thread only */
+	unsigned int e_auth_pending;
+	unsigned int e_auth_gen;
+
 	emv_err_t e_err;
+
+	/* snapshot from emv_db_load(), there is no card */
+	void *e_map;
+	size_t e_map_len;
+};
+
+/* Largest key in the EMV book 2 key set, 1984 bits */
+#define EMV_MAX_KEY_LEN		(1984 / 8)
+
+/* An authentication in progress, the verify function runs without touching
+ * the emv_t so that it can be done on any thread.
+ */
+struct _emv_auth {
+	struct list_head a_list;
+	struct _emv *a_emv;
+	unsigned int a_gen;
+	int (*a_verify)(struct _emv_auth *a);
+	emv_auth_cb_t a_cb;
+	void *a_priv;
+
+	/* copies of everything a_verify needs from the card */
+	gang_t a_mem;
+	void *a_req;
+	emv_rid_t a_rid;
+	emv_aip_t a_aip;
+	const uint8_t *a_sda;
+	size_t a_sda_len;
+	RSA *a_ca_pk;
+	size_t a_ca_pk_len;
+
+	/* scratch space for one key sized RSA operation */
+	uint8_t a_scratch[EMV_MAX_KEY_LEN];
+
+	/* results */
+	RSA *a_iss_pk;
+	RSA *a_icc_pk;
+	emv_err_t a_err;
+	uint8_t a_ok;
+	uint8_t a_sda_ok;
+	uint8_t a_dda_ok;
 };
 
 #define DOL_NUM_TAGS(x) (sizeof(x)/sizeof(struct dol_tag))
@@ -113,6 +215,51 @@ struct dol_tag {
 	int(*op)(uint8_t *ptr, size_t len, void *priv);
 };
 
+/* CA public key store, returns a new reference */
+_private RSA *_emv_ca_key(emv_t e, unsigned int idx, emv_mod_cb_t mod,
+			emv_exp_cb_t exp, size_t *key_len, void *priv);
+
+/* Issuer public key cache and revocation list */
+_private void _emv_pk_digest(const emv_rid_t rid, unsigned int ca_idx,
+				const RSA *ca_key,
+				const uint8_t *cert, size_t cert_len,
+				const uint8_t *r, size_t r_len,
+				const uint8_t *exp, size_t exp_len,
+				uint8_t *md);
+_private RSA *_emv_pk_lookup(const uint8_t *md);
+_private void _emv_pk_store(const emv_rid_t rid, unsigned int ca_idx,
+				const uint8_t *md,
+				const uint8_t *cert, RSA *key);
+_private int _emv_pk_revoked(const emv_rid_t rid, unsigned int ca_idx,
+				const uint8_t *cert);
+
+/* Application selection result cache */
+_private int _emv_sel_key(emv_t e, const uint8_t *fci, size_t len);
+_private int _emv_sel_lookup(emv_t e);
+_private void _emv_sel_store(emv_t e);
+_private int _emv_sel_fci(emv_t e, const uint8_t *fci, size_t len,
+				struct _emv_app *a);
+_private void _emv_sel_fci_store(emv_t e, const uint8_t *fci, size_t len,
+				const struct _emv_app *a);
+
+/* Offline data authentication jobs */
+_private struct _emv_auth *_emv_auth_new(emv_t e,
+					int (*verify)(struct _emv_auth *a));
+_private void _emv_auth_free(struct _emv_auth *a);
+_private void _emv_auth_flush(emv_t e);
+_private uint8_t *_emv_auth_dup(struct _emv_auth *a,
+				const uint8_t *ptr, size_t len);
+_private int _emv_auth_sda_records(struct _emv_auth *a);
+_private void _emv_auth_error(struct _emv_auth *a, unsigned int code);
+_private void _emv_auth_sys_error(struct _emv_auth *a);
+_private uint8_t *_emv_auth_scratch(struct _emv_auth *a, size_t len);
+_private int _emv_auth_recover(struct _emv_auth *a, uint8_t *ptr, size_t len,
+				RSA *key);
+_private int _emv_auth_run(struct _emv_auth *a);
+_private int _emv_auth_submit(struct _emv_auth *a, emv_auth_cb_t cb,
+				void *priv);
+_private void _emv_auth_drain(emv_t e);
+
 /* Utility functions */
 _private uint8_t _emv_sw1(emv_t e);
 _private uint8_t _emv_sw2(emv_t e);
@@ -121,8 +268,14 @@ _private int _emv_pin2pb(const char *pin, uint8_t *pb);
 /* Internal state functions */
 _private void _emv_auth_reset(emv_t e);
 
+_private struct _emv *_emv_new(cci_t cc);
+
 /* Application selection */
 _private void _emv_free_applist(emv_t e);
+_private void _emv_recycle_applist(emv_t e);
+_private mpool_t _emv_app_pool(void);
+_private struct _emv_app *_emv_app_alloc(emv_t e);
+_private void _emv_app_put(emv_t e, struct _emv_app *a);
 _private void _emv_init_applist(emv_t e);
 
 /* Application transaction initiation */
@@ -131,11 +284,18 @@ _private int _emv_app_init(emv_t e, const uint8_t *aid, size_t aid_len);
 /* Application data retrieval */
 _private int _emv_read_app_data(struct _emv *e);
 _private const struct _emv_data *_emv_retrieve_data(emv_t, uint16_t id);
+_private int _emv_read_sda(emv_t e);
+_private void _emv_db_reset(emv_t e);
+_private int _emv_db_index_slots(emv_t e);
 
 /* DOL construction */
 _private uint8_t *_emv_construct_dol(emv_dol_cb_t cbfn,
 					const uint8_t *ptr, size_t len,
 					size_t *ret_len, void *priv);
+_private int _emv_construct_dol_buf(emv_dol_cb_t cbfn,
+					const uint8_t *ptr, size_t len,
+					uint8_t *buf, size_t *buf_len,
+					void *priv);
 
 /* APDU construction + transactions */
 _private int _emv_read_record(emv_t e, uint8_t sfi, uint8_t record);
@@ -156,7 +316,7 @@ _private void _emv_error(struct _emv *e, unsigned int code);
 _private void _emv_success(struct _emv *e);
 
 /* data authentication */
-_private int _emsa_pss_decode(const uint8_t *msg, size_t msg_len,
+_private int _emsa_pss_decode(const uint8_t *md,
 				const uint8_t *em, size_t em_len);
 
 #endif /* _EMV_INTERNAL_H */
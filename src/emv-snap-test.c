@@ -0,0 +1,207 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2008 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Regression test for emv_db_load(), run by "make check". A small snapshot
+ * is built by hand, one record holding a PAN, and must load and give back
+ * the PAN. Damaged copies of it must all be refused.
+*/
+
+#include <ccid.h>
+#include <list.h>
+#include <emv.h>
+#include <errno.h>
+#include <unistd.h>
+#include "emv-internal.h"
+#include "emv-snap.h"
+
+#define TEST_FILE	"emv-snap-test.snap"
+
+static const uint8_t pan[] = {0x47, 0x61, 0x73, 0x90, 0x01};
+
+/* Layout of the test snapshot, a root node and one child */
+#define HDR_SIZE	((sizeof(struct snap_hdr) + SNAP_ALIGN - 1) & \
+				~(size_t)(SNAP_ALIGN - 1))
+#define REC_OFF		HDR_SIZE
+#define REC_SLOTS	(2 * sizeof(struct _emv_data))
+#define REC_DATA	(REC_SLOTS + sizeof(uintptr_t))
+#define REC_SIZE	(REC_DATA + 2 + sizeof(pan))
+#define REC_ARRAY	(REC_OFF + ((REC_SIZE + SNAP_ALIGN - 1) & \
+				~(size_t)(SNAP_ALIGN - 1)))
+#define SNAP_SIZE	(REC_ARRAY + sizeof(uintptr_t))
+
+struct snap {
+	union {
+		struct snap_hdr	hdr;
+		uint8_t		buf[SNAP_SIZE];
+	} s;
+};
+
+static struct _emv_data *snap_root(struct snap *s)
+{
+	return (struct _emv_data *)(s->s.buf + REC_OFF);
+}
+
+static void snap_build(struct snap *s)
+{
+	struct snap_hdr *h = &s->s.hdr;
+	struct _emv_data *d = snap_root(s);
+	uint8_t *data = s->s.buf + REC_OFF + REC_DATA;
+	uintptr_t off;
+
+	memset(s, 0, sizeof(*s));
+	h->h_magic = SNAP_MAGIC;
+	h->h_version = SNAP_VERSION;
+	h->h_ptr_size = sizeof(void *);
+	h->h_node_size = sizeof(struct _emv_data);
+	h->h_size = SNAP_SIZE;
+	h->h_rec = REC_ARRAY;
+	h->h_numrec = 1;
+	h->h_sda = h->h_elem = h->h_sdabuf = h->h_afl = SNAP_SIZE;
+
+	/* record template, containing just the PAN */
+	d[0].d_id = EMV_TAG_RECORD;
+	d[0].d_flags = EMV_DATA_CONSTRUCTED;
+	d[0].d_off = REC_DATA;
+	d[0].d_len = 2 + sizeof(pan);
+	d[0].d_nmemb = 1;
+	d[0].d_elem = REC_SLOTS;
+
+	d[1].d_id = EMV_TAG_PAN;
+	d[1].d_off = REC_DATA + 2 - sizeof(*d);
+	d[1].d_len = sizeof(pan);
+
+	data[0] = EMV_TAG_PAN;
+	data[1] = sizeof(pan);
+	memcpy(data + 2, pan, sizeof(pan));
+
+	off = REC_OFF + sizeof(*d);
+	memcpy(s->s.buf + REC_OFF + REC_SLOTS, &off, sizeof(off));
+	off = REC_OFF;
+	memcpy(s->s.buf + REC_ARRAY, &off, sizeof(off));
+}
+
+static emv_t snap_load(const struct snap *s)
+{
+	FILE *f;
+
+	f = fopen(TEST_FILE, "w");
+	if ( NULL == f || fwrite(s, sizeof(*s), 1, f) != 1 ) {
+		fprintf(stderr, "*** error: %s: %s\n", TEST_FILE,
+			strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	fclose(f);
+
+	return emv_db_load(TEST_FILE);
+}
+
+static int test_good(void)
+{
+	struct snap s;
+	const uint8_t *ptr;
+	emv_data_t d;
+	size_t len;
+	emv_t e;
+	int ret = 0;
+
+	snap_build(&s);
+	e = snap_load(&s);
+	if ( NULL == e ) {
+		fprintf(stderr, "good: not loaded\n");
+		return 0;
+	}
+
+	d = emv_retrieve_data(e, EMV_TAG_PAN);
+	ptr = (d) ? emv_data(d, &len) : NULL;
+	if ( NULL == ptr || len != sizeof(pan) || memcmp(ptr, pan, len) )
+		fprintf(stderr, "good: wrong PAN\n");
+	else
+		ret = 1;
+
+	emv_fini(e);
+	return ret;
+}
+
+/* Each of these must be refused */
+static void bad_wrap_root(struct snap *s)
+{
+	/* d_off + d_len wraps to less than the nodes in 32 bits, so the
+	 * bound for the child, less its own offset, would wrap as well
+	 */
+	snap_root(s)[0].d_off = 0xfffffff0;
+	snap_root(s)[0].d_len = 0x18;
+}
+
+static void bad_wrap_kid(struct snap *s)
+{
+	snap_root(s)[1].d_off = 0xfffffff0;
+	snap_root(s)[1].d_len = 0x20;
+}
+
+static void bad_past_rec(struct snap *s)
+{
+	snap_root(s)[1].d_len++;
+}
+
+static void bad_nodes(struct snap *s)
+{
+	/* claims more nodes than fit before the data */
+	snap_root(s)[0].d_elem = 4 * sizeof(struct _emv_data);
+}
+
+static void bad_kid_slot(struct snap *s)
+{
+	uintptr_t off = REC_OFF;
+	memcpy(s->s.buf + REC_OFF + REC_SLOTS, &off, sizeof(off));
+}
+
+static void bad_rec_slot(struct snap *s)
+{
+	uintptr_t off = SNAP_SIZE;
+	memcpy(s->s.buf + REC_ARRAY, &off, sizeof(off));
+}
+
+static void bad_size(struct snap *s)
+{
+	s->s.hdr.h_size++;
+}
+
+static const struct {
+	const char *name;
+	void (*fn)(struct snap *s);
+} bad[] = {
+	{"wrap root", bad_wrap_root},
+	{"wrap kid", bad_wrap_kid},
+	{"past record", bad_past_rec},
+	{"nodes", bad_nodes},
+	{"kid slot", bad_kid_slot},
+	{"record slot", bad_rec_slot},
+	{"size", bad_size},
+};
+
+int main(int argc, char **argv)
+{
+	struct snap s;
+	unsigned int i;
+	int ret = EXIT_SUCCESS;
+	emv_t e;
+
+	if ( !test_good() )
+		ret = EXIT_FAILURE;
+
+	for(i = 0; i < sizeof(bad)/sizeof(*bad); i++) {
+		snap_build(&s);
+		(*bad[i].fn)(&s);
+		e = snap_load(&s);
+		if ( e ) {
+			fprintf(stderr, "%s: loaded\n", bad[i].name);
+			emv_fini(e);
+			ret = EXIT_FAILURE;
+		}
+	}
+
+	unlink(TEST_FILE);
+	return ret;
+}
@@ -0,0 +1,50 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2008 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * On disk format of the snapshots written by emv_db_save(), shared with the
+ * test which feeds damaged ones to emv_db_load().
+*/
+#ifndef _EMV_SNAP_H
+#define _EMV_SNAP_H
+
+#define SNAP_MAGIC	0x53564d45 /* "EMVS" in little endian */
+#define SNAP_VERSION	1
+#define SNAP_ALIGN	8
+
+struct snap_app {
+	uint8_t		s_present;
+	uint8_t		s_recno;
+	uint8_t		s_prio;
+	uint8_t		s_id_sz;
+	uint8_t		s_id[16];
+	char		s_name[16];
+	char		s_pname[16];
+};
+
+struct snap_hdr {
+	uint32_t	h_magic;
+	uint16_t	h_version;
+	uint8_t		h_ptr_size;
+	uint8_t		h_node_size;
+	uint64_t	h_size;
+
+	/* arrays of pointer slots */
+	uint64_t	h_rec;
+	uint64_t	h_sda;
+	uint64_t	h_elem;
+	uint32_t	h_numrec;
+	uint32_t	h_numsda;
+	uint32_t	h_nmemb;
+	uint32_t	h_sdalen;
+	uint64_t	h_sdabuf;
+	uint64_t	h_afl;
+	uint32_t	h_afl_len;
+	uint8_t		h_aip[EMV_AIP_LEN];
+	uint8_t		_pad0[2];
+
+	struct snap_app	h_app;
+};
+
+#endif /* _EMV_SNAP_H */
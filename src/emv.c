@@ -11,6 +11,7 @@
 #include "emv-internal.h"
 
 #include <ctype.h>
+#include <sys/mman.h>
 
 uint8_t _emv_sw1(emv_t e)
 {
@@ -22,15 +23,11 @@ uint8_t _emv_sw2(emv_t e)
 	return xfr_rx_sw2(e->e_xfr);
 }
 
-int _emsa_pss_decode(const uint8_t *msg, size_t msg_len,
-				const uint8_t *em, size_t em_len)
+/* md is mHash, the caller hashes the message as it sees fit */
+int _emsa_pss_decode(const uint8_t *md, const uint8_t *em, size_t em_len)
 {
-	uint8_t md[SHA_DIGEST_LENGTH];
 	size_t mdb_len;
 
-	/* 2. mHash < Hash(m) */
-	SHA1(msg, msg_len, md);
-
 	/* 4. if the rightmost octet of em does not have hexadecimal
 	 * value 0xBC, output “invalid” */
 	if ( em[em_len - 1] != 0xbc ) {
@@ -38,7 +35,7 @@ int _emsa_pss_decode(const uint8_t *msg, size_t msg_len,
 		return 0;
 	}
 	
-	mdb_len = em_len - sizeof(md) - 1;
+	mdb_len = em_len - SHA_DIGEST_LENGTH - 1;
 
 	if ( memcmp(em + mdb_len, md, SHA_DIGEST_LENGTH) )
 		return 0;
@@ -80,11 +77,9 @@ static const struct dol_tag *find_tag(const struct dol_tag *tags,
 }
 #endif
 
-static uint8_t *construct_dol(emv_dol_cb_t cbfn, const uint8_t *ptr, size_t len,
-				size_t *ret_len, void *priv)
+static int dol_size(const uint8_t *ptr, size_t len, size_t *ret_len)
 {
 	const uint8_t *tmp, *end;
-	uint8_t *dol, *dtmp;
 	size_t sz;
 
 	end = ptr + len;
@@ -93,16 +88,25 @@ static uint8_t *construct_dol(emv_dol_cb_t cbfn, const uint8_t *ptr, size_t len,
 		size_t tag_len;
 
 		tag_len = ber_tag_len(tmp, end);
-		if ( tag_len == 0 )
-			return NULL;
+		if ( tag_len == 0 || tmp + tag_len >= end )
+			return 0;
 
 		tmp += tag_len;
 		sz += *tmp;
 	}
 
-	dol = dtmp = malloc(sz);
-	if ( NULL == dol )
-		return NULL;
+	*ret_len = sz;
+	return 1;
+}
+
+/* buf must have room for the size worked out by dol_size() */
+static int dol_fill(emv_dol_cb_t cbfn, const uint8_t *ptr, size_t len,
+			uint8_t *buf, void *priv)
+{
+	const uint8_t *tmp, *end;
+	uint8_t *dtmp = buf;
+
+	end = ptr + len;
 
 	for(tmp = ptr; tmp < end; tmp++) {
 		//const struct dol_tag *tag;
@@ -118,8 +122,7 @@ static uint8_t *construct_dol(emv_dol_cb_t cbfn, const uint8_t *ptr, size_t len,
 			tag = (tmp[0] << 8) | tmp[1];
 			break;
 		default:
-			free(dol);
-			return NULL;
+			return 0;
 		}
 
 		tmp += tag_len;
@@ -144,10 +147,53 @@ static uint8_t *construct_dol(emv_dol_cb_t cbfn, const uint8_t *ptr, size_t len,
 		dtmp += *tmp;
 	}
 
+	return 1;
+}
+
+static uint8_t *construct_dol(emv_dol_cb_t cbfn, const uint8_t *ptr, size_t len,
+				size_t *ret_len, void *priv)
+{
+	uint8_t *dol;
+	size_t sz;
+
+	if ( !dol_size(ptr, len, &sz) )
+		return NULL;
+
+	dol = malloc(sz);
+	if ( NULL == dol )
+		return NULL;
+
+	if ( !dol_fill(cbfn, ptr, len, dol, priv) ) {
+		free(dol);
+		return NULL;
+	}
+
 	*ret_len = sz;
 	return dol;
 }
 
+/* Build the DOL in to buf, which has room for *buf_len bytes. On return
+ * *buf_len is the size of the DOL, if that is bigger than the buffer then
+ * nothing is written and zero is returned.
+ */
+static int construct_dol_buf(emv_dol_cb_t cbfn, const uint8_t *ptr,
+				size_t len, uint8_t *buf, size_t *buf_len,
+				void *priv)
+{
+	size_t sz;
+
+	if ( !dol_size(ptr, len, &sz) )
+		return 0;
+
+	if ( sz > *buf_len ) {
+		*buf_len = sz;
+		return 0;
+	}
+
+	*buf_len = sz;
+	return dol_fill(cbfn, ptr, len, buf, priv);
+}
+
 uint8_t *emv_construct_dol(emv_dol_cb_t cbfn, const uint8_t *ptr, size_t len,
 				size_t *ret_len, void *priv)
 {
@@ -160,6 +206,18 @@ uint8_t *_emv_construct_dol(emv_dol_cb_t cbfn, const uint8_t *ptr, size_t len,
 	return construct_dol(cbfn, ptr, len, ret_len, priv);
 }
 
+int emv_construct_dol_buf(emv_dol_cb_t cbfn, const uint8_t *ptr, size_t len,
+				uint8_t *buf, size_t *buf_len, void *priv)
+{
+	return construct_dol_buf(cbfn, ptr, len, buf, buf_len, priv);
+}
+
+int _emv_construct_dol_buf(emv_dol_cb_t cbfn, const uint8_t *ptr, size_t len,
+				uint8_t *buf, size_t *buf_len, void *priv)
+{
+	return construct_dol_buf(cbfn, ptr, len, buf, buf_len, priv);
+}
+
 int _emv_pin2pb(const char *pin, emv_pb_t pb)
 {
 	unsigned int i;
@@ -198,6 +256,8 @@ const uint8_t *emv_generate_ac(emv_t e, uint8_t ref,
 /* Reset authentication related state */
 void _emv_auth_reset(emv_t e)
 {
+	/* results of any jobs still in progress no longer apply */
+	e->e_auth_gen++;
 	e->e_sda_ok = 0;
 	e->e_dda_ok = 0;
 	e->e_cda_ok = 0;
@@ -212,16 +272,20 @@ void _emv_auth_reset(emv_t e)
 static void do_emv_fini(emv_t e)
 {
 	if ( e ) {
+		_emv_auth_drain(e);
 		_emv_auth_reset(e);
+		_emv_auth_flush(e);
 
 		_emv_free_applist(e);
 
-		free(e->e_app);
-
-		mpool_free(e->e_data);
 		gang_free(e->e_files);
 
 		free(e->e_afl);
+		free(e->e_db.db_tmp);
+		if ( e->e_map )
+			munmap(e->e_map, e->e_map_len);
+		else
+			free(e->e_db.db_sdabuf);
  
 		if ( e->e_xfr )
 			xfr_free(e->e_xfr);
@@ -235,43 +299,113 @@ emv_app_t emv_current_app(emv_t e)
 	return e->e_app;
 }
 
-emv_t emv_init(cci_t cc)
+/* An emv_t for the card in cc, or for none if cc is NULL */
+struct _emv *_emv_new(cci_t cc)
 {
 	struct _emv *e;
 
-	if ( cci_slot_status(cc) != CHIPCARD_ACTIVE )
-		return NULL;
-
 	e = calloc(1, sizeof(*e));
 	if ( e ) {
 		e->e_dev = cc;
 		INIT_LIST_HEAD(&e->e_apps);
+		INIT_LIST_HEAD(&e->e_auth_done);
+		INIT_LIST_HEAD(&e->e_auth_spare);
 
 		e->e_xfr = xfr_alloc(1024, 1204);
 		if ( NULL == e->e_xfr )
 			goto err;
+		xfr_auto_response(e->e_xfr, 1);
 
-		e->e_data = mpool_new(sizeof(struct _emv_data), 0);
-		if ( NULL == e->e_data )
-			goto err;
-
-		e->e_files = gang_new(0, 0);
+		/* nodes and pointer arrays are carved from it */
+		e->e_files = gang_new(0, sizeof(void *));
 		if ( NULL == e->e_files )
-			goto err_free_data;
+			goto err;
 	}
 
 	return e;
 
-//err_free_files:
-//	gang_free(e->e_files);
-err_free_data:
-	mpool_free(e->e_data);
 err:
 	do_emv_fini(e);
 	return NULL;
 }
 
+emv_t emv_init(cci_t cc)
+{
+	if ( cci_slot_status(cc) != CHIPCARD_ACTIVE )
+		return NULL;
+	return _emv_new(cc);
+}
+
+/* Get ready for a new card in the same slot. Everything allocated for the
+ * last card is kept for re-use so that, once warmed up, processing a card
+ * doesn't need to call malloc.
+ */
+int emv_reset(emv_t e)
+{
+	if ( e->e_map ) {
+		_emv_error(e, EMV_ERR_FUNC_NOT_SUPPORTED);
+		return 0;
+	}
+
+	_emv_auth_drain(e);
+	_emv_auth_reset(e);
+	_emv_recycle_applist(e);
+	_emv_db_reset(e);
+
+	memset(e->e_aip, 0, sizeof(e->e_aip));
+	e->e_afl_len = 0;
+	e->e_sel_key = 0;
+
+	if ( cci_slot_status(e->e_dev) != CHIPCARD_ACTIVE ) {
+		_emv_ccid_error(e);
+		return 0;
+	}
+
+	_emv_success(e);
+	return 1;
+}
+
 void emv_fini(emv_t e)
 {
 	do_emv_fini(e);
 }
+
+static void add_gang(struct emv_alloc_stats *st, gang_t g)
+{
+	struct gang_stats gs;
+
+	gang_stats(g, &gs);
+	st->a_slabs += gs.s_slabs;
+	st->a_committed += gs.s_committed;
+	st->a_live += gs.s_live;
+	st->a_requested += gs.s_requested;
+	st->a_peak += gs.s_peak;
+}
+
+/* Counters for the allocators used by @e, all zero if they were built
+ * without statistics. Application nodes come from a pool shared by every
+ * emv_t in the process, so m_data covers them all.
+ */
+void emv_mem_stats(emv_t e, struct emv_mem_stats *st)
+{
+	struct mpool_stats ms;
+	struct _emv_auth *a;
+	mpool_t pool;
+
+	memset(st, 0, sizeof(*st));
+
+	pool = _emv_app_pool();
+	if ( pool ) {
+		mpool_stats(pool, &ms);
+		st->m_data.a_slabs = ms.s_slabs;
+		st->m_data.a_committed = ms.s_committed;
+		st->m_data.a_live = ms.s_live;
+		st->m_data.a_requested = ms.s_live * ms.s_obj_size;
+		st->m_data.a_peak = ms.s_peak * ms.s_obj_size;
+	}
+
+	add_gang(&st->m_files, e->e_files);
+
+	list_for_each_entry(a, &e->e_auth_spare, a_list)
+		add_gang(&st->m_auth, a->a_mem);
+}
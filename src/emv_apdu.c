@@ -8,39 +8,18 @@
 #include <list.h>
 #include <emv.h>
 #include <ber.h>
+#include <apdu.h>
+#include <errno.h>
 #include "emv-internal.h"
 
-static int do_sel(emv_t e, uint8_t p1, uint8_t p2,
-			const uint8_t *name, size_t nlen)
+/* Procedure bytes are resolved by cci_transact(), see xfr_auto_response() */
+static int do_xfr(emv_t e)
 {
-	uint8_t sw2;
-
-	assert(nlen < 0x100);
-	xfr_reset(e->e_xfr);
-	xfr_tx_byte(e->e_xfr, 0x00);		/* CLA */
-	xfr_tx_byte(e->e_xfr, 0xa4);		/* INS: SELECT */
-	xfr_tx_byte(e->e_xfr, p1);		/* P1: Select by name */
-	xfr_tx_byte(e->e_xfr, p2);		/* P2: First/only occurance */
-	xfr_tx_byte(e->e_xfr, nlen);		/* Lc: name length */
-	xfr_tx_buf(e->e_xfr, name, nlen);	/* DATA: name */
-
-	if ( !cci_transact(e->e_dev, e->e_xfr) ) {
-		_emv_ccid_error(e);
-		return 0;
-	}
-
-	if ( xfr_rx_sw1(e->e_xfr) != 0x61 ) {
-		_emv_icc_error(e);
+	/* loaded from a snapshot */
+	if ( NULL == e->e_dev ) {
+		_emv_error(e, EMV_ERR_FUNC_NOT_SUPPORTED);
 		return 0;
 	}
-	sw2 = xfr_rx_sw2(e->e_xfr);
-
-	xfr_reset(e->e_xfr);
-	xfr_tx_byte(e->e_xfr, 0x00);		/* CLA */
-	xfr_tx_byte(e->e_xfr, 0xc0);		/* INS: GET RESPONSE */
-	xfr_tx_byte(e->e_xfr, 0);		/* P1 */
-	xfr_tx_byte(e->e_xfr, 0);		/* P2 */
-	xfr_tx_byte(e->e_xfr, sw2);		/* Le */
 
 	if ( !cci_transact(e->e_dev, e->e_xfr) ) {
 		_emv_ccid_error(e);
@@ -55,253 +34,100 @@ static int do_sel(emv_t e, uint8_t p1, uint8_t p2,
 	return 1;
 }
 
-int _emv_select(emv_t e, const uint8_t *name, size_t nlen)
+/* Commands which don't fit in the transmit buffer are a system error */
+static int do_apdu(emv_t e, struct apdu *a)
 {
-	return do_sel(e, 0x04, 0, name, nlen);
+	if ( !apdu_finish(a) ) {
+		errno = ENOSPC;
+		_emv_sys_error(e);
+		return 0;
+	}
+	return do_xfr(e);
 }
 
-int _emv_select_next(emv_t e, const uint8_t *name, size_t nlen)
+static int do_sel(emv_t e, uint8_t p1, uint8_t p2,
+			const uint8_t *name, size_t nlen)
 {
-	return do_sel(e, 0x04, 0x2, name, nlen);
+	struct apdu a;
+
+	assert(nlen < 0x100);
+	apdu_init(&a, e->e_xfr, 0x00, 0xa4, p1, p2);	/* SELECT */
+	apdu_data(&a, name, nlen);
+	return do_apdu(e, &a);
 }
 
-int _emv_read_record(emv_t e, uint8_t sfi, uint8_t record)
+/* 4 byte header and Le, Le corrected by 6Cxx */
+static int do_case2(emv_t e, uint8_t cla, uint8_t ins, uint8_t p1, uint8_t p2)
 {
-	uint8_t sw2, p2;
-
-	p2 = (sfi << 3) | (1 << 2);
-
-	xfr_reset(e->e_xfr);
-	xfr_tx_byte(e->e_xfr, 0x00);		/* CLA */
-	xfr_tx_byte(e->e_xfr, 0xb2);		/* INS: READ RECORD */
-	xfr_tx_byte(e->e_xfr, record);		/* P1: record index */
-	xfr_tx_byte(e->e_xfr, p2);		/* P2 */
-	xfr_tx_byte(e->e_xfr, 0);		/* Le: 0 this time around */
+	struct apdu a;
 
-	if ( !cci_transact(e->e_dev, e->e_xfr) ) {
-		_emv_ccid_error(e);
-		return 0;
-	}
+	apdu_init(&a, e->e_xfr, cla, ins, p1, p2);
+	apdu_le(&a, 0x100);
+	return do_apdu(e, &a);
+}
 
-	if ( xfr_rx_sw1(e->e_xfr) != 0x6c ) {
-		_emv_icc_error(e);
-		return 0;
-	}
-	sw2 = xfr_rx_sw2(e->e_xfr);
+/* 4 byte header, data and optionally Le */
+static int do_case3(emv_t e, uint8_t cla, uint8_t ins, uint8_t p1, uint8_t p2,
+			const uint8_t *data, size_t len, int le)
+{
+	struct apdu a;
 
-	xfr_reset(e->e_xfr);
-	xfr_tx_byte(e->e_xfr, 0x00);		/* CLA */
-	xfr_tx_byte(e->e_xfr, 0xb2);		/* INS: READ RECORD */
-	xfr_tx_byte(e->e_xfr, record);		/* P1: record index */
-	xfr_tx_byte(e->e_xfr, p2); 		/* P2 */
-	xfr_tx_byte(e->e_xfr, sw2);		/* Le: got it now */
+	apdu_init(&a, e->e_xfr, cla, ins, p1, p2);
+	apdu_data(&a, data, len);
+	if ( le )
+		apdu_le(&a, 0x100);
+	return do_apdu(e, &a);
+}
 
-	if ( !cci_transact(e->e_dev, e->e_xfr) ) {
-		_emv_ccid_error(e);
-		return 0;
-	}
+int _emv_select(emv_t e, const uint8_t *name, size_t nlen)
+{
+	return do_sel(e, 0x04, 0, name, nlen);
+}
 
-	if ( xfr_rx_sw1(e->e_xfr) != 0x90 ) {
-		_emv_icc_error(e);
-		return 0;
-	}
+int _emv_select_next(emv_t e, const uint8_t *name, size_t nlen)
+{
+	return do_sel(e, 0x04, 0x2, name, nlen);
+}
 
-	return 1;
+int _emv_read_record(emv_t e, uint8_t sfi, uint8_t record)
+{
+	/* READ RECORD, P1: record index, P2: SFI */
+	return do_case2(e, 0x00, 0xb2, record, (sfi << 3) | (1 << 2));
 }
+
 int _emv_get_data(emv_t e, uint8_t p1, uint8_t p2)
 {
-	uint8_t sw2;
-
-	xfr_reset(e->e_xfr);
-	xfr_tx_byte(e->e_xfr, 0x80);		/* CLA */
-	xfr_tx_byte(e->e_xfr, 0xca);		/* INS: GET DATA*/
-	xfr_tx_byte(e->e_xfr, p1);		/* P1 */
-	xfr_tx_byte(e->e_xfr, p2);		/* P2 */
-	xfr_tx_byte(e->e_xfr, 0);		/* Le: 0 this time around */
-
-	if ( !cci_transact(e->e_dev, e->e_xfr) ) {
-		_emv_ccid_error(e);
-		return 0;
-	}
-
-	if ( xfr_rx_sw1(e->e_xfr) != 0x6c ) {
-		_emv_icc_error(e);
-		return 0;
-	}
-	sw2 = xfr_rx_sw2(e->e_xfr);
-
-	xfr_reset(e->e_xfr);
-	xfr_tx_byte(e->e_xfr, 0x80);		/* CLA */
-	xfr_tx_byte(e->e_xfr, 0xca);		/* INS: GET DATA */
-	xfr_tx_byte(e->e_xfr, p1);		/* P1 */
-	xfr_tx_byte(e->e_xfr, p2); 		/* P2 */
-	xfr_tx_byte(e->e_xfr, sw2);		/* Le: got it now */
-
-	if ( !cci_transact(e->e_dev, e->e_xfr) ) {
-		_emv_ccid_error(e);
-		return 0;
-	}
-
-	if ( xfr_rx_sw1(e->e_xfr) != 0x90 ) {
-		_emv_icc_error(e);
-		return 0;
-	}
-
-	return 1;
+	return do_case2(e, 0x80, 0xca, p1, p2);		/* GET DATA */
 }
 
 int _emv_verify(emv_t e, uint8_t fmt, const uint8_t *pin, uint8_t plen)
 {
-	xfr_reset(e->e_xfr);
-	xfr_tx_byte(e->e_xfr, 0x00);		/* CLA */
-	xfr_tx_byte(e->e_xfr, 0x20);		/* INS: VERIFY */
-	xfr_tx_byte(e->e_xfr, 0);		/* P1: record index */
-	xfr_tx_byte(e->e_xfr, fmt);		/* P2 */
-	xfr_tx_byte(e->e_xfr, plen);		/* P2 */
-	xfr_tx_buf(e->e_xfr, pin, plen);
-
-	if ( !cci_transact(e->e_dev, e->e_xfr) ) {
-		_emv_ccid_error(e);
-		return 0;
-	}
-
-	if ( xfr_rx_sw1(e->e_xfr) != 0x90 ) {
-		_emv_icc_error(e);
-		return 0;
-	}
-
-	return 1;
+	return do_case3(e, 0x00, 0x20, 0, fmt, pin, plen, 0);	/* VERIFY */
 }
 
+/* dol is the PDOL related data, it's sent wrapped in the command template */
 int _emv_get_proc_opts(emv_t e, const uint8_t *dol, uint8_t len)
 {
-	uint8_t sw2;
-
-	xfr_reset(e->e_xfr);
-	xfr_tx_byte(e->e_xfr, 0x80);		/* CLA */
-	xfr_tx_byte(e->e_xfr, 0xa8);		/* INS: GET DATA*/
-	xfr_tx_byte(e->e_xfr, 0);		/* P1 */
-	xfr_tx_byte(e->e_xfr, 0);		/* P2 */
-	xfr_tx_byte(e->e_xfr, len);		/* Lc */
-	xfr_tx_buf(e->e_xfr, dol, len);		/* Data: PDOL */
-	xfr_tx_byte(e->e_xfr, 0);		/* Le */
-
-	if ( !cci_transact(e->e_dev, e->e_xfr) ) {
-		_emv_ccid_error(e);
-		return 0;
-	}
-
-	if ( xfr_rx_sw1(e->e_xfr) != 0x61 ) {
-		_emv_icc_error(e);
-		return 0;
-	}
-	sw2 = xfr_rx_sw2(e->e_xfr);
-
-	xfr_reset(e->e_xfr);
-	xfr_tx_byte(e->e_xfr, 0x00);		/* CLA */
-	xfr_tx_byte(e->e_xfr, 0xc0);		/* INS: GET RESPONSE */
-	xfr_tx_byte(e->e_xfr, 0);		/* P1 */
-	xfr_tx_byte(e->e_xfr, 0);		/* P2 */
-	xfr_tx_byte(e->e_xfr, sw2);		/* Le */
-
-	if ( !cci_transact(e->e_dev, e->e_xfr) ) {
-		_emv_ccid_error(e);
-		return 0;
-	}
-
-	if ( xfr_rx_sw1(e->e_xfr) != 0x90 ) {
-		_emv_icc_error(e);
-		return 0;
-	}
-
-	return 1;
+	struct apdu a;
+
+	/* GET PROCESSING OPTIONS */
+	apdu_init(&a, e->e_xfr, 0x80, 0xa8, 0, 0);
+	apdu_data_begin(&a);
+	apdu_tlv(&a, 0x83, dol, len);
+	apdu_data_end(&a);
+	apdu_le(&a, 0x100);
+	return do_apdu(e, &a);
 }
 
 int _emv_generate_ac(emv_t e, uint8_t ref,
 			const uint8_t *data, uint8_t len)
 {
-	uint8_t sw2;
-
-	xfr_reset(e->e_xfr);
-	xfr_tx_byte(e->e_xfr, 0x80);		/* CLA */
-	xfr_tx_byte(e->e_xfr, 0xae);		/* INS: GENERATE AC */
-	xfr_tx_byte(e->e_xfr, ref);		/* P1 */
-	xfr_tx_byte(e->e_xfr, 0);		/* P2 */
-	xfr_tx_byte(e->e_xfr, len);		/* Lc */
-	xfr_tx_buf(e->e_xfr, data, len);	/* Data: */
-	xfr_tx_byte(e->e_xfr, 0);		/* Le */
-
-	if ( !cci_transact(e->e_dev, e->e_xfr) ) {
-		_emv_ccid_error(e);
-		return 0;
-	}
-
-	if ( xfr_rx_sw1(e->e_xfr) != 0x61 ) {
-		_emv_icc_error(e);
-		return 0;
-	}
-	sw2 = xfr_rx_sw2(e->e_xfr);
-
-	xfr_reset(e->e_xfr);
-	xfr_tx_byte(e->e_xfr, 0x00);		/* CLA */
-	xfr_tx_byte(e->e_xfr, 0xc0);		/* INS: GET RESPONSE */
-	xfr_tx_byte(e->e_xfr, 0);		/* P1 */
-	xfr_tx_byte(e->e_xfr, 0);		/* P2 */
-	xfr_tx_byte(e->e_xfr, sw2);		/* Le */
-
-	if ( !cci_transact(e->e_dev, e->e_xfr) ) {
-		_emv_ccid_error(e);
-		return 0;
-	}
-
-	if ( xfr_rx_sw1(e->e_xfr) != 0x90 ) {
-		_emv_icc_error(e);
-		return 0;
-	}
-
-	return 1;
+	/* GENERATE AC */
+	return do_case3(e, 0x80, 0xae, ref, 0, data, len, 1);
 }
 
 _private int _emv_int_authenticate(emv_t e, const uint8_t *data, uint8_t len)
 {
-	uint8_t sw2;
-
-	xfr_reset(e->e_xfr);
-	xfr_tx_byte(e->e_xfr, 0x00);		/* CLA */
-	xfr_tx_byte(e->e_xfr, 0x88);		/* INS: INT_AUTHENTICATE */
-	xfr_tx_byte(e->e_xfr, 0);		/* P1 */
-	xfr_tx_byte(e->e_xfr, 0);		/* P2 */
-	xfr_tx_byte(e->e_xfr, len);		/* Lc */
-	xfr_tx_buf(e->e_xfr, data, len);	/* Data: */
-	xfr_tx_byte(e->e_xfr, 0);		/* Le */
-
-	if ( !cci_transact(e->e_dev, e->e_xfr) ) {
-		_emv_ccid_error(e);
-		return 0;
-	}
-
-	if ( xfr_rx_sw1(e->e_xfr) != 0x61 ) {
-		_emv_icc_error(e);
-		return 0;
-	}
-	sw2 = xfr_rx_sw2(e->e_xfr);
-
-	xfr_reset(e->e_xfr);
-	xfr_tx_byte(e->e_xfr, 0x00);		/* CLA */
-	xfr_tx_byte(e->e_xfr, 0xc0);		/* INS: GET RESPONSE */
-	xfr_tx_byte(e->e_xfr, 0);		/* P1 */
-	xfr_tx_byte(e->e_xfr, 0);		/* P2 */
-	xfr_tx_byte(e->e_xfr, sw2);		/* Le */
-
-	if ( !cci_transact(e->e_dev, e->e_xfr) ) {
-		_emv_ccid_error(e);
-		return 0;
-	}
-
-	if ( xfr_rx_sw1(e->e_xfr) != 0x90 ) {
-		_emv_icc_error(e);
-		return 0;
-	}
-
-	return 1;
+	/* INTERNAL AUTHENTICATE */
+	return do_case3(e, 0x00, 0x88, 0, 0, data, len, 1);
 }
@@ -8,6 +8,7 @@
 #include <list.h>
 #include <emv.h>
 #include <ber.h>
+#include <pthread.h>
 #include "emv-internal.h"
 
 static int bop_adfname(const uint8_t *ptr, size_t len, void *priv)
@@ -53,13 +54,13 @@ static int bop_dtemp(const uint8_t *ptr, size_t len, void *priv)
 	struct _emv *e = priv;
 	struct _emv_app *app;
 	static const struct ber_tag tags[] = {
-		{ .tag = "\x4f", .tag_len = 1, .op = bop_adfname },
-		{ .tag = "\x50", .tag_len = 1, .op = bop_label },
-		{ .tag = "\x87", .tag_len = 1, .op = bop_prio },
-		{ .tag = "\x9f\x12", .tag_len = 2, .op = bop_pname },
+		{ .tag = 0x4f, .op = bop_adfname },
+		{ .tag = 0x50, .op = bop_label },
+		{ .tag = 0x87, .op = bop_prio },
+		{ .tag = 0x9f12, .op = bop_pname },
 	};
 
-	app = calloc(1, sizeof(*app));
+	app = _emv_app_alloc(e);
 	if ( NULL == app )
 		return 0;
 
@@ -69,7 +70,7 @@ static int bop_dtemp(const uint8_t *ptr, size_t len, void *priv)
 		return 1;
 	}else{
 		_emv_error(e, EMV_ERR_DATA_ELEMENT_NOT_FOUND);
-		free(app);
+		_emv_app_put(e, app);
 		return 0;
 	}
 }
@@ -77,7 +78,7 @@ static int bop_dtemp(const uint8_t *ptr, size_t len, void *priv)
 static int bop_psd(const uint8_t *ptr, size_t len, void *priv)
 {
 	static const struct ber_tag tags[] = {
-		{ .tag = "\x61", .tag_len = 1, .op = bop_dtemp },
+		{ .tag = 0x61, .op = bop_dtemp },
 	};
 	return ber_decode(tags, sizeof(tags)/sizeof(*tags), ptr, len, priv);
 }
@@ -87,7 +88,7 @@ static int add_app(emv_t e)
 	const uint8_t *res;
 	size_t len;
 	static const struct ber_tag tags[] = {
-		{ .tag = "\x70", .tag_len = 1, .op = bop_psd },
+		{ .tag = 0x70, .op = bop_psd },
 	};
 
 	res = xfr_rx_data(e->e_xfr, &len);
@@ -101,13 +102,55 @@ static int add_app(emv_t e)
 		return 1;
 }
 
-void _emv_free_applist(emv_t e)
+static pthread_once_t app_once = PTHREAD_ONCE_INIT;
+static mpool_t app_pool;
+
+static void app_pool_init(void)
+{
+	app_pool = mpool_new_shared(sizeof(struct _emv_app), 0);
+}
+
+/* Application nodes for every emv_t in the process come from the one pool,
+ * so that a long lived emv_t doesn't need to malloc them for each new card
+ * and nodes let go by one reader's thread are re-used by the others.
+ */
+mpool_t _emv_app_pool(void)
+{
+	pthread_once(&app_once, app_pool_init);
+	return app_pool;
+}
+
+struct _emv_app *_emv_app_alloc(emv_t e)
+{
+	mpool_t pool = _emv_app_pool();
+
+	if ( NULL == pool )
+		return NULL;
+	return mpool_alloc0(pool);
+}
+
+void _emv_app_put(emv_t e, struct _emv_app *a)
+{
+	if ( a )
+		mpool_return(app_pool, a);
+}
+
+/* Return the PSE list and the current application to the spares */
+void _emv_recycle_applist(emv_t e)
 {
 	struct _emv_app *a, *t;
 	list_for_each_entry_safe(a, t, &e->e_apps, a_list) {
 		list_del(&a->a_list);
-		free(a);
+		_emv_app_put(e, a);
 	}
+	_emv_app_put(e, e->e_app);
+	e->e_app = NULL;
+	e->e_num_apps = 0;
+}
+
+void _emv_free_applist(emv_t e)
+{
+	_emv_recycle_applist(e);
 }
 
 void emv_app_rid(emv_app_t a, emv_rid_t ret)
@@ -149,12 +192,22 @@ int emv_appsel_pse(emv_t e)
 	struct _emv_app *a, *tmp;
 	unsigned int i;
 
+	const uint8_t *fci;
+	size_t len;
+
 	if ( !_emv_select(e, (uint8_t *)pse, strlen(pse)) )
 		return 0;
 
 	list_for_each_entry_safe(a, tmp, &e->e_apps, a_list) {
 		list_del(&a->a_list);
-		free(a);
+		_emv_app_put(e, a);
+	}
+	e->e_num_apps = 0;
+
+	fci = xfr_rx_data(e->e_xfr, &len);
+	if ( fci && _emv_sel_key(e, fci, len) && _emv_sel_lookup(e) ) {
+		_emv_success(e);
+		return 1;
 	}
 
 	for (i = 1; ; i++) {
@@ -163,6 +216,10 @@ int emv_appsel_pse(emv_t e)
 		add_app(e);
 	}
 
+	/* only a complete directory, ending in record not found, is cached */
+	if ( _emv_sw1(e) == 0x6a && _emv_sw2(e) == 0x83 )
+		_emv_sel_store(e);
+
 	/* TODO: Sort by priority */
 
 	_emv_success(e);
@@ -186,19 +243,19 @@ emv_app_t emv_appsel_pse_next(emv_t e, emv_app_t app)
 _public void emv_app_delete(emv_app_t a)
 {
 	list_del(&a->a_list);
-	free(a);
+	mpool_return(app_pool, a);
 }
 
 static int bop_fci2(const uint8_t *ptr, size_t len, void *priv)
 {
 	static const struct ber_tag tags[] = {
-		{ .tag = "\x50", .tag_len = 1, .op = bop_label},
-		{ .tag = "\x87", .tag_len = 1, .op = bop_prio},
-		{ .tag = "\x5f\x2d", .tag_len = 2, .op = NULL},
-		{ .tag = "\x9f\x11", .tag_len = 2, .op = NULL},
-		{ .tag = "\x9f\x12", .tag_len = 2, .op = bop_pname},
-		{ .tag = "\x9f\x38", .tag_len = 2, .op = bop_pdol},
-		{ .tag = "\xbf\x0c", .tag_len = 2, .op = NULL},
+		{ .tag = 0x50, .op = bop_label},
+		{ .tag = 0x87, .op = bop_prio},
+		{ .tag = 0x5f2d, .op = NULL},
+		{ .tag = 0x9f11, .op = NULL},
+		{ .tag = 0x9f12, .op = bop_pname},
+		{ .tag = 0x9f38, .op = bop_pdol},
+		{ .tag = 0xbf0c, .op = NULL},
 		/* FIXME: retrieve optional PDOL if present */
 	};
 	return ber_decode(tags, sizeof(tags)/sizeof(*tags), ptr, len, priv);
@@ -207,8 +264,8 @@ static int bop_fci2(const uint8_t *ptr, size_t len, void *priv)
 static int bop_fci(const uint8_t *ptr, size_t len, void *priv)
 {
 	static const struct ber_tag tags[] = {
-		{ .tag = "\x84", .tag_len = 1, .op = bop_adfname},
-		{ .tag = "\xa5", .tag_len = 1, .op = bop_fci2},
+		{ .tag = 0x84, .op = bop_adfname},
+		{ .tag = 0xa5, .op = bop_fci2},
 	};
 	return ber_decode(tags, sizeof(tags)/sizeof(*tags), ptr, len, priv);
 }
@@ -216,7 +273,7 @@ static int bop_fci(const uint8_t *ptr, size_t len, void *priv)
 static int set_app(emv_t e)
 {
 	static const struct ber_tag tags[] = {
-		{ .tag = "\x6f", .tag_len = 1, .op = bop_fci},
+		{ .tag = 0x6f, .op = bop_fci},
 	};
 	struct _emv_app *cur;
 	const uint8_t *fci;
@@ -228,15 +285,19 @@ static int set_app(emv_t e)
 	if ( NULL == fci )
 		return 0;
 
-	cur = calloc(1, sizeof(*cur));
+	cur = _emv_app_alloc(e);
 	if ( NULL == cur )
 		return 0;
 
-	if ( !ber_decode(tags, BER_NUM_TAGS(tags), fci, len, cur) ) {
-		free(cur);
-		return 0;
+	if ( !_emv_sel_fci(e, fci, len, cur) ) {
+		if ( !ber_decode(tags, BER_NUM_TAGS(tags), fci, len, cur) ) {
+			_emv_app_put(e, cur);
+			return 0;
+		}
+		_emv_sel_fci_store(e, fci, len, cur);
 	}
 
+	_emv_app_put(e, e->e_app);
 	e->e_app = cur;
 	return 1;
 }
@@ -0,0 +1,346 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2008 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Offline data authentication jobs. Everything which needs the card is done
+ * up front on the caller's thread and copied in to the job, the RSA and hash
+ * checks then run either inline or on a process-wide pool of worker threads.
+ * Finished jobs are handed back to the thread which owns the emv_t.
+*/
+
+#include <ccid.h>
+#include <list.h>
+#include <emv.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "emv-internal.h"
+
+#define AUTH_MAX_THREADS	8
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static LIST_HEAD(pool_queue);
+static unsigned int pool_threads;
+
+/* A NULL verify function makes a job which just succeeds. Jobs are recycled
+ * along with their memory so that a long lived emv_t authenticates each new
+ * card without going to the heap, apart from inside OpenSSL.
+ */
+struct _emv_auth *_emv_auth_new(emv_t e, int (*verify)(struct _emv_auth *a))
+{
+	struct _emv_auth *a;
+	gang_t mem;
+
+	if ( !list_empty(&e->e_auth_spare) ) {
+		a = list_entry(e->e_auth_spare.next, struct _emv_auth, a_list);
+		list_del(&a->a_list);
+		mem = a->a_mem;
+		gang_reset(mem);
+		memset(a, 0, sizeof(*a));
+		a->a_mem = mem;
+		goto init;
+	}
+
+	a = calloc(1, sizeof(*a));
+	if ( NULL == a ) {
+		_emv_sys_error(e);
+		return NULL;
+	}
+
+	a->a_mem = gang_new(0, 0);
+	if ( NULL == a->a_mem ) {
+		_emv_sys_error(e);
+		free(a);
+		return NULL;
+	}
+
+init:
+	a->a_emv = e;
+	a->a_gen = e->e_auth_gen;
+	a->a_verify = verify;
+	if ( e->e_app )
+		emv_app_rid(e->e_app, a->a_rid);
+	memcpy(a->a_aip, e->e_aip, sizeof(a->a_aip));
+	return a;
+}
+
+/* Only ever called on the thread which owns the emv_t */
+void _emv_auth_free(struct _emv_auth *a)
+{
+	if ( a ) {
+		RSA_free(a->a_ca_pk);
+		RSA_free(a->a_iss_pk);
+		RSA_free(a->a_icc_pk);
+		a->a_ca_pk = NULL;
+		a->a_iss_pk = NULL;
+		a->a_icc_pk = NULL;
+		list_add(&a->a_list, &a->a_emv->e_auth_spare);
+	}
+}
+
+/* Really free the recycled jobs, for emv_fini() */
+void _emv_auth_flush(emv_t e)
+{
+	struct _emv_auth *a, *tmp;
+
+	list_for_each_entry_safe(a, tmp, &e->e_auth_spare, a_list) {
+		list_del(&a->a_list);
+		gang_free(a->a_mem);
+		free(a);
+	}
+}
+
+/* Copy card data in to the job, so that the worker never touches the emv_t */
+uint8_t *_emv_auth_dup(struct _emv_auth *a, const uint8_t *ptr, size_t len)
+{
+	uint8_t *ret;
+
+	ret = gang_alloc(a->a_mem, len ? len : 1);
+	if ( NULL == ret )
+		return NULL;
+	memcpy(ret, ptr, len);
+	return ret;
+}
+
+/* All records which are covered by SDA, already contiguous in the db */
+int _emv_auth_sda_records(struct _emv_auth *a)
+{
+	struct _emv *e = a->a_emv;
+
+	if ( !_emv_read_sda(e) )
+		return 0;
+
+	a->a_sda_len = e->e_db.db_sdalen;
+	a->a_sda = _emv_auth_dup(a, e->e_db.db_sdabuf, a->a_sda_len);
+	if ( NULL == a->a_sda ) {
+		_emv_sys_error(e);
+		return 0;
+	}
+
+	return 1;
+}
+
+void _emv_auth_error(struct _emv_auth *a, unsigned int code)
+{
+	a->a_err = (EMV_ERR_EMV << EMV_ERR_TYPE_SHIFT) |
+			(code & EMV_ERR_CODE_MASK);
+}
+
+void _emv_auth_sys_error(struct _emv_auth *a)
+{
+	a->a_err = (EMV_ERR_SYSTEM << EMV_ERR_TYPE_SHIFT) |
+			(errno & EMV_ERR_CODE_MASK);
+}
+
+/* The job's scratch buffer, if len bytes fit in it */
+uint8_t *_emv_auth_scratch(struct _emv_auth *a, size_t len)
+{
+	if ( len > sizeof(a->a_scratch) )
+		return NULL;
+	return a->a_scratch;
+}
+
+int _emv_auth_recover(struct _emv_auth *a, uint8_t *ptr, size_t len, RSA *key)
+{
+	uint8_t *tmp;
+	int ret;
+
+	tmp = _emv_auth_scratch(a, len);
+	if ( NULL == tmp )
+		return 0;
+
+	ret = RSA_public_encrypt(len, ptr, tmp, key, RSA_NO_PADDING);
+	if ( ret < 0 || (unsigned)ret != len )
+		return 0;
+
+	memcpy(ptr, tmp, len);
+	return 1;
+}
+
+/* Apply the outcome of a job to its emv_t and free it, returns the result.
+ * Results of jobs started before the last application selection are
+ * reported but otherwise ignored.
+ */
+static int auth_finish(struct _emv_auth *a)
+{
+	struct _emv *e = a->a_emv;
+	int ret = a->a_ok;
+
+	if ( a->a_gen != e->e_auth_gen ) {
+		_emv_auth_free(a);
+		return 0;
+	}
+
+	if ( a->a_ca_pk ) {
+		RSA_free(e->e_ca_pk);
+		e->e_ca_pk = a->a_ca_pk;
+		a->a_ca_pk = NULL;
+	}
+	if ( a->a_iss_pk ) {
+		RSA_free(e->e_iss_pk);
+		e->e_iss_pk = a->a_iss_pk;
+		a->a_iss_pk = NULL;
+	}
+	if ( a->a_icc_pk ) {
+		RSA_free(e->e_icc_pk);
+		e->e_icc_pk = a->a_icc_pk;
+		a->a_icc_pk = NULL;
+	}
+
+	e->e_sda_ok |= a->a_sda_ok;
+	e->e_dda_ok |= a->a_dda_ok;
+
+	if ( !ret && a->a_err )
+		e->e_err = a->a_err;
+
+	_emv_auth_free(a);
+	return ret;
+}
+
+static void auth_verify(struct _emv_auth *a)
+{
+	a->a_ok = (a->a_verify) ? (*a->a_verify)(a) : 1;
+}
+
+/* Synchronous case, verify on the calling thread */
+int _emv_auth_run(struct _emv_auth *a)
+{
+	auth_verify(a);
+	return auth_finish(a);
+}
+
+static void *auth_worker(void *priv)
+{
+	struct _emv_auth *a;
+	struct _emv *e;
+
+	pthread_mutex_lock(&pool_lock);
+	for(;;) {
+		while ( list_empty(&pool_queue) )
+			pthread_cond_wait(&pool_work, &pool_lock);
+
+		a = list_entry(pool_queue.next, struct _emv_auth, a_list);
+		list_del(&a->a_list);
+		pthread_mutex_unlock(&pool_lock);
+
+		auth_verify(a);
+
+		pthread_mutex_lock(&pool_lock);
+		e = a->a_emv;
+		list_add_tail(&a->a_list, &e->e_auth_done);
+		e->e_auth_pending--;
+		pthread_cond_broadcast(&pool_done);
+	}
+
+	return NULL;
+}
+
+static void pool_start(void)
+{
+	pthread_attr_t attr;
+	pthread_t t;
+	long ncpu;
+	unsigned int i;
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if ( ncpu < 1 )
+		ncpu = 1;
+	if ( ncpu > AUTH_MAX_THREADS )
+		ncpu = AUTH_MAX_THREADS;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for(i = 0; i < (unsigned int)ncpu; i++) {
+		if ( pthread_create(&t, &attr, auth_worker, NULL) ) {
+			fprintf(stderr, "*** error: pthread_create: %s\n",
+				strerror(errno));
+			break;
+		}
+		pool_threads++;
+	}
+	pthread_attr_destroy(&attr);
+}
+
+/* Queue a job on the pool, or run it inline if there are no workers */
+int _emv_auth_submit(struct _emv_auth *a, emv_auth_cb_t cb, void *priv)
+{
+	struct _emv *e = a->a_emv;
+
+	a->a_cb = cb;
+	a->a_priv = priv;
+
+	pthread_once(&pool_once, pool_start);
+
+	pthread_mutex_lock(&pool_lock);
+	if ( !pool_threads ) {
+		pthread_mutex_unlock(&pool_lock);
+		auth_verify(a);
+		pthread_mutex_lock(&pool_lock);
+		list_add_tail(&a->a_list, &e->e_auth_done);
+		pthread_mutex_unlock(&pool_lock);
+		return 1;
+	}
+
+	e->e_auth_pending++;
+	list_add_tail(&a->a_list, &pool_queue);
+	pthread_cond_signal(&pool_work);
+	pthread_mutex_unlock(&pool_lock);
+	return 1;
+}
+
+static void take_done(struct _emv *e, int wait, struct list_head *done)
+{
+	pthread_mutex_lock(&pool_lock);
+	while ( wait && e->e_auth_pending )
+		pthread_cond_wait(&pool_done, &pool_lock);
+	list_splice(&e->e_auth_done, done);
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/* Deliver the results of asynchronous authentications.
+ * Runs the callback of every job on @e which has finished, on the calling
+ * thread, after applying its result so that emv_sda_ok() and emv_dda_ok()
+ * are up to date. If @wait is set then first blocks until all outstanding
+ * jobs on @e are done. Returns the number of callbacks run.
+ */
+unsigned int emv_auth_complete(emv_t e, int wait)
+{
+	struct _emv_auth *a, *tmp;
+	LIST_HEAD(done);
+	emv_auth_cb_t cb;
+	unsigned int n = 0;
+	void *priv;
+	int ret;
+
+	take_done(e, wait, &done);
+
+	list_for_each_entry_safe(a, tmp, &done, a_list) {
+		list_del(&a->a_list);
+		cb = a->a_cb;
+		priv = a->a_priv;
+		ret = auth_finish(a);
+		if ( cb )
+			(*cb)(e, ret, priv);
+		n++;
+	}
+
+	return n;
+}
+
+/* For emv_fini(), outstanding jobs are waited for and then discarded */
+void _emv_auth_drain(emv_t e)
+{
+	struct _emv_auth *a, *tmp;
+	LIST_HEAD(done);
+
+	take_done(e, 1, &done);
+
+	list_for_each_entry_safe(a, tmp, &done, a_list) {
+		list_del(&a->a_list);
+		_emv_auth_free(a);
+	}
+}
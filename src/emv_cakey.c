@@ -0,0 +1,184 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2008 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Process-wide store of certification authority public keys. Keys are rebuilt
+ * only when the modulus or exponent handed out by the callbacks changes, and
+ * the Montgomery context for the modulus is set up before the key is shared.
+*/
+
+#include <ccid.h>
+#include <list.h>
+#include <emv.h>
+#include <pthread.h>
+#include "emv-internal.h"
+
+#include <openssl/bn.h>
+
+struct ca_key {
+	struct list_head	k_list;
+	emv_rid_t		k_rid;
+	unsigned int		k_idx;
+	uint8_t			*k_mod;
+	size_t			k_mod_len;
+	uint8_t			*k_exp;
+	size_t			k_exp_len;
+	RSA			*k_rsa;
+};
+
+static pthread_mutex_t ca_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(ca_keys);
+
+static void ca_key_free(struct ca_key *k)
+{
+	list_del(&k->k_list);
+	RSA_free(k->k_rsa);
+	free(k->k_mod);
+	free(k);
+}
+
+static RSA *make_key(const uint8_t *mod, size_t mod_len,
+			const uint8_t *exp, size_t exp_len)
+{
+	BN_CTX *ctx;
+	RSA *key;
+
+	key = RSA_new();
+	if ( NULL == key )
+		return NULL;
+
+	key->n = BN_bin2bn(mod, mod_len, NULL);
+	if ( NULL == key->n )
+		goto err_free_key;
+
+	key->e = BN_bin2bn(exp, exp_len, NULL);
+	if ( NULL == key->e )
+		goto err_free_key;
+
+	/* so that nobody pays for it on their first RSA_public_encrypt() */
+	ctx = BN_CTX_new();
+	if ( NULL == ctx )
+		goto err_free_key;
+
+	if ( !BN_MONT_CTX_set_locked(&key->_method_mod_n, CRYPTO_LOCK_RSA,
+					key->n, ctx) ) {
+		BN_CTX_free(ctx);
+		goto err_free_key;
+	}
+
+	BN_CTX_free(ctx);
+	return key;
+
+err_free_key:
+	RSA_free(key); /* frees n and e too */
+	return NULL;
+}
+
+static struct ca_key *ca_key_new(const emv_rid_t rid, unsigned int idx,
+				const uint8_t *mod, size_t mod_len,
+				const uint8_t *exp, size_t exp_len)
+{
+	struct ca_key *k;
+
+	k = calloc(1, sizeof(*k));
+	if ( NULL == k )
+		return NULL;
+
+	k->k_mod = malloc(mod_len + exp_len);
+	if ( NULL == k->k_mod )
+		goto err_free;
+
+	k->k_rsa = make_key(mod, mod_len, exp, exp_len);
+	if ( NULL == k->k_rsa )
+		goto err_free_mod;
+
+	memcpy(k->k_rid, rid, EMV_RID_LEN);
+	k->k_idx = idx;
+	memcpy(k->k_mod, mod, mod_len);
+	k->k_mod_len = mod_len;
+	k->k_exp = k->k_mod + mod_len;
+	memcpy(k->k_exp, exp, exp_len);
+	k->k_exp_len = exp_len;
+	list_add(&k->k_list, &ca_keys);
+	return k;
+
+err_free_mod:
+	free(k->k_mod);
+err_free:
+	free(k);
+	return NULL;
+}
+
+static int ca_key_match(const struct ca_key *k,
+			const uint8_t *mod, size_t mod_len,
+			const uint8_t *exp, size_t exp_len)
+{
+	if ( k->k_mod_len != mod_len || k->k_exp_len != exp_len )
+		return 0;
+	if ( memcmp(k->k_mod, mod, mod_len) )
+		return 0;
+	if ( memcmp(k->k_exp, exp, exp_len) )
+		return 0;
+	return 1;
+}
+
+/* Returns a new reference to the CA key for the current application's RID,
+ * the caller must RSA_free() it.
+ */
+RSA *_emv_ca_key(emv_t e, unsigned int idx, emv_mod_cb_t mod,
+			emv_exp_cb_t exp, size_t *key_len, void *priv)
+{
+	const uint8_t *modulus, *exponent;
+	size_t mod_len, exp_len;
+	emv_rid_t rid;
+	struct ca_key *k;
+	RSA *key = NULL;
+
+	modulus = (*mod)(priv, idx, &mod_len);
+	if ( NULL == modulus )
+		return NULL;
+
+	exponent = (*exp)(priv, idx, &exp_len);
+	if ( NULL == exponent )
+		return NULL;
+
+	memset(rid, 0, sizeof(rid));
+	if ( e->e_app )
+		memcpy(rid, e->e_app->a_id, EMV_RID_LEN);
+
+	pthread_mutex_lock(&ca_lock);
+
+	list_for_each_entry(k, &ca_keys, k_list) {
+		if ( k->k_idx != idx || memcmp(k->k_rid, rid, EMV_RID_LEN) )
+			continue;
+		if ( ca_key_match(k, modulus, mod_len, exponent, exp_len) )
+			goto found;
+		/* key set changed underneath us */
+		ca_key_free(k);
+		break;
+	}
+
+	k = ca_key_new(rid, idx, modulus, mod_len, exponent, exp_len);
+	if ( NULL == k )
+		goto out;
+found:
+	/* most recently used at the front */
+	list_move(&k->k_list, &ca_keys);
+	RSA_up_ref(k->k_rsa);
+	key = k->k_rsa;
+	*key_len = k->k_mod_len;
+out:
+	pthread_mutex_unlock(&ca_lock);
+	return key;
+}
+
+void emv_ca_flush(void)
+{
+	struct ca_key *k, *tmp;
+
+	pthread_mutex_lock(&ca_lock);
+	list_for_each_entry_safe(k, tmp, &ca_keys, k_list)
+		ca_key_free(k);
+	pthread_mutex_unlock(&ca_lock);
+}
@@ -20,7 +20,7 @@ static int bop_ptc(const uint8_t *ptr, size_t len, void *priv)
 static int ptc(struct _emv *e)
 {
 	static const struct ber_tag tags[] = {
-		{ .tag = "\x9f\x17", .tag_len = 2, .op = bop_ptc},
+		{ .tag = 0x9f17, .op = bop_ptc},
 	};
 	const uint8_t *ptr;
 	size_t len;
@@ -83,7 +83,7 @@ int emv_cvm(emv_t e)
 		return -1;
 	}
 
-	ptr = d->d_data;
+	ptr = _emv_data_ptr(d);
 	len = d->d_len;
 
 	printf("Cardholder verification methods:\n");
@@ -9,8 +9,14 @@
 #include <emv.h>
 #include <ber.h>
 #include <ctype.h>
+#include <pthread.h>
 #include "emv-internal.h"
 
+/* Arena space for a record's copy, child nodes and index entries */
+#define REC_SIZE_HINT	0x200
+/* The most asked of the arena up front, a bigger AFL just takes more slabs */
+#define DB_SIZE_HINT_MAX	0x10000
+
 static const struct _emv_tag unknown_soldier = {
 	.t_tag = 0x00,
 	.t_type = EMV_DATA_ATOMIC | EMV_DATA_BINARY,
@@ -125,27 +131,55 @@ static const struct _emv_tag tags[] = {
 };
 static const unsigned int num_tags = sizeof(tags)/sizeof(*tags);
 
-static const struct _emv_tag *find_tag(uint16_t id)
+/* Two level index in to tags[], built on first use so that the table can be
+ * kept in any order. Row 0 is indexed by single byte tags, two byte tags get
+ * a row for their first byte. Unused first bytes all map to the empty row.
+ * A duplicate tag, or more prefixes than rows, is a bug in tags[] which
+ * emv-tags.test catches at "make check", so it is fatal here.
+ */
+#define TAG_MAX_ROWS	4
+#define TAG_ROW_NONE	TAG_MAX_ROWS
+static pthread_once_t tag_once = PTHREAD_ONCE_INIT;
+static uint8_t tag_row[256];
+static const struct _emv_tag *tag_idx[TAG_MAX_ROWS + 1][256];
+
+static void build_tag_index(void)
 {
-	const struct _emv_tag *t = tags;
-	unsigned int n = num_tags;
+	unsigned int i, hi, lo, rows = 1;
 
-	while ( n ) {
-		unsigned int i;
-		int cmp;
+	memset(tag_row, TAG_ROW_NONE, sizeof(tag_row));
+	tag_row[0] = 0;
 
-		i = n / 2U;
-		cmp = id - t[i].t_tag;
-		if ( cmp < 0 ) {
-			n = i;
-		}else if ( cmp > 0 ) {
-			t = t + (i + 1U);
-			n = n - (i + 1U);
-		}else
-			return t + i;
+	for(i = 0; i < num_tags; i++) {
+		hi = tags[i].t_tag >> 8;
+		lo = tags[i].t_tag & 0xff;
+
+		if ( tag_row[hi] == TAG_ROW_NONE ) {
+			if ( rows >= TAG_ROW_NONE ) {
+				fprintf(stderr, "*** error: too many prefixes "
+					"for tag 0x%.4x\n", tags[i].t_tag);
+				abort();
+			}
+			tag_row[hi] = rows++;
+		}
+
+		if ( tag_idx[tag_row[hi]][lo] ) {
+			fprintf(stderr, "*** error: duplicate tag 0x%.4x\n",
+				tags[i].t_tag);
+			abort();
+		}
+
+		tag_idx[tag_row[hi]][lo] = tags + i;
 	}
+}
+
+static const struct _emv_tag *find_tag(uint16_t id)
+{
+	const struct _emv_tag *t;
 
-	return &unknown_soldier;
+	pthread_once(&tag_once, build_tag_index);
+	t = tag_idx[tag_row[id >> 8]][id & 0xff];
+	return (t) ? t : &unknown_soldier;
 }
 
 static const struct _emv_data *find_data(struct _emv_data **db,
@@ -172,37 +206,70 @@ static const struct _emv_data *find_data(struct _emv_data **db,
 	return NULL;
 }
 
+/* Known tags go straight to their slot, anything else is searched for */
+static const struct _emv_data *lookup(struct _emv_db *db, uint16_t id)
+{
+	const struct _emv_tag *t = find_tag(id);
+
+	if ( t == &unknown_soldier )
+		return find_data(db->db_elem, db->db_nmemb, id);
+	if ( NULL == db->db_slot )
+		return NULL;
+	return db->db_slot[t - tags];
+}
+
+static int read_upto(struct _emv *e, unsigned int n);
+
+/* Records which haven't been read yet are fetched, in AFL order, until the
+ * tag turns up or there's nothing left to read.
+ */
 const struct _emv_data *_emv_retrieve_data(emv_t e, uint16_t id)
 {
-	return find_data(e->e_db.db_elem, e->e_db.db_nmemb, id);
+	struct _emv_db *db = &e->e_db;
+	const struct _emv_data *d;
+
+	for(;;) {
+		d = lookup(db, id);
+		if ( d || db->db_numread >= db->db_numrec )
+			return d;
+		if ( !read_upto(e, db->db_numread + 1) )
+			return NULL;
+	}
 }
 
 emv_data_t emv_retrieve_data(emv_t e, uint16_t id)
 {
-	return find_data(e->e_db.db_elem, e->e_db.db_nmemb, id);
+	return _emv_retrieve_data(e, id);
 }
 
 emv_data_t *emv_data_children(emv_data_t d, unsigned int *nmemb)
 {
 	*nmemb = d->d_nmemb;
-	return (emv_data_t *)d->d_elem;
+	return (d->d_nmemb) ? (emv_data_t *)_emv_data_elem(d) : NULL;
 }
 
 emv_data_t *emv_retrieve_records(emv_t e, unsigned int *nmemb)
 {
-	*nmemb = e->e_db.db_numrec;
+	read_upto(e, e->e_db.db_numrec);
+	*nmemb = e->e_db.db_numread;
 	return (emv_data_t *)e->e_db.db_rec;
 }
 
+/* Make sure every record covered by offline data authentication is read */
+int _emv_read_sda(emv_t e)
+{
+	return read_upto(e, e->e_db.db_lastsda);
+}
+
 const uint8_t *emv_data(emv_data_t d, size_t *len)
 {
 	*len = d->d_len;
-	return d->d_data;
+	return _emv_data_ptr(d);
 }
 
 unsigned int emv_data_type(emv_data_t d)
 {
-	return d->d_tag->t_type & EMV_DATA_TYPE_MASK;
+	return find_tag(d->d_id)->t_type & EMV_DATA_TYPE_MASK;
 }
 
 uint16_t emv_data_tag(emv_data_t d)
@@ -212,21 +279,23 @@ uint16_t emv_data_tag(emv_data_t d)
 
 const char *emv_data_tag_label(emv_data_t d)
 {
-	return (d->d_tag == &unknown_soldier) ? NULL : d->d_tag->t_label;
+	const struct _emv_tag *t = find_tag(d->d_id);
+	return (t == &unknown_soldier) ? NULL : t->t_label;
 }
 
 int emv_data_int(emv_data_t d)
 {
+	const uint8_t *ptr = _emv_data_ptr(d);
 	unsigned int i;
 	int ret;
 
-	if ( (d->d_tag->t_type & EMV_DATA_TYPE_MASK) != EMV_DATA_INT )
+	if ( emv_data_type(d) != EMV_DATA_INT )
 		return -1;
-	if ( d->d_len > sizeof(ret) || d->d_data[0] & 0x80 )
+	if ( d->d_len > sizeof(ret) || ptr[0] & 0x80 )
 		return -1;
 
 	for(ret = i = 0; i < d->d_len; i++)
-		ret = (ret << 8) | d->d_data[i];
+		ret = (ret << 8) | ptr[i];
 	
 	return ret;
 }
@@ -236,113 +305,239 @@ int emv_data_sda(emv_data_t d)
 	return !!(d->d_flags & EMV_DATA_SDA);
 }
 
-struct db_state {
-	struct _emv *e;
-	struct _emv_db *db;
-	struct _emv_data **rec;
-	struct _emv_data **sda;
-};
+static int cmp(const void *A, const void *B)
+{
+	const struct _emv_data * const *a = A, * const *b = B;
+	return (*a)->d_id - (*b)->d_id;
+}
 
-static int composite(emv_t e, struct _emv_data *d)
+/* keeps duplicates in card order, so that the first one gets the slot */
+static int tlv_cmp(const void *A, const void *B)
 {
-	const uint8_t *ptr, *end;
-	struct _emv_data **elem;
-	size_t num_tags;
-	size_t i;
+	const struct _emv_tlv *a = A, *b = B;
 
-	ptr = d->d_data;
-	end = ptr + d->d_len;
+	if ( a->v_id != b->v_id )
+		return a->v_id - b->v_id;
+	return (a->v_ptr > b->v_ptr) - (a->v_ptr < b->v_ptr);
+}
 
-	for(num_tags = 0; ptr < end; num_tags++) {
-		const uint8_t *tag;
-		size_t tag_len;
-		size_t clen;
+/* Children are decoded in to a scratch array which grows as needed and is
+ * shared by every level, each parent's then get copied out in one go.
+ */
+static struct _emv_tlv *scratch(struct _emv *e, unsigned int n)
+{
+	struct _emv_db *db = &e->e_db;
+	struct _emv_tlv *tmp;
+	unsigned int max;
 
-		tag = ber_decode_tag(&ptr, end, &tag_len);
-		if ( ptr >= end ) {
-			_emv_error(e, EMV_ERR_BER_DECODE);
-			return 0;
-		}
+	if ( n < db->db_tmp_max )
+		return db->db_tmp + n;
+
+	max = (db->db_tmp_max) ? db->db_tmp_max * 2 : 32;
+	tmp = realloc(db->db_tmp, max * sizeof(*tmp));
+	if ( NULL == tmp )
+		return NULL;
 
-		clen = ber_decode_len(&ptr, end);
-		if ( ptr + clen > end ) {
-			_emv_error(e, EMV_ERR_BER_DECODE);
+	db->db_tmp = tmp;
+	db->db_tmp_max = max;
+	return db->db_tmp + n;
+}
+
+/* Add to the flat index, which is grown by doubling in the gang */
+static int index_add(struct _emv *e, struct _emv_data **elem,
+			unsigned int n)
+{
+	struct _emv_db *db = &e->e_db;
+	struct _emv_data **new, **slot;
+	const struct _emv_tag *t;
+	unsigned int max;
+
+	if ( db->db_nmemb + n > db->db_elem_max ) {
+		for(max = (db->db_elem_max) ? db->db_elem_max : 64;
+				max < db->db_nmemb + n; max *= 2)
+			/* nothing */;
+
+		new = gang_alloc(e->e_files, max * sizeof(*new));
+		if ( NULL == new )
 			return 0;
-		}
 
-		ptr += clen;
+		memcpy(new, db->db_elem, db->db_nmemb * sizeof(*new));
+		db->db_elem = new;
+		db->db_elem_max = max;
 	}
 
-	elem = gang_alloc(e->e_files, num_tags * sizeof(*elem));
-	if ( NULL == elem ) {
-		_emv_sys_error(e);
+	memcpy(db->db_elem + db->db_nmemb, elem, n * sizeof(*elem));
+	db->db_nmemb += n;
+
+	/* first occurrence of a tag wins, as in the card's own record order */
+	for(; n; n--, elem++) {
+		t = find_tag((*elem)->d_id);
+		if ( t == &unknown_soldier )
+			continue;
+		slot = db->db_slot + (t - tags);
+		if ( NULL == *slot )
+			*slot = *elem;
+	}
+	return 1;
+}
+
+/* Step over one element, the tag is returned if it's no more than 2 bytes */
+static int next_tlv(const uint8_t **pptr, const uint8_t *end,
+			uint16_t *id, const uint8_t **val, size_t *len)
+{
+	const uint8_t *tag;
+	size_t tag_len, clen;
+
+	tag = ber_decode_tag(pptr, end, &tag_len);
+	if ( *pptr >= end )
+		return 0;
+
+	clen = ber_decode_len(pptr, end);
+	if ( clen > (size_t)(end - *pptr) )
+		return 0;
+
+	switch(tag_len) {
+	case 1:
+		*id = tag[0];
+		break;
+	case 2:
+		*id = (tag[0] << 8) | tag[1];
+		break;
+	default:
 		return 0;
 	}
 
-	for(ptr = d->d_data, i = 0; ptr < end; i++) {
-		const uint8_t *tag;
-		size_t tag_len;
-		size_t clen;
-		uint16_t t;
+	*val = *pptr;
+	*len = clen;
+	*pptr += clen;
+	return 1;
+}
 
-		tag = ber_decode_tag(&ptr, end, &tag_len);
-		if ( ptr >= end ) {
-			_emv_error(e, EMV_ERR_BER_DECODE);
-			return 0;
-		}
+/* Count the elements under a composite, checking the encoding on the way */
+static int count_elements(const uint8_t *ptr, size_t len, unsigned int *num)
+{
+	const uint8_t *end = ptr + len, *val;
+	size_t clen;
+	uint16_t id;
 
-		clen = ber_decode_len(&ptr, end);
-		if ( ptr + clen > end ) {
-			_emv_error(e, EMV_ERR_BER_DECODE);
+	while ( ptr < end ) {
+		if ( !next_tlv(&ptr, end, &id, &val, &clen) )
 			return 0;
-		}
+		(*num)++;
+		if ( find_tag(id)->t_type & EMV_DATA_ATOMIC )
+			continue;
+		if ( !count_elements(val, clen, num) )
+			return 0;
+	}
 
-		switch(tag_len) {
-		case 1:
-			t = tag[0];
-			break;
-		case 2:
-			t = (tag[0] << 8) | tag[1];
-			break;
-		default:
-			_emv_error(e, EMV_ERR_BER_DECODE);
+	return 1;
+}
+
+/* Decode the children of node i, they go at the next free place in nodes[]
+ * and their pointers in the matching slots of elem[], which has no slot for
+ * the record itself. The encoding was already checked by count_elements().
+ */
+static int composite(emv_t e, struct _emv_data *nodes,
+			struct _emv_data **elem, unsigned int *next,
+			unsigned int i)
+{
+	struct _emv_data *d = nodes + i, *k;
+	const uint8_t *ptr, *end;
+	struct _emv_tlv *v;
+	unsigned int num_tags, first, j;
+
+	ptr = _emv_data_ptr(d);
+	end = ptr + d->d_len;
+
+	for(num_tags = 0; ptr < end; num_tags++) {
+		v = scratch(e, num_tags);
+		if ( NULL == v ) {
+			_emv_sys_error(e);
 			return 0;
 		}
+		next_tlv(&ptr, end, &v->v_id, &v->v_ptr, &v->v_len);
+	}
 
-		elem[i] = mpool_alloc(e->e_data);
-		elem[i]->d_tag = find_tag(t);
+	d->d_nmemb = num_tags;
+	d->d_elem = 0;
+	if ( !num_tags )
+		return 1;
+
+	/* sorted for rapid searching of children */
+	qsort(e->e_db.db_tmp, num_tags, sizeof(*v), tlv_cmp);
+
+	first = *next;
+	*next += num_tags;
+	d->d_elem = (uint8_t *)(elem + first - 1) - (uint8_t *)d;
+
+	for(j = 0; j < num_tags; j++) {
+		v = e->e_db.db_tmp + j;
+		k = nodes + first + j;
+		k->d_id = v->v_id;
 		/* FIXME: check min/max sizes */
-		elem[i]->d_flags = d->d_flags;
-		elem[i]->d_id = t;
-		elem[i]->d_data = ptr;
-		elem[i]->d_len = clen;
-		if ( emv_data_composite(elem[i]) ) {
-			if ( !composite(e, elem[i]) )
-				return 0;
-		}else {
-			elem[i]->d_elem = NULL;
-			elem[i]->d_nmemb = 0;
-		}
+		k->d_flags = d->d_flags & ~EMV_DATA_CONSTRUCTED;
+		if ( !(find_tag(v->v_id)->t_type & EMV_DATA_ATOMIC) )
+			k->d_flags |= EMV_DATA_CONSTRUCTED;
+		k->d_off = v->v_ptr - (uint8_t *)k;
+		k->d_len = v->v_len;
+		k->d_nmemb = 0;
+		k->d_elem = 0;
+		elem[first - 1 + j] = k;
+	}
 
-		ptr += clen;
+	if ( !index_add(e, elem + first - 1, num_tags) ) {
+		_emv_sys_error(e);
+		return 0;
 	}
 
-	d->d_nmemb = num_tags;
-	d->d_elem = elem;
+	/* scratch is free again now, so it can be used for the next level */
+	for(j = first; j < first + num_tags; j++) {
+		if ( emv_data_composite(nodes + j) &&
+				!composite(e, nodes, elem, next, j) )
+			return 0;
+	}
 
 	return 1;
 }
 
-static int decode_record(struct db_state *s, const uint8_t *ptr,
-				size_t len, int sda)
+/* Keep the data covered by SDA contiguous so it never has to be gathered */
+static int sda_append(struct _emv *e, const uint8_t *ptr, size_t len)
 {
+	struct _emv_db *db = &e->e_db;
+	uint8_t *new;
+	size_t max;
+
+	if ( db->db_sdalen + len > db->db_sdamax ) {
+		for(max = (db->db_sdamax) ? db->db_sdamax : 256;
+				max < db->db_sdalen + len; max *= 2)
+			/* nothing */;
+
+		new = realloc(db->db_sdabuf, max);
+		if ( NULL == new )
+			return 0;
+
+		db->db_sdabuf = new;
+		db->db_sdamax = max;
+	}
+
+	memcpy(db->db_sdabuf + db->db_sdalen, ptr, len);
+	db->db_sdalen += len;
+	return 1;
+}
+
+static int decode_record(struct _emv *e, unsigned int idx,
+				const uint8_t *ptr, size_t len)
+{
+	struct _emv_db *db = &e->e_db;
 	const uint8_t *end = ptr + len;
+	int sda = db->db_afl[idx].r_sda;
+	struct _emv_data *d, **elem;
+	unsigned int num, next;
 	uint8_t *tmp;
-	struct _emv_data *d;
 
 	if ( len < 2 || ptr[0] != EMV_TAG_RECORD ) {
 		printf("emv: bad application data format\n");
-		_emv_error(s->e, EMV_ERR_BER_DECODE);
+		_emv_error(e, EMV_ERR_BER_DECODE);
 		return 0;
 	}
 
@@ -350,254 +545,304 @@ static int decode_record(struct db_state *s, const uint8_t *ptr,
 	len--;
 
 	len = ber_decode_len(&ptr, end);
-	if ( ptr + len > end ) {
-		_emv_error(s->e, EMV_ERR_BER_DECODE);
+	if ( len > (size_t)(end - ptr) || len > 0xffff ) {
+		_emv_error(e, EMV_ERR_BER_DECODE);
 		return 0;
 	}
 
-	d = mpool_alloc(s->e->e_data);
-	if ( NULL == d ) {
-		_emv_sys_error(s->e);
+	num = 1;
+	if ( !count_elements(ptr, len, &num) ) {
+		_emv_error(e, EMV_ERR_BER_DECODE);
 		return 0;
 	}
 
-	tmp = gang_alloc(s->e->e_files, len);
-	if ( NULL == ptr ) {
-		_emv_sys_error(s->e);
+	d = gang_alloc(e->e_files, num * sizeof(*d) +
+			(num - 1) * sizeof(*elem) + len);
+	if ( NULL == d ) {
+		_emv_sys_error(e);
 		return 0;
 	}
 
+	elem = (struct _emv_data **)(d + num);
+	tmp = (uint8_t *)(elem + (num - 1));
 	memcpy(tmp, ptr, len);
 
-	d->d_tag = find_tag(EMV_TAG_RECORD);
 	d->d_id = EMV_TAG_RECORD;
-	d->d_flags = (sda) ? EMV_DATA_SDA : 0;
-	d->d_data = tmp;
+	d->d_flags = EMV_DATA_CONSTRUCTED | ((sda) ? EMV_DATA_SDA : 0);
+	d->d_off = tmp - (uint8_t *)d;
 	d->d_len = len;
 
-	*s->rec = d;
-	s->rec++;
+	next = 1;
+	if ( !composite(e, d, elem, &next, 0) )
+		return 0;
 
-	if ( sda ) {
-		*s->sda = d;
-		s->sda++;
+	if ( sda && !sda_append(e, tmp, len) ) {
+		_emv_sys_error(e);
+		return 0;
 	}
 
-	return composite(s->e, d);
-}
+	db->db_rec[idx] = d;
+	if ( sda )
+		db->db_sda[db->db_sdaread++] = d;
 
-#if 0
-static void hex_dump_r(const uint8_t *tmp, size_t len,
-			size_t llen, unsigned int depth)
-{
-	size_t i, j;
-	size_t line;
-
-	for(j = 0; j < len; j += line, tmp += line) {
-		if ( j + llen > len ) {
-			line = len - j;
-		}else{
-			line = llen;
-		}
-
-		printf("%*c%05x : ", depth, ' ', j);
-
-		for(i = 0; i < line; i++) {
-			if ( isprint(tmp[i]) ) {
-				printf("%c", tmp[i]);
-			}else{
-				printf(".");
-			}
-		}
-
-		for(; i < llen; i++)
-			printf(" ");
-
-		for(i=0; i < line; i++)
-			printf(" %02x", tmp[i]);
-
-		printf("\n");
-	}
-	printf("\n");
+	return 1;
 }
 
-static const char *label(struct _emv_data *d)
+#if 0
+static const char *label(const struct _emv_data *d)
 {
 	static char buf[20];
+	const char *ret;
 
-	if ( d->d_tag == &unknown_soldier ) {
+	ret = emv_data_tag_label(d);
+	if ( NULL == ret ) {
 		snprintf(buf, sizeof(buf),
 			"Unknown tag: 0x%.4x", d->d_id);
 		return buf;
 	}else
-		return d->d_tag->t_label;
+		return ret;
 }
 
-static void dump_records(struct _emv_data **d, size_t num, unsigned depth)
+/* children are back to back, so this is a linear walk of the record */
+static void dump_records(const struct _emv_data *d, size_t num,
+			unsigned depth)
 {
 	unsigned int i;
 
-	for(i = 0; i < num; i++) {
-		if ( emv_data_composite(d[i]) ) {
-			printf("%*c%s {\n", depth, ' ', label(d[i]));
+	for(i = 0; i < num; i++, d++) {
+		if ( emv_data_composite(d) ) {
+			printf("%*c%s {\n", depth, ' ', label(d));
 				
-			dump_records(d[i]->d_elem,
-					d[i]->d_nmemb, depth + 1);
+			dump_records(_emv_data_kids(d),
+					d->d_nmemb, depth + 1);
 			printf("%*c}\n\n", depth, ' ');
 			continue;
 		}
 
-		printf("%*c%s\n", depth, ' ', label(d[i]));
-		hex_dump_r(d[i]->d_data,
-			d[i]->d_len, 16, depth);
+		printf("%*c%s\n", depth, ' ', label(d));
+		hex_dumpf_indent(stdout, _emv_data_ptr(d),
+				d->d_len, 16, depth);
 	}
 }
 #endif
 
-static int cmp(const void *A, const void *B)
+static void forget(struct _emv_db *db, unsigned int nmemb)
 {
-	const struct _emv_data * const *a = A, * const *b = B;
-	return (*a)->d_id - (*b)->d_id;
+	const struct _emv_tag *t;
+	struct _emv_data *d;
+	unsigned int i;
+
+	for(i = nmemb; i < db->db_nmemb; i++) {
+		d = db->db_elem[i];
+		t = find_tag(d->d_id);
+		if ( t != &unknown_soldier && db->db_slot[t - tags] == d )
+			db->db_slot[t - tags] = NULL;
+	}
+	db->db_nmemb = nmemb;
 }
 
-static void count_elements(struct _emv_data **d, size_t num,
-				unsigned int *cnt)
+static int read_next(struct _emv *e)
 {
-	unsigned int i;
+	struct _emv_db *db = &e->e_db;
+	const struct _emv_recref *r = db->db_afl + db->db_numread;
+	unsigned int nmemb = db->db_nmemb, elem_max = db->db_elem_max;
+	struct _emv_data **elem = db->db_elem;
+	struct gang_mark m;
+	const uint8_t *res;
+	size_t len;
 
-	for(i = 0; i < num; i++) {
-		if ( emv_data_composite(d[i]) ) {
-			(*cnt)++;
-			qsort(d[i]->d_elem, d[i]->d_nmemb,
-				sizeof(d[i]->d_elem), cmp);
+	if ( !_emv_read_record(e, r->r_sfi, r->r_rec) )
+		return 0;
 
-			/* take advantage of oppertunity to sort elements
-			 * for rapid searching of children */
-			count_elements(d[i]->d_elem,
-					d[i]->d_nmemb, cnt);
-			continue;
+	res = xfr_rx_data(e->e_xfr, &len);
+	if ( NULL == res )
+		return 0;
+
+	gang_mark(e->e_files, &m);
+	if ( !decode_record(e, db->db_numread, res, len) ) {
+		/* forget anything indexed from the partial record, and give
+		 * back its memory so that retrying a bad record doesn't grow
+		 * the arena. The index may have moved in to that memory, but
+		 * the old copy is still good up to nmemb.
+		 */
+		forget(db, nmemb);
+		db->db_elem = elem;
+		db->db_elem_max = elem_max;
+		gang_rewind(e->e_files, &m);
+		return 0;
+	}
+
+	db->db_numread++;
+	return 1;
+}
+
+/* Read records up to, but not including, number n of the AFL */
+static int read_upto(struct _emv *e, unsigned int n)
+{
+	struct _emv_db *db = &e->e_db;
+	unsigned int numread = db->db_numread;
+	int ret = 1;
+
+	while ( db->db_numread < n ) {
+		if ( !read_next(e) ) {
+			ret = 0;
+			break;
 		}
-		(*cnt)++;
 	}
+
+	if ( db->db_numread != numread )
+		qsort(db->db_elem, db->db_nmemb, sizeof(*db->db_elem), cmp);
+
+	return ret;
 }
 
-static void add_elements(struct _emv_data **d, size_t num,
-				struct _emv_data ***db)
+/* Same order as composite() fills them in, so the first one still wins */
+static void index_kids(struct _emv_db *db, const struct _emv_data *d)
 {
+	const struct _emv_data *k = _emv_data_kids(d);
+	const struct _emv_tag *t;
+	struct _emv_data **slot;
 	unsigned int i;
 
-	for(i = 0; i < num; i++) {
-		if ( emv_data_composite(d[i]) ) {
-			(**db) = d[i];
-			(*db)++;
-			add_elements(d[i]->d_elem,
-					d[i]->d_nmemb, db);
+	for(i = 0; i < d->d_nmemb; i++) {
+		t = find_tag(k[i].d_id);
+		if ( t == &unknown_soldier )
 			continue;
-		}
-		(**db) = d[i];
-		(*db)++;
+		slot = db->db_slot + (t - tags);
+		if ( NULL == *slot )
+			*slot = (struct _emv_data *)(k + i);
+	}
+
+	for(i = 0; i < d->d_nmemb; i++) {
+		if ( emv_data_composite(k + i) )
+			index_kids(db, k + i);
 	}
 }
 
-static int read_sfi(struct db_state *s, uint8_t sfi,
-			uint8_t begin, uint8_t end, uint8_t num_sda)
+/* Rebuild the tag slots for records which weren't decoded here, the slots
+ * depend on the order of tags[] and so can't be stored with them.
+ */
+int _emv_db_index_slots(struct _emv *e)
 {
-	const uint8_t *res;
-	unsigned int i, sda;
-	size_t len;
-
-	for(i = begin; i <= end; i++ ) {
-		if ( !_emv_read_record(s->e, sfi, i) )
-			return 0;
+	struct _emv_db *db = &e->e_db;
+	unsigned int i;
 
-		res = xfr_rx_data(s->e->e_xfr, &len);
-		if ( NULL == res )
-			return 0;
+	db->db_slot = gang_alloc0(e->e_files, num_tags * sizeof(*db->db_slot));
+	if ( NULL == db->db_slot )
+		return 0;
 
-		sda = ( num_sda && i < begin + num_sda ) ? 1 : 0;
-		if ( !decode_record(s, res, len, sda) )
-			return 0;
-	}
+	for(i = 0; i < db->db_numread; i++)
+		index_kids(db, db->db_rec[i]);
 
 	return 1;
 }
 
-int emv_read_app_data(struct _emv *e)
+/* Rewind the database, the memory is kept for the next application */
+void _emv_db_reset(struct _emv *e)
 {
 	struct _emv_db *db = &e->e_db;
-	struct db_state s;
+	uint8_t *sdabuf = db->db_sdabuf;
+	size_t sdamax = db->db_sdamax;
+	struct _emv_tlv *tmp = db->db_tmp;
+	unsigned int tmp_max = db->db_tmp_max;
+
+	gang_reset(e->e_files);
+	memset(db, 0, sizeof(*db));
+
+	db->db_sdabuf = sdabuf;
+	db->db_sdamax = sdamax;
+	db->db_tmp = tmp;
+	db->db_tmp_max = tmp_max;
+}
+
+/* Reset the database and make a list of the records in the AFL */
+static int index_afl(struct _emv *e)
+{
+	struct _emv_db *db = &e->e_db;
+	struct _emv_recref *r;
 	struct _emv_data **pps;
 	uint8_t *ptr, *end;
 	unsigned int i;
+	size_t hint;
 
-	mpool_free(e->e_data);
-	gang_free(e->e_files);
-	memset(&e->e_db, 0, sizeof(e->e_db));
-
-	e->e_data = mpool_new(sizeof(struct _emv_data), 0);
-	if ( NULL == e->e_data ) {
-		_emv_sys_error(e);
-		return 0;
-	}
-
-	e->e_files = gang_new(0, 0);
-	if ( NULL == e->e_files ) {
-		_emv_sys_error(e);
-		return 0;
-	}
+	_emv_db_reset(e);
 
 	for(ptr = e->e_afl, end = e->e_afl + e->e_afl_len;
 		ptr + 4 <= end; ptr += 4) {
 		//printf("SFI %u: %u rec %u sda\n",
 		//	 ptr[0] >> 3, (ptr[2] + 1) - ptr[1], ptr[3]);
+		if ( ptr[2] < ptr[1] )
+			continue;
 		db->db_numsda += ptr[3];
 		db->db_numrec += (ptr[2] + 1) - ptr[1];
 	}
 
+	/* so that a typical card's data fits in a single slab, but the AFL
+	 * comes from the card and may claim thousands of records
+	 */
+	hint = db->db_numrec * REC_SIZE_HINT + num_tags * sizeof(*db->db_slot);
+	gang_size_hint(e->e_files, (hint < DB_SIZE_HINT_MAX) ?
+					hint : DB_SIZE_HINT_MAX);
+
 	pps = gang_alloc(e->e_files,
 			(db->db_numrec + db->db_numsda) * sizeof(*pps));
-	if ( NULL == pps ) {
+	r = gang_alloc(e->e_files, db->db_numrec * sizeof(*r));
+	db->db_slot = gang_alloc0(e->e_files, num_tags * sizeof(*db->db_slot));
+	if ( NULL == pps || NULL == r || NULL == db->db_slot ) {
 		_emv_sys_error(e);
 		return 0;
 	}
-	
+
+	memset(pps, 0, (db->db_numrec + db->db_numsda) * sizeof(*pps));
 	db->db_rec = pps;
 	db->db_sda = pps + db->db_numrec;
-
-	s.e = e;
-	s.db = db;
-	s.rec = db->db_rec;
-	s.sda = db->db_sda;
+	db->db_afl = r;
 
 	for(ptr = e->e_afl, end = e->e_afl + e->e_afl_len;
 		ptr + 4 <= end; ptr += 4) {
-		if ( !read_sfi(&s, ptr[0] >> 3, ptr[1], ptr[2], ptr[3]) )
-			return 0;
+		if ( ptr[2] < ptr[1] )
+			continue;
+		for(i = ptr[1]; i <= ptr[2]; i++, r++) {
+			r->r_sfi = ptr[0] >> 3;
+			r->r_rec = i;
+			r->r_sda = ( i < ptr[1] + ptr[3] ) ? 1 : 0;
+			if ( r->r_sda )
+				db->db_lastsda = (r - db->db_afl) + 1;
+		}
 	}
 
-	for(i = 0; i < db->db_numrec; i++) {
-		count_elements(db->db_rec[i]->d_elem,
-			db->db_rec[i]->d_nmemb,
-			&db->db_nmemb);
-	}
+	/* don't trust the card to have counted its SDA records right */
+	for(db->db_numsda = 0, i = 0; i < db->db_numrec; i++)
+		db->db_numsda += db->db_afl[i].r_sda;
 
-	pps = db->db_elem = gang_alloc(e->e_files,
-					db->db_nmemb * sizeof(*db->db_elem));
-	if ( NULL == pps ) {
-		_emv_sys_error(e);
+	return 1;
+}
+
+int emv_read_app_data(struct _emv *e)
+{
+	if ( !index_afl(e) )
 		return 0;
-	}
 
-	for(i = 0; i < db->db_numrec; i++) {
-		add_elements(db->db_rec[i]->d_elem,
-			db->db_rec[i]->d_nmemb,
-			&pps);
-	}
-	qsort(db->db_elem, db->db_nmemb, sizeof(*db->db_elem), cmp);
+	if ( !read_upto(e, e->e_db.db_numrec) )
+		return 0;
 
-	//dump_records(db->db_rec, db->db_numrec, 1);
+	//for(i = 0; i < db->db_numrec; i++)
+	//	dump_records(db->db_rec[i], 1, 1);
 	//for(i = 0; i < db->db_nmemb; i++)
 	//	printf("%u. %s\n", i, label(db->db_elem[i]));
 	_emv_success(e);
 	return 1;
 }
+
+/* As emv_read_app_data() except that only the AFL is looked at, records are
+ * read as and when emv_retrieve_data() wants a tag which hasn't turned up
+ * yet. Offline data authentication reads whatever it needs.
+ */
+int emv_read_app_data_lazy(struct _emv *e)
+{
+	if ( !index_afl(e) )
+		return 0;
+
+	_emv_success(e);
+	return 1;
+}
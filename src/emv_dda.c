@@ -28,6 +28,11 @@ struct dda_req {
 	const uint8_t *ddol;
 	size_t ddol_len;
 	uint8_t pan[10];
+	/* dynamic data and the signed response to INTERNAL AUTHENTICATE */
+	const uint8_t *dol;
+	size_t dol_len;
+	const uint8_t *sig;
+	size_t sig_len;
 };
 
 static int get_required_data(struct _emv *e, struct dda_req *req)
@@ -45,7 +50,7 @@ static int get_required_data(struct _emv *e, struct dda_req *req)
 	d = _emv_retrieve_data(e, EMV_TAG_ISS_PK_CERT);
 	if ( NULL == d )
 		return 0;
-	req->pk_cert = d->d_data;
+	req->pk_cert = _emv_data_ptr(d);
 	req->pk_cert_len = d->d_len;
 	if ( NULL == req->pk_cert )
 		return 0;
@@ -53,7 +58,7 @@ static int get_required_data(struct _emv *e, struct dda_req *req)
 	d = _emv_retrieve_data(e, EMV_TAG_ISS_PK_R);
 	if ( NULL == d )
 		return 0;
-	req->pk_r = d->d_data;
+	req->pk_r = _emv_data_ptr(d);
 	req->pk_r_len = d->d_len;
 	if ( NULL == req->pk_r )
 		return 0;
@@ -61,7 +66,7 @@ static int get_required_data(struct _emv *e, struct dda_req *req)
 	d = _emv_retrieve_data(e, EMV_TAG_ISS_PK_EXP);
 	if ( NULL == d )
 		return 0;
-	req->pk_exp = d->d_data;
+	req->pk_exp = _emv_data_ptr(d);
 	req->pk_exp_len = d->d_len;
 	if ( NULL == req->pk_exp)
 		return 0;
@@ -69,7 +74,7 @@ static int get_required_data(struct _emv *e, struct dda_req *req)
 	d = _emv_retrieve_data(e, EMV_TAG_ICC_PK_CERT);
 	if ( NULL == d )
 		return 0;
-	req->icc_cert = d->d_data;
+	req->icc_cert = _emv_data_ptr(d);
 	req->icc_cert_len = d->d_len;
 	if ( NULL == req->icc_cert )
 		return 0;
@@ -77,7 +82,7 @@ static int get_required_data(struct _emv *e, struct dda_req *req)
 	d = _emv_retrieve_data(e, EMV_TAG_ICC_PK_R);
 	if ( NULL == d )
 		return 0;
-	req->icc_r = d->d_data;
+	req->icc_r = _emv_data_ptr(d);
 	req->icc_r_len = d->d_len;
 	if ( NULL == req->icc_r )
 		return 0;
@@ -85,7 +90,7 @@ static int get_required_data(struct _emv *e, struct dda_req *req)
 	d = _emv_retrieve_data(e, EMV_TAG_ICC_PK_EXP);
 	if ( NULL == d )
 		return 0;
-	req->icc_exp = d->d_data;
+	req->icc_exp = _emv_data_ptr(d);
 	req->icc_exp_len = d->d_len;
 	if ( NULL == req->icc_exp)
 		return 0;
@@ -93,7 +98,7 @@ static int get_required_data(struct _emv *e, struct dda_req *req)
 	d = _emv_retrieve_data(e, EMV_TAG_DDOL);
 	if ( NULL == d )
 		return 0;
-	req->ddol = d->d_data;
+	req->ddol = _emv_data_ptr(d);
 	req->ddol_len = d->d_len;
 	if ( NULL == req->ddol )
 		return 0;
@@ -104,73 +109,15 @@ static int get_required_data(struct _emv *e, struct dda_req *req)
 	memset(req->pan, 0xff, sizeof(req->pan));
 	if ( d->d_len > sizeof(req->pan) )
 		return 0;
-	memcpy(req->pan, d->d_data, d->d_len);
+	memcpy(req->pan, _emv_data_ptr(d), d->d_len);
 
 	return 1;
 }
 
-static RSA *get_ca_key(unsigned int idx, emv_mod_cb_t mod,
-			emv_exp_cb_t exp, size_t *key_len, void *priv)
+static int check_pk_cert(struct _emv_auth *a, struct dda_req *req)
 {
-	const uint8_t *modulus, *exponent;
-	size_t mod_len, exp_len;
-	RSA *key;
-
-	modulus = (*mod)(priv, idx, &mod_len);
-	if ( NULL == modulus )
-		return NULL;
-
-	exponent = (*exp)(priv, idx, &exp_len);
-	if ( NULL == exponent )
-		return NULL;
-	
-	key = RSA_new();
-	if ( NULL == key )
-		return NULL;
-
-	key->n = BN_bin2bn(modulus, mod_len, NULL);
-	if ( NULL == key->n )
-		goto err_free_key;
-
-	key->e = BN_bin2bn(exponent, exp_len, NULL);
-	if ( NULL == key->e )
-		goto err_free_mod;
-
-	*key_len = mod_len;
-
-	return key;
-err_free_mod:
-	BN_free(key->n);
-err_free_key:
-	RSA_free(key);
-	return NULL;
-}
-
-static int recover(uint8_t *ptr, size_t len, RSA *key)
-{
-	uint8_t *tmp;
-	int ret;
-
-	tmp = malloc(len);
-	if ( NULL == tmp )
-		return 0;
-
-	ret = RSA_public_encrypt(len, ptr, tmp, key, RSA_NO_PADDING);
-	if ( ret < 0 || (unsigned)ret != len ) {
-		free(tmp);
-		return 0;
-	}
-
-	memcpy(ptr, tmp, len);
-	free(tmp);
-
-	return 1;
-}
-
-static int check_pk_cert(struct _emv *e, struct dda_req *req)
-{
-	uint8_t *msg, *tmp;
-	size_t msg_len;
+	uint8_t md[SHA_DIGEST_LENGTH];
+	SHA_CTX ctx;
 	int ret;
 
 	if ( req->pk_cert[0] != 0x6a ) {
@@ -188,47 +135,39 @@ static int check_pk_cert(struct _emv *e, struct dda_req *req)
 		return 0;
 	}
 
-	msg_len = req->pk_cert_len - (SHA_DIGEST_LENGTH + 2) +
-			req->pk_r_len + req->pk_exp_len;
-	tmp = msg = malloc(msg_len);
-	if ( NULL == msg ) {
-		_emv_sys_error(e);
-		return 0;
-	}
-
-	memcpy(tmp, req->pk_cert + 1, req->pk_cert_len -
-		(SHA_DIGEST_LENGTH + 2));
-	tmp += req->pk_cert_len - (SHA_DIGEST_LENGTH + 2);
-	memcpy(tmp, req->pk_r, req->pk_r_len);
-	tmp += req->pk_r_len;
-	memcpy(tmp, req->pk_exp, req->pk_exp_len);
-
-	//printf("Encoded message of %u bytes:\n", msg_len);
-	//hex_dump(msg, msg_len, 16);
+	SHA1_Init(&ctx);
+	SHA1_Update(&ctx, req->pk_cert + 1,
+			req->pk_cert_len - (SHA_DIGEST_LENGTH + 2));
+	SHA1_Update(&ctx, req->pk_r, req->pk_r_len);
+	SHA1_Update(&ctx, req->pk_exp, req->pk_exp_len);
+	SHA1_Final(md, &ctx);
 
-	ret = _emsa_pss_decode(msg, msg_len, req->pk_cert, req->pk_cert_len);
+	ret = _emsa_pss_decode(md, req->pk_cert, req->pk_cert_len);
 	if ( !ret )
-		_emv_error(e, EMV_ERR_CERTIFICATE);
-	free(msg);
+		_emv_auth_error(a, EMV_ERR_CERTIFICATE);
 
 	return ret;
 }
 
-static RSA *make_issuer_pk(struct _emv *e, struct dda_req *req)
+static RSA *make_issuer_pk(struct _emv_auth *a, struct dda_req *req)
 {
 	uint8_t *tmp;
 	const uint8_t *kb;
 	size_t kb_len;
 	RSA *key;
 
-	tmp = malloc(req->pk_cert_len);
+	tmp = _emv_auth_scratch(a, req->pk_cert_len);
 	if ( NULL == tmp ) {
-		_emv_sys_error(e);
+		_emv_auth_error(a, EMV_ERR_KEY_SIZE_MISMATCH);
 		return NULL;
 	}
 
 	kb = req->pk_cert + 15;
 	kb_len = req->pk_cert_len - (15 + SHA_DIGEST_LENGTH + 1);
+	if ( kb_len + req->pk_r_len > req->pk_cert_len ) {
+		_emv_auth_error(a, EMV_ERR_CERTIFICATE);
+		return NULL;
+	}
 
 	memcpy(tmp, kb, kb_len);
 	memcpy(tmp + kb_len, req->pk_r, req->pk_r_len);
@@ -236,16 +175,14 @@ static RSA *make_issuer_pk(struct _emv *e, struct dda_req *req)
 	//hex_dump(kb, req->pk_cert_len, 16);
 	key = RSA_new();
 	if ( NULL == key ) {
-		_emv_sys_error(e);
-		free(tmp);
+		_emv_auth_sys_error(a);
 		return NULL;
 	}
 
 	key->n = BN_bin2bn(tmp, req->pk_cert_len, NULL);
 	key->e = BN_bin2bn(req->pk_exp, req->pk_exp_len, NULL);
-	free(tmp);
 	if ( NULL == key->n || NULL == key->e ) {
-		_emv_sys_error(e);
+		_emv_auth_sys_error(a);
 		RSA_free(key);
 		return NULL;
 	}
@@ -253,62 +190,80 @@ static RSA *make_issuer_pk(struct _emv *e, struct dda_req *req)
 	return key;
 }
 
-static RSA *get_issuer_pk(struct _emv *e, struct dda_req *req,
+static RSA *get_issuer_pk(struct _emv_auth *a, struct dda_req *req,
 				RSA *ca_key, size_t key_len)
 {
+	uint8_t md[SHA_DIGEST_LENGTH];
+	RSA *key;
 
 	if ( req->pk_cert_len != key_len ) {
-		_emv_error(e, EMV_ERR_KEY_SIZE_MISMATCH);
+		_emv_auth_error(a, EMV_ERR_KEY_SIZE_MISMATCH);
 		return NULL;
 	}
 
-	if ( !recover((uint8_t *)req->pk_cert, key_len, ca_key) ) {
-		_emv_error(e, EMV_ERR_RSA_RECOVERY);
+	/* hashed before recovery overwrites our copy of the certificate */
+	_emv_pk_digest(a->a_rid, req->ca_pk_idx, ca_key,
+			req->pk_cert, req->pk_cert_len,
+			req->pk_r, req->pk_r_len,
+			req->pk_exp, req->pk_exp_len, md);
+	key = _emv_pk_lookup(md);
+	if ( key )
+		return key;
+
+	if ( !_emv_auth_recover(a, (uint8_t *)req->pk_cert, key_len, ca_key) ) {
+		_emv_auth_error(a, EMV_ERR_RSA_RECOVERY);
 		return NULL;
 	}
 
 	//printf("recovered issuer pubkey cert:\n");
 	//hex_dump(req->pk_cert, key_len, 16);
 
-	if ( !check_pk_cert(e, req) )
+	if ( !check_pk_cert(a, req) )
 		return NULL;
 
-	return make_issuer_pk(e, req);
+	if ( _emv_pk_revoked(a->a_rid, req->ca_pk_idx, req->pk_cert) ) {
+		_emv_auth_error(a, EMV_ERR_CERT_REVOKED);
+		return NULL;
+	}
+
+	key = make_issuer_pk(a, req);
+	if ( key )
+		_emv_pk_store(a->a_rid, req->ca_pk_idx, md,
+				req->pk_cert, key);
+	return key;
 }
 
-static RSA *make_icc_pk(struct _emv *e, struct dda_req *req)
+static RSA *make_icc_pk(struct _emv_auth *a, struct dda_req *req)
 {
 	uint8_t *tmp;
 	const uint8_t *kb;
 	size_t kb_len;
 	RSA *key;
 
-	tmp = malloc(req->icc_cert_len);
-	if ( NULL == tmp ) {
-		_emv_sys_error(e);
-		return NULL;
-	}
-
 	kb = req->icc_cert + 21;
 	kb_len = req->icc_cert_len - (21 + SHA_DIGEST_LENGTH + 1);
 	req->icc_mod_len = kb_len + req->icc_r_len;
 
+	tmp = _emv_auth_scratch(a, req->icc_mod_len);
+	if ( NULL == tmp ) {
+		_emv_auth_error(a, EMV_ERR_KEY_SIZE_MISMATCH);
+		return NULL;
+	}
+
 	memcpy(tmp, kb, kb_len);
 	memcpy(tmp + kb_len, req->icc_r, req->icc_r_len);
 	//printf("Retrieved ICC public key:\n");
 	//hex_dump(tmp, req->icc_mod_len, 16);
 	key = RSA_new();
 	if ( NULL == key ) {
-		_emv_sys_error(e);
-		free(tmp);
+		_emv_auth_sys_error(a);
 		return NULL;
 	}
 
 	key->n = BN_bin2bn(tmp, req->icc_mod_len, NULL);
 	key->e = BN_bin2bn(req->icc_exp, req->icc_exp_len, NULL);
-	free(tmp);
 	if ( NULL == key->n || NULL == key->e ) {
-		_emv_sys_error(e);
+		_emv_auth_sys_error(a);
 		RSA_free(key);
 		return NULL;
 	}
@@ -316,12 +271,10 @@ static RSA *make_icc_pk(struct _emv *e, struct dda_req *req)
 	return key;
 }
 
-static int check_icc_cert(struct _emv *e, struct dda_req *req)
+static int check_icc_cert(struct _emv_auth *a, struct dda_req *req)
 {
-	struct _emv_data **rec;
-	unsigned int num_rec, i;
-	size_t msg_len, data_len;
-	uint8_t *msg, *tmp;
+	uint8_t md[SHA_DIGEST_LENGTH];
+	SHA_CTX ctx;
 	int ret;
 
 	if ( req->icc_cert[0] != 0x6a ) {
@@ -339,72 +292,51 @@ static int check_icc_cert(struct _emv *e, struct dda_req *req)
 		return 0;
 	}
 
-	rec = e->e_db.db_sda;
-	num_rec = e->e_db.db_numsda;
-
-	for(data_len = sizeof(e->e_aip), i = 0; i < num_rec; i++)
-		data_len += rec[i]->d_len;
-
-	msg_len = req->icc_cert_len - (SHA_DIGEST_LENGTH + 2) +
-			req->icc_r_len + req->icc_exp_len + data_len;
-	tmp = msg = malloc(msg_len);
-	if ( NULL == msg ) {
-		_emv_sys_error(e);
-		return 0;
-	}
-
-	memcpy(tmp, req->icc_cert + 1, req->icc_cert_len -
-		(SHA_DIGEST_LENGTH + 2));
-	tmp += req->icc_cert_len - (SHA_DIGEST_LENGTH + 2);
-	memcpy(tmp, req->icc_r, req->icc_r_len);
-	tmp += req->icc_r_len;
-	memcpy(tmp, req->icc_exp, req->icc_exp_len);
-	tmp += req->icc_exp_len;
-
-	for(i = 0; i < num_rec; i++) {
-		memcpy(tmp, rec[i]->d_data, rec[i]->d_len);
-		tmp += rec[i]->d_len;
-	}
-	memcpy(tmp, e->e_aip, sizeof(e->e_aip));
-
-	//printf("Encoded message of %u bytes:\n", msg_len);
-	//hex_dump(msg, msg_len, 16);
+	SHA1_Init(&ctx);
+	SHA1_Update(&ctx, req->icc_cert + 1,
+			req->icc_cert_len - (SHA_DIGEST_LENGTH + 2));
+	SHA1_Update(&ctx, req->icc_r, req->icc_r_len);
+	SHA1_Update(&ctx, req->icc_exp, req->icc_exp_len);
+	SHA1_Update(&ctx, a->a_sda, a->a_sda_len);
+	SHA1_Update(&ctx, a->a_aip, sizeof(a->a_aip));
+	SHA1_Final(md, &ctx);
 
-	ret = _emsa_pss_decode(msg, msg_len, req->icc_cert, req->icc_cert_len);
+	ret = _emsa_pss_decode(md, req->icc_cert, req->icc_cert_len);
 	if ( !ret )
-		_emv_error(e, EMV_ERR_CERTIFICATE);
-	free(msg);
+		_emv_auth_error(a, EMV_ERR_CERTIFICATE);
 
 	if ( ret && memcmp(req->icc_cert + 2, req->pan, sizeof(req->pan)) ) {
 		printf("emv-dda: ICC certificate PAN mismatch\n");
 		return 0;
 	}
 
-	e->e_sda_ok = 1;
+	if ( ret )
+		a->a_sda_ok = 1;
 
 	return ret;
 }
 
-static RSA *get_icc_pk(struct _emv *e, struct dda_req *req,
+static RSA *get_icc_pk(struct _emv_auth *a, struct dda_req *req,
 				RSA *iss_key, size_t key_len)
 {
 	if ( req->icc_cert_len != key_len ) {
-		_emv_error(e, EMV_ERR_KEY_SIZE_MISMATCH);
+		_emv_auth_error(a, EMV_ERR_KEY_SIZE_MISMATCH);
 		return NULL;
 	}
 
-	if ( !recover((uint8_t *)req->icc_cert, key_len, iss_key) ) {
-		_emv_error(e, EMV_ERR_RSA_RECOVERY);
+	if ( !_emv_auth_recover(a, (uint8_t *)req->icc_cert,
+				key_len, iss_key) ) {
+		_emv_auth_error(a, EMV_ERR_RSA_RECOVERY);
 		return NULL;
 	}
 
 	//printf("recovered ICC pubkey cert:\n");
 	//hex_dump(req->icc_cert, key_len, 16);
 
-	if ( !check_icc_cert(e, req) )
+	if ( !check_icc_cert(a, req) )
 		return NULL;
 
-	return make_icc_pk(e, req);
+	return make_icc_pk(a, req);
 }
 
 static int dol_cb(uint16_t tag, uint8_t *ptr, size_t len, void *priv)
@@ -443,115 +375,204 @@ static int decode_da_sig(const uint8_t **pptr, size_t *psz)
 	return 1;
 }
 
-static int verify_dynamic_sig(emv_t e, size_t icc_pk_len,
-				const uint8_t *ddol, size_t ddol_len)
+/* Send INTERNAL AUTHENTICATE and keep a copy of the signed response */
+static int get_dynamic_sig(emv_t e, struct _emv_auth *a, struct dda_req *req)
 {
-	uint8_t hbuf[icc_pk_len + ddol_len];
-	uint8_t md[SHA_DIGEST_LENGTH];
-	uint8_t da[icc_pk_len];
-	uint8_t *dol;
-	size_t dol_len;
+	uint8_t dol[0xff];
+	size_t dol_len = sizeof(dol);
 	const uint8_t *sig;
 	size_t sig_len;
-	int ret = 0;
 
-	dol = _emv_construct_dol(dol_cb, ddol, ddol_len, &dol_len, NULL);
-	if ( NULL == dol )
+	if ( !_emv_construct_dol_buf(dol_cb, req->ddol, req->ddol_len,
+					dol, &dol_len, NULL) ) {
+		_emv_error(e, EMV_ERR_BER_DECODE);
 		return 0;
+	}
 
 	//printf("Constructed DDOL:\n");
 	//hex_dump(dol, dol_len, 16);
 
 	if ( !_emv_int_authenticate(e, dol, dol_len) )
-		goto out;
+		return 0;
 
 	sig = xfr_rx_data(e->e_xfr, &sig_len);
 	if ( NULL == sig )
-		goto out;
-	
+		return 0;
+
 	if ( !decode_da_sig(&sig, &sig_len) ) {
 		_emv_error(e, EMV_ERR_BER_DECODE);
-		goto out;
+		return 0;
 	}
 
-	if ( sig_len != icc_pk_len || icc_pk_len < 24 ) {
-		_emv_error(e, EMV_ERR_CERTIFICATE);
-		goto out;
+	req->dol = _emv_auth_dup(a, dol, dol_len);
+	req->dol_len = dol_len;
+	req->sig = _emv_auth_dup(a, sig, sig_len);
+	req->sig_len = sig_len;
+	if ( NULL == req->dol || NULL == req->sig ) {
+		_emv_sys_error(e);
+		return 0;
 	}
 
-	memcpy(da, sig, icc_pk_len);
-	if ( !recover(da, icc_pk_len, e->e_icc_pk) ) {
-		_emv_error(e, EMV_ERR_CERTIFICATE);
-		goto out;
+	return 1;
+}
+
+static int verify_dynamic_sig(struct _emv_auth *a, struct dda_req *req)
+{
+	size_t icc_pk_len = req->icc_mod_len;
+	uint8_t hbuf[icc_pk_len + req->dol_len];
+	uint8_t md[SHA_DIGEST_LENGTH];
+	uint8_t da[icc_pk_len];
+
+	if ( req->sig_len != icc_pk_len || icc_pk_len < 24 ) {
+		_emv_auth_error(a, EMV_ERR_CERTIFICATE);
+		return 0;
 	}
-	
+
+	memcpy(da, req->sig, icc_pk_len);
+	if ( !_emv_auth_recover(a, da, icc_pk_len, a->a_icc_pk) ) {
+		_emv_auth_error(a, EMV_ERR_CERTIFICATE);
+		return 0;
+	}
+
 	if ( da[0] != 0x6a || da[1] != 0x05 || da[2] != 0x01) {
 		printf("Dynamic application data is corrupt\n");
-		_emv_error(e, EMV_ERR_CERTIFICATE);
-		goto out;
+		_emv_auth_error(a, EMV_ERR_CERTIFICATE);
+		return 0;
 	}
 
 	//printf("Signed authentication data:\n");
 	//hex_dump(da, icc_pk_len, 16);
 
 	memcpy(hbuf, da + 1, icc_pk_len - 22);
-	memcpy(hbuf + (icc_pk_len - 22), dol, dol_len);
+	memcpy(hbuf + (icc_pk_len - 22), req->dol, req->dol_len);
 	//printf("Data covered by hash:\n");
-	//hex_dump(hbuf, (icc_pk_len - 22) + dol_len, 16);
+	//hex_dump(hbuf, (icc_pk_len - 22) + req->dol_len, 16);
 
-	SHA1(hbuf, (icc_pk_len - 22) + dol_len, md);
+	SHA1(hbuf, (icc_pk_len - 22) + req->dol_len, md);
 
 	if ( memcmp(md, (da + icc_pk_len) - (SHA_DIGEST_LENGTH + 1),
 			SHA_DIGEST_LENGTH) ) {
-		goto out;
+		return 0;
 	}
-	ret = 1;
-out:
-	free(dol);
-	return ret;
+
+	return 1;
 }
 
-int emv_authenticate_dynamic(emv_t e, emv_mod_cb_t mod, emv_exp_cb_t exp,
-					void *priv)
+static int dda_verify(struct _emv_auth *a)
+{
+	struct dda_req *req = a->a_req;
+
+	a->a_iss_pk = get_issuer_pk(a, req, a->a_ca_pk, a->a_ca_pk_len);
+	if ( NULL == a->a_iss_pk )
+		return 0;
+
+	a->a_icc_pk = get_icc_pk(a, req, a->a_iss_pk, a->a_ca_pk_len);
+	if ( NULL == a->a_icc_pk )
+		return 0;
+
+	if ( !verify_dynamic_sig(a, req) )
+		return 0;
+
+	a->a_dda_ok = 1;
+	return 1;
+}
+
+/* Private copies of the certificates, recovery happens in place */
+static int dup_req(struct _emv_auth *a, struct dda_req *req)
+{
+	req->pk_cert = _emv_auth_dup(a, req->pk_cert, req->pk_cert_len);
+	req->pk_r = _emv_auth_dup(a, req->pk_r, req->pk_r_len);
+	req->pk_exp = _emv_auth_dup(a, req->pk_exp, req->pk_exp_len);
+	req->icc_cert = _emv_auth_dup(a, req->icc_cert, req->icc_cert_len);
+	req->icc_r = _emv_auth_dup(a, req->icc_r, req->icc_r_len);
+	req->icc_exp = _emv_auth_dup(a, req->icc_exp, req->icc_exp_len);
+	return req->pk_cert && req->pk_r && req->pk_exp &&
+		req->icc_cert && req->icc_r && req->icc_exp;
+}
+
+/* Everything which needs the card is done here, on the caller's thread */
+static struct _emv_auth *dda_prepare(emv_t e, emv_mod_cb_t mod,
+					emv_exp_cb_t exp, void *priv)
 {
-	struct dda_req req;
-	size_t ca_key_len;
-	RSA *ca_key;
+	struct _emv_auth *a;
+	struct dda_req *req;
 
 	if ( e->e_dda_ok )
-		return 1;
+		return _emv_auth_new(e, NULL);
 
 	if ( !(e->e_aip[0] & EMV_AIP_DDA) ) {
 		_emv_error(e, EMV_ERR_FUNC_NOT_SUPPORTED);
-		return 0;
+		return NULL;
 	}
 
-	if ( !get_required_data(e, &req) ) {
+	a = _emv_auth_new(e, dda_verify);
+	if ( NULL == a )
+		return NULL;
+
+	req = gang_alloc0(a->a_mem, sizeof(*req));
+	if ( NULL == req ) {
+		_emv_sys_error(e);
+		goto err;
+	}
+	a->a_req = req;
+
+	if ( !get_required_data(e, req) ) {
 		_emv_error(e, EMV_ERR_DATA_ELEMENT_NOT_FOUND);
-		return 0;
+		goto err;
 	}
 
-	ca_key = get_ca_key(req.ca_pk_idx, mod, exp, &ca_key_len, priv);
-	if ( NULL == ca_key ) {
+	if ( !dup_req(a, req) ) {
+		_emv_sys_error(e);
+		goto err;
+	}
+
+	a->a_ca_pk = _emv_ca_key(e, req->ca_pk_idx, mod, exp,
+					&a->a_ca_pk_len, priv);
+	if ( NULL == a->a_ca_pk ) {
 		_emv_error(e, EMV_ERR_KEY_NOT_FOUND);
-		return 0;
+		goto err;
 	}
 
-	e->e_ca_pk = ca_key;
+	if ( !_emv_auth_sda_records(a) )
+		goto err;
 
-	e->e_iss_pk = get_issuer_pk(e, &req, ca_key, ca_key_len);
-	if ( NULL == e->e_iss_pk )
-		return 0;
+	if ( !get_dynamic_sig(e, a, req) )
+		goto err;
 
-	e->e_icc_pk = get_icc_pk(e, &req, e->e_iss_pk, ca_key_len);
-	if ( NULL == e->e_icc_pk )
+	return a;
+err:
+	_emv_auth_free(a);
+	return NULL;
+}
+
+int emv_authenticate_dynamic(emv_t e, emv_mod_cb_t mod, emv_exp_cb_t exp,
+					void *priv)
+{
+	struct _emv_auth *a;
+
+	a = dda_prepare(e, mod, exp, priv);
+	if ( NULL == a )
 		return 0;
 
-	if ( !verify_dynamic_sig(e, req.icc_mod_len, req.ddol, req.ddol_len) )
+	return _emv_auth_run(a);
+}
+
+/* As emv_authenticate_dynamic() but only INTERNAL AUTHENTICATE and the card
+ * reads are done before returning. The certificate chain and signature are
+ * checked on the worker pool and the outcome is delivered to cb by
+ * emv_auth_complete().
+ */
+int emv_authenticate_dynamic_async(emv_t e, emv_mod_cb_t mod,
+					emv_exp_cb_t exp, void *priv,
+					emv_auth_cb_t cb, void *cb_priv)
+{
+	struct _emv_auth *a;
+
+	a = dda_prepare(e, mod, exp, priv);
+	if ( NULL == a )
 		return 0;
 
-	e->e_dda_ok = 1;
-	return 1;
+	return _emv_auth_submit(a, cb, cb_priv);
 }
 
 int emv_dda_ok(emv_t e)
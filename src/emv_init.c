@@ -20,9 +20,16 @@ static int bop_po(const uint8_t *ptr, size_t len, void *priv)
 	memcpy(e->e_aip, ptr, sizeof(e->e_aip));
 
 	e->e_afl_len = len - sizeof(e->e_aip);
-	e->e_afl = malloc(e->e_afl_len);
-	if ( NULL == e->e_afl )
-		return 0;
+	if ( e->e_afl_len > e->e_afl_max ) {
+		uint8_t *afl;
+
+		afl = realloc(e->e_afl, e->e_afl_len);
+		if ( NULL == afl )
+			return 0;
+
+		e->e_afl = afl;
+		e->e_afl_max = e->e_afl_len;
+	}
 
 	memcpy(e->e_afl, ptr + sizeof(e->e_aip), e->e_afl_len);
 
@@ -31,16 +38,15 @@ static int bop_po(const uint8_t *ptr, size_t len, void *priv)
 
 static int get_aip(emv_t e)
 {
-	static const uint8_t pdol[] = {0x83, 0x00};
 	static const struct ber_tag tags[] = {
-		{ .tag = "\x80", .tag_len = 1, .op = bop_po},
+		{ .tag = 0x80, .op = bop_po},
 	};
 	const uint8_t *res;
 	size_t len;
 
 	/* TODO: handle case where PDOL was specified */
 
-	if ( !_emv_get_proc_opts(e, pdol, sizeof(pdol)) )
+	if ( !_emv_get_proc_opts(e, NULL, 0) )
 		return 0;
 	res = xfr_rx_data(e->e_xfr, &len);
 	if ( NULL == res )
@@ -0,0 +1,248 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2008 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Bounded LRU cache of verified issuer public keys, plus the issuer
+ * certificate revocation list. Entries are keyed on a hash of the CA key, by
+ * identity and value, and the certificate, remainder and exponent as read
+ * from the card, so a hit means the same recovery would have produced the
+ * same key even if the CA table was rebuilt in between.
+*/
+
+#include <ccid.h>
+#include <list.h>
+#include <emv.h>
+#include <time.h>
+#include <pthread.h>
+#include "emv-internal.h"
+
+#include <openssl/bn.h>
+
+#define PK_SERIAL_LEN	3
+
+struct pk_ent {
+	struct list_head	p_list;
+	uint8_t			p_md[SHA_DIGEST_LENGTH];
+	emv_rid_t		p_rid;
+	uint8_t			p_ca_idx;
+	uint8_t			p_serial[PK_SERIAL_LEN];
+	unsigned int		p_expiry;
+	RSA			*p_rsa;
+};
+
+struct pk_revoked {
+	struct list_head	r_list;
+	emv_rid_t		r_rid;
+	uint8_t			r_ca_idx;
+	uint8_t			r_serial[PK_SERIAL_LEN];
+};
+
+static pthread_mutex_t pk_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(pk_lru);
+static LIST_HEAD(pk_revoked);
+static unsigned int pk_num;
+static unsigned int pk_max;
+
+static unsigned int bcd(uint8_t b)
+{
+	return (b >> 4) * 10 + (b & 0xf);
+}
+
+/* Months since 1950, certificates expire at the end of their MMYY month */
+static unsigned int cert_expiry(const uint8_t *cert)
+{
+	unsigned int mm = bcd(cert[6]), yy = bcd(cert[7]);
+
+	/* nonsense dates are treated as already expired */
+	if ( mm < 1 || mm > 12 )
+		return 0;
+	if ( yy < 50 )
+		yy += 100;
+	return yy * 12 + (mm - 1);
+}
+
+static unsigned int now_month(void)
+{
+	struct tm tm;
+	time_t t;
+
+	t = time(NULL);
+	gmtime_r(&t, &tm);
+	return (tm.tm_year - 50) * 12 + tm.tm_mon;
+}
+
+static void pk_ent_free(struct pk_ent *p)
+{
+	list_del(&p->p_list);
+	RSA_free(p->p_rsa);
+	free(p);
+	pk_num--;
+}
+
+/* Called with pk_lock held */
+static int is_revoked(const emv_rid_t rid, uint8_t ca_idx,
+			const uint8_t *serial)
+{
+	struct pk_revoked *r;
+
+	list_for_each_entry(r, &pk_revoked, r_list) {
+		if ( r->r_ca_idx == ca_idx &&
+				!memcmp(r->r_rid, rid, EMV_RID_LEN) &&
+				!memcmp(r->r_serial, serial, PK_SERIAL_LEN) )
+			return 1;
+	}
+
+	return 0;
+}
+
+/* The cache never leaves the process so the limbs will do as they are */
+static void hash_bn(SHA_CTX *ctx, const BIGNUM *bn)
+{
+	SHA1_Update(ctx, &bn->top, sizeof(bn->top));
+	SHA1_Update(ctx, bn->d, bn->top * sizeof(*bn->d));
+}
+
+void _emv_pk_digest(const emv_rid_t rid, unsigned int ca_idx,
+			const RSA *ca_key,
+			const uint8_t *cert, size_t cert_len,
+			const uint8_t *r, size_t r_len,
+			const uint8_t *exp, size_t exp_len, uint8_t *md)
+{
+	uint8_t idx = ca_idx;
+	SHA_CTX ctx;
+
+	SHA1_Init(&ctx);
+	SHA1_Update(&ctx, rid, EMV_RID_LEN);
+	SHA1_Update(&ctx, &idx, sizeof(idx));
+	hash_bn(&ctx, ca_key->n);
+	hash_bn(&ctx, ca_key->e);
+	SHA1_Update(&ctx, cert, cert_len);
+	SHA1_Update(&ctx, r, r_len);
+	SHA1_Update(&ctx, exp, exp_len);
+	SHA1_Final(md, &ctx);
+}
+
+/* Returns a new reference to a cached issuer key, or NULL */
+RSA *_emv_pk_lookup(const uint8_t *md)
+{
+	struct pk_ent *p;
+	RSA *key = NULL;
+
+	pthread_mutex_lock(&pk_lock);
+
+	list_for_each_entry(p, &pk_lru, p_list) {
+		if ( memcmp(p->p_md, md, sizeof(p->p_md)) )
+			continue;
+		if ( p->p_expiry < now_month() ) {
+			pk_ent_free(p);
+			break;
+		}
+		list_move(&p->p_list, &pk_lru);
+		RSA_up_ref(p->p_rsa);
+		key = p->p_rsa;
+		break;
+	}
+
+	pthread_mutex_unlock(&pk_lock);
+	return key;
+}
+
+/* cert is the recovered issuer public key certificate */
+void _emv_pk_store(const emv_rid_t rid, unsigned int ca_idx,
+			const uint8_t *md,
+			const uint8_t *cert, RSA *key)
+{
+	struct pk_ent *p;
+
+	pthread_mutex_lock(&pk_lock);
+
+	if ( !pk_max )
+		goto out;
+
+	p = calloc(1, sizeof(*p));
+	if ( NULL == p )
+		goto out;
+
+	memcpy(p->p_md, md, sizeof(p->p_md));
+	memcpy(p->p_rid, rid, EMV_RID_LEN);
+	p->p_ca_idx = ca_idx;
+	memcpy(p->p_serial, cert + 8, PK_SERIAL_LEN);
+	p->p_expiry = cert_expiry(cert);
+
+	if ( p->p_expiry < now_month() ||
+			is_revoked(p->p_rid, p->p_ca_idx, p->p_serial) ) {
+		free(p);
+		goto out;
+	}
+
+	while ( pk_num >= pk_max )
+		pk_ent_free(list_entry(pk_lru.prev, struct pk_ent, p_list));
+
+	RSA_up_ref(key);
+	p->p_rsa = key;
+	list_add(&p->p_list, &pk_lru);
+	pk_num++;
+out:
+	pthread_mutex_unlock(&pk_lock);
+}
+
+int _emv_pk_revoked(const emv_rid_t rid, unsigned int ca_idx,
+			const uint8_t *cert)
+{
+	int ret;
+
+	pthread_mutex_lock(&pk_lock);
+	ret = is_revoked(rid, ca_idx, cert + 8);
+	pthread_mutex_unlock(&pk_lock);
+	return ret;
+}
+
+/* Set the maximum number of cached issuer keys, zero disables the cache */
+void emv_pk_cache_size(unsigned int max)
+{
+	pthread_mutex_lock(&pk_lock);
+	pk_max = max;
+	while ( pk_num > pk_max )
+		pk_ent_free(list_entry(pk_lru.prev, struct pk_ent, p_list));
+	pthread_mutex_unlock(&pk_lock);
+}
+
+/* Revoke an issuer certificate by its CA and 3 byte serial number, keys
+ * which were certified by it are dropped from the cache and it will fail
+ * authentication from now on.
+ */
+int emv_pk_revoke(const emv_rid_t rid, unsigned int ca_idx,
+			const uint8_t *serial)
+{
+	struct pk_ent *p, *tmp;
+	struct pk_revoked *r;
+
+	pthread_mutex_lock(&pk_lock);
+
+	if ( is_revoked(rid, ca_idx, serial) ) {
+		pthread_mutex_unlock(&pk_lock);
+		return 1;
+	}
+
+	r = calloc(1, sizeof(*r));
+	if ( NULL == r ) {
+		pthread_mutex_unlock(&pk_lock);
+		return 0;
+	}
+
+	memcpy(r->r_rid, rid, EMV_RID_LEN);
+	r->r_ca_idx = ca_idx;
+	memcpy(r->r_serial, serial, PK_SERIAL_LEN);
+	list_add(&r->r_list, &pk_revoked);
+
+	list_for_each_entry_safe(p, tmp, &pk_lru, p_list) {
+		if ( p->p_ca_idx == ca_idx &&
+				!memcmp(p->p_rid, rid, EMV_RID_LEN) &&
+				!memcmp(p->p_serial, serial, PK_SERIAL_LEN) )
+			pk_ent_free(p);
+	}
+
+	pthread_mutex_unlock(&pk_lock);
+	return 1;
+}
@@ -0,0 +1,171 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2008 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Fast read, the usual select, initiate, read and authenticate sequence in
+ * one call. Records are only read as far as the SDA set and the requested
+ * tags need, and the SDA signature is checked on the authentication pool
+ * while the card is busy with the rest of them.
+*/
+
+#include <ccid.h>
+#include <list.h>
+#include <emv.h>
+#include "emv-internal.h"
+
+#include <time.h>
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Priority 1 is the highest and zero means none was given */
+static unsigned int prio_key(emv_app_t a)
+{
+	unsigned int prio = emv_app_prio(a) & 0xf;
+	return prio ? prio : 0x10;
+}
+
+static int select_pse(emv_t e)
+{
+	emv_app_t a, best = NULL;
+
+	if ( !emv_appsel_pse(e) )
+		return 0;
+
+	for(a = emv_appsel_pse_first(e); a; a = emv_appsel_pse_next(e, a)) {
+		if ( NULL == best || prio_key(a) < prio_key(best) )
+			best = a;
+	}
+
+	if ( NULL == best ) {
+		_emv_error(e, EMV_ERR_APP_NOT_SELECTED);
+		return 0;
+	}
+
+	return emv_app_select_pse(e, best);
+}
+
+static int select_app(emv_t e, const struct emv_quick *q)
+{
+	unsigned int i;
+
+	for(i = 0; i < q->q_num_aids; i++) {
+		if ( emv_app_select_aid(e, q->q_aids[i].a_aid,
+					q->q_aids[i].a_len) )
+			return 1;
+	}
+
+	return select_pse(e);
+}
+
+static void sda_done(emv_t e, int ok, void *priv)
+{
+	struct emv_quick_result *r = priv;
+	r->r_sda = !!ok;
+}
+
+static int start_sda(emv_t e, const struct emv_quick *q,
+			struct emv_quick_result *r)
+{
+	emv_aip_t aip;
+
+	if ( NULL == q->q_mod || !emv_app_aip(e, aip) )
+		return 1;
+	if ( !(aip[0] & EMV_AIP_SDA) )
+		return 1;
+
+	/* missing data doesn't always set an error, so start from none */
+	_emv_success(e);
+	if ( emv_authenticate_static_data_async(e, q->q_mod, q->q_exp,
+						q->q_priv, sda_done, r) )
+		return 1;
+
+	/* a bad certificate is a result, losing the card is not */
+	r->r_sda = 0;
+	return !emv_error(e) || emv_error_type(emv_error(e)) == EMV_ERR_EMV;
+}
+
+static int read_tags(emv_t e, const struct emv_quick *q,
+			struct emv_quick_result *r)
+{
+	unsigned int i;
+
+	for(i = 0; i < q->q_num_tags; i++) {
+		if ( _emv_retrieve_data(e, q->q_tags[i]) )
+			continue;
+		/* not found without every record read, so a read failed */
+		if ( e->e_db.db_numread < e->e_db.db_numrec )
+			return 0;
+		r->r_missing++;
+	}
+
+	return 1;
+}
+
+/* Select an application, initiate it and read what is asked for.
+ * If q_aids is set then those AIDs are selected directly, in order, and the
+ * PSE is only read if none of them are on the card, in which case the
+ * application with the highest priority is taken. Records are read in AFL
+ * order up to the last one covered by SDA, or holding a tag from q_tags,
+ * the rest are left for emv_retrieve_data() to read on demand. If q_mod is
+ * set and the card supports SDA then the signature is verified on the
+ * authentication pool while the remaining records are read, and emv_sda_ok()
+ * holds the result on return. Requested tags which the card doesn't have
+ * are counted in r_missing and are not an error.
+ *
+ * Any other authentication jobs outstanding on @e are completed too. Returns
+ * zero on failure, with r_stage set to the stage which failed.
+ */
+int emv_quick_read(emv_t e, const struct emv_quick *q,
+			struct emv_quick_result *r)
+{
+	uint64_t start, t;
+	int ret = 0;
+
+	memset(r, 0, sizeof(*r));
+	r->r_sda = -1;
+	start = t = now_usec();
+
+	r->r_stage = EMV_QUICK_SELECT;
+	if ( !select_app(e, q) )
+		goto out;
+	r->r_usec[EMV_QUICK_SELECT] = now_usec() - t;
+
+	t = now_usec();
+	r->r_stage = EMV_QUICK_INIT;
+	if ( !emv_app_init(e) )
+		goto out;
+	r->r_usec[EMV_QUICK_INIT] = now_usec() - t;
+
+	t = now_usec();
+	r->r_stage = EMV_QUICK_READ;
+	if ( !emv_read_app_data_lazy(e) )
+		goto out;
+	if ( !start_sda(e, q, r) )
+		goto out;
+	if ( !read_tags(e, q, r) )
+		goto out;
+	r->r_usec[EMV_QUICK_READ] = now_usec() - t;
+
+	r->r_stage = EMV_QUICK_AUTH;
+	ret = 1;
+out:
+	/* the callback points at @r, so never leave it queued */
+	t = now_usec();
+	emv_auth_complete(e, 1);
+	if ( ret ) {
+		r->r_usec[EMV_QUICK_AUTH] = now_usec() - t;
+		r->r_stage = EMV_QUICK_NR_STAGES;
+		_emv_success(e);
+	}
+
+	r->r_records = e->e_db.db_numread;
+	r->r_num_records = e->e_db.db_numrec;
+	r->r_total = now_usec() - start;
+	return ret;
+}
@@ -37,7 +37,7 @@ static int get_required_data(struct _emv *e, struct sda_req *req)
 	d = _emv_retrieve_data(e, EMV_TAG_ISS_PK_CERT);
 	if ( NULL == d )
 		return 0;
-	req->pk_cert = d->d_data;
+	req->pk_cert = _emv_data_ptr(d);
 	req->pk_cert_len = d->d_len;
 	if ( NULL == req->pk_cert )
 		return 0;
@@ -45,7 +45,7 @@ static int get_required_data(struct _emv *e, struct sda_req *req)
 	d = _emv_retrieve_data(e, EMV_TAG_ISS_PK_R);
 	if ( NULL == d )
 		return 0;
-	req->pk_r = d->d_data;
+	req->pk_r = _emv_data_ptr(d);
 	req->pk_r_len = d->d_len;
 	if ( NULL == req->pk_r )
 		return 0;
@@ -53,7 +53,7 @@ static int get_required_data(struct _emv *e, struct sda_req *req)
 	d = _emv_retrieve_data(e, EMV_TAG_ISS_PK_EXP);
 	if ( NULL == d )
 		return 0;
-	req->pk_exp = d->d_data;
+	req->pk_exp = _emv_data_ptr(d);
 	req->pk_exp_len = d->d_len;
 	if ( NULL == req->pk_exp)
 		return 0;
@@ -61,7 +61,7 @@ static int get_required_data(struct _emv *e, struct sda_req *req)
 	d = _emv_retrieve_data(e, EMV_TAG_SSA_DATA);
 	if ( NULL == d )
 		return 0;
-	req->ssa_data = d->d_data;
+	req->ssa_data = _emv_data_ptr(d);
 	req->ssa_data_len = d->d_len;
 	if ( NULL == req->ssa_data)
 		return 0;
@@ -69,68 +69,10 @@ static int get_required_data(struct _emv *e, struct sda_req *req)
 	return 1;
 }
 
-static RSA *get_ca_key(unsigned int idx, emv_mod_cb_t mod,
-			emv_exp_cb_t exp, size_t *key_len, void *priv)
+static int check_pk_cert(struct _emv_auth *a, struct sda_req *req)
 {
-	const uint8_t *modulus, *exponent;
-	size_t mod_len, exp_len;
-	RSA *key;
-
-	modulus = (*mod)(priv, idx, &mod_len);
-	if ( NULL == modulus )
-		return NULL;
-
-	exponent = (*exp)(priv, idx, &exp_len);
-	if ( NULL == exponent )
-		return NULL;
-	
-	key = RSA_new();
-	if ( NULL == key )
-		return NULL;
-
-	key->n = BN_bin2bn(modulus, mod_len, NULL);
-	if ( NULL == key->n )
-		goto err_free_key;
-
-	key->e = BN_bin2bn(exponent, exp_len, NULL);
-	if ( NULL == key->e )
-		goto err_free_mod;
-
-	*key_len = mod_len;
-
-	return key;
-err_free_mod:
-	BN_free(key->n);
-err_free_key:
-	RSA_free(key);
-	return NULL;
-}
-
-static int recover(uint8_t *ptr, size_t len, RSA *key)
-{
-	uint8_t *tmp;
-	int ret;
-
-	tmp = malloc(len);
-	if ( NULL == tmp )
-		return 0;
-
-	ret = RSA_public_encrypt(len, ptr, tmp, key, RSA_NO_PADDING);
-	if ( ret < 0 || (unsigned)ret != len ) {
-		free(tmp);
-		return 0;
-	}
-
-	memcpy(ptr, tmp, len);
-	free(tmp);
-
-	return 1;
-}
-
-static int check_pk_cert(struct _emv *e, struct sda_req *req)
-{
-	uint8_t *msg, *tmp;
-	size_t msg_len;
+	uint8_t md[SHA_DIGEST_LENGTH];
+	SHA_CTX ctx;
 	int ret;
 
 	if ( req->pk_cert[0] != 0x6a ) {
@@ -148,47 +90,39 @@ static int check_pk_cert(struct _emv *e, struct sda_req *req)
 		return 0;
 	}
 
-	msg_len = req->pk_cert_len - (SHA_DIGEST_LENGTH + 2) +
-			req->pk_r_len + req->pk_exp_len;
-	tmp = msg = malloc(msg_len);
-	if ( NULL == msg ) {
-		_emv_sys_error(e);
-		return 0;
-	}
+	SHA1_Init(&ctx);
+	SHA1_Update(&ctx, req->pk_cert + 1,
+			req->pk_cert_len - (SHA_DIGEST_LENGTH + 2));
+	SHA1_Update(&ctx, req->pk_r, req->pk_r_len);
+	SHA1_Update(&ctx, req->pk_exp, req->pk_exp_len);
+	SHA1_Final(md, &ctx);
 
-	memcpy(tmp, req->pk_cert + 1, req->pk_cert_len -
-		(SHA_DIGEST_LENGTH + 2));
-	tmp += req->pk_cert_len - (SHA_DIGEST_LENGTH + 2);
-	memcpy(tmp, req->pk_r, req->pk_r_len);
-	tmp += req->pk_r_len;
-	memcpy(tmp, req->pk_exp, req->pk_exp_len);
-
-//	printf("Encoded message of %u bytes:\n", msg_len);
-//	hex_dump(msg, msg_len, 16);
-
-	ret = _emsa_pss_decode(msg, msg_len, req->pk_cert, req->pk_cert_len);
+	ret = _emsa_pss_decode(md, req->pk_cert, req->pk_cert_len);
 	if ( !ret )
-		_emv_error(e, EMV_ERR_CERTIFICATE);
-	free(msg);
+		_emv_auth_error(a, EMV_ERR_CERTIFICATE);
 
 	return ret;
 }
 
-static RSA *make_issuer_pk(struct _emv *e, struct sda_req *req)
+static RSA *make_issuer_pk(struct _emv_auth *a, struct sda_req *req)
 {
 	uint8_t *tmp;
 	const uint8_t *kb;
 	size_t kb_len;
 	RSA *key;
 
-	tmp = malloc(req->pk_cert_len);
+	tmp = _emv_auth_scratch(a, req->pk_cert_len);
 	if ( NULL == tmp ) {
-		_emv_sys_error(e);
+		_emv_auth_error(a, EMV_ERR_KEY_SIZE_MISMATCH);
 		return NULL;
 	}
 
 	kb = req->pk_cert + 15;
 	kb_len = req->pk_cert_len - (15 + 21);
+	if ( kb_len + req->pk_r_len > req->pk_cert_len ) {
+		_emv_auth_error(a, EMV_ERR_CERTIFICATE);
+		return NULL;
+	}
 
 	memcpy(tmp, kb, kb_len);
 	memcpy(tmp + kb_len, req->pk_r, req->pk_r_len);
@@ -196,16 +130,14 @@ static RSA *make_issuer_pk(struct _emv *e, struct sda_req *req)
 	hex_dump(kb, req->pk_cert_len, 16);
 	key = RSA_new();
 	if ( NULL == key ) {
-		_emv_sys_error(e);
-		free(tmp);
+		_emv_auth_sys_error(a);
 		return NULL;
 	}
 
 	key->n = BN_bin2bn(tmp, req->pk_cert_len, NULL);
 	key->e = BN_bin2bn(req->pk_exp, req->pk_exp_len, NULL);
-	free(tmp);
 	if ( NULL == key->n || NULL == key->e ) {
-		_emv_sys_error(e);
+		_emv_auth_sys_error(a);
 		RSA_free(key);
 		return NULL;
 	}
@@ -213,143 +145,205 @@ static RSA *make_issuer_pk(struct _emv *e, struct sda_req *req)
 	return key;
 }
 
-static RSA *get_issuer_pk(struct _emv *e, struct sda_req *req,
+static RSA *get_issuer_pk(struct _emv_auth *a, struct sda_req *req,
 				RSA *ca_key, size_t key_len)
 {
+	uint8_t md[SHA_DIGEST_LENGTH];
+	RSA *key;
 
 	if ( req->pk_cert_len != key_len ) {
-		_emv_error(e, EMV_ERR_KEY_SIZE_MISMATCH);
+		_emv_auth_error(a, EMV_ERR_KEY_SIZE_MISMATCH);
 		return NULL;
 	}
 
-	if ( !recover((uint8_t *)req->pk_cert, key_len, ca_key) ) {
-		_emv_error(e, EMV_ERR_RSA_RECOVERY);
+	/* hashed before recovery overwrites our copy of the certificate */
+	_emv_pk_digest(a->a_rid, req->ca_pk_idx, ca_key,
+			req->pk_cert, req->pk_cert_len,
+			req->pk_r, req->pk_r_len,
+			req->pk_exp, req->pk_exp_len, md);
+	key = _emv_pk_lookup(md);
+	if ( key )
+		return key;
+
+	if ( !_emv_auth_recover(a, (uint8_t *)req->pk_cert, key_len, ca_key) ) {
+		_emv_auth_error(a, EMV_ERR_RSA_RECOVERY);
 		return NULL;
 	}
 
 //	printf("recovered issuer pubkey cert:\n");
 //	hex_dump(req->pk_cert, key_len, 16);
 
-	if ( !check_pk_cert(e, req) )
+	if ( !check_pk_cert(a, req) )
 		return NULL;
 
-	return make_issuer_pk(e, req);
+	if ( _emv_pk_revoked(a->a_rid, req->ca_pk_idx, req->pk_cert) ) {
+		_emv_auth_error(a, EMV_ERR_CERT_REVOKED);
+		return NULL;
+	}
+
+	key = make_issuer_pk(a, req);
+	if ( key )
+		_emv_pk_store(a->a_rid, req->ca_pk_idx, md,
+				req->pk_cert, key);
+	return key;
 }
 
-static int check_ssa(struct _emv *e, const uint8_t *ptr, size_t len,
-				struct _emv_data **rec, unsigned int num,
-				const uint8_t *aip)
+/* The records and AIP are hashed straight from the job, no message is built */
+static int check_ssa(struct _emv_auth *a, const uint8_t *ptr, size_t len)
 {
-	uint8_t *tmp, *msg;
-	const uint8_t *cf;
-	size_t msg_len, cf_len, data_len;
-	unsigned int i;
+	uint8_t md[SHA_DIGEST_LENGTH];
+	SHA_CTX ctx;
 	int ret;
 
-	for(data_len = 2, i = 0; i < num; i++)
-		data_len += rec[i]->d_len;
-
-	cf = ptr + 1;
-	cf_len = len - (SHA_DIGEST_LENGTH + 2);
-	msg_len = cf_len + data_len;
-
-	tmp = msg = malloc(msg_len);
-	if ( NULL == msg ) {
-		_emv_sys_error(e);
-		return 0;
-	}
-
-	memcpy(msg, cf, cf_len), tmp += cf_len;
-
-	for(i = 0; i < num; i++) {
-		memcpy(tmp, rec[i]->d_data, rec[i]->d_len);
-		tmp += rec[i]->d_len;
-	}
-
-	memcpy(tmp, aip, 2);
+	SHA1_Init(&ctx);
+	SHA1_Update(&ctx, ptr + 1, len - (SHA_DIGEST_LENGTH + 2));
+	SHA1_Update(&ctx, a->a_sda, a->a_sda_len);
+	SHA1_Update(&ctx, a->a_aip, sizeof(a->a_aip));
+	SHA1_Final(md, &ctx);
 
 #if 0
-	printf("%u byte ssa certificate:\n", msg_len);
+	printf("%zu byte ssa certificate:\n", len);
 	hex_dump(ptr, len, 16);
-
-	printf("%u byte ssa message:\n", msg_len);
-	hex_dump(msg, msg_len, 16);
 #endif
 
-	ret = _emsa_pss_decode(msg, msg_len, ptr, len);
+	ret = _emsa_pss_decode(md, ptr, len);
 	if ( !ret )
-		_emv_error(e, EMV_ERR_SSA_SIGNATURE);
-	free(msg);
+		_emv_auth_error(a, EMV_ERR_SSA_SIGNATURE);
 
 	return ret;
 }
 
-static int verify_ssa_data(struct _emv *e, struct _emv_data **rec,
-				unsigned int num_rec, struct sda_req *req,
-				RSA *iss_key, const uint8_t *aip)
+static int verify_ssa_data(struct _emv_auth *a, struct sda_req *req,
+				RSA *iss_key)
 {
-	if ( !recover((uint8_t *)req->ssa_data, req->ssa_data_len, iss_key) ) {
-		_emv_error(e, EMV_ERR_RSA_RECOVERY);
+	if ( !_emv_auth_recover(a, (uint8_t *)req->ssa_data,
+				req->ssa_data_len, iss_key) ) {
+		_emv_auth_error(a, EMV_ERR_RSA_RECOVERY);
 		return 0;
 	}
 
 	if ( req->ssa_data[0] != 0x6a ) {
-		_emv_error(e, EMV_ERR_SSA_SIGNATURE);
+		_emv_auth_error(a, EMV_ERR_SSA_SIGNATURE);
 		return 0;
 	}
 	
 	if ( req->ssa_data[1] != 0x03 ) {
-		_emv_error(e, EMV_ERR_SSA_SIGNATURE);
+		_emv_auth_error(a, EMV_ERR_SSA_SIGNATURE);
 		return 0;
 	}
 
 	if ( req->ssa_data[2] != 0x01 ) {
-		_emv_error(e, EMV_ERR_SSA_SIGNATURE);
+		_emv_auth_error(a, EMV_ERR_SSA_SIGNATURE);
 		return 0;
 	}
 
-	return check_ssa(e, req->ssa_data, req->ssa_data_len,
-			rec, num_rec, aip);
+	return check_ssa(a, req->ssa_data, req->ssa_data_len);
 }
 
-int emv_authenticate_static_data(emv_t e, emv_mod_cb_t mod, emv_exp_cb_t exp,
-					void *priv)
+static int sda_verify(struct _emv_auth *a)
 {
-	struct sda_req req;
-	size_t ca_key_len;
-	RSA *ca_key;
+	struct sda_req *req = a->a_req;
+
+	a->a_iss_pk = get_issuer_pk(a, req, a->a_ca_pk, a->a_ca_pk_len);
+	if ( NULL == a->a_iss_pk )
+		return 0;
+
+	if ( !verify_ssa_data(a, req, a->a_iss_pk) )
+		return 0;
+
+	a->a_sda_ok = 1;
+	return 1;
+}
+
+/* Private copies of the certificates, recovery happens in place */
+static int dup_req(struct _emv_auth *a, struct sda_req *req)
+{
+	req->pk_cert = _emv_auth_dup(a, req->pk_cert, req->pk_cert_len);
+	req->pk_r = _emv_auth_dup(a, req->pk_r, req->pk_r_len);
+	req->pk_exp = _emv_auth_dup(a, req->pk_exp, req->pk_exp_len);
+	req->ssa_data = _emv_auth_dup(a, req->ssa_data, req->ssa_data_len);
+	return req->pk_cert && req->pk_r && req->pk_exp && req->ssa_data;
+}
+
+/* Everything which needs the card is done here, on the caller's thread */
+static struct _emv_auth *sda_prepare(emv_t e, emv_mod_cb_t mod,
+					emv_exp_cb_t exp, void *priv)
+{
+	struct _emv_auth *a;
+	struct sda_req *req;
 
 	if ( e->e_sda_ok )
-		return 1;
+		return _emv_auth_new(e, NULL);
 
 	if ( !(e->e_aip[0] & EMV_AIP_SDA) ) {
 		_emv_error(e, EMV_ERR_FUNC_NOT_SUPPORTED);
-		return 0;
+		return NULL;
+	}
+
+	a = _emv_auth_new(e, sda_verify);
+	if ( NULL == a )
+		return NULL;
+
+	req = gang_alloc0(a->a_mem, sizeof(*req));
+	if ( NULL == req ) {
+		_emv_sys_error(e);
+		goto err;
 	}
+	a->a_req = req;
 
-	if ( !get_required_data(e, &req) ) {
+	if ( !get_required_data(e, req) ) {
 		_emv_error(e, EMV_ERR_DATA_ELEMENT_NOT_FOUND);
-		return 0;
+		goto err;
+	}
+
+	if ( !dup_req(a, req) ) {
+		_emv_sys_error(e);
+		goto err;
 	}
 
-	ca_key = get_ca_key(req.ca_pk_idx, mod, exp, &ca_key_len, priv);
-	if ( NULL == ca_key ) {
+	a->a_ca_pk = _emv_ca_key(e, req->ca_pk_idx, mod, exp,
+					&a->a_ca_pk_len, priv);
+	if ( NULL == a->a_ca_pk ) {
 		_emv_error(e, EMV_ERR_KEY_NOT_FOUND);
-		return 0;
+		goto err;
 	}
 
-	e->e_ca_pk = ca_key;
+	if ( !_emv_auth_sda_records(a) )
+		goto err;
 
-	e->e_iss_pk = get_issuer_pk(e, &req, ca_key, ca_key_len);
-	if ( NULL == e->e_iss_pk )
+	return a;
+err:
+	_emv_auth_free(a);
+	return NULL;
+}
+
+int emv_authenticate_static_data(emv_t e, emv_mod_cb_t mod, emv_exp_cb_t exp,
+					void *priv)
+{
+	struct _emv_auth *a;
+
+	a = sda_prepare(e, mod, exp, priv);
+	if ( NULL == a )
 		return 0;
 
-	if ( !verify_ssa_data(e, e->e_db.db_sda, e->e_db.db_numsda,
-				&req, e->e_iss_pk, e->e_aip) )
+	return _emv_auth_run(a);
+}
+
+/* As emv_authenticate_static_data() but only the card reads are done before
+ * returning. The RSA and hash checks are done on the worker pool and the
+ * outcome is delivered to cb by emv_auth_complete().
+ */
+int emv_authenticate_static_data_async(emv_t e, emv_mod_cb_t mod,
+					emv_exp_cb_t exp, void *priv,
+					emv_auth_cb_t cb, void *cb_priv)
+{
+	struct _emv_auth *a;
+
+	a = sda_prepare(e, mod, exp, priv);
+	if ( NULL == a )
 		return 0;
 
-	e->e_sda_ok = 1;
-	return 1;
+	return _emv_auth_submit(a, cb, cb_priv);
 }
 
 int emv_sda_ok(emv_t e)
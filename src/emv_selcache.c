@@ -0,0 +1,259 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2008 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Application selection result cache. Entries are keyed on a hash of the ATR
+ * and the FCI returned when selecting the PSE, and hold the parsed payment
+ * system directory plus the FCI of every application selected under it. A
+ * directory hit assumes that cards which look identical up to that point have
+ * identical directories, which is why the cache is disabled by default. A
+ * cached FCI is only used if it matches the SELECT response byte for byte.
+*/
+
+#include <ccid.h>
+#include <list.h>
+#include <emv.h>
+#include <pthread.h>
+#include "emv-internal.h"
+
+#define SEL_MAX_FCI	8
+
+struct sel_fci {
+	struct list_head	f_list;
+	struct _emv_app		f_app;
+	size_t			f_len;
+	uint8_t			f_buf[0];
+};
+
+struct sel_ent {
+	struct list_head	s_list;
+	uint8_t			s_md[SHA_DIGEST_LENGTH];
+	unsigned int		s_num_apps;
+	struct _emv_app		*s_apps;
+	struct list_head	s_fci;
+	unsigned int		s_num_fci;
+};
+
+static pthread_mutex_t sel_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(sel_lru);
+static unsigned int sel_num;
+static unsigned int sel_max;
+
+static void sel_ent_free(struct sel_ent *s)
+{
+	struct sel_fci *f, *tmp;
+
+	list_for_each_entry_safe(f, tmp, &s->s_fci, f_list) {
+		list_del(&f->f_list);
+		free(f);
+	}
+	list_del(&s->s_list);
+	free(s->s_apps);
+	free(s);
+	sel_num--;
+}
+
+/* Called with sel_lock held */
+static struct sel_ent *sel_find(const uint8_t *md)
+{
+	struct sel_ent *s;
+
+	list_for_each_entry(s, &sel_lru, s_list) {
+		if ( memcmp(s->s_md, md, sizeof(s->s_md)) )
+			continue;
+		list_move(&s->s_list, &sel_lru);
+		return s;
+	}
+
+	return NULL;
+}
+
+/* Work out the key for the card from its ATR and PSE FCI, returns zero if
+ * the cache is disabled or the card can't be identified.
+ */
+int _emv_sel_key(emv_t e, const uint8_t *fci, size_t len)
+{
+	const uint8_t *atr;
+	size_t atr_len;
+	SHA_CTX ctx;
+
+	e->e_sel_key = 0;
+
+	if ( !sel_max )
+		return 0;
+
+	atr = cci_atr(e->e_dev, &atr_len);
+	if ( NULL == atr )
+		return 0;
+
+	SHA1_Init(&ctx);
+	SHA1_Update(&ctx, atr, atr_len);
+	SHA1_Update(&ctx, fci, len);
+	SHA1_Final(e->e_sel_md, &ctx);
+	e->e_sel_key = 1;
+	return 1;
+}
+
+/* Fill in the application list from the cache, returns zero on a miss */
+int _emv_sel_lookup(emv_t e)
+{
+	struct _emv_app *a, *tmp;
+	struct sel_ent *s;
+	unsigned int i;
+	int ret = 0;
+
+	if ( !e->e_sel_key )
+		return 0;
+
+	pthread_mutex_lock(&sel_lock);
+
+	s = sel_find(e->e_sel_md);
+	if ( NULL == s )
+		goto out;
+
+	for(i = 0; i < s->s_num_apps; i++) {
+		a = _emv_app_alloc(e);
+		if ( NULL == a )
+			goto err;
+		memcpy(a, &s->s_apps[i], sizeof(*a));
+		list_add_tail(&a->a_list, &e->e_apps);
+		e->e_num_apps++;
+	}
+
+	ret = 1;
+	goto out;
+err:
+	list_for_each_entry_safe(a, tmp, &e->e_apps, a_list) {
+		list_del(&a->a_list);
+		_emv_app_put(e, a);
+	}
+	e->e_num_apps = 0;
+out:
+	pthread_mutex_unlock(&sel_lock);
+	return ret;
+}
+
+/* Remember the application list which was just read from the card */
+void _emv_sel_store(emv_t e)
+{
+	struct _emv_app *a;
+	struct sel_ent *s;
+	unsigned int i;
+
+	if ( !e->e_sel_key )
+		return;
+
+	pthread_mutex_lock(&sel_lock);
+
+	if ( !sel_max || sel_find(e->e_sel_md) )
+		goto out;
+
+	s = calloc(1, sizeof(*s));
+	if ( NULL == s )
+		goto out;
+
+	if ( e->e_num_apps ) {
+		s->s_apps = calloc(e->e_num_apps, sizeof(*s->s_apps));
+		if ( NULL == s->s_apps ) {
+			free(s);
+			goto out;
+		}
+	}
+
+	i = 0;
+	list_for_each_entry(a, &e->e_apps, a_list)
+		memcpy(&s->s_apps[i++], a, sizeof(*a));
+
+	memcpy(s->s_md, e->e_sel_md, sizeof(s->s_md));
+	s->s_num_apps = e->e_num_apps;
+	INIT_LIST_HEAD(&s->s_fci);
+
+	while ( sel_num >= sel_max )
+		sel_ent_free(list_entry(sel_lru.prev, struct sel_ent, s_list));
+
+	list_add(&s->s_list, &sel_lru);
+	sel_num++;
+out:
+	pthread_mutex_unlock(&sel_lock);
+}
+
+/* Parse a SELECT response from the cache if it has been seen before under
+ * the current PSE, returns zero on a miss.
+ */
+int _emv_sel_fci(emv_t e, const uint8_t *fci, size_t len,
+			struct _emv_app *a)
+{
+	struct sel_fci *f;
+	struct sel_ent *s;
+	int ret = 0;
+
+	if ( !e->e_sel_key )
+		return 0;
+
+	pthread_mutex_lock(&sel_lock);
+
+	s = sel_find(e->e_sel_md);
+	if ( NULL == s )
+		goto out;
+
+	list_for_each_entry(f, &s->s_fci, f_list) {
+		if ( f->f_len != len || memcmp(f->f_buf, fci, len) )
+			continue;
+		memcpy(a, &f->f_app, sizeof(*a));
+		ret = 1;
+		break;
+	}
+
+out:
+	pthread_mutex_unlock(&sel_lock);
+	return ret;
+}
+
+void _emv_sel_fci_store(emv_t e, const uint8_t *fci, size_t len,
+			const struct _emv_app *a)
+{
+	struct sel_fci *f;
+	struct sel_ent *s;
+
+	if ( !e->e_sel_key )
+		return;
+
+	pthread_mutex_lock(&sel_lock);
+
+	s = sel_find(e->e_sel_md);
+	if ( NULL == s || s->s_num_fci >= SEL_MAX_FCI )
+		goto out;
+
+	f = malloc(sizeof(*f) + len);
+	if ( NULL == f )
+		goto out;
+
+	memcpy(&f->f_app, a, sizeof(f->f_app));
+	f->f_len = len;
+	memcpy(f->f_buf, fci, len);
+	list_add_tail(&f->f_list, &s->s_fci);
+	s->s_num_fci++;
+out:
+	pthread_mutex_unlock(&sel_lock);
+}
+
+/* Set the maximum number of cached cards, zero disables the cache */
+void emv_appsel_cache_size(unsigned int max)
+{
+	pthread_mutex_lock(&sel_lock);
+	sel_max = max;
+	while ( sel_num > sel_max )
+		sel_ent_free(list_entry(sel_lru.prev, struct sel_ent, s_list));
+	pthread_mutex_unlock(&sel_lock);
+}
+
+void emv_appsel_cache_flush(void)
+{
+	struct sel_ent *s, *tmp;
+
+	pthread_mutex_lock(&sel_lock);
+	list_for_each_entry_safe(s, tmp, &sel_lru, s_list)
+		sel_ent_free(s);
+	pthread_mutex_unlock(&sel_lock);
+}
@@ -0,0 +1,554 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2008 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Snapshots of decoded card data. The records are written out as the blocks
+ * built by emv_data.c, nodes already refer to their data and children by
+ * relative offset, so only the pointer arrays need fixing up after the file
+ * is mapped back in. Pointer slots are stored as file offsets, they are
+ * relocated in place in a private mapping, and so only the pages which hold
+ * them get copied. The format is native to the machine which wrote it, the
+ * header says which that was and files from anywhere else are refused.
+*/
+
+#include <ccid.h>
+#include <list.h>
+#include <emv.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "emv-internal.h"
+#include "emv-snap.h"
+
+static size_t snap_align(size_t len)
+{
+	return (len + (SNAP_ALIGN - 1)) & ~(size_t)(SNAP_ALIGN - 1);
+}
+
+/* Number of nodes in a record block, the root's children start the pointer
+ * area which comes straight after the node array.
+ */
+static unsigned int rec_nodes(const struct _emv_data *d)
+{
+	if ( !d->d_nmemb )
+		return 1;
+	return d->d_elem / sizeof(*d);
+}
+
+/* 64 bits, a 32 bit d_off from a file plus d_len must not wrap */
+static uint64_t rec_size(const struct _emv_data *d)
+{
+	return (uint64_t)d->d_off + d->d_len;
+}
+
+struct snap_ctx {
+	const struct _emv_db	*c_db;
+	uint64_t		*c_off;
+	unsigned int		c_numrec;
+};
+
+/* File offset of a node, by the record block which contains it */
+static uint64_t snap_off(const struct snap_ctx *c, const void *ptr)
+{
+	const uint8_t *p = ptr, *r;
+	unsigned int i;
+
+	if ( NULL == ptr )
+		return 0;
+
+	for(i = 0; i < c->c_numrec; i++) {
+		r = (const uint8_t *)c->c_db->db_rec[i];
+		if ( p >= r && p < r + rec_size(c->c_db->db_rec[i]) )
+			return c->c_off[i] + (p - r);
+	}
+
+	return 0;
+}
+
+static void snap_slots(const struct snap_ctx *c, uint8_t *img, uint64_t off,
+			struct _emv_data * const *ptrs, unsigned int n)
+{
+	uintptr_t *slot = (uintptr_t *)(img + off);
+	unsigned int i;
+
+	for(i = 0; i < n; i++)
+		slot[i] = snap_off(c, ptrs[i]);
+}
+
+static void snap_app(struct snap_app *s, const struct _emv_app *a)
+{
+	if ( NULL == a )
+		return;
+
+	s->s_present = 1;
+	s->s_recno = a->a_recno;
+	s->s_prio = a->a_prio;
+	s->s_id_sz = a->a_id_sz;
+	memcpy(s->s_id, a->a_id, sizeof(s->s_id));
+	memcpy(s->s_name, a->a_name, sizeof(s->s_name));
+	memcpy(s->s_pname, a->a_pname, sizeof(s->s_pname));
+}
+
+/* Write the records read so far, and what's needed to make sense of them,
+ * to a file which emv_db_load() can map back in.
+ */
+int emv_db_save(emv_t e, const char *fn)
+{
+	const struct _emv_db *db = &e->e_db;
+	struct snap_ctx c;
+	struct snap_hdr *h;
+	struct _emv_data *d;
+	unsigned int i, n;
+	uint8_t *img = NULL;
+	size_t size;
+	FILE *f;
+	int ret = 0;
+
+	c.c_db = db;
+	c.c_numrec = db->db_numread;
+	c.c_off = calloc(c.c_numrec ? c.c_numrec : 1, sizeof(*c.c_off));
+	if ( NULL == c.c_off ) {
+		_emv_sys_error(e);
+		return 0;
+	}
+
+	size = snap_align(sizeof(*h));
+	for(i = 0; i < c.c_numrec; i++) {
+		c.c_off[i] = size;
+		size = snap_align(size + rec_size(db->db_rec[i]));
+	}
+
+	img = calloc(1, size + snap_align(db->db_sdalen) +
+			snap_align(e->e_afl_len) +
+			(c.c_numrec + db->db_sdaread + db->db_nmemb) *
+			sizeof(uintptr_t));
+	if ( NULL == img ) {
+		_emv_sys_error(e);
+		goto out;
+	}
+
+	h = (struct snap_hdr *)img;
+	h->h_magic = SNAP_MAGIC;
+	h->h_version = SNAP_VERSION;
+	h->h_ptr_size = sizeof(void *);
+	h->h_node_size = sizeof(struct _emv_data);
+
+	/* record blocks, with their pointer arrays made in to offsets */
+	for(i = 0; i < c.c_numrec; i++) {
+		d = db->db_rec[i];
+		memcpy(img + c.c_off[i], d, rec_size(d));
+		n = rec_nodes(d);
+		snap_slots(&c, img, c.c_off[i] + n * sizeof(*d),
+				(struct _emv_data **)(d + n), n - 1);
+	}
+
+	h->h_rec = size;
+	h->h_numrec = c.c_numrec;
+	snap_slots(&c, img, size, db->db_rec, c.c_numrec);
+	size += c.c_numrec * sizeof(uintptr_t);
+
+	h->h_sda = size;
+	h->h_numsda = db->db_sdaread;
+	snap_slots(&c, img, size, db->db_sda, db->db_sdaread);
+	size += db->db_sdaread * sizeof(uintptr_t);
+
+	h->h_elem = size;
+	h->h_nmemb = db->db_nmemb;
+	snap_slots(&c, img, size, db->db_elem, db->db_nmemb);
+	size += db->db_nmemb * sizeof(uintptr_t);
+
+	h->h_sdabuf = size;
+	h->h_sdalen = db->db_sdalen;
+	if ( db->db_sdalen )
+		memcpy(img + size, db->db_sdabuf, db->db_sdalen);
+	size = snap_align(size + db->db_sdalen);
+
+	h->h_afl = size;
+	h->h_afl_len = e->e_afl_len;
+	if ( e->e_afl_len )
+		memcpy(img + size, e->e_afl, e->e_afl_len);
+	size = snap_align(size + e->e_afl_len);
+
+	memcpy(h->h_aip, e->e_aip, sizeof(h->h_aip));
+	snap_app(&h->h_app, e->e_app);
+	h->h_size = size;
+
+	f = fopen(fn, "w");
+	if ( NULL == f ) {
+		_emv_sys_error(e);
+		goto out;
+	}
+
+	if ( fwrite(img, size, 1, f) != 1 ) {
+		_emv_sys_error(e);
+		fclose(f);
+		goto out;
+	}
+
+	if ( fclose(f) ) {
+		_emv_sys_error(e);
+		goto out;
+	}
+
+	_emv_success(e);
+	ret = 1;
+out:
+	free(img);
+	free(c.c_off);
+	return ret;
+}
+
+/* Nothing is relocated until the whole file is known to be sane, first the
+ * layout is checked using file offsets only. A file offset is a node if it
+ * is a whole number of nodes in to the node array of one of the records.
+ */
+struct snap_range {
+	uint64_t	r_off;
+	uint64_t	r_len;
+};
+
+static int range_cmp(const void *A, const void *B)
+{
+	const struct snap_range *a = A, *b = B;
+
+	if ( a->r_off < b->r_off )
+		return -1;
+	return (a->r_off > b->r_off);
+}
+
+static const uintptr_t *file_slots(const uint8_t *map, uint64_t off)
+{
+	return (const uintptr_t *)(map + off);
+}
+
+/* An array of n pointer slots lies within the file */
+static int check_slots(uint64_t size, uint64_t off, unsigned int n)
+{
+	return !(off % sizeof(uintptr_t)) && off <= size &&
+		n <= (size - off) / sizeof(uintptr_t);
+}
+
+static const struct _emv_data *file_node(const uint8_t *map, uint64_t size,
+						uint64_t off)
+{
+	if ( off < snap_align(sizeof(struct snap_hdr)) || off % SNAP_ALIGN ||
+			off > size - sizeof(struct _emv_data) )
+		return NULL;
+	return (const struct _emv_data *)(map + off);
+}
+
+/* Offset of the pointer slots which follow the node array of a record */
+static uint64_t rec_slots(uint64_t off, const struct _emv_data *r)
+{
+	return off + rec_nodes(r) * sizeof(*r);
+}
+
+/* Check every node of a record block stays within it, and that the
+ * children of each node are its own, back to back in the node array.
+ */
+static int check_rec(const uint8_t *map, uint64_t size, uint64_t off)
+{
+	const struct _emv_data *r, *d;
+	const uintptr_t *slot;
+	uint64_t nodes, slots, blk, v;
+	unsigned int n, i, j;
+
+	r = file_node(map, size, off);
+	if ( NULL == r )
+		return 0;
+
+	if ( r->d_nmemb && (r->d_elem % sizeof(*r) ||
+				r->d_elem < 2 * sizeof(*r)) )
+		return 0;
+
+	n = rec_nodes(r);
+	if ( (uint64_t)n * sizeof(*r) > size - off )
+		return 0;
+
+	nodes = (uint64_t)n * sizeof(*r);
+	slots = nodes + (uint64_t)(n - 1) * sizeof(uintptr_t);
+	blk = rec_size(r);
+	if ( blk < slots || blk > size - off || r->d_off < slots )
+		return 0;
+
+	for(i = 0, d = r; i < n; i++, d++) {
+		uint64_t doff = off + (uint64_t)i * sizeof(*r);
+
+		if ( rec_size(d) > blk - (uint64_t)i * sizeof(*r) )
+			return 0;
+		if ( !d->d_nmemb )
+			continue;
+
+		v = doff + d->d_elem;
+		if ( d->d_elem % sizeof(uintptr_t) || v < off + nodes ||
+				v + d->d_nmemb * sizeof(uintptr_t) >
+				off + slots )
+			return 0;
+
+		slot = file_slots(map, v);
+		for(j = 0; j < d->d_nmemb; j++) {
+			if ( slot[j] <= doff || slot[j] >= off + nodes ||
+					(slot[j] - off) % sizeof(*r) ||
+					slot[j] != slot[0] + j * sizeof(*r) )
+				return 0;
+		}
+	}
+
+	return 1;
+}
+
+static int is_rec(const uint8_t *map, const struct snap_hdr *h, uint64_t v)
+{
+	const uintptr_t *rec = file_slots(map, h->h_rec);
+	unsigned int i;
+
+	for(i = 0; i < h->h_numrec; i++) {
+		if ( rec[i] == v )
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Index entries have to be nodes of one of the checked records */
+static int is_node(const uint8_t *map, const struct snap_hdr *h, uint64_t v)
+{
+	const uintptr_t *rec = file_slots(map, h->h_rec);
+	const struct _emv_data *r;
+	unsigned int i;
+
+	for(i = 0; i < h->h_numrec; i++) {
+		r = (const struct _emv_data *)(map + rec[i]);
+		if ( v >= rec[i] && v < rec_slots(rec[i], r) &&
+				!((v - rec[i]) % sizeof(*r)) )
+			return 1;
+	}
+
+	return 0;
+}
+
+static void add_range(struct snap_range *rng, unsigned int *num,
+			uint64_t off, uint64_t len)
+{
+	if ( !len )
+		return;
+	rng[*num].r_off = off;
+	rng[*num].r_len = len;
+	(*num)++;
+}
+
+/* Header, pointer arrays, buffers and record blocks must not overlap, or
+ * relocating one could change another which was already checked.
+ */
+static int check_disjoint(const uint8_t *map, const struct snap_hdr *h)
+{
+	const uintptr_t *rec = file_slots(map, h->h_rec);
+	struct snap_range *rng;
+	unsigned int i, num = 0;
+	int ret = 0;
+
+	rng = malloc((h->h_numrec + 6) * sizeof(*rng));
+	if ( NULL == rng )
+		return 0;
+
+	add_range(rng, &num, 0, snap_align(sizeof(*h)));
+	add_range(rng, &num, h->h_rec,
+			(uint64_t)h->h_numrec * sizeof(uintptr_t));
+	add_range(rng, &num, h->h_sda,
+			(uint64_t)h->h_numsda * sizeof(uintptr_t));
+	add_range(rng, &num, h->h_elem,
+			(uint64_t)h->h_nmemb * sizeof(uintptr_t));
+	add_range(rng, &num, h->h_sdabuf, h->h_sdalen);
+	add_range(rng, &num, h->h_afl, h->h_afl_len);
+	for(i = 0; i < h->h_numrec; i++)
+		add_range(rng, &num, rec[i],
+			rec_size((const struct _emv_data *)(map + rec[i])));
+
+	qsort(rng, num, sizeof(*rng), range_cmp);
+	for(i = 1; i < num; i++) {
+		if ( rng[i].r_off < rng[i - 1].r_off + rng[i - 1].r_len )
+			goto out;
+	}
+
+	ret = 1;
+out:
+	free(rng);
+	return ret;
+}
+
+static int check_db(const uint8_t *map, uint64_t size,
+			const struct snap_hdr *h)
+{
+	const uintptr_t *slot;
+	unsigned int i;
+
+	if ( h->h_magic != SNAP_MAGIC || h->h_version != SNAP_VERSION ||
+			h->h_ptr_size != sizeof(void *) ||
+			h->h_node_size != sizeof(struct _emv_data) ||
+			h->h_size != size )
+		return 0;
+
+	if ( h->h_numsda > h->h_numrec )
+		return 0;
+
+	if ( !check_slots(size, h->h_rec, h->h_numrec) ||
+			!check_slots(size, h->h_sda, h->h_numsda) ||
+			!check_slots(size, h->h_elem, h->h_nmemb) )
+		return 0;
+
+	if ( h->h_sdabuf > size || h->h_sdalen > size - h->h_sdabuf )
+		return 0;
+	if ( h->h_afl > size || h->h_afl_len > size - h->h_afl )
+		return 0;
+
+	slot = file_slots(map, h->h_rec);
+	for(i = 0; i < h->h_numrec; i++) {
+		if ( !check_rec(map, size, slot[i]) )
+			return 0;
+	}
+
+	slot = file_slots(map, h->h_sda);
+	for(i = 0; i < h->h_numsda; i++) {
+		if ( !is_rec(map, h, slot[i]) )
+			return 0;
+	}
+
+	slot = file_slots(map, h->h_elem);
+	for(i = 0; i < h->h_nmemb; i++) {
+		if ( !is_node(map, h, slot[i]) )
+			return 0;
+	}
+
+	return check_disjoint(map, h);
+}
+
+/* Turn an array of file offsets, already checked, in to pointers */
+static void load_slots(uint8_t *map, uint64_t off, unsigned int n)
+{
+	uintptr_t *slot = (uintptr_t *)(map + off);
+	unsigned int i;
+
+	for(i = 0; i < n; i++)
+		slot[i] = (uintptr_t)(map + slot[i]);
+}
+
+static int load_app(struct _emv *e, const struct snap_app *s)
+{
+	struct _emv_app *a;
+
+	if ( !s->s_present )
+		return 1;
+
+	if ( s->s_id_sz > sizeof(a->a_id) )
+		return 0;
+
+	a = _emv_app_alloc(e);
+	if ( NULL == a )
+		return 0;
+
+	a->a_recno = s->s_recno;
+	a->a_prio = s->s_prio;
+	a->a_id_sz = s->s_id_sz;
+	memcpy(a->a_id, s->s_id, sizeof(a->a_id));
+	memcpy(a->a_name, s->s_name, sizeof(a->a_name));
+	memcpy(a->a_pname, s->s_pname, sizeof(a->a_pname));
+	a->a_name[sizeof(a->a_name) - 1] = '\0';
+	a->a_pname[sizeof(a->a_pname) - 1] = '\0';
+	e->e_app = a;
+	return 1;
+}
+
+static int load_db(struct _emv *e, uint8_t *map, uint64_t size)
+{
+	struct snap_hdr *h = (struct snap_hdr *)map;
+	struct _emv_db *db = &e->e_db;
+	struct _emv_data *r;
+	unsigned int i;
+
+	if ( !check_db(map, size, h) )
+		return 0;
+
+	/* record slots first, while they're still offsets */
+	for(i = 0; i < h->h_numrec; i++) {
+		uint64_t off = file_slots(map, h->h_rec)[i];
+
+		r = (struct _emv_data *)(map + off);
+		load_slots(map, rec_slots(off, r), rec_nodes(r) - 1);
+	}
+
+	load_slots(map, h->h_rec, h->h_numrec);
+	load_slots(map, h->h_sda, h->h_numsda);
+	load_slots(map, h->h_elem, h->h_nmemb);
+
+	db->db_rec = (struct _emv_data **)(map + h->h_rec);
+	db->db_sda = (struct _emv_data **)(map + h->h_sda);
+	db->db_elem = (struct _emv_data **)(map + h->h_elem);
+
+	db->db_numrec = db->db_numread = h->h_numrec;
+	db->db_numsda = db->db_sdaread = db->db_lastsda = h->h_numsda;
+	db->db_nmemb = db->db_elem_max = h->h_nmemb;
+	db->db_sdabuf = map + h->h_sdabuf;
+	db->db_sdalen = h->h_sdalen;
+
+	if ( !_emv_db_index_slots(e) )
+		return 0;
+
+	if ( h->h_afl_len ) {
+		e->e_afl = malloc(h->h_afl_len);
+		if ( NULL == e->e_afl )
+			return 0;
+		memcpy(e->e_afl, map + h->h_afl, h->h_afl_len);
+		e->e_afl_len = e->e_afl_max = h->h_afl_len;
+	}
+
+	memcpy(e->e_aip, h->h_aip, sizeof(e->e_aip));
+	return load_app(e, &h->h_app);
+}
+
+/* Map a file written by emv_db_save(). The returned emv_t has no card, only
+ * the application data accessors may be used on it, and emv_fini() on it
+ * unmaps the file.
+ */
+emv_t emv_db_load(const char *fn)
+{
+	struct _emv *e;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(fn, O_RDONLY);
+	if ( fd < 0 )
+		return NULL;
+
+	if ( fstat(fd, &st) || st.st_size < (off_t)sizeof(struct snap_hdr) ) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE, fd, 0);
+	close(fd);
+	if ( MAP_FAILED == map )
+		return NULL;
+
+	e = _emv_new(NULL);
+	if ( NULL == e ) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	e->e_map = map;
+	e->e_map_len = st.st_size;
+
+	if ( !load_db(e, map, st.st_size) ) {
+		errno = EINVAL;
+		emv_fini(e);
+		return NULL;
+	}
+
+	_emv_success(e);
+	return e;
+}
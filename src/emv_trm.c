@@ -25,8 +25,8 @@ static int bop_atc(const uint8_t *ptr, size_t len, void *priv)
 static int atc(struct _emv *e, int online)
 {
 	static const struct ber_tag tags[] = {
-		{ .tag = "\x9f\x13", .tag_len = 2, .op = bop_atc},
-		{ .tag = "\x9f\x36", .tag_len = 2, .op = bop_atc},
+		{ .tag = 0x9f13, .op = bop_atc},
+		{ .tag = 0x9f36, .op = bop_atc},
 	};
 	const uint8_t *ptr;
 	size_t len;
@@ -8,6 +8,10 @@
 #include <emv.h>
 
 #include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "ca_pubkeys.h"
 
@@ -58,7 +62,7 @@ static int app_supported(emv_app_t a)
 }
 
 /* Step 0. Select application */
-static int select_app(emv_t e)
+static int select_app(emv_t e, int verbose)
 {
 	emv_app_t app;
 	unsigned int i;
@@ -67,23 +71,28 @@ static int select_app(emv_t e)
 	if ( emv_appsel_pse(e) ) {
 		for(app = emv_appsel_pse_first(e); app; ) {
 			if ( !app_supported(app) ) {
-				printf("emvtool: unsupported PSE app: %s\n",
-					emv_app_pname(app));
+				if ( verbose )
+					printf("emvtool: unsupported PSE "
+						"app: %s\n",
+						emv_app_pname(app));
 				emv_app_t f = app;
 				app = emv_appsel_pse_next(e, app);
 				emv_app_delete(f);
 				continue;
 			}
-			printf("emvtool: PSE app: %s\n",
-				emv_app_pname(app));
+			if ( verbose )
+				printf("emvtool: PSE app: %s\n",
+					emv_app_pname(app));
 			app = emv_appsel_pse_next(e, app);
 		}
 
 		for(app = emv_appsel_pse_first(e); app;
 			app = emv_appsel_pse_next(e, app)) {
 			if ( emv_app_select_pse(e, app) ) {
-				printf("emvtool: Selected PSE app: %s\n",
-					emv_app_pname(app));
+				if ( verbose )
+					printf("emvtool: Selected PSE "
+						"app: %s\n",
+						emv_app_pname(app));
 				return 1;
 			}
 		}
@@ -96,8 +105,9 @@ static int select_app(emv_t e)
 
 		app = emv_current_app(e);
 		if ( !app_cmp(app, apps + i) ) {
-			printf("emvtool: Selected AID app: %s\n",
-				emv_app_pname(app));
+			if ( verbose )
+				printf("emvtool: Selected AID app: %s\n",
+					emv_app_pname(app));
 			return 1;
 		}
 
@@ -106,8 +116,9 @@ static int select_app(emv_t e)
 			app = emv_current_app(e);
 			if ( app_cmp(app, apps + i) )
 				continue;
-			printf("emvtool: Selected partial AID app: %s\n",
-				emv_app_pname(app));
+			if ( verbose )
+				printf("emvtool: Selected partial AID "
+					"app: %s\n", emv_app_pname(app));
 			return 1;
 		}
 	}
@@ -162,7 +173,7 @@ static int do_emv_stuff(cci_t cc)
 		return 0;
 	}
 
-	if ( !select_app(e) )
+	if ( !select_app(e, 1) )
 		goto end;
 
 
@@ -255,10 +266,468 @@ out:
 	return ret;
 }
 
+/* Batch mode: every slot and field of every reader is watched for cards, one
+ * thread per reader, and each card found is put through the pipeline up to
+ * the chosen stage. One line of JSON is written for each card.
+ */
+#define BATCH_POLL_USEC		250000
+#define BATCH_DOL_MAX		256
+
+#define ST_POWER	0
+#define ST_APPSEL	1
+#define ST_INIT		2
+#define ST_READ		3
+#define ST_AUTH		4
+#define ST_AC		5
+#define ST_MAX		6
+
+static const char * const stage_name[ST_MAX] = {
+	[ST_POWER] = "power",
+	[ST_APPSEL] = "appsel",
+	[ST_INIT] = "init",
+	[ST_READ] = "read",
+	[ST_AUTH] = "auth",
+	[ST_AC] = "ac",
+};
+
+struct batch {
+	unsigned int	b_last; /* last stage to run */
+	int		b_once; /* only the cards present at startup */
+};
+
+struct reader {
+	const struct batch	*r_batch;
+	ccid_t			r_ccid;
+	pthread_t		r_thread;
+	int			r_running;
+};
+
+struct card {
+	const char	*c_type;
+	unsigned int	c_idx;
+	unsigned int	c_stages; /* number completed */
+	uint64_t	c_usec[ST_MAX];
+	const char	*c_app;
+	const char	*c_auth;
+	const char	*c_err;
+	size_t		c_ac_len;
+	uint8_t		c_cid;
+};
+
+static volatile sig_atomic_t stop;
+
+static void sig_stop(int sig)
+{
+	stop = 1;
+}
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int stage_by_name(const char *str, unsigned int *st)
+{
+	unsigned int i;
+
+	/* powering up is always done */
+	for(i = ST_APPSEL; i < ST_MAX; i++) {
+		if ( !strcmp(str, stage_name[i]) ) {
+			*st = i;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void json_str(const char *str)
+{
+	for(; *str; str++) {
+		switch(*str) {
+		case '"':
+		case '\\':
+			printf("\\%c", *str);
+			break;
+		default:
+			if ( (unsigned char)*str < 0x20 )
+				printf("\\u%.4x", (unsigned char)*str);
+			else
+				putchar(*str);
+			break;
+		}
+	}
+}
+
+static void card_report(ccid_t ccid, const struct card *c)
+{
+	unsigned int i, num;
+	uint64_t total = 0;
+
+	/* including the one which failed */
+	num = c->c_stages + ((c->c_err) ? 1 : 0);
+
+	flockfile(stdout);
+
+	printf("{\"reader\":\"");
+	json_str(ccid_name(ccid));
+	printf("\",\"bus\":%u,\"addr\":%u,\"%s\":%u",
+		ccid_bus(ccid), ccid_addr(ccid), c->c_type, c->c_idx);
+
+	printf(",\"ok\":%s", (c->c_err) ? "false" : "true");
+	if ( c->c_err ) {
+		printf(",\"failed\":\"%s\",\"error\":\"",
+			stage_name[c->c_stages]);
+		json_str(c->c_err);
+		printf("\"");
+	}
+
+	if ( c->c_app ) {
+		printf(",\"app\":\"");
+		json_str(c->c_app);
+		printf("\"");
+	}
+	if ( c->c_auth )
+		printf(",\"auth\":\"%s\"", c->c_auth);
+	if ( c->c_ac_len )
+		printf(",\"ac_len\":%zu,\"cid\":%u", c->c_ac_len, c->c_cid);
+
+	printf(",\"usec\":{");
+	for(i = 0; i < num; i++) {
+		printf("%s\"%s\":%llu", (i) ? "," : "", stage_name[i],
+			(unsigned long long)c->c_usec[i]);
+		total += c->c_usec[i];
+	}
+	printf("},\"total_usec\":%llu}\n", (unsigned long long)total);
+
+	fflush(stdout);
+	funlockfile(stdout);
+}
+
+/* Terminal data for the CDOL, a random unpredictable number and zero for
+ * everything else, ie. a transaction for nothing which is then declined.
+ */
+static int cdol_cb(uint16_t tag, uint8_t *ptr, size_t len, void *priv)
+{
+	unsigned int *seed = priv;
+	size_t i;
+
+	if ( tag != EMV_TAG_UNPREDICTABLE_NUMBER )
+		return 0;
+
+	for(i = 0; i < len; i++)
+		ptr[i] = rand_r(seed);
+	return 1;
+}
+
+static int gen_ac(emv_t e, struct card *c, unsigned int *seed)
+{
+	uint8_t dol[BATCH_DOL_MAX];
+	const uint8_t *cdol, *rsp;
+	size_t cdol_len, dol_len, rlen;
+	emv_data_t d;
+
+	d = emv_retrieve_data(e, EMV_TAG_CDOL1);
+	if ( NULL == d ) {
+		c->c_err = "no CDOL1";
+		return 0;
+	}
+
+	cdol = emv_data(d, &cdol_len);
+	dol_len = sizeof(dol);
+	if ( !emv_construct_dol_buf(cdol_cb, cdol, cdol_len,
+					dol, &dol_len, seed) ) {
+		c->c_err = "bad CDOL1";
+		return 0;
+	}
+
+	rsp = emv_generate_ac(e, EMV_AC_AAC, dol, dol_len, &rlen);
+	if ( NULL == rsp )
+		return 0;
+
+	/* format 1 is 80 len cid ..., format 2 is a template with tag 9f27 */
+	c->c_ac_len = rlen;
+	if ( rlen > 2 && rsp[0] == 0x80 )
+		c->c_cid = rsp[2];
+	return 1;
+}
+
+static int run_stage(emv_t e, unsigned int st, struct card *c,
+			unsigned int *seed)
+{
+	emv_aip_t aip;
+
+	switch(st) {
+	case ST_APPSEL:
+		if ( !select_app(e, 0) ) {
+			c->c_err = "no supported application";
+			return 0;
+		}
+		c->c_app = emv_app_pname(emv_current_app(e));
+		return 1;
+	case ST_INIT:
+		return emv_app_init(e);
+	case ST_READ:
+		return emv_read_app_data(e);
+	case ST_AUTH:
+		if ( !emv_app_aip(e, aip) )
+			return 0;
+		if ( aip[0] & EMV_AIP_DDA ) {
+			c->c_auth = "dda";
+			return emv_authenticate_dynamic(e, get_mod,
+							get_exp, NULL);
+		}
+		if ( aip[0] & EMV_AIP_SDA ) {
+			c->c_auth = "sda";
+			return emv_authenticate_static_data(e, get_mod,
+							get_exp, NULL);
+		}
+		c->c_auth = "none";
+		return 1;
+	case ST_AC:
+		return gen_ac(e, c, seed);
+	default:
+		abort();
+	}
+}
+
+/* Put the card through the pipeline, it has already been powered up */
+static void do_card(const struct batch *b, ccid_t ccid, cci_t cci,
+			struct card *c, unsigned int *seed)
+{
+	uint64_t start;
+	emv_t e;
+
+	e = emv_init(cci);
+	if ( NULL == e ) {
+		c->c_err = "emv init failed";
+		goto out;
+	}
+
+	for(; c->c_stages <= b->b_last; c->c_stages++) {
+		start = now_usec();
+		if ( !run_stage(e, c->c_stages, c, seed) ) {
+			c->c_usec[c->c_stages] = now_usec() - start;
+			if ( NULL == c->c_err )
+				c->c_err = emv_error_string(emv_error(e));
+			break;
+		}
+		c->c_usec[c->c_stages] = now_usec() - start;
+	}
+
+	/* the strings belong to the emv_t */
+	card_report(ccid, c);
+	emv_fini(e);
+	return;
+out:
+	card_report(ccid, c);
+}
+
+/* Returns 1 if a new card was powered up, with the time it took, or -1 for a
+ * new card in a contact slot which failed to power up.
+ */
+static int card_wait(cci_t cci, int field, int *seen, uint64_t *usec)
+{
+	uint64_t start;
+	int ok;
+
+	/* contact slots say if there's a card, fields have to be tried */
+	if ( !field && cci_slot_status(cci) == CHIPCARD_NOT_PRESENT ) {
+		*seen = 0;
+		return 0;
+	}
+	if ( !field && *seen )
+		return 0;
+
+	start = now_usec();
+	ok = (NULL != cci_power_on(cci, CHIPCARD_AUTO_VOLTAGE, NULL));
+	*usec = now_usec() - start;
+
+	if ( !ok ) {
+		if ( field || *seen ) {
+			*seen = 0;
+			return 0;
+		}
+		*seen = 1;
+		return -1;
+	}
+
+	if ( *seen ) {
+		cci_power_off(cci);
+		return 0;
+	}
+
+	*seen = 1;
+	return 1;
+}
+
+static void *reader_thread(void *priv)
+{
+	struct reader *r = priv;
+	const struct batch *b = r->r_batch;
+	unsigned int num_slots, num, i, seed;
+	struct card c;
+	int *seen;
+	cci_t cci;
+
+	num_slots = ccid_num_slots(r->r_ccid);
+	num = num_slots + ccid_num_fields(r->r_ccid);
+
+	seen = calloc(num + 1, sizeof(*seen));
+	if ( NULL == seen )
+		return NULL;
+
+	seed = time(NULL) ^ (uintptr_t)r;
+
+	while ( !stop ) {
+		for(i = 0; i < num && !stop; i++) {
+			memset(&c, 0, sizeof(c));
+			if ( i < num_slots ) {
+				cci = ccid_get_slot(r->r_ccid, i);
+				c.c_type = "slot";
+				c.c_idx = i;
+			}else{
+				cci = ccid_get_field(r->r_ccid, i - num_slots);
+				c.c_type = "field";
+				c.c_idx = i - num_slots;
+			}
+
+			switch(card_wait(cci, i >= num_slots, &seen[i],
+					&c.c_usec[ST_POWER])) {
+			case 0:
+				continue;
+			case -1:
+				c.c_err = "power on failed";
+				card_report(r->r_ccid, &c);
+				continue;
+			default:
+				break;
+			}
+
+			c.c_stages = ST_POWER + 1;
+			do_card(b, r->r_ccid, cci, &c, &seed);
+			cci_power_off(cci);
+		}
+
+		if ( b->b_once )
+			break;
+		usleep(BATCH_POLL_USEC);
+	}
+
+	free(seen);
+	return NULL;
+}
+
+static int batch(const struct batch *b, const char *tf)
+{
+	struct reader *r = NULL;
+	ccid_t *ccid = NULL;
+	char **fn = NULL;
+	ccidev_t *dev;
+	size_t num_dev, i;
+	int ret = 0;
+
+	dev = libccid_get_device_list(&num_dev);
+	if ( NULL == dev )
+		return 0;
+
+	ccid = calloc(num_dev + 1, sizeof(*ccid));
+	r = calloc(num_dev + 1, sizeof(*r));
+	fn = calloc(num_dev + 1, sizeof(*fn));
+	if ( NULL == ccid || NULL == r || NULL == fn )
+		goto out;
+
+	for(i = 0; tf && i < num_dev; i++) {
+		fn[i] = malloc(strlen(tf) + 32);
+		if ( NULL == fn[i] )
+			goto out;
+		sprintf(fn[i], "%s.%zu.log", tf, i);
+	}
+
+	libccid_probe_all(dev, num_dev, (const char * const *)fn, ccid);
+
+	signal(SIGINT, sig_stop);
+	signal(SIGTERM, sig_stop);
+
+	for(i = 0; i < num_dev; i++) {
+		if ( NULL == ccid[i] )
+			continue;
+		r[i].r_batch = b;
+		r[i].r_ccid = ccid[i];
+		if ( pthread_create(&r[i].r_thread, NULL,
+					reader_thread, r + i) ) {
+			fprintf(stderr, "%s: can't start thread\n",
+				ccid_name(ccid[i]));
+			continue;
+		}
+		r[i].r_running = 1;
+	}
+
+	ret = 1;
+	for(i = 0; i < num_dev; i++) {
+		if ( r[i].r_running )
+			pthread_join(r[i].r_thread, NULL);
+		ccid_close(ccid[i]);
+	}
+
+out:
+	for(i = 0; fn && i < num_dev; i++)
+		free(fn[i]);
+	free(fn);
+	free(r);
+	free(ccid);
+	libccid_free_device_list(dev);
+	return ret;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: emvtool [options]\n"
+		"  -b           batch mode, JSON line for each card in any "
+			"reader\n"
+		"  -s <stage>   last stage of the pipeline in batch mode, "
+			"one of\n"
+		"               appsel, init, read, auth (default) or ac\n"
+		"  -1           batch mode only does the cards present at "
+			"startup\n"
+		"  -t <prefix>  trace log file prefix for batch mode\n");
+}
+
 int main(int argc, char **argv)
 {
+	struct batch b = {.b_last = ST_AUTH};
+	const char *tf = NULL;
 	ccidev_t *dev;
 	size_t num_dev, i;
+	int c, do_batch = 0;
+
+	while ( (c = getopt(argc, argv, "bs:1t:h")) != -1 ) {
+		switch(c) {
+		case 'b':
+			do_batch = 1;
+			break;
+		case 's':
+			if ( !stage_by_name(optarg, &b.b_last) ) {
+				fprintf(stderr, "bad stage: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case '1':
+			b.b_once = 1;
+			break;
+		case 't':
+			tf = optarg;
+			break;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if ( do_batch )
+		return (batch(&b, tf)) ? EXIT_SUCCESS : EXIT_FAILURE;
 
 	dev = libccid_get_device_list(&num_dev);
 	if ( NULL == dev )
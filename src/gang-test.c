@@ -0,0 +1,140 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2009 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Regression test for the gang allocator, run by "make check". Memory given
+ * back by gang_rewind() and gang_reset() must be handed out again without any
+ * more slabs being taken from malloc.
+*/
+#include <compiler.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <gang.h>
+
+#define SLAB_SIZE	0x100
+#define ALLOC_SIZE	40
+#define NUM_ALLOCS	32 /* enough to need several slabs */
+
+static int check(const char *name, gang_t g, uint64_t slabs, uint64_t live,
+			uint64_t requested)
+{
+	struct gang_stats st;
+
+	gang_stats(g, &st);
+	if ( st.s_slabs == slabs && st.s_live == live &&
+			st.s_requested == requested )
+		return 1;
+
+	fprintf(stderr, "%s: slabs %llu live %llu requested %llu, "
+		"expected %llu %llu %llu\n", name,
+		(unsigned long long)st.s_slabs,
+		(unsigned long long)st.s_live,
+		(unsigned long long)st.s_requested,
+		(unsigned long long)slabs,
+		(unsigned long long)live,
+		(unsigned long long)requested);
+	return 0;
+}
+
+static int fill(gang_t g, uint8_t **ptr, uint8_t pattern)
+{
+	unsigned int i;
+
+	for(i = 0; i < NUM_ALLOCS; i++) {
+		ptr[i] = gang_alloc(g, ALLOC_SIZE);
+		if ( NULL == ptr[i] )
+			return 0;
+		memset(ptr[i], pattern, ALLOC_SIZE);
+	}
+
+	return 1;
+}
+
+static int test_rewind(void)
+{
+	uint8_t *first, *ptr[NUM_ALLOCS], *again[NUM_ALLOCS];
+	struct gang_stats st;
+	struct gang_mark m;
+	unsigned int i;
+	uint64_t slabs;
+	gang_t g;
+	int ret = 0;
+
+	g = gang_new(SLAB_SIZE, 0);
+	if ( NULL == g )
+		return 0;
+
+	/* kept across the rewind */
+	first = gang_alloc(g, ALLOC_SIZE);
+	if ( NULL == first )
+		goto out;
+	memset(first, 0x5a, ALLOC_SIZE);
+
+	gang_mark(g, &m);
+	if ( !fill(g, ptr, 0x11) )
+		goto out;
+
+	gang_stats(g, &st);
+	slabs = st.s_slabs;
+	if ( slabs < 3 ) {
+		fprintf(stderr, "rewind: only %llu slabs\n",
+			(unsigned long long)slabs);
+		goto out;
+	}
+
+	gang_rewind(g, &m);
+	if ( !check("rewind", g, slabs, 1, ALLOC_SIZE) )
+		goto out;
+
+	/* the same memory again, in the same order, and nothing new */
+	if ( !fill(g, again, 0x22) )
+		goto out;
+	if ( !check("reuse", g, slabs, NUM_ALLOCS + 1,
+			(NUM_ALLOCS + 1) * ALLOC_SIZE) )
+		goto out;
+	for(i = 0; i < NUM_ALLOCS; i++) {
+		if ( again[i] != ptr[i] ) {
+			fprintf(stderr, "reuse: allocation %u moved\n", i);
+			goto out;
+		}
+	}
+
+	for(i = 0; i < ALLOC_SIZE; i++) {
+		if ( first[i] != 0x5a ) {
+			fprintf(stderr, "rewind: lost data before the mark\n");
+			goto out;
+		}
+	}
+
+	/* a mark of an empty gang goes back to nothing at all */
+	gang_reset(g);
+	gang_mark(g, &m);
+	if ( !fill(g, ptr, 0x33) )
+		goto out;
+	gang_rewind(g, &m);
+	if ( !check("empty", g, slabs, 0, 0) )
+		goto out;
+	if ( !fill(g, ptr, 0x44) )
+		goto out;
+	if ( !check("refill", g, slabs, NUM_ALLOCS,
+			NUM_ALLOCS * ALLOC_SIZE) )
+		goto out;
+
+	ret = 1;
+out:
+	gang_free(g);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	if ( !GANG_STATS ) {
+		/* the test is all about the counters */
+		return 77;
+	}
+
+	return (test_rewind()) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
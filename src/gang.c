@@ -15,6 +15,12 @@
 #define POISON(ptr, len) do { } while(0);
 #endif
 
+#if GANG_STATS
+#define STAT(x) do { x; } while(0)
+#else
+#define STAT(x) do { } while(0)
+#endif
+
 struct _slab {
 	struct _slab *s_next;
 	uint8_t s_data[0];
@@ -24,7 +30,11 @@ struct _gang {
 	size_t g_align;
 	size_t g_alloc;
 	struct _slab *g_slab;
+	struct _slab *g_spare;
 	uint8_t *g_ptr;
+#if GANG_STATS
+	struct gang_stats g_stats;
+#endif
 };
 
 gang_t gang_new(size_t alloc, size_t align)
@@ -38,15 +48,20 @@ gang_t gang_new(size_t alloc, size_t align)
 	g->g_align = align;
 	g->g_alloc = (0 == alloc) ? GANG_DEFAULT_ALLOC : alloc;
 	g->g_slab = NULL;
+	g->g_spare = NULL;
 	g->g_ptr = NULL;
+	STAT(memset(&g->g_stats, 0, sizeof(g->g_stats)));
 
 	return g;
 }
 
-static uint8_t *ptr_align(uint8_t *ptr, size_t sz)
+/* align must be a power of two, or zero for none */
+static uint8_t *ptr_align(uint8_t *ptr, size_t align)
 {
-	/* later for this bullshit */
-	return ptr;
+	if ( align <= 1 )
+		return ptr;
+	return (uint8_t *)(((uintptr_t)ptr + (align - 1)) &
+				~(uintptr_t)(align - 1));
 }
 
 static void *do_alloc_slow(struct _gang *g, size_t sz, size_t align)
@@ -54,15 +69,23 @@ static void *do_alloc_slow(struct _gang *g, size_t sz, size_t align)
 	struct _slab *s;
 	uint8_t *ret;
 
-	s = malloc(g->g_alloc);
-	if ( NULL == s )
-		return NULL;
+	if ( g->g_spare ) {
+		s = g->g_spare;
+		g->g_spare = s->s_next;
+	}else{
+		s = malloc(g->g_alloc);
+		if ( NULL == s )
+			return NULL;
+		STAT(g->g_stats.s_slabs++);
+		STAT(g->g_stats.s_committed += g->g_alloc);
+	}
 
 	POISON(s, g->g_alloc);
 
 	ret = ptr_align(s->s_data, align);
 	if ( ret + sz > (uint8_t *)s + g->g_alloc ) {
-		free(s);
+		s->s_next = g->g_spare;
+		g->g_spare = s;
 		return NULL;
 	}
 
@@ -73,7 +96,7 @@ static void *do_alloc_slow(struct _gang *g, size_t sz, size_t align)
 	return ret;
 }
 
-static void *do_alloc(struct _gang *g, size_t sz, size_t align)
+static void *carve(struct _gang *g, size_t sz, size_t align)
 {
 	uint8_t *nxt;
 
@@ -84,10 +107,26 @@ static void *do_alloc(struct _gang *g, size_t sz, size_t align)
 	if ( nxt + sz >= (uint8_t *)g->g_slab + g->g_alloc )
 		return do_alloc_slow(g, sz, align);
 
-	g->g_ptr += sz;
+	g->g_ptr = nxt + sz;
 	return nxt;
 }
 
+static void *do_alloc(struct _gang *g, size_t sz, size_t align)
+{
+	void *ret;
+
+	ret = carve(g, sz, align);
+#if GANG_STATS
+	if ( ret ) {
+		g->g_stats.s_live++;
+		g->g_stats.s_requested += sz;
+		if ( g->g_stats.s_requested > g->g_stats.s_peak )
+			g->g_stats.s_peak = g->g_stats.s_requested;
+	}
+#endif
+	return ret;
+}
+
 void *gang_alloc(gang_t g, size_t sz)
 {
 	return do_alloc(g, sz, g->g_align);
@@ -116,6 +155,86 @@ void *gang_alloc0_a(gang_t g, size_t sz, size_t align)
 	return ret;
 }
 
+/* Make sure the first slab has room for sz bytes, so that a working set of
+ * known size fits in one. Only done while nothing is allocated, slabs are all
+ * the same size and so any spares which are too small are freed.
+ */
+void gang_size_hint(gang_t g, size_t sz)
+{
+	struct _slab *s, *tmp;
+
+	if ( g->g_slab )
+		return;
+
+	sz += sizeof(struct _slab);
+	if ( sz <= g->g_alloc )
+		return;
+
+	for(s = g->g_spare; (tmp = s); free(tmp)) {
+		s = s->s_next;
+		STAT(g->g_stats.s_slabs--);
+		STAT(g->g_stats.s_committed -= g->g_alloc);
+	}
+	g->g_spare = NULL;
+
+	g->g_alloc = (sz + GANG_DEFAULT_ALLOC - 1) & ~(GANG_DEFAULT_ALLOC - 1);
+}
+
+/* Remember the current position for a later gang_rewind() */
+void gang_mark(gang_t g, struct gang_mark *m)
+{
+	m->m_slab = g->g_slab;
+	m->m_ptr = g->g_ptr;
+	STAT(m->m_live = g->g_stats.s_live);
+	STAT(m->m_requested = g->g_stats.s_requested);
+}
+
+/* Forget everything allocated since gang_mark(), slabs which were used after
+ * the mark are kept for re-use.
+ */
+void gang_rewind(gang_t g, const struct gang_mark *m)
+{
+	struct _slab *s;
+
+	while ( g->g_slab && g->g_slab != m->m_slab ) {
+		s = g->g_slab;
+		g->g_slab = s->s_next;
+		s->s_next = g->g_spare;
+		g->g_spare = s;
+	}
+
+	/* a mark from before the last gang_reset() rewinds to the start */
+	g->g_ptr = (g->g_slab == m->m_slab) ? m->m_ptr : NULL;
+#if GANG_STATS
+	if ( g->g_ptr ) {
+		g->g_stats.s_live = m->m_live;
+		g->g_stats.s_requested = m->m_requested;
+	}else{
+		g->g_stats.s_live = 0;
+		g->g_stats.s_requested = 0;
+	}
+#endif
+	if ( g->g_slab )
+		POISON(g->g_ptr, (uint8_t *)g->g_slab + g->g_alloc - g->g_ptr);
+}
+
+/* Forget all allocations but keep the slabs around for re-use */
+void gang_reset(gang_t g)
+{
+	struct _slab *s, *tmp;
+
+	for(s = g->g_slab; (tmp = s); ) {
+		s = s->s_next;
+		tmp->s_next = g->g_spare;
+		g->g_spare = tmp;
+	}
+
+	g->g_slab = NULL;
+	g->g_ptr = NULL;
+	STAT(g->g_stats.s_live = 0);
+	STAT(g->g_stats.s_requested = 0);
+}
+
 void gang_free(gang_t g)
 {
 	struct _slab *s, *tmp;
@@ -123,7 +242,8 @@ void gang_free(gang_t g)
 	if ( NULL == g )
 		return;
 
-	for(s = g->g_slab; (tmp = s); free(tmp)) {
+	gang_reset(g);
+	for(s = g->g_spare; (tmp = s); free(tmp)) {
 		s = s->s_next;
 		POISON(tmp, g->g_alloc);
 	}
@@ -131,3 +251,16 @@ void gang_free(gang_t g)
 	POISON(g, sizeof(*g));
 	free(g);
 }
+
+/* Slabs and committed bytes are memory held from malloc, live allocations
+ * and requested bytes are what has been handed out since the last reset,
+ * peak is the high-water mark of requested bytes.
+ */
+void gang_stats(gang_t g, struct gang_stats *st)
+{
+#if GANG_STATS
+	memcpy(st, &g->g_stats, sizeof(*st));
+#else
+	memset(st, 0, sizeof(*st));
+#endif
+}
@@ -0,0 +1,560 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2008 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * GlobalPlatform load engine, INSTALL [for load], the LOAD blocks and
+ * optionally INSTALL [for install and make selectable]. The load file is
+ * mapped and LOAD commands are built straight out of the mapping, either
+ * from an IJC file or from the components of a CAP file, which is a zip and
+ * must have been written without compression. Blocks are made as large as
+ * the protocol in use allows and go out a window at a time through
+ * cci_transact_batch(). Secure channel C-MACs are computed as each command
+ * is built, by a callback, with the chaining value kept here.
+*/
+
+#include <ccid.h>
+#include <apdu.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ccid-internal.h"
+
+#define GP_WINDOW	16
+#define GP_MAX_BLOCKS	256
+
+#define GP_CLA		0x80
+#define GP_CLA_MAC	0x04
+#define GP_INS_INSTALL	0xe6
+#define GP_INS_LOAD	0xe8
+#define GP_P1_LAST	0x80
+#define GP_FOR_LOAD	0x02
+#define GP_FOR_INSTALL	0x0c
+
+#define SHORT_HDR	5
+#define EXT_HDR		7
+
+/* CAP components in the order they have to be loaded, the descriptor and
+ * debug components are left out.
+ */
+static const char * const cap_order[] = {
+	"Header.cap",
+	"Directory.cap",
+	"Import.cap",
+	"Applet.cap",
+	"Class.cap",
+	"Method.cap",
+	"StaticField.cap",
+	"Export.cap",
+	"ConstantPool.cap",
+	"RefLocation.cap",
+};
+#define CAP_NUM_COMPONENTS (sizeof(cap_order)/sizeof(*cap_order))
+
+#define ZIP_LOCAL	0x04034b50
+#define ZIP_CENTRAL	0x02014b50
+#define ZIP_END		0x06054b50
+#define ZIP_LOCAL_LEN	30
+#define ZIP_CENTRAL_LEN	46
+#define ZIP_END_LEN	22
+
+struct gp_seg {
+	const uint8_t	*s_ptr;
+	size_t		s_len;
+};
+
+/* The load file data block, tag C4 and its length then the load file */
+struct gp_stream {
+	uint8_t		g_hdr[5];
+	unsigned int	g_nseg;
+	struct gp_seg	g_seg[CAP_NUM_COMPONENTS + 1];
+	unsigned int	g_cur;
+	size_t		g_off;
+	size_t		g_left;
+};
+
+struct gp_ctx {
+	cci_t				c_cci;
+	const struct cci_gp_load	*c_load;
+	struct cci_gp_result		*c_res;
+	uint8_t				c_icv[CCI_GP_MAC_LEN];
+};
+
+static unsigned int le16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int component_idx(const uint8_t *name, size_t len)
+{
+	const uint8_t *base;
+	unsigned int i;
+	size_t blen;
+
+	for(base = name + len; base > name && base[-1] != '/'; base--)
+		/* nothing */;
+	blen = len - (base - name);
+
+	for(i = 0; i < CAP_NUM_COMPONENTS; i++) {
+		if ( blen == strlen(cap_order[i]) &&
+				!memcmp(base, cap_order[i], blen) )
+			return i;
+	}
+
+	return -1;
+}
+
+/* Find the components through the zip central directory */
+static int cap_components(struct gp_seg *seg, const uint8_t *map, size_t len)
+{
+	const uint8_t *end, *cd, *lh;
+	size_t num, off, nlen, data;
+	int idx;
+
+	if ( len < ZIP_END_LEN )
+		return 0;
+
+	/* end of central directory, the comment is at most 64k */
+	for(end = map + len - ZIP_END_LEN; end >= map; end--) {
+		if ( le32(end) == ZIP_END )
+			break;
+		if ( (size_t)(map + len - end) > ZIP_END_LEN + 0xffff )
+			return 0;
+	}
+	if ( end < map )
+		return 0;
+
+	num = le16(end + 10);
+	off = le32(end + 16);
+
+	for(; num; num--) {
+		if ( off > len || len - off < ZIP_CENTRAL_LEN )
+			return 0;
+		cd = map + off;
+		if ( le32(cd) != ZIP_CENTRAL )
+			return 0;
+
+		nlen = le16(cd + 28);
+		if ( len - off - ZIP_CENTRAL_LEN < nlen )
+			return 0;
+
+		idx = component_idx(cd + ZIP_CENTRAL_LEN, nlen);
+		off += ZIP_CENTRAL_LEN + nlen + le16(cd + 30) + le16(cd + 32);
+		if ( idx < 0 )
+			continue;
+
+		if ( le16(cd + 10) != 0 ) {
+			fprintf(stderr, "*** error: gp: compressed CAP "
+				"component, convert it to IJC\n");
+			return 0;
+		}
+
+		data = le32(cd + 42);
+		if ( data > len || len - data < ZIP_LOCAL_LEN )
+			return 0;
+		lh = map + data;
+		if ( le32(lh) != ZIP_LOCAL )
+			return 0;
+
+		data += ZIP_LOCAL_LEN + le16(lh + 26) + le16(lh + 28);
+		seg[idx].s_len = le32(cd + 20);
+		if ( data > len || len - data < seg[idx].s_len )
+			return 0;
+		seg[idx].s_ptr = map + data;
+	}
+
+	return 1;
+}
+
+static int stream_init(struct gp_stream *g, const uint8_t *map, size_t len)
+{
+	struct gp_seg seg[CAP_NUM_COMPONENTS];
+	size_t total = 0, hlen;
+	unsigned int i;
+
+	memset(g, 0, sizeof(*g));
+	memset(seg, 0, sizeof(seg));
+
+	if ( len >= 4 && le32(map) == ZIP_LOCAL ) {
+		if ( !cap_components(seg, map, len) ) {
+			fprintf(stderr, "*** error: gp: bad CAP file\n");
+			return 0;
+		}
+		if ( NULL == seg[0].s_ptr ) {
+			fprintf(stderr, "*** error: gp: no header component\n");
+			return 0;
+		}
+	}else{
+		seg[0].s_ptr = map;
+		seg[0].s_len = len;
+	}
+
+	for(i = 0; i < CAP_NUM_COMPONENTS; i++) {
+		if ( !seg[i].s_len )
+			continue;
+		g->g_seg[++g->g_nseg] = seg[i];
+		total += seg[i].s_len;
+	}
+
+	if ( !total || total > 0xffffff )
+		return 0;
+
+	g->g_hdr[0] = 0xc4;
+	if ( total < 0x80 ) {
+		g->g_hdr[1] = total;
+		hlen = 2;
+	}else if ( total < 0x100 ) {
+		g->g_hdr[1] = 0x81;
+		g->g_hdr[2] = total;
+		hlen = 3;
+	}else if ( total < 0x10000 ) {
+		g->g_hdr[1] = 0x82;
+		g->g_hdr[2] = total >> 8;
+		g->g_hdr[3] = total & 0xff;
+		hlen = 4;
+	}else{
+		g->g_hdr[1] = 0x83;
+		g->g_hdr[2] = total >> 16;
+		g->g_hdr[3] = (total >> 8) & 0xff;
+		g->g_hdr[4] = total & 0xff;
+		hlen = 5;
+	}
+
+	g->g_seg[0].s_ptr = g->g_hdr;
+	g->g_seg[0].s_len = hlen;
+	g->g_nseg++;
+	g->g_left = hlen + total;
+	return 1;
+}
+
+static void stream_copy(struct gp_stream *g, struct apdu *a, size_t len)
+{
+	const struct gp_seg *s;
+	size_t n;
+
+	while ( len ) {
+		s = &g->g_seg[g->g_cur];
+		n = s->s_len - g->g_off;
+		if ( n > len )
+			n = len;
+
+		apdu_buf(a, s->s_ptr + g->g_off, n);
+		g->g_off += n;
+		g->g_left -= n;
+		len -= n;
+
+		if ( g->g_off == s->s_len ) {
+			g->g_cur++;
+			g->g_off = 0;
+		}
+	}
+}
+
+/* Largest block of LOAD data, if the command goes out in frames of a known
+ * size then it is trimmed to end on a frame boundary, or the last frame of
+ * every command would be a short one.
+ */
+static size_t block_size(struct gp_ctx *c)
+{
+	const struct cci_gp_load *l = c->c_load;
+	struct _cci *cci = c->c_cci;
+	struct _ccid *ccid = cci->i_parent;
+	size_t max, hdr, frame = 0, limit = 0, fsc;
+	uint32_t features = ccid->d_desc.dwFeatures;
+	int ext = !!(l->l_flags & CCI_GP_EXTENDED);
+
+	if ( cci->i_ops == &_rfid_ops ) {
+		/* two bytes of CRC and up to two of prologue */
+		if ( cci_rf_params(cci, NULL, NULL, &fsc) && fsc > 4 )
+			frame = fsc - 4;
+	}else if ( cci->i_t1.t_on ) {
+		frame = cci->i_t1.t_ifsc;
+		if ( frame > cci->i_t1.t_max_inf )
+			frame = cci->i_t1.t_max_inf;
+	}else{
+		/* the reader carries the whole command in one message */
+		if ( cci->i_proto != CCID_PROTOCOL_T1 ||
+				!(features & CCID_T1_APDU_EXT) )
+			ext = 0;
+		if ( ccid->d_desc.dwMaxCCIDMessageLength >
+				sizeof(struct ccid_msg) + SHORT_HDR + 0xff )
+			limit = ccid->d_desc.dwMaxCCIDMessageLength -
+				sizeof(struct ccid_msg);
+		else
+			ext = 0;
+	}
+
+	hdr = (ext) ? EXT_HDR : SHORT_HDR;
+	max = hdr + ((ext) ? 0xffff : 0xff);
+	if ( limit && max > limit )
+		max = limit;
+	if ( frame && max > frame )
+		max -= max % frame;
+
+	max -= hdr;
+	if ( l->l_mac )
+		max -= CCI_GP_MAC_LEN;
+	if ( l->l_block && l->l_block < max )
+		max = l->l_block;
+
+	return max;
+}
+
+/* MAC goes in the command data, before Le */
+static int cmd_finish(struct gp_ctx *c, struct apdu *a, int le)
+{
+	const struct cci_gp_load *l = c->c_load;
+	uint8_t *mac = NULL;
+
+	if ( l->l_mac ) {
+		mac = a->a_ptr;
+		apdu_buf(a, c->c_icv, CCI_GP_MAC_LEN);
+	}
+	apdu_data_end(a);
+	if ( a->a_err )
+		return 0;
+
+	if ( mac ) {
+		if ( !(*l->l_mac)(l->l_priv, c->c_icv, a->a_buf,
+					mac - a->a_buf, mac) )
+			return 0;
+		memcpy(c->c_icv, mac, CCI_GP_MAC_LEN);
+	}
+
+	if ( le >= 0 )
+		apdu_le(a, le);
+
+	return apdu_finish(a);
+}
+
+static uint8_t cla(struct gp_ctx *c)
+{
+	return (c->c_load->l_mac) ? (GP_CLA | GP_CLA_MAC) : GP_CLA;
+}
+
+static void lv(struct apdu *a, const uint8_t *ptr, size_t len)
+{
+	apdu_byte(a, len);
+	apdu_buf(a, ptr, len);
+}
+
+static int run(struct gp_ctx *c, xfr_t xfr)
+{
+	int ret;
+
+	ret = cci_transact(c->c_cci, xfr);
+	if ( !ret )
+		return 0;
+
+	c->c_res->r_sw = (xfr_rx_sw1(xfr) << 8) | xfr_rx_sw2(xfr);
+	return (c->c_res->r_sw == 0x9000);
+}
+
+static int install_for_load(struct gp_ctx *c, xfr_t xfr)
+{
+	const struct cci_gp_load *l = c->c_load;
+	struct apdu a;
+
+	apdu_init(&a, xfr, cla(c), GP_INS_INSTALL, GP_FOR_LOAD, 0);
+	apdu_data_begin(&a);
+	lv(&a, l->l_pkg, l->l_pkg_len);
+	lv(&a, l->l_sd, l->l_sd_len);
+	apdu_byte(&a, 0); /* load file data block hash */
+	apdu_byte(&a, 0); /* load parameters */
+	apdu_byte(&a, 0); /* load token */
+	if ( !cmd_finish(c, &a, 0) )
+		return 0;
+
+	return run(c, xfr);
+}
+
+static int install_applet(struct gp_ctx *c, xfr_t xfr)
+{
+	const struct cci_gp_load *l = c->c_load;
+	const uint8_t *inst = l->l_inst;
+	size_t inst_len = l->l_inst_len;
+	struct apdu a;
+
+	if ( NULL == inst ) {
+		inst = l->l_applet;
+		inst_len = l->l_applet_len;
+	}
+
+	apdu_init(&a, xfr, cla(c), GP_INS_INSTALL, GP_FOR_INSTALL, 0);
+	apdu_data_begin(&a);
+	lv(&a, l->l_pkg, l->l_pkg_len);
+	lv(&a, l->l_applet, l->l_applet_len);
+	lv(&a, inst, inst_len);
+	apdu_byte(&a, 1);
+	apdu_byte(&a, l->l_privs);
+	apdu_byte(&a, 2); /* install parameters, empty application specific */
+	apdu_byte(&a, 0xc9);
+	apdu_byte(&a, 0);
+	apdu_byte(&a, 0); /* install token */
+	if ( !cmd_finish(c, &a, 0) )
+		return 0;
+
+	return run(c, xfr);
+}
+
+static int load_block(struct gp_ctx *c, struct gp_stream *g, xfr_t xfr,
+			unsigned int nr, size_t max)
+{
+	size_t len = (g->g_left < max) ? g->g_left : max;
+	struct apdu a;
+
+	apdu_init(&a, xfr, cla(c), GP_INS_LOAD,
+			(len == g->g_left) ? GP_P1_LAST : 0, nr);
+	if ( len + ((c->c_load->l_mac) ? CCI_GP_MAC_LEN : 0) > 0xff )
+		apdu_extended(&a);
+	apdu_data_begin(&a);
+	stream_copy(g, &a, len);
+	return cmd_finish(c, &a, -1);
+}
+
+static int load_file(struct gp_ctx *c, struct gp_stream *g)
+{
+	struct cci_apdu apdu[GP_WINDOW];
+	xfr_t xfr[GP_WINDOW] = {NULL, };
+	unsigned int i, cnt, nr = 0;
+	size_t max;
+	int ret = 0;
+
+	max = block_size(c);
+	if ( !max || (g->g_left + max - 1) / max > GP_MAX_BLOCKS ) {
+		fprintf(stderr, "*** error: gp: load file too big for %zu "
+			"byte blocks\n", max);
+		return 0;
+	}
+	c->c_res->r_block = max;
+
+	for(i = 0; i < GP_WINDOW; i++) {
+		xfr[i] = xfr_alloc(EXT_HDR + max + CCI_GP_MAC_LEN, 258);
+		if ( NULL == xfr[i] )
+			goto out;
+	}
+
+	while ( g->g_left ) {
+		for(cnt = 0; cnt < GP_WINDOW && g->g_left; cnt++, nr++) {
+			if ( !load_block(c, g, xfr[cnt], nr, max) )
+				goto out;
+			apdu[cnt].a_xfr = xfr[cnt];
+			apdu[cnt].a_sw = 0x9000;
+			apdu[cnt].a_sw_mask = 0xffff;
+		}
+
+		i = cci_transact_batch(c->c_cci, apdu, cnt, 0);
+		c->c_res->r_blocks += (i < cnt) ? i : cnt;
+		if ( i < cnt ) {
+			if ( xfr[i]->x_rxlen >= 2 )
+				c->c_res->r_sw = (xfr_rx_sw1(xfr[i]) << 8) |
+						xfr_rx_sw2(xfr[i]);
+			goto out;
+		}
+		c->c_res->r_sw = 0x9000;
+	}
+
+	ret = 1;
+out:
+	for(i = 0; i < GP_WINDOW; i++)
+		xfr_free(xfr[i]);
+	return ret;
+}
+
+/** Load, and optionally install, a Java Card package.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t with the security domain selected, and a secure
+ * channel opened if the card needs one.
+ * @param load Parameters of the load, see \ref cci_gp_load.
+ * @param res Filled in with the results.
+ *
+ * Sends INSTALL [for load], then the load file in as many LOAD commands as
+ * it takes, then INSTALL [for install and make selectable] if l_applet is
+ * set. LOAD commands are pipelined where the interface allows.
+ *
+ * @return zero on failure, r_sw holds the status word of the command which
+ * failed if there was one.
+ */
+int cci_gp_load(cci_t cci, const struct cci_gp_load *load,
+		struct cci_gp_result *res)
+{
+	struct gp_stream g;
+	struct gp_ctx c;
+	struct stat st;
+	xfr_t xfr = NULL;
+	void *map;
+	int fd, ret = 0;
+
+	memset(res, 0, sizeof(*res));
+	memcpy(res->r_icv, load->l_icv, sizeof(res->r_icv));
+
+	if ( load->l_pkg_len > 16 || load->l_sd_len > 16 ||
+			load->l_applet_len > 16 || load->l_inst_len > 16 ) {
+		cci->i_parent->d_error = CCID_ERROR_IN_VALUE;
+		return 0;
+	}
+
+	fd = open(load->l_file, O_RDONLY);
+	if ( fd < 0 ) {
+		fprintf(stderr, "*** error: open: %s: %s\n",
+			load->l_file, strerror(errno));
+		return 0;
+	}
+
+	if ( fstat(fd, &st) ) {
+		fprintf(stderr, "*** error: fstat: %s\n", strerror(errno));
+		close(fd);
+		return 0;
+	}
+
+	if ( !st.st_size ) {
+		fprintf(stderr, "*** error: gp: %s: empty\n", load->l_file);
+		close(fd);
+		return 0;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if ( map == MAP_FAILED ) {
+		fprintf(stderr, "*** error: mmap: %s\n", strerror(errno));
+		return 0;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	c.c_cci = cci;
+	c.c_load = load;
+	c.c_res = res;
+	memcpy(c.c_icv, load->l_icv, sizeof(c.c_icv));
+
+	if ( !stream_init(&g, map, st.st_size) )
+		goto out;
+	res->r_size = g.g_left;
+
+	xfr = xfr_alloc(SHORT_HDR + 0xff + 1, 258);
+	if ( NULL == xfr )
+		goto out;
+	xfr_auto_response(xfr, 1);
+
+	if ( !install_for_load(&c, xfr) )
+		goto out;
+	if ( !load_file(&c, &g) )
+		goto out;
+	if ( load->l_applet && !install_applet(&c, xfr) )
+		goto out;
+
+	ret = 1;
+out:
+	memcpy(res->r_icv, c.c_icv, sizeof(res->r_icv));
+	xfr_free(xfr);
+	munmap(map, st.st_size);
+	return ret;
+}
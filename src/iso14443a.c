@@ -50,25 +50,26 @@ static uint8_t fsdi_table[] = { 15, 23, 31, 39, 47, 63, 95, 127, 255 };
 int _iso14443_fsdi_to_fsd(uint8_t fsdi, size_t *fsd)
 {
 	/* ISO 14443-4:2000(E) Section 5.1. */
-	if (fsdi > sizeof(fsdi_table)/sizeof(*fsdi_table))
+	if (fsdi >= sizeof(fsdi_table)/sizeof(*fsdi_table))
 		return 0;
 
 	*fsd = fsdi_table[fsdi] + 1;
 	return 1;
 }
 
+/* Find the largest frame size which doesn't exceed fsd */
 int _iso14443_fsd_to_fsdi(size_t fsd, uint8_t *fsdi)
 {
-	int i;
+	unsigned int i;
 
-	for (i = 0; i < sizeof(fsdi_table)/sizeof(*fsdi_table); i++) {
-		if (fsdi_table[i] + 1 == fsd) {
+	for (i = sizeof(fsdi_table)/sizeof(*fsdi_table); i-- > 0; ) {
+		if ((size_t)fsdi_table[i] + 1 <= fsd) {
 			*fsdi = i;
-			return 0;
+			return 1;
 		}
 	}
 
-	return -1;
+	return 0;
 }
 
 /* transceive anti collission bitframe */
@@ -124,9 +125,10 @@ int _iso14443a_transceive_acf(struct _cci *cci,
 		if ( !_rfid_layer1_get_coll_pos(cci, &boc) )
 			return 0;
 
-		/* bit of collission relative to start of part 1 of
-		 * anticollision frame (!) */
-		*bit_of_col = 2*8 + boc;
+		/* the ASIC counts from the first bit it received, make it
+		 * relative to the start of the anticollision frame so it can
+		 * be used as the NVB bit count including the collided bit */
+		*bit_of_col = tx_bytes*8 + tx_last_bits + boc;
 	}
 
 	return 1;
@@ -236,203 +238,339 @@ int _iso14443a_transceive_sf(struct _cci *cci,
 	return 1;
 }
 
-static int random_bit(void)
+static int iso14443a_code_nvb_bits(unsigned char *nvb, unsigned int bits)
 {
-	static unsigned long randctx[4] = {0x22d4a017,
-						0x773a1f44,
-						0xc39e1460,
-						0x9cde8801};
-	unsigned long e;
-
-	e = randctx[0];
-	randctx[0] = randctx[1];
-	randctx[1] = (randctx[2]<<19) + (randctx[2]>>13) + randctx[3];
-	randctx[2] = randctx[3] ^ randctx[0];
-	randctx[3] = e+randctx[1];
-
-	return randctx[1]&1;
+	unsigned int byte_count = bits / 8;
+	unsigned int bit_count = bits % 8;
+
+	if (byte_count < 2 || byte_count > 7)
+		return -1;
+
+	*nvb = ((byte_count & 0xf) << 4) | bit_count;
+
+	return 0;
 }
 
-/* first bit is '1', second bit '2' */
-static void rnd_toggle_bit_in_field(uint8_t *bitfield,
-					size_t size,
-					unsigned int bit)
+/* bits of SEL and NVB at the start of every anticollision frame */
+#define ACF_HDR_BITS	16
+#define ACF_UID_BITS	(5 * 8)
+
+/* Unexplored branches of the CL1 anticollision tree, one per collision at
+ * most. Each entry is a prefix of UID bits which some tag still in the field
+ * may answer to.
+ */
+struct ac_branch {
+	uint8_t uid_bits[5];
+	uint8_t known;
+};
+
+struct ac_stack {
+	struct ac_branch b[ACF_UID_BITS];
+	unsigned int top;
+};
+
+static void set_bit_in_field(uint8_t *bitfield, unsigned int bit,
+				unsigned int val)
 {
-	unsigned int byte,rnd;
+	uint8_t mask = 1U << (bit % 8);
 
-	if (bit && (bit <= (size*8))) {
-		rnd = random_bit();
+	if (val)
+		bitfield[bit / 8] |= mask;
+	else
+		bitfield[bit / 8] &= ~mask;
+}
 
-		dprintf("xor'ing bit %u with %u\n",bit,rnd);
-		bit--;
-		byte = bit/8;
-		bit = rnd << (bit % 8);
-		bitfield[byte] ^= bit;
+static int request(struct _cci *cci, int wup, struct iso14443a_atqa *atqa)
+{
+	if (wup) {
+		dprintf("Sending WUPA\n");
+		return _iso14443a_transceive_sf(cci,
+					ISO14443A_SF_CMD_WUPA, atqa);
+	}else{
+		dprintf("Sending REQA\n");
+		return _iso14443a_transceive_sf(cci,
+					ISO14443A_SF_CMD_REQA, atqa);
 	}
 }
 
+/* Resolve the UID at the current cascade level starting from the first
+ * known bits of acf->uid_bits. Every collision is resolved deterministically
+ * by taking the 1 branch. If stack is not NULL the 0 branch is pushed on to
+ * it so that the caller can come back for it. Returns zero if no tag answers.
+ */
+static int resolve_level(struct _cci *cci, struct iso14443a_anticol_cmd *acf,
+				unsigned int known, struct ac_stack *stack)
+{
+	unsigned int bit_of_col;
+	struct ac_branch *b;
 
-static int iso14443a_code_nvb_bits(unsigned char *nvb, unsigned int bits)
+	for(;;) {
+		iso14443a_code_nvb_bits(&acf->nvb, ACF_HDR_BITS + known);
+		dprintf("ANTICOL: sel_code=%.2x nvb=%.2x\n",
+			acf->sel_code, acf->nvb);
+
+		if ( !_iso14443a_transceive_acf(cci, acf, &bit_of_col) )
+			return 0;
+		if ( bit_of_col == ISO14443A_BITOFCOL_NONE )
+			return 1;
+
+		dprintf("collision at pos %u\n", bit_of_col);
+
+		/* the collided bit must be one we did not send */
+		if ( bit_of_col <= ACF_HDR_BITS + known ||
+				bit_of_col > ACF_HDR_BITS + ACF_UID_BITS )
+			return 0;
+		known = bit_of_col - ACF_HDR_BITS;
+
+		if ( stack && stack->top < ACF_UID_BITS ) {
+			b = &stack->b[stack->top++];
+			memcpy(b->uid_bits, acf->uid_bits, sizeof(b->uid_bits));
+			set_bit_in_field(b->uid_bits, known - 1, 0);
+			b->known = known;
+		}
+
+		set_bit_in_field(acf->uid_bits, known - 1, 1);
+		dhex_dump(acf->uid_bits, sizeof(acf->uid_bits), 16);
+	}
+}
+
+static int select_level(struct _cci *cci, struct iso14443a_anticol_cmd *acf,
+				uint8_t *sak)
 {
-	unsigned int byte_count = bits / 8;
-	unsigned int bit_count = bits % 8;
+	uint8_t rx_buf[3];
+	size_t rx_len = sizeof(rx_buf);
 
-	if (byte_count < 2 || byte_count > 7)
-		return -1;
+	iso14443a_code_nvb_bits(&acf->nvb, 7*8);
+	dprintf("SELECT: sel_code=%.2x nvb=%.2x\n", acf->sel_code, acf->nvb);
 
-	*nvb = ((byte_count & 0xf) << 4) | bit_count;
+	if ( !_iso14443ab_transceive(cci, RFID_14443A_FRAME_REGULAR,
+				   (uint8_t *)acf, sizeof(*acf),
+				   rx_buf, &rx_len, TIMEOUT) )
+		return 0;
+	if ( !rx_len )
+		return 0;
+
+	*sak = rx_buf[0];
+	return 1;
+}
+
+static const uint8_t sel_code[] = {
+	ISO14443A_AC_SEL_CODE_CL1,
+	ISO14443A_AC_SEL_CODE_CL2,
+	ISO14443A_AC_SEL_CODE_CL3,
+};
+
+static void tag_selected(struct rfid_tag *tag, unsigned int level,
+				uint8_t sak)
+{
+	tag->level = ISO14443A_LEVEL_CL1 + level;
+	tag->uid_len = 3 * level + 4;
+	tag->sak = sak;
+	tag->layer2 = RFID_LAYER2_ISO14443A;
+	tag->state = ISO14443A_STATE_SELECTED;
+
+	if (sak & 0x20) {
+		dprintf("we have a T=CL compliant PICC\n");
+		tag->tcl_capable = 1;
+	} else {
+		dprintf("we have a T!=CL PICC\n");
+		tag->tcl_capable = 0;
+	}
+}
+
+/* Run anticollision and SELECT through every cascade level of one tag. The
+ * first level starts from the first known bits of acf and collisions there
+ * are recorded on stack, deeper levels only collide between tags sharing the
+ * same CL1 UID bytes and are not recorded.
+ */
+static int select_cascade(struct _cci *cci, struct rfid_tag *tag,
+				struct iso14443a_anticol_cmd *acf,
+				unsigned int known, struct ac_stack *stack)
+{
+	unsigned int level;
+	uint8_t sak;
+
+	tag->state = ISO14443A_STATE_ANTICOL_RUNNING;
+
+	for(level = 0; level < sizeof(sel_code); level++) {
+		acf->sel_code = sel_code[level];
+		tag->level = ISO14443A_LEVEL_CL1 + level;
+
+		if ( !resolve_level(cci, acf, known, (level) ? NULL : stack) )
+			return 0;
+		if ( !select_level(cci, acf, &sak) )
+			return 0;
+
+		if ( !(sak & 0x04) ) {
+			memcpy(&tag->uid[3 * level], &acf->uid_bits[0], 4);
+			tag_selected(tag, level, sak);
+			return 1;
+		}
 
+		/* Cascade bit set, UID not complete */
+		if (acf->uid_bits[0] != 0x88) {
+			dprintf("Cascade bit set, but UID0 != 0x88\n");
+			break;
+		}
+
+		dprintf("cascading from CL%u to CL%u\n", level + 1, level + 2);
+		memcpy(&tag->uid[3 * level], &acf->uid_bits[1], 3);
+		memset(acf->uid_bits, 0, sizeof(acf->uid_bits));
+		known = 0;
+	}
+
+	dprintf("cannot cascade any further than CL3\n");
+	tag->state = ISO14443A_STATE_ERROR;
 	return 0;
 }
 
 int _iso14443a_anticol(struct _cci *cci, int wup, struct rfid_tag *tag)
 {
-	int ret;
-	unsigned int uid_size;
 	struct iso14443a_atqa atqa;
 	struct iso14443a_anticol_cmd acf;
-	unsigned int bit_of_col;
-	unsigned char sak[3];
-	size_t rx_len = sizeof(sak);
 
-	memset(sak, 0, sizeof(sak));
-	memset(&atqa, 0, sizeof(atqa));
 	memset(&acf, 0, sizeof(acf));
 
-	memset(tag, 0, sizeof(tag));
-	tag->state = ISO14443A_STATE_NONE;
+	memset(tag, 0, sizeof(*tag));
+	tag->state = ISO14443A_STATE_REQA_SENT;
 	tag->level = ISO14443A_LEVEL_NONE;
 
-
-	if (wup) {
-		dprintf("Sending WUPA\n");
-		ret = _iso14443a_transceive_sf(cci,
-					ISO14443A_SF_CMD_WUPA, &atqa);
-	}else{
-		dprintf("Sending REQA\n");
-		ret = _iso14443a_transceive_sf(cci,
-					ISO14443A_SF_CMD_REQA, &atqa);
-	}
-
-	if (!ret) {
-		tag->state = ISO14443A_STATE_REQA_SENT;
-		dprintf("error during transceive_sf: %d\n", ret);
+	if ( !request(cci, wup, &atqa) ) {
+		dprintf("error during transceive_sf\n");
 		return 0;
 	}
 	tag->state = ISO14443A_STATE_ATQA_RCVD;
+	memcpy(tag->atqa, &atqa, sizeof(tag->atqa));
 
 	if (!atqa.bf_anticol) {
 		tag->state = ISO14443A_STATE_NO_BITFRAME_ANTICOL;
 		dprintf("no bitframe anticollission bits set, aborting\n");
-		return -1;
+		return 0;
 	}
 	dprintf("ATQA anticol bits = %d\n", atqa.bf_anticol);
 
-	if (atqa.uid_size == 2 || atqa.uid_size == 3)
-		uid_size = 3;
-	else if (atqa.uid_size == 1)
-		uid_size = 2;
-	else
-		uid_size = 1;
+	return select_cascade(cci, tag, &acf, 0, NULL);
+}
 
-	dprintf("uid_size = %u\n", uid_size);
-	acf.sel_code = ISO14443A_AC_SEL_CODE_CL1;
+/* ISO 14443-3, Chapter 6.3.3: the PICC never answers a HLTA */
+static void iso14443a_hlta(struct _cci *cci)
+{
+	static const uint8_t hlta[] = {0x50, 0x00};
+	uint8_t rx_buf[1];
+	size_t rx_len = sizeof(rx_buf);
 
-	tag->state = ISO14443A_STATE_ANTICOL_RUNNING;
-	tag->level = ISO14443A_LEVEL_CL1;
+	_iso14443ab_transceive(cci, RFID_14443A_FRAME_REGULAR,
+				hlta, sizeof(hlta), rx_buf, &rx_len, TIMEOUT);
+}
 
-cascade:
-	rx_len = sizeof(sak);
-	iso14443a_code_nvb_bits(&acf.nvb, 16);
-	dprintf("ANTICOL: sel_code=%.2x nvb=%.2x\n", acf.sel_code, acf.nvb);
+/* Check for a tag with nothing but a REQA/WUPA. A tag which answers is sent
+ * straight back to IDLE by the HLTA, which it doesn't expect when READY, so
+ * it answers the same way next time and is ready for a full anticollision.
+ */
+int _iso14443a_present(struct _cci *cci, int wup)
+{
+	struct iso14443a_atqa atqa;
 
-	ret = _iso14443a_transceive_acf(cci, &acf, &bit_of_col);
-	dprintf("tran_acf->%d boc: %d\n",ret,bit_of_col);
-	if (!ret)
+	if ( !request(cci, wup, &atqa) )
 		return 0;
 
-	while (bit_of_col != ISO14443A_BITOFCOL_NONE) {
-		dprintf("collision at pos %u\n", bit_of_col);
-
-		iso14443a_code_nvb_bits(&acf.nvb, bit_of_col);
-		rnd_toggle_bit_in_field(acf.uid_bits, sizeof(acf.uid_bits), bit_of_col);
-		dprintf("acf: nvb=0x%02X uid_bits=...\n", acf.nvb);
-		dhex_dump(acf.uid_bits, sizeof(acf.uid_bits), 16);
-		if ( !_iso14443a_transceive_acf(cci, &acf, &bit_of_col) )
-			return 0;
-	}
+	iso14443a_hlta(cci);
+	return 1;
+}
 
-	iso14443a_code_nvb_bits(&acf.nvb, 7*8);
+/* Find up to max tags in the field by walking the anticollision tree, each
+ * one found is selected and then halted so that it drops out of the next
+ * REQA. A branch is only popped when no tag answers to its prefix, so a
+ * lost branch or a collision at CL2/CL3 just means coming back to the same
+ * prefix one more time.
+ */
+int _iso14443a_inventory(struct _cci *cci, struct rfid_tag *tags,
+				unsigned int max, unsigned int *num)
+{
+	struct ac_stack stack;
+	struct iso14443a_atqa atqa;
+	struct iso14443a_anticol_cmd acf;
+	struct rfid_tag *tag;
+	unsigned int n, top;
 
-	dprintf("ANTICOL: sel_code=%.2x nvb=%.2x\n", acf.sel_code, acf.nvb);
-	if ( !_iso14443ab_transceive(cci, RFID_14443A_FRAME_REGULAR,
-				   (unsigned char *)&acf, sizeof(acf),
-				   (unsigned char *) &sak, &rx_len,
-				   TIMEOUT) )
-		return 0;
+	memset(&stack.b[0], 0, sizeof(stack.b[0]));
+	stack.top = 1;
 
-	if (sak[0] & 0x04) {
-		/* Cascade bit set, UID not complete */
-		switch (acf.sel_code) {
-		case ISO14443A_AC_SEL_CODE_CL1:
-			/* cascading from CL1 to CL2 */
-			dprintf("cascading from CL1 to CL2\n");
-			if (acf.uid_bits[0] != 0x88) {
-				dprintf("Cascade bit set, but UID0 != 0x88\n");
-				return 0;
-			}
-			memcpy(&tag->uid[0], &acf.uid_bits[1], 3);
-			acf.sel_code = ISO14443A_AC_SEL_CODE_CL2;
-			tag->level = ISO14443A_LEVEL_CL2;
-			break;
-		case ISO14443A_AC_SEL_CODE_CL2:
-			/* cascading from CL2 to CL3 */
-			dprintf("cascading from CL2 to CL3\n");
-			memcpy(&tag->uid[3], &acf.uid_bits[1], 3);
-			acf.sel_code = ISO14443A_AC_SEL_CODE_CL3;
-			tag->level = ISO14443A_LEVEL_CL3;
+	for(n = 0; n < max && stack.top; ) {
+		/* halted tags stay quiet so silence means we're done */
+		if ( !request(cci, 0, &atqa) )
 			break;
-		default:
-			dprintf("cannot cascade any further than CL3\n");
-			tag->state = ISO14443A_STATE_ERROR;
-			return 0;
-		}
-		goto cascade;
 
-	} else {
-		switch (acf.sel_code) {
-		case ISO14443A_AC_SEL_CODE_CL1:
-			/* single size UID (4 bytes) */
-			memcpy(&tag->uid[0], &acf.uid_bits[0], 4);
-			break;
-		case ISO14443A_AC_SEL_CODE_CL2:
-			/* double size UID (7 bytes) */
-			memcpy(&tag->uid[3], &acf.uid_bits[0], 4);
-			break;
-		case ISO14443A_AC_SEL_CODE_CL3:
-			/* triple size UID (10 bytes) */
-			memcpy(&tag->uid[6], &acf.uid_bits[0], 4);
-			break;
+		top = stack.top - 1;
+		memset(&acf, 0, sizeof(acf));
+		memcpy(acf.uid_bits, stack.b[top].uid_bits,
+			sizeof(acf.uid_bits));
+
+		tag = tags + n;
+		memset(tag, 0, sizeof(*tag));
+		memcpy(tag->atqa, &atqa, sizeof(tag->atqa));
+
+		if ( !select_cascade(cci, tag, &acf,
+					stack.b[top].known, &stack) ) {
+			if ( stack.top == top + 1 )
+				stack.top = top;
+			continue;
 		}
+
+		dprintf("Found ISO-14443-A tag: cascade level %d\n",
+			tag->level);
+		dhex_dump(tag->uid, tag->uid_len, 16);
+
+		iso14443a_hlta(cci);
+		n++;
 	}
 
-	if (tag->level == ISO14443A_LEVEL_CL1)
-		tag->uid_len = 4;
-	else if (tag->level == ISO14443A_LEVEL_CL2)
-		tag->uid_len = 7;
-	else
-		tag->uid_len = 10;
+	*num = n;
+	return 1;
+}
 
-	tag->layer2 = RFID_LAYER2_ISO14443A;
-	tag->state = ISO14443A_STATE_SELECTED;
+/* Select a tag with a known UID, halted tags included */
+int _iso14443a_select(struct _cci *cci, struct rfid_tag *tag)
+{
+	struct iso14443a_atqa atqa;
+	struct iso14443a_anticol_cmd acf;
+	unsigned int level, levels;
+	const uint8_t *uid;
+	uint8_t sak;
+
+	switch(tag->uid_len) {
+	case 4:
+	case 7:
+	case 10:
+		levels = (tag->uid_len - 1) / 3;
+		break;
+	default:
+		return 0;
+	}
 
-	if (sak[0] & 0x20) {
-		dprintf("we have a T=CL compliant PICC\n");
-		tag->tcl_capable = 1;
-	} else {
-		dprintf("we have a T!=CL PICC\n");
-		tag->tcl_capable = 0;
+	if ( !request(cci, 1, &atqa) )
+		return 0;
+
+	for(level = 0; level < levels; level++) {
+		uid = tag->uid + 3 * level;
+		acf.sel_code = sel_code[level];
+		if ( level + 1 < levels ) {
+			acf.uid_bits[0] = 0x88;
+			memcpy(&acf.uid_bits[1], uid, 3);
+		}else{
+			memcpy(&acf.uid_bits[0], uid, 4);
+		}
+		acf.uid_bits[4] = acf.uid_bits[0] ^ acf.uid_bits[1] ^
+				acf.uid_bits[2] ^ acf.uid_bits[3];
+
+		if ( !select_level(cci, &acf, &sak) )
+			return 0;
+
+		/* cascade bit must be set on all but the last level */
+		if ( !(sak & 0x04) != (level + 1 == levels) )
+			return 0;
 	}
 
+	tag_selected(tag, levels - 1, sak);
 	return 1;
 }
@@ -8,7 +8,7 @@
 
 /* ISO 14443-3, Chapter 6.3.2 */
 #define ISO14443A_AC_SEL_CODE_CL1	0x93
-#define ISO14443A_AC_SEL_CODE_CL2	0x92
+#define ISO14443A_AC_SEL_CODE_CL2	0x95
 #define ISO14443A_AC_SEL_CODE_CL3	0x97
 struct iso14443a_anticol_cmd {
 	uint8_t sel_code;
@@ -51,5 +51,9 @@ _private int _iso14443a_transceive_acf(struct _cci *cci,
 					unsigned int *bit_of_col);
 _private int _iso14443a_anticol(struct _cci *cci, int wup,
 				struct rfid_tag *tag);
+_private int _iso14443a_inventory(struct _cci *cci, struct rfid_tag *tags,
+				unsigned int max, unsigned int *num);
+_private int _iso14443a_select(struct _cci *cci, struct rfid_tag *tag);
+_private int _iso14443a_present(struct _cci *cci, int wup);
 
 #endif /* ISO14443A_H */
@@ -0,0 +1,288 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2008 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Event loop for driving many CCIDs from a single thread.
+*/
+
+#include <ccid.h>
+#include <poll.h>
+#include <errno.h>
+
+#include "ccid-internal.h"
+
+struct _ccid_loop {
+	libusb_context		*l_ctx;
+	struct list_head	l_readers;
+	ccid_pollfd_added_t	l_added;
+	ccid_pollfd_removed_t	l_removed;
+	void			*l_priv;
+};
+
+/* only one loop may own the libusb context at a time */
+static struct _ccid_loop *owner;
+
+static void fd_added(int fd, short events, void *priv)
+{
+	struct _ccid_loop *loop = priv;
+	if ( loop->l_added )
+		(*loop->l_added)(fd, events, loop->l_priv);
+}
+
+static void fd_removed(int fd, void *priv)
+{
+	struct _ccid_loop *loop = priv;
+	if ( loop->l_removed )
+		(*loop->l_removed)(fd, loop->l_priv);
+}
+
+/** Create an event loop.
+ * \ingroup g_loop
+ *
+ * The loop owns the USB event handling for all readers in the process. The
+ * readers should then only be used with asynchronous calls such as
+ * \ref cci_submit, the synchronous calls will still work but block the loop.
+ *
+ * @return NULL on failure, a valid \ref ccid_loop_t otherwise.
+ */
+ccid_loop_t libccid_loop_new(void)
+{
+	struct _ccid_loop *loop;
+
+	if ( owner ) {
+		fprintf(stderr, "*** error: event loop already exists\n");
+		return NULL;
+	}
+
+	loop = calloc(1, sizeof(*loop));
+	if ( NULL == loop )
+		return NULL;
+
+	loop->l_ctx = _libccid_ctx();
+	if ( NULL == loop->l_ctx ) {
+		free(loop);
+		return NULL;
+	}
+
+	INIT_LIST_HEAD(&loop->l_readers);
+	owner = loop;
+	return loop;
+}
+
+/** Register for notification of USB file descriptors.
+ * \ingroup g_loop
+ * @param loop The \ref ccid_loop_t.
+ * @param added Called for each file descriptor which must be polled.
+ * @param removed Called when a file descriptor is no longer used.
+ * @param priv Private data pointer passed to the callbacks.
+ *
+ * The added callback is run immediately for every file descriptor currently
+ * in use, and then whenever libusb opens a new one. The events are as for
+ * poll(2). When any of them become ready call \ref libccid_loop_dispatch.
+ *
+ * @return zero on failure.
+ */
+int libccid_loop_pollfds(ccid_loop_t loop, ccid_pollfd_added_t added,
+				ccid_pollfd_removed_t removed, void *priv)
+{
+	const struct libusb_pollfd **fds, **ptr;
+
+	loop->l_added = added;
+	loop->l_removed = removed;
+	loop->l_priv = priv;
+
+	libusb_set_pollfd_notifiers(loop->l_ctx, fd_added, fd_removed, loop);
+
+	fds = libusb_get_pollfds(loop->l_ctx);
+	if ( NULL == fds )
+		return 0;
+
+	for(ptr = fds; *ptr; ptr++)
+		fd_added((*ptr)->fd, (*ptr)->events, loop);
+
+	libusb_free_pollfds(fds);
+	return 1;
+}
+
+/** Add a CCID to the loop.
+ * \ingroup g_loop
+ * @param loop The \ref ccid_loop_t.
+ * @param ccid The \ref ccid_t to add.
+ *
+ * Starts listening for slot change notifications on the reader. Events are
+ * delivered to any callback set with \ref ccid_slot_notify.
+ *
+ * @return zero on failure.
+ */
+int libccid_loop_add(ccid_loop_t loop, ccid_t ccid)
+{
+	if ( ccid->d_loop ) {
+		ccid->d_error = CCID_ERROR_IN_VALUE;
+		return 0;
+	}
+
+	/* readers without an interrupt endpoint can still do transactions */
+	_ccid_intr_start(ccid);
+
+	ccid->d_loop = loop;
+	list_add_tail(&ccid->d_loop_list, &loop->l_readers);
+	return 1;
+}
+
+/** Remove a CCID from the loop.
+ * \ingroup g_loop
+ * @param loop The \ref ccid_loop_t.
+ * @param ccid The \ref ccid_t to remove.
+ *
+ * Waits for any outstanding transactions on the reader to complete.
+ */
+void libccid_loop_remove(ccid_loop_t loop, ccid_t ccid)
+{
+	if ( ccid->d_loop != loop )
+		return;
+
+	ccid_flush(ccid);
+	list_del(&ccid->d_loop_list);
+	ccid->d_loop = NULL;
+}
+
+/* Cards in keep powered mode whose timeout has run out are powered off, and
+ * transfers past their deadline are cancelled.
+ */
+static int idle_timeout(struct _ccid_loop *loop)
+{
+	struct _ccid *ccid;
+	int ret = -1, ms;
+
+	list_for_each_entry(ccid, &loop->l_readers, d_loop_list) {
+		ms = ccid_expire_idle(ccid);
+		if ( ms >= 0 && (ret < 0 || ms < ret) )
+			ret = ms;
+		ms = _ccid_expire_xfrs(ccid);
+		if ( ms >= 0 && (ret < 0 || ms < ret) )
+			ret = ms;
+	}
+
+	return ret;
+}
+
+/** Time until the loop needs to be dispatched regardless of fd activity.
+ * \ingroup g_loop
+ * @param loop The \ref ccid_loop_t.
+ *
+ * Includes the idle timeouts of cards in keep powered mode, see
+ * \ref cci_set_idle_timeout, and the deadlines of transactions, see
+ * \ref cci_set_timeout.
+ *
+ * @return timeout in milliseconds, or -1 if there are no pending timeouts.
+ */
+int libccid_loop_timeout(ccid_loop_t loop)
+{
+	struct timeval tv;
+	int ret, ms;
+
+	ret = idle_timeout(loop);
+
+	if ( libusb_get_next_timeout(loop->l_ctx, &tv) != 1 )
+		return ret;
+
+	ms = (tv.tv_sec * 1000) + ((tv.tv_usec + 999) / 1000);
+	return (ret < 0 || ms < ret) ? ms : ret;
+}
+
+/** Handle events on all CCIDs in the loop without blocking.
+ * \ingroup g_loop
+ * @param loop The \ref ccid_loop_t.
+ *
+ * Runs completion callbacks for any transfers which have finished.
+ *
+ * @return zero on failure.
+ */
+int libccid_loop_dispatch(ccid_loop_t loop)
+{
+	struct timeval tv = {0, 0};
+	int rc;
+
+	rc = libusb_handle_events_timeout(loop->l_ctx, &tv);
+	if ( rc && rc != LIBUSB_ERROR_INTERRUPTED ) {
+		fprintf(stderr, "*** error: libusb_handle_events()\n");
+		return 0;
+	}
+
+	idle_timeout(loop);
+	return 1;
+}
+
+/** Run the loop for one iteration.
+ * \ingroup g_loop
+ * @param loop The \ref ccid_loop_t.
+ * @param timeout Maximum time to wait in milliseconds, or -1 for forever.
+ *
+ * A simple poll(2) based loop for applications which do not have their own.
+ *
+ * @return zero on failure.
+ */
+int libccid_loop_run(ccid_loop_t loop, int timeout)
+{
+	const struct libusb_pollfd **fds;
+	struct pollfd *pfd;
+	unsigned int i, nfds;
+	int usb_timeout, ret;
+
+	fds = libusb_get_pollfds(loop->l_ctx);
+	if ( NULL == fds )
+		return 0;
+
+	for(nfds = 0; fds[nfds]; nfds++)
+		/* nothing */;
+
+	pfd = calloc(nfds, sizeof(*pfd));
+	if ( NULL == pfd ) {
+		libusb_free_pollfds(fds);
+		return 0;
+	}
+
+	for(i = 0; i < nfds; i++) {
+		pfd[i].fd = fds[i]->fd;
+		pfd[i].events = fds[i]->events;
+	}
+
+	libusb_free_pollfds(fds);
+
+	usb_timeout = libccid_loop_timeout(loop);
+	if ( usb_timeout >= 0 && (timeout < 0 || usb_timeout < timeout) )
+		timeout = usb_timeout;
+
+	ret = poll(pfd, nfds, timeout);
+	free(pfd);
+
+	if ( ret < 0 && errno != EINTR ) {
+		fprintf(stderr, "*** error: poll: %s\n", strerror(errno));
+		return 0;
+	}
+
+	return libccid_loop_dispatch(loop);
+}
+
+/** Destroy an event loop.
+ * \ingroup g_loop
+ * @param loop The \ref ccid_loop_t to free.
+ *
+ * Any CCIDs still in the loop are removed, but not closed.
+ */
+void libccid_loop_free(ccid_loop_t loop)
+{
+	struct _ccid *ccid, *tmp;
+
+	if ( NULL == loop )
+		return;
+
+	list_for_each_entry_safe(ccid, tmp, &loop->l_readers, d_loop_list)
+		libccid_loop_remove(loop, ccid);
+
+	libusb_set_pollfd_notifiers(loop->l_ctx, NULL, NULL, NULL);
+	if ( owner == loop )
+		owner = NULL;
+	free(loop);
+}
@@ -8,6 +8,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include <mpool.h>
 
 #if MPOOL_POISON
@@ -16,6 +17,12 @@
 #define POISON(ptr, len) do { } while(0);
 #endif
 
+#if MPOOL_STATS
+#define STAT(x) do { x; } while(0)
+#else
+#define STAT(x) do { } while(0)
+#endif
+
 /** mpool descriptor.
  * \ingroup g_mpool
 */
@@ -26,8 +33,53 @@ struct _mpool {
 	size_t slab_size;
 	/** List of blocks. */
 	struct _mpool_hdr *slabs;
+	/** List of blocks kept by mpool_reset() for re-use. */
+	struct _mpool_hdr *spare;
 	/** List of free'd objects. */
 	void *free;
+	/** Depot and magazines for pools from mpool_new_shared(). */
+	struct _mpool_shared *shared;
+#if MPOOL_STATS
+	/** Counters for mpool_stats(). */
+	struct mpool_stats stats;
+#endif
+};
+
+/** Number of objects cached per thread by a shared pool.
+ * \ingroup g_mpool
+*/
+#define MPOOL_MAG_SIZE	32
+
+/** Per-thread cache of free objects for a shared mpool.
+ * \ingroup g_mpool
+*/
+struct _mpool_mag {
+	/** Next magazine in the depot lists. */
+	struct _mpool_mag *next;
+	/** Next in the list of every magazine, for mpool_free(). */
+	struct _mpool_mag *all;
+	/** Pool the magazine belongs to. */
+	struct _mpool *pool;
+	/** Number of objects in the magazine. */
+	unsigned int count;
+	/** The objects. */
+	void *obj[MPOOL_MAG_SIZE];
+};
+
+/** Process-wide state of a shared mpool.
+ * \ingroup g_mpool
+*/
+struct _mpool_shared {
+	/** Protects everything here and the slabs of the pool. */
+	pthread_mutex_t lock;
+	/** Each thread's current magazine. */
+	pthread_key_t key;
+	/** Depot of full magazines. */
+	struct _mpool_mag *full;
+	/** Depot of empty magazines. */
+	struct _mpool_mag *empty;
+	/** Every magazine. */
+	struct _mpool_mag *all;
 };
 
 /** mpool memory area descriptor.
@@ -87,7 +139,10 @@ mpool_t mpool_new(size_t obj_size, unsigned slab_size)
 	}
 
 	m->slabs = NULL;
+	m->spare = NULL;
 	m->free = NULL;
+	m->shared = NULL;
+	STAT(memset(&m->stats, 0, sizeof(m->stats)));
 
 	return m;
 }
@@ -99,6 +154,7 @@ mpool_t mpool_new(size_t obj_size, unsigned slab_size)
  * Allocate a new object, returns NULL if out of memory. Note that this
  * is the slow path, the fast path for common case (no new allocation
  * needed) is handled in the inline fucntion mpool_alloc() in mpool.h.
+ * Blocks kept by mpool_reset() are used before calling malloc.
  *
  * @return a new object
  */
@@ -106,10 +162,17 @@ static void *mpool_alloc_slow(struct _mpool *m)
 {
 	struct _mpool_hdr *h;
 	void *ptr, *ret;
-	
-	h = ptr = malloc(m->slab_size);
-	if ( h == NULL )
-		return NULL;
+
+	if ( m->spare ) {
+		h = ptr = m->spare;
+		m->spare = h->next;
+	}else{
+		h = ptr = malloc(m->slab_size);
+		if ( h == NULL )
+			return NULL;
+		STAT(m->stats.s_slabs++);
+		STAT(m->stats.s_committed += m->slab_size);
+	}
 
 	POISON(ptr, m->slab_size);
 
@@ -124,16 +187,7 @@ static void *mpool_alloc_slow(struct _mpool *m)
 	return ret;
 }
 
-/** Allocate an object from an mpool.
- * \ingroup g_mpool
- * @param m a valid mpool structure returned from mpool_init()
- *
- * Allocate a new object, returns NULL if out of memory. This is the
- * fast path. It never calls malloc directly.
- *
- * @return a new object
- */
-void *mpool_alloc(mpool_t m)
+static inline void *carve(struct _mpool *m)
 {
 	/* Try a free'd object first */
 	if ( unlikely(m->free) ) {
@@ -155,6 +209,36 @@ void *mpool_alloc(mpool_t m)
 	return mpool_alloc_slow(m);
 }
 
+static inline void *do_alloc(struct _mpool *m)
+{
+	void *ret;
+
+	ret = carve(m);
+#if MPOOL_STATS
+	if ( likely(ret) && ++m->stats.s_live > m->stats.s_peak )
+		m->stats.s_peak = m->stats.s_live;
+#endif
+	return ret;
+}
+
+static void *shared_alloc(struct _mpool *m);
+
+/** Allocate an object from an mpool.
+ * \ingroup g_mpool
+ * @param m a valid mpool structure returned from mpool_init()
+ *
+ * Allocate a new object, returns NULL if out of memory. This is the
+ * fast path. It never calls malloc directly.
+ *
+ * @return a new object
+ */
+void *mpool_alloc(mpool_t m)
+{
+	if ( unlikely(m->shared) )
+		return shared_alloc(m);
+	return do_alloc(m);
+}
+
 /** Destroy an mpool object.
  * \ingroup g_mpool
  * @param m a valid mpool structure returned from mpool_init()
@@ -165,11 +249,22 @@ void *mpool_alloc(mpool_t m)
 void mpool_free(mpool_t m)
 {
 	struct _mpool_hdr *h, *f;
+	struct _mpool_mag *g, *n;
 
 	if ( NULL == m )
 		return;
 
-	for(h = m->slabs; (f = h); free(f)) {
+	if ( m->shared ) {
+		pthread_key_delete(m->shared->key);
+		for(g = m->shared->all; (n = g); free(n))
+			g = g->all;
+		pthread_mutex_destroy(&m->shared->lock);
+		free(m->shared);
+		m->shared = NULL;
+	}
+
+	mpool_reset(m);
+	for(h = m->spare; (f = h); free(f)) {
 		h = h->next;
 		POISON(f, m->slab_size);
 	}
@@ -178,6 +273,29 @@ void mpool_free(mpool_t m)
 	free(m);
 }
 
+/** Free all objects without giving the memory back.
+ * \ingroup g_mpool
+ * @param m a valid mpool structure returned from mpool_init()
+ *
+ * Every object allocated from the #mpool becomes invalid, but the blocks
+ * are kept so that subsequent allocations need not call malloc. Not for
+ * shared pools, whose objects must be given back with mpool_return().
+ */
+void mpool_reset(mpool_t m)
+{
+	struct _mpool_hdr *h, *f;
+
+	for(h = m->slabs; (f = h); ) {
+		h = h->next;
+		f->next = m->spare;
+		m->spare = f;
+	}
+
+	m->slabs = NULL;
+	m->free = NULL;
+	STAT(m->stats.s_live = 0);
+}
+
 /** Free an individual object.
  * \ingroup g_mpool
  * @param m mpool object that obj was allocated from.
@@ -187,6 +305,8 @@ void mpool_free(mpool_t m)
  * free objects which mpool_alloc() scans before trying to commit
  * further memory resources.
 */
+static void shared_return(struct _mpool *m, void *obj);
+
 void mpool_return(mpool_t m, void *obj)
 {
 	if ( unlikely(obj == NULL) )
@@ -194,8 +314,13 @@ void mpool_return(mpool_t m, void *obj)
 	if ( unlikely(m->obj_size < sizeof(void *)) )
 		return;
 	POISON(obj, m->obj_size);
+	if ( unlikely(m->shared) ) {
+		shared_return(m, obj);
+		return;
+	}
 	*(void **)obj = m->free;
 	m->free = obj;
+	STAT(m->stats.s_live--);
 }
 
 /** Allocate an object initialized to zero.
@@ -218,3 +343,174 @@ void *mpool_alloc0(mpool_t m)
 
 	return ret;
 }
+
+/* Called with the shared lock held */
+static struct _mpool_mag *mag_new(struct _mpool *m)
+{
+	struct _mpool_shared *sh = m->shared;
+	struct _mpool_mag *g;
+
+	if ( sh->empty ) {
+		g = sh->empty;
+		sh->empty = g->next;
+		return g;
+	}
+
+	g = malloc(sizeof(*g));
+	if ( NULL == g )
+		return NULL;
+
+	g->pool = m;
+	g->count = 0;
+	g->all = sh->all;
+	sh->all = g;
+	return g;
+}
+
+/* At thread exit the cached objects go back to the depot */
+static void mag_dtor(void *priv)
+{
+	struct _mpool_mag *g = priv;
+	struct _mpool_shared *sh = g->pool->shared;
+
+	pthread_mutex_lock(&sh->lock);
+	if ( g->count ) {
+		g->next = sh->full;
+		sh->full = g;
+	}else{
+		g->next = sh->empty;
+		sh->empty = g;
+	}
+	pthread_mutex_unlock(&sh->lock);
+}
+
+/** Create an mpool which may be used from many threads.
+ * \ingroup g_mpool
+ *
+ * @param obj_size size of objects to allocate
+ * @param slab_size size of slabs in number of objects (set to zero for auto)
+ *
+ * As for mpool_new(), except that mpool_alloc() and mpool_return() may be
+ * called concurrently. Each thread keeps a magazine of up to MPOOL_MAG_SIZE
+ * free objects which it allocates from and returns to without locking, only
+ * whole magazines are exchanged with the depot, or objects carved from the
+ * slabs, under the pool lock. mpool_reset() may not be used.
+ *
+ * @return NULL on error.
+ */
+mpool_t mpool_new_shared(size_t obj_size, unsigned slab_size)
+{
+	struct _mpool_shared *sh;
+	struct _mpool *m;
+
+	m = mpool_new(obj_size, slab_size);
+	if ( NULL == m )
+		return NULL;
+
+	sh = calloc(1, sizeof(*sh));
+	if ( NULL == sh )
+		goto err_free;
+
+	if ( pthread_key_create(&sh->key, mag_dtor) )
+		goto err_free_sh;
+
+	pthread_mutex_init(&sh->lock, NULL);
+	m->shared = sh;
+	return m;
+
+err_free_sh:
+	free(sh);
+err_free:
+	mpool_free(m);
+	return NULL;
+}
+
+static void *shared_alloc(struct _mpool *m)
+{
+	struct _mpool_shared *sh = m->shared;
+	struct _mpool_mag *g;
+	void *ret;
+
+	g = pthread_getspecific(sh->key);
+	if ( likely(g && g->count) )
+		return g->obj[--g->count];
+
+	pthread_mutex_lock(&sh->lock);
+
+	/* swap our empty magazine for a full one */
+	if ( sh->full ) {
+		if ( g ) {
+			g->next = sh->empty;
+			sh->empty = g;
+		}
+		g = sh->full;
+		sh->full = g->next;
+		pthread_setspecific(sh->key, g);
+		pthread_mutex_unlock(&sh->lock);
+		return g->obj[--g->count];
+	}
+
+	/* nothing cached anywhere, carve it from the slabs */
+	ret = do_alloc(m);
+
+	pthread_mutex_unlock(&sh->lock);
+	return ret;
+}
+
+static void shared_return(struct _mpool *m, void *obj)
+{
+	struct _mpool_shared *sh = m->shared;
+	struct _mpool_mag *g, *e;
+
+	g = pthread_getspecific(sh->key);
+	if ( likely(g && g->count < MPOOL_MAG_SIZE) ) {
+		g->obj[g->count++] = obj;
+		return;
+	}
+
+	pthread_mutex_lock(&sh->lock);
+
+	e = mag_new(m);
+	if ( NULL == e ) {
+		/* no magazine to be had, put it straight on the free list */
+		*(void **)obj = m->free;
+		m->free = obj;
+		STAT(m->stats.s_live--);
+		pthread_mutex_unlock(&sh->lock);
+		return;
+	}
+
+	if ( g ) {
+		g->next = sh->full;
+		sh->full = g;
+	}
+
+	pthread_setspecific(sh->key, e);
+	pthread_mutex_unlock(&sh->lock);
+
+	e->obj[e->count++] = obj;
+}
+
+/** Read the counters of an mpool.
+ * \ingroup g_mpool
+ * @param m a valid mpool structure returned from mpool_init()
+ * @param st filled in with the counters
+ *
+ * Slabs and committed bytes count memory obtained from malloc and not yet
+ * given back by mpool_free(), live objects are those handed out and not yet
+ * returned, peak is the high-water mark of live objects. For shared pools
+ * objects sitting in per-thread magazines count as live.
+ */
+void mpool_stats(mpool_t m, struct mpool_stats *st)
+{
+#if MPOOL_STATS
+	if ( m->shared )
+		pthread_mutex_lock(&m->shared->lock);
+	memcpy(st, &m->stats, sizeof(*st));
+	if ( m->shared )
+		pthread_mutex_unlock(&m->shared->lock);
+#else
+	memset(st, 0, sizeof(*st));
+#endif
+	st->s_obj_size = m->obj_size;
+}
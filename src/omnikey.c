@@ -114,11 +114,60 @@ static int reg_write(struct _ccid *ccid, uint8_t reg, uint8_t val)
 	return 1;
 }
 
+/* The register access escape carries a count of (reg, val) pairs to write
+ * and a count of registers to read, so many accesses can be packed in to one
+ * command. The response is a status byte followed by the values read.
+ */
+static int reg_batch(struct _ccid *ccid,
+			const struct _clrc632_reg *wr, unsigned int nwr,
+			struct _clrc632_reg *rd, unsigned int nrd)
+{
+	struct _xfr *xfr = ccid->d_xfr;
+	unsigned int i;
+
+	assert(nwr <= CLRC632_BATCH_MAX && nrd <= CLRC632_BATCH_MAX);
+
+	trace(ccid, "     : batch of %u writes and %u reads\n", nwr, nrd);
+	xfr_reset(xfr);
+	xfr_tx_byte(xfr, 0x20);
+	xfr_tx_byte(xfr, 0x00);
+	xfr_tx_byte(xfr, nwr);
+	xfr_tx_byte(xfr, 0x00);
+	xfr_tx_byte(xfr, nrd);
+	xfr_tx_byte(xfr, 0x00);
+	for(i = 0; i < nwr; i++) {
+		trace(ccid, "     : writing reg 0x%x with 0x%.2x\n",
+			wr[i].reg, wr[i].val);
+		xfr_tx_byte(xfr, wr[i].reg);
+		xfr_tx_byte(xfr, wr[i].val);
+	}
+	for(i = 0; i < nrd; i++)
+		xfr_tx_byte(xfr, rd[i].reg);
+
+	if ( !_PC_to_RDR_Escape(ccid, RFID_SLOT, xfr) )
+		return 0;
+
+	if ( !_RDR_to_PC(ccid, RFID_SLOT, xfr) )
+		return 0;
+
+	if ( xfr->x_rxlen != 1 + nrd )
+		return 0;
+
+	for(i = 0; i < nrd; i++) {
+		rd[i].val = xfr->x_rxbuf[1 + i];
+		trace(ccid, "     : reading reg 0x%x and got 0x%.2x\n",
+			rd[i].reg, rd[i].val);
+	}
+
+	return 1;
+}
+
 static const struct _clrc632_ops asic_ops = {
 	.fifo_read = fifo_read,
 	.fifo_write = fifo_write,
 	.reg_read = reg_read,
 	.reg_write = reg_write,
+	.reg_batch = reg_batch,
 };
 
 static int enable_clrc632(struct _ccid *ccid)
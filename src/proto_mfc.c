@@ -63,7 +63,7 @@ int _mfc_read(struct _cci *cci, unsigned int page,
 }
 
 int _mfc_write(struct _cci *cci, unsigned int page,
-	   unsigned char *tx_data, unsigned int tx_len)
+	   const unsigned char *tx_data, unsigned int tx_len)
 {
 	unsigned char tx[2];
 	unsigned char rx[1];
@@ -161,3 +161,167 @@ int mfcl_sector_blocks(uint8_t sector)
 	else
 		return 0;
 }
+
+size_t _mfc_sectors_size(unsigned int sector, unsigned int num)
+{
+	size_t len = 0;
+
+	for(; num && sector < MIFARE_CL_SECTORS; sector++, num--)
+		len += mfcl_sector_blocks(sector) * MIFARE_CL_PAGE_SIZE;
+
+	return len;
+}
+
+/* Authenticate to a sector unless that has already been done with the same
+ * key, the key itself is only loaded in to the ASIC when it changes.
+ */
+static int sector_auth(struct _cci *cci, struct rfid_tag *tag,
+			struct mfc_handle *h, unsigned int sector,
+			uint8_t cmd, const uint8_t *coded)
+{
+	uint32_t serno;
+	int same_key;
+
+	same_key = h->key_loaded && !memcmp(h->key, coded, sizeof(h->key));
+
+	if ( same_key && h->auth_valid &&
+			h->auth_sector == sector && h->auth_cmd == cmd )
+		return 1;
+
+	h->auth_valid = 0;
+
+	if ( !same_key ) {
+		h->key_loaded = 0;
+		if ( !_rfid_layer1_mfc_load_key(cci, coded) )
+			return 0;
+		memcpy(h->key, coded, sizeof(h->key));
+		h->key_loaded = 1;
+	}
+
+	/* the last 4 bytes are used for double size UIDs */
+	memcpy(&serno, tag->uid + tag->uid_len - sizeof(serno), sizeof(serno));
+
+	if ( !_rfid_layer1_mfc_auth(cci, cmd, serno,
+					mfcl_sector2block(sector)) )
+		return 0;
+
+	h->auth_valid = 1;
+	h->auth_sector = sector;
+	h->auth_cmd = cmd;
+	return 1;
+}
+
+/* A failed command drops the card out of the authenticated state, select it
+ * again so the next sector gets a chance.
+ */
+static int sector_failed(struct _cci *cci, struct rfid_tag *tag,
+			struct mfc_handle *h)
+{
+	h->auth_valid = 0;
+	return _iso14443a_select(cci, tag);
+}
+
+static int sectors_prepare(struct _cci *cci,
+				unsigned int sector, unsigned int num,
+				const struct cci_mfc_key *keys,
+				uint8_t coded[][RFID_MFC_CODED_KEY_LEN])
+{
+	unsigned int i;
+
+	if ( sector >= MIFARE_CL_SECTORS || num > MIFARE_CL_SECTORS - sector )
+		return 0;
+
+	for(i = 0; i < num; i++) {
+		if ( keys[i].k_type != CCI_MFC_KEY_A &&
+				keys[i].k_type != CCI_MFC_KEY_B )
+			return 0;
+		_rfid_layer1_mfc_code_key(cci, keys[i].k_key, coded[i]);
+	}
+
+	return 1;
+}
+
+int _mfc_read_sectors(struct _cci *cci, struct rfid_tag *tag,
+			struct mfc_handle *h,
+			unsigned int sector, unsigned int num,
+			const struct cci_mfc_key *keys,
+			uint8_t *buf, uint64_t *done)
+{
+	uint8_t coded[MIFARE_CL_SECTORS][RFID_MFC_CODED_KEY_LEN];
+	unsigned int i, blk, first, nblk, len;
+
+	*done = 0;
+
+	if ( !sectors_prepare(cci, sector, num, keys, coded) )
+		return 0;
+
+	for(i = 0; i < num; i++) {
+		first = mfcl_sector2block(sector + i);
+		nblk = mfcl_sector_blocks(sector + i);
+		blk = 0;
+
+		if ( !sector_auth(cci, tag, h, sector + i,
+					keys[i].k_type, coded[i]) )
+			goto fail;
+
+		for(; blk < nblk; blk++) {
+			len = MIFARE_CL_PAGE_SIZE;
+			if ( !_mfc_read(cci, first + blk, buf, &len) ||
+					len != MIFARE_CL_PAGE_SIZE )
+				goto fail;
+			buf += MIFARE_CL_PAGE_SIZE;
+		}
+
+		*done |= 1ULL << i;
+		continue;
+fail:
+		memset(buf, 0, (nblk - blk) * MIFARE_CL_PAGE_SIZE);
+		buf += (nblk - blk) * MIFARE_CL_PAGE_SIZE;
+		if ( !sector_failed(cci, tag, h) )
+			return 0;
+	}
+
+	return 1;
+}
+
+int _mfc_write_sectors(struct _cci *cci, struct rfid_tag *tag,
+			struct mfc_handle *h,
+			unsigned int sector, unsigned int num,
+			const struct cci_mfc_key *keys,
+			const uint8_t *buf, uint64_t *done)
+{
+	uint8_t coded[MIFARE_CL_SECTORS][RFID_MFC_CODED_KEY_LEN];
+	unsigned int i, blk, first, nblk;
+
+	*done = 0;
+
+	if ( !sectors_prepare(cci, sector, num, keys, coded) )
+		return 0;
+
+	for(i = 0; i < num; i++, buf += nblk * MIFARE_CL_PAGE_SIZE) {
+		first = mfcl_sector2block(sector + i);
+		nblk = mfcl_sector_blocks(sector + i);
+
+		if ( !sector_auth(cci, tag, h, sector + i,
+					keys[i].k_type, coded[i]) )
+			goto fail;
+
+		/* never touch the manufacturer block or sector trailers */
+		for(blk = 0; blk + 1 < nblk; blk++) {
+			if ( first + blk == 0 )
+				continue;
+			if ( !_mfc_write(cci, first + blk,
+					buf + blk * MIFARE_CL_PAGE_SIZE,
+					MIFARE_CL_PAGE_SIZE) )
+				goto fail;
+		}
+
+		*done |= 1ULL << i;
+		continue;
+fail:
+		if ( !sector_failed(cci, tag, h) )
+			return 0;
+	}
+
+	return 1;
+}
@@ -6,8 +6,16 @@
 #ifndef _PROTO_MFC_H
 #define _PROTO_MFC_H
 
+/* What the card and ASIC were left with by the last bulk operation, so
+ * that consecutive calls on the same sector with the same key don't have to
+ * authenticate all over again.
+ */
 struct mfc_handle {
-	/* stateless */
+	uint8_t key[RFID_MFC_CODED_KEY_LEN];
+	uint8_t key_loaded;
+	uint8_t auth_valid;
+	uint8_t auth_cmd;
+	uint8_t auth_sector;
 };
 
 #define MIFARE_CL_KEYA_DEFAULT	(const uint8_t *)"\xa0\xa1\xa2\xa3\xa4\xa5"
@@ -27,7 +35,9 @@ struct mfc_handle {
 #define MIFARE_CL_BLOCKS_P_SECTOR_1k	4
 #define MIFARE_CL_BLOCKS_P_SECTOR_4k	16
 #define MIFARE_CL_SMALL_SECTORS		32
-#define MIFARE_CL_LARGE_SECTORS		4
+#define MIFARE_CL_LARGE_SECTORS		8
+#define MIFARE_CL_SECTORS		\
+	(MIFARE_CL_SMALL_SECTORS + MIFARE_CL_LARGE_SECTORS)
 
 enum rfid_proto_mfcl_opt {
 	RFID_OPT_P_MFCL_SIZE	=	0x10000001,
@@ -46,7 +56,19 @@ extern const struct rfid_protocol rfid_protocol_mfcl;
 _private int _mfc_read(struct _cci *cci, unsigned int page,
 			unsigned char *rx_data, unsigned int *rx_len);
 _private int _mfc_write(struct _cci *cci, unsigned int page,
-			unsigned char *tx_data, unsigned int tx_len);
+			const unsigned char *tx_data, unsigned int tx_len);
+
+_private size_t _mfc_sectors_size(unsigned int sector, unsigned int num);
+_private int _mfc_read_sectors(struct _cci *cci, struct rfid_tag *tag,
+				struct mfc_handle *h,
+				unsigned int sector, unsigned int num,
+				const struct cci_mfc_key *keys,
+				uint8_t *buf, uint64_t *done);
+_private int _mfc_write_sectors(struct _cci *cci, struct rfid_tag *tag,
+				struct mfc_handle *h,
+				unsigned int sector, unsigned int num,
+				const struct cci_mfc_key *keys,
+				const uint8_t *buf, uint64_t *done);
 
 extern int mfcl_sector2block(uint8_t sector);
 extern int mfcl_block2sector(uint8_t block);
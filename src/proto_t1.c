@@ -0,0 +1,424 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2008 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Host side of the ISO 7816-3 T=1 block protocol, for readers which only
+ * exchange TPDUs. Commands go out as a chain of I-blocks of up to IFSC bytes
+ * and responses come back in blocks of up to IFSD, which is raised from the
+ * default of 32 with an S(IFS) request when the card is activated. Bad
+ * blocks are recovered with R-blocks, and if that fails the link is
+ * resynchronised. Waiting time extensions are passed on to the reader so it
+ * waits long enough for the next block.
+*/
+
+#include <ccid.h>
+
+#include "ccid-internal.h"
+
+#define T1_NAD		0
+#define T1_PROLOGUE	3
+#define T1_MAX_EDC	2
+#define T1_MAX_BLOCK	(T1_PROLOGUE + T1_MAX_IFS + T1_MAX_EDC)
+#define T1_MAX_RETRY	3
+
+#define PCB_R		0x80
+#define PCB_S		0xc0
+#define PCB_TYPE_MASK	0xc0
+#define PCB_I_NS	0x40
+#define PCB_I_MORE	0x20
+#define PCB_R_NR	0x10
+#define PCB_R_EDC	0x01
+#define PCB_R_OTHER	0x02
+#define PCB_S_RESPONSE	0x20
+
+#define S_RESYNCH	0x00
+#define S_IFS		0x01
+#define S_ABORT		0x02
+#define S_WTX		0x03
+
+#define is_i_block(pcb)	(((pcb) & PCB_R) == 0)
+#define is_r_block(pcb)	(((pcb) & PCB_TYPE_MASK) == PCB_R)
+
+/* CRC-16 of ISO/IEC 13239, reflected, as used for the T=1 EDC */
+static const uint16_t crc_table[256] = {
+	0x0000, 0x1189, 0x2312, 0x329b, 0x4624, 0x57ad, 0x6536, 0x74bf,
+	0x8c48, 0x9dc1, 0xaf5a, 0xbed3, 0xca6c, 0xdbe5, 0xe97e, 0xf8f7,
+	0x1081, 0x0108, 0x3393, 0x221a, 0x56a5, 0x472c, 0x75b7, 0x643e,
+	0x9cc9, 0x8d40, 0xbfdb, 0xae52, 0xdaed, 0xcb64, 0xf9ff, 0xe876,
+	0x2102, 0x308b, 0x0210, 0x1399, 0x6726, 0x76af, 0x4434, 0x55bd,
+	0xad4a, 0xbcc3, 0x8e58, 0x9fd1, 0xeb6e, 0xfae7, 0xc87c, 0xd9f5,
+	0x3183, 0x200a, 0x1291, 0x0318, 0x77a7, 0x662e, 0x54b5, 0x453c,
+	0xbdcb, 0xac42, 0x9ed9, 0x8f50, 0xfbef, 0xea66, 0xd8fd, 0xc974,
+	0x4204, 0x538d, 0x6116, 0x709f, 0x0420, 0x15a9, 0x2732, 0x36bb,
+	0xce4c, 0xdfc5, 0xed5e, 0xfcd7, 0x8868, 0x99e1, 0xab7a, 0xbaf3,
+	0x5285, 0x430c, 0x7197, 0x601e, 0x14a1, 0x0528, 0x37b3, 0x263a,
+	0xdecd, 0xcf44, 0xfddf, 0xec56, 0x98e9, 0x8960, 0xbbfb, 0xaa72,
+	0x6306, 0x728f, 0x4014, 0x519d, 0x2522, 0x34ab, 0x0630, 0x17b9,
+	0xef4e, 0xfec7, 0xcc5c, 0xddd5, 0xa96a, 0xb8e3, 0x8a78, 0x9bf1,
+	0x7387, 0x620e, 0x5095, 0x411c, 0x35a3, 0x242a, 0x16b1, 0x0738,
+	0xffcf, 0xee46, 0xdcdd, 0xcd54, 0xb9eb, 0xa862, 0x9af9, 0x8b70,
+	0x8408, 0x9581, 0xa71a, 0xb693, 0xc22c, 0xd3a5, 0xe13e, 0xf0b7,
+	0x0840, 0x19c9, 0x2b52, 0x3adb, 0x4e64, 0x5fed, 0x6d76, 0x7cff,
+	0x9489, 0x8500, 0xb79b, 0xa612, 0xd2ad, 0xc324, 0xf1bf, 0xe036,
+	0x18c1, 0x0948, 0x3bd3, 0x2a5a, 0x5ee5, 0x4f6c, 0x7df7, 0x6c7e,
+	0xa50a, 0xb483, 0x8618, 0x9791, 0xe32e, 0xf2a7, 0xc03c, 0xd1b5,
+	0x2942, 0x38cb, 0x0a50, 0x1bd9, 0x6f66, 0x7eef, 0x4c74, 0x5dfd,
+	0xb58b, 0xa402, 0x9699, 0x8710, 0xf3af, 0xe226, 0xd0bd, 0xc134,
+	0x39c3, 0x284a, 0x1ad1, 0x0b58, 0x7fe7, 0x6e6e, 0x5cf5, 0x4d7c,
+	0xc60c, 0xd785, 0xe51e, 0xf497, 0x8028, 0x91a1, 0xa33a, 0xb2b3,
+	0x4a44, 0x5bcd, 0x6956, 0x78df, 0x0c60, 0x1de9, 0x2f72, 0x3efb,
+	0xd68d, 0xc704, 0xf59f, 0xe416, 0x90a9, 0x8120, 0xb3bb, 0xa232,
+	0x5ac5, 0x4b4c, 0x79d7, 0x685e, 0x1ce1, 0x0d68, 0x3ff3, 0x2e7a,
+	0xe70e, 0xf687, 0xc41c, 0xd595, 0xa12a, 0xb0a3, 0x8238, 0x93b1,
+	0x6b46, 0x7acf, 0x4854, 0x59dd, 0x2d62, 0x3ceb, 0x0e70, 0x1ff9,
+	0xf78f, 0xe606, 0xd49d, 0xc514, 0xb1ab, 0xa022, 0x92b9, 0x8330,
+	0x7bc7, 0x6a4e, 0x58d5, 0x495c, 0x3de3, 0x2c6a, 0x1ef1, 0x0f78,
+};
+
+static size_t edc_len(const struct _t1 *t1)
+{
+	return (t1->t_crc) ? 2 : 1;
+}
+
+static void edc(const struct _t1 *t1, const uint8_t *ptr, size_t len,
+		uint8_t *out)
+{
+	uint16_t crc = 0xffff;
+	uint8_t lrc = 0;
+
+	if ( !t1->t_crc ) {
+		while ( len-- )
+			lrc ^= *ptr++;
+		out[0] = lrc;
+		return;
+	}
+
+	while ( len-- )
+		crc = (crc >> 8) ^ crc_table[(crc ^ *ptr++) & 0xff];
+	out[0] = crc >> 8;
+	out[1] = crc & 0xff;
+}
+
+static uint8_t r_pcb(const struct _t1 *t1, uint8_t err)
+{
+	return PCB_R | ((t1->t_nr) ? PCB_R_NR : 0) | err;
+}
+
+/* Send a block and receive the answer in to t_xfr. Returns -1 if the reader
+ * failed, zero if the card said nothing or garbage, which is recoverable,
+ * and 1 for a good block.
+ */
+static int xchg(struct _cci *cci, uint8_t pcb, const uint8_t *inf,
+		size_t len, unsigned int wtx)
+{
+	struct _ccid *ccid = cci->i_parent;
+	struct _t1 *t1 = &cci->i_t1;
+	struct _xfr *xfr = t1->t_xfr;
+	size_t elen = edc_len(t1);
+	uint8_t sum[T1_MAX_EDC];
+	uint8_t *blk;
+
+	xfr_reset(xfr);
+	blk = xfr->x_txbuf;
+	blk[0] = T1_NAD;
+	blk[1] = pcb;
+	blk[2] = len;
+	if ( len )
+		memcpy(blk + T1_PROLOGUE, inf, len);
+	edc(t1, blk, T1_PROLOGUE + len, blk + T1_PROLOGUE + len);
+	xfr->x_txlen = T1_PROLOGUE + len + elen;
+
+	if ( !_PC_to_RDR_XfrBlock_bwi(ccid, cci->i_idx, xfr, wtx) )
+		return -1;
+	if ( !_RDR_to_PC(ccid, cci->i_idx, xfr) )
+		return (ccid->d_error == CCID_ERROR_CARD_IO) ? 0 : -1;
+	_RDR_to_PC_DataBlock(ccid, xfr);
+
+	blk = xfr->x_rxbuf;
+	if ( xfr->x_rxlen < T1_PROLOGUE + elen ||
+			blk[2] > T1_MAX_IFS ||
+			xfr->x_rxlen != T1_PROLOGUE + blk[2] + elen ) {
+		trace(ccid, "     : T=1: bad block length\n");
+		return 0;
+	}
+
+	edc(t1, blk, xfr->x_rxlen - elen, sum);
+	if ( memcmp(sum, blk + xfr->x_rxlen - elen, elen) ) {
+		trace(ccid, "     : T=1: EDC error\n");
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Send an S-block request and wait for the matching response, which must
+ * echo the INF field.
+ */
+static int s_request(struct _cci *cci, uint8_t type,
+			const uint8_t *inf, size_t len)
+{
+	const uint8_t *blk = cci->i_t1.t_xfr->x_rxbuf;
+	unsigned int i;
+	int rc;
+
+	for(i = 0; i <= T1_MAX_RETRY; i++) {
+		rc = xchg(cci, PCB_S | type, inf, len, 0);
+		if ( rc < 0 )
+			return 0;
+		if ( rc == 0 )
+			continue;
+		if ( blk[1] == (PCB_S | PCB_S_RESPONSE | type) &&
+				blk[2] == len &&
+				!memcmp(blk + T1_PROLOGUE, inf, len) )
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Ask for the biggest blocks that both the reader and the host can take,
+ * on failure the card carries on sending at most 32 bytes at a time.
+ */
+static void set_ifsd(struct _cci *cci)
+{
+	struct _ccid *ccid = cci->i_parent;
+	struct _t1 *t1 = &cci->i_t1;
+	uint8_t ifsd;
+
+	ifsd = (ccid->d_desc.dwMaxIFSD < t1->t_max_inf) ?
+		ccid->d_desc.dwMaxIFSD : t1->t_max_inf;
+
+	/* reader does the S(IFS) exchange itself */
+	if ( ccid->d_desc.dwFeatures & CCID_IFSD ) {
+		t1->t_ifsd = ifsd;
+		return;
+	}
+
+	if ( ifsd <= T1_DEFAULT_IFS )
+		return;
+
+	if ( s_request(cci, S_IFS, &ifsd, 1) )
+		t1->t_ifsd = ifsd;
+	else
+		trace(ccid, "     : T=1: IFSD %u refused\n", ifsd);
+}
+
+static void t1_reset(struct _t1 *t1)
+{
+	t1->t_ns = 0;
+	t1->t_nr = 0;
+	t1->t_ifsc = t1->t_atr_ifsc;
+	t1->t_ifsd = T1_DEFAULT_IFS;
+}
+
+/* Put both ends back to the state after the ATR, including the block sizes */
+static void resync(struct _cci *cci)
+{
+	struct _t1 *t1 = &cci->i_t1;
+
+	trace(cci->i_parent, "     : T=1: resynchronising\n");
+	if ( !s_request(cci, S_RESYNCH, NULL, 0) ) {
+		t1->t_on = 0;
+		return;
+	}
+
+	t1_reset(t1);
+	set_ifsd(cci);
+}
+
+/* Start the host T=1 engine on a freshly activated card, with the IFSC and
+ * EDC from the ATR, and negotiate the IFSD. Returns zero if out of memory.
+ */
+int _t1_init(struct _cci *cci, unsigned int ifsc, int crc)
+{
+	struct _ccid *ccid = cci->i_parent;
+	struct _t1 *t1 = &cci->i_t1;
+	uint32_t max_msg = ccid->d_desc.dwMaxCCIDMessageLength;
+
+	t1->t_on = 0;
+	if ( NULL == t1->t_xfr ) {
+		t1->t_xfr = _xfr_do_alloc(T1_MAX_BLOCK, T1_MAX_BLOCK);
+		if ( NULL == t1->t_xfr )
+			return 0;
+	}
+
+	/* blocks, CCID header and all, must fit in one reader message */
+	t1->t_max_inf = T1_MAX_IFS;
+	if ( max_msg && max_msg < sizeof(struct ccid_msg) + T1_MAX_BLOCK ) {
+		if ( max_msg < sizeof(struct ccid_msg) + T1_PROLOGUE +
+				T1_MAX_EDC + T1_DEFAULT_IFS )
+			t1->t_max_inf = T1_DEFAULT_IFS;
+		else
+			t1->t_max_inf = max_msg - sizeof(struct ccid_msg) -
+					T1_PROLOGUE - T1_MAX_EDC;
+	}
+
+	if ( ifsc < 1 || ifsc > T1_MAX_IFS )
+		ifsc = T1_DEFAULT_IFS;
+	t1->t_atr_ifsc = ifsc;
+	t1->t_crc = !!crc;
+	t1_reset(t1);
+	t1->t_on = 1;
+
+	set_ifsd(cci);
+
+	trace(ccid, " o T=1: host block protocol, IFSC %u, IFSD %u, %s\n",
+		t1->t_ifsc, t1->t_ifsd, (t1->t_crc) ? "CRC" : "LRC");
+	return 1;
+}
+
+void _t1_free(struct _t1 *t1)
+{
+	_xfr_do_free(t1->t_xfr);
+	t1->t_xfr = NULL;
+	t1->t_on = 0;
+}
+
+/* Exchange the APDU in the transmit buffer of xfr, leaving the response
+ * in its receive buffer.
+ */
+int _t1_transact(struct _cci *cci, struct _xfr *xfr)
+{
+	struct _ccid *ccid = cci->i_parent;
+	struct _t1 *t1 = &cci->i_t1;
+	const uint8_t *ptr = xfr->x_txbuf, *end = ptr + xfr->x_txlen;
+	const uint8_t *inf, *iinf, *blk;
+	uint8_t pcb, ipcb, rpcb, sinf;
+	size_t len, ilen, max, got = 0;
+	unsigned int errs = 0, wtx = 0, acked = 0;
+	int rc;
+
+	xfr->x_rxlen = 0;
+	if ( !t1->t_on ) {
+		ccid->d_error = CCID_ERROR_CARD_IO;
+		return 0;
+	}
+	blk = t1->t_xfr->x_rxbuf;
+
+	max = (t1->t_ifsc < t1->t_max_inf) ? t1->t_ifsc : t1->t_max_inf;
+next_i:
+	/* chain of I-blocks carrying the command */
+	ilen = ((size_t)(end - ptr) < max) ? (size_t)(end - ptr) : max;
+	ipcb = (t1->t_ns) ? PCB_I_NS : 0;
+	iinf = ptr;
+	ptr += ilen;
+	if ( ptr < end )
+		ipcb |= PCB_I_MORE;
+
+	pcb = ipcb;
+	inf = iinf;
+	len = ilen;
+
+	for(;;) {
+		rc = xchg(cci, pcb, inf, len, wtx);
+		wtx = 0;
+		if ( rc < 0 )
+			goto fail;
+		if ( rc == 0 ) {
+			if ( ++errs > T1_MAX_RETRY )
+				goto resync;
+			pcb = r_pcb(t1, PCB_R_EDC);
+			len = 0;
+			continue;
+		}
+
+		rpcb = blk[1];
+		if ( is_i_block(rpcb) ) {
+			/* card can't answer before the command is finished,
+			 * or send a block out of sequence
+			 */
+			if ( (!acked && (ipcb & PCB_I_MORE)) ||
+					!!(rpcb & PCB_I_NS) != t1->t_nr ) {
+				if ( ++errs > T1_MAX_RETRY )
+					goto resync;
+				pcb = r_pcb(t1, PCB_R_OTHER);
+				len = 0;
+				continue;
+			}
+
+			/* which acknowledges our last I-block */
+			if ( !acked ) {
+				t1->t_ns ^= 1;
+				acked = 1;
+			}
+
+			if ( blk[2] > xfr->x_rxmax - got ) {
+				trace(ccid, "     : T=1: response exceeds "
+					"%zu byte buffer\n", xfr->x_rxmax);
+				goto resync;
+			}
+			memcpy(xfr->x_rxbuf + got, blk + T1_PROLOGUE, blk[2]);
+			got += blk[2];
+			t1->t_nr ^= 1;
+			errs = 0;
+
+			if ( rpcb & PCB_I_MORE ) {
+				pcb = r_pcb(t1, 0);
+				len = 0;
+				continue;
+			}
+
+			xfr->x_rxlen = got;
+			return 1;
+		}
+
+		if ( is_r_block(rpcb) ) {
+			if ( !acked && (ipcb & PCB_I_MORE) &&
+					!!(rpcb & PCB_R_NR) != t1->t_ns ) {
+				/* ready for the next block of the command */
+				t1->t_ns ^= 1;
+				errs = 0;
+				goto next_i;
+			}
+
+			/* otherwise it missed what was sent last */
+			if ( ++errs > T1_MAX_RETRY )
+				goto resync;
+			if ( acked ) {
+				pcb = r_pcb(t1, 0);
+				len = 0;
+			}else{
+				pcb = ipcb;
+				inf = iinf;
+				len = ilen;
+			}
+			continue;
+		}
+
+		switch(rpcb) {
+		case PCB_S | S_WTX:
+			if ( blk[2] != 1 || !blk[T1_PROLOGUE] )
+				goto resync;
+			sinf = wtx = blk[T1_PROLOGUE];
+			trace(ccid, "     : T=1: waiting time x %u\n", wtx);
+			break;
+		case PCB_S | S_IFS:
+			if ( blk[2] != 1 || !blk[T1_PROLOGUE] ||
+					blk[T1_PROLOGUE] > T1_MAX_IFS )
+				goto resync;
+			sinf = t1->t_ifsc = blk[T1_PROLOGUE];
+			max = (t1->t_ifsc < t1->t_max_inf) ?
+				t1->t_ifsc : t1->t_max_inf;
+			trace(ccid, "     : T=1: IFSC %u\n", t1->t_ifsc);
+			break;
+		case PCB_S | S_ABORT:
+			trace(ccid, "     : T=1: card aborted chain\n");
+			xchg(cci, PCB_S | PCB_S_RESPONSE | S_ABORT, NULL, 0, 0);
+			ccid->d_error = CCID_ERROR_CARD_IO;
+			return 0;
+		default:
+			goto resync;
+		}
+
+		pcb = rpcb | PCB_S_RESPONSE;
+		inf = &sinf;
+		len = 1;
+	}
+
+resync:
+	resync(cci);
+	ccid->d_error = CCID_ERROR_CARD_IO;
+fail:
+	return 0;
+}
@@ -98,27 +98,36 @@ static unsigned int fwi_to_fwt(struct _cci *cci,
 	return (tmp / _rfid_layer1_carrier_freq(cci)) * multiplier;
 }
 
-#define ATS_TA_DIV_2	1
-#define ATS_TA_DIV_4	2
-#define ATS_TA_DIV_8	4
-
 #define PPS_DIV_8	3
 #define PPS_DIV_4	2
 #define PPS_DIV_2	1
 #define PPS_DIV_1	0
-static unsigned char d_to_di(struct _cci *cci, unsigned char D)
+
+#define di_to_kbps(DI) (106U << (DI))
+
+static unsigned int di_to_speed(unsigned char DI);
+
+/* Pick the fastest divisor which the PICC supports in both directions, and
+ * the ASIC and caller allow. The ASIC runs at the same rate each way. In TA,
+ * bit n of DR (b3-b1) and DS (b7-b5) means divisor 2^(n+1) is supported.
+ */
+static unsigned char best_di(struct _cci *cci, const struct tcl_handle *h)
 {
-	static char DI;
 	unsigned int speeds = _rfid_layer1_get_speeds(cci);
-	
-	if ((D & ATS_TA_DIV_8) && (speeds & (1 << RFID_14443A_SPEED_848K)))
-		DI = PPS_DIV_8;
-	else if ((D & ATS_TA_DIV_4) && (speeds & (1 << RFID_14443A_SPEED_424K)))
-		DI = PPS_DIV_4;
-	else if ((D & ATS_TA_DIV_2) && (speeds & (1 <<RFID_14443A_SPEED_212K)))
-		DI = PPS_DIV_2;
-	else
-		DI = PPS_DIV_1;
+	unsigned char Dr, Ds, DI;
+
+	Dr = h->ta & 0x07;
+	Ds = (h->ta & 0x70) >> 4;
+
+	for (DI = PPS_DIV_8; DI > PPS_DIV_1; DI--) {
+		if ( !(Dr & Ds & (1 << (DI - 1))) )
+			continue;
+		if ( !(speeds & (1 << di_to_speed(DI))) )
+			continue;
+		if ( h->max_kbps && di_to_kbps(DI) > h->max_kbps )
+			continue;
+		break;
+	}
 
 	return DI;
 }
@@ -147,35 +156,24 @@ static int do_pps(struct _cci *cci, struct rfid_tag *tag,
 	   we'll get stack corruption! */
 	unsigned char pps_response[10];
 	size_t rx_len = 1;
-	unsigned char Dr, Ds, DrI, DsI;
+	unsigned char DI;
 	unsigned int speed;
 
 	if (h->state != TCL_STATE_ATS_RCVD)
 		return 0;
 
-	Dr = h->ta & 0x07;
-	Ds = h->ta & 0x70 >> 4;
-	//dprintf("Dr = 0x%x, Ds = 0x%x\n", Dr, Ds);
+	DI = best_di(cci, h);
+	h->kbps = di_to_kbps(PPS_DIV_1);
 
-	if (Dr != Ds && !(h->ta & 0x80)) {
-		/* device supports different divisors for rx and tx, but not
-		 * really ?!? */
-		dprintf("PICC has contradictory TA, aborting PPS\n");
-		return 0;
-	};
+	/* everything starts at 106kbit/s, no PPS needed */
+	if (DI == PPS_DIV_1)
+		return 1;
 
 	/* ISO 14443-4:2000(E) Section 5.3. */
 
 	ppss[0] = 0xd0 | (h->cid & 0x0f);
 	ppss[1] = 0x11;
-	ppss[2] = 0x00;
-
-	/* FIXME: deal with different speed for each direction */
-	DrI = d_to_di(cci, Dr);
-	DsI = d_to_di(cci, Ds);
-	//dprintf("DrI = 0x%x, DsI = 0x%x\n", DrI, DsI);
-
-	ppss[2] = (ppss[2] & 0xf0) | (DrI | DsI << 2);
+	ppss[2] = DI | (DI << 2);
 
 	if ( !_iso14443ab_transceive(cci, RFID_14443A_FRAME_REGULAR,
 					ppss, 3, pps_response, &rx_len,
@@ -187,10 +185,11 @@ static int do_pps(struct _cci *cci, struct rfid_tag *tag,
 		return 0;
 	}
 
-	speed = di_to_speed(DrI);
+	speed = di_to_speed(DI);
 	if ( !_rfid_layer1_set_speed(cci, speed) )
 		return 0;
 
+	h->kbps = di_to_kbps(DI);
 	return 1;
 }
 
@@ -232,7 +231,9 @@ static int parse_ats(struct _cci *cci, struct rfid_tag *tag,
 	t0 = ats[1];
 	cur = &ats[2];
 
-	_iso14443_fsdi_to_fsd(t0 & 0xf, &h->fsc);
+	/* FSCI values above 8 were RFU and mean 256 bytes */
+	if ( !_iso14443_fsdi_to_fsd(t0 & 0xf, &h->fsc) )
+		h->fsc = RFID_MAX_FRAMELEN;
 	if (h->fsc > _rfid_layer1_mtu(cci) )
 		h->fsc = _rfid_layer1_mtu(cci);
 
@@ -288,12 +289,8 @@ struct rfid_xcvb {
 
 struct tcl_tx_context {
 	const unsigned char *tx;
-	unsigned char *rx;
 	const unsigned char *next_tx_byte;
-	unsigned char *next_rx_byte;
-	unsigned int rx_len;
-	unsigned int tx_len;
-	struct rfid_protocol_handle *h;
+	size_t tx_len;
 };
 
 #define tcl_ctx_todo(ctx) (ctx->tx_len - (ctx->next_tx_byte - ctx->tx))
@@ -388,7 +385,8 @@ static int tcl_prlg_len(struct tcl_handle *th)
 	return prlg_len;
 }
 
-#define max_net_tx_framesize(x)	(x->fsc - tcl_prlg_len(x))
+/* frame sizes include the two byte CRC added by the ASIC */
+#define max_net_tx_framesize(x)	(x->fsc - 2 - tcl_prlg_len(x))
 
 static int 
 tcl_refill_xcvb(struct tcl_handle *th, struct rfid_xcvb *xcvb,
@@ -403,7 +401,7 @@ tcl_refill_xcvb(struct tcl_handle *th, struct rfid_xcvb *xcvb,
 				 &xcvb->tx.hdr_len) < 0)
 		return 0;
 
-	if (tcl_ctx_todo(ctx) > th->fsc - xcvb->tx.hdr_len)
+	if (tcl_ctx_todo(ctx) > max_net_tx_framesize(th))
 		xcvb->tx.frame_len = max_net_tx_framesize(th);
 	else
 		xcvb->tx.frame_len = tcl_ctx_todo(ctx);
@@ -437,160 +435,248 @@ static void fill_xcvb_wtxm(struct tcl_handle *th, struct rfid_xcvb *xcvb,
 	xcvb->timeout = th->fwt * inf;
 }
 
-static int check_cid(struct tcl_handle *th, struct rfid_xcvb *xcvb)
+static int check_cid(struct tcl_handle *th, const unsigned char *pcb)
 {
-	if (xcvb->rx.data[0] & TCL_PCB_CID_FOLLOWING) {
-		if (xcvb->rx.data[1] != th->cid) {
+	if (pcb[0] & TCL_PCB_CID_FOLLOWING) {
+		if (pcb[1] != th->cid) {
 			dprintf("CID %u is not valid, we expected %u\n", 
-				xcvb->rx.data[1], th->cid);
+				pcb[1], th->cid);
 			return 0;
 		}
 	}
 	return 1;
 }
 
-int _tcl_transact(struct _cci *cci, struct rfid_tag *tag,
-		struct tcl_handle *th,
-		const unsigned char *tx_data, unsigned int tx_len,
-		unsigned char *rx_data, unsigned int *rx_len)
+/* Where the payload of I-blocks from the PICC ends up, either the callers
+ * buffer or handed to a callback one frame at a time.
+ */
+struct tcl_rx_sink {
+	unsigned char *buf;
+	size_t len;
+	size_t max;
+	tcl_rx_cb_t cb;
+	void *priv;
+};
+
+static int sink_put(struct tcl_rx_sink *sink, const unsigned char *payload,
+			size_t len)
 {
-	int ret;
+	if (sink->cb)
+		return (*sink->cb)(sink->priv, payload, len);
+
+	if (len > sink->max - sink->len) {
+		dprintf("response exceeds %zu byte buffer\n", sink->max);
+		return 0;
+	}
+
+	/* no-op when the frame was received in place */
+	memmove(sink->buf + sink->len, payload, len);
+	sink->len += len;
+	return 1;
+}
 
+/* Frames are received straight in to the callers buffer at the current
+ * offset, with the prologue landing on top of the tail of the previous frame
+ * which is saved and put back afterwards. That needs room for a whole frame
+ * after the offset and a prologue before it, otherwise, and for callbacks,
+ * the frame goes via the xcvb.
+ */
+static int rx_in_place(const struct tcl_rx_sink *sink, size_t hdr_len,
+			size_t frame_max)
+{
+	if (sink->cb)
+		return 0;
+	if (sink->len < hdr_len)
+		return 0;
+	return sink->max - sink->len >= frame_max - hdr_len;
+}
+
+static int tcl_xchg(struct _cci *cci, struct rfid_tag *tag,
+			struct tcl_handle *th,
+			const unsigned char *tx_data, size_t tx_len,
+			struct tcl_rx_sink *sink)
+{
 	struct rfid_xcvb xcvb;
 	struct tcl_tx_context tcl_ctx;
-
-	unsigned char ack[10];
-	unsigned int ack_len;
+	unsigned char pcb[3], saved[3];
+	unsigned char *frame;
+	size_t frame_max, frame_len, hdr_len, exp_hdr;
+	int in_place, ret;
 
 	/* initialize context */
 	tcl_ctx.next_tx_byte = tcl_ctx.tx = tx_data;
-	tcl_ctx.next_rx_byte = tcl_ctx.rx = rx_data;
-	tcl_ctx.rx_len = *rx_len;
 	tcl_ctx.tx_len = tx_len;
 
 	/* initialize xcvb */
 	xcvb.timeout = th->fwt;
 
+	/* the PICC echoes whatever CID and NAD we send */
+	exp_hdr = tcl_prlg_len(th);
+	frame_max = th->fsd - 2;
+	if (frame_max > sizeof(xcvb.rx.data))
+		frame_max = sizeof(xcvb.rx.data);
+
 tx_refill:
-	if (!tcl_refill_xcvb(th, &xcvb, &tcl_ctx)) {
-		ret = 0;
-		goto out;
-	}
+	if (!tcl_refill_xcvb(th, &xcvb, &tcl_ctx))
+		return 0;
 
 do_tx:
-	xcvb.rx.frame_len = sizeof(xcvb.rx.data);
+	in_place = rx_in_place(sink, exp_hdr, frame_max);
+	if (in_place) {
+		frame = sink->buf + sink->len - exp_hdr;
+		memcpy(saved, frame, exp_hdr);
+	}else{
+		frame = xcvb.rx.data;
+	}
+
+	frame_len = frame_max;
 	ret = _iso14443ab_transceive(cci, l2_to_frame(tag->layer2),
 				     xcvb.tx.data, xcvb.tx.frame_len,
-				     xcvb.rx.data, &xcvb.rx.frame_len,
+				     frame, &frame_len,
 				     xcvb.timeout);
-	if ( !ret )
+	if (ret && !frame_len)
+		ret = 0;
+
+	/* work from a copy of the prologue so the tail can be put back */
+	memset(pcb, 0, sizeof(pcb));
+	memcpy(pcb, frame, (frame_len < sizeof(pcb)) ? frame_len : sizeof(pcb));
+
+	hdr_len = 1;
+	if (pcb[0] & TCL_PCB_CID_FOLLOWING)
+		hdr_len++;
+	if (is_i_block(pcb[0]) && (pcb[0] & TCL_PCB_NAD_FOLLOWING))
+		hdr_len++;
+
+	if (ret && hdr_len > frame_len) {
+		dprintf("short frame\n");
+		ret = 0;
+	}
+
+	if (ret && is_i_block(pcb[0])) {
+		if (!sink_put(sink, frame + hdr_len, frame_len - hdr_len))
+			ret = 0;
+	}
+
+	if (in_place)
+		memcpy(frame, saved, exp_hdr);
+
+	if (!ret)
 		return 0;
 
 	dprintf("l2 transceive finished\n");
 
-	if (is_r_block(xcvb.rx.data[0])) {
+	if (!check_cid(th, pcb))
+		return 0;
+
+	if (is_r_block(pcb[0])) {
 		dprintf("R-Block\n");
 
-		if ((xcvb.rx.data[0] & 0x01) != th->toggle) {
+		if ((pcb[0] & 0x01) != th->toggle) {
 			dprintf("response with wrong toggle bit\n");
-			goto out;
+			return 0;
 		}
 
 		/* Handle ACK frame in case of chaining */
-		if (!check_cid(th, &xcvb))
-			goto out;
-
 		goto tx_refill;
-	} else if (is_s_block(xcvb.rx.data[0])) {
+	} else if (is_s_block(pcb[0])) {
 		unsigned char inf;
 
 		dprintf("S-Block\n");
 		/* Handle Wait Time Extension */
-		
-		if (!check_cid(th, &xcvb))
-			goto out;
-
-		if (xcvb.rx.data[0] & TCL_PCB_CID_FOLLOWING) {
-			if (xcvb.rx.frame_len < 3) {
-				dprintf("S-Block with CID but short len\n");
-				ret = 0;
-				goto out;
-			}
-			inf = xcvb.rx.data[2];
-		} else
-			inf = xcvb.rx.data[1];
-
-		if ((xcvb.rx.data[0] & 0x30) != 0x30) {
+
+		if (frame_len < hdr_len + 1) {
+			dprintf("S-Block but short len\n");
+			return 0;
+		}
+		inf = pcb[hdr_len];
+
+		if ((pcb[0] & 0x30) != 0x30) {
 			dprintf("S-Block but not WTX?\n");
-			ret = 0;
-			goto out;
+			return 0;
 		}
 		inf &= 0x3f;	/* only lower 6 bits code WTXM */
 		if (inf == 0 || (inf >= 60 && inf <= 63)) {
 			dprintf("WTXM %u is RFU!\n", inf);
-			ret = 0;
-			goto out;
+			return 0;
 		}
-		
+
 		fill_xcvb_wtxm(th, &xcvb, inf);
 		/* start over with next transceive */
-		goto do_tx; 
-	} else if (is_i_block(xcvb.rx.data[0])) {
-		unsigned int net_payload_len;
-		/* we're actually receiving payload data */
+		goto do_tx;
+	}
 
-		dprintf("I-Block: ");
+	/* we're actually receiving payload data */
+	dprintf("I-Block: %zu bytes\n", frame_len - hdr_len);
 
-		if ((xcvb.rx.data[0] & 0x01) != th->toggle) {
-			dprintf("response with wrong toggle bit\n");
-			goto out;
-		}
+	if ((pcb[0] & 0x01) != th->toggle) {
+		dprintf("response with wrong toggle bit\n");
+		return 0;
+	}
 
-		xcvb.rx.hdr_len = 1;
+	if (pcb[0] & 0x10) {
+		/* we're not the last frame in the chain, continue rx */
+		dprintf("not the last frame in the chain, continue\n");
+		tcl_build_prologue_r(th, xcvb.tx.data, &xcvb.tx.frame_len, 0);
+		xcvb.timeout = th->fwt;
+		goto do_tx;
+	}
 
-		if (!check_cid(th, &xcvb))
-			goto out;
+	return 1;
+}
 
-		if (xcvb.rx.data[0] & TCL_PCB_CID_FOLLOWING)
-			xcvb.rx.hdr_len++;
-		if (xcvb.rx.data[0] & TCL_PCB_NAD_FOLLOWING)
-			xcvb.rx.hdr_len++;
-	
-		net_payload_len = xcvb.rx.frame_len - xcvb.rx.hdr_len;
-		dprintf("%u bytes\n", net_payload_len);
-		memcpy(tcl_ctx.next_rx_byte, &xcvb.rx.data[xcvb.rx.hdr_len], 
-			net_payload_len);
-		tcl_ctx.next_rx_byte += net_payload_len;
-
-		if (xcvb.rx.data[0] & 0x10) {
-			/* we're not the last frame in the chain, continue rx */
-			dprintf("not the last frame in the chain, continue\n");
-			ack_len = sizeof(ack);
-			tcl_build_prologue_r(th, xcvb.tx.data, &xcvb.tx.frame_len, 0);
-			xcvb.timeout = th->fwt;
-			goto do_tx;
-		}
-	}
+int _tcl_transact(struct _cci *cci, struct rfid_tag *tag,
+		struct tcl_handle *th,
+		const unsigned char *tx_data, size_t tx_len,
+		unsigned char *rx_data, size_t *rx_len)
+{
+	struct tcl_rx_sink sink = {
+		.buf = rx_data,
+		.max = *rx_len,
+	};
+	int ret;
 
-out:
-	*rx_len = tcl_ctx.next_rx_byte - tcl_ctx.rx;
+	ret = tcl_xchg(cci, tag, th, tx_data, tx_len, &sink);
+	*rx_len = sink.len;
 	return ret;
 }
 
+/* As _tcl_transact() but the response is passed to cb as it arrives, one
+ * frame at a time, so it may be any size.
+ */
+int _tcl_transact_cb(struct _cci *cci, struct rfid_tag *tag,
+		struct tcl_handle *th,
+		const unsigned char *tx_data, size_t tx_len,
+		tcl_rx_cb_t cb, void *priv)
+{
+	struct tcl_rx_sink sink = {
+		.cb = cb,
+		.priv = priv,
+	};
+
+	return tcl_xchg(cci, tag, th, tx_data, tx_len, &sink);
+}
+
 #define CID	0
 #define TIMEOUT	(((uint64_t)1000000 * 65536 / ISO14443_FREQ_CARRIER))
 int _tcl_get_ats(struct _cci *cci, struct rfid_tag *tag,
 		 struct tcl_handle *th)
 {
 	struct _ccid *ccid;
-	uint8_t ats[64];
+	uint8_t ats[RFID_MAX_FRAMELEN];
 	uint8_t rats[2];
-	size_t ats_len;
+	size_t ats_len, fsd;
 	uint8_t fsdi;
 
 	th->toggle = 1;
 
-	_iso14443_fsd_to_fsdi(_rfid_layer1_mtu(cci), &fsdi);
+	/* ask for the biggest frames we can receive */
+	fsd = _rfid_layer1_mru(cci);
+	if ( th->max_fsd && th->max_fsd < fsd )
+		fsd = th->max_fsd;
+	if ( !_iso14443_fsd_to_fsdi(fsd, &fsdi) )
+		return 0;
+	_iso14443_fsdi_to_fsd(fsdi, &th->fsd);
+
 	rats[0] = 0xe0;
 	rats[1] = (CID & 0xf) | ((fsdi & 0xf) << 4);
 
@@ -611,6 +697,9 @@ int _tcl_get_ats(struct _cci *cci, struct rfid_tag *tag,
 	if ( !do_pps(cci, tag, th) )
 		return 0;
 
+	trace(ccid, " o T=CL: %u kbit/s, FSD %zu, FSC %zu\n",
+		th->kbps, th->fsd, th->fsc);
+
 	memcpy(ccid->d_xfr->x_rxbuf, ats, ats_len);
 	ccid->d_xfr->x_rxlen = ats_len;
 	return 1;
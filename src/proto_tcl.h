@@ -22,13 +22,24 @@ struct tcl_handle {
 	unsigned int state;	/* protocol state */
 
 	unsigned int toggle;	/* send toggle with next frame */
+
+	/* bit rate negotiation */
+	unsigned int kbps;	/* chosen bit rate, both directions */
+	unsigned int max_kbps;	/* limit set by caller, or zero */
+	size_t max_fsd;		/* limit set by caller, or zero */
 };
 
 _private int _tcl_get_ats(struct _cci *cci, struct rfid_tag *tag,
 			  struct tcl_handle *th);
+typedef int (*tcl_rx_cb_t)(void *priv, const uint8_t *buf, size_t len);
+
 _private int _tcl_transact(struct _cci *cci, struct rfid_tag *tag,
 			struct tcl_handle *th,
-			const unsigned char *tx_data, unsigned int tx_len,
-			unsigned char *rx_data, unsigned int *rx_len);
+			const unsigned char *tx_data, size_t tx_len,
+			unsigned char *rx_data, size_t *rx_len);
+_private int _tcl_transact_cb(struct _cci *cci, struct rfid_tag *tag,
+			struct tcl_handle *th,
+			const unsigned char *tx_data, size_t tx_len,
+			tcl_rx_cb_t cb, void *priv);
 
 #endif /* PROTO_TCL_H */
@@ -220,6 +220,83 @@ static PyObject *cp_xfr_data(struct cp_xfr *self, PyObject *args)
 	return Py_BuildValue("s#", str, (int)len);
 }
 
+/* The view holds a reference to the xfr, not to the data in it. So the
+ * contents change underneath it with the next transaction or reset.
+ */
+static PyObject *xfr_view(struct cp_xfr *self, uint8_t *ptr, size_t len,
+				int readonly)
+{
+	Py_buffer view;
+
+	if ( PyBuffer_FillInfo(&view, (PyObject *)self, ptr, len,
+				readonly, PyBUF_FULL_RO) )
+		return NULL;
+	return PyMemoryView_FromBuffer(&view);
+}
+
+static PyObject *cp_xfr_rx_view(struct cp_xfr *self, PyObject *args)
+{
+	const uint8_t *ptr;
+	size_t len;
+
+	ptr = xfr_rx_data(self->xfr, &len);
+	if ( NULL == ptr ) {
+		PyErr_SetString(PyExc_ValueError, "RX buffer underflow");
+		return NULL;
+	}
+	return xfr_view(self, (uint8_t *)ptr, len, 1);
+}
+
+static PyObject *cp_xfr_tx_space(struct cp_xfr *self, PyObject *args)
+{
+	uint8_t *ptr;
+	size_t len;
+
+	ptr = xfr_tx_space(self->xfr, &len);
+	if ( NULL == ptr ) {
+		PyErr_SetString(PyExc_MemoryError, "TX buffer overflow");
+		return NULL;
+	}
+	return xfr_view(self, ptr, len, 0);
+}
+
+static PyObject *cp_xfr_tx_commit(struct cp_xfr *self, PyObject *args)
+{
+	Py_ssize_t len;
+
+	if ( !PyArg_ParseTuple(args, "n", &len) )
+		return NULL;
+
+	if ( len < 0 || !xfr_tx_commit(self->xfr, len) ) {
+		PyErr_SetString(PyExc_MemoryError, "TX buffer overflow");
+		return NULL;
+	}
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+/* memoryview(xfr) is the receive data, without the status words */
+static int cp_xfr_getbuffer(struct cp_xfr *self, Py_buffer *view, int flags)
+{
+	const uint8_t *ptr;
+	size_t len;
+
+	ptr = xfr_rx_data(self->xfr, &len);
+	if ( NULL == ptr ) {
+		PyErr_SetString(PyExc_BufferError, "RX buffer underflow");
+		view->obj = NULL;
+		return -1;
+	}
+
+	return PyBuffer_FillInfo(view, (PyObject *)self, (void *)ptr,
+				len, 1, flags);
+}
+
+static PyBufferProcs cp_xfr_buffer = {
+	.bf_getbuffer = (getbufferproc)cp_xfr_getbuffer,
+};
+
 static PyMethodDef cp_xfr_methods[] = {
 	{"reset", (PyCFunction)cp_xfr_reset, METH_NOARGS,	
 		"xfr.reset()\n"
@@ -239,6 +316,16 @@ static PyMethodDef cp_xfr_methods[] = {
 	{"rx_data", (PyCFunction)cp_xfr_data, METH_NOARGS,
 		"xfr.rx_data()\n"
 		"Return receive buffer data."},
+	{"rx_view", (PyCFunction)cp_xfr_rx_view, METH_NOARGS,
+		"xfr.rx_view()\n"
+		"Read-only memoryview of receive buffer data, without a copy."},
+	{"tx_space", (PyCFunction)cp_xfr_tx_space, METH_NOARGS,
+		"xfr.tx_space()\n"
+		"Writable memoryview of free transmit buffer space."},
+	{"tx_commit", (PyCFunction)cp_xfr_tx_commit, METH_VARARGS,
+		"xfr.tx_commit(len)\n"
+		"Append len bytes written through tx_space() to the transmit "
+		"buffer."},
 	{NULL,}
 };
 
@@ -246,8 +333,9 @@ static PyTypeObject xfr_pytype = {
 	PyObject_HEAD_INIT(NULL)
 	.tp_name = MODNAME ".xfr",
 	.tp_basicsize = sizeof(struct cp_xfr),
-	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER,
 	.tp_new = PyType_GenericNew,
+	.tp_as_buffer = &cp_xfr_buffer,
 	.tp_methods = cp_xfr_methods,
 	.tp_init = (initproc)cp_xfr_init,
 	.tp_dealloc = (destructor)cp_xfr_dealloc,
@@ -255,9 +343,15 @@ static PyTypeObject xfr_pytype = {
 };
 
 /* ---[ chipcard wrapper */
+
+/* The GIL is dropped around everything which waits on the reader, so other
+ * threads can drive other readers meanwhile. An xfr must only be used by one
+ * thread at a time.
+ */
 static PyObject *cp_cci_transact(struct cp_cci *self, PyObject *args)
 {
 	struct cp_xfr *xfr;
+	int ret;
 
 	if ( NULL == self->slot ) {
 		PyErr_SetString(_ccid_err, "Bad slot");
@@ -272,7 +366,11 @@ static PyObject *cp_cci_transact(struct cp_cci *self, PyObject *args)
 		return NULL;
 	}
 
-	if ( !cci_transact(self->slot, xfr->xfr) ) {
+	Py_BEGIN_ALLOW_THREADS
+	ret = cci_transact(self->slot, xfr->xfr);
+	Py_END_ALLOW_THREADS
+
+	if ( !ret ) {
 		PyErr_SetString(PyExc_IOError, "Transaction error");
 		return NULL;
 	}
@@ -287,7 +385,9 @@ static PyObject *cp_cci_wait(struct cp_cci *self, PyObject *args)
 		return NULL;
 	}
 
+	Py_BEGIN_ALLOW_THREADS
 	cci_wait_for_card(self->slot);
+	Py_END_ALLOW_THREADS
 
 	Py_INCREF(Py_None);
 	return Py_None;
@@ -295,12 +395,18 @@ static PyObject *cp_cci_wait(struct cp_cci *self, PyObject *args)
 
 static PyObject *cp_cci_status(struct cp_cci *self)
 {
+	unsigned int ret;
+
 	if ( NULL == self->slot ) {
 		PyErr_SetString(_ccid_err, "Bad slot");
 		return NULL;
 	}
 
-	return PyInt_FromLong(cci_slot_status(self->slot));
+	Py_BEGIN_ALLOW_THREADS
+	ret = cci_slot_status(self->slot);
+	Py_END_ALLOW_THREADS
+
+	return PyInt_FromLong(ret);
 }
 
 static PyObject *cp_cci_clock(struct cp_cci *self, PyObject *args)
@@ -312,7 +418,9 @@ static PyObject *cp_cci_clock(struct cp_cci *self, PyObject *args)
 		return NULL;
 	}
 
+	Py_BEGIN_ALLOW_THREADS
 	ret = cci_clock_status(self->slot);
+	Py_END_ALLOW_THREADS
 	if ( ret == CHIPCARD_CLOCK_ERR ) {
 		PyErr_SetString(PyExc_IOError, "Transaction error");
 		return NULL;
@@ -340,7 +448,9 @@ static PyObject *cp_cci_on(struct cp_cci *self, PyObject *args)
 		return NULL;
 	}
 
+	Py_BEGIN_ALLOW_THREADS
 	ptr = cci_power_on(self->slot, voltage, &atr_len);
+	Py_END_ALLOW_THREADS
 	if ( NULL == ptr ) {
 		PyErr_SetString(PyExc_IOError, "Transaction error");
 		return NULL;
@@ -351,12 +461,18 @@ static PyObject *cp_cci_on(struct cp_cci *self, PyObject *args)
 
 static PyObject *cp_cci_off(struct cp_cci *self, PyObject *args)
 {
+	int ret;
+
 	if ( NULL == self->slot ) {
 		PyErr_SetString(_ccid_err, "Bad slot");
 		return NULL;
 	}
 
-	if ( !cci_power_off(self->slot) ) {
+	Py_BEGIN_ALLOW_THREADS
+	ret = cci_power_off(self->slot);
+	Py_END_ALLOW_THREADS
+
+	if ( !ret ) {
 		PyErr_SetString(PyExc_IOError, "Transaction error");
 		return NULL;
 	}
@@ -365,6 +481,431 @@ static PyObject *cp_cci_off(struct cp_cci *self, PyObject *args)
 	return Py_None;
 }
 
+static PyObject *cp_cci_warm_reset(struct cp_cci *self, PyObject *args)
+{
+	const uint8_t *ptr;
+	size_t atr_len;
+
+	if ( NULL == self->slot ) {
+		PyErr_SetString(_ccid_err, "Bad slot");
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	ptr = cci_warm_reset(self->slot, &atr_len);
+	Py_END_ALLOW_THREADS
+	if ( NULL == ptr ) {
+		PyErr_SetString(PyExc_IOError, "Transaction error");
+		return NULL;
+	}
+
+	return Py_BuildValue("s#", ptr, (int)atr_len);
+}
+
+static PyObject *cp_cci_idle_timeout(struct cp_cci *self, PyObject *args)
+{
+	unsigned int ms;
+
+	if ( NULL == self->slot ) {
+		PyErr_SetString(_ccid_err, "Bad slot");
+		return NULL;
+	}
+
+	if ( !PyArg_ParseTuple(args, "I", &ms) )
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	cci_set_idle_timeout(self->slot, ms);
+	Py_END_ALLOW_THREADS
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *cp_cci_timeout(struct cp_cci *self, PyObject *args)
+{
+	unsigned int ms;
+
+	if ( NULL == self->slot ) {
+		PyErr_SetString(_ccid_err, "Bad slot");
+		return NULL;
+	}
+
+	if ( !PyArg_ParseTuple(args, "I", &ms) )
+		return NULL;
+
+	cci_set_timeout(self->slot, ms);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+/* Commands are run through a window of this many xfrs */
+#define BATCH_WINDOW	32
+#define BATCH_TXMAX	(5 + 256 + 1)
+#define BATCH_RXMAX	1024
+
+static PyObject *cp_cci_transact_batch(struct cp_cci *self, PyObject *args,
+					PyObject *kwds)
+{
+	static char *kwlist[] = {"apdus", "sw", "mask", "stop", "auto", NULL};
+	unsigned int sw = 0x9000, mask = 0xffff, done;
+	int stop = 0, autoresp = 0, rc;
+	struct cci_apdu apdu[BATCH_WINDOW];
+	xfr_t xfr[BATCH_WINDOW] = {NULL, };
+	PyObject *seq, *item, *list = NULL, *ret = NULL;
+	Py_ssize_t num, i, j, cnt, len;
+	const uint8_t *data;
+	size_t rlen;
+	char *ptr;
+
+	if ( NULL == self->slot ) {
+		PyErr_SetString(_ccid_err, "Bad slot");
+		return NULL;
+	}
+
+	if ( !PyArg_ParseTupleAndKeywords(args, kwds, "O|IIii", kwlist,
+					&seq, &sw, &mask, &stop, &autoresp) )
+		return NULL;
+
+	seq = PySequence_Fast(seq, "Expected a sequence of APDUs");
+	if ( NULL == seq )
+		return NULL;
+
+	num = PySequence_Fast_GET_SIZE(seq);
+	list = PyList_New(0);
+	if ( NULL == list )
+		goto out;
+
+	for(j = 0; j < BATCH_WINDOW && j < num; j++) {
+		xfr[j] = xfr_alloc(BATCH_TXMAX, BATCH_RXMAX);
+		if ( NULL == xfr[j] ) {
+			PyErr_SetString(PyExc_MemoryError, "Allocating buffer");
+			goto out;
+		}
+		xfr_auto_response(xfr[j], autoresp);
+	}
+
+	for(i = 0; i < num; i += cnt) {
+		cnt = (num - i < BATCH_WINDOW) ? num - i : BATCH_WINDOW;
+
+		for(j = 0; j < cnt; j++) {
+			item = PySequence_Fast_GET_ITEM(seq, i + j);
+			if ( PyString_AsStringAndSize(item, &ptr, &len) )
+				goto out;
+			xfr_reset(xfr[j]);
+			if ( !xfr_tx_buf(xfr[j], (uint8_t *)ptr, len) ) {
+				PyErr_SetString(PyExc_MemoryError,
+						"TX buffer overflow");
+				goto out;
+			}
+			apdu[j].a_xfr = xfr[j];
+			apdu[j].a_sw = sw;
+			apdu[j].a_sw_mask = mask;
+		}
+
+		Py_BEGIN_ALLOW_THREADS
+		done = cci_transact_batch(self->slot, apdu, cnt,
+					stop ? CCI_BATCH_STOP : 0);
+		Py_END_ALLOW_THREADS
+
+		/* when stopping, the command which failed is returned too */
+		for(j = 0; j < cnt && (!stop || j <= (Py_ssize_t)done); j++) {
+			data = xfr_rx_data(xfr[j], &rlen);
+			if ( NULL == data ) {
+				PyErr_SetString(PyExc_IOError,
+						"Transaction error");
+				goto out;
+			}
+			item = Py_BuildValue("(s#i)", data, (int)rlen,
+					(xfr_rx_sw1(xfr[j]) << 8) |
+					xfr_rx_sw2(xfr[j]));
+			if ( NULL == item )
+				goto out;
+			rc = PyList_Append(list, item);
+			Py_DECREF(item);
+			if ( rc )
+				goto out;
+		}
+
+		if ( stop && done < cnt )
+			break;
+	}
+
+	ret = list;
+	list = NULL;
+out:
+	for(j = 0; j < BATCH_WINDOW; j++)
+		xfr_free(xfr[j]);
+	Py_XDECREF(list);
+	Py_DECREF(seq);
+	return ret;
+}
+
+/* Sequence of ints in to a PyMem_Malloc()'d array of uint16_t */
+static int u16_array(PyObject *obj, uint16_t **arr, unsigned int *num)
+{
+	PyObject *seq;
+	Py_ssize_t i, n;
+	long v;
+
+	*arr = NULL;
+	*num = 0;
+	if ( NULL == obj )
+		return 1;
+
+	seq = PySequence_Fast(obj, "Expected a sequence of integers");
+	if ( NULL == seq )
+		return 0;
+
+	n = PySequence_Fast_GET_SIZE(seq);
+	*arr = PyMem_Malloc((n ? n : 1) * sizeof(**arr));
+	if ( NULL == *arr ) {
+		Py_DECREF(seq);
+		PyErr_NoMemory();
+		return 0;
+	}
+
+	for(i = 0; i < n; i++) {
+		v = PyInt_AsLong(PySequence_Fast_GET_ITEM(seq, i));
+		if ( v == -1 && PyErr_Occurred() )
+			goto err;
+		if ( v < 0 || v > 0xffff ) {
+			PyErr_SetString(PyExc_ValueError, "Value out of range");
+			goto err;
+		}
+		(*arr)[i] = v;
+	}
+
+	Py_DECREF(seq);
+	*num = n;
+	return 1;
+err:
+	Py_DECREF(seq);
+	PyMem_Free(*arr);
+	*arr = NULL;
+	return 0;
+}
+
+static PyObject *scan_dict(const struct cci_scan_result *res)
+{
+	const struct cci_scan_bucket *b;
+	PyObject *dict, *vals, *item, *key;
+	unsigned int i, j;
+	int rc;
+
+	dict = PyDict_New();
+	if ( NULL == dict )
+		return NULL;
+
+	for(i = 0; i < res->r_nbuckets; i++) {
+		b = &res->r_bucket[i];
+
+		vals = PyList_New(b->b_nval);
+		if ( NULL == vals )
+			goto err;
+		for(j = 0; j < b->b_nval; j++) {
+			item = PyInt_FromLong(b->b_val[j]);
+			if ( NULL == item ) {
+				Py_DECREF(vals);
+				goto err;
+			}
+			PyList_SET_ITEM(vals, j, item);
+		}
+
+		item = Py_BuildValue("(IN)", b->b_count, vals);
+		key = PyInt_FromLong(b->b_sw);
+		rc = (key && item) ? PyDict_SetItem(dict, key, item) : -1;
+		Py_XDECREF(key);
+		Py_XDECREF(item);
+		if ( rc )
+			goto err;
+	}
+
+	return dict;
+err:
+	Py_DECREF(dict);
+	return NULL;
+}
+
+static PyObject *cp_cci_scan(struct cp_cci *self, PyObject *args,
+				PyObject *kwds)
+{
+	static char *kwlist[] = {"field", "first", "last", "hdr", "le",
+				"path", "skip", "ignore", NULL};
+	PyObject *path = NULL, *skip = NULL, *ign = NULL, *ret = NULL;
+	struct cci_scan_result *res;
+	uint16_t *parr, *sarr, *iarr;
+	const char *hdr = "\0\0\0\0";
+	struct cci_scan scan;
+	unsigned int nign, i;
+	int hdr_len = 4, le = -1, ok;
+
+	if ( NULL == self->slot ) {
+		PyErr_SetString(_ccid_err, "Bad slot");
+		return NULL;
+	}
+
+	memset(&scan, 0, sizeof(scan));
+	if ( !PyArg_ParseTupleAndKeywords(args, kwds, "III|s#iOOO", kwlist,
+					&scan.s_field, &scan.s_first,
+					&scan.s_last, &hdr, &hdr_len, &le,
+					&path, &skip, &ign) )
+		return NULL;
+
+	if ( hdr_len != sizeof(scan.s_hdr) ) {
+		PyErr_SetString(PyExc_ValueError, "Header must be 4 bytes");
+		return NULL;
+	}
+	memcpy(scan.s_hdr, hdr, sizeof(scan.s_hdr));
+	scan.s_le = le;
+
+	if ( !u16_array(path, &parr, &scan.s_npath) )
+		return NULL;
+	if ( !u16_array(skip, &sarr, &scan.s_nskip) )
+		goto out_path;
+	if ( !u16_array(ign, &iarr, &nign) )
+		goto out_skip;
+	scan.s_path = parr;
+	scan.s_skip = sarr;
+	for(i = 0; i < nign; i++)
+		scan.s_ignore[(iarr[i] >> 3) & 0x1f] |= 1U << (iarr[i] & 7);
+
+	res = PyMem_Malloc(sizeof(*res));
+	if ( NULL == res ) {
+		PyErr_NoMemory();
+		goto out_ign;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	ok = cci_scan(self->slot, &scan, res);
+	Py_END_ALLOW_THREADS
+
+	if ( ok )
+		ret = scan_dict(res);
+	else
+		PyErr_SetString(PyExc_IOError, "Scan failed");
+
+	PyMem_Free(res);
+out_ign:
+	PyMem_Free(iarr);
+out_skip:
+	PyMem_Free(sarr);
+out_path:
+	PyMem_Free(parr);
+	return ret;
+}
+
+struct gp_mac {
+	PyObject *fn;
+	int err;
+};
+
+/* Called with the GIL dropped, from inside cci_gp_load() */
+static int gp_mac_cb(void *priv, const uint8_t *icv,
+			const uint8_t *cmd, size_t len, uint8_t *mac)
+{
+	struct gp_mac *m = priv;
+	PyGILState_STATE gil;
+	PyObject *res;
+	char *ptr;
+	Py_ssize_t rlen;
+	int ret = 0;
+
+	gil = PyGILState_Ensure();
+
+	res = PyObject_CallFunction(m->fn, "s#s#", icv, CCI_GP_MAC_LEN,
+					cmd, (int)len);
+	if ( NULL == res )
+		goto out;
+
+	if ( PyString_AsStringAndSize(res, &ptr, &rlen) ) {
+		Py_DECREF(res);
+		goto out;
+	}
+
+	if ( rlen == CCI_GP_MAC_LEN ) {
+		memcpy(mac, ptr, CCI_GP_MAC_LEN);
+		ret = 1;
+	}else{
+		PyErr_SetString(PyExc_ValueError, "MAC must be 8 bytes");
+	}
+	Py_DECREF(res);
+out:
+	if ( !ret )
+		m->err = 1;
+	PyGILState_Release(gil);
+	return ret;
+}
+
+static PyObject *cp_cci_gp_load(struct cp_cci *self, PyObject *args,
+				PyObject *kwds)
+{
+	static char *kwlist[] = {"file", "pkg", "sd", "applet", "inst",
+				"privs", "block", "extended", "mac", "icv",
+				NULL};
+	const char *pkg, *sd = "", *applet = NULL, *inst = NULL;
+	const char *icv = "\0\0\0\0\0\0\0\0";
+	int pkg_len, sd_len = 0, applet_len = 0, inst_len = 0, icv_len = 8;
+	unsigned int privs = 0, block = 0;
+	struct cci_gp_result res;
+	struct cci_gp_load load;
+	struct gp_mac m = {NULL, 0};
+	int ext = 0, ok;
+
+	if ( NULL == self->slot ) {
+		PyErr_SetString(_ccid_err, "Bad slot");
+		return NULL;
+	}
+
+	memset(&load, 0, sizeof(load));
+	if ( !PyArg_ParseTupleAndKeywords(args, kwds, "ss#|s#z#z#IIiOs#",
+					kwlist, &load.l_file, &pkg, &pkg_len,
+					&sd, &sd_len, &applet, &applet_len,
+					&inst, &inst_len, &privs, &block, &ext,
+					&m.fn, &icv, &icv_len) )
+		return NULL;
+
+	if ( icv_len != CCI_GP_MAC_LEN ) {
+		PyErr_SetString(PyExc_ValueError, "ICV must be 8 bytes");
+		return NULL;
+	}
+
+	load.l_pkg = (const uint8_t *)pkg;
+	load.l_pkg_len = pkg_len;
+	load.l_sd = (const uint8_t *)sd;
+	load.l_sd_len = sd_len;
+	load.l_applet = (const uint8_t *)applet;
+	load.l_applet_len = applet_len;
+	load.l_inst = (const uint8_t *)inst;
+	load.l_inst_len = inst_len;
+	load.l_privs = privs;
+	load.l_block = block;
+	load.l_flags = (ext) ? CCI_GP_EXTENDED : 0;
+	memcpy(load.l_icv, icv, CCI_GP_MAC_LEN);
+	if ( m.fn && m.fn != Py_None ) {
+		load.l_mac = gp_mac_cb;
+		load.l_priv = &m;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	ok = cci_gp_load(self->slot, &load, &res);
+	Py_END_ALLOW_THREADS
+
+	if ( m.err )
+		return NULL;
+
+	if ( !ok ) {
+		PyErr_Format(PyExc_IOError, "Load failed, SW=%.4x",
+				res.r_sw);
+		return NULL;
+	}
+
+	return Py_BuildValue("(IIIs#)", res.r_blocks, (unsigned int)res.r_block,
+				(unsigned int)res.r_size,
+				res.r_icv, CCI_GP_MAC_LEN);
+}
+
 static PyMethodDef cp_cci_methods[] = {
 	{"wait_for_card", (PyCFunction)cp_cci_wait, METH_NOARGS,	
 		"cci.wait_for_card()\n"
@@ -376,8 +917,43 @@ static PyMethodDef cp_cci_methods[] = {
 	{"off", (PyCFunction)cp_cci_off, METH_NOARGS,	
 		"cci.off()\n"
 		"Power off card."},
+	{"warm_reset", (PyCFunction)cp_cci_warm_reset, METH_NOARGS,
+		"cci.warm_reset()\n"
+		"Reset the active card without powering it off, returns "
+		"the ATR."},
+	{"idle_timeout", (PyCFunction)cp_cci_idle_timeout, METH_VARARGS,
+		"cci.idle_timeout(ms)\n"
+		"Keep cards powered for ms after off(), so that the next on() "
+		"is only a warm reset. Zero disables."},
+	{"timeout", (PyCFunction)cp_cci_timeout, METH_VARARGS,
+		"cci.timeout(ms)\n"
+		"Time limit for each transact(), on() or warm_reset(), "
+		"zero for none."},
 	{"transact", (PyCFunction)cp_cci_transact, METH_VARARGS,	
 		"cci.transact(xfr) - chipcard transaction."},
+	{"transact_batch", (PyCFunction)cp_cci_transact_batch,
+		METH_VARARGS | METH_KEYWORDS,
+		"cci.transact_batch(apdus, sw=0x9000, mask=0xffff, "
+		"stop=False, auto=False)\n"
+		"Run a list of command strings back to back, returns a list "
+		"of (data, sw) tuples. With stop set, stops after the first "
+		"status word which doesn't match sw under mask."},
+	{"scan", (PyCFunction)cp_cci_scan, METH_VARARGS | METH_KEYWORDS,
+		"cci.scan(field, first, last, hdr='\\0\\0\\0\\0', le=-1, "
+		"path=[], skip=[], ignore=[])\n"
+		"Brute force one field of a command, SCAN_CLA, SCAN_INS, "
+		"SCAN_P1P2 or SCAN_FID. Files in path are selected first and "
+		"again after each hit. SW1 values in ignore aren't recorded. "
+		"Returns a dict mapping each status word to a tuple of the "
+		"count and up to SCAN_VALUES of the values which got it."},
+	{"gp_load", (PyCFunction)cp_cci_gp_load, METH_VARARGS | METH_KEYWORDS,
+		"cci.gp_load(file, pkg, sd='', applet=None, inst=None, "
+		"privs=0, block=0, extended=False, mac=None, icv='\\0'*8)\n"
+		"Load a CAP or IJC file with GlobalPlatform INSTALL and LOAD, "
+		"and install applet as inst if it's given. mac(icv, cmd) "
+		"returns the C-MAC of each command if there is a secure "
+		"channel. Returns a tuple of the number of LOAD blocks, the "
+		"block size, the load file size and the next ICV."},
 	{NULL, }
 };
 
@@ -492,7 +1068,9 @@ static int cp_ccid_init(struct cp_ccid *self, PyObject *args, PyObject *kwds)
 
 	dev = get_dev(cpd);
 
+	Py_BEGIN_ALLOW_THREADS
 	self->dev = ccid_probe(dev, trace);
+	Py_END_ALLOW_THREADS
 	if ( NULL == self->dev ) {
 		PyErr_SetString(PyExc_IOError, "ccid_probe() failed");
 		return -1;
@@ -561,6 +1139,141 @@ static PyObject *cp_log(struct cp_ccid *self, PyObject *args)
 	return Py_None;
 }
 
+static PyObject *cp_cancel(struct cp_ccid *self, PyObject *args)
+{
+	unsigned int slot;
+	int ret;
+
+	if ( !PyArg_ParseTuple(args, "I", &slot) )
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	ret = ccid_cancel(self->dev, slot);
+	Py_END_ALLOW_THREADS
+
+	return PyBool_FromLong(ret);
+}
+
+static int dict_set_u64(PyObject *dict, const char *key, uint64_t val)
+{
+	PyObject *obj;
+	int ret;
+
+	obj = PyLong_FromUnsignedLongLong(val);
+	if ( NULL == obj )
+		return 0;
+	ret = PyDict_SetItemString(dict, key, obj);
+	Py_DECREF(obj);
+	return (ret == 0);
+}
+
+static PyObject *cmd_stats_dict(const struct ccid_cmd_stats *cs)
+{
+	PyObject *dict, *hist, *obj;
+	unsigned int i;
+
+	dict = PyDict_New();
+	if ( NULL == dict )
+		return NULL;
+
+	if ( !dict_set_u64(dict, "count", cs->c_count) ||
+			!dict_set_u64(dict, "total_usec", cs->c_total_usec) ||
+			!dict_set_u64(dict, "max_usec", cs->c_max_usec) )
+		goto err;
+
+	hist = PyList_New(CCID_STATS_BUCKETS);
+	if ( NULL == hist )
+		goto err;
+	for(i = 0; i < CCID_STATS_BUCKETS; i++) {
+		obj = PyLong_FromUnsignedLongLong(cs->c_hist[i]);
+		if ( NULL == obj ) {
+			Py_DECREF(hist);
+			goto err;
+		}
+		PyList_SET_ITEM(hist, i, obj);
+	}
+	i = PyDict_SetItemString(dict, "histogram", hist);
+	Py_DECREF(hist);
+	if ( i )
+		goto err;
+
+	return dict;
+err:
+	Py_DECREF(dict);
+	return NULL;
+}
+
+static PyObject *cp_stats(struct cp_ccid *self, PyObject *args)
+{
+	struct ccid_stats st;
+	PyObject *dict, *cmds, *errs, *obj, *key;
+	unsigned int i;
+	int rc;
+
+	ccid_stats(self->dev, &st);
+
+	dict = PyDict_New();
+	if ( NULL == dict )
+		return NULL;
+
+	if ( !dict_set_u64(dict, "tx_bytes", st.s_tx_bytes) ||
+			!dict_set_u64(dict, "rx_bytes", st.s_rx_bytes) ||
+			!dict_set_u64(dict, "time_extensions", st.s_time_ext) )
+		goto err;
+
+	cmds = PyDict_New();
+	if ( NULL == cmds )
+		goto err;
+	rc = PyDict_SetItemString(dict, "commands", cmds);
+	Py_DECREF(cmds);
+	if ( rc )
+		goto err;
+
+	for(i = 0; i < CCID_STATS_CMDS; i++) {
+		if ( NULL == ccid_stats_cmd_name(i) || !st.s_cmd[i].c_count )
+			continue;
+		obj = cmd_stats_dict(&st.s_cmd[i]);
+		if ( NULL == obj )
+			goto err;
+		rc = PyDict_SetItemString(cmds, ccid_stats_cmd_name(i), obj);
+		Py_DECREF(obj);
+		if ( rc )
+			goto err;
+	}
+
+	errs = PyDict_New();
+	if ( NULL == errs )
+		goto err;
+	rc = PyDict_SetItemString(dict, "errors", errs);
+	Py_DECREF(errs);
+	if ( rc )
+		goto err;
+
+	for(i = 0; i < CCID_STATS_ERRORS; i++) {
+		if ( !st.s_errors[i] )
+			continue;
+		key = PyInt_FromLong(i);
+		obj = PyLong_FromUnsignedLongLong(st.s_errors[i]);
+		rc = (key && obj) ? PyDict_SetItem(errs, key, obj) : -1;
+		Py_XDECREF(key);
+		Py_XDECREF(obj);
+		if ( rc )
+			goto err;
+	}
+
+	return dict;
+err:
+	Py_DECREF(dict);
+	return NULL;
+}
+
+static PyObject *cp_stats_reset(struct cp_ccid *self, PyObject *args)
+{
+	ccid_stats_reset(self->dev);
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
 static PyObject *ccid_bus_get(struct cp_ccid *self)
 {
 	return PyInt_FromLong(ccid_bus(self->dev));
@@ -591,6 +1304,13 @@ static PyGetSetDef cp_ccid_attribs[] = {
 static PyMethodDef cp_ccid_methods[] = {
 	{"log",(PyCFunction)cp_log, METH_VARARGS,
 		MODNAME ".log(string) - Log some text to the tracefile"},
+	{"stats",(PyCFunction)cp_stats, METH_NOARGS,
+		MODNAME ".stats() - Return performance counters as a dict"},
+	{"stats_reset",(PyCFunction)cp_stats_reset, METH_NOARGS,
+		MODNAME ".stats_reset() - Zero performance counters"},
+	{"cancel",(PyCFunction)cp_cancel, METH_VARARGS,
+		MODNAME ".cancel(slot) - Abort commands on a slot, from any "
+		"thread"},
 	{NULL, }
 };
 
@@ -671,6 +1391,12 @@ PyMODINIT_FUNC initccid(void)
 	_INT_CONST(m, CHIPCARD_CLOCK_STOP_H);
 	_INT_CONST(m, CHIPCARD_CLOCK_STOP_L);
 
+	PyModule_AddIntConstant(m, "SCAN_CLA", CCI_SCAN_CLA);
+	PyModule_AddIntConstant(m, "SCAN_INS", CCI_SCAN_INS);
+	PyModule_AddIntConstant(m, "SCAN_P1P2", CCI_SCAN_P1P2);
+	PyModule_AddIntConstant(m, "SCAN_FID", CCI_SCAN_FID);
+	PyModule_AddIntConstant(m, "SCAN_VALUES", CCI_SCAN_VALUES);
+
 	_INT_CONST(m, CHIPCARD_AUTO_VOLTAGE);
 	_INT_CONST(m, CHIPCARD_5V);
 	_INT_CONST(m, CHIPCARD_3V);
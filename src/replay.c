@@ -0,0 +1,233 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2008 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Virtual CCID which answers commands from a binary trace of a previous
+ * session, without touching USB.
+*/
+
+#include <ccid.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ccid-internal.h"
+#include "trace.h"
+
+struct _replay_rec {
+	uint8_t		*p_data;
+	size_t		p_len;
+	uint8_t		p_dir;
+};
+
+struct _replay {
+	struct _replay_rec	*r_recs;
+	unsigned int		r_num;
+	unsigned int		r_pos;
+	uint8_t			*r_blob;
+};
+
+static int load_recs(struct _replay *rp, const uint8_t *map, size_t maplen)
+{
+	struct _trace_ring r;
+	struct _trace_rec rec;
+	uint8_t *ptr;
+	int64_t off, start;
+	unsigned int n;
+
+	start = _trace_ring_open(&r, map, maplen);
+	if ( start < 0 ) {
+		fprintf(stderr, "*** error: not a valid ccid trace file\n");
+		return 0;
+	}
+
+	/* Worst case sizes, there can be no more data than the ring */
+	n = (r.head - start) / sizeof(rec) + 1;
+	rp->r_recs = calloc(n, sizeof(*rp->r_recs));
+	rp->r_blob = malloc(r.head - start + 1);
+	if ( NULL == rp->r_recs || NULL == rp->r_blob )
+		return 0;
+
+	for(off = start, ptr = rp->r_blob;
+			(uint64_t)off + sizeof(rec) <= r.head;
+			off += TRACE_ALIGN(sizeof(rec) + rec.r_len)) {
+		_trace_ring_read(&r, off, &rec, sizeof(rec));
+		if ( rec.r_magic != TRACE_REC_MAGIC )
+			continue;
+		switch(rec.r_dir) {
+		case TRACE_XMIT:
+		case TRACE_RECV:
+			if ( rec.r_len < sizeof(struct ccid_msg) )
+				continue;
+			break;
+		case TRACE_DESC:
+			break;
+		default:
+			continue;
+		}
+
+		_trace_ring_read(&r, off + sizeof(rec), ptr, rec.r_len);
+		rp->r_recs[rp->r_num].p_data = ptr;
+		rp->r_recs[rp->r_num].p_len = rec.r_len;
+		rp->r_recs[rp->r_num].p_dir = rec.r_dir;
+		rp->r_num++;
+		ptr += rec.r_len;
+	}
+
+	return 1;
+}
+
+struct _replay *_replay_open(const char *fn)
+{
+	struct _replay *rp;
+	struct stat st;
+	void *map;
+	int fd, ret;
+
+	fd = open(fn, O_RDONLY);
+	if ( fd < 0 ) {
+		fprintf(stderr, "*** error: open: %s: %s\n",
+			fn, strerror(errno));
+		return NULL;
+	}
+
+	if ( fstat(fd, &st) ) {
+		fprintf(stderr, "*** error: fstat: %s\n", strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if ( map == MAP_FAILED ) {
+		fprintf(stderr, "*** error: mmap: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	rp = calloc(1, sizeof(*rp));
+	if ( NULL == rp ) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	ret = load_recs(rp, map, st.st_size);
+	munmap(map, st.st_size);
+	if ( !ret ) {
+		_replay_close(rp);
+		return NULL;
+	}
+
+	return rp;
+}
+
+void _replay_close(struct _replay *rp)
+{
+	if ( NULL == rp )
+		return;
+	free(rp->r_recs);
+	free(rp->r_blob);
+	free(rp);
+}
+
+const uint8_t *_replay_desc(struct _replay *rp, size_t *len)
+{
+	unsigned int i;
+
+	for(i = 0; i < rp->r_num; i++) {
+		if ( rp->r_recs[i].p_dir == TRACE_DESC ) {
+			*len = rp->r_recs[i].p_len;
+			return rp->r_recs[i].p_data;
+		}
+	}
+
+	return NULL;
+}
+
+static int cmd_match(const struct _replay_rec *p, const struct ccid_msg *msg,
+			size_t len, int exact)
+{
+	const struct ccid_msg *rec = (const struct ccid_msg *)p->p_data;
+
+	if ( p->p_dir != TRACE_XMIT )
+		return 0;
+	if ( rec->bMessageType != msg->bMessageType )
+		return 0;
+	if ( !exact )
+		return 1;
+	return p->p_len == len && !memcmp(rec + 1, msg + 1,
+						len - sizeof(*msg));
+}
+
+/* The response is the next one after the command with the same sequence
+ * number, skipping time extensions which the engine would wait out anyway.
+ */
+static const struct _replay_rec *find_resp(struct _replay *rp, unsigned int i)
+{
+	const struct ccid_msg *cmd, *rsp;
+	unsigned int j, n;
+
+	cmd = (const struct ccid_msg *)rp->r_recs[i].p_data;
+	for(n = 1; n < rp->r_num; n++) {
+		j = (i + n) % rp->r_num;
+		if ( rp->r_recs[j].p_dir != TRACE_RECV )
+			continue;
+		rsp = (const struct ccid_msg *)rp->r_recs[j].p_data;
+		if ( rsp->bSeq != cmd->bSeq || rsp->bSlot != cmd->bSlot )
+			continue;
+		if ( rsp->in.bStatus == CCID_RESULT_TIMEOUT )
+			continue;
+		return rp->r_recs + j;
+	}
+
+	return NULL;
+}
+
+/* Commands are matched in order starting after the previous match, wrapping
+ * at the end of the trace so that a captured session can be looped forever.
+ * An identical command is preferred, failing that any of the same type.
+ * Returns the response length placed in the xfr, or zero.
+ */
+size_t _replay_answer(struct _replay *rp, struct _xfr *xfr, size_t txlen)
+{
+	const struct _replay_rec *rsp = NULL;
+	struct ccid_msg *msg;
+	unsigned int i, n;
+	int exact;
+
+	if ( 0 == rp->r_num )
+		return 0;
+
+	for(exact = 1; exact >= 0 && NULL == rsp; exact--) {
+		for(n = 0; n < rp->r_num; n++) {
+			i = (rp->r_pos + n) % rp->r_num;
+			if ( !cmd_match(rp->r_recs + i, xfr->x_txhdr,
+					txlen, exact) )
+				continue;
+			rsp = find_resp(rp, i);
+			if ( rsp ) {
+				rp->r_pos = (i + 1) % rp->r_num;
+				break;
+			}
+		}
+	}
+
+	if ( NULL == rsp ) {
+		fprintf(stderr, "*** error: no recorded answer for 0x%.2x\n",
+			xfr->x_txhdr->bMessageType);
+		return 0;
+	}
+
+	if ( rsp->p_len > xfr->x_rxmax + sizeof(struct ccid_msg) ) {
+		fprintf(stderr, "*** error: recorded answer too big\n");
+		return 0;
+	}
+
+	msg = (struct ccid_msg *)xfr->x_rxhdr;
+	memcpy(msg, rsp->p_data, rsp->p_len);
+	msg->bSlot = xfr->x_txhdr->bSlot;
+	msg->bSeq = xfr->x_txhdr->bSeq;
+	return rsp->p_len;
+}
@@ -30,6 +30,13 @@ struct _rfid {
 
 	rfid_l3_t rf_l3;
 	union _rfid_layer3 rf_l3p;
+
+	/* field is on and layer 1 is set up for ISO 14443-A */
+	unsigned int rf_ready;
+
+	/* negotiation limits from cci_rf_set_limits() */
+	unsigned int rf_max_kbps;
+	size_t rf_max_fsd;
 };
 
 #endif /* RFID_INTERNAL_H */
@@ -0,0 +1,310 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2008 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Regression test for the contactless stack, run by "make check" against
+ * the simulated RC632. Each case checks the results and the simulator's
+ * counters, so a change to the number of reader round trips or over the air
+ * frames shows up here and the expected values must be updated with it.
+*/
+
+#include <ccid.h>
+
+#include <stdio.h>
+#include <string.h>
+
+struct expect {
+	uint64_t	e_escapes;
+	uint64_t	e_frames;
+	uint64_t	e_collisions;
+	uint64_t	e_wtx;
+	uint64_t	e_chained;
+};
+
+/* The driver must never break the rules, or overflow the FIFO */
+static int check_stats(ccid_t ccid, const char *name, const struct expect *x)
+{
+	struct ccid_sim_stats st;
+	int ret = 1;
+
+	if ( !ccid_sim_stats(ccid, &st) ) {
+		fprintf(stderr, "%s: no simulator counters\n", name);
+		return 0;
+	}
+
+#define CHECK(f, v) \
+	if ( st.f != (v) ) { \
+		fprintf(stderr, "%s: %s is %llu, expected %llu\n", name, #f, \
+			(unsigned long long)st.f, (unsigned long long)(v)); \
+		ret = 0; \
+	}
+	CHECK(s_escapes, x->e_escapes);
+	CHECK(s_frames, x->e_frames);
+	CHECK(s_collisions, x->e_collisions);
+	CHECK(s_wtx, x->e_wtx);
+	CHECK(s_chained, x->e_chained);
+	CHECK(s_overflows, 0);
+	CHECK(s_proto_err, 0);
+#undef CHECK
+
+	if ( !ret )
+		printf("%s: escapes %llu frames %llu collisions %llu wtx %llu "
+			"chained %llu\n", name,
+			(unsigned long long)st.s_escapes,
+			(unsigned long long)st.s_frames,
+			(unsigned long long)st.s_collisions,
+			(unsigned long long)st.s_wtx,
+			(unsigned long long)st.s_chained);
+	return ret;
+}
+
+static int find_tag(const struct cci_rf_tag *found, unsigned int num,
+			const struct ccid_sim_tag *tag)
+{
+	unsigned int i;
+
+	for(i = 0; i < num; i++) {
+		if ( found[i].t_uid_len == tag->t_uid_len &&
+				!memcmp(found[i].t_uid, tag->t_uid,
+					tag->t_uid_len) &&
+				found[i].t_sak == tag->t_sak )
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Two double size UIDs which only differ at cascade level 2 */
+static int test_anticol(void)
+{
+	static const struct expect x = {
+		.e_escapes = 138,
+		.e_frames = 14,
+		.e_collisions = 1,
+	};
+	struct ccid_sim_tag tag[2];
+	struct cci_rf_tag found[4];
+	unsigned int num, i;
+	ccid_t ccid;
+	cci_t cci;
+	int ret = 0;
+
+	memset(tag, 0, sizeof(tag));
+	for(i = 0; i < 2; i++) {
+		memcpy(tag[i].t_uid, "\x04\x11\x22\x33\x44\x55\x66", 7);
+		tag[i].t_uid_len = 7;
+		tag[i].t_sak = 0x08;
+	}
+	tag[1].t_uid[5] = 0x57;
+
+	ccid = ccid_probe_sim(tag, 2, NULL);
+	if ( NULL == ccid )
+		return 0;
+
+	cci = ccid_get_field(ccid, 0);
+	ccid_sim_stats_reset(ccid);
+	if ( NULL == cci || !cci_rf_inventory(cci, found, 4, &num) ) {
+		fprintf(stderr, "anticol: inventory failed\n");
+		goto out;
+	}
+
+	if ( num != 2 || !find_tag(found, num, &tag[0]) ||
+			!find_tag(found, num, &tag[1]) ) {
+		fprintf(stderr, "anticol: found %u cards\n", num);
+		goto out;
+	}
+
+	ret = check_stats(ccid, "anticol", &x);
+out:
+	ccid_close(ccid);
+	return ret;
+}
+
+/* Card side of the T=CL test, echoes the command then a counting pattern */
+static size_t echo_apdu(void *priv, const uint8_t *cmd, size_t len,
+			uint8_t *rsp, size_t max)
+{
+	size_t i, n = 300;
+
+	if ( n + 2 > max )
+		return 0;
+	for(i = 0; i < n; i++)
+		rsp[i] = (i < len) ? cmd[i] : i & 0xff;
+	rsp[n] = 0x90;
+	rsp[n + 1] = 0x00;
+	return n + 2;
+}
+
+/* A command and a response both bigger than a frame, with WTX in between */
+static int test_tcl(void)
+{
+	static const uint8_t ats[] = {0x05, 0x72, 0x00, 0x40, 0x00};
+	static const struct expect x = {
+		.e_escapes = 75,
+		.e_frames = 6,
+		.e_wtx = 2,
+		.e_chained = 3,
+	};
+	struct ccid_sim_tag tag;
+	uint8_t cmd[80];
+	const uint8_t *rsp;
+	size_t len, i;
+	ccid_t ccid;
+	xfr_t xfr;
+	cci_t cci;
+	int ret = 0;
+
+	memset(&tag, 0, sizeof(tag));
+	memcpy(tag.t_uid, "\x08\x12\x34\x56", 4);
+	tag.t_uid_len = 4;
+	tag.t_sak = 0x20;
+	tag.t_ats = ats;
+	tag.t_ats_len = sizeof(ats);
+	tag.t_wtx = 2;
+	tag.t_apdu = echo_apdu;
+
+	ccid = ccid_probe_sim(&tag, 1, NULL);
+	if ( NULL == ccid )
+		return 0;
+
+	xfr = xfr_alloc(sizeof(cmd), 512);
+	if ( NULL == xfr )
+		goto out;
+
+	cci = ccid_get_field(ccid, 0);
+	if ( NULL == cci || NULL == cci_power_on(cci, 0, NULL) ) {
+		fprintf(stderr, "tcl: power on failed\n");
+		goto out_free;
+	}
+
+	cmd[0] = 0x00;
+	cmd[1] = 0xd6;
+	cmd[2] = 0x00;
+	cmd[3] = 0x00;
+	cmd[4] = sizeof(cmd) - 5;
+	for(i = 5; i < sizeof(cmd); i++)
+		cmd[i] = i;
+
+	ccid_sim_stats_reset(ccid);
+	xfr_reset(xfr);
+	xfr_tx_buf(xfr, cmd, sizeof(cmd));
+	if ( !cci_transact(cci, xfr) ) {
+		fprintf(stderr, "tcl: transact failed\n");
+		goto out_free;
+	}
+
+	rsp = xfr_rx_data(xfr, &len);
+	if ( NULL == rsp || len != 300 || memcmp(rsp, cmd, sizeof(cmd)) ||
+			xfr_rx_sw1(xfr) != 0x90 || xfr_rx_sw2(xfr) != 0x00 ) {
+		fprintf(stderr, "tcl: bad response\n");
+		goto out_free;
+	}
+	for(i = sizeof(cmd); i < len; i++) {
+		if ( rsp[i] != (i & 0xff) ) {
+			fprintf(stderr, "tcl: bad response\n");
+			goto out_free;
+		}
+	}
+
+	ret = check_stats(ccid, "tcl", &x);
+	cci_power_off(cci);
+out_free:
+	xfr_free(xfr);
+out:
+	ccid_close(ccid);
+	return ret;
+}
+
+#define MFC_SECTORS	16
+
+/* Write a sector of a Mifare Classic 1K and read it back */
+static int test_mfc(void)
+{
+	static const struct expect x = {
+		.e_escapes = 101,
+		.e_frames = 10,
+	};
+	static uint8_t img[MFC_SECTORS * 4 * CCI_MFC_BLOCK_SIZE];
+	uint8_t wr[4 * CCI_MFC_BLOCK_SIZE], rd[sizeof(wr)];
+	struct cci_mfc_key keys[1];
+	struct ccid_sim_tag tag;
+	struct cci_rf_tag found;
+	unsigned int num, i;
+	uint64_t done;
+	ccid_t ccid;
+	cci_t cci;
+	int ret = 0;
+
+	/* transport keys, key A and B all ones */
+	for(i = 0; i < MFC_SECTORS; i++)
+		memset(img + (i * 4 + 3) * CCI_MFC_BLOCK_SIZE, 0xff,
+			CCI_MFC_BLOCK_SIZE);
+
+	memset(&tag, 0, sizeof(tag));
+	memcpy(tag.t_uid, "\xde\xad\xbe\xef", 4);
+	tag.t_uid_len = 4;
+	tag.t_sak = 0x08;
+	tag.t_mfc = img;
+	tag.t_mfc_sectors = MFC_SECTORS;
+
+	memset(keys[0].k_key, 0xff, sizeof(keys[0].k_key));
+	keys[0].k_type = CCI_MFC_KEY_A;
+	for(i = 0; i < sizeof(wr); i++)
+		wr[i] = i ^ 0xa5;
+
+	ccid = ccid_probe_sim(&tag, 1, NULL);
+	if ( NULL == ccid )
+		return 0;
+
+	cci = ccid_get_field(ccid, 0);
+	if ( NULL == cci || !cci_rf_inventory(cci, &found, 1, &num) ||
+			num != 1 ||
+			NULL == cci_rf_activate(cci, &found, NULL) ) {
+		fprintf(stderr, "mfc: card not found\n");
+		goto out;
+	}
+
+	ccid_sim_stats_reset(ccid);
+	if ( !cci_mfc_write(cci, 1, 1, keys, wr, sizeof(wr), &done) ||
+			done != 1 ) {
+		fprintf(stderr, "mfc: write failed\n");
+		goto out;
+	}
+
+	if ( !cci_mfc_read(cci, 1, 1, keys, rd, sizeof(rd), &done) ||
+			done != 1 ) {
+		fprintf(stderr, "mfc: read failed\n");
+		goto out;
+	}
+
+	/* the trailer keeps its keys, and reads back as on the card */
+	if ( memcmp(rd, wr, 3 * CCI_MFC_BLOCK_SIZE) ||
+			memcmp(img + 4 * CCI_MFC_BLOCK_SIZE, wr,
+				3 * CCI_MFC_BLOCK_SIZE) ||
+			memcmp(rd + 3 * CCI_MFC_BLOCK_SIZE,
+				img + 7 * CCI_MFC_BLOCK_SIZE,
+				CCI_MFC_BLOCK_SIZE) ) {
+		fprintf(stderr, "mfc: read back wrong data\n");
+		goto out;
+	}
+
+	ret = check_stats(ccid, "mfc", &x);
+out:
+	ccid_close(ccid);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int ret = EXIT_SUCCESS;
+
+	if ( !test_anticol() )
+		ret = EXIT_FAILURE;
+	if ( !test_tcl() )
+		ret = EXIT_FAILURE;
+	if ( !test_mfc() )
+		ret = EXIT_FAILURE;
+
+	return ret;
+}
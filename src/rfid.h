@@ -33,6 +33,10 @@ struct rfid_tag {
 	uint8_t level;
 
 	uint8_t tcl_capable;
+
+	/* from the REQA/WUPA and the final SELECT */
+	uint8_t atqa[2];
+	uint8_t sak;
 };
 
 /* ==================[ API ]================== */
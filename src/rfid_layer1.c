@@ -84,10 +84,25 @@ int _rfid_layer1_14443a_init(struct _cci *cci)
 	return (*rf->rf_l1->iso14443a_init)(cci->i_parent, rf->rf_l1p);
 }
 
-int _rfid_layer1_mfc_set_key(struct _cci *cci, const uint8_t *key)
+void _rfid_layer1_mfc_code_key(struct _cci *cci, const uint8_t *key,
+				uint8_t *coded)
+{
+	struct _rfid *rf = cci->i_priv;
+	(*rf->rf_l1->mfc_code_key)(key, coded);
+}
+
+int _rfid_layer1_mfc_load_key(struct _cci *cci, const uint8_t *coded)
 {
 	struct _rfid *rf = cci->i_priv;
-	return (*rf->rf_l1->mfc_set_key)(cci->i_parent, rf->rf_l1p, key);
+	return (*rf->rf_l1->mfc_load_key)(cci->i_parent, rf->rf_l1p, coded);
+}
+
+int _rfid_layer1_mfc_set_key(struct _cci *cci, const uint8_t *key)
+{
+	uint8_t coded[RFID_MFC_CODED_KEY_LEN];
+
+	_rfid_layer1_mfc_code_key(cci, key, coded);
+	return _rfid_layer1_mfc_load_key(cci, coded);
 }
 
 int _rfid_layer1_mfc_set_key_ee(struct _cci *cci, unsigned int addr)
@@ -48,7 +48,12 @@ _private int _rfid_layer1_transact(struct _cci *cci,
 
 _private int _rfid_layer1_14443a_init(struct _cci *cci);
 
+/* crypto1 keys in whatever form the ASIC wants them loaded */
+#define RFID_MFC_CODED_KEY_LEN	12
 _private int _rfid_layer1_mfc_set_key(struct _cci *cci, const uint8_t *key);
+_private void _rfid_layer1_mfc_code_key(struct _cci *cci, const uint8_t *key,
+					uint8_t *coded);
+_private int _rfid_layer1_mfc_load_key(struct _cci *cci, const uint8_t *coded);
 _private int _rfid_layer1_mfc_set_key_ee(struct _cci *cci, unsigned int addr);
 _private int _rfid_layer1_mfc_auth(struct _cci *cci, uint8_t cmd,
 				uint32_t serial_no, uint8_t block);
@@ -78,7 +83,8 @@ struct rfid_layer1_ops {
 
 	int (*iso14443a_init)(struct _ccid *ccid, void *p);
 
-	int (*mfc_set_key)(struct _ccid *ccid, void *p, const uint8_t *key);
+	void (*mfc_code_key)(const uint8_t *key, uint8_t *coded);
+	int (*mfc_load_key)(struct _ccid *ccid, void *p, const uint8_t *coded);
 	int (*mfc_set_key_ee)(struct _ccid *ccid, void *p, unsigned int addr);
 	int (*mfc_auth)(struct _ccid *ccid, void *p, uint8_t cmd,
 			uint32_t serial_no, uint8_t block);
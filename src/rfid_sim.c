@@ -0,0 +1,1203 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Software model of a CLRC632 with ISO 14443-A cards in its field. It sits
+ * underneath the real ASIC driver in place of the Omnikey escape commands,
+ * so everything from the register shadow up is exercised as on a reader.
+ *
+ * Time only passes when the host talks to the ASIC: each register or FIFO
+ * access moves SIM_TICK_BYTES of a frame over the air, roughly what goes at
+ * 106kbit/s during one USB round trip. The FIFO fills and drains much as it
+ * would on hardware and a driver which makes too many round trips shows up
+ * in the counters, independent of the speed of the machine.
+ *
+ * Frames are modelled without their CRC, the CRC and parity settings are
+ * not checked. Mifare Classic access bits are ignored, either key of a
+ * sector allows reading and writing all of it.
+*/
+
+#include <ccid.h>
+
+#include "ccid-internal.h"
+#include "clrc632-regs.h"
+#include "rfid.h"
+#include "clrc632.h"
+#include "rfid_layer1.h"
+#include "iso14443a.h"
+#include "proto_mfc.h"
+
+#define SIM_TICK_BYTES	16
+#define SIM_TIMER_TICKS	2
+#define SIM_FIFO_SIZE	64
+#define SIM_NUM_REGS	0x40
+#define SIM_FRAME_MAX	258
+#define SIM_APDU_MAX	4096
+
+#define PH_IDLE		0
+#define PH_TX		1 /* transmitting what's in the FIFO */
+#define PH_RX		2 /* receiving in to the FIFO */
+#define PH_EXEC		3 /* command which doesn't use the air */
+#define PH_WAIT		4 /* nobody answered, waiting for the timer */
+
+#define TAG_IDLE	0
+#define TAG_READY	1
+#define TAG_ACTIVE	2
+#define TAG_HALT	3
+
+#define CMD_REQA	0x26
+#define CMD_WUPA	0x52
+#define CMD_HLTA	0x50
+#define CMD_RATS	0xe0
+
+#define MFC_NAK		0x04
+
+struct sim_frame {
+	uint8_t		f_buf[SIM_FRAME_MAX];
+	size_t		f_len;
+	uint8_t		f_bits; /* valid bits in the last byte, 0 for all */
+	uint8_t		f_align; /* first bit position in the first byte */
+};
+
+struct sim_tag {
+	struct ccid_sim_tag	t_cfg;
+	uint8_t			t_ats[SIM_FRAME_MAX];
+	size_t			t_ats_len;
+	size_t			t_fsc;
+	uint8_t			t_cl[3][5]; /* UID bytes and BCC per level */
+	unsigned int		t_levels;
+	unsigned int		t_mfc_blocks;
+	uint8_t			t_present;
+
+	/* ISO 14443-3 */
+	uint8_t			t_state;
+	uint8_t			t_from_halt; /* falls back to HALT not IDLE */
+	uint8_t			t_level;
+
+	/* ISO 14443-4 */
+	uint8_t			t_l4;
+	uint8_t			t_blk;
+	int			t_cid; /* as last sent by the PCD, or -1 */
+	size_t			t_fsd;
+	unsigned int		t_wtx_left;
+	size_t			t_cmd_len;
+	size_t			t_rsp_len;
+	size_t			t_rsp_ofs;
+	struct sim_frame	t_last;
+	uint8_t			t_cmd[SIM_APDU_MAX];
+	uint8_t			t_rsp[SIM_APDU_MAX];
+
+	/* Mifare Classic */
+	int			t_auth_sector;
+	int			t_wr_blk;
+};
+
+struct _rfid_sim {
+	struct _ccid		*s_ccid;
+	struct sim_tag		*s_tag;
+	unsigned int		s_num_tags;
+
+	uint8_t			s_reg[SIM_NUM_REGS];
+	uint8_t			s_fifo[SIM_FIFO_SIZE];
+	unsigned int		s_fifo_len;
+	unsigned int		s_phase;
+	unsigned int		s_wait;
+	uint8_t			s_field;
+
+	struct sim_frame	s_tx;
+	struct sim_frame	s_rx;
+	size_t			s_rx_ofs;
+
+	/* crypto1 unit */
+	uint8_t			s_key[6];
+	uint8_t			s_key_ok;
+	struct sim_tag		*s_auth_tag;
+	uint8_t			s_auth_cmd;
+	uint8_t			s_auth_blk;
+
+	struct ccid_sim_stats	s_stats;
+};
+
+/* Spelled out from ISO 14443-3, not the driver's defines, so that a wrong
+ * select code can't agree with itself and pass the tests
+ */
+static const uint8_t sel_code[] = {0x93, 0x95, 0x97};
+
+/* FSCI 8 (256 bytes), all bit rates, FWI 4 and no CID or NAD */
+static const uint8_t default_ats[] = {0x05, 0x78, 0x77, 0x40, 0x00};
+
+static void fifo_put(struct _rfid_sim *s, const uint8_t *buf, size_t len)
+{
+	size_t room = SIM_FIFO_SIZE - s->s_fifo_len;
+
+	if ( len > room ) {
+		s->s_reg[RC632_REG_ERROR_FLAG] |= RC632_ERR_FLAG_FIFO_OVERFLOW;
+		s->s_stats.s_overflows++;
+		len = room;
+	}
+
+	memcpy(s->s_fifo + s->s_fifo_len, buf, len);
+	s->s_fifo_len += len;
+}
+
+/* Reading an empty FIFO gives zeros */
+static void fifo_get(struct _rfid_sim *s, uint8_t *buf, size_t len)
+{
+	size_t n = (len < s->s_fifo_len) ? len : s->s_fifo_len;
+
+	memcpy(buf, s->s_fifo, n);
+	memset(buf + n, 0, len - n);
+	s->s_fifo_len -= n;
+	memmove(s->s_fifo, s->s_fifo + n, s->s_fifo_len);
+}
+
+static void tag_reset_l3(struct sim_tag *t)
+{
+	t->t_l4 = 0;
+	t->t_cid = -1;
+	t->t_wtx_left = 0;
+	t->t_cmd_len = 0;
+	t->t_rsp_len = t->t_rsp_ofs = 0;
+	t->t_last.f_len = 0;
+	t->t_auth_sector = -1;
+	t->t_wr_blk = -1;
+}
+
+/* Loss of power */
+static void tag_reset(struct sim_tag *t)
+{
+	t->t_state = TAG_IDLE;
+	t->t_from_halt = 0;
+	t->t_level = 0;
+	tag_reset_l3(t);
+}
+
+/* Anything unexpected sends a card back to where it was woken from */
+static void tag_fall(struct sim_tag *t)
+{
+	t->t_state = (t->t_from_halt) ? TAG_HALT : TAG_IDLE;
+	t->t_level = 0;
+	tag_reset_l3(t);
+}
+
+static void regs_reset(struct _rfid_sim *s)
+{
+	memset(s->s_reg, 0, sizeof(s->s_reg));
+	s->s_reg[RC632_REG_TX_CONTROL] = 0x58;
+	s->s_reg[RC632_REG_CW_CONDUCTANCE] = 0x3f;
+	s->s_reg[RC632_REG_FIFO_LEVEL] = 0x08;
+	s->s_fifo_len = 0;
+	s->s_phase = PH_IDLE;
+	s->s_key_ok = 0;
+	s->s_auth_tag = NULL;
+}
+
+static void field_update(struct _rfid_sim *s)
+{
+	unsigned int i;
+	uint8_t on;
+
+	on = (s->s_reg[RC632_REG_TX_CONTROL] &
+			(RC632_TXCTRL_TX1_RF_EN | RC632_TXCTRL_TX2_RF_EN)) &&
+		!(s->s_reg[RC632_REG_CONTROL] & RC632_CONTROL_POWERDOWN);
+	if ( on == s->s_field )
+		return;
+
+	s->s_field = on;
+	if ( on )
+		return;
+
+	for(i = 0; i < s->s_num_tags; i++)
+		tag_reset(&s->s_tag[i]);
+	s->s_auth_tag = NULL;
+}
+
+static int bits_match(const uint8_t *a, const uint8_t *b, unsigned int bits)
+{
+	uint8_t mask;
+
+	if ( memcmp(a, b, bits / 8) )
+		return 0;
+	if ( !(bits % 8) )
+		return 1;
+	mask = (1U << (bits % 8)) - 1;
+	return !((a[bits / 8] ^ b[bits / 8]) & mask);
+}
+
+static int tag_short(struct sim_tag *t, uint8_t cmd, struct sim_frame *r)
+{
+	switch(cmd) {
+	case CMD_REQA:
+		if ( t->t_state == TAG_IDLE )
+			break;
+		if ( t->t_state != TAG_HALT )
+			tag_fall(t);
+		return 0;
+	case CMD_WUPA:
+		if ( t->t_state == TAG_IDLE || t->t_state == TAG_HALT )
+			break;
+		tag_fall(t);
+		return 0;
+	default:
+		if ( t->t_state == TAG_READY || t->t_state == TAG_ACTIVE )
+			tag_fall(t);
+		return 0;
+	}
+
+	t->t_from_halt = (t->t_state == TAG_HALT);
+	t->t_state = TAG_READY;
+	t->t_level = 0;
+
+	memcpy(r->f_buf, t->t_cfg.t_atqa, 2);
+	r->f_len = 2;
+	return 1;
+}
+
+/* ANTICOLLISION and SELECT at the current cascade level */
+static int tag_anticol(struct sim_tag *t, const struct sim_frame *f,
+			struct sim_frame *r)
+{
+	const uint8_t *cl;
+	unsigned int nvb, known;
+
+	if ( f->f_len < 2 || f->f_buf[0] != sel_code[t->t_level] ) {
+		tag_fall(t);
+		return 0;
+	}
+
+	cl = t->t_cl[t->t_level];
+	nvb = f->f_buf[1];
+
+	if ( nvb == 0x70 ) {
+		if ( f->f_len != 7 || memcmp(f->f_buf + 2, cl, 5) ) {
+			tag_fall(t);
+			return 0;
+		}
+		if ( t->t_level + 1 < t->t_levels ) {
+			t->t_level++;
+			r->f_buf[0] = 0x04;
+		}else{
+			t->t_state = TAG_ACTIVE;
+			r->f_buf[0] = t->t_cfg.t_sak & ~0x04;
+		}
+		r->f_len = 1;
+		return 1;
+	}
+
+	known = (nvb >> 4) * 8 + (nvb & 0x7);
+	if ( known < 16 || known >= 16 + 40 || f->f_len * 8 < known )
+		return 0;
+	known -= 16;
+
+	if ( !bits_match(f->f_buf + 2, cl, known) )
+		return 0;
+
+	r->f_align = known % 8;
+	r->f_len = 5 - known / 8;
+	memcpy(r->f_buf, cl + known / 8, r->f_len);
+	r->f_buf[0] &= 0xff << r->f_align;
+	return 1;
+}
+
+/* Answer with as many bytes as Le asks for, then 90 00 */
+static size_t apdu_default(const uint8_t *cmd, size_t len,
+				uint8_t *rsp, size_t max)
+{
+	size_t le = 0, i;
+
+	if ( len < 4 ) {
+		rsp[0] = 0x67;
+		rsp[1] = 0x00;
+		return 2;
+	}
+
+	if ( len == 5 )
+		le = (cmd[4]) ? cmd[4] : 256;
+	else if ( len > 5 && cmd[4] && len == 6U + cmd[4] )
+		le = (cmd[len - 1]) ? cmd[len - 1] : 256;
+
+	if ( le > max - 2 )
+		le = max - 2;
+	for(i = 0; i < le; i++)
+		rsp[i] = i & 0xff;
+	rsp[le] = 0x90;
+	rsp[le + 1] = 0x00;
+	return le + 2;
+}
+
+static void apdu_run(struct sim_tag *t)
+{
+	size_t len;
+
+	if ( t->t_cfg.t_apdu )
+		len = (*t->t_cfg.t_apdu)(t->t_cfg.t_priv,
+					t->t_cmd, t->t_cmd_len,
+					t->t_rsp, sizeof(t->t_rsp));
+	else
+		len = apdu_default(t->t_cmd, t->t_cmd_len,
+					t->t_rsp, sizeof(t->t_rsp));
+
+	t->t_cmd_len = 0;
+	t->t_rsp_len = (len < sizeof(t->t_rsp)) ? len : sizeof(t->t_rsp);
+	t->t_rsp_ofs = 0;
+	t->t_wtx_left = (len) ? t->t_cfg.t_wtx : 0;
+}
+
+static void l4_prologue(struct sim_tag *t, struct sim_frame *r, uint8_t pcb)
+{
+	r->f_len = 0;
+	r->f_buf[r->f_len++] = pcb | ((t->t_cid >= 0) ? 0x08 : 0);
+	if ( t->t_cid >= 0 )
+		r->f_buf[r->f_len++] = t->t_cid;
+}
+
+/* Next block of the response, or a WTX request if the card's not ready */
+static int l4_next(struct _rfid_sim *s, struct sim_tag *t,
+			struct sim_frame *r)
+{
+	size_t max, n;
+
+	if ( t->t_wtx_left ) {
+		t->t_wtx_left--;
+		s->s_stats.s_wtx++;
+		l4_prologue(t, r, 0xf2);
+		r->f_buf[r->f_len++] = 1;
+		return 1;
+	}
+
+	l4_prologue(t, r, 0x02 | t->t_blk);
+
+	/* FSD counts the CRC */
+	max = t->t_fsd - 2 - r->f_len;
+	n = t->t_rsp_len - t->t_rsp_ofs;
+	if ( n > max ) {
+		n = max;
+		r->f_buf[0] |= 0x10;
+		s->s_stats.s_chained++;
+	}
+
+	memcpy(r->f_buf + r->f_len, t->t_rsp + t->t_rsp_ofs, n);
+	r->f_len += n;
+	t->t_rsp_ofs += n;
+	return 1;
+}
+
+static int l4_block(struct _rfid_sim *s, struct sim_tag *t,
+			const struct sim_frame *f, struct sim_frame *r)
+{
+	const uint8_t *b = f->f_buf;
+	size_t hdr, n;
+	uint8_t pcb;
+
+	if ( !f->f_len )
+		return 0;
+	pcb = b[0];
+
+	/* PPS, the bit rate is whatever the ASIC is set to */
+	if ( (pcb & 0xf0) == 0xd0 ) {
+		r->f_buf[0] = pcb;
+		r->f_len = 1;
+		return 1;
+	}
+
+	hdr = 1;
+	t->t_cid = -1;
+	if ( pcb & 0x08 ) {
+		if ( f->f_len < 2 )
+			goto err;
+		t->t_cid = b[1];
+		hdr++;
+	}
+	/* NAD is dropped */
+	if ( !(pcb & 0xc0) && (pcb & 0x04) )
+		hdr++;
+	if ( f->f_len < hdr )
+		goto err;
+
+	switch(pcb & 0xc0) {
+	case 0x00:
+		if ( f->f_len + 2 > t->t_fsc )
+			s->s_stats.s_proto_err++;
+		t->t_blk = pcb & 0x01;
+		n = f->f_len - hdr;
+		if ( n > sizeof(t->t_cmd) - t->t_cmd_len ) {
+			t->t_cmd_len = 0;
+			goto err;
+		}
+		memcpy(t->t_cmd + t->t_cmd_len, b + hdr, n);
+		t->t_cmd_len += n;
+
+		if ( pcb & 0x10 ) {
+			s->s_stats.s_chained++;
+			l4_prologue(t, r, 0xa2 | t->t_blk);
+			return 1;
+		}
+
+		apdu_run(t);
+		if ( !t->t_rsp_len )
+			return 0;
+		return l4_next(s, t, r);
+	case 0x80:
+		t->t_blk = pcb & 0x01;
+		if ( !(pcb & 0x10) && t->t_rsp_ofs < t->t_rsp_len )
+			return l4_next(s, t, r);
+		/* NAK, or nothing more to send */
+		*r = t->t_last;
+		return (r->f_len != 0);
+	case 0xc0:
+		if ( (pcb & 0x30) == 0x30 && t->t_rsp_ofs < t->t_rsp_len )
+			return l4_next(s, t, r);
+		if ( (pcb & 0x30) == 0x00 ) {
+			/* DESELECT */
+			l4_prologue(t, r, pcb & ~0x08);
+			tag_reset_l3(t);
+			t->t_state = TAG_HALT;
+			return 1;
+		}
+		break;
+	}
+
+err:
+	s->s_stats.s_proto_err++;
+	return 0;
+}
+
+static int tag_rats(struct sim_tag *t, const struct sim_frame *f,
+			struct sim_frame *r)
+{
+	if ( !_iso14443_fsdi_to_fsd(f->f_buf[1] >> 4, &t->t_fsd) )
+		t->t_fsd = 256;
+	if ( t->t_fsd > SIM_FRAME_MAX )
+		t->t_fsd = SIM_FRAME_MAX;
+
+	t->t_l4 = 1;
+	t->t_blk = 1;
+	t->t_cmd_len = 0;
+	t->t_rsp_len = t->t_rsp_ofs = 0;
+
+	memcpy(r->f_buf, t->t_ats, t->t_ats_len);
+	r->f_len = t->t_ats_len;
+	return 1;
+}
+
+static unsigned int mfc_sector(unsigned int blk)
+{
+	unsigned int small = MIFARE_CL_SMALL_SECTORS *
+				MIFARE_CL_BLOCKS_P_SECTOR_1k;
+
+	if ( blk < small )
+		return blk / MIFARE_CL_BLOCKS_P_SECTOR_1k;
+	return MIFARE_CL_SMALL_SECTORS +
+		(blk - small) / MIFARE_CL_BLOCKS_P_SECTOR_4k;
+}
+
+static int mfc_allowed(const struct sim_tag *t, unsigned int blk)
+{
+	return blk < t->t_mfc_blocks &&
+		t->t_auth_sector == (int)mfc_sector(blk);
+}
+
+/* ACK and NAK are 4 bit frames */
+static int mfc_ack(struct sim_frame *r, uint8_t val)
+{
+	r->f_buf[0] = val;
+	r->f_len = 1;
+	r->f_bits = 4;
+	return 1;
+}
+
+static int tag_mfc(struct sim_tag *t, const struct sim_frame *f,
+			struct sim_frame *r)
+{
+	uint8_t *img = t->t_cfg.t_mfc;
+	unsigned int blk;
+
+	if ( t->t_wr_blk >= 0 ) {
+		blk = t->t_wr_blk;
+		t->t_wr_blk = -1;
+		if ( f->f_len != MIFARE_CL_PAGE_SIZE )
+			goto nak;
+		memcpy(img + blk * MIFARE_CL_PAGE_SIZE, f->f_buf,
+			MIFARE_CL_PAGE_SIZE);
+		return mfc_ack(r, MIFARE_CL_RESP_ACK);
+	}
+
+	if ( f->f_len != 2 )
+		goto nak;
+
+	blk = f->f_buf[1];
+	switch(f->f_buf[0]) {
+	case MIFARE_CL_CMD_READ:
+		if ( !mfc_allowed(t, blk) )
+			goto nak;
+		memcpy(r->f_buf, img + blk * MIFARE_CL_PAGE_SIZE,
+			MIFARE_CL_PAGE_SIZE);
+		r->f_len = MIFARE_CL_PAGE_SIZE;
+		return 1;
+	case MIFARE_CL_CMD_WRITE16:
+		/* the manufacturer block is read only */
+		if ( !mfc_allowed(t, blk) || blk == 0 )
+			goto nak;
+		t->t_wr_blk = blk;
+		return mfc_ack(r, MIFARE_CL_RESP_ACK);
+	default:
+		break;
+	}
+
+nak:
+	tag_fall(t);
+	return mfc_ack(r, MFC_NAK);
+}
+
+static int tag_active(struct _rfid_sim *s, struct sim_tag *t,
+			const struct sim_frame *f, struct sim_frame *r)
+{
+	int ret;
+
+	/* HLTA, which is never answered */
+	if ( f->f_len == 2 && f->f_buf[0] == CMD_HLTA && !f->f_buf[1] ) {
+		tag_reset_l3(t);
+		t->t_state = TAG_HALT;
+		t->t_from_halt = 1;
+		return 0;
+	}
+
+	if ( t->t_l4 ) {
+		ret = l4_block(s, t, f, r);
+		if ( ret )
+			t->t_last = *r;
+		return ret;
+	}
+
+	if ( (t->t_cfg.t_sak & 0x20) && f->f_len == 2 &&
+			f->f_buf[0] == CMD_RATS )
+		return tag_rats(t, f, r);
+
+	if ( t->t_cfg.t_mfc )
+		return tag_mfc(t, f, r);
+
+	tag_fall(t);
+	return 0;
+}
+
+static int tag_frame(struct _rfid_sim *s, struct sim_tag *t,
+			const struct sim_frame *f, struct sim_frame *r)
+{
+	r->f_len = 0;
+	r->f_bits = 0;
+	r->f_align = 0;
+
+	if ( !t->t_present )
+		return 0;
+
+	if ( f->f_len == 1 && f->f_bits == 7 )
+		return tag_short(t, f->f_buf[0], r);
+
+	switch(t->t_state) {
+	case TAG_READY:
+		return tag_anticol(t, f, r);
+	case TAG_ACTIVE:
+		return tag_active(s, t, f, r);
+	default:
+		return 0;
+	}
+}
+
+/* Every card in the field hears the frame, answers which disagree in any
+ * bit have collided and the ASIC gets the OR of them.
+ */
+static int rf_frame(struct _rfid_sim *s)
+{
+	static struct sim_frame rsp;
+	uint8_t diff[SIM_FRAME_MAX];
+	struct sim_frame *rx = &s->s_rx;
+	unsigned int i, j, n = 0;
+	size_t k;
+
+	if ( !s->s_field )
+		return 0;
+
+	memset(diff, 0, sizeof(diff));
+	for(i = 0; i < s->s_num_tags; i++) {
+		if ( !tag_frame(s, &s->s_tag[i], &s->s_tx, &rsp) )
+			continue;
+		if ( !n++ ) {
+			*rx = rsp;
+			continue;
+		}
+		if ( rsp.f_len > rx->f_len ) {
+			memset(rx->f_buf + rx->f_len, 0,
+				rsp.f_len - rx->f_len);
+			rx->f_len = rsp.f_len;
+		}
+		for(k = 0; k < rsp.f_len; k++) {
+			diff[k] |= rx->f_buf[k] ^ rsp.f_buf[k];
+			rx->f_buf[k] |= rsp.f_buf[k];
+		}
+	}
+
+	trace(s->s_ccid, "     : sim: %zu byte frame, %u answers\n",
+		s->s_tx.f_len, n);
+	if ( !n )
+		return 0;
+
+	if ( rx->f_align != ((s->s_reg[RC632_REG_BIT_FRAMING] >> 4) & 0x7) )
+		s->s_stats.s_proto_err++;
+
+	s->s_reg[RC632_REG_SECONDARY_STATUS] = rx->f_bits & 0x7;
+
+	for(k = 0; k < rx->f_len; k++) {
+		if ( !diff[k] )
+			continue;
+		for(j = 0; !(diff[k] & (1U << j)); j++)
+			;
+		/* counted from 1 at the first bit received */
+		s->s_reg[RC632_REG_COLL_POS] = k * 8 + j - rx->f_align + 1;
+		s->s_reg[RC632_REG_ERROR_FLAG] |= RC632_ERR_FLAG_COL_ERR;
+		s->s_stats.s_collisions++;
+		break;
+	}
+
+	return 1;
+}
+
+static void cmd_done(struct _rfid_sim *s, uint8_t irq)
+{
+	s->s_reg[RC632_REG_COMMAND] = RC632_CMD_IDLE;
+	s->s_reg[RC632_REG_INTERRUPT_RQ] |= RC632_IRQ_IDLE | irq;
+	s->s_phase = PH_IDLE;
+}
+
+static void no_answer(struct _rfid_sim *s)
+{
+	s->s_wait = SIM_TIMER_TICKS;
+	s->s_phase = PH_WAIT;
+}
+
+static void load_key(struct _rfid_sim *s)
+{
+	uint8_t c[RFID_MFC_CODED_KEY_LEN];
+	unsigned int i;
+
+	s->s_key_ok = 0;
+	if ( s->s_fifo_len < sizeof(c) ) {
+		s->s_fifo_len = 0;
+		s->s_reg[RC632_REG_ERROR_FLAG] |= RC632_ERR_FLAG_KEY_ERR;
+		return;
+	}
+
+	fifo_get(s, c, sizeof(c));
+	for(i = 0; i < sizeof(c); i++) {
+		if ( (((c[i] >> 4) ^ c[i]) & 0xf) != 0xf ) {
+			s->s_reg[RC632_REG_ERROR_FLAG] |=
+				RC632_ERR_FLAG_KEY_ERR;
+			return;
+		}
+	}
+
+	for(i = 0; i < sizeof(s->s_key); i++)
+		s->s_key[i] = ((c[i * 2] & 0xf) << 4) | (c[i * 2 + 1] & 0xf);
+	s->s_key_ok = 1;
+}
+
+static int authent1(struct _rfid_sim *s)
+{
+	struct sim_tag *t;
+	uint8_t c[6];
+	unsigned int i;
+
+	s->s_auth_tag = NULL;
+	if ( !s->s_field || s->s_fifo_len < sizeof(c) )
+		return 0;
+
+	fifo_get(s, c, sizeof(c));
+	if ( c[0] != RFID_CMD_MIFARE_AUTH1A && c[0] != RFID_CMD_MIFARE_AUTH1B )
+		return 0;
+
+	for(i = 0; i < s->s_num_tags; i++) {
+		t = &s->s_tag[i];
+		if ( !t->t_present || t->t_state != TAG_ACTIVE ||
+				t->t_l4 || NULL == t->t_cfg.t_mfc ||
+				c[1] >= t->t_mfc_blocks )
+			continue;
+		if ( memcmp(t->t_cfg.t_uid + t->t_cfg.t_uid_len - 4,
+				c + 2, 4) )
+			continue;
+
+		t->t_auth_sector = -1;
+		s->s_auth_tag = t;
+		s->s_auth_cmd = c[0];
+		s->s_auth_blk = c[1];
+		return 1;
+	}
+
+	return 0;
+}
+
+static int authent2(struct _rfid_sim *s)
+{
+	struct sim_tag *t = s->s_auth_tag;
+	unsigned int sector, trailer;
+	const uint8_t *key;
+
+	s->s_auth_tag = NULL;
+	s->s_reg[RC632_REG_CONTROL] &= ~RC632_CONTROL_CRYPTO1_ON;
+	if ( NULL == t || !t->t_present || t->t_state != TAG_ACTIVE )
+		return 0;
+
+	sector = mfc_sector(s->s_auth_blk);
+	trailer = mfcl_sector2block(sector) + mfcl_sector_blocks(sector) - 1;
+	key = t->t_cfg.t_mfc + trailer * MIFARE_CL_PAGE_SIZE;
+	if ( s->s_auth_cmd == RFID_CMD_MIFARE_AUTH1B )
+		key += 10;
+
+	if ( !s->s_key_ok || memcmp(key, s->s_key, sizeof(s->s_key)) ) {
+		tag_fall(t);
+		return 0;
+	}
+
+	t->t_auth_sector = sector;
+	s->s_reg[RC632_REG_CONTROL] |= RC632_CONTROL_CRYPTO1_ON;
+	return 1;
+}
+
+static void exec(struct _rfid_sim *s)
+{
+	s->s_reg[RC632_REG_SECONDARY_STATUS] = 0;
+
+	switch(s->s_reg[RC632_REG_COMMAND]) {
+	case RC632_CMD_LOAD_KEY:
+		load_key(s);
+		break;
+	case RC632_CMD_LOAD_KEY_E2:
+		/* there are no keys in the EEPROM */
+		s->s_fifo_len = 0;
+		s->s_reg[RC632_REG_ERROR_FLAG] |= RC632_ERR_FLAG_KEY_ERR;
+		break;
+	case RC632_CMD_AUTHENT1:
+		if ( !authent1(s) ) {
+			no_answer(s);
+			return;
+		}
+		break;
+	case RC632_CMD_AUTHENT2:
+		if ( !authent2(s) ) {
+			no_answer(s);
+			return;
+		}
+		break;
+	default:
+		break;
+	}
+
+	cmd_done(s, 0);
+}
+
+static void tx_done(struct _rfid_sim *s)
+{
+	s->s_stats.s_frames++;
+	s->s_tx.f_bits = s->s_reg[RC632_REG_BIT_FRAMING] & 0x7;
+
+	if ( !rf_frame(s) ) {
+		no_answer(s);
+		return;
+	}
+
+	s->s_rx_ofs = 0;
+	s->s_phase = PH_RX;
+}
+
+/* Move things along by one host round trip */
+static void tick(struct _rfid_sim *s)
+{
+	size_t n;
+
+	switch(s->s_phase) {
+	case PH_TX:
+		n = (s->s_fifo_len < SIM_TICK_BYTES) ?
+			s->s_fifo_len : SIM_TICK_BYTES;
+		if ( n > sizeof(s->s_tx.f_buf) - s->s_tx.f_len ) {
+			s->s_stats.s_proto_err++;
+			n = sizeof(s->s_tx.f_buf) - s->s_tx.f_len;
+			s->s_fifo_len = n;
+		}
+		fifo_get(s, s->s_tx.f_buf + s->s_tx.f_len, n);
+		s->s_tx.f_len += n;
+		if ( !s->s_fifo_len )
+			tx_done(s);
+		break;
+	case PH_RX:
+		n = s->s_rx.f_len - s->s_rx_ofs;
+		if ( n > SIM_TICK_BYTES )
+			n = SIM_TICK_BYTES;
+		fifo_put(s, s->s_rx.f_buf + s->s_rx_ofs, n);
+		s->s_rx_ofs += n;
+		if ( s->s_rx_ofs == s->s_rx.f_len )
+			cmd_done(s, RC632_IRQ_RX);
+		break;
+	case PH_EXEC:
+		exec(s);
+		break;
+	case PH_WAIT:
+		if ( --s->s_wait )
+			break;
+		s->s_reg[RC632_REG_INTERRUPT_RQ] |= RC632_IRQ_TIMER;
+		s->s_phase = PH_IDLE;
+		break;
+	default:
+		break;
+	}
+}
+
+static void cmd_start(struct _rfid_sim *s, uint8_t cmd)
+{
+	s->s_reg[RC632_REG_COMMAND] = cmd;
+	s->s_phase = PH_IDLE;
+	if ( cmd == RC632_CMD_IDLE )
+		return;
+
+	s->s_reg[RC632_REG_ERROR_FLAG] = 0;
+	if ( cmd == RC632_CMD_TRANSCEIVE ) {
+		s->s_tx.f_len = 0;
+		s->s_phase = PH_TX;
+	}else{
+		s->s_phase = PH_EXEC;
+	}
+}
+
+static void control_set(struct _rfid_sim *s, uint8_t val)
+{
+	uint8_t old = s->s_reg[RC632_REG_CONTROL];
+
+	if ( val & RC632_CONTROL_FIFO_FLUSH )
+		s->s_fifo_len = 0;
+
+	/* Crypto1On is only ever set by a successful Authent2 */
+	s->s_reg[RC632_REG_CONTROL] = (old & val & RC632_CONTROL_CRYPTO1_ON) |
+		(val & (RC632_CONTROL_POWERDOWN | RC632_CONTROL_STANDBY));
+
+	if ( (old & RC632_CONTROL_POWERDOWN) &&
+			!(val & RC632_CONTROL_POWERDOWN) )
+		regs_reset(s);
+
+	field_update(s);
+}
+
+static uint8_t primary_status(struct _rfid_sim *s)
+{
+	unsigned int level = s->s_reg[RC632_REG_FIFO_LEVEL] & 0x3f;
+	uint8_t st = 0;
+
+	if ( s->s_fifo_len <= level )
+		st |= RC632_STAT_LOALERT;
+	if ( SIM_FIFO_SIZE - s->s_fifo_len <= level )
+		st |= RC632_STAT_HIALERT;
+	if ( s->s_reg[RC632_REG_ERROR_FLAG] )
+		st |= RC632_STAT_ERR;
+	if ( s->s_reg[RC632_REG_INTERRUPT_EN] &
+			s->s_reg[RC632_REG_INTERRUPT_RQ] & 0x3f )
+		st |= RC632_STAT_IRQ;
+	return st;
+}
+
+static uint8_t reg_get(struct _rfid_sim *s, uint8_t reg)
+{
+	uint8_t val;
+
+	reg &= SIM_NUM_REGS - 1;
+	switch(reg) {
+	case RC632_REG_FIFO_DATA:
+		fifo_get(s, &val, 1);
+		return val;
+	case RC632_REG_PRIMARY_STATUS:
+		return primary_status(s);
+	case RC632_REG_FIFO_LENGTH:
+		return s->s_fifo_len;
+	default:
+		return s->s_reg[reg];
+	}
+}
+
+static void reg_set(struct _rfid_sim *s, uint8_t reg, uint8_t val)
+{
+	reg &= SIM_NUM_REGS - 1;
+	switch(reg) {
+	case RC632_REG_COMMAND:
+		cmd_start(s, val & 0x3f);
+		break;
+	case RC632_REG_FIFO_DATA:
+		fifo_put(s, &val, 1);
+		break;
+	case RC632_REG_PRIMARY_STATUS:
+	case RC632_REG_FIFO_LENGTH:
+	case RC632_REG_SECONDARY_STATUS:
+	case RC632_REG_ERROR_FLAG:
+	case RC632_REG_COLL_POS:
+		break;
+	case RC632_REG_INTERRUPT_EN:
+	case RC632_REG_INTERRUPT_RQ:
+		if ( val & RC632_IRQ_SET )
+			s->s_reg[reg] |= val & ~RC632_IRQ_SET;
+		else
+			s->s_reg[reg] &= ~val;
+		break;
+	case RC632_REG_CONTROL:
+		control_set(s, val);
+		break;
+	default:
+		s->s_reg[reg] = val;
+		if ( reg == RC632_REG_TX_CONTROL )
+			field_update(s);
+		break;
+	}
+}
+
+/* Every call is one round trip to the reader */
+static struct _rfid_sim *sim_op(struct _ccid *ccid)
+{
+	struct _rfid_sim *s = ccid->d_sim;
+
+	s->s_stats.s_escapes++;
+	tick(s);
+	return s;
+}
+
+static int sim_fifo_read(struct _ccid *ccid, uint8_t *buf, size_t len)
+{
+	struct _rfid_sim *s = sim_op(ccid);
+
+	if ( len > s->s_fifo_len )
+		s->s_stats.s_proto_err++;
+	fifo_get(s, buf, len);
+	s->s_stats.s_fifo_read++;
+	s->s_stats.s_fifo_bytes += len;
+	return 1;
+}
+
+static int sim_fifo_write(struct _ccid *ccid, const uint8_t *buf, size_t len)
+{
+	struct _rfid_sim *s = sim_op(ccid);
+
+	fifo_put(s, buf, len);
+	s->s_stats.s_fifo_write++;
+	s->s_stats.s_fifo_bytes += len;
+	return 1;
+}
+
+static int sim_reg_read(struct _ccid *ccid, uint8_t reg, uint8_t *val)
+{
+	struct _rfid_sim *s = sim_op(ccid);
+
+	*val = reg_get(s, reg);
+	s->s_stats.s_reg_read++;
+	s->s_stats.s_regs_read++;
+	return 1;
+}
+
+static int sim_reg_write(struct _ccid *ccid, uint8_t reg, uint8_t val)
+{
+	struct _rfid_sim *s = sim_op(ccid);
+
+	reg_set(s, reg, val);
+	s->s_stats.s_reg_write++;
+	s->s_stats.s_regs_written++;
+	return 1;
+}
+
+static int sim_reg_batch(struct _ccid *ccid,
+			const struct _clrc632_reg *wr, unsigned int nwr,
+			struct _clrc632_reg *rd, unsigned int nrd)
+{
+	struct _rfid_sim *s = sim_op(ccid);
+	unsigned int i;
+
+	assert(nwr <= CLRC632_BATCH_MAX && nrd <= CLRC632_BATCH_MAX);
+
+	for(i = 0; i < nwr; i++)
+		reg_set(s, wr[i].reg, wr[i].val);
+	for(i = 0; i < nrd; i++)
+		rd[i].val = reg_get(s, rd[i].reg);
+
+	s->s_stats.s_batch++;
+	s->s_stats.s_regs_written += nwr;
+	s->s_stats.s_regs_read += nrd;
+	return 1;
+}
+
+static const struct _clrc632_ops sim_ops = {
+	.fifo_read = sim_fifo_read,
+	.fifo_write = sim_fifo_write,
+	.reg_read = sim_reg_read,
+	.reg_write = sim_reg_write,
+	.reg_batch = sim_reg_batch,
+};
+
+static int tag_init(struct sim_tag *t, const struct ccid_sim_tag *cfg)
+{
+	const uint8_t *uid = cfg->t_uid;
+	unsigned int l;
+	uint8_t *b;
+
+	switch(cfg->t_uid_len) {
+	case 4:
+	case 7:
+	case 10:
+		t->t_levels = (cfg->t_uid_len - 1) / 3;
+		break;
+	default:
+		return 0;
+	}
+
+	if ( cfg->t_mfc_sectors > MIFARE_CL_SECTORS ||
+			(cfg->t_mfc_sectors && NULL == cfg->t_mfc) ||
+			cfg->t_ats_len > sizeof(t->t_ats) ||
+			(cfg->t_ats_len && NULL == cfg->t_ats) )
+		return 0;
+
+	t->t_cfg = *cfg;
+	if ( !cfg->t_atqa[0] && !cfg->t_atqa[1] )
+		t->t_cfg.t_atqa[0] = ((t->t_levels - 1) << 6) | 0x04;
+	if ( !cfg->t_mfc_sectors )
+		t->t_cfg.t_mfc = NULL;
+
+	for(l = 0; l < t->t_levels; l++) {
+		b = t->t_cl[l];
+		if ( l + 1 < t->t_levels ) {
+			b[0] = 0x88;
+			memcpy(b + 1, uid, 3);
+			uid += 3;
+		}else{
+			memcpy(b, uid, 4);
+		}
+		b[4] = b[0] ^ b[1] ^ b[2] ^ b[3];
+	}
+
+	if ( cfg->t_ats_len ) {
+		memcpy(t->t_ats, cfg->t_ats, cfg->t_ats_len);
+		t->t_ats_len = cfg->t_ats_len;
+	}else{
+		memcpy(t->t_ats, default_ats, sizeof(default_ats));
+		t->t_ats_len = sizeof(default_ats);
+	}
+
+	t->t_fsc = 32;
+	if ( t->t_ats_len > 1 &&
+			!_iso14443_fsdi_to_fsd(t->t_ats[1] & 0xf, &t->t_fsc) )
+		t->t_fsc = 256;
+
+	t->t_mfc_blocks = _mfc_sectors_size(0, cfg->t_mfc_sectors) /
+				MIFARE_CL_PAGE_SIZE;
+	t->t_present = 1;
+	tag_reset(t);
+	return 1;
+}
+
+void _rfid_sim_free(struct _rfid_sim *s)
+{
+	if ( s ) {
+		free(s->s_tag);
+		free(s);
+	}
+}
+
+/* Put a simulated ASIC and cards in the first RF field of ccid */
+int _rfid_sim_attach(struct _ccid *ccid, const struct ccid_sim_tag *tags,
+			unsigned int num)
+{
+	struct _rfid_sim *s;
+	unsigned int i;
+
+	s = calloc(1, sizeof(*s));
+	if ( NULL == s )
+		return 0;
+
+	s->s_tag = calloc((num) ? num : 1, sizeof(*s->s_tag));
+	if ( NULL == s->s_tag )
+		goto err;
+
+	for(i = 0; i < num; i++) {
+		if ( !tag_init(&s->s_tag[i], &tags[i]) ) {
+			fprintf(stderr, "*** error: sim: bad tag %u\n", i);
+			goto err;
+		}
+	}
+
+	s->s_ccid = ccid;
+	s->s_num_tags = num;
+	regs_reset(s);
+
+	ccid->d_sim = s;
+	ccid->d_rf[0].i_idx = 0;
+	if ( !_clrc632_init(ccid->d_rf, &sim_ops) ) {
+		ccid->d_sim = NULL;
+		goto err;
+	}
+
+	ccid->d_num_rf = 1;
+	return 1;
+err:
+	_rfid_sim_free(s);
+	return 0;
+}
+
+/** Take a simulated card out of the field, or put it back.
+ * \ingroup g_ccid
+ * @param ccid \ref ccid_t from \ref ccid_probe_sim.
+ * @param tag Index of the card in the array passed to \ref ccid_probe_sim.
+ * @param present Whether the card is in the field.
+ *
+ * A card which comes back is in the state it would be after being powered
+ * up, it has to be found and activated all over again.
+ *
+ * @return zero on failure.
+ */
+int ccid_sim_present(ccid_t ccid, unsigned int tag, int present)
+{
+	struct _rfid_sim *s = ccid->d_sim;
+	struct sim_tag *t;
+
+	if ( NULL == s || tag >= s->s_num_tags ) {
+		ccid->d_error = CCID_ERROR_IN_VALUE;
+		return 0;
+	}
+
+	t = &s->s_tag[tag];
+	if ( !t->t_present != !present ) {
+		t->t_present = !!present;
+		tag_reset(t);
+	}
+
+	return 1;
+}
+
+/** Retrieve the counters of a simulated reader.
+ * \ingroup g_ccid
+ * @param ccid \ref ccid_t from \ref ccid_probe_sim.
+ * @param st Filled in with the counters.
+ *
+ * The counters are updated by the thread making the calls on the \ref
+ * cci_t and are not locked.
+ *
+ * @return zero if ccid is not a simulator.
+ */
+int ccid_sim_stats(ccid_t ccid, struct ccid_sim_stats *st)
+{
+	if ( NULL == ccid->d_sim )
+		return 0;
+	memcpy(st, &ccid->d_sim->s_stats, sizeof(*st));
+	return 1;
+}
+
+/** Zero the counters of a simulated reader.
+ * \ingroup g_ccid
+ * @param ccid \ref ccid_t from \ref ccid_probe_sim.
+ * @return zero if ccid is not a simulator.
+ */
+int ccid_sim_stats_reset(ccid_t ccid)
+{
+	if ( NULL == ccid->d_sim )
+		return 0;
+	memset(&ccid->d_sim->s_stats, 0, sizeof(ccid->d_sim->s_stats));
+	return 1;
+}
@@ -0,0 +1,219 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2008 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Brute force scanning of the command space, for finding out which classes,
+ * instructions and files a card supports. Commands go out a window at a time
+ * through cci_transact_batch(). A command which selects something changes the
+ * context that the rest of the window was sent in, so after the path is
+ * selected again the scan carries on from the command after it.
+*/
+
+#include <ccid.h>
+#include <apdu.h>
+
+#include "ccid-internal.h"
+
+#define SCAN_WINDOW	32
+#define SCAN_TXMAX	(5 + 2 + 1)
+#define SCAN_RXMAX	(256 + 2)
+
+#define INS_SELECT	0xa4
+
+static int skipped(const struct cci_scan *s, unsigned int v)
+{
+	unsigned int i;
+
+	for(i = 0; i < s->s_nskip; i++)
+		if ( s->s_skip[i] == v )
+			return 1;
+	return 0;
+}
+
+static int ignored(const struct cci_scan *s, uint8_t sw1)
+{
+	return !!(s->s_ignore[sw1 >> 3] & (1U << (sw1 & 7)));
+}
+
+/* Something was selected, so the current file has changed */
+static int selected(uint8_t sw1)
+{
+	return (sw1 == 0x90 || sw1 == 0x61 || sw1 == 0x9f);
+}
+
+static int build(const struct cci_scan *s, xfr_t xfr, unsigned int v)
+{
+	uint8_t hdr[4], fid[2];
+	struct apdu a;
+
+	memcpy(hdr, s->s_hdr, sizeof(hdr));
+	switch(s->s_field) {
+	case CCI_SCAN_CLA:
+		hdr[0] = v;
+		break;
+	case CCI_SCAN_INS:
+		hdr[1] = v;
+		break;
+	case CCI_SCAN_P1P2:
+		hdr[2] = v >> 8;
+		hdr[3] = v & 0xff;
+		break;
+	case CCI_SCAN_FID:
+		break;
+	default:
+		return 0;
+	}
+
+	apdu_init(&a, xfr, hdr[0], hdr[1], hdr[2], hdr[3]);
+	if ( s->s_field == CCI_SCAN_FID ) {
+		fid[0] = v >> 8;
+		fid[1] = v & 0xff;
+		apdu_data(&a, fid, sizeof(fid));
+		if ( s->s_le >= 0 )
+			apdu_le(&a, s->s_le);
+	}else{
+		/* T=0 always wants P3, so case 1 commands get a zero one */
+		apdu_le(&a, (s->s_le >= 0) ? s->s_le : 0);
+	}
+
+	return apdu_finish(&a);
+}
+
+static int restore(cci_t cci, const struct cci_scan *s, xfr_t xfr)
+{
+	uint8_t fid[2];
+	struct apdu a;
+	unsigned int i;
+
+	for(i = 0; i < s->s_npath; i++) {
+		fid[0] = s->s_path[i] >> 8;
+		fid[1] = s->s_path[i] & 0xff;
+		apdu_init(&a, xfr, s->s_hdr[0], INS_SELECT, 0, 0);
+		apdu_data(&a, fid, sizeof(fid));
+		if ( !apdu_finish(&a) )
+			return 0;
+		if ( !cci_transact(cci, xfr) )
+			return 0;
+		if ( !selected(xfr_rx_sw1(xfr)) ) {
+			fprintf(stderr, "*** error: scan: can't select "
+				"0x%.4x\n", s->s_path[i]);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static void record(struct cci_scan_result *res, uint16_t sw, uint16_t v)
+{
+	struct cci_scan_bucket *b;
+	unsigned int i;
+
+	for(i = 0; i < res->r_nbuckets; i++) {
+		if ( res->r_bucket[i].b_sw == sw )
+			break;
+	}
+
+	if ( i == res->r_nbuckets ) {
+		if ( res->r_nbuckets >= CCI_SCAN_BUCKETS ) {
+			res->r_overflow++;
+			return;
+		}
+		res->r_nbuckets++;
+		res->r_bucket[i].b_sw = sw;
+	}
+
+	b = &res->r_bucket[i];
+	b->b_count++;
+	if ( b->b_nval < CCI_SCAN_VALUES )
+		b->b_val[b->b_nval++] = v;
+}
+
+/** Scan a range of commands and bucket the results by status word.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t to scan.
+ * @param scan Parameters of the scan, see \ref cci_scan.
+ * @param res Filled in with the results.
+ *
+ * Commands are pipelined where the interface allows. Commands whose
+ * transaction fails are counted in r_errors and the scan carries on.
+ *
+ * @return zero on failure, including failing to select the path.
+ */
+int cci_scan(cci_t cci, const struct cci_scan *scan,
+		struct cci_scan_result *res)
+{
+	struct cci_apdu apdu[SCAN_WINDOW];
+	unsigned int val[SCAN_WINDOW];
+	xfr_t xfr[SCAN_WINDOW] = {NULL, }, ctx;
+	unsigned int v, i, cnt;
+	uint8_t sw1;
+	int ret = 0;
+
+	memset(res, 0, sizeof(*res));
+
+	if ( scan->s_first > scan->s_last || scan->s_last > 0xffff )
+		return 0;
+
+	ctx = xfr_alloc(SCAN_TXMAX, SCAN_RXMAX);
+	if ( NULL == ctx )
+		return 0;
+	xfr_auto_response(ctx, 1);
+
+	for(i = 0; i < SCAN_WINDOW; i++) {
+		xfr[i] = xfr_alloc(SCAN_TXMAX, SCAN_RXMAX);
+		if ( NULL == xfr[i] )
+			goto out;
+	}
+
+	if ( !restore(cci, scan, ctx) )
+		goto out;
+
+	for(v = scan->s_first; v <= scan->s_last; ) {
+		for(cnt = 0; cnt < SCAN_WINDOW && v <= scan->s_last; v++) {
+			if ( skipped(scan, v) )
+				continue;
+			if ( !build(scan, xfr[cnt], v) )
+				goto out;
+			apdu[cnt].a_xfr = xfr[cnt];
+			apdu[cnt].a_sw = 0;
+			apdu[cnt].a_sw_mask = 0;
+			val[cnt++] = v;
+		}
+
+		if ( !cnt )
+			break;
+
+		cci_transact_batch(cci, apdu, cnt, 0);
+
+		for(i = 0; i < cnt; i++) {
+			res->r_sent++;
+			if ( !apdu[i].a_ok ) {
+				res->r_errors++;
+				continue;
+			}
+
+			sw1 = xfr_rx_sw1(xfr[i]);
+			if ( !ignored(scan, sw1) )
+				record(res, (sw1 << 8) | xfr_rx_sw2(xfr[i]),
+					val[i]);
+
+			if ( scan->s_npath && selected(sw1) ) {
+				if ( !restore(cci, scan, ctx) )
+					goto out;
+				/* rest of the window ran in the wrong place */
+				v = val[i] + 1;
+				break;
+			}
+		}
+	}
+
+	ret = 1;
+out:
+	for(i = 0; i < SCAN_WINDOW; i++)
+		xfr_free(xfr[i]);
+	xfr_free(ctx);
+	return ret;
+}
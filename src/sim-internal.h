@@ -46,15 +46,13 @@
 #define EF_LINEAR		0x1
 #define EF_CYCLIC		0x3
 
-/* SMS record status codes */
-#define SIM_SMS_STATUS_FREE	0
-#define SIM_SMS_STATUS_READ	1
-#define SIM_SMS_STATUS_UNREAD	3
-#define SIM_SMS_STATUS_SENT	5
-#define SIM_SMS_STATUS_UNSENT	7
-
 /* SMS-DELIVER octet codes */
 #define SMS_TP_MTI		((1<<0)|(1<<1)) /* message type indicator */
+#define  SMS_MTI_DELIVER	0
+#define  SMS_MTI_SUBMIT		1
+#define SMS_TP_VPF		((1<<3)|(1<<4)) /* SMS-SUBMIT validity period */
+#define  SMS_VPF_NONE		(0<<3)
+#define  SMS_VPF_RELATIVE	(2<<3)
 #define SMS_TP_MMS		(1<<2) /* more messages */
 #define SMS_TP_SRI		(1<<5) /* status report indicator */
 #define SMS_TP_UDHI		(1<<6) /* user data header included */
@@ -67,8 +65,8 @@
 #define GSM_NUMBER_NATIONAL	(2 << 4)
 #define GSM_NUMBER_NET_SPEC	(3 << 4)
 #define GSM_NUMBER_SUBSCR	(4 << 4)
-#define GSM_NUMBER_ABBREV	(5 << 4)
-#define GSM_NUMBER_ALNUM	(6 << 4)
+#define GSM_NUMBER_ALNUM	(5 << 4)
+#define GSM_NUMBER_ABBREV	(6 << 4)
 #define GSM_NUMBER_RESERVED	(7 << 4)
 
 /* Phone numbering plan */
@@ -123,36 +121,64 @@ struct ef_fci {
 	uint8_t	 e_reclen;
 } _packed;
 
-struct _sms {
-	const uint8_t *smsc;
-	const uint8_t *sender;
-	const uint8_t *data;
-	uint8_t smsc_len;
-	uint8_t smsc_type;
-	uint8_t sender_len;
-	uint8_t sender_type;
-	uint8_t tp_pid;
-	uint8_t tp_dcs;
-	uint8_t uda;
-	uint8_t status;
-	uint8_t sms_deliver;
-	uint8_t timestamp[7];
+/* READ RECORD commands in flight at once in sim_read_records() */
+#define SIM_PIPELINE		8
+
+struct sim_rec_slot {
+	xfr_t		r_xfr;
+	uint8_t		*r_dst;
+	uint8_t		r_reclen;
+	uint8_t		r_ok;
+};
+
+/* Record container written by sim_sms_save(), all fields big endian. The
+ * header is followed by the number of each record present, one byte each,
+ * and then the records themselves in the same order.
+ */
+#define SIM_REC_MAGIC		"SIMR"
+#define SIM_REC_VERSION		1
+struct sim_rec_hdr {
+	uint8_t		h_magic[4];
+	uint8_t		h_vers;
+	uint8_t		h_reclen;
+	uint16_t	h_df;
+	uint16_t	h_ef;
+	uint16_t	h_nrec;
+	uint16_t	h_nent;
+} _packed;
+
+/* Parsed FCI of files already selected in this session, EFs are keyed on
+ * their parent DF as well, DFs have f_df set to SIM_MF.
+ */
+#define SIM_FCI_CACHE		16
+struct sim_fci {
+	uint16_t	f_id;
+	uint16_t	f_df;
+	struct df_fci	f_df_fci;
+	struct df_gsm	f_df_gsm;
+	struct ef_fci	f_ef_fci;
 };
 
 struct _sim {
 	cci_t	s_cc;
 	xfr_t		s_xfr;
+	struct sim_rec_slot s_pipe[SIM_PIPELINE];
 	uint16_t	s_df;
 	uint16_t	s_ef;
 	uint8_t		s_reclen;
 	struct df_fci	s_df_fci;
 	struct df_gsm 	s_df_gsm;
 	struct ef_fci	s_ef_fci;
+	struct sim_fci	s_fci[SIM_FCI_CACHE];
+	unsigned int	s_num_fci;
+	unsigned int	s_fci_next;
 };
 
 _private int _apdu_select(struct _sim *s, uint16_t id);
+_private int _apdu_select_nofci(struct _sim *s, uint16_t id);
 _private int _apdu_read_binary(struct _sim *s, uint16_t ofs, uint8_t len);
 _private int _apdu_read_record(struct _sim *s, uint8_t rec, uint8_t len);
-_private void _sms_decode(struct _sms *, const uint8_t *ptr); /* 175 bytes */
+_private int _apdu_read_record_cmd(xfr_t xfr, uint8_t rec, uint8_t len);
+_private void _sms_print(const struct sim_sms *sms);
 
 #endif /* _SIM_INTERNAL_H */
@@ -189,12 +189,112 @@ static int set_fci(struct _sim *s, uint16_t id)
 	return (id == f.f_id);
 }
 
+static int is_df(uint16_t id)
+{
+	return SIM_IS_MF(id) || SIM_IS_DF(id);
+}
+
+static struct sim_fci *fci_find(struct _sim *s, uint16_t id)
+{
+	uint16_t df = is_df(id) ? SIM_MF : s->s_df;
+	unsigned int i;
+
+	if ( df == SIM_FILE_INVALID )
+		return NULL;
+
+	for(i = 0; i < s->s_num_fci; i++) {
+		if ( s->s_fci[i].f_id == id && s->s_fci[i].f_df == df )
+			return &s->s_fci[i];
+	}
+
+	return NULL;
+}
+
+/* Called after set_fci() succeeded, the oldest entry goes when full */
+static void fci_store(struct _sim *s, uint16_t id)
+{
+	struct sim_fci *f;
+
+	f = &s->s_fci[s->s_fci_next];
+	s->s_fci_next = (s->s_fci_next + 1) % SIM_FCI_CACHE;
+	if ( s->s_num_fci < SIM_FCI_CACHE )
+		s->s_num_fci++;
+
+	f->f_id = id;
+	if ( is_df(id) ) {
+		f->f_df = SIM_MF;
+		f->f_df_fci = s->s_df_fci;
+		f->f_df_gsm = s->s_df_gsm;
+	}else{
+		f->f_df = s->s_df;
+		f->f_ef_fci = s->s_ef_fci;
+	}
+}
+
+static void fci_apply(struct _sim *s, const struct sim_fci *f)
+{
+	if ( is_df(f->f_id) ) {
+		s->s_df = f->f_id;
+		s->s_ef = SIM_FILE_INVALID;
+		s->s_df_fci = f->f_df_fci;
+		s->s_df_gsm = f->f_df_gsm;
+		memset(&s->s_ef_fci, 0, sizeof(s->s_ef_fci));
+	}else{
+		s->s_ef = f->f_id;
+		s->s_ef_fci = f->f_ef_fci;
+	}
+}
+
+/* Selecting the current file is skipped, as is the GET RESPONSE for files
+ * whose FCI has been seen before. Cached DF FCI isn't refreshed, so the
+ * free space figure in it is as of the first selection. If anything goes
+ * wrong then the current DF is forgotten, which makes the next path based
+ * selection start again from the MF.
+ */
 static int _sim_select(struct _sim *s, uint16_t id)
 {
-	if ( !_apdu_select(s, id) )
-		return 0;
+	struct sim_fci *f;
+
+	if ( id == s->s_ef )
+		return 1;
+
+	/* the card may still have an EF selected but that doesn't matter */
+	if ( id == s->s_df ) {
+		s->s_ef = SIM_FILE_INVALID;
+		memset(&s->s_ef_fci, 0, sizeof(s->s_ef_fci));
+		return 1;
+	}
+
+	f = fci_find(s, id);
+	if ( f ) {
+		if ( !_apdu_select_nofci(s, id) )
+			goto lost;
+		fci_apply(s, f);
+		return 1;
+	}
+
+	if ( !_apdu_select(s, id) || !set_fci(s, id) )
+		goto lost;
 
-	return set_fci(s, id);
+	fci_store(s, id);
+	return 1;
+lost:
+	s->s_df = s->s_ef = SIM_FILE_INVALID;
+	return 0;
+}
+
+/* Select ef under df, where df is the MF or a DF directly under it, with as
+ * few SELECTs as possible. Any first level DF can be selected from the MF or
+ * from one of its siblings.
+ */
+static int _sim_select_path(struct _sim *s, uint16_t df, uint16_t ef)
+{
+	if ( s->s_df == SIM_FILE_INVALID && df != SIM_MF &&
+			!_sim_select(s, SIM_MF) )
+		return 0;
+	if ( s->s_df != df && !_sim_select(s, df) )
+		return 0;
+	return _sim_select(s, ef);
 }
 
 static const uint8_t *_sim_read_binary(struct _sim *s, size_t *len)
@@ -218,9 +318,11 @@ static void read_iccid(struct _sim *s)
 	const uint8_t *ptr;
 	size_t len, i;
 
-	_sim_select(s, SIM_MF);
-	_sim_select(s, SIM_EF_ICCID);
+	if ( !_sim_select_path(s, SIM_MF, SIM_EF_ICCID) )
+		return;
 	ptr = _sim_read_binary(s, &len);
+	if ( NULL == ptr )
+		return;
 
 	printf("ICCID: ");
 	for(i = 0; i < len && ptr[i] != 0xff; i++) {
@@ -238,9 +340,8 @@ static void read_imsi(struct _sim *s)
 	const uint8_t *ptr;
 	size_t len, i;
 
-	_sim_select(s, SIM_MF);
-	_sim_select(s, SIM_DF_GSM);
-	_sim_select(s, SIM_EF_IMSI);
+	if ( !_sim_select_path(s, SIM_DF_GSM, SIM_EF_IMSI) )
+		return;
 	ptr = _sim_read_binary(s, &len);
 	if ( NULL == ptr )
 		return;
@@ -256,57 +357,317 @@ static void read_imsi(struct _sim *s)
 	printf("\n");
 }
 
-int sim_sms_save(sim_t s, const char *fn)
+static void rec_done(cci_t cc, xfr_t xfr, int ok, void *priv)
 {
+	struct sim_rec_slot *r = priv;
 	const uint8_t *ptr;
-	size_t num_rec, i, len;
-	FILE *f;
+	size_t len;
+
+	/* anything but a clean 9000 is retried with cci_transact() */
+	if ( !ok || xfr_rx_sw1(xfr) != SIM_SW1_SUCCESS )
+		return;
+
+	ptr = xfr_rx_data(xfr, &len);
+	if ( NULL == ptr || len != r->r_reclen )
+		return;
+
+	memcpy(r->r_dst, ptr, len);
+	r->r_ok = 1;
+}
+
+static int pipe_alloc(struct _sim *s)
+{
+	unsigned int i;
+
+	for(i = 0; i < SIM_PIPELINE; i++) {
+		if ( s->s_pipe[i].r_xfr )
+			continue;
+		s->s_pipe[i].r_xfr = xfr_alloc(16, 258);
+		if ( NULL == s->s_pipe[i].r_xfr )
+			return 0;
+	}
 
-	if ( !_sim_select(s, SIM_DF_TELECOM) )
+	return 1;
+}
+
+static void pipe_free(struct _sim *s)
+{
+	unsigned int i;
+
+	for(i = 0; i < SIM_PIPELINE; i++) {
+		if ( s->s_pipe[i].r_xfr )
+			xfr_free(s->s_pipe[i].r_xfr);
+		s->s_pipe[i].r_xfr = NULL;
+	}
+}
+
+/* Queue READ RECORD for up to SIM_PIPELINE records and wait for them */
+static int read_batch(struct _sim *s, unsigned int first, unsigned int cnt,
+			uint8_t *buf, uint8_t reclen)
+{
+	struct sim_rec_slot *r;
+	unsigned int i;
+
+	for(i = 0; i < cnt; i++) {
+		r = &s->s_pipe[i];
+		r->r_dst = buf + i * reclen;
+		r->r_reclen = reclen;
+		r->r_ok = 0;
+		if ( !_apdu_read_record_cmd(r->r_xfr, first + i, reclen) )
+			continue;
+		cci_submit(s->s_cc, r->r_xfr, rec_done, r);
+	}
+
+	return ccid_flush(cci_ccid(s->s_cc));
+}
+
+static int read_one(struct _sim *s, unsigned int rec, uint8_t *dst,
+			uint8_t reclen)
+{
+	const uint8_t *ptr;
+	size_t len;
+
+	ptr = _sim_read_record(s, rec, &len);
+	if ( NULL == ptr || len != reclen )
 		return 0;
+	memcpy(dst, ptr, len);
+	return 1;
+}
 
-	if ( !_sim_select(s, SIM_EF_SMS) )
+/* Read every record of a linear fixed or cyclic EF in to buf.
+ * The EF is selected by way of df, which may be SIM_MF for EFs directly
+ * under it. Records are stored back to back, *reclen bytes apart,
+ * in record number order, and records which can't be read are zeroed. If buf
+ * is NULL then only the size of the file is returned. READ RECORD commands
+ * are queued SIM_PIPELINE at a time with cci_submit(), any which don't come
+ * straight back with 9000 are retried one by one so that GSM 9Fxx responses
+ * still work. Returns the number of records read, zero on failure.
+ */
+unsigned int sim_read_records(sim_t s, uint16_t df, uint16_t ef,
+				uint8_t *buf, size_t len,
+				size_t *reclen, unsigned int *nrec,
+				sim_rec_cb_t cb, void *priv)
+{
+	unsigned int n, i, j, cnt, ok, ret = 0;
+	uint8_t rl;
+
+	if ( !_sim_select_path(s, df, ef) )
 		return 0;
 
-	f = fopen(fn, "w");
-	if ( NULL == f )
+	if ( s->s_ef_fci.e_struct != EF_LINEAR &&
+			s->s_ef_fci.e_struct != EF_CYCLIC )
+		return 0;
+
+	rl = s->s_ef_fci.e_reclen;
+	if ( !rl )
+		return 0;
+
+	/* record numbers 0 and 0xff are reserved */
+	n = s->s_ef_fci.e_size / rl;
+	if ( n > 0xfe )
+		n = 0xfe;
+
+	if ( reclen )
+		*reclen = rl;
+	if ( nrec )
+		*nrec = n;
+	if ( NULL == buf )
+		return n;
+	if ( len < (size_t)n * rl )
+		return 0;
+
+	if ( !pipe_alloc(s) )
+		return 0;
+
+	for(i = 0; i < n; i += cnt) {
+		cnt = (n - i < SIM_PIPELINE) ? n - i : SIM_PIPELINE;
+		if ( !read_batch(s, i + 1, cnt, buf + i * rl, rl) )
+			return 0;
+
+		for(j = 0; j < cnt; j++) {
+			uint8_t *dst = buf + (i + j) * rl;
+
+			ok = s->s_pipe[j].r_ok;
+			if ( !ok )
+				ok = read_one(s, i + j + 1, dst, rl);
+			if ( !ok )
+				memset(dst, 0, rl);
+			ret += ok;
+			if ( cb )
+				(*cb)(s, i + j + 1, n, ok, priv);
+		}
+	}
+
+	return ret;
+}
+
+static int sms_present(const uint8_t *rec)
+{
+	return (rec[0] & 0x7) != SIM_SMS_STATUS_FREE;
+}
+
+/* Only keep records which were read and aren't free */
+static void sms_mark(sim_t s, unsigned int rec, unsigned int nrec,
+			int ok, void *priv)
+{
+	uint8_t *present = priv;
+
+	present[rec - 1] = ok;
+}
+
+static int save_container(FILE *f, uint16_t df, uint16_t ef,
+				const uint8_t *buf, uint8_t reclen,
+				unsigned int nrec, const uint8_t *present)
+{
+	struct sim_rec_hdr h;
+	unsigned int i, nent;
+	uint8_t idx;
+
+	for(nent = i = 0; i < nrec; i++)
+		nent += !!present[i];
+
+	memcpy(h.h_magic, SIM_REC_MAGIC, sizeof(h.h_magic));
+	h.h_vers = SIM_REC_VERSION;
+	h.h_reclen = reclen;
+	h.h_df = htobe16(df);
+	h.h_ef = htobe16(ef);
+	h.h_nrec = htobe16(nrec);
+	h.h_nent = htobe16(nent);
+	if ( fwrite(&h, sizeof(h), 1, f) != 1 )
 		return 0;
 
-	printf("Saving SMS messages to '%s'", fn);
-	fflush(stdout);
-	num_rec = s->s_ef_fci.e_size / s->s_ef_fci.e_reclen;
-	for(i = 1; i <= num_rec; i++) {
-		ptr = _sim_read_record(s, i, &len);
-		if ( NULL == ptr )
+	for(i = 0; i < nrec; i++) {
+		if ( !present[i] )
 			continue;
-		fwrite(ptr, len, 1, f);
-		printf(".");
-		fflush(stdout);
+		idx = i + 1;
+		if ( fwrite(&idx, 1, 1, f) != 1 )
+			return 0;
+	}
+
+	for(i = 0; i < nrec; i++) {
+		if ( !present[i] )
+			continue;
+		if ( fwrite(buf + i * reclen, reclen, 1, f) != 1 )
+			return 0;
 	}
-	printf("\n");
 
-	fclose(f);
 	return 1;
 }
 
+int sim_sms_save(sim_t s, const char *fn)
+{
+	uint8_t *buf = NULL, *present = NULL;
+	unsigned int nrec, i;
+	size_t reclen;
+	FILE *f = NULL;
+	int ret = 0;
+
+	if ( !sim_read_records(s, SIM_DF_TELECOM, SIM_EF_SMS, NULL, 0,
+				&reclen, &nrec, NULL, NULL) )
+		goto out;
+
+	buf = malloc(nrec * reclen);
+	present = calloc(nrec, 1);
+	if ( NULL == buf || NULL == present )
+		goto out;
+
+	if ( !sim_read_records(s, SIM_DF_TELECOM, SIM_EF_SMS,
+				buf, nrec * reclen, &reclen, &nrec,
+				sms_mark, present) )
+		goto out;
+
+	for(i = 0; i < nrec; i++) {
+		if ( present[i] && !sms_present(buf + i * reclen) )
+			present[i] = 0;
+	}
+
+	f = fopen(fn, "w");
+	if ( NULL == f )
+		goto out;
+
+	if ( !save_container(f, SIM_DF_TELECOM, SIM_EF_SMS,
+				buf, reclen, nrec, present) )
+		goto out;
+
+	ret = 1;
+out:
+	if ( f && fclose(f) )
+		ret = 0;
+	free(present);
+	free(buf);
+	return ret;
+}
+
+static void sms_restore_one(const uint8_t *rec, size_t reclen)
+{
+	struct sim_sms sms;
+
+	if ( sim_sms_decode(rec, reclen, &sms) )
+		_sms_print(&sms);
+}
+
+/* Files from before the container was introduced are raw 176 byte records */
+static int restore_raw(FILE *f)
+{
+	uint8_t buf[176];
+
+	rewind(f);
+	while ( fread(buf, sizeof(buf), 1, f) == 1 )
+		sms_restore_one(buf, sizeof(buf));
+
+	return 1;
+}
+
+static int restore_container(FILE *f, const struct sim_rec_hdr *h)
+{
+	unsigned int nent, i;
+	uint8_t *rec;
+	int ret = 0;
+
+	nent = be16toh(h->h_nent);
+	if ( h->h_vers != SIM_REC_VERSION || !h->h_reclen ||
+			nent > be16toh(h->h_nrec) )
+		return 0;
+
+	rec = malloc(h->h_reclen);
+	if ( NULL == rec )
+		return 0;
+
+	/* records are stored in index order, so the index can be skipped */
+	if ( fseek(f, sizeof(*h) + nent, SEEK_SET) )
+		goto out;
+
+	for(i = 0; i < nent; i++) {
+		if ( fread(rec, h->h_reclen, 1, f) != 1 )
+			goto out;
+		sms_restore_one(rec, h->h_reclen);
+	}
+
+	ret = 1;
+out:
+	free(rec);
+	return ret;
+}
+
 int sim_sms_restore(sim_t s, const char *fn)
 {
+	struct sim_rec_hdr h;
 	FILE *f;
-	uint8_t buf[176];
-	unsigned int i;
-	struct _sms sms;
+	int ret;
 
 	f = fopen(fn, "r");
 	if ( NULL == f )
 		return 0;
 
 	printf("Reading SMS messages from '%s':\n", fn);
-	for(i = 1; fread(buf, sizeof(buf), 1, f) == 1; i++) {
-		_sms_decode(&sms, buf);
-	}
+	if ( fread(&h, sizeof(h), 1, f) == 1 &&
+			!memcmp(h.h_magic, SIM_REC_MAGIC, sizeof(h.h_magic)) )
+		ret = restore_container(f, &h);
+	else
+		ret = restore_raw(f);
 
 	fclose(f);
-	return 1;
+	return ret;
 }
 
 sim_t sim_new(cci_t cc)
@@ -320,10 +681,12 @@ sim_t sim_new(cci_t cc)
 		goto err;
 
 	s->s_cc = cc;
+	s->s_df = s->s_ef = SIM_FILE_INVALID;
 
 	s->s_xfr = xfr_alloc(502, 502);
 	if ( NULL == s->s_xfr )
 		goto err_free;
+	xfr_auto_response(s->s_xfr, 1);
 
 	atr = cci_power_on(s->s_cc, CHIPCARD_AUTO_VOLTAGE, &atr_len);
 	if ( NULL == atr )
@@ -351,6 +714,7 @@ err:
 void sim_free(sim_t s)
 {
 	if ( s ) {
+		pipe_free(s);
 		if ( s->s_xfr )
 			xfr_free(s->s_xfr);
 		if ( s->s_cc )
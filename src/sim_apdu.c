@@ -5,75 +5,76 @@
 */
 
 #include <ccid.h>
+#include <apdu.h>
+#include <sim.h>
 #include "sim-internal.h"
 
 static int do_select(struct _sim * s, uint16_t id)
 {
-	xfr_reset(s->s_xfr);
-	xfr_tx_byte(s->s_xfr, SIM_CLA);
-	xfr_tx_byte(s->s_xfr, SIM_INS_SELECT);
-	xfr_tx_byte(s->s_xfr, 0); /* p1 */
-	xfr_tx_byte(s->s_xfr, 0); /* p2 */
-	xfr_tx_byte(s->s_xfr, 2); /* lc */
-	xfr_tx_byte(s->s_xfr, (id >> 8));
-	xfr_tx_byte(s->s_xfr, (id & 0xff));
-	return cci_transact(s->s_cc, s->s_xfr);
-}
+	struct apdu a;
 
-static int do_get_response(struct _sim * s, uint8_t le)
-{
-	xfr_reset(s->s_xfr);
-	xfr_tx_byte(s->s_xfr, SIM_CLA);
-	xfr_tx_byte(s->s_xfr, SIM_INS_GET_RESPONSE);
-	xfr_tx_byte(s->s_xfr, 0); /* p1 */
-	xfr_tx_byte(s->s_xfr, 0); /* p2 */
-	xfr_tx_byte(s->s_xfr, le);
+	apdu_init(&a, s->s_xfr, SIM_CLA, SIM_INS_SELECT, 0, 0);
+	apdu_data_begin(&a);
+	apdu_byte(&a, id >> 8);
+	apdu_byte(&a, id & 0xff);
+	apdu_data_end(&a);
+	if ( !apdu_finish(&a) )
+		return 0;
 	return cci_transact(s->s_cc, s->s_xfr);
 }
 
+/* GET RESPONSE is issued by cci_transact(), see xfr_auto_response() */
 int _apdu_select(struct _sim *s, uint16_t id)
 {
-	uint8_t sw1, sw2;
-
 	if ( !do_select(s, id) )
 		return 0;
 
-	sw1 = xfr_rx_sw1(s->s_xfr);
-	if ( sw1 != SIM_SW1_SHORT )
-		return 0;
+	return ( xfr_rx_sw1(s->s_xfr) == SIM_SW1_SUCCESS );
+}
 
-	sw2 = xfr_rx_sw2(s->s_xfr);
-	if ( !do_get_response(s, sw2) )
-		return 0;
+/* The FCI is already known, so don't fetch it */
+int _apdu_select_nofci(struct _sim *s, uint16_t id)
+{
+	int ret;
 
-	sw1 = xfr_rx_sw1(s->s_xfr);
-	if ( sw1 != SIM_SW1_SUCCESS )
+	xfr_auto_response(s->s_xfr, 0);
+	ret = do_select(s, id);
+	xfr_auto_response(s->s_xfr, 1);
+	if ( !ret )
 		return 0;
 
-	return 1;
+	return ( xfr_rx_sw1(s->s_xfr) == SIM_SW1_SUCCESS ||
+		xfr_rx_sw1(s->s_xfr) == SIM_SW1_SHORT );
 }
 
 int _apdu_read_binary(struct _sim *s, uint16_t ofs, uint8_t len)
 {
-	xfr_reset(s->s_xfr);
-	xfr_tx_byte(s->s_xfr, SIM_CLA);
-	xfr_tx_byte(s->s_xfr, SIM_INS_READ_BINARY);
-	xfr_tx_byte(s->s_xfr, ofs >> 8); /* p1 */
-	xfr_tx_byte(s->s_xfr, ofs & 0xff); /* p2 */
-	xfr_tx_byte(s->s_xfr, len);
+	struct apdu a;
+
+	apdu_init(&a, s->s_xfr, SIM_CLA, SIM_INS_READ_BINARY,
+			ofs >> 8, ofs & 0xff);
+	apdu_le(&a, len);
+	if ( !apdu_finish(&a) )
+		return 0;
 	if ( !cci_transact(s->s_cc, s->s_xfr) )
 		return 0;
 	return ( xfr_rx_sw1(s->s_xfr) == 0x90 );
 }
 
+/* Build READ RECORD (absolute mode) in any xfr, for pipelining */
+int _apdu_read_record_cmd(xfr_t xfr, uint8_t rec, uint8_t len)
+{
+	struct apdu a;
+
+	apdu_init(&a, xfr, SIM_CLA, SIM_INS_READ_RECORD, rec, 0x4);
+	apdu_le(&a, len);
+	return apdu_finish(&a);
+}
+
 int _apdu_read_record(struct _sim *s, uint8_t rec, uint8_t len)
 {
-	xfr_reset(s->s_xfr);
-	xfr_tx_byte(s->s_xfr, SIM_CLA);
-	xfr_tx_byte(s->s_xfr, SIM_INS_READ_RECORD);
-	xfr_tx_byte(s->s_xfr, rec);
-	xfr_tx_byte(s->s_xfr, 0x4);
-	xfr_tx_byte(s->s_xfr, len);
+	if ( !_apdu_read_record_cmd(s->s_xfr, rec, len) )
+		return 0;
 	if ( !cci_transact(s->s_cc, s->s_xfr) )
 		return 0;
 	return ( xfr_rx_sw1(s->s_xfr) == 0x90 );
@@ -2,43 +2,431 @@
  * This file is part of ccid-utils
  * Copyright (c) 2008 Gianni Tedesco <gianni@scaramanga.co.uk>
  * Released under the terms of the GNU GPL version 3
+ *
+ * SMS PDU decoding as per GSM 03.40 and 03.38. Everything is decoded in to
+ * the caller's struct sim_sms so many records can be decoded at once from any
+ * number of threads.
 */
 
 #include <ccid.h>
+#include <sim.h>
 #include "sim-internal.h"
 
-static void decode_7bit(const uint8_t *inp, size_t len)
+#define GSM_ESC		0x1b
+
+/* GSM 03.38 default alphabet */
+static const uint16_t gsm_alphabet[128] = {
+	0x0040, 0x00a3, 0x0024, 0x00a5, 0x00e8, 0x00e9, 0x00f9, 0x00ec,
+	0x00f2, 0x00c7, 0x000a, 0x00d8, 0x00f8, 0x000d, 0x00c5, 0x00e5,
+	0x0394, 0x005f, 0x03a6, 0x0393, 0x039b, 0x03a9, 0x03a0, 0x03a8,
+	0x03a3, 0x0398, 0x039e, 0x00a0, 0x00c6, 0x00e6, 0x00df, 0x00c9,
+	0x0020, 0x0021, 0x0022, 0x0023, 0x00a4, 0x0025, 0x0026, 0x0027,
+	0x0028, 0x0029, 0x002a, 0x002b, 0x002c, 0x002d, 0x002e, 0x002f,
+	0x0030, 0x0031, 0x0032, 0x0033, 0x0034, 0x0035, 0x0036, 0x0037,
+	0x0038, 0x0039, 0x003a, 0x003b, 0x003c, 0x003d, 0x003e, 0x003f,
+	0x00a1, 0x0041, 0x0042, 0x0043, 0x0044, 0x0045, 0x0046, 0x0047,
+	0x0048, 0x0049, 0x004a, 0x004b, 0x004c, 0x004d, 0x004e, 0x004f,
+	0x0050, 0x0051, 0x0052, 0x0053, 0x0054, 0x0055, 0x0056, 0x0057,
+	0x0058, 0x0059, 0x005a, 0x00c4, 0x00d6, 0x00d1, 0x00dc, 0x00a7,
+	0x00bf, 0x0061, 0x0062, 0x0063, 0x0064, 0x0065, 0x0066, 0x0067,
+	0x0068, 0x0069, 0x006a, 0x006b, 0x006c, 0x006d, 0x006e, 0x006f,
+	0x0070, 0x0071, 0x0072, 0x0073, 0x0074, 0x0075, 0x0076, 0x0077,
+	0x0078, 0x0079, 0x007a, 0x00e4, 0x00f6, 0x00f1, 0x00fc, 0x00e0,
+};
+
+/* Extension table, reached through GSM_ESC. Anything not in here is shown
+ * as the character from the default alphabet.
+ */
+static const uint16_t gsm_extension[128] = {
+	[0x0a] = 0x000c,
+	[0x14] = 0x005e,
+	[0x28] = 0x007b,
+	[0x29] = 0x007d,
+	[0x2f] = 0x005c,
+	[0x3c] = 0x005b,
+	[0x3d] = 0x007e,
+	[0x3e] = 0x005d,
+	[0x40] = 0x007c,
+	[0x65] = 0x20ac,
+};
+
+/* Septet n of a group of 8 starts in byte sept_ofs[n] of the 7 byte group, at
+ * bit sept_shift[n]. Septets at shift 0 or 1 don't spill in to the next byte.
+ */
+static const uint8_t sept_ofs[8] = {0, 0, 1, 2, 3, 4, 5, 6};
+static const uint8_t sept_shift[8] = {0, 7, 6, 5, 4, 3, 2, 1};
+
+static const char bcd_digit[16] = "0123456789*#abc";
+
+struct utf8 {
+	char	*u_ptr;
+	char	*u_end;
+};
+
+static void utf8_init(struct utf8 *u, char *buf, size_t len)
+{
+	u->u_ptr = buf;
+	u->u_end = buf + len - 1;
+	*buf = '\0';
+}
+
+static void utf8_put(struct utf8 *u, unsigned int cp)
+{
+	uint8_t b[4];
+	size_t n;
+
+	if ( cp < 0x80 ) {
+		b[0] = cp;
+		n = 1;
+	}else if ( cp < 0x800 ) {
+		b[0] = 0xc0 | (cp >> 6);
+		b[1] = 0x80 | (cp & 0x3f);
+		n = 2;
+	}else if ( cp < 0x10000 ) {
+		b[0] = 0xe0 | (cp >> 12);
+		b[1] = 0x80 | ((cp >> 6) & 0x3f);
+		b[2] = 0x80 | (cp & 0x3f);
+		n = 3;
+	}else{
+		b[0] = 0xf0 | (cp >> 18);
+		b[1] = 0x80 | ((cp >> 12) & 0x3f);
+		b[2] = 0x80 | ((cp >> 6) & 0x3f);
+		b[3] = 0x80 | (cp & 0x3f);
+		n = 4;
+	}
+
+	/* truncate rather than split a character */
+	if ( n > (size_t)(u->u_end - u->u_ptr) ) {
+		u->u_end = u->u_ptr;
+		return;
+	}
+
+	memcpy(u->u_ptr, b, n);
+	u->u_ptr += n;
+	*u->u_ptr = '\0';
+}
+
+/* Septet i of packed data which is len bytes long */
+static uint8_t septet(const uint8_t *ptr, size_t len, size_t i)
 {
-	uint8_t out[len + 1];
-	unsigned int i;
+	size_t ofs = (i >> 3) * 7 + sept_ofs[i & 7];
+	unsigned int shift = sept_shift[i & 7];
+	unsigned int v;
 
-	for(i = 0; i <= len; i++) {
-		int ipos = i - (i >> 3);
-		int offset = (i & 0x7);
+	v = ptr[ofs] >> shift;
+	if ( shift > 1 && ofs + 1 < len )
+		v |= ptr[ofs + 1] << (8 - shift);
+	return v & 0x7f;
+}
+
+/* Septets first to first + nsept - 1 of packed data, in UTF-8 */
+static size_t decode_7bit(const uint8_t *ptr, size_t len, size_t first,
+				size_t nsept, char *out, size_t out_len)
+{
+	struct utf8 u;
+	uint8_t c;
+	size_t i;
 
-		out[i] = (inp[ipos] & (0x7F >> offset)) << offset;
-		if( 0 == offset )
+	utf8_init(&u, out, out_len);
+
+	for(i = first; i < first + nsept; i++) {
+		c = septet(ptr, len, i);
+		if ( c == GSM_ESC && i + 1 < first + nsept ) {
+			c = septet(ptr, len, ++i);
+			utf8_put(&u, gsm_extension[c] ?
+					gsm_extension[c] : gsm_alphabet[c]);
 			continue;
+		}
+		utf8_put(&u, gsm_alphabet[c]);
+	}
+
+	return u.u_ptr - out;
+}
+
+static size_t decode_ucs2(const uint8_t *ptr, size_t len,
+				char *out, size_t out_len)
+{
+	unsigned int cp, lo;
+	struct utf8 u;
+	size_t i;
+
+	utf8_init(&u, out, out_len);
 
-		out[i] |= (inp[ipos - 1] & 
-			(0x7F << (8 - offset)) & 0xFF) >> (8 - offset);
+	for(i = 0; i + 1 < len; i += 2) {
+		cp = (ptr[i] << 8) | ptr[i + 1];
+		if ( cp >= 0xd800 && cp < 0xdc00 && i + 3 < len ) {
+			lo = (ptr[i + 2] << 8) | ptr[i + 3];
+			if ( lo >= 0xdc00 && lo < 0xe000 ) {
+				cp = 0x10000 + ((cp - 0xd800) << 10) +
+					(lo - 0xdc00);
+				i += 2;
+			}
+		}
+		utf8_put(&u, cp);
 	}
 
-	out[len] = '\0';
-	printf(" \"%s\"\n", out);
+	return u.u_ptr - out;
 }
 
-static uint8_t hi_nibble(uint8_t byte)
+#define ALPHABET_7BIT	0
+#define ALPHABET_8BIT	1
+#define ALPHABET_UCS2	2
+static unsigned int dcs_alphabet(uint8_t dcs)
 {
-	return byte >> 4;
+	switch(dcs >> 4) {
+	case 0x0 ... 0x3:
+		/* general data coding, compressed text is left as data */
+		if ( dcs & 0x20 )
+			return ALPHABET_8BIT;
+		switch((dcs >> 2) & 0x3) {
+		case 1:
+			return ALPHABET_8BIT;
+		case 2:
+			return ALPHABET_UCS2;
+		default:
+			return ALPHABET_7BIT;
+		}
+	case 0xc:
+	case 0xd:
+		return ALPHABET_7BIT;
+	case 0xe:
+		return ALPHABET_UCS2;
+	case 0xf:
+		return (dcs & 0x4) ? ALPHABET_8BIT : ALPHABET_7BIT;
+	default:
+		return ALPHABET_8BIT;
+	}
 }
 
-static uint8_t lo_nibble(uint8_t byte)
+/* Semi-octet numbers, nibble swapped and padded with 0xf */
+static void decode_bcd(const uint8_t *ptr, size_t ndigits, uint8_t type,
+				char *out, size_t out_len)
 {
-	return byte & 0xf;
+	char *o = out, *end = out + out_len - 1;
+	uint8_t d;
+	size_t i;
+
+	if ( GSM_NUMBER_INTL == (type & GSM_NUMBER_TYPE_MASK) && o < end )
+		*o++ = '+';
+
+	for(i = 0; i < ndigits && o < end; i++) {
+		d = (i & 1) ? (ptr[i >> 1] >> 4) : (ptr[i >> 1] & 0xf);
+		if ( d == 0xf )
+			break;
+		*o++ = bcd_digit[d];
+	}
+
+	*o = '\0';
+}
+
+/* TP address, where the length is in semi-octets */
+static const uint8_t *decode_addr(const uint8_t *ptr, const uint8_t *end,
+					uint8_t *type, char *out, size_t len)
+{
+	size_t ndigits, nbytes;
+
+	if ( end - ptr < 2 )
+		return NULL;
+
+	ndigits = ptr[0];
+	*type = ptr[1];
+	ptr += 2;
+
+	nbytes = (ndigits + 1) >> 1;
+	if ( (size_t)(end - ptr) < nbytes )
+		return NULL;
+
+	if ( GSM_NUMBER_ALNUM == (*type & GSM_NUMBER_TYPE_MASK) )
+		decode_7bit(ptr, nbytes, 0, (ndigits * 4) / 7, out, len);
+	else
+		decode_bcd(ptr, ndigits, *type, out, len);
+
+	return ptr + nbytes;
 }
 
-const char *number_type(uint8_t type)
+/* RP address of the service centre, the length is in octets and includes
+ * the type of number
+ */
+static const uint8_t *decode_smsc(const uint8_t *ptr, const uint8_t *end,
+					uint8_t *type, char *out, size_t len)
+{
+	size_t nbytes;
+
+	if ( ptr >= end )
+		return NULL;
+
+	nbytes = *ptr++;
+	*out = '\0';
+	if ( !nbytes )
+		return ptr;
+
+	if ( (size_t)(end - ptr) < nbytes )
+		return NULL;
+
+	*type = ptr[0];
+	decode_bcd(ptr + 1, (nbytes - 1) * 2, *type, out, len);
+	return ptr + nbytes;
+}
+
+static uint8_t bcd_swapped(uint8_t b)
+{
+	return (b & 0xf) * 10 + (b >> 4);
+}
+
+static void decode_scts(struct sim_sms *sms, const uint8_t *ptr)
+{
+	sms->s_year = 2000 + bcd_swapped(ptr[0]);
+	sms->s_mon = bcd_swapped(ptr[1]);
+	sms->s_day = bcd_swapped(ptr[2]);
+	sms->s_hour = bcd_swapped(ptr[3]);
+	sms->s_min = bcd_swapped(ptr[4]);
+	sms->s_sec = bcd_swapped(ptr[5]);
+	sms->s_tz = (ptr[6] & 0x7) * 10 + (ptr[6] >> 4);
+	if ( ptr[6] & 0x8 )
+		sms->s_tz = -sms->s_tz;
+}
+
+/* Pick the concatenation information element out of a user data header */
+static void decode_udh(struct sim_sms *sms, const uint8_t *ptr, size_t len)
+{
+	const uint8_t *end = ptr + len;
+	uint8_t iei, ielen;
+
+	while ( end - ptr >= 2 ) {
+		iei = ptr[0];
+		ielen = ptr[1];
+		ptr += 2;
+		if ( (size_t)(end - ptr) < ielen )
+			return;
+
+		if ( iei == 0x00 && ielen == 3 ) {
+			sms->s_concat_ref = ptr[0];
+			sms->s_concat_total = ptr[1];
+			sms->s_concat_seq = ptr[2];
+		}else if ( iei == 0x08 && ielen == 4 ) {
+			sms->s_concat_ref = (ptr[0] << 8) | ptr[1];
+			sms->s_concat_total = ptr[2];
+			sms->s_concat_seq = ptr[3];
+		}
+
+		ptr += ielen;
+	}
+}
+
+static int decode_ud(struct sim_sms *sms, const uint8_t *ptr,
+			const uint8_t *end)
+{
+	unsigned int alphabet = dcs_alphabet(sms->s_dcs);
+	size_t udl, nbytes, hdr = 0, skip = 0;
+
+	if ( ptr >= end )
+		return 0;
+
+	udl = *ptr++;
+	nbytes = (alphabet == ALPHABET_7BIT) ? (udl * 7 + 7) / 8 : udl;
+	if ( (size_t)(end - ptr) < nbytes )
+		return 0;
+
+	if ( sms->s_udhi && nbytes ) {
+		hdr = ptr[0] + 1;
+		if ( hdr > nbytes )
+			return 0;
+		decode_udh(sms, ptr + 1, hdr - 1);
+		/* in septets the header is padded to a septet boundary */
+		skip = (alphabet == ALPHABET_7BIT) ? (hdr * 8 + 6) / 7 : hdr;
+		if ( skip > udl )
+			return 0;
+	}
+
+	sms->s_ud = ptr + hdr;
+	sms->s_ud_len = nbytes - hdr;
+
+	switch(alphabet) {
+	case ALPHABET_7BIT:
+		sms->s_text_len = decode_7bit(ptr, nbytes, skip, udl - skip,
+					sms->s_text, sizeof(sms->s_text));
+		break;
+	case ALPHABET_UCS2:
+		sms->s_text_len = decode_ucs2(sms->s_ud, sms->s_ud_len,
+					sms->s_text, sizeof(sms->s_text));
+		break;
+	default:
+		break;
+	}
+
+	return 1;
+}
+
+/** Decode an EF_SMS record.
+ * Fills in sms from a record of len bytes, the status byte followed by the
+ * service centre address and then an SMS-DELIVER or SMS-SUBMIT TPDU. The
+ * user data pointer points in to rec. Returns zero for free records and for
+ * ones which can't be decoded, s_status is still filled in for those.
+ */
+int sim_sms_decode(const uint8_t *rec, size_t len, struct sim_sms *sms)
+{
+	const uint8_t *ptr = rec, *end = rec + len;
+
+	memset(sms, 0, sizeof(*sms));
+
+	if ( !len )
+		return 0;
+
+	sms->s_status = *ptr++ & 0x7;
+	if ( sms->s_status == SIM_SMS_STATUS_FREE )
+		return 0;
+
+	ptr = decode_smsc(ptr, end, &sms->s_smsc_type,
+				sms->s_smsc, sizeof(sms->s_smsc));
+	if ( NULL == ptr || ptr >= end )
+		return 0;
+
+	sms->s_mti = *ptr++;
+	sms->s_udhi = !!(sms->s_mti & SMS_TP_UDHI);
+
+	switch(sms->s_mti & SMS_TP_MTI) {
+	case SMS_MTI_DELIVER:
+		ptr = decode_addr(ptr, end, &sms->s_addr_type,
+					sms->s_addr, sizeof(sms->s_addr));
+		if ( NULL == ptr || end - ptr < 9 )
+			return 0;
+		sms->s_pid = ptr[0];
+		sms->s_dcs = ptr[1];
+		decode_scts(sms, ptr + 2);
+		ptr += 9;
+		break;
+	case SMS_MTI_SUBMIT:
+		/* skip TP-MR */
+		if ( ++ptr >= end )
+			return 0;
+		ptr = decode_addr(ptr, end, &sms->s_addr_type,
+					sms->s_addr, sizeof(sms->s_addr));
+		if ( NULL == ptr || end - ptr < 2 )
+			return 0;
+		sms->s_pid = ptr[0];
+		sms->s_dcs = ptr[1];
+		ptr += 2;
+		switch(sms->s_mti & SMS_TP_VPF) {
+		case SMS_VPF_NONE:
+			break;
+		case SMS_VPF_RELATIVE:
+			ptr += 1;
+			break;
+		default:
+			ptr += 7;
+			break;
+		}
+		if ( ptr > end )
+			return 0;
+		break;
+	default:
+		return 0;
+	}
+
+	return decode_ud(sms, ptr, end);
+}
+
+static const char *number_type(uint8_t type)
 {
 	switch(type & GSM_NUMBER_TYPE_MASK) {
 	case GSM_NUMBER_UNKNOWN:
@@ -60,7 +448,8 @@ const char *number_type(uint8_t type)
 		return "reserved";
 	}
 }
-const char *number_plan(uint8_t type)
+
+static const char *number_plan(uint8_t type)
 {
 	switch(type & GSM_PLAN_MASK) {
 	case GSM_PLAN_UNKNOWN:
@@ -82,130 +471,64 @@ const char *number_plan(uint8_t type)
 	}
 }
 
-const char *fmt_number(uint8_t type, uint8_t len, const uint8_t *ptr)
+static const char *status_str(uint8_t status)
 {
-	static char buf[768];
-	char *o = buf;
-	uint8_t i;
-
-	if ( GSM_NUMBER_INTL == (type & GSM_NUMBER_TYPE_MASK) )
-		*o = '+', o++;
-	
-	for(i = 0; i < len; i++, ptr++) {
-		if ( *ptr == 0xff )
-			continue;
-		switch(lo_nibble(*ptr)) {
-		case 0 ... 9:
-			o += sprintf(o, "%1x", lo_nibble(*ptr));
-			break;
-		case 0xa:
-			*o = '*', o++;
-			break;
-		case 0xb:
-			*o = '#', o++;
-			break;
-		default:
-			break;
-		}
-		if ( hi_nibble(*ptr) != 0xf )
-			o += sprintf(o, "%1x", hi_nibble(*ptr));
-		if ( 0 == i || 1 == ((i - 1) % 2) )
-			*o = ' ', o++;
-	}
-	*o = '\0';
-	return buf;
-}
-
-void _sms_decode(struct _sms *sms, const uint8_t *ptr)
-{
-	const uint8_t *end = ptr + 176;
-
-	memset(sms, 0, sizeof(*sms));
-
-	sms->status = *ptr, ptr++;
-
-	switch( sms->status & 0x7 ) {
-	case SIM_SMS_STATUS_FREE:
-		/* free block */
-		return;
+	switch(status) {
 	case SIM_SMS_STATUS_READ:
-		printf("sms: Status: READ\n");
-		break;
+		return "READ";
 	case SIM_SMS_STATUS_UNREAD:
-		printf("sms: Status: UNREAD\n");
-		break;
+		return "UNREAD";
 	case SIM_SMS_STATUS_SENT:
-		printf("sms: Status: SENT\n");
-		break;
+		return "SENT";
 	case SIM_SMS_STATUS_UNSENT:
-		printf("sms: Status: UNSENT\n");
-		break;
+		return "UNSENT";
 	default:
-		printf("sms: Status: unknown status 0x%.1x\n",
-			sms->status & 0x7);
-		return;
+		return "unknown";
 	}
+}
 
-	sms->smsc_len = ptr[0] - 1;
-	sms->smsc_type = ptr[1];
-	ptr += 2;
-	sms->smsc = ptr;
-	ptr += sms->smsc_len;
+void _sms_print(const struct sim_sms *sms)
+{
+	int deliver = ((sms->s_mti & SMS_TP_MTI) == SMS_MTI_DELIVER);
+
+	printf("sms: Status: %s\n", status_str(sms->s_status));
 	printf(" SMSC: type %s/%s\n",
-		number_type(sms->smsc_type),
-		number_plan(sms->smsc_type));
-	printf(" SMSC: %s\n",
-		fmt_number(sms->smsc_type, sms->smsc_len, sms->smsc));
-
-	sms->sms_deliver = *ptr, ptr++;
-	if ( (sms->sms_deliver & SMS_TP_MTI) ) {
-		printf(" Not an SMS-DELIVER 0x%.2x\n", sms->sms_deliver);
-		return;
-	}
-	printf(" SMS-DELIVER");
-	if ( 0 == (sms->sms_deliver & SMS_TP_MMS) )
+		number_type(sms->s_smsc_type),
+		number_plan(sms->s_smsc_type));
+	printf(" SMSC: %s\n", sms->s_smsc);
+
+	printf(" %s", deliver ? "SMS-DELIVER" : "SMS-SUBMIT");
+	if ( deliver && 0 == (sms->s_mti & SMS_TP_MMS) )
 		printf(" MMS");
-	if ( sms->sms_deliver & SMS_TP_SRI )
+	if ( sms->s_mti & SMS_TP_SRI )
 		printf(" SRI");
-	if ( sms->sms_deliver & SMS_TP_UDHI )
+	if ( sms->s_udhi )
 		printf(" UDHI");
-	if ( sms->sms_deliver & SMS_TP_RP )
+	if ( sms->s_mti & SMS_TP_RP )
 		printf(" RP");
 	printf("\n");
 
-	sms->sender_len = (ptr[0] + 1) >> 1;
-	sms->sender_type = ptr[1];
-	ptr += 2;
-	sms->sender = ptr;
-	ptr += sms->sender_len;
-	printf(" Sender: type %s/%s\n",
-		number_type(sms->sender_type),
-		number_plan(sms->sender_type));
-	printf(" Sender: %s\n",
-		fmt_number(sms->sender_type, sms->sender_len, sms->sender));
-
-	sms->tp_pid = ptr[0];
-	sms->tp_dcs = ptr[1];
-	ptr += 2;
-	printf(" TP-PID = 0x%.2x, TP-DCS = 0x%.2x\n", sms->tp_pid, sms->tp_dcs);
-
-	memcpy(sms->timestamp, ptr, 7), ptr += 7;
-	printf(" Timestamp: 20%1x%1x-%1x%1x-%1x%1x %1x%1x:%1x%1x:%1x%1x\n",
-		lo_nibble(sms->timestamp[0]),
-		hi_nibble(sms->timestamp[0]),
-		lo_nibble(sms->timestamp[1]),
-		hi_nibble(sms->timestamp[1]),
-		lo_nibble(sms->timestamp[2]),
-		hi_nibble(sms->timestamp[2]),
-		lo_nibble(sms->timestamp[3]),
-		hi_nibble(sms->timestamp[3]),
-		lo_nibble(sms->timestamp[4]),
-		hi_nibble(sms->timestamp[4]),
-		lo_nibble(sms->timestamp[5]),
-		hi_nibble(sms->timestamp[5]));
-
-	sms->uda = ptr[0], ptr++;
-	sms->data = ptr;
-	decode_7bit(sms->data, sms->uda);
+	printf(" %s: type %s/%s\n", deliver ? "Sender" : "Recipient",
+		number_type(sms->s_addr_type),
+		number_plan(sms->s_addr_type));
+	printf(" %s: %s\n", deliver ? "Sender" : "Recipient", sms->s_addr);
+
+	printf(" TP-PID = 0x%.2x, TP-DCS = 0x%.2x\n", sms->s_pid, sms->s_dcs);
+	if ( deliver )
+		printf(" Timestamp: %.4u-%.2u-%.2u %.2u:%.2u:%.2u "
+			"%c%.2u:%.2u\n",
+			sms->s_year, sms->s_mon, sms->s_day,
+			sms->s_hour, sms->s_min, sms->s_sec,
+			(sms->s_tz < 0) ? '-' : '+',
+			abs(sms->s_tz) / 4, (abs(sms->s_tz) % 4) * 15);
+	if ( sms->s_concat_total )
+		printf(" Part %u of %u, reference 0x%.4x\n",
+			sms->s_concat_seq, sms->s_concat_total,
+			sms->s_concat_ref);
+
+	if ( sms->s_text_len )
+		printf(" \"%s\"\n", sms->s_text);
+	else
+		hex_dump(sms->s_ud, sms->s_ud_len, 16);
 	printf("\n");
 }
@@ -0,0 +1,156 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2008 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Binary trace backend. Raw CCID messages are appended to a ring in a shared
+ * file mapping, space is reserved with an atomic add so any thread may log
+ * without taking a lock. Use ccid-trace to turn the file back in to text.
+*/
+
+#include <ccid.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "ccid-internal.h"
+#include "trace.h"
+
+struct _trace {
+	struct _trace_hdr	*b_hdr;
+	uint8_t			*b_ring;
+	size_t			b_maplen;
+};
+
+struct _trace *_trace_open(const char *fn)
+{
+	struct _trace *bt;
+	size_t len;
+	void *map;
+	int fd;
+
+	len = sizeof(*bt->b_hdr) + TRACE_RING_SIZE;
+
+	fd = open(fn, O_RDWR|O_CREAT|O_TRUNC, 0644);
+	if ( fd < 0 ) {
+		fprintf(stderr, "*** error: open: %s: %s\n",
+			fn, strerror(errno));
+		return NULL;
+	}
+
+	if ( ftruncate(fd, len) ) {
+		fprintf(stderr, "*** error: ftruncate: %s\n", strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if ( map == MAP_FAILED ) {
+		fprintf(stderr, "*** error: mmap: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	bt = calloc(1, sizeof(*bt));
+	if ( NULL == bt ) {
+		munmap(map, len);
+		return NULL;
+	}
+
+	bt->b_hdr = map;
+	bt->b_ring = (uint8_t *)(bt->b_hdr + 1);
+	bt->b_maplen = len;
+
+	bt->b_hdr->t_version = TRACE_VERSION;
+	bt->b_hdr->t_hdrlen = sizeof(*bt->b_hdr);
+	bt->b_hdr->t_size = TRACE_RING_SIZE;
+	bt->b_hdr->t_head = 0;
+	__sync_synchronize();
+	bt->b_hdr->t_magic = TRACE_MAGIC;
+
+	return bt;
+}
+
+void _trace_close(struct _trace *bt)
+{
+	if ( NULL == bt )
+		return;
+	msync(bt->b_hdr, bt->b_maplen, MS_ASYNC);
+	munmap(bt->b_hdr, bt->b_maplen);
+	free(bt);
+}
+
+static void ring_write(struct _trace *bt, uint64_t off,
+			const void *buf, size_t len)
+{
+	size_t pos = off % TRACE_RING_SIZE;
+	size_t chunk = TRACE_RING_SIZE - pos;
+
+	if ( chunk > len )
+		chunk = len;
+	memcpy(bt->b_ring + pos, buf, chunk);
+	memcpy(bt->b_ring, (const uint8_t *)buf + chunk, len - chunk);
+}
+
+static void trace_rec(struct _trace *bt, unsigned int dir,
+			const struct ccid_msg *msg,
+			const void *buf, size_t len)
+{
+	struct _trace_rec rec;
+	struct timespec ts;
+	uint64_t off;
+	size_t reclen;
+
+	/* anything bigger would overwrite itself */
+	if ( sizeof(rec) + len > TRACE_RING_SIZE / 2 )
+		len = TRACE_RING_SIZE / 2 - sizeof(rec);
+
+	reclen = TRACE_ALIGN(sizeof(rec) + len);
+	off = __sync_fetch_and_add(&bt->b_hdr->t_head, reclen);
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	memset(&rec, 0, sizeof(rec));
+	rec.r_len = len;
+	rec.r_ts = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	rec.r_dir = dir;
+	if ( msg && len >= sizeof(*msg) ) {
+		rec.r_slot = msg->bSlot;
+		rec.r_seq = msg->bSeq;
+		rec.r_type = msg->bMessageType;
+	}else if ( dir == TRACE_INTR && len ) {
+		rec.r_type = *(const uint8_t *)buf;
+	}
+
+	ring_write(bt, off, &rec, sizeof(rec));
+	ring_write(bt, off + sizeof(rec), buf, len);
+	__sync_synchronize();
+	rec.r_magic = TRACE_REC_MAGIC;
+	ring_write(bt, off, &rec.r_magic, sizeof(rec.r_magic));
+}
+
+void _trace_msg(struct _ccid *ccid, unsigned int dir,
+		const void *buf, size_t len)
+{
+	if ( NULL == ccid->d_bt )
+		return;
+	trace_rec(ccid->d_bt, dir,
+		(dir == TRACE_XMIT || dir == TRACE_RECV) ? buf : NULL,
+		buf, len);
+}
+
+void _trace_log(struct _ccid *ccid, const char *fmt, va_list va)
+{
+	char buf[512];
+	int len;
+
+	len = vsnprintf(buf, sizeof(buf), fmt, va);
+	if ( len < 0 )
+		return;
+	if ( (size_t)len >= sizeof(buf) )
+		len = sizeof(buf) - 1;
+	trace_rec(ccid->d_bt, TRACE_LOG, NULL, buf, len);
+}
@@ -0,0 +1,117 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2008 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * On-disk layout of binary trace files, shared between the library and the
+ * ccid-trace decoder. All fields are in host byte order.
+*/
+#ifndef _CCID_TRACE_H
+#define _CCID_TRACE_H
+
+#define TRACE_MAGIC		0x43434964U /* "dICC" */
+#define TRACE_REC_MAGIC		0x74726563U /* "cert" */
+#define TRACE_VERSION		1
+#define TRACE_RING_SIZE		(4U << 20)
+
+/* record types, r_dir */
+#define TRACE_XMIT		0
+#define TRACE_RECV		1
+#define TRACE_INTR		2
+#define TRACE_LOG		3
+#define TRACE_DESC		4 /* raw USB config descriptor */
+
+struct _trace_hdr {
+	uint32_t	t_magic;
+	uint16_t	t_version;
+	uint16_t	t_hdrlen;
+	uint32_t	t_size;
+	uint32_t	t_pad;
+	/* total bytes ever reserved, the ring offset is t_head % t_size */
+	uint64_t	t_head;
+};
+
+/* Each record is padded to a multiple of 8 bytes and may wrap around the end
+ * of the ring. r_magic is written last so that records which were not
+ * completed can be detected and skipped.
+ */
+struct _trace_rec {
+	uint32_t	r_magic;
+	uint32_t	r_len;
+	uint64_t	r_ts; /* nanoseconds since the epoch */
+	uint8_t		r_dir;
+	uint8_t		r_slot;
+	uint8_t		r_seq;
+	uint8_t		r_type;
+	uint32_t	r_pad;
+};
+
+#define TRACE_ALIGN(x)		(((x) + 7) & ~7ULL)
+
+/* Reading back a mapped trace file */
+struct _trace_ring {
+	const uint8_t	*ring;
+	uint64_t	size;
+	uint64_t	head;
+};
+
+static inline void _trace_ring_read(const struct _trace_ring *r, uint64_t off,
+					void *buf, size_t len)
+{
+	size_t pos = off % r->size;
+	size_t chunk = r->size - pos;
+
+	if ( chunk > len )
+		chunk = len;
+	memcpy(buf, r->ring + pos, chunk);
+	memcpy((uint8_t *)buf + chunk, r->ring, len - chunk);
+}
+
+/* Check that a chain of records starting at off ends exactly at the head */
+static inline int _trace_valid_chain(const struct _trace_ring *r, uint64_t off)
+{
+	struct _trace_rec rec;
+
+	while ( off + sizeof(rec) <= r->head ) {
+		_trace_ring_read(r, off, &rec, sizeof(rec));
+		if ( rec.r_magic != TRACE_REC_MAGIC && rec.r_magic )
+			return 0;
+		if ( sizeof(rec) + rec.r_len > r->size / 2 )
+			return 0;
+		off += TRACE_ALIGN(sizeof(rec) + rec.r_len);
+	}
+
+	return off == r->head;
+}
+
+/* Validate the file header and return the offset of the oldest record, once
+ * the ring has wrapped it was partly overwritten so search forward for the
+ * first one which leads to the head. Returns -1 for bad files.
+ */
+static inline int64_t _trace_ring_open(struct _trace_ring *r,
+					const uint8_t *map, size_t maplen)
+{
+	const struct _trace_hdr *hdr = (const struct _trace_hdr *)map;
+	uint64_t off;
+
+	if ( maplen < sizeof(*hdr) || hdr->t_magic != TRACE_MAGIC )
+		return -1;
+
+	if ( hdr->t_version != TRACE_VERSION ||
+			hdr->t_size > TRACE_RING_SIZE ||
+			hdr->t_size % 8 ||
+			hdr->t_hdrlen + (size_t)hdr->t_size > maplen )
+		return -1;
+
+	r->ring = map + hdr->t_hdrlen;
+	r->size = hdr->t_size;
+	r->head = hdr->t_head;
+
+	off = (r->head > r->size) ? r->head - r->size : 0;
+	while ( off < r->head && !_trace_valid_chain(r, off) )
+		off += 8;
+
+	return off;
+}
+
+#endif /* _CCID_TRACE_H */
@@ -6,42 +6,93 @@
 #include <ccid.h>
 #include "ccid-internal.h"
 
-#include <ctype.h>
+/* Two characters per byte value, so that lines are built without printf */
+static const char hex_tab[] =
+	"000102030405060708090a0b0c0d0e0f"
+	"101112131415161718191a1b1c1d1e1f"
+	"202122232425262728292a2b2c2d2e2f"
+	"303132333435363738393a3b3c3d3e3f"
+	"404142434445464748494a4b4c4d4e4f"
+	"505152535455565758595a5b5c5d5e5f"
+	"606162636465666768696a6b6c6d6e6f"
+	"707172737475767778797a7b7c7d7e7f"
+	"808182838485868788898a8b8c8d8e8f"
+	"909192939495969798999a9b9c9d9e9f"
+	"a0a1a2a3a4a5a6a7a8a9aaabacadaeaf"
+	"b0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+	"c0c1c2c3c4c5c6c7c8c9cacbcccdcecf"
+	"d0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+	"e0e1e2e3e4e5e6e7e8e9eaebecedeeef"
+	"f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
 
-void _hex_dumpf(FILE *f, const uint8_t *tmp, size_t len, size_t llen)
+#define HEX_MAX_LINE	64
+#define HEX_MAX_PFX	32
+
+static void hex_dump_pfx(FILE *f, const char *pfx, size_t pfx_len,
+			const uint8_t *tmp, size_t len, size_t llen)
 {
-	size_t i, j;
-	size_t line;
+	char buf[HEX_MAX_PFX + 8 + HEX_MAX_LINE * 4 + 1];
+	size_t i, j, line;
+	char *ptr;
 
 	if ( NULL == f || 0 == len )
 		return;
+	if ( 0 == llen || llen > HEX_MAX_LINE )
+		llen = HEX_MAX_LINE;
+	if ( pfx_len > HEX_MAX_PFX )
+		pfx_len = HEX_MAX_PFX;
 
 	for(j = 0; j < len; j += line, tmp += line) {
-		if ( j + llen > len ) {
-			line = len - j;
-		}else{
-			line = llen;
-		}
+		line = (j + llen > len) ? len - j : llen;
+
+		memcpy(buf, pfx, pfx_len);
+		ptr = buf + pfx_len;
 
-		fprintf(f, " | %05zx : ", j);
+		/* 5 hex digits of offset, as for %05zx */
+		*ptr++ = hex_tab[((j >> 16) & 0xf) * 2 + 1];
+		memcpy(ptr, hex_tab + ((j >> 8) & 0xff) * 2, 2);
+		memcpy(ptr + 2, hex_tab + (j & 0xff) * 2, 2);
+		memcpy(ptr + 4, " : ", 3);
+		ptr += 7;
 
 		for(i = 0; i < line; i++) {
-			if ( isprint(tmp[i]) ) {
-				fprintf(f, "%c", tmp[i]);
-			}else{
-				fprintf(f, ".");
-			}
+			if ( tmp[i] >= 0x20 && tmp[i] < 0x7f )
+				*ptr++ = tmp[i];
+			else
+				*ptr++ = '.';
 		}
-
 		for(; i < llen; i++)
-			fprintf(f, " ");
+			*ptr++ = ' ';
 
-		for(i = 0; i < line; i++)
-			fprintf(f, " %02x", tmp[i]);
+		for(i = 0; i < line; i++) {
+			*ptr++ = ' ';
+			memcpy(ptr, hex_tab + tmp[i] * 2, 2);
+			ptr += 2;
+		}
 
-		fprintf(f, "\n");
+		*ptr++ = '\n';
+		fwrite(buf, 1, ptr - buf, f);
 	}
-	fprintf(f, "\n");
+	fputc('\n', f);
+}
+
+void _hex_dumpf(FILE *f, const uint8_t *tmp, size_t len, size_t llen)
+{
+	hex_dump_pfx(f, " | ", 3, tmp, len, llen);
+}
+
+/* As for ber_dump(), lines are indented by depth with a minimum of one */
+void hex_dumpf_indent(FILE *f, const uint8_t *tmp, size_t len,
+			size_t llen, unsigned int depth)
+{
+	char pfx[HEX_MAX_PFX];
+
+	if ( depth < 1 )
+		depth = 1;
+	if ( depth > sizeof(pfx) )
+		depth = sizeof(pfx);
+	memset(pfx, ' ', depth);
+	hex_dump_pfx(f, pfx, depth, tmp, len, llen);
 }
 
 void hex_dumpf(FILE *f, const uint8_t *ptr, size_t len, size_t llen)
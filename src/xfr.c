@@ -27,7 +27,7 @@ struct _xfr *_xfr_do_alloc(size_t txbuf, size_t rxbuf)
 	ptr += sizeof(*xfr);
 
 	xfr->x_txmax = txbuf;
-	xfr->x_rxmax = txbuf;
+	xfr->x_rxmax = rxbuf;
 
 	xfr->x_txhdr = (struct ccid_msg *)ptr;
 	ptr += sizeof(*xfr->x_txhdr);
@@ -40,7 +40,27 @@ struct _xfr *_xfr_do_alloc(size_t txbuf, size_t rxbuf)
 
 	xfr->x_rxbuf = ptr;
 
+	xfr->x_own_txmax = xfr->x_txmax;
+	xfr->x_own_rxmax = xfr->x_rxmax;
+	xfr->x_own_txhdr = xfr->x_txhdr;
+	xfr->x_own_rxhdr = (struct ccid_msg *)xfr->x_rxhdr;
+
+	xfr->x_out = libusb_alloc_transfer(0);
+	if ( NULL == xfr->x_out )
+		goto err;
+
+	xfr->x_in = libusb_alloc_transfer(0);
+	if ( NULL == xfr->x_in )
+		goto err_free_out;
+
+	INIT_LIST_HEAD(&xfr->x_list);
 	return xfr;
+
+err_free_out:
+	libusb_free_transfer(xfr->x_out);
+err:
+	free(xfr);
+	return NULL;
 }
 
 /** Allocate a transaction buffer.
@@ -59,10 +79,17 @@ xfr_t xfr_alloc(size_t txbuf, size_t rxbuf)
  * \ingroup g_xfr
  * @param xfr \ref xfr_t representing the transaction buffer.
  *
- * Empty the buffer of any send or receive data.
+ * Empty the buffer of any send or receive data. Any caller provided buffers
+ * are detached.
 */
 void xfr_reset(xfr_t xfr)
 {
+	xfr->x_txhdr = xfr->x_own_txhdr;
+	xfr->x_txbuf = (uint8_t *)(xfr->x_txhdr + 1);
+	xfr->x_txmax = xfr->x_own_txmax;
+	xfr->x_rxhdr = xfr->x_own_rxhdr;
+	xfr->x_rxbuf = (uint8_t *)(xfr->x_own_rxhdr + 1);
+	xfr->x_rxmax = xfr->x_own_rxmax;
 	xfr->x_txlen = xfr->x_rxlen = 0;
 }
 
@@ -105,6 +132,161 @@ int xfr_tx_buf(xfr_t xfr, const uint8_t *ptr, size_t len)
 	return 1;
 }
 
+/** Append a list of buffers to the transmit buffer.
+ * \ingroup g_xfr
+ * @param xfr \ref xfr_t representing the transaction buffer.
+ * @param iov Array of buffers to transmit, in order.
+ * @param iovcnt Number of elements in iov.
+ *
+ * Equivalent to calling \ref xfr_tx_buf for each element but with only one
+ * capacity check, so that eg. an APDU header and its data may be sent without
+ * first being assembled in to a temporary buffer.
+ *
+ * @return zero on error.
+*/
+int xfr_tx_iov(xfr_t xfr, const struct iovec *iov, unsigned int iovcnt)
+{
+	size_t len;
+	uint8_t *ptr;
+	unsigned int i;
+
+	for(len = i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	if ( xfr->x_txlen + len > xfr->x_txmax )
+		return 0;
+
+	for(ptr = xfr->x_txbuf + xfr->x_txlen, i = 0; i < iovcnt; i++) {
+		memcpy(ptr, iov[i].iov_base, iov[i].iov_len);
+		ptr += iov[i].iov_len;
+	}
+
+	xfr->x_txlen += len;
+	return 1;
+}
+
+/** Reserve space in the transmit buffer.
+ * \ingroup g_xfr
+ * @param xfr \ref xfr_t representing the transaction buffer.
+ * @param len Number of bytes to reserve.
+ *
+ * Returns a pointer in to the transmit buffer so that the caller can build
+ * len bytes of payload in place.
+ *
+ * @return NULL on error, pointer to reserved bytes otherwise.
+*/
+uint8_t *xfr_tx_reserve(xfr_t xfr, size_t len)
+{
+	uint8_t *ret;
+
+	if ( xfr->x_txlen + len > xfr->x_txmax )
+		return NULL;
+
+	ret = xfr->x_txbuf + xfr->x_txlen;
+	xfr->x_txlen += len;
+	return ret;
+}
+
+/** Get the free space at the end of the transmit buffer.
+ * \ingroup g_xfr
+ * @param xfr \ref xfr_t representing the transaction buffer.
+ * @param len Returns the number of bytes free.
+ *
+ * For building a command in place without a capacity check per byte, the
+ * caller may write up to len bytes at the returned pointer and then append
+ * them with \ref xfr_tx_commit.
+ *
+ * @return pointer to the first free byte.
+*/
+uint8_t *xfr_tx_space(xfr_t xfr, size_t *len)
+{
+	*len = xfr->x_txmax - xfr->x_txlen;
+	return xfr->x_txbuf + xfr->x_txlen;
+}
+
+/** Append bytes written in to the free space.
+ * \ingroup g_xfr
+ * @param xfr \ref xfr_t representing the transaction buffer.
+ * @param len Number of bytes written at the pointer from \ref xfr_tx_space.
+ *
+ * @return zero on error.
+*/
+int xfr_tx_commit(xfr_t xfr, size_t len)
+{
+	if ( xfr->x_txlen + len > xfr->x_txmax )
+		return 0;
+
+	xfr->x_txlen += len;
+	return 1;
+}
+
+/** Transmit directly from a caller provided buffer.
+ * \ingroup g_xfr
+ * @param xfr \ref xfr_t representing the transaction buffer.
+ * @param buf Buffer containing the payload to transmit.
+ * @param len Number of bytes in the payload.
+ *
+ * The XFR_HEADROOM bytes immediately preceding buf must be writable, the
+ * CCID message header is constructed there so that the payload is sent
+ * without being copied. The buffer must remain valid until the transaction
+ * has completed. Detached by \ref xfr_reset.
+ *
+ * @return zero on error.
+*/
+int xfr_tx_attach(xfr_t xfr, uint8_t *buf, size_t len)
+{
+	if ( xfr->x_state != XFR_STATE_IDLE )
+		return 0;
+
+	xfr->x_txhdr = (struct ccid_msg *)(buf - XFR_HEADROOM);
+	xfr->x_txbuf = buf;
+	xfr->x_txmax = len;
+	xfr->x_txlen = len;
+	return 1;
+}
+
+/** Receive directly in to a caller provided buffer.
+ * \ingroup g_xfr
+ * @param xfr \ref xfr_t representing the transaction buffer.
+ * @param buf Buffer in to which to receive the response.
+ * @param len Size of the buffer.
+ *
+ * As for \ref xfr_tx_attach the XFR_HEADROOM bytes immediately preceding buf
+ * are used for the CCID message header and the buffer must remain valid until
+ * the transaction has completed. Response data, including status words, is
+ * placed at the start of buf. Detached by \ref xfr_reset.
+ *
+ * @return zero on error.
+*/
+int xfr_rx_attach(xfr_t xfr, uint8_t *buf, size_t len)
+{
+	if ( xfr->x_state != XFR_STATE_IDLE )
+		return 0;
+
+	xfr->x_rxhdr = (const struct ccid_msg *)(buf - XFR_HEADROOM);
+	xfr->x_rxbuf = buf;
+	xfr->x_rxmax = len;
+	xfr->x_rxlen = 0;
+	return 1;
+}
+
+/** Handle procedure bytes automatically.
+ * \ingroup g_xfr
+ * @param xfr \ref xfr_t representing the transaction buffer.
+ * @param enable Non-zero to enable.
+ *
+ * When enabled \ref cci_transact resolves 61xx (and GSM 9Fxx) status words by
+ * issuing GET RESPONSE, concatenating the response data, and 6Cxx by
+ * re-sending the command with the corrected Le. The caller only ever sees the
+ * final status word. Readers doing APDU level exchange resolve these
+ * themselves so no extra commands are sent. \ref cci_submit does not do
+ * this. Not changed by \ref xfr_reset.
+*/
+void xfr_auto_response(xfr_t xfr, int enable)
+{
+	xfr->x_auto = !!enable;
+}
+
 /** Retrieve status word 1 from the receive buffer.
  * \ingroup g_xfr
  * @param xfr \ref xfr_t representing the transaction buffer.
@@ -154,6 +336,10 @@ const uint8_t *xfr_rx_data(xfr_t xfr, size_t *len)
 
 void _xfr_do_free(struct _xfr *xfr)
 {
+	if ( xfr ) {
+		libusb_free_transfer(xfr->x_in);
+		libusb_free_transfer(xfr->x_out);
+	}
 	free(xfr);
 }
 